@@ -0,0 +1,84 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _ADAPTIVEDEPTH_H
+#define _ADAPTIVEDEPTH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "arch.h"
+
+
+const int ADAPTIVE_DEPTH_BITS = 16;
+const u32 ADAPTIVE_DEPTH_SLOTS = 1 << ADAPTIVE_DEPTH_BITS;
+const u32 ADAPTIVE_DEPTH_UNLIMITED = 0xffff;
+
+// Per-thread stack depth limits. Every thread starts with a small limit, which doubles each time
+// a sample of the thread is truncated by it, until it reaches the maximum depth. Most threads
+// are walked cheaply, while the few deep ones soon get full stacks. Threads are mapped to slots
+// by their id; a rare collision only makes another thread walk deeper. Safe for signal handlers.
+class AdaptiveDepth {
+  private:
+    volatile unsigned short* _limits;  // 0 stands for the initial limit
+    int _initial;
+
+  public:
+    AdaptiveDepth() : _limits(NULL), _initial(0) {
+    }
+
+    ~AdaptiveDepth() {
+        free((void*)_limits);
+    }
+
+    // initial <= 0 turns adaptive depth off. Otherwise, limits of the previous session are forgotten.
+    bool init(int initial) {
+        _initial = 0;
+        if (initial <= 0) {
+            return true;
+        }
+
+        if (_limits == NULL) {
+            _limits = (volatile unsigned short*)calloc(ADAPTIVE_DEPTH_SLOTS, sizeof(unsigned short));
+            if (_limits == NULL) {
+                return false;
+            }
+        } else {
+            memset((void*)_limits, 0, ADAPTIVE_DEPTH_SLOTS * sizeof(unsigned short));
+        }
+        _initial = initial < (int)ADAPTIVE_DEPTH_UNLIMITED ? initial : ADAPTIVE_DEPTH_UNLIMITED - 1;
+        return true;
+    }
+
+    bool enabled() const {
+        return _initial > 0;
+    }
+
+    int limit(int tid, int max_depth) const {
+        if (_initial <= 0) {
+            return max_depth;
+        }
+        u32 depth = _limits[(u32)tid & (ADAPTIVE_DEPTH_SLOTS - 1)];
+        if (depth == ADAPTIVE_DEPTH_UNLIMITED) {
+            return max_depth;
+        } else if (depth == 0) {
+            depth = _initial;
+        }
+        return (int)depth < max_depth ? (int)depth : max_depth;
+    }
+
+    // Called after the walk limited by limit(): a full walk means the stack was likely truncated
+    void update(int tid, int limit, int num_frames, int max_depth) {
+        if (_initial <= 0 || num_frames < limit || limit >= max_depth) {
+            return;
+        }
+        u32 next = (u32)limit * 2;
+        if (next >= (u32)max_depth || next >= ADAPTIVE_DEPTH_UNLIMITED) {
+            next = ADAPTIVE_DEPTH_UNLIMITED;
+        }
+        _limits[(u32)tid & (ADAPTIVE_DEPTH_SLOTS - 1)] = (unsigned short)next;
+    }
+};
+
+#endif // _ADAPTIVEDEPTH_H
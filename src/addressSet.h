@@ -0,0 +1,125 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _ADDRESSSET_H
+#define _ADDRESSSET_H
+
+#include <stdint.h>
+#include <string.h>
+#include "arch.h"
+
+
+const uintptr_t ADDRESS_SET_REMOVED = (uintptr_t)-1;
+const u32 ADDRESS_SET_MAX_PROBES = 32;
+
+// Lock-free open addressing set of addresses. Removed entries leave a tombstone
+// that can be taken by a later insertion. Probe sequences are limited: when an address
+// does not fit, the set marks itself as overflowed; from this moment contains() answers
+// true for every address, so that the owner falls back to processing all of them.
+// The set never reports false negatives, which is what the malloc tracer relies on
+// to drop free() calls of addresses that were never sampled.
+class AddressSet {
+  private:
+    volatile uintptr_t* _slots;
+    u32 _mask;
+    volatile bool _overflow;
+    volatile bool _used;
+
+    u32 home(uintptr_t address) const {
+        return (u32)(((u64)address * 0x9e3779b97f4a7c15ULL) >> 32) & _mask;
+    }
+
+  public:
+    AddressSet() : _slots(NULL), _mask(0), _overflow(false), _used(false) {
+    }
+
+    // The memory must be zeroed; capacity is a power of 2
+    void init(void* memory, u32 capacity) {
+        _slots = (volatile uintptr_t*)memory;
+        _mask = capacity - 1;
+        _overflow = false;
+        _used = false;
+    }
+
+    bool initialized() const {
+        return _slots != NULL;
+    }
+
+    void reset() {
+        if (_used) {
+            memset((void*)_slots, 0, (size_t)(_mask + 1) * sizeof(uintptr_t));
+            _used = false;
+        }
+        _overflow = false;
+    }
+
+    bool overflow() const {
+        return _overflow;
+    }
+
+    u32 capacity() const {
+        return _mask + 1;
+    }
+
+    // Returns the address stored in the slot, or 0 if the slot is free
+    uintptr_t at(u32 slot) const {
+        uintptr_t value = _slots[slot];
+        return value == ADDRESS_SET_REMOVED ? 0 : value;
+    }
+
+    // Returns the slot taken by the address, or -1 if the set has overflowed
+    int insert(uintptr_t address) {
+        if (!_used) {
+            _used = true;
+        }
+
+        u32 slot = home(address);
+        for (u32 i = 0; i < ADDRESS_SET_MAX_PROBES; i++) {
+            uintptr_t value = _slots[slot];
+            if ((value == 0 || value == ADDRESS_SET_REMOVED) &&
+                __sync_bool_compare_and_swap(&_slots[slot], value, address)) {
+                return (int)slot;
+            }
+            slot = (slot + 1) & _mask;
+        }
+        _overflow = true;
+        return -1;
+    }
+
+    // Returns the slot of the address regardless of overflow, or -1 if it is not found
+    int find(uintptr_t address) const {
+        u32 slot = home(address);
+        for (u32 i = 0; i < ADDRESS_SET_MAX_PROBES; i++) {
+            uintptr_t value = _slots[slot];
+            if (value == address) {
+                return (int)slot;
+            } else if (value == 0) {
+                break;
+            }
+            slot = (slot + 1) & _mask;
+        }
+        return -1;
+    }
+
+    // Frees the slot previously returned by find(); false if someone else did it first
+    bool removeAt(int slot, uintptr_t address) {
+        return __sync_bool_compare_and_swap(&_slots[slot], address, ADDRESS_SET_REMOVED);
+    }
+
+    // Removes the address and returns true if it was in the set
+    bool remove(uintptr_t address) {
+        if (_overflow) {
+            return true;
+        }
+        int slot = find(address);
+        return (slot >= 0 && removeAt(slot, address)) || _overflow;
+    }
+
+    bool contains(uintptr_t address) const {
+        return _overflow || find(address) >= 0;
+    }
+};
+
+#endif // _ADDRESSSET_H
@@ -4,19 +4,33 @@
  */
 
 #include "allocTracer.h"
+#include "os.h"
 #include "profiler.h"
 #include "stackFrame.h"
 #include "tsc.h"
 #include "vmStructs.h"
 
 
+// Time for threads caught at the entry of an AllocTracer function to move past the patched bytes
+const u64 JUMP_GRACE_NANOS = 10000000;
+
 int AllocTracer::_trap_kind;
 Trap AllocTracer::_in_new_tlab(0);
 Trap AllocTracer::_outside_tlab(1);
+bool AllocTracer::_jumps = false;
+bool AllocTracer::_histo = false;
 
 u64 AllocTracer::_interval;
-volatile u64 AllocTracer::_allocated_bytes;
+EventCounter AllocTracer::_allocated_bytes;
+
 
+static u32 lookupKlassId(uintptr_t rklass) {
+    if (!VMStructs::hasClassNames()) {
+        return 0;
+    }
+    VMSymbol* symbol = VMKlass::fromHandle(rklass)->name();
+    return Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
+}
 
 // Called whenever our breakpoint trap is hit
 void AllocTracer::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
@@ -53,20 +67,41 @@ void AllocTracer::trapHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     }
 }
 
+void AllocTracer::inNewTlabHook(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3) {
+    uintptr_t total_size = _trap_kind == 1 ? arg2 : arg1;
+    uintptr_t instance_size = _trap_kind == 1 ? arg3 : arg2;
+    if (_enabled && updateCounter(_allocated_bytes, total_size, _interval)) {
+        recordAllocation(NULL, ALLOC_SAMPLE, arg0, total_size, instance_size);
+    }
+}
+
+void AllocTracer::outsideTlabHook(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2) {
+    uintptr_t total_size = _trap_kind == 1 ? arg2 : arg1;
+    if (_enabled && updateCounter(_allocated_bytes, total_size, _interval)) {
+        recordAllocation(NULL, ALLOC_OUTSIDE_TLAB, arg0, total_size, 0);
+    }
+}
+
 void AllocTracer::recordAllocation(void* ucontext, EventType event_type, uintptr_t rklass,
                                    uintptr_t total_size, uintptr_t instance_size) {
+    if (_histo) {
+        // No stack walk, hence no need to charge the overhead budget
+        Profiler::instance()->classHistogram()->add(lookupKlassId(rklass), total_size);
+        return;
+    }
+
+    u64 counter = total_size;
+    if (!Profiler::instance()->takeSample(counter)) {
+        return;
+    }
+
     AllocEvent event;
     event._start_time = TSC::ticks();
-    event._class_id = 0;
+    event._class_id = lookupKlassId(rklass);
     event._total_size = total_size;
     event._instance_size = instance_size;
 
-    if (VMStructs::hasClassNames()) {
-        VMSymbol* symbol = VMKlass::fromHandle(rklass)->name();
-        event._class_id = Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
-    }
-
-    Profiler::instance()->recordSample(ucontext, total_size, event_type, &event);
+    Profiler::instance()->recordSample(ucontext, counter, event_type, &event);
 }
 
 Error AllocTracer::check(Arguments& args) {
@@ -99,6 +134,10 @@ Error AllocTracer::check(Arguments& args) {
     _outside_tlab.assign(oe);
     _in_new_tlab.pair(_outside_tlab);
 
+    // Trap-free jumps need both functions to be patchable, otherwise both stay breakpoints
+    _jumps = _in_new_tlab.prepareJump((const void*)inNewTlabHook) &&
+             _outside_tlab.prepareJump((const void*)outsideTlabHook);
+
     return Error::OK;
 }
 
@@ -109,16 +148,34 @@ Error AllocTracer::start(Arguments& args) {
     }
 
     _interval = args._alloc > 0 ? args._alloc : 0;
-    _allocated_bytes = 0;
+    _histo = args._alloc_histo;
+    _allocated_bytes.reset(_interval, OS::nanotime());
 
     if (!_in_new_tlab.install() || !_outside_tlab.install()) {
         return Error("Cannot install allocation breakpoints");
     }
 
+    if (_jumps) {
+        // Breakpoints catch new calls, while threads that have just entered the functions leave them
+        OS::sleep(JUMP_GRACE_NANOS);
+        if (_in_new_tlab.patchJumpTail(true) && _outside_tlab.patchJumpTail(true)) {
+            _in_new_tlab.patchJumpHead();
+            _outside_tlab.patchJumpHead();
+        }
+    }
+
     return Error::OK;
 }
 
 void AllocTracer::stop() {
+    if (_jumps) {
+        // Breakpoints over the jump opcodes first, then the original bytes behind them
+        _in_new_tlab.install();
+        _outside_tlab.install();
+        OS::sleep(JUMP_GRACE_NANOS);
+        _in_new_tlab.patchJumpTail(false);
+        _outside_tlab.patchJumpTail(false);
+    }
     _in_new_tlab.uninstall();
     _outside_tlab.uninstall();
 }
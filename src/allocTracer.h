@@ -19,12 +19,19 @@ class AllocTracer : public Engine {
     static Trap _in_new_tlab;
     static Trap _outside_tlab;
 
+    static bool _jumps;
+    static bool _histo;
+
     static u64 _interval;
-    static volatile u64 _allocated_bytes;
+    static EventCounter _allocated_bytes;
 
     static void recordAllocation(void* ucontext, EventType event_type, uintptr_t rklass,
                                  uintptr_t total_size, uintptr_t instance_size);
 
+    // Targets of the jumps patched over AllocTracer functions: same arguments, no signal
+    static void inNewTlabHook(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
+    static void outsideTlabHook(uintptr_t arg0, uintptr_t arg1, uintptr_t arg2);
+
   public:
     const char* type() {
         return "alloc_tracer";
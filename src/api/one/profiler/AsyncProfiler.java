@@ -9,6 +9,7 @@ import java.io.File;
 import java.io.FileOutputStream;
 import java.io.IOException;
 import java.io.InputStream;
+import java.io.OutputStream;
 
 /**
  * Java API for in-process profiling. Serves as a wrapper around
@@ -17,6 +18,16 @@ import java.io.InputStream;
  * libasyncProfiler.so.
  */
 public class AsyncProfiler implements AsyncProfilerMXBean {
+    // Native counters, in the order of ProfilerMetric in profiler.h
+    private static final int METRIC_SKIPPED_TICKS = 1;
+    private static final int METRIC_FAILED_SAMPLES = 2;
+    private static final int METRIC_CALL_TRACE_STORAGE = 3;
+    private static final int METRIC_USED_MEMORY = 4;
+    private static final int METRIC_NATIVE_UNWIND_NANOS = 5;
+    private static final int METRIC_JAVA_UNWIND_NANOS = 6;
+    private static final int METRIC_STORAGE_NANOS = 7;
+    private static final int METRIC_JFR_NANOS = 8;
+
     private static AsyncProfiler instance;
 
     private AsyncProfiler() {
@@ -155,6 +166,92 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
     @Override
     public native long getSamples();
 
+    /**
+     * Get the number of samples dropped during the profiling session,
+     * because too many signals were being handled concurrently
+     *
+     * @return Number of skipped ticks
+     */
+    @Override
+    public long getSkippedTicks() {
+        return getMetric0(METRIC_SKIPPED_TICKS);
+    }
+
+    /**
+     * Get the number of samples whose stack trace could not be walked,
+     * the sum of the failure counters shown in the summary of a dump
+     *
+     * @return Number of failed samples
+     */
+    @Override
+    public long getFailedSamples() {
+        return getMetric0(METRIC_FAILED_SAMPLES);
+    }
+
+    /**
+     * Get the memory taken by the call trace storage
+     *
+     * @return Size in bytes
+     */
+    @Override
+    public long getCallTraceStorageBytes() {
+        return getMetric0(METRIC_CALL_TRACE_STORAGE);
+    }
+
+    /**
+     * Get the memory used by the profiler, the total shown by 'meminfo'
+     *
+     * @return Size in bytes
+     */
+    @Override
+    public long getUsedMemoryBytes() {
+        return getMetric0(METRIC_USED_MEMORY);
+    }
+
+    /**
+     * Get the total time spent unwinding native stacks of samples.
+     * Overhead counters are updated only with 'features=stats'.
+     *
+     * @return Time in nanoseconds
+     */
+    @Override
+    public long getNativeUnwindNanos() {
+        return getMetric0(METRIC_NATIVE_UNWIND_NANOS);
+    }
+
+    /**
+     * Get the total time spent walking Java stacks of samples.
+     * Overhead counters are updated only with 'features=stats'.
+     *
+     * @return Time in nanoseconds
+     */
+    @Override
+    public long getJavaUnwindNanos() {
+        return getMetric0(METRIC_JAVA_UNWIND_NANOS);
+    }
+
+    /**
+     * Get the total time spent storing stack traces of samples.
+     * Overhead counters are updated only with 'features=stats'.
+     *
+     * @return Time in nanoseconds
+     */
+    @Override
+    public long getStorageNanos() {
+        return getMetric0(METRIC_STORAGE_NANOS);
+    }
+
+    /**
+     * Get the total time spent writing samples to the JFR recording.
+     * Overhead counters are updated only with 'features=stats'.
+     *
+     * @return Time in nanoseconds
+     */
+    @Override
+    public long getJfrNanos() {
+        return getMetric0(METRIC_JFR_NANOS);
+    }
+
     /**
      * Get profiler agent version, e.g. "1.0"
      *
@@ -231,6 +328,58 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
         }
     }
 
+    /**
+     * Execute an agent-compatible profiling command and write the result to the stream.
+     * Unlike {@link #execute(String)}, the output is passed to the stream in chunks
+     * as the native code produces it, without building a String on the Java heap.
+     * The stream is called while the profiler state is locked, so it must not call the profiler.
+     * If the command specifies an output file, nothing is written to the stream.
+     *
+     * @param command Profiling command
+     * @param out     Stream to write the command result to
+     * @throws IllegalArgumentException If failed to parse the command
+     * @throws IOException              If failed to create output file or the stream failed
+     */
+    public void execute(String command, OutputStream out) throws IllegalArgumentException, IllegalStateException, IOException {
+        if (command == null || out == null) {
+            throw new NullPointerException();
+        }
+        execute1(command, out);
+    }
+
+    /**
+     * Dump profile in 'collapsed stacktraces' format to the stream
+     *
+     * @param counter Which counter to display in the output
+     * @param out     Stream to write the profile to
+     * @throws IOException If the stream failed
+     */
+    public void dumpCollapsed(Counter counter, OutputStream out) throws IOException {
+        execute("collapsed," + counter.name().toLowerCase(), out);
+    }
+
+    /**
+     * Dump collected stack traces to the stream
+     *
+     * @param maxTraces Maximum number of stack traces to dump. 0 means no limit
+     * @param out       Stream to write the profile to
+     * @throws IOException If the stream failed
+     */
+    public void dumpTraces(int maxTraces, OutputStream out) throws IOException {
+        execute(maxTraces == 0 ? "traces" : "traces=" + maxTraces, out);
+    }
+
+    /**
+     * Dump flat profile, i.e. the histogram of the hottest methods, to the stream
+     *
+     * @param maxMethods Maximum number of methods to dump. 0 means no limit
+     * @param out        Stream to write the profile to
+     * @throws IOException If the stream failed
+     */
+    public void dumpFlat(int maxMethods, OutputStream out) throws IOException {
+        execute(maxMethods == 0 ? "flat" : "flat=" + maxMethods, out);
+    }
+
     /**
      * Add the given thread to the set of profiled threads.
      * 'filter' option must be enabled to use this method.
@@ -251,6 +400,42 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
         filterThread(thread, false);
     }
 
+    /**
+     * Change how often the current thread is sampled by CPU, wall clock
+     * and perf event profiling. The setting stays with the thread
+     * until changed and does not require 'filter' option.
+     *
+     * @param priority 0 to sample normally; -N to record only one of every 2^N samples;
+     *                 Integer.MIN_VALUE to exclude the thread from sampling altogether
+     */
+    public void setSamplingPriority(int priority) {
+        setSamplingPriority0(priority);
+    }
+
+    /**
+     * Tag subsequent CPU, wall clock and perf event samples of the current thread
+     * with the given tracing context, e.g. the current OpenTelemetry span.
+     * The context is recorded in JFR output; use spanId = 0 to clear it.
+     *
+     * @param spanId     ID of the current span
+     * @param traceId    lower 64 bits of the trace ID
+     * @param contextTag an ID from {@link #registerContextTag(String)}, or 0
+     */
+    public void setTracingContext(long spanId, long traceId, int contextTag) {
+        setTracingContext0(spanId, traceId, contextTag);
+    }
+
+    /**
+     * Get a numeric ID for an attribute string to be used as a context tag.
+     * The same string always yields the same ID.
+     *
+     * @param tag Attribute, such as an endpoint name
+     * @return ID for {@link #setTracingContext(long, long, int)}
+     */
+    public int registerContextTag(String tag) {
+        return registerContextTag0(tag);
+    }
+
     private void filterThread(Thread thread, boolean enable) {
         if (thread == null || thread == Thread.currentThread()) {
             filterThread0(null, enable);
@@ -271,5 +456,15 @@ public class AsyncProfiler implements AsyncProfilerMXBean {
 
     private native String execute0(String command) throws IllegalArgumentException, IllegalStateException, IOException;
 
+    private native void execute1(String command, OutputStream out) throws IllegalArgumentException, IllegalStateException, IOException;
+
+    private native long getMetric0(int metric);
+
     private native void filterThread0(Thread thread, boolean enable);
+
+    private native void setSamplingPriority0(int priority);
+
+    private native void setTracingContext0(long spanId, long traceId, int contextTag);
+
+    private native int registerContextTag0(String tag);
 }
@@ -24,6 +24,16 @@ public interface AsyncProfilerMXBean {
     long getSamples();
     String getVersion();
 
+    long getSkippedTicks();
+    long getFailedSamples();
+    long getCallTraceStorageBytes();
+    long getUsedMemoryBytes();
+
+    long getNativeUnwindNanos();
+    long getJavaUnwindNanos();
+    long getStorageNanos();
+    long getJfrNanos();
+
     String execute(String command) throws IllegalArgumentException, IllegalStateException, java.io.IOException;
 
     String dumpCollapsed(Counter counter);
@@ -62,6 +62,11 @@ const int PROBE_SP_LIMIT = 4;
 const int PLT_HEADER_SIZE = 16;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 8;  // PERF_REG_X86_IP
+#ifdef __x86_64__
+const u64 PERF_REGS_GENERAL = 0xff007f;   // AX-BP, R8-R15
+#else
+const u64 PERF_REGS_GENERAL = 0x7f;       // AX-BP
+#endif
 
 #define spinPause()       asm volatile("pause")
 #define rmb()             asm volatile("lfence" : : : "memory")
@@ -83,6 +88,7 @@ const int PROBE_SP_LIMIT = 0;
 const int PLT_HEADER_SIZE = 20;
 const int PLT_ENTRY_SIZE = 12;
 const int PERF_REG_PC = 15;  // PERF_REG_ARM_PC
+const u64 PERF_REGS_GENERAL = 0x1fff;  // R0-R12
 
 #define spinPause()       asm volatile("yield")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -103,6 +109,7 @@ const int PROBE_SP_LIMIT = 0;
 const int PLT_HEADER_SIZE = 32;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 32;  // PERF_REG_ARM64_PC
+const u64 PERF_REGS_GENERAL = 0x1fffffff;  // X0-X28
 
 #define spinPause()       asm volatile("isb")
 #define rmb()             asm volatile("dmb ish" : : : "memory")
@@ -125,6 +132,7 @@ const int PROBE_SP_LIMIT = 0;
 const int PLT_HEADER_SIZE = 24;
 const int PLT_ENTRY_SIZE = 24;
 const int PERF_REG_PC = 32;  // PERF_REG_POWERPC_NIP
+const u64 PERF_REGS_GENERAL = 0xffffffff;  // R0-R31
 
 #define spinPause()       asm volatile("yield") // does nothing, but using or 1,1,1 would lead to other problems
 #define rmb()             asm volatile ("sync" : : : "memory") // lwsync would do but better safe than sorry
@@ -149,6 +157,7 @@ const int PROBE_SP_LIMIT = 0;
 const int PLT_HEADER_SIZE = 24; // Best guess from examining readelf
 const int PLT_ENTRY_SIZE = 24;  // ...same...
 const int PERF_REG_PC = 0;      // PERF_REG_RISCV_PC
+const u64 PERF_REGS_GENERAL = 0xffffffe2;  // RA, T0-T6, S0-S11, A0-A7
 
 #define spinPause()       // No architecture support
 #define rmb()             asm volatile ("fence" : : : "memory")
@@ -169,6 +178,7 @@ const int PROBE_SP_LIMIT = 0;
 const int PLT_HEADER_SIZE = 32;
 const int PLT_ENTRY_SIZE = 16;
 const int PERF_REG_PC = 0;      // PERF_REG_LOONGARCH_PC
+const u64 PERF_REGS_GENERAL = 0xfffffff2;  // R1, R4-R31
 
 #define spinPause()       asm volatile("ibar 0x0")
 #define rmb()             asm volatile("dbar 0x0" : : : "memory")
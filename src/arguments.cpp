@@ -54,17 +54,27 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     meminfo          - print profiler memory stats
 //     list             - show the list of available profiling events
 //     version          - display the agent version
+//     snapshot         - remember current counters as a baseline for diff
 //     event=EVENT      - which event to trace (cpu, wall, cache-misses, etc.)
 //     alloc[=BYTES]    - profile allocations with BYTES interval
 //     live             - build allocation profile from live objects only
+//     liverefs=N       - maximum number of live objects tracked (default: 65536)
+//     allochisto       - count allocated bytes per class without stack traces
 //     lock[=DURATION]  - profile contended locks overflowing the DURATION ns bucket (default: 10us)
+//     parkthreshold=NS - ignore Unsafe.park calls shorter than NS when profiling locks
+//     latency[=NS]     - collect latency histograms of instrumented methods; record stacks of calls over NS
 //     wall[=NS]        - run wall clock profiling together with CPU profiling
 //     nobatch          - legacy wall clock sampling without batch events
+//     pauseframes      - record [gc] or [safepoint] instead of walking threads stopped by a pause
+//     wallthreads=N    - number of wall clock sampler threads (default: depends on CPU count)
+//     vthreads[=NS]    - attribute samples to virtual threads; sample parked ones every NS
 //     collapsed        - dump collapsed stacks (the format used by FlameGraph script)
 //     flamegraph       - produce Flame Graph in HTML format
 //     tree             - produce call tree in HTML format
 //     jfr              - dump events in Java Flight Recorder format
-//     jfropts=OPTIONS  - JFR recording options: numeric bitmask or 'mem'
+//     pprof            - dump samples in gzipped pprof (profile.proto) format
+//     heatmap          - produce heatmap of samples over time in HTML format
+//     jfropts=OPTIONS  - JFR recording options: numeric bitmask or 'mem', 'gzip', 'batch', 'threadcpu'
 //     jfrsync[=CONFIG] - start Java Flight Recording with the given config along with the profiler
 //     traces[=N]       - dump top N call traces
 //     flat[=N]         - dump top N methods (aka flat profile)
@@ -72,25 +82,44 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     total            - count the total value (time, bytes, etc.) instead of samples
 //     chunksize=N      - approximate size of JFR chunk in bytes (default: 100 MB)
 //     chunktime=N      - duration of JFR chunk in seconds (default: 1 hour)
+//     tracemem=BYTES   - limit memory for call traces; evict traces unused in the last JFR chunk
+//     memlimit=BYTES   - limit total profiler memory; shed load step by step when exceeded
+//     hugepages        - back call trace storage with huge pages when available
+//     deferred         - record CPU samples in a background thread instead of a signal handler
+//     overhead=PCT     - adapt sampling rate to keep recording time within PCT of process CPU time
 //     timeout=TIME     - automatically stop profiler at TIME (absolute or relative)
 //     loop=TIME        - run profiler in a loop (continuous profiling)
+//     recent=TIME      - keep a ring of recent samples; dump only the samples of the last TIME
+//     spike=PCT        - with 'recent', dump recent samples to file whenever process CPU exceeds PCT
 //     interval=N       - sampling interval in ns (default: 10'000'000, i.e. 10 ms)
 //     jstackdepth=N    - maximum Java stack depth (default: 2048)
+//     adaptivedepth=N  - start each thread at Java depth N, doubled when its stacks are truncated
+//     stitch=N         - walk N frames, take the rest from a recent deeper stack (cstack=vm|vmx)
 //     signal=N         - use alternative signal for cpu or wall clock profiling
 //     features=LIST    - advanced stack trace features (vtable, comptask, pcaddr)"
 //     safemode=BITS    - disable stack recovery techniques (default: 0, i.e. everything enabled)
-//     file=FILENAME    - output file name for dumping
+//     file=FILENAME    - output file name for dumping, or tcp://host:port, unix:/path to stream JFR chunks;
+//                        FILE1+FILE2 dumps the same profile in several formats;
+//                        .gz or .zst suffix compresses the output, e.g. profile.collapsed.gz
 //     log=FILENAME     - log warnings and errors to the given dedicated stream
 //     loglevel=LEVEL   - logging level: TRACE, DEBUG, INFO, WARN, ERROR, or NONE
 //     quiet            - do not log "Profiling started/stopped" message
 //     server=ADDRESS   - start insecure HTTP server at ADDRESS/PORT
+//     lazysyms         - load symbols of native libraries only when dumping (LD_PRELOAD only)
+//     control          - keep a control socket for subsequent asprof commands
 //     filter=FILTER    - thread filter
-//     threads          - profile different threads separately
+//     threads[=group]  - profile different threads separately, or pools of threads by their common name
 //     sched            - group threads by scheduling policy
 //     cstack=MODE      - how to collect C stack frames in addition to Java stack
-//                        MODE is 'fp', 'dwarf', 'lbr', 'vm' or 'no'
+//                        MODE is 'fp', 'dwarf', 'lbr', 'lbrx', 'vm', 'vmx' or 'no'
 //     clock=SOURCE     - clock source for JFR timestamps: 'tsc' or 'monotonic'
+//     nonsafepoints=MODE - when to enable DebugNonSafepoints: 'always', 'exec' or 'never'
 //     alluser          - include only user-mode events
+//     percpu           - open one perf_event per CPU instead of per thread
+//     cgroup[=PATH]    - sample all processes of the cgroup with per-CPU events
+//     counter=EVENT    - read a hardware counter with every perf_events sample (up to 4)
+//     dataaddr         - record data addresses and sources of precise perf_events samples
+//     perfmap          - write JIT-compiled methods to /tmp/perf-<pid>.map for external profilers
 //     fdtransfer       - use fdtransfer to pass fds to the profiler
 //     target-cpu=CPU   - sample threads on a specific CPU (perf_events only, default: -1)
 //     simple           - simple class names instead of FQN
@@ -99,7 +128,7 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     sig              - print method signatures
 //     ann              - annotate Java methods
 //     lib              - prepend library names
-//     mcache           - max age of jmethodID cache (default: 0 = disabled)
+//     mcache           - max age of frame name cache (default: 0 = disabled)
 //     include=PATTERN  - include stack traces containing PATTERN
 //     exclude=PATTERN  - exclude stack traces containing PATTERN
 //     begin=FUNCTION   - begin profiling when FUNCTION is executed
@@ -110,6 +139,8 @@ static const Multiplier UNIVERSAL[] = {{'n', 1}, {'u', 1000}, {'m', 1000000}, {'
 //     reverse          - generate stack-reversed FlameGraph / Call tree (defaults to icicle graph)
 //     inverted         - toggles the layout for reversed stacktraces from icicle to flamegraph
 //                        and for default stacktraces from flamegraph to icicle
+//     diff             - color FlameGraph frames by their change since the last snapshot
+//     delta            - dump collapsed or pprof samples since the last snapshot, then take a new one
 //
 // It is possible to specify multiple dump options at the same time
 
@@ -161,6 +192,9 @@ Error Arguments::parse(const char* args) {
             CASE("version")
                 _action = ACTION_VERSION;
 
+            CASE("snapshot")
+                _action = ACTION_SNAPSHOT;
+
             // Output formats
             CASE("collapsed")
                 _output = OUTPUT_COLLAPSED;
@@ -174,14 +208,23 @@ Error Arguments::parse(const char* args) {
             CASE("jfr")
                 _output = OUTPUT_JFR;
 
+            CASE("pprof")
+                _output = OUTPUT_PPROF;
+
+            CASE("heatmap")
+                _output = OUTPUT_HEATMAP;
+
             CASE("jfropts")
                 _output = OUTPUT_JFR;
                 if (value == NULL) {
                     msg = "Invalid jfropts";
                 } else if (value[0] >= '0' && value[0] <= '9') {
                     _jfr_options = (int)strtol(value, NULL, 0);
-                } else if (strstr(value, "mem")) {
-                    _jfr_options |= IN_MEMORY;
+                } else {
+                    if (strstr(value, "mem")) _jfr_options |= IN_MEMORY;
+                    if (strstr(value, "gzip")) _jfr_options |= GZIP_CHUNKS;
+                    if (strstr(value, "batch")) _jfr_options |= BATCH_EVENTS;
+                    if (strstr(value, "threadcpu")) _jfr_options |= THREAD_CPU_LOAD;
                 }
 
             CASE("jfrsync")
@@ -213,6 +256,16 @@ Error Arguments::parse(const char* args) {
                     msg = "Invalid chunktime";
                 }
 
+            CASE("tracemem")
+                if (value == NULL || (_trace_mem = parseUnits(value, BYTES)) < 0) {
+                    msg = "Invalid tracemem";
+                }
+
+            CASE("memlimit")
+                if (value == NULL || (_mem_limit = parseUnits(value, BYTES)) <= 0) {
+                    msg = "Invalid memlimit";
+                }
+
             // Basic options
             CASE("event")
                 if (value == NULL || value[0] == 0) {
@@ -240,6 +293,16 @@ Error Arguments::parse(const char* args) {
                     msg = "Invalid loop duration";
                 }
 
+            CASE("recent")
+                if (value == NULL || (_recent = parseUnits(value, SECONDS)) <= 0) {
+                    msg = "Invalid recent";
+                }
+
+            CASE("spike")
+                if (value == NULL || (_spike = atof(value)) <= 0) {
+                    msg = "Invalid spike";
+                }
+
             CASE("alloc")
                 _alloc = value == NULL ? 0 : parseUnits(value, BYTES);
 
@@ -249,9 +312,30 @@ Error Arguments::parse(const char* args) {
             CASE("nofree")
                 _nofree = true;
 
+            CASE("hugepages")
+                _huge_pages = true;
+
+            CASE("deferred")
+                _deferred = true;
+
+            CASE("overhead")
+                if (value == NULL || (_overhead = atof(value)) <= 0 || _overhead >= 100) {
+                    msg = "Invalid overhead";
+                }
+
             CASE("lock")
                 _lock = value == NULL ? 0 : parseUnits(value, NANOS);
 
+            CASE("parkthreshold")
+                if (value == NULL || (_park_threshold = parseUnits(value, NANOS)) < 0) {
+                    msg = "Invalid parkthreshold";
+                }
+
+            CASE("latency")
+                if ((_latency = value == NULL ? 0 : parseUnits(value, NANOS)) < 0) {
+                    msg = "Invalid latency";
+                }
+
             CASE("wall")
                 _wall = value == NULL ? 0 : parseUnits(value, NANOS);
 
@@ -267,11 +351,29 @@ Error Arguments::parse(const char* args) {
                     msg = "Invalid interval";
                 }
 
+            CASE("vthreads")
+                _vthreads = value == NULL ? 0 : parseUnits(value, NANOS);
+
+            CASE("wallthreads")
+                if (value == NULL || (_wall_threads = atoi(value)) <= 0) {
+                    msg = "wallthreads must be > 0";
+                }
+
             CASE("jstackdepth")
                 if (value == NULL || (_jstackdepth = atoi(value)) <= 0) {
                     msg = "jstackdepth must be > 0";
                 }
 
+            CASE("adaptivedepth")
+                if (value == NULL || (_adaptive_depth = atoi(value)) <= 0) {
+                    msg = "adaptivedepth must be > 0";
+                }
+
+            CASE("stitch")
+                if (value == NULL || (_stitch = atoi(value)) <= 0) {
+                    msg = "stitch must be > 0";
+                }
+
             CASE("signal")
                 if (value == NULL || (_signal = atoi(value)) <= 0) {
                     msg = "signal must be > 0";
@@ -305,6 +407,25 @@ Error Arguments::parse(const char* args) {
                     msg = "file must not be empty";
                 }
                 _file = value;
+                _extra_file_count = 0;
+                // More files of other formats can follow, each dumped from the same data
+                for (char* p; value != NULL && (p = strchr(value, '+')) != NULL; ) {
+                    *p = 0;
+                    value = p + 1;
+                    Output output = detectOutputFormat(value);
+                    if (_extra_file_count == MAX_EXTRA_FILES) {
+                        msg = "Too many output files";
+                    } else if (output == OUTPUT_JFR) {
+                        msg = "Only the first output file may be JFR";
+                    } else if (output == OUTPUT_SVG) {
+                        msg = "SVG format is obsolete, use .html for FlameGraph";
+                    } else if (output == OUTPUT_PPROF && detectCompression(value) != COMPRESS_NONE) {
+                        msg = "pprof output is already compressed, use .pb.gz";
+                    } else {
+                        _extra_files[_extra_file_count] = value;
+                        _extra_outputs[_extra_file_count++] = output;
+                    }
+                }
 
             CASE("log")
                 _log = value == NULL || value[0] == 0 ? NULL : value;
@@ -318,12 +439,18 @@ Error Arguments::parse(const char* args) {
             CASE("quiet")
                 _quiet = true;
 
+            CASE("control")
+                _control = true;
+
             CASE("server")
                 if (value == NULL || value[0] == 0) {
                     msg = "server address must not be empty";
                 }
                 _server = value;
 
+            CASE("lazysyms")
+                _lazy_symbols = true;
+
             CASE("fdtransfer")
                 _fdtransfer = true;
                 if (value == NULL || value[0] == 0) {
@@ -345,6 +472,13 @@ Error Arguments::parse(const char* args) {
 
             CASE("threads")
                 _threads = true;
+                if (value != NULL) {
+                    if (strcmp(value, "group") == 0) {
+                        _thread_groups = true;
+                    } else {
+                        msg = "Invalid threads";
+                    }
+                }
 
             CASE("sched")
                 _sched = true;
@@ -352,12 +486,41 @@ Error Arguments::parse(const char* args) {
             CASE("live")
                 _live = true;
 
+            CASE("liverefs")
+                if (value == NULL || (_live_refs = atoi(value)) <= 0) {
+                    msg = "liverefs must be > 0";
+                }
+
+            CASE("allochisto")
+                _alloc_histo = true;
+
+            CASE("dataaddr")
+                _data_addr = true;
+
+            CASE("perfmap")
+                _perf_map = true;
+
             CASE("nobatch")
                 _nobatch = true;
 
+            CASE("pauseframes")
+                _pause_frames = true;
+
             CASE("alluser")
                 _alluser = true;
 
+            CASE("percpu")
+                _per_cpu = true;
+
+            CASE("cgroup")
+                // Empty value stands for the cgroup of the profiled process
+                _cgroup = value == NULL ? "" : value;
+                _per_cpu = true;
+
+            CASE("counter")
+                // Workaround -Wstringop-overflow warning
+                if (value == arg + 8) appendToEmbeddedList(_perf_counters, arg + 8);
+
             CASE("cstack")
                 if (value != NULL) {
                     if (strcmp(value, "fp") == 0) {
@@ -366,6 +529,8 @@ Error Arguments::parse(const char* args) {
                         _cstack = CSTACK_DWARF;
                     } else if (strcmp(value, "lbr") == 0) {
                         _cstack = CSTACK_LBR;
+                    } else if (strcmp(value, "lbrx") == 0) {
+                        _cstack = CSTACK_LBRX;
                     } else if (strcmp(value, "vm") == 0) {
                         _cstack = CSTACK_VM;
                     } else if (strcmp(value, "vmx") == 0) {
@@ -384,6 +549,17 @@ Error Arguments::parse(const char* args) {
                     }
                 }
 
+            CASE("nonsafepoints")
+                if (value == NULL || strcmp(value, "always") == 0) {
+                    _nonsafepoints = NONSAFEPOINTS_ALWAYS;
+                } else if (strcmp(value, "exec") == 0) {
+                    _nonsafepoints = NONSAFEPOINTS_EXEC;
+                } else if (strcmp(value, "never") == 0) {
+                    _nonsafepoints = NONSAFEPOINTS_NEVER;
+                } else {
+                    msg = "nonsafepoints must be 'always', 'exec' or 'never'";
+                }
+
             CASE("target-cpu")
                 if (value == NULL || (_target_cpu = atoi(value)) < 0) {
                     _target_cpu = -1;
@@ -433,6 +609,12 @@ Error Arguments::parse(const char* args) {
             CASE("inverted")
                 _inverted = true;
 
+            CASE("diff")
+                _diff = true;
+
+            CASE("delta")
+                _delta = true;
+
             DEFAULT()
                 if (_unknown_arg == NULL) _unknown_arg = arg;
         }
@@ -456,6 +638,23 @@ Error Arguments::parse(const char* args) {
         _dump_flat = 200;
     }
 
+    if (_file != NULL) {
+        Compression compression = detectCompression(_file);
+        if (compression != COMPRESS_NONE && _output == OUTPUT_JFR) {
+            if (compression != COMPRESS_GZIP) {
+                return Error("JFR output can be compressed only with gzip");
+            }
+            _jfr_options |= GZIP_CHUNKS;
+        } else if (compression != COMPRESS_NONE && _output == OUTPUT_PPROF) {
+            return Error("pprof output is already compressed, use .pb.gz");
+        }
+    }
+
+    if (_lazy_symbols && _clock == CLK_DEFAULT) {
+        // TSC calibration would take 10 ms of the startup time
+        _clock = CLK_MONOTONIC;
+    }
+
     if (_action == ACTION_NONE && _output != OUTPUT_NONE) {
         _action = ACTION_DUMP;
     }
@@ -464,10 +663,14 @@ Error Arguments::parse(const char* args) {
 }
 
 const char* Arguments::file() {
-    if (_file != NULL && strchr(_file, '%') != NULL) {
-        return expandFilePattern(_file);
+    return file(_file);
+}
+
+const char* Arguments::file(const char* name) {
+    if (name != NULL && strchr(name, '%') != NULL) {
+        return expandFilePattern(name);
     }
-    return _file;
+    return name;
 }
 
 // Returns true if the log file is a temporary file of asprof launcher
@@ -547,16 +750,51 @@ const char* Arguments::expandFilePattern(const char* pattern) {
     return _buf;
 }
 
-Output Arguments::detectOutputFormat(const char* file) {
+Compression Arguments::detectCompression(const char* file) {
+    if (isStreamingAddress(file)) {
+        return COMPRESS_NONE;
+    }
+
     const char* ext = strrchr(file, '.');
     if (ext != NULL) {
-        if (strcmp(ext, ".html") == 0) {
+        if (strcmp(ext, ".gz") == 0) {
+            // pprof output is gzipped on its own
+            return ext - file >= 3 && strncmp(ext - 3, ".pb", 3) == 0 ? COMPRESS_NONE : COMPRESS_GZIP;
+        } else if (strcmp(ext, ".zst") == 0) {
+            return COMPRESS_ZSTD;
+        }
+    }
+    return COMPRESS_NONE;
+}
+
+bool Arguments::hasExtension(const char* ext, const char* end, const char* expected) {
+    size_t len = strlen(expected);
+    return (size_t)(end - ext) == len && memcmp(ext, expected, len) == 0;
+}
+
+Output Arguments::detectOutputFormat(const char* file) {
+    if (isStreamingAddress(file)) {
+        return OUTPUT_JFR;
+    }
+
+    // The format is determined by the extension before the compression suffix
+    const char* end = file + strlen(file);
+    if (detectCompression(file) != COMPRESS_NONE) {
+        end = strrchr(file, '.');
+    }
+
+    const char* ext = end;
+    while (ext > file && *--ext != '.') ;
+    if (*ext == '.') {
+        if (hasExtension(ext, end, ".html")) {
             return OUTPUT_FLAMEGRAPH;
-        } else if (strcmp(ext, ".jfr") == 0) {
+        } else if (hasExtension(ext, end, ".jfr")) {
             return OUTPUT_JFR;
-        } else if (strcmp(ext, ".collapsed") == 0 || strcmp(ext, ".folded") == 0) {
+        } else if (hasExtension(ext, end, ".collapsed") || hasExtension(ext, end, ".folded")) {
             return OUTPUT_COLLAPSED;
-        } else if (strcmp(ext, ".svg") == 0) {
+        } else if (hasExtension(ext, end, ".pprof") || (hasExtension(ext, end, ".gz") && ext - file >= 3 && strncmp(ext - 3, ".pb", 3) == 0)) {
+            return OUTPUT_PPROF;
+        } else if (hasExtension(ext, end, ".svg")) {
             return OUTPUT_SVG;
         }
     }
@@ -7,12 +7,15 @@
 #define _ARGUMENTS_H
 
 #include <stddef.h>
+#include <string.h>
 
 
 const long DEFAULT_INTERVAL = 10000000;      // 10 ms
 const long DEFAULT_ALLOC_INTERVAL = 524287;  // 512 KiB
 const long DEFAULT_LOCK_INTERVAL = 10000;    // 10 us
 const int DEFAULT_JSTACKDEPTH = 2048;
+const int DEFAULT_LIVE_REFS = 65536;
+const int MAX_EXTRA_FILES = 3;              // file=A+B+C+D
 
 const char* const EVENT_CPU        = "cpu";
 const char* const EVENT_ALLOC      = "alloc";
@@ -21,6 +24,7 @@ const char* const EVENT_LOCK       = "lock";
 const char* const EVENT_WALL       = "wall";
 const char* const EVENT_CTIMER     = "ctimer";
 const char* const EVENT_ITIMER     = "itimer";
+const char* const EVENT_OFFCPU     = "offcpu";
 
 #define SHORT_ENUM __attribute__((__packed__))
 
@@ -34,7 +38,8 @@ enum SHORT_ENUM Action {
     ACTION_STATUS,
     ACTION_MEMINFO,
     ACTION_LIST,
-    ACTION_VERSION
+    ACTION_VERSION,
+    ACTION_SNAPSHOT
 };
 
 enum SHORT_ENUM Counter {
@@ -59,10 +64,18 @@ enum SHORT_ENUM CStack {
     CSTACK_FP,       // walk stack using Frame Pointer links
     CSTACK_DWARF,    // use DWARF unwinding info from .eh_frame section
     CSTACK_LBR,      // Last Branch Record hardware capability
+    CSTACK_LBRX,     // LBR for the top frames, continued with FP or DWARF unwinding below them
     CSTACK_VM,       // unwind using HotSpot VMStructs
     CSTACK_VMX       // same as CSTACK_VM but with intermediate native frames
 };
 
+// When to turn on DebugNonSafepoints for accurate inlined frames in compiled code
+enum SHORT_ENUM NonSafepoints {
+    NONSAFEPOINTS_ALWAYS,  // from JVM startup or the first profiling session
+    NONSAFEPOINTS_EXEC,    // only while sampling execution: cpu, wall or perf events
+    NONSAFEPOINTS_NEVER
+};
+
 enum SHORT_ENUM Clock {
     CLK_DEFAULT,
     CLK_TSC,
@@ -76,7 +89,16 @@ enum SHORT_ENUM Output {
     OUTPUT_COLLAPSED,
     OUTPUT_FLAMEGRAPH,
     OUTPUT_TREE,
-    OUTPUT_JFR
+    OUTPUT_JFR,
+    OUTPUT_PPROF,
+    OUTPUT_HEATMAP
+};
+
+// Selected by .gz or .zst suffix after the format extension, e.g. profile.collapsed.gz
+enum SHORT_ENUM Compression {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD
 };
 
 enum JfrOption {
@@ -87,6 +109,9 @@ enum JfrOption {
     NO_HEAP_SUMMARY = 0x10,
 
     IN_MEMORY       = 0x100,
+    GZIP_CHUNKS     = 0x200,
+    BATCH_EVENTS    = 0x400,
+    THREAD_CPU_LOAD = 0x800,
 
     JFR_SYNC_OPTS   = NO_SYSTEM_INFO | NO_SYSTEM_PROPS | NO_NATIVE_LIBS | NO_CPU_LOAD | NO_HEAP_SUMMARY
 };
@@ -152,6 +177,7 @@ class Arguments {
 
     static long long hash(const char* arg);
     static Output detectOutputFormat(const char* file);
+    static bool hasExtension(const char* ext, const char* end, const char* expected);
     static long parseUnits(const char* str, const Multiplier* multipliers);
     static int parseTimeout(const char* str);
 
@@ -164,10 +190,22 @@ class Arguments {
     long _alloc;
     long _nativemem;
     long _lock;
+    long _park_threshold;
+    long _latency;
     long _wall;
+    int _wall_threads;
+    long _vthreads;
+    double _overhead;
+    long _recent;
+    double _spike;
     int _jstackdepth;
+    int _adaptive_depth;
+    int _stitch;
     int _signal;
     const char* _file;
+    const char* _extra_files[MAX_EXTRA_FILES];
+    Output _extra_outputs[MAX_EXTRA_FILES];
+    int _extra_file_count;
     const char* _log;
     const char* _loglevel;
     const char* _unknown_arg;
@@ -179,13 +217,26 @@ class Arguments {
     bool _loop;
     bool _preloaded;
     bool _quiet;
+    bool _control;
     bool _threads;
+    bool _thread_groups;
     bool _sched;
     bool _live;
+    int _live_refs;
+    bool _alloc_histo;
+    bool _data_addr;
+    bool _perf_map;
     bool _nofree;
+    bool _huge_pages;
+    bool _lazy_symbols;
+    bool _deferred;
     bool _nobatch;
+    bool _pause_frames;
     bool _nostop;
     bool _alluser;
+    bool _per_cpu;
+    const char* _cgroup;
+    int _perf_counters;
     bool _fdtransfer;
     const char* _fdtransfer_path;
     int _target_cpu;
@@ -193,9 +244,12 @@ class Arguments {
     StackWalkFeatures _features;
     CStack _cstack;
     Clock _clock;
+    NonSafepoints _nonsafepoints;
     Output _output;
     long _chunk_size;
     long _chunk_time;
+    long _trace_mem;
+    long _mem_limit;
     const char* _jfr_sync;
     int _jfr_options;
     int _dump_traces;
@@ -208,6 +262,8 @@ class Arguments {
     double _minwidth;
     bool _reverse;
     bool _inverted;
+    bool _diff;
+    bool _delta;
 
     Arguments() :
         _buf(NULL),
@@ -220,10 +276,20 @@ class Arguments {
         _alloc(-1),
         _nativemem(-1),
         _lock(-1),
+        _park_threshold(0),
+        _latency(-1),
         _wall(-1),
+        _wall_threads(0),
+        _vthreads(-1),
+        _overhead(0),
+        _recent(0),
+        _spike(0),
         _jstackdepth(DEFAULT_JSTACKDEPTH),
+        _adaptive_depth(0),
+        _stitch(0),
         _signal(0),
         _file(NULL),
+        _extra_file_count(0),
         _log(NULL),
         _loglevel(NULL),
         _unknown_arg(NULL),
@@ -235,13 +301,26 @@ class Arguments {
         _loop(false),
         _preloaded(false),
         _quiet(false),
+        _control(false),
         _threads(false),
+        _thread_groups(false),
         _sched(false),
         _live(false),
+        _live_refs(DEFAULT_LIVE_REFS),
+        _alloc_histo(false),
+        _data_addr(false),
+        _perf_map(false),
         _nofree(false),
+        _huge_pages(false),
+        _lazy_symbols(false),
+        _deferred(false),
         _nobatch(false),
+        _pause_frames(false),
         _nostop(false),
         _alluser(false),
+        _per_cpu(false),
+        _cgroup(NULL),
+        _perf_counters(0),
         _fdtransfer(false),
         _fdtransfer_path(NULL),
         _target_cpu(-1),
@@ -249,9 +328,12 @@ class Arguments {
         _features(),
         _cstack(CSTACK_DEFAULT),
         _clock(CLK_DEFAULT),
+        _nonsafepoints(NONSAFEPOINTS_ALWAYS),
         _output(OUTPUT_NONE),
         _chunk_size(100 * 1024 * 1024),
         _chunk_time(3600),
+        _trace_mem(0),
+        _mem_limit(0),
         _jfr_sync(NULL),
         _jfr_options(0),
         _dump_traces(0),
@@ -262,7 +344,9 @@ class Arguments {
         _title(NULL),
         _minwidth(0),
         _reverse(false),
-        _inverted(false) {
+        _inverted(false),
+        _diff(false),
+        _delta(false) {
     }
 
     ~Arguments();
@@ -272,6 +356,9 @@ class Arguments {
     Error parse(const char* args);
 
     const char* file();
+    const char* file(const char* name);
+
+    static Compression detectCompression(const char* file);
 
     bool hasTemporaryLog() const;
 
@@ -280,12 +367,18 @@ class Arguments {
             (_action == ACTION_STOP || _action == ACTION_DUMP ? _output != OUTPUT_JFR : _action >= ACTION_CHECK);
     }
 
+    // JFR chunks are streamed to a collector at tcp://host:port or unix:/path
+    static bool isStreamingAddress(const char* file) {
+        return strncmp(file, "tcp://", 6) == 0 || strncmp(file, "unix:", 5) == 0;
+    }
+
     bool hasOption(JfrOption option) const {
         return (_jfr_options & option) != 0;
     }
 
     friend class FrameName;
     friend class Recording;
+    friend class PerfEvents;
 };
 
 extern Arguments _global_args;
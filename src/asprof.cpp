@@ -52,10 +52,34 @@ DLLEXPORT asprof_error_t asprof_execute(const char* command, asprof_writer_t out
     return asprof_error(error.message());
 }
 
+DLLEXPORT asprof_error_t asprof_dump_binary(const char* options, asprof_dump_handler* handler) {
+    if (handler == NULL || handler->trace == NULL || handler->frames == NULL || handler->max_frames == 0) {
+        return asprof_error("Invalid dump handler");
+    }
+
+    Arguments args;
+    if (options != NULL) {
+        Error error = args.parse(options);
+        if (error) {
+            return asprof_error(error.message());
+        }
+    }
+
+    Error error = Profiler::instance()->dumpBinary(args, handler);
+    if (error) {
+        return asprof_error(error.message());
+    }
+    return NULL;
+}
+
 DLLEXPORT asprof_thread_local_data* asprof_get_thread_local_data(void) {
     return ThreadLocalData::getThreadLocalData();
 }
 
+DLLEXPORT uint32_t asprof_register_context_tag(const char* name) {
+    return UserEvents::registerContextTag(name);
+}
+
 DLLEXPORT asprof_jfr_event_key asprof_register_jfr_event(const char* name) {
     return UserEvents::registerEvent(name);
 }
@@ -75,3 +99,16 @@ DLLEXPORT asprof_error_t asprof_emit_jfr_event(asprof_jfr_event_key type, const
     Profiler::instance()->recordEventOnly(USER_EVENT, &event);
     return NULL;
 }
+
+DLLEXPORT asprof_error_t asprof_emit_jfr_events(const asprof_jfr_event* events, size_t count, int flags) {
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].len > ASPROF_MAX_JFR_EVENT_LENGTH) {
+            return asprof_error("Unable to emit JFR event larger than " asprof_str(ASPROF_MAX_JFR_EVENT_LENGTH) " bytes");
+        }
+    }
+
+    if (count > 0) {
+        Profiler::instance()->recordUserEvents(events, count, (flags & ASPROF_JFR_BUFFERED) != 0);
+    }
+    return NULL;
+}
@@ -47,8 +47,31 @@ typedef struct {
     // `asprof_get_thread_local_data` is called on a given thread. Further calls to
     // `asprof_get_thread_local_data` on a given thread will of course not reset the counter.
     volatile uint64_t sample_counter;
+
+    // Sampling priority of the thread, ASPROF_PRIORITY_NORMAL by default. Can be changed
+    // at any time by the thread itself or by anyone holding the pointer.
+    //
+    // A negative priority -N makes CPU, wall clock and perf event profiling record only
+    // one of every 2^N signals delivered to this thread; ASPROF_PRIORITY_NONE drops all.
+    // Positive values are reserved and currently behave like ASPROF_PRIORITY_NORMAL.
+    // Allocation, lock and other event samples of the thread are not affected.
+    volatile int32_t sampling_priority;
+
+    // Tracing context of the work the thread is currently doing, e.g. an OpenTelemetry
+    // span. CPU, wall clock and perf event samples taken on the thread carry the context
+    // into the JFR output. span_id == 0 means no context.
+    //
+    // Samples are taken on the thread itself, so a sample can see a half-updated context
+    // only if it interrupts the update. To avoid that, clear span_id first, then change
+    // the other fields, and set span_id last.
+    volatile uint64_t span_id;
+    volatile uint64_t trace_id;     // the lower 64 bits of the trace ID
+    volatile uint32_t context_tag;  // an attribute from `asprof_register_context_tag`, or 0
 } asprof_thread_local_data;
 
+#define ASPROF_PRIORITY_NORMAL 0
+#define ASPROF_PRIORITY_NONE   INT32_MIN
+
 // This API is UNSTABLE and might change or be removed in the next version of async-profiler.
 //
 // Gets a pointer to asprof's thread-local data structure, see `asprof_thread_local_data`'s
@@ -63,6 +86,41 @@ typedef struct {
 DLLEXPORT asprof_thread_local_data* asprof_get_thread_local_data(void);
 typedef asprof_thread_local_data* (*asprof_get_thread_local_data_t)(void);
 
+// This API is UNSTABLE and might change or be removed in the next version of async-profiler.
+//
+// Returns an identifier of the given attribute string, such as an endpoint or a tenant name,
+// for use in `asprof_thread_local_data.context_tag`. The same string always yields the same
+// identifier. Returns 0 on failure.
+DLLEXPORT uint32_t asprof_register_context_tag(const char* name);
+typedef uint32_t (*asprof_register_context_tag_t)(const char* name);
+
+
+// This API is UNSTABLE and might change or be removed in the next version of async-profiler.
+//
+// Receives call traces from `asprof_dump_binary`. Frame names are identified by IDs starting
+// from 1, assigned in the order of first use and valid within one dump only. `name` is called
+// once for every ID before the first trace that refers to it; `name` is not zero terminated.
+// `trace` gets the frames of one call trace, from the top frame to the bottom, in the
+// caller-provided `frames` array; deeper traces are cut to the top `max_frames` frames.
+typedef struct {
+    void* arg;
+    void (*name)(void* arg, uint32_t id, const char* name, size_t len);
+    void (*trace)(void* arg, const uint32_t* frames, uint32_t num_frames, uint64_t samples, uint64_t counter);
+    uint32_t* frames;
+    uint32_t max_frames;
+} asprof_dump_handler;
+
+// This API is UNSTABLE and might change or be removed in the next version of async-profiler.
+//
+// Reports call traces collected so far with their sample counts and counters, without
+// formatting any text. `options` control frame names the same way as for the `dump`
+// command, e.g. "simple,exclude=*Unsafe.park*", and may be NULL.
+// Called on the caller's thread; callbacks must not call into async-profiler.
+//
+// Returns an error code or NULL on success.
+DLLEXPORT asprof_error_t asprof_dump_binary(const char* options, asprof_dump_handler* handler);
+typedef asprof_error_t (*asprof_dump_binary_t)(const char* options, asprof_dump_handler* handler);
+
 
 typedef int asprof_jfr_event_key;
 
@@ -99,6 +157,31 @@ typedef asprof_jfr_event_key (*asprof_register_jfr_event_t)(const char* name);
 DLLEXPORT asprof_error_t asprof_emit_jfr_event(asprof_jfr_event_key type, const uint8_t* data, size_t len);
 typedef asprof_error_t (*asprof_emit_jfr_event_t)(asprof_jfr_event_key type, const uint8_t* data, size_t len);
 
+typedef struct {
+    asprof_jfr_event_key type;
+    const uint8_t* data;
+    size_t len;
+} asprof_jfr_event;
+
+// Events are kept in a thread-local buffer and reach the recording later, see below
+#define ASPROF_JFR_BUFFERED 1
+
+// This API is UNSTABLE and might change or be removed in the next version of async-profiler.
+//
+// Emits several user-defined JFR events at once, the same as `asprof_emit_jfr_event` would,
+// but at the cost of a single call. All events of the batch get the same timestamp.
+//
+// With ASPROF_JFR_BUFFERED flag, events are encoded into a buffer owned by the calling thread
+// without taking any locks shared with other threads. Buffered events are written to the
+// recording when the buffer fills up, in the background about once a second, and when the
+// recording is dumped or stopped. If the recording is busy for long, e.g. switching chunks,
+// events that do not fit in the buffer are dropped.
+//
+// Returns an error code or NULL on success. Nothing is emitted if any event exceeds
+// ASPROF_MAX_JFR_EVENT_LENGTH.
+DLLEXPORT asprof_error_t asprof_emit_jfr_events(const asprof_jfr_event* events, size_t count, int flags);
+typedef asprof_error_t (*asprof_emit_jfr_events_t)(const asprof_jfr_event* events, size_t count, int flags);
+
 #ifdef __cplusplus
 }
 #endif
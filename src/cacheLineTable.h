@@ -0,0 +1,115 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CACHELINETABLE_H
+#define _CACHELINETABLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "arch.h"
+
+
+const int CACHE_LINE_BITS = 6;
+const int CACHE_LINE_TABLE_BITS = 14;
+const u32 CACHE_LINE_TABLE_CAPACITY = 1 << CACHE_LINE_TABLE_BITS;
+const u32 CACHE_LINE_MAX_PROBES = 32;
+
+struct CacheLineEntry {
+    volatile u64 line;
+    volatile u64 samples;
+    volatile u64 hitm;      // samples served by a modified line in another core's cache
+    volatile u32 words;     // bitmask of accessed 8-byte words within the line
+    volatile u32 class_id;  // class of the first object seen on the line
+};
+
+// Sampled data accesses aggregated by cache line. Accesses to different words of the same line
+// with many HITM samples hint at false sharing. Lock-free, safe to update from a signal handler.
+class CacheLineTable {
+  private:
+    CacheLineEntry* _entries;
+    volatile u64 _dropped;
+
+    CacheLineEntry* find(u64 line) {
+        u32 slot = (u32)((line * 0x9e3779b97f4a7c15ULL) >> (64 - CACHE_LINE_TABLE_BITS));
+        for (u32 i = 0; i < CACHE_LINE_MAX_PROBES; i++) {
+            CacheLineEntry* e = &_entries[slot];
+            u64 key = e->line;
+            if (key == line) {
+                return e;
+            } else if (key == 0) {
+                key = __sync_val_compare_and_swap(&e->line, 0, line);
+                if (key == 0 || key == line) {
+                    return e;
+                }
+            }
+            slot = (slot + 1) & (CACHE_LINE_TABLE_CAPACITY - 1);
+        }
+        return NULL;
+    }
+
+  public:
+    CacheLineTable() : _entries(NULL), _dropped(0) {
+    }
+
+    ~CacheLineTable() {
+        free(_entries);
+    }
+
+    bool init() {
+        if (_entries == NULL) {
+            _entries = (CacheLineEntry*)calloc(CACHE_LINE_TABLE_CAPACITY, sizeof(CacheLineEntry));
+        }
+        return _entries != NULL;
+    }
+
+    void reset() {
+        if (_entries != NULL) {
+            memset((void*)_entries, 0, CACHE_LINE_TABLE_CAPACITY * sizeof(CacheLineEntry));
+        }
+        _dropped = 0;
+    }
+
+    void add(uintptr_t address, bool hitm, u32 class_id) {
+        u64 line = (u64)address >> CACHE_LINE_BITS;
+        if (_entries == NULL || line == 0) {
+            return;
+        }
+
+        CacheLineEntry* e = find(line);
+        if (e == NULL) {
+            atomicInc(_dropped);
+            return;
+        }
+
+        atomicInc(e->samples);
+        if (hitm) {
+            atomicInc(e->hitm);
+        }
+        u32 word = 1U << ((address >> 3) & ((1 << (CACHE_LINE_BITS - 3)) - 1));
+        if ((e->words & word) == 0) {
+            __sync_fetch_and_or(&e->words, word);
+        }
+        if (class_id != 0 && e->class_id == 0) {
+            e->class_id = class_id;
+        }
+    }
+
+    u64 dropped() const {
+        return _dropped;
+    }
+
+    void collect(std::vector<CacheLineEntry>& entries) const {
+        if (_entries != NULL) {
+            for (u32 i = 0; i < CACHE_LINE_TABLE_CAPACITY; i++) {
+                if (_entries[i].samples != 0) {
+                    entries.push_back(_entries[i]);
+                }
+            }
+        }
+    }
+};
+
+#endif // _CACHELINETABLE_H
@@ -3,38 +3,60 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "callTraceStorage.h"
 #include "os.h"
 
 #define COMMA ,
 
-static const u32 INITIAL_CAPACITY = 65536;
+// Trace id consists of a shard index and a local id within the shard
+static const u32 SHARD_SHIFT = 27;
+static const u32 MAX_LOCAL_ID = (1U << SHARD_SHIFT) - 1;
+static const u32 INITIAL_CAPACITY = 4096;
+static const u32 MAX_CAPACITY = 1U << (SHARD_SHIFT + 1);
+static const u32 MIGRATION_BATCH = 64;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
 static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+static const int PREFIX_BLOCK = 32;
+static const u32 PREFIX_TABLE_SIZE = 16384;
+static const u32 PREFIX_PROBE_LIMIT = 16;
+static const u32 KERNEL_TABLE_SIZE = 4096;
+// A kernel stack reference takes one slot, so shorter stacks are kept inline
+static const int MIN_KERNEL_FRAMES = 2;
 
 
+// Open addressing table that maps call trace hash to a local id within the shard.
+// When a table becomes full, a new one with double capacity takes its place,
+// and the entries of the old table are migrated cooperatively by the callers of put().
 class LongHashTable {
   private:
     LongHashTable* _prev;
-    void* _padding0;
+    LongHashTable* volatile _source;
     u32 _capacity;
     u32 _padding1[15];
     volatile u32 _size;
     u32 _padding2[15];
+    volatile u32 _migrate_next;
+    volatile u32 _migrate_done;
+    u32 _padding3[14];
 
+  public:
     static size_t getSize(u32 capacity) {
-        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
+        size_t size = sizeof(LongHashTable) + sizeof(u32) * (size_t)capacity;
         return (size + OS::page_mask) & ~OS::page_mask;
     }
 
-  public:
-    static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
-        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
+    // Initializes a table in the memory of getSize(capacity) bytes
+    static LongHashTable* allocate(LongHashTable* prev, u32 capacity, void* memory) {
+        LongHashTable* table = (LongHashTable*)memory;
         if (table != NULL) {
             table->_prev = prev;
+            table->_source = prev;
             table->_capacity = capacity;
             table->_size = 0;
+            table->_migrate_next = 0;
+            table->_migrate_done = 0;
         }
         return table;
     }
@@ -45,14 +67,31 @@ class LongHashTable {
         return prev;
     }
 
+    // Frees all previous tables; must not race with put()
+    void releasePrev() {
+        for (LongHashTable* table = _prev; table != NULL; ) {
+            table = table->destroy();
+        }
+        _prev = NULL;
+        _source = NULL;
+        _migrate_next = 0;
+        _migrate_done = 0;
+    }
+
     size_t usedMemory() {
         return getSize(_capacity);
     }
 
+    // All previous tables are kept until clear(), since signal handlers may still read them
     LongHashTable* prev() {
         return _prev;
     }
 
+    // The table whose entries are not yet completely migrated into this one
+    LongHashTable* source() {
+        return __atomic_load_n(&_source, __ATOMIC_ACQUIRE);
+    }
+
     u32 capacity() {
         return _capacity;
     }
@@ -65,69 +104,410 @@ class LongHashTable {
         return __sync_add_and_fetch(&_size, 1);
     }
 
-    u64* keys() {
-        return (u64*)(this + 1);
+    // Returns the first slot of the next batch to copy from the source table
+    u32 claimBatch(u32 source_capacity) {
+        return _migrate_next >= source_capacity ? source_capacity : atomicInc(_migrate_next, MIGRATION_BATCH);
+    }
+
+    void completeBatch(u32 slots, u32 source_capacity) {
+        if (__sync_add_and_fetch(&_migrate_done, slots) == source_capacity) {
+            __atomic_store_n(&_source, (LongHashTable*)NULL, __ATOMIC_RELEASE);
+        }
     }
 
-    CallTraceSample* values() {
-        return (CallTraceSample*)(keys() + _capacity);
+    u32* ids() {
+        return (u32*)(this + 1);
     }
 
     void clear() {
-        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity);
+        memset(ids(), 0, sizeof(u32) * (size_t)_capacity);
         _size = 0;
     }
 };
 
-CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, LP64_ONLY(0 COMMA) (jmethodID)"storage_overflow"}};
+static inline u32 segmentOf(u32 id) {
+    return 31 - __builtin_clz(id / INITIAL_CAPACITY + 1);
+}
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+static inline u32 segmentStart(u32 segment) {
+    return INITIAL_CAPACITY * ((1U << segment) - 1);
+}
+
+// Links all slots of the same call trace in different shards to one merged sample
+struct SampleLink {
+    u32 merged;  // index in _merged + 1, or 0 if the slot has not been merged yet
+    u32 next;    // global id of the next slot with the same merged sample
+};
+
+// Segment layout: hashes, samples, links, a bitmap of slots changed since the last merge,
+// and a bitmap of slots sampled since the last collectTraces
+static inline size_t segmentSize(u32 segment) {
+    size_t count = (size_t)INITIAL_CAPACITY << segment;
+    size_t size = (sizeof(u64) + sizeof(CallTraceSample) + sizeof(SampleLink)) * count + count / 4;
+    return (size + OS::page_mask) & ~OS::page_mask;
+}
+
+static inline u64* changedBits(char* base, u32 segment) {
+    size_t count = (size_t)INITIAL_CAPACITY << segment;
+    return (u64*)(base + (sizeof(u64) + sizeof(CallTraceSample) + sizeof(SampleLink)) * count);
+}
+
+static inline u64* sampledBits(char* base, u32 segment) {
+    return changedBits(base, segment) + ((INITIAL_CAPACITY << segment) / 64);
+}
+
+static inline void setBit(u64* bits, u32 index) {
+    u64* word = bits + index / 64;
+    u64 bit = 1ULL << (index & 63);
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0) {
+        __sync_fetch_and_or(word, bit);
+    }
+}
+
+CallTrace CallTraceStorage::_overflow_trace = {1, 0, NULL, {BCI_ERROR, LP64_ONLY(0 COMMA) (jmethodID)"storage_overflow"}};
+
+CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK), _spare_allocator(CALL_TRACE_CHUNK) {
+    _active_allocator = &_allocator;
+    memset((void*)_shards, 0, sizeof(_shards));
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        _shards[i].table = LongHashTable::allocate(NULL, INITIAL_CAPACITY, OS::safeAlloc(LongHashTable::getSize(INITIAL_CAPACITY)));
+        _shards[i].next_id = 1;
+    }
+    _prefixes = (CallTrace* volatile*)OS::safeAlloc(PREFIX_TABLE_SIZE * sizeof(CallTrace*));
+    _kernel_stacks = (CallTrace* volatile*)OS::safeAlloc(KERNEL_TABLE_SIZE * sizeof(CallTrace*));
     _overflow = 0;
+    _memory_limit = 0;
+    _frozen = false;
+    _evicted_at = 0;
+    _huge_pages = false;
+    _backing = PAGES_REGULAR;
 }
 
 CallTraceStorage::~CallTraceStorage() {
-    while (_current_table != NULL) {
-        _current_table = _current_table->destroy();
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        while (shard->table != NULL) {
+            shard->table = shard->table->destroy();
+        }
+        freeSegments(shard);
+        free(shard->free_ids);
+    }
+    if (_prefixes != NULL) {
+        OS::safeFree((void*)_prefixes, PREFIX_TABLE_SIZE * sizeof(CallTrace*));
+    }
+    if (_kernel_stacks != NULL) {
+        OS::safeFree((void*)_kernel_stacks, KERNEL_TABLE_SIZE * sizeof(CallTrace*));
     }
 }
 
 void CallTraceStorage::clear() {
-    while (_current_table->prev() != NULL) {
-        _current_table = _current_table->destroy();
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        while (shard->table->prev() != NULL) {
+            shard->table = shard->table->destroy();
+        }
+        shard->table->clear();
+        freeSegments(shard);
+        free(shard->free_ids);
+        shard->free_ids = NULL;
+        shard->free_count = 0;
+        shard->next_id = 1;
+    }
+    if (_prefixes != NULL) {
+        memset((void*)_prefixes, 0, PREFIX_TABLE_SIZE * sizeof(CallTrace*));
     }
-    _current_table->clear();
+    if (_kernel_stacks != NULL) {
+        memset((void*)_kernel_stacks, 0, KERNEL_TABLE_SIZE * sizeof(CallTrace*));
+    }
+    resetMerged();
+    _baseline.clear();
     _allocator.clear();
+    _spare_allocator.clear();
+    _active_allocator = &_allocator;
     _overflow = 0;
+    _evicted_at = 0;
+}
+
+void CallTraceStorage::freeSegments(CallTraceShard* shard) {
+    for (u32 segment = 0; segment < MAX_TRACE_SEGMENTS; segment++) {
+        if (shard->segments[segment] != NULL) {
+            OS::safeFree(shard->segments[segment], segmentSize(segment));
+            shard->segments[segment] = NULL;
+        }
+    }
 }
 
 u32 CallTraceStorage::capacity() {
-    // As capacity of each subsequent table doubles,
-    // total capacity is a sum of geometric series: 64K + 128K + 256K...
-    return _current_table->capacity() * 2 - INITIAL_CAPACITY;
+    u32 capacity = 0;
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        capacity += _shards[i].table->capacity();
+    }
+    return capacity;
 }
 
 size_t CallTraceStorage::usedMemory() {
-    size_t bytes = _allocator.usedMemory();
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        bytes += table->usedMemory();
+    size_t bytes = _active_allocator->usedMemory() + (_prefixes != NULL ? PREFIX_TABLE_SIZE * sizeof(CallTrace*) : 0) +
+                   (_kernel_stacks != NULL ? KERNEL_TABLE_SIZE * sizeof(CallTrace*) : 0);
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        for (LongHashTable* table = shard->table; table != NULL; table = table->prev()) {
+            bytes += table->usedMemory();
+        }
+        for (u32 segment = 0; segment < MAX_TRACE_SEGMENTS; segment++) {
+            if (shard->segments[segment] != NULL) {
+                bytes += segmentSize(segment);
+            }
+        }
+    }
+    if (_memory_limit != 0) {
+        bytes += (_active_allocator == &_allocator ? _spare_allocator : _allocator).usedMemory();
     }
     return bytes;
 }
 
-void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
+// Memory taken by call trace frames placed on the given NUMA node
+size_t CallTraceStorage::frameMemory(int node) {
+    return _allocator.usedMemory(node) + _spare_allocator.usedMemory(node);
+}
+
+void CallTraceStorage::stats(CallTraceStorageStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    stats.overflow = _overflow;
+
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        LongHashTable* table = shard->table;
+        u32* ids = table->ids();
         u32 capacity = table->capacity();
 
+        stats.capacity += capacity;
+        stats.size += table->size();
+        float load = (float)table->size() / capacity;
+        if (load > stats.max_load) {
+            stats.max_load = load;
+        }
+
         for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && loadAcquire(values[slot].samples) != 0) {
-                // Reset samples to avoid duplication of call traces between JFR chunks
-                values[slot].samples = 0;
-                CallTrace* trace = values[slot].acquireTrace();
-                if (trace != NULL) {
-                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = trace;
+            u32 id = __atomic_load_n(&ids[slot], __ATOMIC_ACQUIRE);
+            if (id == 0) continue;
+
+            // Replay the probe sequence of put() to find how far the entry is from its home slot
+            u32 probe = hashAt(shard, id) == NULL ? 0 : (u32)*hashAt(shard, id) & (capacity - 1);
+            u32 length = 1;
+            for (u32 step = 1; probe != slot && step < capacity; step++) {
+                probe = (probe + step) & (capacity - 1);
+                length++;
+            }
+
+            stats.total_probes += length;
+            if (length > stats.max_probe) {
+                stats.max_probe = length;
+            }
+            int bucket = length == 1 ? 0 : 32 - __builtin_clz(length - 1);
+            stats.probes[bucket < PROBE_HISTOGRAM_SIZE ? bucket : PROBE_HISTOGRAM_SIZE - 1]++;
+        }
+    }
+
+    if (_prefixes != NULL) {
+        for (u32 slot = 0; slot < PREFIX_TABLE_SIZE; slot++) {
+            if (_prefixes[slot] != NULL) {
+                stats.shared_prefixes++;
+            }
+        }
+    }
+
+    if (_kernel_stacks != NULL) {
+        for (u32 slot = 0; slot < KERNEL_TABLE_SIZE; slot++) {
+            if (_kernel_stacks[slot] != NULL) {
+                stats.kernel_stacks++;
+            }
+        }
+    }
+}
+
+u64* CallTraceStorage::hashAt(CallTraceShard* shard, u32 id) {
+    u32 segment = segmentOf(id);
+    char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+    return base == NULL ? NULL : (u64*)base + (id - segmentStart(segment));
+}
+
+CallTraceSample* CallTraceStorage::sampleAt(CallTraceShard* shard, u32 id) {
+    u32 segment = segmentOf(id);
+    char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+    if (base == NULL) {
+        return NULL;
+    }
+    u32 count = INITIAL_CAPACITY << segment;
+    return (CallTraceSample*)((u64*)base + count) + (id - segmentStart(segment));
+}
+
+SampleLink* CallTraceStorage::linkAt(CallTraceShard* shard, u32 id) {
+    u32 segment = segmentOf(id);
+    char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+    u32 count = INITIAL_CAPACITY << segment;
+    return (SampleLink*)((CallTraceSample*)((u64*)base + count) + count) + (id - segmentStart(segment));
+}
+
+// Called after the sample counters are updated, so that the next merge sees the new values
+void CallTraceStorage::markChanged(CallTraceShard* shard, u32 id) {
+    u32 segment = segmentOf(id);
+    char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+    setBit(changedBits(base, segment), id - segmentStart(segment));
+}
+
+// Same as markChanged, but also makes the slot visible to the next collectTraces
+void CallTraceStorage::markSampled(CallTraceShard* shard, u32 id) {
+    u32 segment = segmentOf(id);
+    char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+    setBit(changedBits(base, segment), id - segmentStart(segment));
+    setBit(sampledBits(base, segment), id - segmentStart(segment));
+}
+
+// Reserves a new local id with the given hash; returns 0 if the shard is exhausted
+u32 CallTraceStorage::allocateId(CallTraceShard* shard, u64 hash) {
+    // Fill is guarded by the profiler locks, so taking from the free list needs no ABA protection
+    int free_index;
+    if (shard->free_count > 0 && (free_index = __sync_sub_and_fetch(&shard->free_count, 1)) >= 0) {
+        u32 id = shard->free_ids[free_index];
+        *hashAt(shard, id) = hash;
+        return id;
+    }
+
+    if (shard->next_id >= MAX_LOCAL_ID) {
+        return 0;
+    }
+
+    u32 id = atomicInc(shard->next_id);
+    if (id >= MAX_LOCAL_ID) {
+        return 0;
+    }
+
+    u32 segment = segmentOf(id);
+    if (shard->segments[segment] == NULL) {
+        char* base = (char*)allocateArena(segmentSize(segment));
+        if (base == NULL) {
+            return 0;
+        }
+        if (!__sync_bool_compare_and_swap(&shard->segments[segment], (char*)NULL, base)) {
+            OS::safeFree(base, segmentSize(segment));
+        }
+    }
+
+    *hashAt(shard, id) = hash;
+    return id;
+}
+
+u32 CallTraceStorage::findId(CallTraceShard* shard, LongHashTable* table, u64 hash) {
+    u32* ids = table->ids();
+    u32 capacity = table->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    u32 id;
+    while ((id = __atomic_load_n(&ids[slot], __ATOMIC_ACQUIRE)) != 0) {
+        if (*hashAt(shard, id) == hash) {
+            return id;
+        }
+        if (++step >= capacity) {
+            break;
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+    return 0;
+}
+
+// Copies an existing id into the table unless an entry with the same hash is already there
+void CallTraceStorage::insertId(CallTraceShard* shard, LongHashTable* table, u64 hash, u32 id) {
+    u32* ids = table->ids();
+    u32 capacity = table->capacity();
+    u32 slot = hash & (capacity - 1);
+    u32 step = 0;
+
+    u32 existing;
+    while ((existing = __atomic_load_n(&ids[slot], __ATOMIC_ACQUIRE)) == 0 || *hashAt(shard, existing) != hash) {
+        if (existing == 0) {
+            if (!__sync_bool_compare_and_swap(&ids[slot], 0, id)) {
+                continue;
+            }
+            if (table->incSize() == capacity * 3 / 4) {
+                grow(shard, table);
+            }
+            return;
+        }
+        if (++step >= capacity) {
+            return;
+        }
+        slot = (slot + step) & (capacity - 1);
+    }
+}
+
+// Moves one batch of entries from the source table; returns false if there is nothing left to claim
+bool CallTraceStorage::migrate(CallTraceShard* shard, LongHashTable* table, LongHashTable* source) {
+    u32 source_capacity = source->capacity();
+    u32 start = table->claimBatch(source_capacity);
+    if (start >= source_capacity) {
+        return false;
+    }
+
+    u32 end = start + MIGRATION_BATCH < source_capacity ? start + MIGRATION_BATCH : source_capacity;
+    u32* ids = source->ids();
+    for (u32 slot = start; slot < end; slot++) {
+        u32 id = __atomic_load_n(&ids[slot], __ATOMIC_ACQUIRE);
+        if (id != 0) {
+            insertId(shard, table, *hashAt(shard, id), id);
+        }
+    }
+
+    table->completeBatch(end - start, source_capacity);
+    return true;
+}
+
+void CallTraceStorage::grow(CallTraceShard* shard, LongHashTable* table) {
+    u32 capacity = table->capacity();
+    if (capacity >= MAX_CAPACITY) {
+        return;
+    }
+
+    // By the time the new table reaches its load factor, migration into the old one is long over
+    void* memory = allocateArena(LongHashTable::getSize(capacity * 2));
+    LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2, memory);
+    if (new_table != NULL && !__sync_bool_compare_and_swap(&shard->table, table, new_table)) {
+        new_table->destroy();
+    }
+}
+
+// Visits only the slots sampled since the previous call, so the cost depends on
+// the number of traces in the current JFR chunk rather than on the whole history
+void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map, std::vector<std::pair<u64, u32> >* samples) {
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        for (u32 segment = 0; segment < MAX_TRACE_SEGMENTS; segment++) {
+            char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+            if (base == NULL) {
+                break;
+            }
+
+            u64* bits = sampledBits(base, segment);
+            u32 words = (INITIAL_CAPACITY << segment) / 64;
+            for (u32 w = 0; w < words; w++) {
+                if (__atomic_load_n(&bits[w], __ATOMIC_RELAXED) == 0) continue;
+
+                for (u64 word = __sync_fetch_and_and(&bits[w], 0); word != 0; word &= word - 1) {
+                    u32 id = segmentStart(segment) + w * 64 + __builtin_ctzll(word);
+                    CallTraceSample* s = sampleAt(shard, id);
+                    u64 sample_count = loadAcquire(s->samples);
+                    if (sample_count != 0) {
+                        // Reset samples to avoid duplication of call traces between JFR chunks
+                        s->samples = 0;
+                        markChanged(shard, id);
+                        CallTrace* trace = s->acquireTrace();
+                        if (trace != NULL) {
+                            map[i << SHARD_SHIFT | id] = trace;
+                            if (samples != NULL) {
+                                samples->push_back(std::make_pair(sample_count, i << SHARD_SHIFT | id));
+                            }
+                        }
+                    }
                 }
             }
         }
@@ -139,33 +519,173 @@ void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
 }
 
 void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
-
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
-                samples.push_back(&values[slot]);
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        u32 max_id = __atomic_load_n(&shard->next_id, __ATOMIC_ACQUIRE);
+        for (u32 id = 1; id < max_id && id < MAX_LOCAL_ID; id++) {
+            CallTraceSample* s = sampleAt(shard, id);
+            if (s == NULL) {
+                id = segmentStart(segmentOf(id) + 1) - 1;
+                continue;
             }
+            samples.push_back(s);
         }
     }
 }
 
-void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
+// Merges samples of the same call trace recorded in different shards.
+// Only the slots changed since the previous call are visited: a new slot is linked
+// to the merged sample with the same hash, and every affected merged sample is recomputed
+// from its linked slots. The result remains valid until the next call or clear().
+const std::vector<CallTraceSample>& CallTraceStorage::mergeSamples() {
+    std::vector<u32> changed;
+    std::vector<bool> is_changed(_merged.size());
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && values[slot].acquireTrace() != NULL) {
-                map[keys[slot]] += values[slot];
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        for (u32 segment = 0; segment < MAX_TRACE_SEGMENTS; segment++) {
+            char* base = __atomic_load_n(&shard->segments[segment], __ATOMIC_ACQUIRE);
+            if (base == NULL) {
+                break;
             }
+
+            u64* bits = changedBits(base, segment);
+            u32 words = (INITIAL_CAPACITY << segment) / 64;
+            for (u32 w = 0; w < words; w++) {
+                if (__atomic_load_n(&bits[w], __ATOMIC_RELAXED) == 0) continue;
+
+                for (u64 word = __sync_fetch_and_and(&bits[w], 0); word != 0; word &= word - 1) {
+                    u32 id = segmentStart(segment) + w * 64 + __builtin_ctzll(word);
+                    SampleLink* link = linkAt(shard, id);
+                    if (link->merged == 0) {
+                        if (sampleAt(shard, id)->acquireTrace() == NULL) {
+                            // The trace is still being stored by put(); retry on the next merge
+                            markChanged(shard, id);
+                            continue;
+                        }
+                        u32& index = _merged_index[*hashAt(shard, id)];
+                        if (index == 0) {
+                            CallTraceSample empty = {NULL, 0, 0};
+                            _merged.push_back(empty);
+                            _merged_heads.push_back(0);
+                            is_changed.push_back(false);
+                            index = _merged.size();
+                        }
+                        link->merged = index;
+                        link->next = _merged_heads[index - 1];
+                        _merged_heads[index - 1] = i << SHARD_SHIFT | id;
+                    }
+                    if (!is_changed[link->merged - 1]) {
+                        is_changed[link->merged - 1] = true;
+                        changed.push_back(link->merged - 1);
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t k = 0; k < changed.size(); k++) {
+        CallTraceSample& m = _merged[changed[k]];
+        m.samples = 0;
+        m.counter = 0;
+        for (u32 global_id = _merged_heads[changed[k]]; global_id != 0; ) {
+            CallTraceShard* shard = &_shards[global_id >> SHARD_SHIFT];
+            u32 id = global_id & MAX_LOCAL_ID;
+            m += *sampleAt(shard, id);
+            global_id = linkAt(shard, id)->next;
+        }
+    }
+
+    return _merged;
+}
+
+size_t CallTraceStorage::snapshot() {
+    mergeSamples();
+
+    _baseline.clear();
+    for (std::map<u64, u32>::const_iterator it = _merged_index.begin(); it != _merged_index.end(); ++it) {
+        const CallTraceSample& s = _merged[it->second - 1];
+        if (s.samples != 0 || s.counter != 0) {
+            CallTraceSample& b = _baseline[it->first];
+            b.trace = NULL;
+            b.samples = s.samples;
+            b.counter = s.counter;
         }
     }
+    return _baseline.size();
+}
+
+void CallTraceStorage::collectBaselines(std::vector<CallTraceSample>& baselines) {
+    CallTraceSample empty = {NULL, 0, 0};
+    baselines.assign(_merged.size(), empty);
+
+    // Both maps are ordered by hash, so they are joined in a single pass
+    std::map<u64, CallTraceSample>::const_iterator b = _baseline.begin();
+    for (std::map<u64, u32>::const_iterator it = _merged_index.begin(); it != _merged_index.end(); ++it) {
+        while (b != _baseline.end() && b->first < it->first) ++b;
+        if (b == _baseline.end()) break;
+        if (b->first == it->first) {
+            baselines[it->second - 1] = b->second;
+        }
+    }
+}
+
+void CallTraceStorage::resetMerged() {
+    _merged.clear();
+    _merged_heads.clear();
+    _merged_index.clear();
 }
 
+// Frames are read as raw words; may_alias keeps the compiler from reordering them with frame stores
+typedef u64 __attribute__((may_alias)) frame_word_t;
+typedef u32 __attribute__((may_alias)) frame_half_t;
+
+#ifdef __SIZEOF_INT128__
+
+// 64x64->128 bit multiply folded to 64 bits, as used by wyhash and MUM hash
+static inline u64 mum(u64 a, u64 b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (u64)r ^ (u64)(r >> 64);
+}
+
+// Every 16 bytes of the stack are mixed by a single wide multiplication instead of six
+// 64-bit ones in MurmurHash64A. Long stacks are hashed in 2 independent lanes,
+// so that consecutive multiplications do not wait for each other.
+u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
+    const u64 P0 = 0xa0761d6478bd642fULL;
+    const u64 P1 = 0xe7037ed1a0b428dbULL;
+    const u64 P2 = 0x8ebc6af09c88c6e3ULL;
+    const u64 P3 = 0x589965cc75374cc3ULL;
+
+    u64 len = num_frames * sizeof(ASGCT_CallFrame);
+    u64 h1 = len ^ P0;
+    u64 h2 = len ^ P3;
+
+    const frame_word_t* data = (const frame_word_t*)frames;
+    const frame_word_t* end = data + len / 8;
+
+    while (end - data >= 4) {
+        h1 = mum(data[0] ^ P1, data[1] ^ h1);
+        h2 = mum(data[2] ^ P2, data[3] ^ h2);
+        data += 4;
+    }
+    if (end - data >= 2) {
+        h1 = mum(data[0] ^ P1, data[1] ^ h1);
+        data += 2;
+    }
+    if (data != end) {
+        h2 = mum(data[0] ^ P2, h2 ^ P1);
+        data++;
+    }
+    if (len & 4) {
+        h2 = mum(*(const frame_half_t*)data ^ P3, h2 ^ P2);
+    }
+
+    return mum(h1 ^ P3, mum(h2 ^ P1, len ^ P2));
+}
+
+#else
+
 // Adaptation of MurmurHash64A by Austin Appleby
 u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     const u64 M = 0xc6a4a7935bd1e995ULL;
@@ -174,8 +694,8 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     int len = num_frames * sizeof(ASGCT_CallFrame);
     u64 h = len * M;
 
-    const u64* data = (const u64*)frames;
-    const u64* end = data + len / 8;
+    const frame_word_t* data = (const frame_word_t*)frames;
+    const frame_word_t* end = data + len / 8;
 
     while (data != end) {
         u64 k = *data++;
@@ -187,7 +707,7 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     }
 
     if (len & 4) {
-        h ^= *(u32*)data;
+        h ^= *(const frame_half_t*)data;
         h *= M;
     }
 
@@ -198,67 +718,190 @@ u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
     return h;
 }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+#endif // __SIZEOF_INT128__
+
+CallTrace* CallTraceStorage::storeFrames(CallTrace* parent, int num_frames, int own_frames, ASGCT_CallFrame* frames,
+                                        CallTrace* kernel) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    int slots = kernel != NULL ? own_frames + 1 : own_frames;
+    CallTrace* buf = (CallTrace*)_active_allocator->alloc(header_size + slots * sizeof(ASGCT_CallFrame));
     if (buf != NULL) {
         buf->num_frames = num_frames;
+        buf->kernel_frames = kernel != NULL ? kernel->num_frames : 0;
+        buf->parent = parent;
+        ASGCT_CallFrame* dst = buf->frames;
+        if (kernel != NULL) {
+            dst->bci = 0;
+            dst->method_id = (jmethodID)kernel;
+            dst++;
+        }
         // Do not use memcpy inside signal handler
-        for (int i = 0; i < num_frames; i++) {
-            buf->frames[i] = frames[i];
+        for (int i = 0; i < own_frames; i++) {
+            dst[i] = frames[i];
         }
     }
     return buf;
 }
 
-CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
-    u64* keys = table->keys();
-    u32 capacity = table->capacity();
-    u32 slot = hash & (capacity - 1);
-    u32 step = 0;
+static bool samePrefix(CallTrace* prefix, CallTrace* parent, int num_frames, ASGCT_CallFrame* frames) {
+    if (prefix->parent != parent || prefix->num_frames != num_frames) {
+        return false;
+    }
+    for (int i = 0; i < PREFIX_BLOCK; i++) {
+        if (prefix->frames[i].bci != frames[i].bci || prefix->frames[i].method_id != frames[i].method_id) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    while (keys[slot] != hash) {
-        if (keys[slot] == 0) {
-            return NULL;
+// Finds or creates a shared block of PREFIX_BLOCK frames on top of the given parent
+CallTrace* CallTraceStorage::storePrefix(CallTrace* parent, int num_frames, ASGCT_CallFrame* frames) {
+    u64 hash = calcHash(PREFIX_BLOCK, frames) ^ ((u64)(uintptr_t)parent * 0xc6a4a7935bd1e995ULL);
+    u32 slot = hash & (PREFIX_TABLE_SIZE - 1);
+    CallTrace* created = NULL;
+
+    for (u32 step = 1; step <= PREFIX_PROBE_LIMIT; slot = (slot + step++) & (PREFIX_TABLE_SIZE - 1)) {
+        CallTrace* prefix = __atomic_load_n(&_prefixes[slot], __ATOMIC_ACQUIRE);
+        if (prefix == NULL) {
+            if (created == NULL && (created = storeFrames(parent, num_frames, PREFIX_BLOCK, frames)) == NULL) {
+                return NULL;
+            }
+            if (__sync_bool_compare_and_swap(&_prefixes[slot], (CallTrace*)NULL, created)) {
+                return created;
+            }
+            prefix = _prefixes[slot];
         }
-        if (++step >= capacity) {
-            return NULL;
+        if (samePrefix(prefix, parent, num_frames, frames)) {
+            return prefix;
+        }
+    }
+
+    // The table is too crowded: keep the block private to this trace
+    return created != NULL ? created : storeFrames(parent, num_frames, PREFIX_BLOCK, frames);
+}
+
+static bool isKernelFrame(const ASGCT_CallFrame& frame) {
+    if (frame.bci != BCI_NATIVE_FRAME || frame.method_id == NULL) {
+        return false;
+    }
+    // Kernel symbols are marked with _[k] suffix
+    const char* name = (const char*)frame.method_id;
+    const char* end = name;
+    while (*end) end++;
+    return end - name > 4 && end[-4] == '_' && end[-3] == '[' && end[-2] == 'k' && end[-1] == ']';
+}
+
+static bool sameFrames(CallTrace* stack, int num_frames, ASGCT_CallFrame* frames) {
+    if (stack->num_frames != num_frames) {
+        return false;
+    }
+    for (int i = 0; i < num_frames; i++) {
+        if (stack->frames[i].bci != frames[i].bci || stack->frames[i].method_id != frames[i].method_id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds or creates a kernel stack shared by all traces that start with the same kernel frames.
+// Returns NULL if the table is too crowded, in which case the frames are kept inline.
+CallTrace* CallTraceStorage::storeKernelStack(int num_frames, ASGCT_CallFrame* frames) {
+    u32 slot = calcHash(num_frames, frames) & (KERNEL_TABLE_SIZE - 1);
+    CallTrace* created = NULL;
+
+    for (u32 step = 1; step <= PREFIX_PROBE_LIMIT; slot = (slot + step++) & (KERNEL_TABLE_SIZE - 1)) {
+        CallTrace* stack = __atomic_load_n(&_kernel_stacks[slot], __ATOMIC_ACQUIRE);
+        if (stack == NULL) {
+            if (created == NULL && (created = storeFrames(NULL, num_frames, num_frames, frames)) == NULL) {
+                return NULL;
+            }
+            if (__sync_bool_compare_and_swap(&_kernel_stacks[slot], (CallTrace*)NULL, created)) {
+                return created;
+            }
+            stack = _kernel_stacks[slot];
+        }
+        if (sameFrames(stack, num_frames, frames)) {
+            return stack;
         }
-        slot = (slot + step) & (capacity - 1);
     }
 
-    return table->values()[slot].trace;
+    // A stack created for a lost race is left in the allocator; this is as rare as it is harmless
+    return NULL;
 }
 
-u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
+CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+    // Syscall paths are repeated on top of many different user stacks
+    int kernel_frames = 0;
+    if (_kernel_stacks != NULL) {
+        while (kernel_frames < num_frames && isKernelFrame(frames[kernel_frames])) {
+            kernel_frames++;
+        }
+    }
+
+    CallTrace* kernel = NULL;
+    if (kernel_frames >= MIN_KERNEL_FRAMES && kernel_frames < num_frames) {
+        kernel = storeKernelStack(kernel_frames, frames);
+    }
+    if (kernel == NULL) {
+        kernel_frames = 0;
+    }
+
+    // Build the chain of shared blocks from the root, leaving at least one user frame in the trace itself
+    int user_frames = num_frames - kernel_frames;
+    int shared_frames = _prefixes == NULL ? 0 : (user_frames - 1) / PREFIX_BLOCK * PREFIX_BLOCK;
+    CallTrace* parent = NULL;
+    for (int depth = PREFIX_BLOCK; depth <= shared_frames; depth += PREFIX_BLOCK) {
+        if ((parent = storePrefix(parent, depth, frames + num_frames - depth)) == NULL) {
+            return NULL;
+        }
+    }
+    return storeFrames(parent, num_frames, user_frames - shared_frames, frames + kernel_frames, kernel);
+}
+
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard_index) {
     u64 hash = calcHash(num_frames, frames);
 
-    LongHashTable* table = _current_table;
-    u64* keys = table->keys();
+    shard_index %= CALL_TRACE_SHARDS;
+    CallTraceShard* shard = &_shards[shard_index];
+    LongHashTable* table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+    LongHashTable* source = table->source();
+    if (source != NULL) {
+        // Help moving the old table, so that lookups soon need to probe just one table
+        migrate(shard, table, source);
+    }
+
+    u32* ids = table->ids();
     u32 capacity = table->capacity();
     u32 slot = hash & (capacity - 1);
     u32 step = 0;
+    u32 new_id = 0;
+
+    u32 id;
+    while ((id = __atomic_load_n(&ids[slot], __ATOMIC_ACQUIRE)) == 0 || *hashAt(shard, id) != hash) {
+        if (id == 0) {
+            // The trace may exist in the table that is still being migrated
+            bool found = false;
+            if (new_id == 0 && source != NULL && (new_id = findId(shard, source, hash)) != 0) {
+                found = true;
+            } else if (new_id == 0 && (limitReached() || (new_id = allocateId(shard, hash)) == 0)) {
+                atomicInc(_overflow);
+                return OVERFLOW_TRACE_ID;
+            }
 
-    while (keys[slot] != hash) {
-        if (keys[slot] == 0) {
-            if (!__sync_bool_compare_and_swap(&keys[slot], 0, hash)) {
+            if (!__sync_bool_compare_and_swap(&ids[slot], 0, new_id)) {
                 continue;
             }
 
-            // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
             if (table->incSize() == capacity * 3 / 4) {
-                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
-                if (new_table != NULL) {
-                    __sync_bool_compare_and_swap(&_current_table, table, new_table);
-                }
+                grow(shard, table);
             }
 
-            // Migrate from a previous table to save space
-            CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
-            if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+            // A racing insertion of the same trace may rarely leave an unused id behind; this is harmless
+            if (!found) {
+                sampleAt(shard, new_id)->setTrace(storeCallTrace(num_frames, frames));
             }
-            table->values()[slot].setTrace(trace);
+            id = new_id;
             break;
         }
 
@@ -272,42 +915,174 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
     }
 
     if (counter != 0) {
-        CallTraceSample& s = table->values()[slot];
-        atomicInc(s.samples);
-        atomicInc(s.counter, counter);
+        CallTraceSample* s = sampleAt(shard, id);
+        atomicInc(s->samples);
+        atomicInc(s->counter, counter);
+        markSampled(shard, id);
     }
 
-    return capacity - (INITIAL_CAPACITY - 1) + slot;
+    return shard_index << SHARD_SHIFT | id;
 }
 
 void CallTraceStorage::add(u32 call_trace_id, u64 samples, u64 counter) {
-    if (call_trace_id > capacity()) {  // this also covers call_trace_id == OVERFLOW_TRACE_ID
+    CallTraceShard* shard = &_shards[(call_trace_id >> SHARD_SHIFT) % CALL_TRACE_SHARDS];
+    u32 id = call_trace_id & MAX_LOCAL_ID;
+    if (id == 0 || id >= MAX_LOCAL_ID || id >= shard->next_id) {  // this also covers call_trace_id == OVERFLOW_TRACE_ID
         return;
     }
 
-    call_trace_id += (INITIAL_CAPACITY - 1);
-    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        if (call_trace_id >= table->capacity()) {
-            CallTraceSample& s = table->values()[call_trace_id - table->capacity()];
-            atomicInc(s.samples, samples);
-            atomicInc(s.counter, counter);
-            break;
-        }
+    CallTraceSample* s = sampleAt(shard, id);
+    if (s != NULL) {
+        atomicInc(s->samples, samples);
+        atomicInc(s->counter, counter);
+        markSampled(shard, id);
     }
 }
 
 void CallTraceStorage::resetCounters() {
-     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
-        CallTraceSample* values = table->values();
-        u32 capacity = table->capacity();
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        u32 max_id = __atomic_load_n(&shard->next_id, __ATOMIC_ACQUIRE);
+        for (u32 id = 1; id < max_id && id < MAX_LOCAL_ID; id++) {
+            CallTraceSample* s = sampleAt(shard, id);
+            if (s == NULL) {
+                id = segmentStart(segmentOf(id) + 1) - 1;
+                continue;
+            }
+            storeRelease(s->samples, 0);
+            storeRelease(s->counter, 0);
+        }
+    }
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0) {
-                CallTraceSample& s = values[slot];
-                storeRelease(s.samples, 0);
-                storeRelease(s.counter, 0);
+    for (size_t i = 0; i < _merged.size(); i++) {
+        _merged[i].samples = 0;
+        _merged[i].counter = 0;
+    }
+    // Deltas against counters from before the reset would be meaningless
+    _baseline.clear();
+}
+
+// Large hash tables and sample segments may be backed by huge pages to reduce TLB misses in signal handlers
+void* CallTraceStorage::allocateArena(size_t size) {
+    if (!_huge_pages) {
+        return OS::safeAlloc(size);
+    }
+
+    int backing = PAGES_REGULAR;
+    void* result = OS::safeAllocHuge(size, &backing);
+    if (result != NULL) {
+        __sync_fetch_and_or(&_backing, backing);
+    }
+    return result;
+}
+
+void CallTraceStorage::setHugePages(bool enabled) {
+    if (enabled) {
+        // Initialize before the first allocation from a signal handler
+        OS::getHugePageSize();
+    }
+    _huge_pages = enabled;
+    _allocator.setHugePages(enabled);
+    _spare_allocator.setHugePages(enabled);
+}
+
+int CallTraceStorage::pageBacking() {
+    return _backing | _allocator.backing() | _spare_allocator.backing();
+}
+
+void CallTraceStorage::setMemoryLimit(size_t limit) {
+    _memory_limit = limit;
+}
+
+void CallTraceStorage::setFrozen(bool frozen) {
+    _frozen = frozen;
+}
+
+bool CallTraceStorage::limitReached() {
+    return _frozen || (_memory_limit != 0 && _active_allocator->usedMemory() > _memory_limit);
+}
+
+// Eviction is worth it when the storage approaches the limit and has grown since the last eviction
+bool CallTraceStorage::needsEviction() {
+    if (_memory_limit == 0) {
+        return false;
+    }
+    size_t used = _active_allocator->usedMemory();
+    return used >= _memory_limit / 4 * 3 && used >= _evicted_at + CALL_TRACE_CHUNK;
+}
+
+// Drops traces that have not been sampled since the last collectTraces() and recycles their ids.
+// Surviving traces are copied to the spare allocator, then the old one is released at once.
+// The caller must ensure no concurrent put() or add(), e.g. by holding all profiler locks.
+size_t CallTraceStorage::evictColdTraces() {
+    LinearAllocator* old_allocator = _active_allocator;
+    _active_allocator = old_allocator == &_allocator ? &_spare_allocator : &_allocator;
+
+    if (_prefixes != NULL) {
+        memset((void*)_prefixes, 0, PREFIX_TABLE_SIZE * sizeof(CallTrace*));
+    }
+    if (_kernel_stacks != NULL) {
+        memset((void*)_kernel_stacks, 0, KERNEL_TABLE_SIZE * sizeof(CallTrace*));
+    }
+
+    // Merged samples refer to evicted traces and recycled ids; they are rebuilt from the surviving slots
+    resetMerged();
+
+    TraceFrames trace_frames;
+    size_t evicted = 0;
+
+    for (u32 i = 0; i < CALL_TRACE_SHARDS; i++) {
+        CallTraceShard* shard = &_shards[i];
+        LongHashTable* table = shard->table;
+        table->releasePrev();
+        table->clear();
+
+        for (u32 segment = 0; segment < MAX_TRACE_SEGMENTS && shard->segments[segment] != NULL; segment++) {
+            memset(changedBits(shard->segments[segment], segment), 0, (INITIAL_CAPACITY << segment) / 8);
+        }
+
+        u32 max_id = shard->next_id < MAX_LOCAL_ID ? shard->next_id : MAX_LOCAL_ID;
+        free(shard->free_ids);
+        shard->free_ids = (u32*)malloc(max_id * sizeof(u32));
+        int free_count = 0;
+
+        for (u32 id = 1; id < max_id; id++) {
+            CallTraceSample* s = sampleAt(shard, id);
+            if (s == NULL) {
+                id = segmentStart(segmentOf(id) + 1) - 1;
+                continue;
+            }
+
+            SampleLink* link = linkAt(shard, id);
+            link->merged = 0;
+            link->next = 0;
+
+            CallTrace* trace = s->trace;
+            if (trace != NULL && s->samples != 0) {
+                trace = storeCallTrace(trace->num_frames, trace_frames.get(trace));
+                if (trace != NULL) {
+                    s->trace = trace;
+                    insertId(shard, shard->table, *hashAt(shard, id), id);
+                    markChanged(shard, id);
+                    continue;
+                }
+            }
+
+            if (s->trace != NULL) {
+                evicted++;
+            }
+            s->trace = NULL;
+            s->samples = 0;
+            s->counter = 0;
+            if (shard->free_ids != NULL) {
+                shard->free_ids[free_count++] = id;
             }
         }
+
+        shard->free_count = free_count;
     }
+
+    old_allocator->clear();
+    _evicted_at = _active_allocator->usedMemory();
+    return evicted;
 }
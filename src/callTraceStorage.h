@@ -14,10 +14,56 @@
 
 
 class LongHashTable;
+struct SampleLink;
 
+// Frames closer to the root are stored in parent traces shared by the stacks with the same bottom part.
+// The topmost frame is always stored inline, unless the trace starts with a kernel stack:
+// kernel frames are interned in a separate table, and the first slot of a trace refers to them.
 struct CallTrace {
     int num_frames;
+    int kernel_frames;
+    CallTrace* parent;
     ASGCT_CallFrame frames[1];
+
+    CallTrace* kernelStack() const {
+        return kernel_frames == 0 ? NULL : (CallTrace*)frames[0].method_id;
+    }
+
+    // Frames that follow the kernel stack reference in this trace
+    const ASGCT_CallFrame* userFrames() const {
+        return kernel_frames == 0 ? frames : frames + 1;
+    }
+
+    int ownFrames() const {
+        return (parent == NULL ? num_frames : num_frames - parent->num_frames) - kernel_frames;
+    }
+
+    const ASGCT_CallFrame& top() const {
+        return kernel_frames == 0 ? frames[0] : kernelStack()->frames[0];
+    }
+};
+
+// Presents all frames of a CallTrace as a contiguous array, starting from the topmost frame
+class TraceFrames {
+  private:
+    std::vector<ASGCT_CallFrame> _buf;
+
+  public:
+    ASGCT_CallFrame* get(CallTrace* trace) {
+        if (trace->parent == NULL && trace->kernel_frames == 0) {
+            return trace->frames;
+        }
+        _buf.clear();
+        for (; trace != NULL; trace = trace->parent) {
+            CallTrace* kernel = trace->kernelStack();
+            if (kernel != NULL) {
+                _buf.insert(_buf.end(), kernel->frames, kernel->frames + kernel->num_frames);
+            }
+            const ASGCT_CallFrame* own = trace->userFrames();
+            _buf.insert(_buf.end(), own, own + trace->ownFrames());
+        }
+        return _buf.data();
+    }
 };
 
 struct CallTraceSample {
@@ -41,31 +87,118 @@ struct CallTraceSample {
     }
 };
 
+const u32 MAX_TRACE_SEGMENTS = 16;
+const int PROBE_HISTOGRAM_SIZE = 8;
+
+struct CallTraceStorageStats {
+    u64 capacity;
+    u64 size;
+    u64 overflow;
+    u64 shared_prefixes;
+    u64 kernel_stacks;
+    float max_load;
+    u32 max_probe;
+    u64 total_probes;
+    // Number of entries found after 1, 2, 3-4, 5-8, ..., 65+ probes
+    u64 probes[PROBE_HISTOGRAM_SIZE];
+};
+const u32 CALL_TRACE_SHARDS = 16;
+
+// Samples from different threads are spread over independent shards to avoid
+// contention on hash table slots and counters; shards are merged at dump time.
+struct CallTraceShard {
+    LongHashTable* volatile table;
+    // Samples are indexed by local id; segment N holds twice as many records as segment N-1
+    char* volatile segments[MAX_TRACE_SEGMENTS];
+    // Ids of evicted traces available for reuse
+    u32* free_ids;
+    volatile u32 next_id;
+    volatile int free_count;
+    // To avoid false sharing
+    char _padding[40];
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
 
     LinearAllocator _allocator;
-    LongHashTable* _current_table;
+    LinearAllocator _spare_allocator;
+    LinearAllocator* _active_allocator;
+    CallTraceShard _shards[CALL_TRACE_SHARDS];
+    CallTrace* volatile* _prefixes;
+    CallTrace* volatile* _kernel_stacks;
     u64 _overflow;
-
-    u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
+    size_t _memory_limit;
+    volatile bool _frozen;
+    size_t _evicted_at;
+    bool _huge_pages;
+    volatile int _backing;
+
+    // Samples merged across shards, updated incrementally from the slots changed since the last merge
+    std::vector<CallTraceSample> _merged;
+    std::vector<u32> _merged_heads;
+    std::map<u64, u32> _merged_index;
+    // Counters of merged samples at the last snapshot, by trace hash
+    std::map<u64, CallTraceSample> _baseline;
+
+    bool limitReached();
+    void* allocateArena(size_t size);
+
+    CallTrace* storeFrames(CallTrace* parent, int num_frames, int own_frames, ASGCT_CallFrame* frames,
+                           CallTrace* kernel = NULL);
+    CallTrace* storePrefix(CallTrace* parent, int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* storeKernelStack(int num_frames, ASGCT_CallFrame* frames);
     CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
-    CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+
+    u64* hashAt(CallTraceShard* shard, u32 id);
+    CallTraceSample* sampleAt(CallTraceShard* shard, u32 id);
+    SampleLink* linkAt(CallTraceShard* shard, u32 id);
+    void markChanged(CallTraceShard* shard, u32 id);
+    void markSampled(CallTraceShard* shard, u32 id);
+    void resetMerged();
+    u32 allocateId(CallTraceShard* shard, u64 hash);
+    u32 findId(CallTraceShard* shard, LongHashTable* table, u64 hash);
+    void insertId(CallTraceShard* shard, LongHashTable* table, u64 hash, u32 id);
+    bool migrate(CallTraceShard* shard, LongHashTable* table, LongHashTable* source);
+    void grow(CallTraceShard* shard, LongHashTable* table);
+    void freeSegments(CallTraceShard* shard);
 
   public:
+    static u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
+
     CallTraceStorage();
     ~CallTraceStorage();
 
     void clear();
     u32 capacity();
     size_t usedMemory();
+    size_t frameMemory(int node);
+    void stats(CallTraceStorageStats& stats);
+
+    void setHugePages(bool enabled);
+    int pageBacking();
 
-    void collectTraces(std::map<u32, CallTrace*>& map);
+    void setMemoryLimit(size_t limit);
+    // A frozen storage counts samples of known traces only, new ones go to the overflow trace
+    void setFrozen(bool frozen);
+    bool needsEviction();
+    size_t evictColdTraces();
+
+    // Optionally reports the number of samples of every collected trace since the previous call
+    void collectTraces(std::map<u32, CallTrace*>& map, std::vector<std::pair<u64, u32> >* samples = NULL);
     void collectSamples(std::vector<CallTraceSample*>& samples);
-    void collectSamples(std::map<u64, CallTraceSample>& map);
+    const std::vector<CallTraceSample>& mergeSamples();
+
+    // Remembers counters of all merged samples; returns the number of traces in the snapshot
+    size_t snapshot();
+    bool hasSnapshot() const {
+        return !_baseline.empty();
+    }
+    // Snapshot counters of the samples returned by the last mergeSamples(), at the same indices
+    void collectBaselines(std::vector<CallTraceSample>& baselines);
 
-    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard_index = 0);
     void add(u32 call_trace_id, u64 samples, u64 counter);
     void resetCounters();
 };
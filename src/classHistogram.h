@@ -0,0 +1,110 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CLASSHISTOGRAM_H
+#define _CLASSHISTOGRAM_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "arch.h"
+
+
+const int CLASS_HISTOGRAM_BITS = 15;
+const u32 CLASS_HISTOGRAM_CAPACITY = 1 << CLASS_HISTOGRAM_BITS;
+const u32 CLASS_HISTOGRAM_MAX_PROBES = 64;
+
+struct ClassHistogramEntry {
+    volatile u32 class_id;
+    volatile u64 samples;
+    volatile u64 bytes;
+};
+
+// Allocated bytes per class without stack traces. Open addressing table keyed by
+// class id, updated concurrently without locks; entries are never removed until reset.
+// Class id 0 stands for allocations of unknown classes.
+class ClassHistogram {
+  private:
+    ClassHistogramEntry* _entries;
+    ClassHistogramEntry _unknown;
+    volatile u64 _dropped;
+
+    ClassHistogramEntry* find(u32 class_id) {
+        if (class_id == 0) {
+            return &_unknown;
+        }
+
+        u32 slot = (class_id * 0x9e3779b9U) >> (32 - CLASS_HISTOGRAM_BITS);
+        for (u32 i = 0; i < CLASS_HISTOGRAM_MAX_PROBES; i++) {
+            ClassHistogramEntry* e = &_entries[slot];
+            u32 key = e->class_id;
+            if (key == class_id) {
+                return e;
+            } else if (key == 0) {
+                key = __sync_val_compare_and_swap(&e->class_id, 0, class_id);
+                if (key == 0 || key == class_id) {
+                    return e;
+                }
+            }
+            slot = (slot + 1) & (CLASS_HISTOGRAM_CAPACITY - 1);
+        }
+        return NULL;
+    }
+
+  public:
+    ClassHistogram() : _entries(NULL), _dropped(0) {
+        memset((void*)&_unknown, 0, sizeof(_unknown));
+    }
+
+    ~ClassHistogram() {
+        free(_entries);
+    }
+
+    // The table takes a few hundred KB, hence it is allocated on the first use only
+    bool init() {
+        if (_entries == NULL) {
+            _entries = (ClassHistogramEntry*)calloc(CLASS_HISTOGRAM_CAPACITY, sizeof(ClassHistogramEntry));
+        }
+        return _entries != NULL;
+    }
+
+    void reset() {
+        if (_entries != NULL) {
+            memset((void*)_entries, 0, CLASS_HISTOGRAM_CAPACITY * sizeof(ClassHistogramEntry));
+        }
+        memset((void*)&_unknown, 0, sizeof(_unknown));
+        _dropped = 0;
+    }
+
+    void add(u32 class_id, u64 bytes) {
+        ClassHistogramEntry* e = find(class_id);
+        if (e != NULL) {
+            atomicInc(e->samples);
+            atomicInc(e->bytes, bytes);
+        } else {
+            atomicInc(_dropped);
+        }
+    }
+
+    // Samples that did not fit in the table
+    u64 dropped() const {
+        return _dropped;
+    }
+
+    void collect(std::vector<ClassHistogramEntry>& entries) const {
+        if (_unknown.samples != 0) {
+            entries.push_back(_unknown);
+        }
+        if (_entries != NULL) {
+            for (u32 i = 0; i < CLASS_HISTOGRAM_CAPACITY; i++) {
+                if (_entries[i].samples != 0) {
+                    entries.push_back(_entries[i]);
+                }
+            }
+        }
+    }
+};
+
+#endif // _CLASSHISTOGRAM_H
@@ -0,0 +1,65 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CLASSIDCACHE_H
+#define _CLASSIDCACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "arch.h"
+
+
+const u32 CLASS_ID_CACHE_SIZE = 1024;
+
+// Direct-mapped cache of class ids by Klass*. Resolving a class name through JVM TI
+// for every sampled event may cost more than the event itself. Entries written by
+// concurrent threads may be torn; such entries fail the checksum and are treated as a miss.
+// Klass* of an unloaded class can be reused, so the cache is reset on profiler start.
+class ClassIdCache {
+  private:
+    struct Entry {
+        volatile uintptr_t klass;
+        volatile u32 value;
+        volatile uintptr_t checksum;
+    };
+
+    Entry _entries[CLASS_ID_CACHE_SIZE];
+
+    static uintptr_t checksum(uintptr_t klass, u32 value) {
+        return (klass ^ value) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    static u32 slot(uintptr_t klass) {
+        return (u32)(((u64)klass * 0x9e3779b97f4a7c15ULL) >> 48) & (CLASS_ID_CACHE_SIZE - 1);
+    }
+
+  public:
+    ClassIdCache() {
+        reset();
+    }
+
+    void reset() {
+        memset((void*)_entries, 0, sizeof(_entries));
+    }
+
+    // Returns the cached value, or 0 if there is none
+    u32 get(uintptr_t klass) const {
+        const Entry* e = &_entries[slot(klass)];
+        u32 value = e->value;
+        if (e->klass != klass || klass == 0 || e->checksum != checksum(klass, value)) {
+            return 0;
+        }
+        return value;
+    }
+
+    void put(uintptr_t klass, u32 value) {
+        Entry* e = &_entries[slot(klass)];
+        e->klass = klass;
+        e->value = value;
+        e->checksum = checksum(klass, value);
+    }
+};
+
+#endif // _CLASSIDCACHE_H
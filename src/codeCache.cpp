@@ -3,19 +3,83 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "codeCache.h"
 #include "dwarf.h"
 #include "os.h"
+#include "symbols.h"
 
 
+// Number of leading keys that are <= key; the loop has no data-dependent branches
+template <typename T>
+static inline int countKeysNotAbove(const T* keys, int count, T key) {
+    if (count == 0) {
+        return 0;
+    }
+    const T* base = keys;
+    while (count > 1) {
+        int half = count >> 1;
+        base = base[half] <= key ? base + half : base;
+        count -= half;
+    }
+    return (int)(base - keys) + (*base <= key ? 1 : 0);
+}
+
+static inline int searchIndexLength(int count) {
+    return (count + SEARCH_BLOCK_SIZE - 1) / SEARCH_BLOCK_SIZE;
+}
+
+// Symbol cache file: header, entries sorted by offset, then zero-terminated names
+const u32 SYMBOL_CACHE_MAGIC = 0x31435341;  // "ASC1"
+
+struct SymbolCacheHeader {
+    u32 magic;
+    u32 count;
+    u32 strings_size;
+    u32 reserved;
+};
+
+struct SymbolCacheEntry {
+    u64 offset;  // relative to the image base
+    u32 length;
+    u32 name;    // offset in the string pool
+};
+
+static int compareSymbolCacheEntries(const void* e1, const void* e2) {
+    u64 offset1 = ((const SymbolCacheEntry*)e1)->offset;
+    u64 offset2 = ((const SymbolCacheEntry*)e2)->offset;
+    return offset1 < offset2 ? -1 : offset1 > offset2 ? 1 : 0;
+}
+
+// Names of symbols are packed into chunks owned by their CodeCache instead of
+// being allocated one by one: a library may have hundreds of thousands of them
+const size_t MIN_NAME_CHUNK_SIZE = 4096;
+const size_t MAX_NAME_CHUNK_SIZE = 1024 * 1024;
+
+struct NameChunk {
+    NameChunk* next;
+    size_t capacity;
+    size_t used;
+    char data[0];
+};
+
 char* NativeFunc::create(const char* name, short lib_index) {
-    NativeFunc* f = (NativeFunc*)malloc(sizeof(NativeFunc) + 1 + strlen(name));
+    return create(name, lib_index, malloc(size(name)));
+}
+
+char* NativeFunc::create(const char* name, short lib_index, void* buf) {
+    NativeFunc* f = (NativeFunc*)buf;
     f->_lib_index = lib_index;
     f->_mark = 0;
+    f->_demangled = 0;
     return strcpy(f->_name, name);
 }
 
@@ -43,21 +107,52 @@ CodeCache::CodeCache(const char* name, short lib_index, bool imports_patchable,
     _imports_patchable = imports_patchable;
     _debug_symbols = false;
 
+    _deferred_file = NULL;
+    _deferred_base = NULL;
+
     _dwarf_table = NULL;
     _dwarf_table_length = 0;
+    _dwarf_rows = NULL;
+    _dwarf_row_count = 0;
+    _dwarf_index = NULL;
+
+    _dwarf_base = NULL;
+    _eh_frame_hdr = NULL;
+    _dwarf_pinned = false;
+    _dwarf_state = DWARF_LOADED;
 
     _capacity = INITIAL_CODE_CACHE_CAPACITY;
     _count = 0;
     _blobs = new CodeBlob[_capacity];
+    _blob_index = NULL;
+    _name_chunks = NULL;
 }
 
 CodeCache::~CodeCache() {
-    for (int i = 0; i < _count; i++) {
-        NativeFunc::destroy(_blobs[i]._name);
+    while (_name_chunks != NULL) {
+        NameChunk* next = _name_chunks->next;
+        free(_name_chunks);
+        _name_chunks = next;
     }
     NativeFunc::destroy(_name);
+    free(_deferred_file);
     delete[] _blobs;
+    delete[] _blob_index;
     free(_dwarf_table);
+    free(_dwarf_rows);
+    delete[] _dwarf_index;
+}
+
+void CodeCache::deferSymbols(const char* base, const char* file) {
+    _deferred_base = base;
+    _deferred_file = strdup(file);
+}
+
+// Called after the deferred symbols are added and sorted: from now on, lookups may see them
+void CodeCache::clearDeferredSymbols() {
+    char* file = _deferred_file;
+    __atomic_store_n(&_deferred_file, (char*)NULL, __ATOMIC_RELEASE);
+    free(file);
 }
 
 void CodeCache::expand() {
@@ -71,8 +166,30 @@ void CodeCache::expand() {
     delete[] old_blobs;
 }
 
-void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
-    char* name_copy = NativeFunc::create(name, _lib_index);
+char* CodeCache::createName(const char* name) {
+    // NativeFunc header is 2-byte aligned
+    size_t size = (NativeFunc::size(name) + 1) & ~(size_t)1;
+
+    NameChunk* chunk = _name_chunks;
+    if (chunk == NULL || chunk->used + size > chunk->capacity) {
+        size_t capacity = chunk == NULL ? MIN_NAME_CHUNK_SIZE
+                        : chunk->capacity < MAX_NAME_CHUNK_SIZE ? chunk->capacity * 2 : MAX_NAME_CHUNK_SIZE;
+        if (capacity < size) capacity = size;
+
+        chunk = (NameChunk*)malloc(sizeof(NameChunk) + capacity);
+        chunk->next = _name_chunks;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        _name_chunks = chunk;
+    }
+
+    char* result = NativeFunc::create(name, _lib_index, chunk->data + chunk->used);
+    chunk->used += size;
+    return result;
+}
+
+char* CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
+    char* name_copy = createName(name);
     // Replace non-printable characters
     for (char* s = name_copy; *s != 0; s++) {
         if (*s < ' ') *s = '?';
@@ -91,6 +208,7 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
     if (update_bounds) {
         updateBounds(start, end);
     }
+    return name_copy;
 }
 
 void CodeCache::updateBounds(const void* start, const void* end) {
@@ -103,10 +221,112 @@ void CodeCache::sort() {
 
     qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
 
+    delete[] _blob_index;
+    _blob_index = new const void*[searchIndexLength(_count)];
+    for (int i = 0; i < _count; i += SEARCH_BLOCK_SIZE) {
+        _blob_index[i / SEARCH_BLOCK_SIZE] = _blobs[i]._start;
+    }
+
     if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
     if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
 }
 
+bool CodeCache::readSymbolCache(const char* path, const char* base) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    void* addr = fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(SymbolCacheHeader)
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    const SymbolCacheHeader* header = (const SymbolCacheHeader*)addr;
+    const SymbolCacheEntry* entries = (const SymbolCacheEntry*)(header + 1);
+    const char* strings = (const char*)(entries + header->count);
+
+    // A truncated or foreign file is ignored and will be rewritten
+    bool valid = header->magic == SYMBOL_CACHE_MAGIC && header->strings_size > 0 &&
+                 (u64)st.st_size == sizeof(SymbolCacheHeader) + (u64)header->count * sizeof(SymbolCacheEntry) + header->strings_size &&
+                 strings[header->strings_size - 1] == 0;
+    for (u32 i = 0; valid && i < header->count; i++) {
+        valid = entries[i].name < header->strings_size;
+    }
+
+    if (valid) {
+        for (u32 i = 0; i < header->count; i++) {
+            add(base + entries[i].offset, (int)entries[i].length, strings + entries[i].name);
+        }
+    }
+
+    munmap(addr, st.st_size);
+    return valid;
+}
+
+bool CodeCache::writeSymbolCache(const char* path, const char* base, int first) {
+    u32 count = first < _count ? _count - first : 0;
+    if (count == 0) {
+        return false;
+    }
+
+    size_t strings_size = 0;
+    for (int i = first; i < _count; i++) {
+        strings_size += strlen(_blobs[i]._name) + 1;
+    }
+
+    size_t size = sizeof(SymbolCacheHeader) + count * sizeof(SymbolCacheEntry) + strings_size;
+    char* buf = (char*)malloc(size);
+    if (buf == NULL) {
+        return false;
+    }
+
+    SymbolCacheHeader* header = (SymbolCacheHeader*)buf;
+    header->magic = SYMBOL_CACHE_MAGIC;
+    header->count = count;
+    header->strings_size = (u32)strings_size;
+    header->reserved = 0;
+
+    SymbolCacheEntry* entries = (SymbolCacheEntry*)(header + 1);
+    char* strings = (char*)(entries + count);
+    u32 name = 0;
+    for (u32 i = 0; i < count; i++) {
+        const CodeBlob& blob = _blobs[first + i];
+        entries[i].offset = (u64)((const char*)blob._start - base);
+        entries[i].length = (u32)((const char*)blob._end - (const char*)blob._start);
+        entries[i].name = name;
+        strcpy(strings + name, blob._name);
+        name += strlen(blob._name) + 1;
+    }
+    qsort(entries, count, sizeof(SymbolCacheEntry), compareSymbolCacheEntries);
+
+    // Write to a temporary file first, so that concurrent readers never see a partial cache.
+    // Kernel addresses are sensitive: the file is private to the user.
+    char tmp_path[PATH_MAX];
+    bool written = false;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) < (int)sizeof(tmp_path)) {
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd != -1) {
+            size_t offset = 0;
+            ssize_t bytes;
+            while (offset < size && (bytes = write(fd, buf + offset, size - offset)) > 0) {
+                offset += bytes;
+            }
+            written = close(fd) == 0 && offset == size && rename(tmp_path, path) == 0;
+            if (!written) {
+                unlink(tmp_path);
+            }
+        }
+    }
+
+    free(buf);
+    return written;
+}
+
 CodeBlob* CodeCache::findBlob(const char* name) {
     for (int i = 0; i < _count; i++) {
         const char* blob_name = _blobs[i]._name;
@@ -130,6 +350,17 @@ const char* CodeCache::binarySearch(const void* address) {
     int low = 0;
     int high = _count - 1;
 
+    if (_blob_index != NULL) {
+        // Blobs of later blocks start above the address
+        int block = countKeysNotAbove(_blob_index, searchIndexLength(_count), address);
+        if (block > 0) {
+            low = (block - 1) * SEARCH_BLOCK_SIZE;
+            high = block * SEARCH_BLOCK_SIZE < _count ? block * SEARCH_BLOCK_SIZE - 1 : _count - 1;
+        } else {
+            high = -1;
+        }
+    }
+
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
         if (_blobs[mid]._end <= address) {
@@ -154,6 +385,30 @@ const void* CodeCache::findSymbol(const char* name) {
     return blob == NULL ? NULL : blob->_start;
 }
 
+// Looks up several symbols in one pass over the table. Returns the number of symbols found;
+// addresses of the missing ones are set to NULL.
+int CodeCache::findSymbols(const char* const* names, const void** addresses, int count) {
+    for (int j = 0; j < count; j++) {
+        addresses[j] = NULL;
+    }
+
+    int found = 0;
+    for (int i = 0; i < _count && found < count; i++) {
+        const char* blob_name = _blobs[i]._name;
+        if (blob_name == NULL) {
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            if (addresses[j] == NULL && blob_name[0] == names[j][0] && strcmp(blob_name, names[j]) == 0) {
+                addresses[j] = _blobs[i]._start;
+                found++;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
 const void* CodeCache::findSymbolByPrefix(const char* prefix) {
     return findSymbolByPrefix(prefix, strlen(prefix));
 }
@@ -198,6 +453,8 @@ void CodeCache::addImport(void** entry, const char* name) {
         case 'd':
             if (strcmp(name, "dlopen") == 0) {
                 saveImport(im_dlopen, entry);
+            } else if (strcmp(name, "dallocx") == 0) {
+                saveImport(im_dallocx, entry);
             }
             break;
         case 'f':
@@ -208,6 +465,12 @@ void CodeCache::addImport(void** entry, const char* name) {
         case 'm':
             if (strcmp(name, "malloc") == 0) {
                 saveImport(im_malloc, entry);
+            } else if (strcmp(name, "mmap") == 0) {
+                saveImport(im_mmap, entry);
+            } else if (strcmp(name, "munmap") == 0) {
+                saveImport(im_munmap, entry);
+            } else if (strcmp(name, "mallocx") == 0) {
+                saveImport(im_mallocx, entry);
             }
             break;
         case 'p':
@@ -226,6 +489,13 @@ void CodeCache::addImport(void** entry, const char* name) {
         case 'r':
             if (strcmp(name, "realloc") == 0) {
                 saveImport(im_realloc, entry);
+            } else if (strcmp(name, "rallocx") == 0) {
+                saveImport(im_rallocx, entry);
+            }
+            break;
+        case 's':
+            if (strcmp(name, "sdallocx") == 0) {
+                saveImport(im_sdallocx, entry);
             }
             break;
     }
@@ -272,29 +542,151 @@ void CodeCache::makeImportsPatchable() {
     }
 }
 
+// Orders FrameDescs by unwind rule; loc holds the row number meanwhile
+static int compareDwarfRules(const void* p1, const void* p2) {
+    const FrameDesc* fd1 = (const FrameDesc*)p1;
+    const FrameDesc* fd2 = (const FrameDesc*)p2;
+    if (fd1->cfa != fd2->cfa) return fd1->cfa < fd2->cfa ? -1 : 1;
+    if (fd1->fp_off != fd2->fp_off) return fd1->fp_off < fd2->fp_off ? -1 : 1;
+    if (fd1->pc_off != fd2->pc_off) return fd1->pc_off < fd2->pc_off ? -1 : 1;
+    return 0;
+}
+
 void CodeCache::setDwarfTable(FrameDesc* table, int length) {
-    _dwarf_table = table;
-    _dwarf_table_length = length;
+    free(_dwarf_table);
+    free(_dwarf_rows);
+    delete[] _dwarf_index;
+
+    if (!compressDwarfTable(table, length)) {
+        _dwarf_table = table;
+        _dwarf_table_length = length;
+        _dwarf_rows = NULL;
+        _dwarf_row_count = length;
+        _dwarf_index = new unsigned int[searchIndexLength(length)];
+        for (int i = 0; i < length; i += SEARCH_BLOCK_SIZE) {
+            _dwarf_index[i / SEARCH_BLOCK_SIZE] = table[i].loc;
+        }
+    }
+
+    __atomic_store_n(&_dwarf_state, DWARF_LOADED, __ATOMIC_RELEASE);
+}
+
+// Replaces the table with DwarfRows of 4 bytes that refer to a dictionary of distinct rules.
+// A row stores its loc relative to the first row of the search block. If the distance does not fit,
+// the block is padded with copies of the previous row, and the row starts a new block.
+bool CodeCache::compressDwarfTable(FrameDesc* table, int length) {
+    if (length == 0) {
+        return false;
+    }
+
+    FrameDesc* sorted = (FrameDesc*)malloc(length * sizeof(FrameDesc));
+    u16* row_rules = (u16*)malloc(length * sizeof(u16));
+    if (sorted == NULL || row_rules == NULL) {
+        free(sorted);
+        free(row_rules);
+        return false;
+    }
+
+    memcpy(sorted, table, length * sizeof(FrameDesc));
+    for (int i = 0; i < length; i++) {
+        sorted[i].loc = i;
+    }
+    qsort(sorted, length, sizeof(FrameDesc), compareDwarfRules);
+
+    // Distinct rules are collected in place at the beginning of the sorted array
+    int rule_count = 0;
+    for (int i = 0; i < length; i++) {
+        u32 row = sorted[i].loc;
+        if (rule_count == 0 || compareDwarfRules(&sorted[rule_count - 1], &sorted[i]) != 0) {
+            if (rule_count == MAX_DWARF_RULES) {
+                free(sorted);
+                free(row_rules);
+                return false;
+            }
+            sorted[rule_count] = sorted[i];
+            sorted[rule_count].loc = 0;
+            rule_count++;
+        }
+        row_rules[row] = (u16)(rule_count - 1);
+    }
+
+    // The first pass counts rows including padding, the second one fills them
+    DwarfRow* rows = NULL;
+    unsigned int* index = NULL;
+    int row_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            rows = (DwarfRow*)malloc(row_count * sizeof(DwarfRow));
+            if (rows == NULL) {
+                free(sorted);
+                free(row_rules);
+                return false;
+            }
+            index = new unsigned int[searchIndexLength(row_count)];
+        }
+
+        int n = 0;
+        u32 base = 0;
+        for (int i = 0; i < length; i++) {
+            if (n % SEARCH_BLOCK_SIZE != 0 && table[i].loc - base > MAX_DWARF_ROW_DELTA) {
+                for (; n % SEARCH_BLOCK_SIZE != 0; n++) {
+                    if (rows != NULL) rows[n] = rows[n - 1];
+                }
+            }
+            if (n % SEARCH_BLOCK_SIZE == 0) {
+                base = table[i].loc;
+                if (index != NULL) index[n / SEARCH_BLOCK_SIZE] = base;
+            }
+            if (rows != NULL) {
+                rows[n].delta = (u16)(table[i].loc - base);
+                rows[n].rule = row_rules[i];
+            }
+            n++;
+        }
+        row_count = n;
+    }
+
+    _dwarf_table = (FrameDesc*)realloc(sorted, rule_count * sizeof(FrameDesc));
+    _dwarf_table_length = rule_count;
+    _dwarf_rows = rows;
+    _dwarf_row_count = row_count;
+    _dwarf_index = index;
+
+    free(row_rules);
+    free(table);
+    return true;
 }
 
 FrameDesc* CodeCache::findFrameDesc(const void* pc) {
     u32 target_loc = (const char*)pc - _text_base;
-    int low = 0;
-    int high = _dwarf_table_length - 1;
 
-    while (low <= high) {
-        int mid = (unsigned int)(low + high) >> 1;
-        if (_dwarf_table[mid].loc < target_loc) {
-            low = mid + 1;
-        } else if (_dwarf_table[mid].loc > target_loc) {
-            high = mid - 1;
-        } else {
-            return &_dwarf_table[mid];
+    int state = __atomic_load_n(&_dwarf_state, __ATOMIC_ACQUIRE);
+    if (state != DWARF_LOADED) {
+        if (state == DWARF_PENDING && __sync_bool_compare_and_swap(&_dwarf_state, DWARF_PENDING, DWARF_REQUESTED)) {
+            Symbols::requestDwarf();
         }
+        // Unwind with the default frame layout until the table is ready
+        return target_loc - _plt_offset < _plt_size ? &FrameDesc::empty_frame : &FrameDesc::default_frame;
     }
 
-    if (low > 0) {
-        return &_dwarf_table[low - 1];
+    // Find the block of the last row at or below target_loc in the index, then the row in that block
+    int block = countKeysNotAbove(_dwarf_index, searchIndexLength(_dwarf_row_count), target_loc);
+    if (block > 0) {
+        int start = (block - 1) * SEARCH_BLOCK_SIZE;
+        int end = start + SEARCH_BLOCK_SIZE < _dwarf_row_count ? start + SEARCH_BLOCK_SIZE : _dwarf_row_count;
+        int row = start - 1;
+        if (_dwarf_rows != NULL) {
+            u32 delta = target_loc - _dwarf_index[block - 1];
+            u16 max_delta = (u16)(delta < MAX_DWARF_ROW_DELTA ? delta : MAX_DWARF_ROW_DELTA);
+            for (int i = start; i < end; i++) {
+                row += _dwarf_rows[i].delta <= max_delta ? 1 : 0;
+            }
+            return &_dwarf_table[_dwarf_rows[row].rule];
+        }
+        for (int i = start; i < end; i++) {
+            row += _dwarf_table[i].loc <= target_loc ? 1 : 0;
+        }
+        return &_dwarf_table[row];
     } else if (target_loc - _plt_offset < _plt_size) {
         return &FrameDesc::empty_frame;
     } else {
@@ -304,10 +696,243 @@ FrameDesc* CodeCache::findFrameDesc(const void* pc) {
 
 size_t CodeCache::usedMemory() {
     size_t bytes = _capacity * sizeof(CodeBlob);
-    bytes += _dwarf_table_length * sizeof(FrameDesc);
+    bytes += _blob_index != NULL ? searchIndexLength(_count) * sizeof(const void*) : 0;
+    bytes += dwarfMemory();
     bytes += NativeFunc::usedMemory(_name);
-    for (int i = 0; i < _count; i++) {
-        bytes += NativeFunc::usedMemory(_blobs[i]._name);
+    for (NameChunk* chunk = _name_chunks; chunk != NULL; chunk = chunk->next) {
+        bytes += sizeof(NameChunk) + chunk->capacity;
     }
     return bytes;
 }
+
+size_t CodeCache::dwarfMemory() {
+    size_t bytes = _dwarf_table_length * sizeof(FrameDesc);
+    bytes += _dwarf_rows != NULL ? _dwarf_row_count * sizeof(DwarfRow) : 0;
+    bytes += searchIndexLength(_dwarf_row_count) * sizeof(unsigned int);
+    return bytes;
+}
+
+StubTable::~StubTable() {
+    free(_table);
+}
+
+void StubTable::add(const void* start, const void* end, char* name) {
+    Table* table = _table;
+    if (table != NULL && table->count < table->capacity) {
+        CodeBlob& blob = table->blobs[table->count];
+        blob._start = start;
+        blob._end = end;
+        blob._name = name;
+        __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    int count = table != NULL ? table->count : 0;
+    int capacity = count + 1 + STUB_TABLE_TAIL;
+    Table* new_table = (Table*)malloc(sizeof(Table) + capacity * sizeof(CodeBlob));
+    if (count > 0) {
+        memcpy(new_table->blobs, table->blobs, count * sizeof(CodeBlob));
+    }
+    new_table->blobs[count]._start = start;
+    new_table->blobs[count]._end = end;
+    new_table->blobs[count]._name = name;
+    qsort(new_table->blobs, count + 1, sizeof(CodeBlob), CodeBlob::comparator);
+
+    new_table->count = count + 1;
+    new_table->sorted = count + 1;
+    new_table->capacity = capacity;
+    __atomic_store_n(&_table, new_table, __ATOMIC_SEQ_CST);
+
+    if (table != NULL) {
+        // Readers of the previous epoch may still look at the old table, later ones cannot
+        int epoch = __sync_fetch_and_add(&_epoch, 1);
+        while (__atomic_load_n(&_readers[epoch & 1], __ATOMIC_SEQ_CST) > 0) {
+            spinPause();
+        }
+        free(table);
+    }
+}
+
+bool StubTable::find(const void* address, CodeBlob& blob) {
+    int epoch;
+    while (true) {
+        epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+        atomicInc(_readers[epoch & 1]);
+        // Otherwise, a writer might have missed this reader
+        if (__atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) == epoch) break;
+        atomicInc(_readers[epoch & 1], -1);
+    }
+
+    bool found = false;
+    Table* table = __atomic_load_n(&_table, __ATOMIC_SEQ_CST);
+    if (table != NULL) {
+        int count = __atomic_load_n(&table->count, __ATOMIC_ACQUIRE);
+
+        // The last stub starting at or below the address; for equal starts, the innermost one
+        int low = 0;
+        int high = table->sorted - 1;
+        while (low <= high) {
+            int mid = (unsigned int)(low + high) >> 1;
+            if (table->blobs[mid]._start <= address) {
+                low = mid + 1;
+            } else {
+                high = mid - 1;
+            }
+        }
+
+        if (high >= 0 && address < table->blobs[high]._end) {
+            blob = table->blobs[high];
+            found = true;
+        } else {
+            for (int i = table->sorted; i < count; i++) {
+                if (address >= table->blobs[i]._start && address < table->blobs[i]._end) {
+                    blob = table->blobs[i];
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    atomicInc(_readers[epoch & 1], -1);
+    return found;
+}
+
+size_t StubTable::usedMemory() {
+    Table* table = _table;
+    return table != NULL ? sizeof(Table) + table->capacity * sizeof(CodeBlob) : 0;
+}
+
+void CodeCacheArray::indexLibrary(CodeCache* lib) {
+    const void* start = lib->minAddress();
+    int count = _range_count;
+    int pos = count;
+    while (pos > 0 && _ranges[pos - 1].start > start) {
+        pos--;
+    }
+
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // Shift from the end, so that every slot below the published count always holds a valid library
+    for (int i = count; i > pos; i--) {
+        _ranges[i] = _ranges[i - 1];
+    }
+    _ranges[pos].start = start;
+    _ranges[pos].lib = lib;
+
+    const void* max_end = pos > 0 ? _ranges[pos - 1].max_end : NO_MAX_ADDRESS;
+    for (int i = pos; i <= count; i++) {
+        if (_ranges[i].lib->maxAddress() > max_end) {
+            max_end = _ranges[i].lib->maxAddress();
+        }
+        _ranges[i].max_end = max_end;
+    }
+    __atomic_store_n(&_range_count, count + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELEASE);
+}
+
+CodeCache* CodeCacheArray::findInRanges(const void* address) {
+    // Find the last range that starts at or below the address
+    int low = 0;
+    int high = __atomic_load_n(&_range_count, __ATOMIC_ACQUIRE) - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (_ranges[mid].start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    // Library ranges hardly ever overlap, but a preceding range may still cover the address
+    for (int i = high; i >= 0 && _ranges[i].max_end > address; i--) {
+        CodeCache* lib = _ranges[i].lib;
+        if (lib->contains(address)) {
+            return lib;
+        }
+    }
+    return NULL;
+}
+
+CodeCacheArray::~CodeCacheArray() {
+    for (int i = 0; i < LIB_MAP_REGIONS; i++) {
+        free(_map[i].granules);
+    }
+}
+
+unsigned short* CodeCacheArray::mapRegion(uintptr_t tag, bool create) {
+    for (int i = 0; i < LIB_MAP_REGIONS; i++) {
+        MapRegion* region = &_map[(tag + i) % LIB_MAP_REGIONS];
+        unsigned short* granules = __atomic_load_n(&region->granules, __ATOMIC_ACQUIRE);
+        if (granules == NULL) {
+            if (!create || (granules = (unsigned short*)calloc(LIB_MAP_REGION_GRANULES, sizeof(unsigned short))) == NULL) {
+                return NULL;
+            }
+            // Only one thread adds libraries, readers never see a region before its tag
+            region->tag = tag;
+            __atomic_store_n(&region->granules, granules, __ATOMIC_RELEASE);
+            return granules;
+        } else if (region->tag == tag) {
+            return granules;
+        }
+    }
+    return NULL;
+}
+
+void CodeCacheArray::mapLibrary(CodeCache* lib, int index) {
+    uintptr_t start = (uintptr_t)lib->minAddress();
+    uintptr_t end = (uintptr_t)lib->maxAddress();
+    if (start >= end) {
+        return;
+    }
+
+    uintptr_t last = (end - 1) >> LIB_MAP_GRANULE_SHIFT;
+    for (uintptr_t granule = start >> LIB_MAP_GRANULE_SHIFT; granule <= last; granule++) {
+        unsigned short* granules = mapRegion(granule >> (LIB_MAP_REGION_SHIFT - LIB_MAP_GRANULE_SHIFT), true);
+        if (granules == NULL) {
+            __atomic_store_n(&_map_overflow, true, __ATOMIC_RELEASE);
+            return;
+        }
+
+        unsigned short* entry = &granules[granule & (LIB_MAP_REGION_GRANULES - 1)];
+        unsigned short value = *entry == 0 || *entry == index + 1 ? index + 1 : LIB_MAP_SHARED;
+        __atomic_store_n(entry, value, __ATOMIC_RELEASE);
+    }
+}
+
+CodeCache* CodeCacheArray::findLibraryByAddress(const void* address) {
+    unsigned short* granules = mapRegion((uintptr_t)address >> LIB_MAP_REGION_SHIFT, false);
+    if (granules != NULL) {
+        unsigned short entry = __atomic_load_n(&granules[((uintptr_t)address >> LIB_MAP_GRANULE_SHIFT) & (LIB_MAP_REGION_GRANULES - 1)],
+                                               __ATOMIC_ACQUIRE);
+        if (entry == 0) {
+            return NULL;
+        } else if (entry != LIB_MAP_SHARED) {
+            // The only library near the address
+            CodeCache* lib = _libs[entry - 1];
+            return lib->contains(address) ? lib : NULL;
+        }
+    } else if (!__atomic_load_n(&_map_overflow, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    unsigned int version = __atomic_load_n(&_version, __ATOMIC_ACQUIRE);
+    if ((version & 1) == 0) {
+        CodeCache* lib = findInRanges(address);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&_version, __ATOMIC_RELAXED) == version) {
+            return lib;
+        }
+    }
+
+    // The index is being updated concurrently
+    const int count = this->count();
+    for (int i = 0; i < count; i++) {
+        if (_libs[i]->contains(address)) {
+            return _libs[i];
+        }
+    }
+    return NULL;
+}
@@ -6,6 +6,8 @@
 #ifndef _CODECACHE_H
 #define _CODECACHE_H
 
+#include <stdint.h>
+#include <string.h>
 #include <jvmti.h>
 
 
@@ -15,6 +17,21 @@
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
 const int MAX_NATIVE_LIBS = 2048;
 
+// Granules of the library map: 64 KB pages in 1 GB regions
+const int LIB_MAP_GRANULE_SHIFT = 16;
+const int LIB_MAP_REGION_SHIFT = 30;
+const int LIB_MAP_REGION_GRANULES = 1 << (LIB_MAP_REGION_SHIFT - LIB_MAP_GRANULE_SHIFT);
+const int LIB_MAP_REGIONS = 64;
+// Granule entry shared by several libraries, which are told apart by the range index
+const unsigned short LIB_MAP_SHARED = 0xffff;
+
+// Sorted tables are searched through the keys of every Nth entry,
+// so that only this small index and one block of the table are touched
+const int SEARCH_BLOCK_SIZE = 16;
+
+// Unsorted stubs appended to a published StubTable before it is rebuilt
+const int STUB_TABLE_TAIL = 32;
+
 
 enum ImportId {
     im_dlopen,
@@ -28,6 +45,12 @@ enum ImportId {
     im_free,
     im_posix_memalign,
     im_aligned_alloc,
+    im_mmap,
+    im_munmap,
+    im_mallocx,
+    im_rallocx,
+    im_dallocx,
+    im_sdallocx,
     NUM_IMPORTS
 };
 
@@ -49,7 +72,7 @@ class NativeFunc {
   private:
     short _lib_index;
     char _mark;
-    char _reserved;
+    char _demangled;  // which forms of the name are in the demangling cache
     char _name[0];
 
     static NativeFunc* from(const char* name) {
@@ -58,8 +81,13 @@ class NativeFunc {
 
   public:
     static char* create(const char* name, short lib_index);
+    static char* create(const char* name, short lib_index, void* buf);
     static void destroy(char* name);
 
+    static size_t size(const char* name) {
+        return sizeof(NativeFunc) + 1 + strlen(name);
+    }
+
     static size_t usedMemory(const char* name);
 
     static short libIndex(const char* name) {
@@ -73,6 +101,14 @@ class NativeFunc {
     static void mark(const char* name, char value) {
         from(name)->_mark = value;
     }
+
+    static char demangled(const char* name) {
+        return from(name)->_demangled;
+    }
+
+    static void demangled(const char* name, char value) {
+        from(name)->_demangled = value;
+    }
 };
 
 
@@ -99,6 +135,15 @@ class CodeBlob {
 
 
 class FrameDesc;
+struct DwarfRow;
+struct NameChunk;
+
+// DWARF tables of libraries are parsed when a stack walker first needs them
+enum DwarfState {
+    DWARF_LOADED,     // the table, possibly empty, is ready for lookups
+    DWARF_PENDING,    // not parsed yet
+    DWARF_REQUESTED   // waits for the background parser
+};
 
 class CodeCache {
   private:
@@ -115,14 +160,32 @@ class CodeCache {
     bool _imports_patchable;
     bool _debug_symbols;
 
+    // The file to load symbols from on demand, NULL once they are loaded
+    char* volatile _deferred_file;
+    const char* _deferred_base;
+
+    // With _dwarf_rows, _dwarf_table holds the distinct unwind rules the rows refer to;
+    // otherwise it holds FrameDescs of all rows
     FrameDesc* _dwarf_table;
     int _dwarf_table_length;
+    DwarfRow* _dwarf_rows;
+    int _dwarf_row_count;
+    unsigned int* _dwarf_index;
+
+    const char* _dwarf_base;
+    const char* _eh_frame_hdr;
+    bool _dwarf_pinned;
+    volatile int _dwarf_state;
 
     int _capacity;
     int _count;
     CodeBlob* _blobs;
+    const void** _blob_index;
+    NameChunk* _name_chunks;
 
+    char* createName(const char* name);
     void expand();
+    bool compressDwarfTable(FrameDesc* table, int length);
     void makeImportsPatchable();
     void saveImport(ImportId id, void** entry);
 
@@ -168,10 +231,41 @@ class CodeCache {
         _debug_symbols = debug_symbols;
     }
 
-    void add(const void* start, int length, const char* name, bool update_bounds = false);
+    int count() const {
+        return _count;
+    }
+
+    const CodeBlob* blob(int index) const {
+        return &_blobs[index];
+    }
+
+    // Symbols of the file are loaded later by Symbols::loadDeferredSymbols,
+    // only dynamic symbols are known until then
+    void deferSymbols(const char* base, const char* file);
+    void clearDeferredSymbols();
+
+    bool symbolsDeferred() const {
+        return __atomic_load_n(&_deferred_file, __ATOMIC_ACQUIRE) != NULL;
+    }
+
+    const char* deferredFile() const {
+        return _deferred_file;
+    }
+
+    const char* deferredBase() const {
+        return _deferred_base;
+    }
+
+    // Returns the stored copy of the name
+    char* add(const void* start, int length, const char* name, bool update_bounds = false);
     void updateBounds(const void* start, const void* end);
     void sort();
 
+    // Adds symbols saved by writeSymbolCache. Returns false if the file is missing or malformed.
+    bool readSymbolCache(const char* path, const char* base);
+    // Saves symbols starting from the given index with addresses relative to the base
+    bool writeSymbolCache(const char* path, const char* base, int first);
+
     template <typename NamePredicate>
     inline void mark(NamePredicate predicate, char value) {
         for (int i = 0; i < _count; i++) {
@@ -195,25 +289,122 @@ class CodeCache {
     CodeBlob* findBlobByAddress(const void* address);
     const char* binarySearch(const void* address);
     const void* findSymbol(const char* name);
+    int findSymbols(const char* const* names, const void** addresses, int count);
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
 
     void setDwarfTable(FrameDesc* table, int length);
     FrameDesc* findFrameDesc(const void* pc);
 
+    // Defers parsing of .eh_frame_hdr until the first lookup. A pinned library is never unloaded.
+    void setLazyDwarf(const char* image_base, const char* eh_frame_hdr, bool pinned) {
+        _dwarf_base = image_base;
+        _eh_frame_hdr = eh_frame_hdr;
+        _dwarf_pinned = pinned;
+        _dwarf_state = DWARF_PENDING;
+    }
+
+    bool dwarfPending() const {
+        return __atomic_load_n(&_dwarf_state, __ATOMIC_ACQUIRE) != DWARF_LOADED;
+    }
+
+    bool dwarfRequested() const {
+        return __atomic_load_n(&_dwarf_state, __ATOMIC_ACQUIRE) == DWARF_REQUESTED;
+    }
+
+    const char* dwarfBase() const {
+        return _dwarf_base;
+    }
+
+    const char* ehFrameHdr() const {
+        return _eh_frame_hdr;
+    }
+
+    bool dwarfPinned() const {
+        return _dwarf_pinned;
+    }
+
     size_t usedMemory();
+    size_t dwarfMemory();
 };
 
 
+// Copy of runtime stubs for lookups from signal handlers without locks.
+// Readers search a published table: binary search over its sorted part and a linear scan
+// over a short tail of recently added stubs. When the tail is full, the writer publishes
+// a new sorted table and frees the old one once all readers that entered it have left.
+class StubTable {
+  private:
+    struct Table {
+        volatile int count;
+        int sorted;
+        int capacity;
+        CodeBlob blobs[0];
+    };
+
+    Table* volatile _table;
+
+    // Readers count themselves in the slot of the current epoch. A writer replacing the table
+    // advances the epoch and waits only for the readers of the previous one.
+    volatile int _epoch;
+    volatile int _readers[2];
+
+  public:
+    StubTable() : _table(NULL), _epoch(0), _readers() {
+    }
+
+    ~StubTable();
+
+    // Writers must be serialized; the name is not copied and must outlive the table
+    void add(const void* start, const void* end, char* name);
+
+    // Copies the stub containing the address, since the table may be replaced after return
+    bool find(const void* address, CodeBlob& blob);
+
+    size_t usedMemory();
+};
+
 class CodeCacheArray {
   private:
+    // Address ranges of libraries sorted by start,
+    // max_end is the largest end address among this and all preceding ranges
+    struct Range {
+        const void* start;
+        const void* max_end;
+        CodeCache* lib;
+    };
+
     CodeCache* _libs[MAX_NATIVE_LIBS];
     int _count;
 
+    // The index is updated in place; readers retry with a linear scan
+    // if _version was odd or changed while they were searching
+    Range _ranges[MAX_NATIVE_LIBS];
+    int _range_count;
+    volatile unsigned int _version;
+
+    // Page map for O(1) lookups: for every granule, 0 if no library overlaps it,
+    // or the position of the library in _libs + 1. Regions are hashed by address;
+    // if they do not fit, lookups in unmapped regions fall back to the range index.
+    struct MapRegion {
+        uintptr_t tag;
+        unsigned short* volatile granules;
+    };
+
+    MapRegion _map[LIB_MAP_REGIONS];
+    volatile bool _map_overflow;
+
+    void indexLibrary(CodeCache* lib);
+    CodeCache* findInRanges(const void* address);
+    unsigned short* mapRegion(uintptr_t tag, bool create);
+    void mapLibrary(CodeCache* lib, int index);
+
   public:
-    CodeCacheArray() : _count(0) {
+    CodeCacheArray() : _count(0), _range_count(0), _version(0), _map(), _map_overflow(false) {
     }
 
+    ~CodeCacheArray();
+
     CodeCache* operator[](int index) {
         return _libs[index];
     }
@@ -222,11 +413,17 @@ class CodeCacheArray {
         return __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
     }
 
+    // Libraries are added by one thread at a time, but may be looked up concurrently
     void add(CodeCache* lib) {
         int index = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
         _libs[index] = lib;
+        indexLibrary(lib);
+        mapLibrary(lib, index);
         __atomic_store_n(&_count, index + 1, __ATOMIC_RELEASE);
     }
+
+    // Async signal safe
+    CodeCache* findLibraryByAddress(const void* address);
 };
 
 #endif // _CODECACHE_H
@@ -0,0 +1,39 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CONTROLSOCKET_H
+#define _CONTROLSOCKET_H
+
+// Name of the control socket in the /tmp directory of the target process
+#define CONTROL_SOCKET_PREFIX ".asprof_ctl_"
+
+#ifdef __linux__
+
+// A Unix socket that lets asprof run commands in a process where the agent is
+// already loaded, without going through the Dynamic Attach sequence again.
+// The launcher sends a command string terminated by '\0', the same one it would
+// pass to Agent_OnAttach, and receives the 4-byte result code of the command.
+// Only processes with the same effective uid, or root, are served.
+class ControlSocket {
+  private:
+    static int _listener;
+
+    static void* threadEntry(void* unused);
+    static void serve(int fd);
+
+  public:
+    static bool start();
+};
+
+#else
+
+class ControlSocket {
+  public:
+    static bool start() { return false; }
+};
+
+#endif // __linux__
+
+#endif // _CONTROLSOCKET_H
@@ -0,0 +1,113 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "controlSocket.h"
+#include "fdtransfer.h"
+#include "log.h"
+#include "vmEntry.h"
+
+
+const size_t MAX_COMMAND_LENGTH = 65536;
+
+int ControlSocket::_listener = -1;
+
+bool ControlSocket::start() {
+    if (_listener != -1) {
+        return true;
+    }
+
+    struct sockaddr_un sun;
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "/tmp/" CONTROL_SOCKET_PREFIX "%d", getpid());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        Log::warn("Control socket: %s", strerror(errno));
+        return false;
+    }
+
+    // A socket left over from a previous process with the same pid
+    unlink(sun.sun_path);
+
+    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0 || chmod(sun.sun_path, 0600) != 0 || listen(fd, 4) != 0) {
+        Log::warn("Control socket %s: %s", sun.sun_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    _listener = fd;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, threadEntry, NULL) != 0) {
+        Log::warn("Could not start control socket thread");
+        _listener = -1;
+        close(fd);
+        unlink(sun.sun_path);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void* ControlSocket::threadEntry(void* unused) {
+    // Commands may need JNI, e.g. to resolve class names
+    VM::attachThread("Async-profiler Control");
+
+    while (true) {
+        int fd = accept4(_listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            Log::warn("Control socket accept(): %s", strerror(errno));
+            break;
+        }
+        serve(fd);
+        close(fd);
+    }
+
+    VM::detachThread();
+    return NULL;
+}
+
+void ControlSocket::serve(int fd) {
+    // The same check as the HotSpot attach listener does
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || (cred.uid != 0 && cred.uid != geteuid())) {
+        return;
+    }
+
+    // Do not let a stuck client block the control thread forever
+    struct timeval tv = {10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char* command = new char[MAX_COMMAND_LENGTH];
+    size_t length = 0;
+    while (length == 0 || command[length - 1] != 0) {
+        ssize_t bytes = RESTARTABLE(recv(fd, command + length, MAX_COMMAND_LENGTH - length, 0));
+        if (bytes <= 0 || (length += bytes) == MAX_COMMAND_LENGTH) {
+            delete[] command;
+            return;
+        }
+    }
+
+    int result = VM::executeCommand(command);
+    delete[] command;
+
+    if (send(fd, &result, sizeof(result), MSG_NOSIGNAL) != sizeof(result)) {
+        Log::warn("Control socket send(): %s", strerror(errno));
+    }
+}
+
+#endif // __linux__
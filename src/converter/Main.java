@@ -8,6 +8,7 @@ import one.convert.*;
 import java.io.File;
 import java.io.FileInputStream;
 import java.io.IOException;
+import java.util.List;
 
 public class Main {
 
@@ -35,6 +36,20 @@ public class Main {
             }
         }
 
+        if (args.merge && fileCount > 1) {
+            String output = isDirectory ? new File(lastFile, replaceExt(args.files.get(0), args.output)).getPath() : lastFile;
+
+            System.out.print("Merging " + fileCount + " files -> " + getFileName(output) + " ");
+            System.out.flush();
+
+            long startTime = System.nanoTime();
+            merge(args.files.subList(0, fileCount), output, args);
+            long endTime = System.nanoTime();
+
+            System.out.print("# " + (endTime - startTime) / 1000000 / 1000.0 + " s\n");
+            return;
+        }
+
         for (int i = 0; i < fileCount; i++) {
             String input = args.files.get(i);
             String output = isDirectory ? new File(lastFile, replaceExt(input, args.output)).getPath() : lastFile;
@@ -66,6 +81,18 @@ public class Main {
         }
     }
 
+    public static void merge(List<String> inputs, String output, Arguments args) throws IOException {
+        if (!"pprof".equals(args.output) && !"pb".equals(args.output) && !args.output.endsWith("gz")) {
+            throw new IllegalArgumentException("--merge is supported only for pprof output");
+        }
+        for (String input : inputs) {
+            if (!isJfr(input)) {
+                throw new IllegalArgumentException("Not a JFR file: " + input);
+            }
+        }
+        JfrToPprof.convert(inputs, output, args);
+    }
+
     private static String getFileName(String fileName) {
         return fileName.substring(fileName.lastIndexOf(File.separatorChar) + 1);
     }
@@ -104,7 +131,10 @@ public class Main {
                 "     --leak             Only include memory leaks in nativemem\n" +
                 "     --lock             Lock contention profile\n" +
                 "  -t --threads          Split stack traces by threads\n" +
+                "     --cpus             Split CPU samples by the CPU they were taken on\n" +
+                "     --nodes            Split CPU samples by NUMA node\n" +
                 "  -s --state LIST       Filter thread states: runnable, sleeping\n" +
+                "     --span LIST        Filter CPU and wall clock samples by span ID (hex)\n" +
                 "     --classify         Classify samples into predefined categories\n" +
                 "     --total            Accumulate total value (time, bytes, etc.)\n" +
                 "     --lines            Show line numbers\n" +
@@ -114,6 +144,8 @@ public class Main {
                 "     --dot              Dotted class names\n" +
                 "     --from TIME        Start time in ms (absolute or relative)\n" +
                 "     --to TIME          End time in ms (absolute or relative)\n" +
+                "     --jobs N           Parse JFR chunks in N threads\n" +
+                "     --merge            Merge all JFR inputs into one pprof output\n" +
                 "\n" +
                 "Flame Graph options:\n" +
                 "     --title STRING     Flame Graph title\n" +
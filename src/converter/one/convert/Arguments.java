@@ -15,11 +15,13 @@ public class Arguments {
     public String highlight;
     public String output;
     public String state;
+    public String span;
     public Pattern include;
     public Pattern exclude;
     public double minwidth;
     public double grain;
     public int skip;
+    public int jobs;
     public boolean help;
     public boolean reverse;
     public boolean inverted;
@@ -31,6 +33,8 @@ public class Arguments {
     public boolean live;
     public boolean lock;
     public boolean threads;
+    public boolean cpus;
+    public boolean nodes;
     public boolean classify;
     public boolean total;
     public boolean lines;
@@ -38,6 +42,7 @@ public class Arguments {
     public boolean simple;
     public boolean norm;
     public boolean dot;
+    public boolean merge;
     public long from;
     public long to;
     public final List<String> files = new ArrayList<>();
@@ -36,7 +36,13 @@ abstract class Classifier {
         }
     }
 
+    private static final Category[] CATEGORIES = Category.values();
+
     public Category getCategory(StackTrace stackTrace) {
+        if (stackTrace.category > 0 && stackTrace.category <= CATEGORIES.length) {
+            return CATEGORIES[stackTrace.category - 1];
+        }
+
         long[] methods = stackTrace.methods;
         byte[] types = stackTrace.types;
 
@@ -6,25 +6,31 @@
 package one.convert;
 
 import java.io.*;
+import java.nio.ByteBuffer;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
 import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
 import java.util.Arrays;
-import java.util.Comparator;
 import java.util.StringTokenizer;
 import java.util.regex.Pattern;
 
 import static one.convert.Frame.*;
 import static one.convert.ResourceProcessor.*;
 
-public class FlameGraph implements Comparator<Frame> {
-    private static final Frame[] EMPTY_FRAME_ARRAY = {};
+public class FlameGraph {
     private static final String[] FRAME_SUFFIX = {"_[0]", "_[j]", "_[i]", "", "", "_[k]", "_[1]"};
     private static final byte HAS_SUFFIX = (byte) 0x80;
     private static final int FLUSH_THRESHOLD = 15000;
+    private static final int PACKED_BASE = 45;
+    private static final long COLLAPSED_REGION_SIZE = 1 << 30;
     private static final Pattern TID_FRAME_PATTERN = Pattern.compile("\\[(.* )?tid=\\d+]");
 
     private final Arguments args;
     private final Index<String> cpool = new Index<>(String.class, "");
-    private final Frame root = new Frame(0, TYPE_NATIVE);
+    private final FrameTree tree = new FrameTree();
     private final StringBuilder outbuf = new StringBuilder(FLUSH_THRESHOLD + 1000);
     private int[] order;
     private int depth;
@@ -64,14 +70,78 @@ public class FlameGraph implements Comparator<Frame> {
         }
     }
 
+    // Same as parseCollapsed(Reader), but scans bytes of the mapped file. Frames are interned by their bytes,
+    // so that a String is created once per distinct frame rather than for every frame of every line.
+    public void parseCollapsed(FileChannel ch) throws IOException {
+        CallStack stack = new CallStack();
+        CollapsedFrames frames = new CollapsedFrames();
+        long fileSize = ch.size();
+
+        for (long regionStart = 0; regionStart < fileSize; ) {
+            int limit = (int) Math.min(fileSize - regionStart, COLLAPSED_REGION_SIZE);
+            boolean lastRegion = regionStart + limit == fileSize;
+            MappedByteBuffer buf = ch.map(FileChannel.MapMode.READ_ONLY, regionStart, limit);
+
+            int pos = 0;
+            while (pos < limit) {
+                int eol = pos;
+                while (eol < limit && buf.get(eol) != '\n') eol++;
+                if (eol == limit && !lastRegion) {
+                    if (pos == 0) throw new IOException("Line too long at offset " + regionStart);
+                    // The line continues in the next region
+                    break;
+                }
+                parseCollapsedLine(buf, pos, eol, stack, frames);
+                pos = eol + 1;
+            }
+            regionStart += Math.min(pos, limit);
+        }
+    }
+
+    private void parseCollapsedLine(ByteBuffer buf, int from, int to, CallStack stack, CollapsedFrames frames) {
+        if (to > from && buf.get(to - 1) == '\r') to--;
+
+        int space = to - 1;
+        while (space >= from && buf.get(space) != ' ') space--;
+        if (space <= from) return;
+
+        long ticks = parseTicks(buf, space + 1, to);
+
+        for (int start = from, end; start < space; start = end + 1) {
+            for (end = start; end < space && buf.get(end) != ';'; end++) ;
+            int frame = frames.intern(buf, start, end);
+            stack.push(frames.names[frame], frames.types[frame]);
+        }
+
+        addSample(stack, ticks);
+        stack.clear();
+    }
+
+    private static long parseTicks(ByteBuffer buf, int from, int to) {
+        if (from == to) {
+            throw new NumberFormatException("Missing sample count in collapsed stack");
+        }
+
+        long ticks = 0;
+        for (int i = from; i < to; i++) {
+            int digit = buf.get(i) - '0';
+            if (digit < 0 || digit > 9) {
+                throw new NumberFormatException("Invalid sample count in collapsed stack");
+            }
+            ticks = ticks * 10 + digit;
+        }
+        return ticks;
+    }
+
     public void parseHtml(Reader in) throws IOException {
-        Frame[] levels = new Frame[128];
-        int level = 0;
-        long total = 0;
         boolean needRebuild = args.reverse || args.include != null || args.exclude != null;
+        HtmlFrames frames = new HtmlFrames(needRebuild ? new FrameTree() : tree);
 
         try (BufferedReader br = new BufferedReader(in)) {
-            while (!br.readLine().startsWith("const cpool")) ;
+            boolean diff = false;
+            for (String line; !(line = br.readLine()).startsWith("const cpool"); ) {
+                diff |= line.contains("const diff = true");
+            }
             br.readLine();
 
             String s = "";
@@ -84,10 +154,16 @@ public class FlameGraph implements Comparator<Frame> {
             while (!br.readLine().isEmpty()) ;
 
             for (String line; !(line = br.readLine()).isEmpty(); ) {
+                if (line.startsWith("unpackFrames(\"")) {
+                    frames.parsePacked(line.substring(14, line.lastIndexOf('"')), diff);
+                    continue;
+                }
+
                 StringTokenizer st = new StringTokenizer(line.substring(2, line.length() - 1), ",");
                 int nameAndType = Integer.parseInt(st.nextToken());
 
                 char func = line.charAt(0);
+                int level = frames.level;
                 if (func == 'f') {
                     level = Integer.parseInt(st.nextToken());
                     st.nextToken();
@@ -97,50 +173,29 @@ public class FlameGraph implements Comparator<Frame> {
                     throw new IllegalStateException("Unexpected line: " + line);
                 }
 
-                if (st.hasMoreTokens()) {
-                    total = Long.parseLong(st.nextToken());
-                }
-
-                int titleIndex = nameAndType >>> 3;
-                byte type = (byte) (nameAndType & 7);
-                if (st.hasMoreTokens() && (type <= TYPE_INLINED || type >= TYPE_C1_COMPILED)) {
-                    type = TYPE_JIT_COMPILED;
-                }
-
-                Frame f = level > 0 || needRebuild ? new Frame(titleIndex, type) : root;
-                f.self = f.total = total;
-                if (st.hasMoreTokens()) f.inlined = Long.parseLong(st.nextToken());
-                if (st.hasMoreTokens()) f.c1 = Long.parseLong(st.nextToken());
-                if (st.hasMoreTokens()) f.interpreted = Long.parseLong(st.nextToken());
-
-                if (level > 0) {
-                    Frame parent = levels[level - 1];
-                    parent.put(f.key, f);
-                    parent.self -= total;
-                    depth = Math.max(depth, level);
-                }
-                if (level >= levels.length) {
-                    levels = Arrays.copyOf(levels, level * 2);
-                }
-                levels[level] = f;
+                long total = st.hasMoreTokens() ? Long.parseLong(st.nextToken()) : frames.total;
+                boolean hasTypes = st.hasMoreTokens();
+                long inlined = st.hasMoreTokens() ? Long.parseLong(st.nextToken()) : 0;
+                long c1 = st.hasMoreTokens() ? Long.parseLong(st.nextToken()) : 0;
+                long interpreted = st.hasMoreTokens() ? Long.parseLong(st.nextToken()) : 0;
+                frames.add(nameAndType, level, total, hasTypes, inlined, c1, interpreted);
             }
         }
 
+        depth = Math.max(depth, frames.depth);
         if (needRebuild) {
-            rebuild(levels[0], new CallStack(), cpool.keys());
+            rebuild(frames.tree, FrameTree.ROOT, new CallStack(), cpool.keys());
         }
     }
 
-    private void rebuild(Frame frame, CallStack stack, String[] strings) {
-        if (frame.self > 0) {
-            addSample(stack, frame.self);
+    private void rebuild(FrameTree parsed, int node, CallStack stack, String[] strings) {
+        if (parsed.self[node] > 0) {
+            addSample(stack, parsed.self[node]);
         }
-        if (!frame.isEmpty()) {
-            for (Frame child : frame.values()) {
-                stack.push(strings[child.getTitleIndex()], child.getType());
-                rebuild(child, stack, strings);
-                stack.pop();
-            }
+        for (int child = parsed.firstChild[node]; child != 0; child = parsed.nextSibling[child]) {
+            stack.push(strings[parsed.getTitleIndex(child)], parsed.getType(child));
+            rebuild(parsed, child, stack, strings);
+            stack.pop();
         }
     }
 
@@ -149,7 +204,7 @@ public class FlameGraph implements Comparator<Frame> {
             return;
         }
 
-        Frame frame = root;
+        int frame = FrameTree.ROOT;
         if (args.reverse) {
             // Retain by-thread grouping, unless thread frame is skipped
             int skip = args.skip;
@@ -165,24 +220,24 @@ public class FlameGraph implements Comparator<Frame> {
                 frame = addChild(frame, stack.names[i], stack.types[i], ticks);
             }
         }
-        frame.total += ticks;
-        frame.self += ticks;
+        tree.total[frame] += ticks;
+        tree.self[frame] += ticks;
 
         depth = Math.max(depth, stack.size);
     }
 
     public void dump(PrintStream out) {
-        mintotal = (long) (root.total * args.minwidth / 100);
+        mintotal = (long) (tree.total[FrameTree.ROOT] * args.minwidth / 100);
 
         if ("collapsed".equals(args.output)) {
-            printFrameCollapsed(out, root, cpool.keys());
+            printFrameCollapsed(out, FrameTree.ROOT, cpool.keys());
             return;
         }
 
         String tail = getResource("/flame.html");
 
         tail = printTill(out, tail, "/*height:*/300");
-        int depth = mintotal > 1 ? root.depth(mintotal) : this.depth + 1;
+        int depth = mintotal > 1 ? tree.depth(FrameTree.ROOT, mintotal) : this.depth + 1;
         out.print(Math.min(depth * 16, 32767));
 
         tail = printTill(out, tail, "/*title:*/");
@@ -200,7 +255,7 @@ public class FlameGraph implements Comparator<Frame> {
         printCpool(out);
 
         tail = printTill(out, tail, "/*frames:*/");
-        printFrame(out, root, 0, 0);
+        printFrame(out, FrameTree.ROOT, 0, 0);
         out.print(outbuf);
 
         tail = printTill(out, tail, "/*highlight:*/");
@@ -226,10 +281,15 @@ public class FlameGraph implements Comparator<Frame> {
         cpool.clear();
     }
 
-    private void printFrame(PrintStream out, Frame frame, int level, long x) {
-        int nameAndType = order[frame.getTitleIndex()] << 3 | frame.getType();
-        boolean hasExtraTypes = (frame.inlined | frame.c1 | frame.interpreted) != 0 &&
-                frame.inlined < frame.total && frame.interpreted < frame.total;
+    private void printFrame(PrintStream out, int frame, int level, long x) {
+        FrameTree tree = this.tree;
+        long total = tree.total[frame];
+        long inlined = tree.inlined[frame];
+        long c1 = tree.c1[frame];
+        long interpreted = tree.interpreted[frame];
+
+        int nameAndType = order[tree.getTitleIndex(frame)] << 3 | tree.getType(frame);
+        boolean hasExtraTypes = (inlined | c1 | interpreted) != 0 && inlined < total && interpreted < total;
 
         char func = 'f';
         if (level == lastLevel + 1 && x == lastX) {
@@ -242,10 +302,10 @@ public class FlameGraph implements Comparator<Frame> {
         if (func == 'f') {
             sb.append(',').append(level).append(',').append(x - lastX);
         }
-        if (frame.total != lastTotal || hasExtraTypes) {
-            sb.append(',').append(frame.total);
+        if (total != lastTotal || hasExtraTypes) {
+            sb.append(',').append(total);
             if (hasExtraTypes) {
-                sb.append(',').append(frame.inlined).append(',').append(frame.c1).append(',').append(frame.interpreted);
+                sb.append(',').append(inlined).append(',').append(c1).append(',').append(interpreted);
             }
         }
         sb.append(")\n");
@@ -257,39 +317,38 @@ public class FlameGraph implements Comparator<Frame> {
 
         lastLevel = level;
         lastX = x;
-        lastTotal = frame.total;
+        lastTotal = total;
 
-        Frame[] children = frame.values().toArray(EMPTY_FRAME_ARRAY);
-        Arrays.sort(children, this);
+        if (!tree.hasChildren(frame)) {
+            return;
+        }
 
-        x += frame.self;
-        for (Frame child : children) {
-            if (child.total >= mintotal) {
+        x += tree.self[frame];
+        for (int child : tree.sortedChildren(frame, order)) {
+            if (tree.total[child] >= mintotal) {
                 printFrame(out, child, level + 1, x);
             }
-            x += child.total;
+            x += tree.total[child];
         }
     }
 
-    private void printFrameCollapsed(PrintStream out, Frame frame, String[] strings) {
+    private void printFrameCollapsed(PrintStream out, int frame, String[] strings) {
         StringBuilder sb = outbuf;
         int prevLength = sb.length();
 
-        if (frame != root) {
-            sb.append(strings[frame.getTitleIndex()]).append(FRAME_SUFFIX[frame.getType()]);
-            if (frame.self > 0) {
+        if (frame != FrameTree.ROOT) {
+            sb.append(strings[tree.getTitleIndex(frame)]).append(FRAME_SUFFIX[tree.getType(frame)]);
+            if (tree.self[frame] > 0) {
                 int tmpLength = sb.length();
-                out.print(sb.append(' ').append(frame.self).append('\n'));
+                out.print(sb.append(' ').append(tree.self[frame]).append('\n'));
                 sb.setLength(tmpLength);
             }
             sb.append(';');
         }
 
-        if (!frame.isEmpty()) {
-            for (Frame child : frame.values()) {
-                if (child.total >= mintotal) {
-                    printFrameCollapsed(out, child, strings);
-                }
+        for (int child = tree.firstChild[frame]; child != 0; child = tree.nextSibling[child]) {
+            if (tree.total[child] >= mintotal) {
+                printFrameCollapsed(out, child, strings);
             }
         }
 
@@ -316,24 +375,27 @@ public class FlameGraph implements Comparator<Frame> {
         return include != null;
     }
 
-    private Frame addChild(Frame frame, String title, byte type, long ticks) {
-        frame.total += ticks;
+    private int addChild(int frame, String title, byte type, long ticks) {
+        tree.total[frame] += ticks;
 
         int titleIndex = cpool.index(title);
 
-        Frame child;
+        int child;
         switch (type) {
             case TYPE_INTERPRETED:
-                (child = frame.getChild(titleIndex, TYPE_JIT_COMPILED)).interpreted += ticks;
+                child = tree.child(frame, key(titleIndex, TYPE_JIT_COMPILED));
+                tree.interpreted[child] += ticks;
                 break;
             case TYPE_INLINED:
-                (child = frame.getChild(titleIndex, TYPE_JIT_COMPILED)).inlined += ticks;
+                child = tree.child(frame, key(titleIndex, TYPE_JIT_COMPILED));
+                tree.inlined[child] += ticks;
                 break;
             case TYPE_C1_COMPILED:
-                (child = frame.getChild(titleIndex, TYPE_JIT_COMPILED)).c1 += ticks;
+                child = tree.child(frame, key(titleIndex, TYPE_JIT_COMPILED));
+                tree.c1[child] += ticks;
                 break;
             default:
-                child = frame.getChild(titleIndex, type);
+                child = tree.child(frame, key(titleIndex, type));
         }
         return child;
     }
@@ -385,17 +447,180 @@ public class FlameGraph implements Comparator<Frame> {
         return s;
     }
 
-    @Override
-    public int compare(Frame f1, Frame f2) {
-        return order[f1.getTitleIndex()] - order[f2.getTitleIndex()];
+    // Distinct frames of collapsed stacks, looked up by their UTF-8 bytes
+    private static class CollapsedFrames {
+        int[] table = new int[4096];  // frame + 1, or 0 for an empty slot
+        byte[][] keys = new byte[1024][];
+        int[] hashes = new int[1024];
+        String[] names = new String[1024];
+        byte[] types = new byte[1024];
+        int size;
+
+        int intern(ByteBuffer buf, int from, int to) {
+            int hash = 0;
+            for (int i = from; i < to; i++) {
+                hash = hash * 31 + buf.get(i);
+            }
+
+            int mask = table.length - 1;
+            for (int slot = hash & mask; ; slot = (slot + 1) & mask) {
+                int frame = table[slot] - 1;
+                if (frame < 0) {
+                    frame = add(buf, from, to, hash);
+                    table[slot] = frame + 1;
+                    if (size * 2 > table.length) {
+                        rehash(table.length * 2);
+                    }
+                    return frame;
+                } else if (hashes[frame] == hash && sameBytes(keys[frame], buf, from, to)) {
+                    return frame;
+                }
+            }
+        }
+
+        private int add(ByteBuffer buf, int from, int to, int hash) {
+            if (size == keys.length) {
+                int newCapacity = size * 2;
+                keys = Arrays.copyOf(keys, newCapacity);
+                hashes = Arrays.copyOf(hashes, newCapacity);
+                names = Arrays.copyOf(names, newCapacity);
+                types = Arrays.copyOf(types, newCapacity);
+            }
+
+            byte[] key = new byte[to - from];
+            ByteBuffer src = buf.duplicate();
+            src.position(from);
+            src.get(key);
+
+            String name = new String(key, StandardCharsets.UTF_8);
+            byte type = detectType(name);
+            if ((type & HAS_SUFFIX) != 0) {
+                name = name.substring(0, name.length() - 4);
+                type ^= HAS_SUFFIX;
+            }
+
+            keys[size] = key;
+            hashes[size] = hash;
+            names[size] = name;
+            types[size] = type;
+            return size++;
+        }
+
+        private void rehash(int newCapacity) {
+            int[] newTable = new int[newCapacity];
+            int mask = newCapacity - 1;
+            for (int frame = 0; frame < size; frame++) {
+                int slot = hashes[frame] & mask;
+                while (newTable[slot] != 0) {
+                    slot = (slot + 1) & mask;
+                }
+                newTable[slot] = frame + 1;
+            }
+            table = newTable;
+        }
+
+        private static boolean sameBytes(byte[] key, ByteBuffer buf, int from, int to) {
+            if (key.length != to - from) {
+                return false;
+            }
+            for (int i = 0; i < key.length; i++) {
+                if (key[i] != buf.get(from + i)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    // Frames of an HTML flame graph are restored level by level, the same way flame.html draws them
+    private static class HtmlFrames {
+        final FrameTree tree;
+        int[] levels = new int[128];
+        int level;
+        long total;
+        int depth;
+
+        HtmlFrames(FrameTree tree) {
+            this.tree = tree;
+        }
+
+        void add(int nameAndType, int level, long total, boolean hasTypes, long inlined, long c1, long interpreted) {
+            int titleIndex = nameAndType >>> 3;
+            byte type = (byte) (nameAndType & 7);
+            if (hasTypes && (type <= TYPE_INLINED || type >= TYPE_C1_COMPILED)) {
+                type = TYPE_JIT_COMPILED;
+            }
+
+            int f = FrameTree.ROOT;
+            if (level > 0) {
+                int parent = levels[level - 1];
+                f = tree.child(parent, key(titleIndex, type));
+                tree.self[parent] -= total;
+                depth = Math.max(depth, level);
+            }
+            tree.self[f] = tree.total[f] = total;
+            tree.inlined[f] = inlined;
+            tree.c1[f] = c1;
+            tree.interpreted[f] = interpreted;
+
+            if (level >= levels.length) {
+                levels = Arrays.copyOf(levels, level * 2);
+            }
+            levels[level] = f;
+            this.level = level;
+            this.total = total;
+        }
+
+        // Mirrors unpackFrames() of flame.html
+        void parsePacked(String data, boolean diff) {
+            for (int pos = 0; pos < data.length(); ) {
+                long[] values = new long[8];
+                int count = 0;
+                int expected = 1;
+                int flags = 0;
+                while (count < expected) {
+                    long value = 0;
+                    for (long scale = 1; ; scale *= PACKED_BASE) {
+                        char c = data.charAt(pos++);
+                        int digit = c - '#' - (c > '<' ? 1 : 0) - (c > '\\' ? 1 : 0);
+                        if (digit < PACKED_BASE) {
+                            value += digit * scale;
+                            break;
+                        }
+                        value += (digit - PACKED_BASE) * scale;
+                    }
+                    if (count++ == 0) {
+                        flags = (int) value & 15;
+                        expected += ((flags & 3) == 0 ? 2 : 0) + ((flags & 4) != 0 ? 1 : 0) +
+                                ((flags & 8) != 0 ? 3 : 0) + (diff ? 1 : 0);
+                    }
+                    values[count - 1] = value;
+                }
+
+                int i = 1;
+                int level = (flags & 3) == 0 ? (int) values[i++] : (flags & 3) == 1 ? this.level + 1 : this.level;
+                if ((flags & 3) == 0) i++;
+                long total = (flags & 4) != 0 ? values[i++] : this.total;
+                boolean hasTypes = (flags & 8) != 0;
+                add((int) (values[0] >>> 4), level, total, hasTypes,
+                        hasTypes ? values[i] : 0, hasTypes ? values[i + 1] : 0, hasTypes ? values[i + 2] : 0);
+            }
+        }
     }
 
     public static void convert(String input, String output, Arguments args) throws IOException {
         FlameGraph fg = new FlameGraph(args);
-        try (InputStreamReader in = new InputStreamReader(new FileInputStream(input), StandardCharsets.UTF_8)) {
-            if (input.endsWith(".html")) {
+        if (input.endsWith(".html")) {
+            try (InputStreamReader in = new InputStreamReader(new FileInputStream(input), StandardCharsets.UTF_8)) {
                 fg.parseHtml(in);
-            } else {
+            }
+        } else if (Files.isRegularFile(Paths.get(input))) {
+            try (FileChannel ch = FileChannel.open(Paths.get(input), StandardOpenOption.READ)) {
+                fg.parseCollapsed(ch);
+            }
+        } else {
+            // Pipes and devices cannot be mapped
+            try (InputStreamReader in = new InputStreamReader(new FileInputStream(input), StandardCharsets.UTF_8)) {
                 fg.parseCollapsed(in);
             }
         }
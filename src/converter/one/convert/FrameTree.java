@@ -0,0 +1,165 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package one.convert;
+
+import java.util.Arrays;
+
+import static one.convert.Frame.*;
+
+/**
+ * Call tree of a flame graph kept in primitive arrays indexed by node.
+ * Node 0 is the root. Children form a linked list for traversal,
+ * and are found by (parent, key) in an open addressing table.
+ */
+class FrameTree {
+    static final int ROOT = 0;
+
+    private static final int INITIAL_CAPACITY = 1024;
+
+    int[] keys;
+    long[] total;
+    long[] self;
+    long[] inlined, c1, interpreted;
+
+    // 0 marks the end of the list, since the root is never a child
+    int[] firstChild;
+    int[] nextSibling;
+
+    private int[] parents;
+    private int[] table;  // node + 1, or 0 for an empty slot
+    private int size;
+
+    FrameTree() {
+        allocate(INITIAL_CAPACITY);
+        table = new int[INITIAL_CAPACITY * 2];
+        keys[ROOT] = key(0, TYPE_NATIVE);
+        size = 1;
+    }
+
+    int child(int parent, int key) {
+        int mask = table.length - 1;
+        for (int i = hash(parent, key) & mask; ; i = (i + 1) & mask) {
+            int node = table[i] - 1;
+            if (node < 0) {
+                node = addNode(parent, key);
+                table[i] = node + 1;
+                if (size * 2 > table.length) {
+                    rehash(table.length * 2);
+                }
+                return node;
+            } else if (keys[node] == key && parents[node] == parent) {
+                return node;
+            }
+        }
+    }
+
+    int getTitleIndex(int node) {
+        return keys[node] & ((1 << TYPE_SHIFT) - 1);
+    }
+
+    byte getType(int node) {
+        long total = this.total[node];
+        if (inlined[node] * 3 >= total) {
+            return TYPE_INLINED;
+        } else if (c1[node] * 2 >= total) {
+            return TYPE_C1_COMPILED;
+        } else if (interpreted[node] * 2 >= total) {
+            return TYPE_INTERPRETED;
+        } else {
+            return (byte) (keys[node] >>> TYPE_SHIFT);
+        }
+    }
+
+    boolean hasChildren(int node) {
+        return firstChild[node] != 0;
+    }
+
+    int depth(int node, long cutoff) {
+        int depth = 0;
+        for (int child = firstChild[node]; child != 0; child = nextSibling[child]) {
+            if (total[child] >= cutoff) {
+                depth = Math.max(depth, depth(child, cutoff));
+            }
+        }
+        return depth + 1;
+    }
+
+    // Children of the node ordered by the given rank of their titles
+    int[] sortedChildren(int node, int[] order) {
+        int count = 0;
+        for (int child = firstChild[node]; child != 0; child = nextSibling[child]) {
+            count++;
+        }
+
+        long[] ranked = new long[count];
+        count = 0;
+        for (int child = firstChild[node]; child != 0; child = nextSibling[child]) {
+            ranked[count++] = (long) order[getTitleIndex(child)] << 32 | child;
+        }
+        Arrays.sort(ranked);
+
+        int[] children = new int[count];
+        for (int i = 0; i < count; i++) {
+            children[i] = (int) ranked[i];
+        }
+        return children;
+    }
+
+    private int addNode(int parent, int key) {
+        if (size == keys.length) {
+            allocate(size * 2);
+        }
+
+        int node = size++;
+        keys[node] = key;
+        parents[node] = parent;
+        nextSibling[node] = firstChild[parent];
+        firstChild[parent] = node;
+        return node;
+    }
+
+    private void allocate(int capacity) {
+        if (keys == null) {
+            keys = new int[capacity];
+            parents = new int[capacity];
+            firstChild = new int[capacity];
+            nextSibling = new int[capacity];
+            total = new long[capacity];
+            self = new long[capacity];
+            inlined = new long[capacity];
+            c1 = new long[capacity];
+            interpreted = new long[capacity];
+        } else {
+            keys = Arrays.copyOf(keys, capacity);
+            parents = Arrays.copyOf(parents, capacity);
+            firstChild = Arrays.copyOf(firstChild, capacity);
+            nextSibling = Arrays.copyOf(nextSibling, capacity);
+            total = Arrays.copyOf(total, capacity);
+            self = Arrays.copyOf(self, capacity);
+            inlined = Arrays.copyOf(inlined, capacity);
+            c1 = Arrays.copyOf(c1, capacity);
+            interpreted = Arrays.copyOf(interpreted, capacity);
+        }
+    }
+
+    private void rehash(int newCapacity) {
+        int[] newTable = new int[newCapacity];
+        int mask = newCapacity - 1;
+        for (int node = 1; node < size; node++) {
+            int i = hash(parents[node], keys[node]) & mask;
+            while (newTable[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            newTable[i] = node + 1;
+        }
+        table = newTable;
+    }
+
+    private static int hash(int parent, int key) {
+        int h = (parent * 0x9e3779b9 + key) * 0x85ebca6b;
+        return h ^ (h >>> 15);
+    }
+}
@@ -12,16 +12,29 @@ import one.jfr.MethodRef;
 import one.jfr.event.*;
 
 import java.io.IOException;
+import java.io.InterruptedIOException;
+import java.nio.ByteBuffer;
 import java.nio.charset.StandardCharsets;
+import java.util.ArrayDeque;
 import java.util.BitSet;
+import java.util.HashSet;
+import java.util.Iterator;
+import java.util.List;
 import java.util.Map;
+import java.util.Set;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
 
 import static one.convert.Frame.*;
 
 public abstract class JfrConverter extends Classifier {
-    protected final JfrReader jfr;
+    // Point to the chunk being converted when chunks are parsed in parallel
+    protected JfrReader jfr;
+    protected EventCollector collector;
     protected final Arguments args;
-    protected final EventCollector collector;
     protected Dictionary<String> methodNames;
 
     public JfrConverter(JfrReader jfr, Arguments args) {
@@ -33,6 +46,25 @@ public abstract class JfrConverter extends Classifier {
     }
 
     public void convert() throws IOException {
+        if (args.from != 0 || args.to != 0) {
+            // Relative times need the end of the recording, which is known from chunk headers.
+            // Chunks out of the range are then skipped without parsing their events.
+            jfr.readChunkHeaders();
+            jfr.setTimeRange(args.from != 0 ? toNanos(jfr, args.from) : Long.MIN_VALUE,
+                    args.to != 0 ? toNanos(jfr, args.to) : Long.MAX_VALUE);
+        }
+
+        // Aggregated events of different chunks are independent of each other,
+        // unlike the state of heatmap and leak collectors
+        int jobs = args.jobs > 0 ? args.jobs : Runtime.getRuntime().availableProcessors();
+        if (jobs > 1 && collector instanceof EventAggregator) {
+            List<ByteBuffer> chunks = jfr.mapChunks();
+            if (chunks != null && chunks.size() > 1) {
+                convertParallel(chunks, Math.min(jobs, chunks.size()));
+                return;
+            }
+        }
+
         jfr.stopAtNewChunk = true;
 
         while (jfr.hasMoreChunks()) {
@@ -44,6 +76,11 @@ public abstract class JfrConverter extends Classifier {
             collector.afterChunk();
 
             convertChunk();
+
+            // Unlike heatmap and leak collectors, aggregated events do not outlive the chunk
+            if (collector instanceof EventAggregator) {
+                jfr.discardConstants();
+            }
         }
 
         if (collector.finish()) {
@@ -51,17 +88,103 @@ public abstract class JfrConverter extends Classifier {
         }
     }
 
+    // Chunks are parsed and aggregated by a pool of threads, while conversion of the aggregated
+    // events stays in order on the current thread. Only a few parsed chunks are kept in memory.
+    private void convertParallel(List<ByteBuffer> chunks, int jobs) throws IOException {
+        JfrReader recording = jfr;
+        EventCollector recordingCollector = collector;
+        BitSet threadStates = getThreadStateFilter();
+        recording.discardConstants();
+
+        ExecutorService executor = Executors.newFixedThreadPool(jobs);
+        try {
+            ArrayDeque<Future<ChunkParser>> pending = new ArrayDeque<>();
+            Iterator<ByteBuffer> it = chunks.iterator();
+            while (it.hasNext() || !pending.isEmpty()) {
+                while (it.hasNext() && pending.size() < jobs * 2) {
+                    pending.add(executor.submit(new ChunkParser(it.next(), recording, threadStates)));
+                }
+
+                ChunkParser chunk = await(pending.poll());
+                jfr = chunk.jfr;
+                collector = chunk.collector;
+                methodNames = new Dictionary<>();
+                convertChunk();
+                collector.finish();
+            }
+        } finally {
+            executor.shutdownNow();
+            jfr = recording;
+            collector = recordingCollector;
+        }
+    }
+
+    private static <T> T await(Future<T> future) throws IOException {
+        try {
+            return future.get();
+        } catch (InterruptedException e) {
+            Thread.currentThread().interrupt();
+            throw new InterruptedIOException();
+        } catch (ExecutionException e) {
+            Throwable cause = e.getCause();
+            if (cause instanceof IOException) {
+                throw (IOException) cause;
+            } else if (cause instanceof RuntimeException) {
+                throw (RuntimeException) cause;
+            } else if (cause instanceof Error) {
+                throw (Error) cause;
+            }
+            throw new IllegalStateException(cause);
+        }
+    }
+
     protected EventCollector createCollector(Arguments args) {
-        return new EventAggregator(args.threads, args.grain);
+        return new EventAggregator(args.threads, args.cpus || args.nodes, args.grain);
     }
 
     protected void collectEvents() throws IOException {
+        collectEvents(jfr, collector, getThreadStateFilter(), jfr);
+    }
+
+    // Runs on parser threads for parallel conversion, so it must not touch the current jfr and collector.
+    // The recording provides the time range for relative --from and --to.
+    private void collectEvents(JfrReader jfr, EventCollector collector, BitSet threadStates,
+                               JfrReader recording) throws IOException {
         Class<? extends Event> eventClass = args.nativemem ? MallocEvent.class
                 : args.live ? LiveObject.class
                 : args.alloc ? AllocationSample.class
                 : args.lock ? ContendedLock.class
                 : ExecutionSample.class;
 
+        long startTicks = args.from != 0 ? toTicks(jfr, recording, args.from) : Long.MIN_VALUE;
+        long endTicks = args.to != 0 ? toTicks(jfr, recording, args.to) : Long.MAX_VALUE;
+
+        Set<Long> spans = getSpanFilter();
+
+        for (Event event; (event = jfr.readEvent(eventClass)) != null; ) {
+            if (event.time >= startTicks && event.time <= endTicks) {
+                if (threadStates == null || threadStates.get(((ExecutionSample) event).threadState)) {
+                    if (spans == null || event instanceof ExecutionSample && spans.contains(((ExecutionSample) event).spanId)) {
+                        collector.collect(event);
+                    }
+                }
+            }
+        }
+    }
+
+    // Span IDs are given in hex, as tracing systems print them
+    private Set<Long> getSpanFilter() {
+        if (args.span == null) {
+            return null;
+        }
+        Set<Long> spans = new HashSet<>();
+        for (String span : args.span.split(",")) {
+            spans.add(Long.parseUnsignedLong(span.trim(), 16));
+        }
+        return spans;
+    }
+
+    private BitSet getThreadStateFilter() {
         BitSet threadStates = null;
         if (args.state != null) {
             threadStates = new BitSet();
@@ -73,17 +196,7 @@ public abstract class JfrConverter extends Classifier {
         } else if (args.wall) {
             threadStates = getThreadStates(false);
         }
-
-        long startTicks = args.from != 0 ? toTicks(args.from) : Long.MIN_VALUE;
-        long endTicks = args.to != 0 ? toTicks(args.to) : Long.MAX_VALUE;
-
-        for (Event event; (event = jfr.readEvent(eventClass)) != null; ) {
-            if (event.time >= startTicks && event.time <= endTicks) {
-                if (threadStates == null || threadStates.get(((ExecutionSample) event).threadState)) {
-                    collector.collect(event);
-                }
-            }
-        }
+        return threadStates;
     }
 
     protected void convertChunk() {
@@ -115,13 +228,22 @@ public abstract class JfrConverter extends Classifier {
 
     // millis can be an absolute timestamp or an offset from the beginning/end of the recording
     protected long toTicks(long millis) {
+        return toTicks(jfr, jfr, millis);
+    }
+
+    private static long toTicks(JfrReader chunk, JfrReader recording, long millis) {
+        long nanos = toNanos(recording, millis);
+        return (long) ((nanos - chunk.chunkStartNanos) * (chunk.ticksPerSec / 1e9)) + chunk.chunkStartTicks;
+    }
+
+    private static long toNanos(JfrReader recording, long millis) {
         long nanos = millis * 1_000_000;
         if (millis < 0) {
-            nanos += jfr.endNanos;
+            nanos += recording.endNanos;
         } else if (millis < 1500000000000L) {
-            nanos += jfr.startNanos;
+            nanos += recording.startNanos;
         }
-        return (long) ((nanos - jfr.chunkStartNanos) * (jfr.ticksPerSec / 1e9)) + jfr.chunkStartTicks;
+        return nanos;
     }
 
     @Override
@@ -260,6 +382,30 @@ public abstract class JfrConverter extends Classifier {
                 methodType == TYPE_KERNEL;
     }
 
+    private class ChunkParser implements Callable<ChunkParser> {
+        final ByteBuffer buf;
+        final JfrReader recording;
+        final BitSet threadStates;
+        JfrReader jfr;
+        EventCollector collector;
+
+        ChunkParser(ByteBuffer buf, JfrReader recording, BitSet threadStates) {
+            this.buf = buf;
+            this.recording = recording;
+            this.threadStates = threadStates;
+        }
+
+        @Override
+        public ChunkParser call() throws IOException {
+            jfr = new JfrReader(buf);
+            collector = createCollector(args);
+            collector.beforeChunk();
+            collectEvents(jfr, collector, threadStates, recording);
+            collector.afterChunk();
+            return this;
+        }
+    }
+
     // Select sum(samples) or sum(value) depending on the --total option.
     // For lock events, convert lock duration from ticks to nanoseconds.
     protected abstract class AggregatedEventVisitor implements EventCollector.Visitor {
@@ -42,6 +42,14 @@ public class JfrToFlame extends JfrConverter {
                     byte[] types = stackTrace.types;
                     int[] locations = stackTrace.locations;
 
+                    if (args.nodes) {
+                        int node = event.numaNode();
+                        stack.push(node >= 0 ? "[node " + node + "]" : "[node unknown]", TYPE_NATIVE);
+                    }
+                    if (args.cpus) {
+                        int cpu = event.cpu();
+                        stack.push(cpu >= 0 ? "[CPU " + cpu + "]" : "[CPU unknown]", TYPE_NATIVE);
+                    }
                     if (args.threads) {
                         stack.push(getThreadName(event.tid), TYPE_NATIVE);
                     }
@@ -13,19 +13,34 @@ import one.proto.Proto;
 import java.io.FileOutputStream;
 import java.io.IOException;
 import java.io.OutputStream;
+import java.io.UncheckedIOException;
+import java.util.Collections;
+import java.util.List;
 import java.util.zip.GZIPOutputStream;
 
 /**
  * Converts .jfr output to <a href="https://github.com/google/pprof">pprof</a>.
  */
 public class JfrToPprof extends JfrConverter {
+    private static final int STREAM_THRESHOLD = 65536;
+
     private final Proto profile = new Proto(100000);
     private final Index<String> strings = new Index<>(String.class, "");
     private final Index<String> functions = new Index<>(String.class, "");
     private final Index<Long> locations = new Index<>(Long.class, 0L);
+    private final OutputStream out;
+    private long startNanos = Long.MAX_VALUE;
+    private long endNanos = Long.MIN_VALUE;
 
     public JfrToPprof(JfrReader jfr, Arguments args) {
+        this(jfr, args, null);
+    }
+
+    // Encoded samples are written to the stream as they come instead of being buffered,
+    // since Profile fields may appear in any order; dump() to the same stream completes the message
+    public JfrToPprof(JfrReader jfr, Arguments args, OutputStream out) {
         super(jfr, args);
+        this.out = out;
 
         Proto sampleType;
         if (args.nativemem) {
@@ -42,6 +57,23 @@ public class JfrToPprof extends JfrConverter {
                 .field(13, strings.index("Produced by async-profiler"));
     }
 
+    @Override
+    public void convert() throws IOException {
+        try {
+            super.convert();
+        } catch (UncheckedIOException e) {
+            throw e.getCause();
+        }
+        startNanos = Math.min(startNanos, jfr.startNanos);
+        endNanos = Math.max(endNanos, jfr.startNanos + jfr.durationNanos());
+    }
+
+    // Adds another recording to the same profile: strings, functions and locations are shared
+    public void convert(JfrReader jfr) throws IOException {
+        this.jfr = jfr;
+        convert();
+    }
+
     @Override
     protected void convertChunk() {
         collector.forEach(new AggregatedEventVisitor() {
@@ -51,6 +83,14 @@ public class JfrToPprof extends JfrConverter {
             public void visit(Event event, long value) {
                 profile.field(2, sample(s, event, value));
                 s.reset();
+
+                if (out != null && profile.size() >= STREAM_THRESHOLD) {
+                    try {
+                        profile.writeTo(out);
+                    } catch (IOException e) {
+                        throw new UncheckedIOException(e);
+                    }
+                }
             }
         });
     }
@@ -73,10 +113,14 @@ public class JfrToPprof extends JfrConverter {
             profile.field(6, string);
         }
 
-        profile.field(9, jfr.startNanos)
-                .field(10, jfr.durationNanos());
+        if (startNanos > endNanos) {
+            startNanos = jfr.startNanos;
+            endNanos = startNanos + jfr.durationNanos();
+        }
+        profile.field(9, startNanos)
+                .field(10, endNanos - startNanos);
 
-        out.write(profile.buffer(), 0, profile.size());
+        profile.writeTo(out);
     }
 
     private Proto sample(Proto s, Event event, long value) {
@@ -152,14 +196,25 @@ public class JfrToPprof extends JfrConverter {
     }
 
     public static void convert(String input, String output, Arguments args) throws IOException {
-        JfrToPprof converter;
-        try (JfrReader jfr = new JfrReader(input)) {
-            converter = new JfrToPprof(jfr, args);
-            converter.convert();
-        }
+        convert(Collections.singletonList(input), output, args);
+    }
+
+    // Merges all inputs into one profile in a single pass
+    public static void convert(List<String> inputs, String output, Arguments args) throws IOException {
         try (FileOutputStream fos = new FileOutputStream(output);
              OutputStream out = args.output.endsWith("gz") ? new GZIPOutputStream(fos, 4096) : fos) {
-            converter.dump(out);
+            JfrToPprof converter = null;
+            for (String input : inputs) {
+                try (JfrReader jfr = new JfrReader(input)) {
+                    if (converter == null) {
+                        converter = new JfrToPprof(jfr, args, out);
+                    }
+                    converter.convert(jfr);
+                }
+            }
+            if (converter != null) {
+                converter.dump(out);
+            }
         }
     }
 }
@@ -55,7 +55,7 @@ public class Heatmap {
         return new EvaluationContext(
                 state.sampleList.samples(),
                 state.methodsCache.methodsIndex(),
-                state.stackTracesRemap.orderedTraces(),
+                state.stackTracesRemap,
                 state.methodsCache.orderedSymbolTable()
         );
     }
@@ -241,7 +241,10 @@ public class Heatmap {
         int[] samples = context.sampleList.stackIds;
 
         // prepared data for output, firstly used to remember last stack positions
-        int[] stackBuffer = new int[(context.stackTraces.length + 1) * 16];
+        StackStorage stacks = context.stackTraces;
+        int[] frames = stacks.frames();
+        int stacksCount = stacks.size();
+        int[] stackBuffer = new int[(stacksCount + 1) * 16];
 
         // remember the last position of stackId
         for (int i = 0; i < samples.length; i++) {
@@ -249,18 +252,20 @@ public class Heatmap {
             stackBuffer[stackId * 2] = ~i;   // rewrites data multiple times, the last one wins
         }
 
-        int chunksIterator = context.stackTraces.length * 2 + 1;
+        int chunksIterator = stacksCount * 2 + 1;
 
         // builds the tree and prepares data for the last stack
         for (int i = 0; i < samples.length; i++) {
             int stackId = samples[i];
             int current = 0;
-            int[] stack = context.stackTraces[stackId];
+            int stackStart = stacks.stackStart(stackId);
+            int stackEnd = stacks.stackEnd(stackId);
 
             if (i == ~stackBuffer[stackId * 2]) {    // last version of that stack
                 stackBuffer[stackId * 2] = chunksIterator;  // start
 
-                for (int methodId : stack) {
+                for (int j = stackStart; j < stackEnd; j++) {
+                    int methodId = frames[j];
                     current = context.nodeTree.appendChild(current, methodId);
                     if (current == 0) { // so we are starting from root again, it will be written to output as Lz78 element - [parent node id; method id]
                         context.orderedMethods[methodId].frequencyOrNewMethodId++;
@@ -285,7 +290,8 @@ public class Heatmap {
 
                 stackBuffer[stackId * 2 + 1] = chunksIterator;  // end
             } else { // general case
-                for (int methodId : stack) {
+                for (int j = stackStart; j < stackEnd; j++) {
+                    int methodId = frames[j];
                     current = context.nodeTree.appendChild(current, methodId);
                     if (current == 0) { // so we are starting from root again, it will be written to output as Lz78 element - [parent node id; method id]
                         context.orderedMethods[methodId].frequencyOrNewMethodId++;
@@ -295,7 +301,7 @@ public class Heatmap {
         }
 
         // removes unused chunks
-        context.nodeTree.compactTree(stackBuffer, context.stackTraces.length * 2 + 1, chunksIterator);
+        context.nodeTree.compactTree(stackBuffer, stacksCount * 2 + 1, chunksIterator);
 
         return stackBuffer;
     }
@@ -374,14 +380,14 @@ public class Heatmap {
     private static class EvaluationContext {
         final Index<Method> methods;
         final Method[] orderedMethods;
-        final int[][] stackTraces;
+        final StackStorage stackTraces;
         final String[] symbols;
 
         final SampleList.Result sampleList;
 
         final LzNodeTree nodeTree = new LzNodeTree();
 
-        EvaluationContext(SampleList.Result sampleList, Index<Method> methods, int[][] stackTraces, String[] symbols) {
+        EvaluationContext(SampleList.Result sampleList, Index<Method> methods, StackStorage stackTraces, String[] symbols) {
             this.sampleList = sampleList;
             this.methods = methods;
             this.stackTraces = stackTraces;
@@ -425,9 +431,7 @@ public class Heatmap {
             }
 
             int prototypeId = stackTracesCache.get(stackTraceId);
-            int[] prototype = stackTracesRemap.get(prototypeId);
-
-            id = stackTracesRemap.indexWithPrototype(prototype, methodsCache.indexForClass(extra, type));
+            id = stackTracesRemap.indexWithPrototype(prototypeId, methodsCache.indexForClass(extra, type));
             stackTracesCache.put((long) extra << 32 | stackTraceId, id);
 
             sampleList.add(id, timeMs);
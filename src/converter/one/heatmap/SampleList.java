@@ -9,7 +9,8 @@ import java.util.Arrays;
 
 public class SampleList {
 
-    private static final int DEFAULT_SAMPLES_COUNT = 10_000_000;
+    // grows by half when full, so that short recordings do not reserve hundreds of megabytes
+    private static final int DEFAULT_SAMPLES_COUNT = 1_000_000;
 
     private final long blockDurationMs;
 
@@ -38,7 +39,8 @@ public class SampleList {
     }
 
     public Result samples() {
-        Arrays.sort(data, 0, recordsCount);
+        // the most expensive step for long recordings, spread over the common ForkJoin pool
+        Arrays.parallelSort(data, 0, recordsCount);
 
         int firstBlockId = (int) (data[0] >> 32);
         int lastBlockId = (int) (data[recordsCount - 1] >> 32);
@@ -16,8 +16,10 @@ public class StackStorage {
     // highest 32 bits for index, lowest 32 bits for hash
     private long[] meta;
 
-    // ordered incrementally
-    private int[][] values;
+    // frames of all stacks one after another, ordered incrementally;
+    // stack i occupies frames[offsets[i]] .. frames[offsets[i + 1] - 1]
+    private int[] frames;
+    private int[] offsets;
 
     public StackStorage() {
         this(INITIAL_CAPACITY);
@@ -25,16 +27,30 @@ public class StackStorage {
 
     public StackStorage(int initialCapacity) {
         meta = new long[initialCapacity * 2];
-        values = new int[initialCapacity][];
+        offsets = new int[initialCapacity + 1];
+        frames = new int[initialCapacity * 16];
     }
 
-    public int[] get(int id) {
-        return values[id - 1];
+    public int size() {
+        return size;
+    }
+
+    // shared array of frames, valid until the next stack is added
+    public int[] frames() {
+        return frames;
+    }
+
+    public int stackStart(int index) {
+        return offsets[index];
+    }
+
+    public int stackEnd(int index) {
+        return offsets[index + 1];
     }
 
     public int index(int[] stack, int stackSize) {
         int mask = meta.length - 1;
-        int hashCode = murmur(stack, stackSize);
+        int hashCode = murmur(stack, 0, stackSize, -1);
         int i = hashCode & mask;
         while (true) {
             long currentMeta = meta[i];
@@ -45,8 +61,7 @@ public class StackStorage {
             int hash = (int) currentMeta;
             if (hash == hashCode) {
                 int index = (int) (currentMeta >>> 32);
-                int[] value = values[index];
-                if (equals(value, stack, stackSize)) {
+                if (equals(index, stack, 0, stackSize, -1)) {
                     return index + 1;
                 }
             }
@@ -54,20 +69,17 @@ public class StackStorage {
             i = (i + 1) & mask;
         }
 
-        values[size] = Arrays.copyOf(stack, stackSize);
-        meta[i] = (long) size << 32 | (hashCode & 0xFFFFFFFFL);
-        size++;
-
-        if (size * 2 > values.length) {
-            resize(values.length * 2);
-        }
-
+        add(i, hashCode, stack, 0, stackSize, -1);
         return size;
     }
 
-    public int indexWithPrototype(int[] prototype, int append) {
+    // prototypeId is a value returned by index(), the new stack is the prototype followed by append
+    public int indexWithPrototype(int prototypeId, int append) {
+        int from = offsets[prototypeId - 1];
+        int length = offsets[prototypeId] - from;
+
         int mask = meta.length - 1;
-        int hashCode = murmurWithExtra(prototype, append);
+        int hashCode = murmur(frames, from, length, append);
         int i = hashCode & mask;
         while (true) {
             long currentMeta = meta[i];
@@ -78,30 +90,37 @@ public class StackStorage {
             int hash = (int) currentMeta;
             if (hash == hashCode) {
                 int index = (int) (currentMeta >>> 32);
-                int[] value = values[index - 1];
-                if (equalsWithExtra(value, prototype, append)) {
-                    return index;
+                if (equals(index, frames, from, length, append)) {
+                    return index + 1;
                 }
             }
 
             i = (i + 1) & mask;
         }
 
-        int[] stack = Arrays.copyOf(prototype, prototype.length + 1);
-        stack[prototype.length] = append;
-        values[size] = stack;
-        meta[i] = (long) size << 32 | (hashCode & 0xFFFFFFFFL);
-        size++;
+        add(i, hashCode, frames, from, length, append);
+        return size;
+    }
 
-        if (size * 2 > values.length) {
-            resize(values.length * 2);
+    // appends stack[from .. from + length) and an optional extra frame, if it is non-negative
+    private void add(int slot, int hashCode, int[] stack, int from, int length, int extra) {
+        int start = offsets[size];
+        int end = start + length + (extra >= 0 ? 1 : 0);
+        if (end > frames.length) {
+            // stack may be the old frames array, which is left intact by copying
+            frames = Arrays.copyOf(frames, Math.max(end, frames.length + frames.length / 2));
+        }
+        System.arraycopy(stack, from, frames, start, length);
+        if (extra >= 0) {
+            frames[start + length] = extra;
         }
 
-        return size;
-    }
+        meta[slot] = (long) size << 32 | (hashCode & 0xFFFFFFFFL);
+        offsets[++size] = end;
 
-    public int[][] orderedTraces() {
-        return Arrays.copyOf(values, size);
+        if (size * 2 > offsets.length - 1) {
+            resize((offsets.length - 1) * 2);
+        }
     }
 
     protected void resize(int newCapacity) {
@@ -121,38 +140,28 @@ public class StackStorage {
         }
 
         meta = newMeta;
-        values = Arrays.copyOf(values, newCapacity);
+        offsets = Arrays.copyOf(offsets, newCapacity + 1);
     }
 
-    private boolean equals(int[] a, int[] b, int bSize) {
-        if (a.length != bSize) {
+    private boolean equals(int index, int[] b, int from, int length, int extra) {
+        int start = offsets[index];
+        int aSize = offsets[index + 1] - start;
+        if (aSize != length + (extra >= 0 ? 1 : 0)) {
             return false;
         }
-        for (int i = 0; i < bSize; i++) {
-            if (a[i] != b[i]) {
+        for (int i = 0; i < length; i++) {
+            if (frames[start + i] != b[from + i]) {
                 return false;
             }
         }
-        return true;
+        return extra < 0 || frames[start + length] == extra;
     }
 
-    private boolean equalsWithExtra(int[] a, int[] b, int extra) {
-        if (a.length != b.length + 1) {
-            return false;
-        }
-        for (int i = 0; i < b.length; i++) {
-            if (a[i] != b[i]) {
-                return false;
-            }
-        }
-        return a[b.length] == extra;
-    }
-
-    private static int murmur(int[] data, int size) {
+    private static int murmur(int[] data, int from, int length, int extra) {
         int m = 0x5bd1e995;
-        int h = 0x9747b28c ^ data.length;
+        int h = 0x9747b28c ^ (length + (extra >= 0 ? 1 : 0));
 
-        for (int i = 0; i < size; i++) {
+        for (int i = from; i < from + length; i++) {
             int k = data[i];
             k *= m;
             k ^= k >>> 24;
@@ -161,31 +170,14 @@ public class StackStorage {
             h ^= k;
         }
 
-        h ^= h >>> 13;
-        h *= m;
-        h ^= h >>> 15;
-
-        return h;
-    }
-
-    private static int murmurWithExtra(int[] data, int extra) {
-        int m = 0x5bd1e995;
-        int h = 0x9747b28c ^ (data.length + 1);
-
-        for (int k : data) {
-            k *= m;
+        if (extra >= 0) {
+            int k = extra * m;
             k ^= k >>> 24;
             k *= m;
             h *= m;
             h ^= k;
         }
 
-        int k = extra * m;
-        k ^= k >>> 24;
-        k *= m;
-        h *= m;
-        h ^= k;
-
         h ^= h >>> 13;
         h *= m;
         h ^= h >>> 15;
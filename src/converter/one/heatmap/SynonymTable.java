@@ -27,7 +27,7 @@ public class SynonymTable {
             synonyms[i] = (long) childrenCount[i] << 32 | i;
         }
 
-        Arrays.sort(synonyms, 0, nodesCount);
+        Arrays.parallelSort(synonyms, 0, nodesCount);
 
         synonymsCount = Math.min(61 * 61, nodesCount);
 
@@ -8,19 +8,26 @@ package one.jfr;
 import one.jfr.event.*;
 
 import java.io.Closeable;
+import java.io.EOFException;
 import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
 import java.lang.reflect.Constructor;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
 import java.nio.channels.FileChannel;
 import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
 import java.nio.file.Paths;
 import java.nio.file.StandardOpenOption;
+import java.util.ArrayDeque;
 import java.util.ArrayList;
 import java.util.Collections;
 import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
+import java.util.zip.GZIPInputStream;
 
 /**
  * Parses JFR output produced by async-profiler.
@@ -39,7 +46,12 @@ public class JfrReader implements Closeable {
     private ByteBuffer buf;
     private final long fileSize;
     private long filePosition;
+    private long nextChunkPosition;
     private byte state;
+    private int cpoolStart;
+    private int cpoolSize;
+    private long fromNanos = Long.MIN_VALUE;
+    private long toNanos = Long.MAX_VALUE;
 
     public long startNanos = Long.MAX_VALUE;
     public long endNanos = Long.MIN_VALUE;
@@ -55,13 +67,14 @@ public class JfrReader implements Closeable {
     public final Dictionary<String> threads = new Dictionary<>();
     public final Dictionary<ClassRef> classes = new Dictionary<>();
     public final Dictionary<String> strings = new Dictionary<>();
-    public final Dictionary<byte[]> symbols = new Dictionary<>();
+    public final SymbolTable symbols = new SymbolTable();
     public final Dictionary<MethodRef> methods = new Dictionary<>();
     public final Dictionary<StackTrace> stackTraces = new Dictionary<>();
     public final Map<String, String> settings = new HashMap<>();
     public final Map<String, Map<Integer, String>> enums = new HashMap<>();
 
     private final Dictionary<Constructor<? extends Event>> customEvents = new Dictionary<>();
+    private final ArrayDeque<Event> batchedEvents = new ArrayDeque<>();
 
     private int executionSample;
     private int nativeMethodSample;
@@ -75,9 +88,14 @@ public class JfrReader implements Closeable {
     private int activeSetting;
     private int malloc;
     private int free;
+    private int mallocBatch;
+    private int allocationBatch;
+    private boolean executionSampleContext;
+    private boolean executionSampleCpu;
+    private boolean wallClockSampleContext;
 
     public JfrReader(String fileName) throws IOException {
-        this.ch = FileChannel.open(Paths.get(fileName), StandardOpenOption.READ);
+        this.ch = openChannel(Paths.get(fileName));
         this.buf = ByteBuffer.allocateDirect(BUFFER_SIZE);
         this.fileSize = ch.size();
 
@@ -99,6 +117,30 @@ public class JfrReader implements Closeable {
         }
     }
 
+    // Recordings made with jfropts=gzip are unpacked to a temporary file, since chunks are accessed randomly
+    private static FileChannel openChannel(Path path) throws IOException {
+        try (InputStream in = Files.newInputStream(path)) {
+            if (in.read() != 0x1f || in.read() != 0x8b) {
+                return FileChannel.open(path, StandardOpenOption.READ);
+            }
+        }
+
+        Path tmp = Files.createTempFile("jfr", ".jfr");
+        try (InputStream in = new GZIPInputStream(Files.newInputStream(path), 65536);
+             OutputStream out = Files.newOutputStream(tmp)) {
+            byte[] data = new byte[65536];
+            for (int bytes; (bytes = in.read(data)) > 0; ) {
+                out.write(data, 0, bytes);
+            }
+        } catch (EOFException e) {
+            // The last chunk is still being compressed; it will be treated as incomplete
+        } catch (IOException e) {
+            Files.deleteIfExists(tmp);
+            throw e;
+        }
+        return FileChannel.open(tmp, StandardOpenOption.READ, StandardOpenOption.DELETE_ON_CLOSE);
+    }
+
     @Override
     public void close() throws IOException {
         if (ch != null) {
@@ -134,6 +176,93 @@ public class JfrReader implements Closeable {
         return state == STATE_NEW_CHUNK ? readChunk(buf.position()) : state == STATE_READING;
     }
 
+    // Chunks that end before fromNanos or start after toNanos are skipped without parsing
+    public void setTimeRange(long fromNanos, long toNanos) throws IOException {
+        this.fromNanos = fromNanos;
+        this.toNanos = toNanos;
+
+        if (state == STATE_READING && !inTimeRange(chunkStartNanos, chunkEndNanos)) {
+            seek(nextChunkPosition);
+            state = ensureBytes(CHUNK_HEADER_SIZE) ? STATE_NEW_CHUNK : STATE_EOF;
+        }
+    }
+
+    private boolean inTimeRange(long chunkStartNanos, long chunkEndNanos) {
+        return chunkEndNanos >= fromNanos && chunkStartNanos <= toNanos;
+    }
+
+    // Chunk headers link all chunks of the recording and serve as the index of their time ranges.
+    // Extends startNanos/endNanos to the whole recording without parsing any chunk.
+    public void readChunkHeaders() throws IOException {
+        walkChunks(null);
+    }
+
+    // Maps all complete chunks within the time range for parsing them independently with JfrReader(ByteBuffer).
+    // Also extends startNanos/endNanos to the whole recording. Returns null if a chunk cannot be mapped.
+    public List<ByteBuffer> mapChunks() throws IOException {
+        List<ByteBuffer> chunks = new ArrayList<>();
+        return walkChunks(chunks) ? chunks : null;
+    }
+
+    private boolean walkChunks(List<ByteBuffer> chunks) throws IOException {
+        ByteBuffer header = ByteBuffer.allocate(CHUNK_HEADER_SIZE);
+
+        for (long pos = 0; pos + CHUNK_HEADER_SIZE <= fileSize; ) {
+            header.clear();
+            if (ch != null) {
+                while (header.hasRemaining() && ch.read(header, pos + header.position()) > 0) {
+                    // keep reading
+                }
+            } else {
+                ByteBuffer src = buf.duplicate();
+                src.limit((int) pos + CHUNK_HEADER_SIZE).position((int) pos);
+                header.put(src);
+            }
+
+            if (header.position() < CHUNK_HEADER_SIZE || header.getInt(0) != CHUNK_SIGNATURE) {
+                break;
+            }
+
+            long chunkSize = header.getLong(8);
+            if (chunkSize < CHUNK_HEADER_SIZE || pos + chunkSize > fileSize ||
+                    header.getLong(16) == 0 || header.getLong(24) == 0) {
+                // Incomplete chunk is the last one
+                break;
+            }
+
+            long chunkStart = header.getLong(32);
+            long chunkEnd = chunkStart + header.getLong(40);
+            startNanos = Math.min(startNanos, chunkStart);
+            endNanos = Math.max(endNanos, chunkEnd);
+            startTicks = Math.min(startTicks, header.getLong(48));
+
+            if (chunks != null && inTimeRange(chunkStart, chunkEnd)) {
+                if (chunkSize > Integer.MAX_VALUE) {
+                    return false;
+                } else if (ch != null) {
+                    chunks.add(ch.map(FileChannel.MapMode.READ_ONLY, pos, chunkSize));
+                } else {
+                    ByteBuffer chunk = buf.duplicate();
+                    chunk.limit((int) (pos + chunkSize)).position((int) pos);
+                    chunks.add(chunk.slice());
+                }
+            }
+            pos += chunkSize;
+        }
+        return true;
+    }
+
+    // Chunks are self-contained: once events of a chunk are converted, its constant pools
+    // can be released to keep memory bounded by the largest chunk rather than the whole file
+    public void discardConstants() {
+        threads.clear();
+        classes.clear();
+        strings.clear();
+        symbols.clear();
+        methods.clear();
+        stackTraces.clear();
+    }
+
     public List<Event> readAllEvents() throws IOException {
         return readAllEvents(null);
     }
@@ -153,6 +282,10 @@ public class JfrReader implements Closeable {
 
     @SuppressWarnings("unchecked")
     public <E extends Event> E readEvent(Class<E> cls) throws IOException {
+        if (!batchedEvents.isEmpty()) {
+            return (E) batchedEvents.poll();
+        }
+
         while (ensureBytes(CHUNK_HEADER_SIZE)) {
             int pos = buf.position();
             int size = getVarint();
@@ -168,10 +301,12 @@ public class JfrReader implements Closeable {
                 return null;
             }
 
-            if (type == executionSample || type == nativeMethodSample) {
-                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample(false);
+            if (type == executionSample) {
+                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample(false, executionSampleContext);
+            } else if (type == nativeMethodSample) {
+                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample(false, false);
             } else if (type == wallClockSample) {
-                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample(true);
+                if (cls == null || cls == ExecutionSample.class) return (E) readExecutionSample(true, wallClockSampleContext);
             } else if (type == allocationInNewTLAB) {
                 if (cls == null || cls == AllocationSample.class) return (E) readAllocationSample(true);
             } else if (type == allocationOutsideTLAB || type == allocationSample) {
@@ -180,6 +315,10 @@ public class JfrReader implements Closeable {
                 if (cls == null || cls == MallocEvent.class) return (E) readMallocEvent(true);
             } else if (type == free) {
                 if (cls == null || cls == MallocEvent.class) return (E) readMallocEvent(false);
+            } else if (type == mallocBatch) {
+                if (cls == null || cls == MallocEvent.class) return (E) readMallocBatch(size - (buf.position() - pos));
+            } else if (type == allocationBatch) {
+                if (cls == null || cls == AllocationSample.class) return (E) readAllocationBatch(size - (buf.position() - pos));
             } else if (type == liveObject) {
                 if (cls == null || cls == LiveObject.class) return (E) readLiveObject();
             } else if (type == monitorEnter) {
@@ -208,13 +347,25 @@ public class JfrReader implements Closeable {
         return null;
     }
 
-    private ExecutionSample readExecutionSample(boolean hasSamples) {
+    private ExecutionSample readExecutionSample(boolean hasSamples, boolean hasContext) {
         long time = getVarlong();
         int tid = getVarint();
         int stackTraceId = getVarint();
         int threadState = getVarint();
         int samples = hasSamples ? getVarint() : 1;
-        return new ExecutionSample(time, tid, stackTraceId, threadState, samples);
+        if (!hasContext) {
+            return new ExecutionSample(time, tid, stackTraceId, threadState, samples);
+        }
+        long spanId = getVarlong();
+        long traceId = getVarlong();
+        int contextTag = getVarint();
+        if (hasSamples || !executionSampleCpu) {
+            return new ExecutionSample(time, tid, stackTraceId, threadState, samples, spanId, traceId, contextTag);
+        }
+        int cpu = getVarint();
+        int numaNode = getVarint();
+        return new ExecutionSample(time, tid, stackTraceId, threadState, samples, spanId, traceId, contextTag,
+                cpu, numaNode);
     }
 
     private AllocationSample readAllocationSample(boolean tlab) {
@@ -236,6 +387,39 @@ public class JfrReader implements Closeable {
         return new MallocEvent(time, tid, stackTraceId, address, size);
     }
 
+    // Batch entries share the thread and carry the time relative to the previous entry
+    private MallocEvent readMallocBatch(int remaining) throws IOException {
+        // Unlike regular events, a batch may exceed the chunk header size guaranteed by readEvent
+        ensureBytes(remaining);
+        long time = getVarlong();
+        int tid = getVarint();
+        int count = getVarint();
+        for (int i = 0; i < count; i++) {
+            time += getVarlong();
+            int stackTraceId = getVarint();
+            long address = getVarlong();
+            long size = getVarlong();
+            batchedEvents.add(new MallocEvent(time, tid, stackTraceId, address, size));
+        }
+        return (MallocEvent) batchedEvents.poll();
+    }
+
+    private AllocationSample readAllocationBatch(int remaining) throws IOException {
+        ensureBytes(remaining);
+        long time = getVarlong();
+        int tid = getVarint();
+        int count = getVarint();
+        for (int i = 0; i < count; i++) {
+            time += getVarlong();
+            int stackTraceId = getVarint();
+            int classId = getVarint();
+            long allocationSize = getVarlong();
+            long tlabSize = getVarlong();
+            batchedEvents.add(new AllocationSample(time, tid, stackTraceId, classId, allocationSize, tlabSize));
+        }
+        return (AllocationSample) batchedEvents.poll();
+    }
+
     private LiveObject readLiveObject() {
         long time = getVarlong();
         int tid = getVarint();
@@ -271,48 +455,61 @@ public class JfrReader implements Closeable {
     }
 
     private boolean readChunk(int pos) throws IOException {
-        if (pos + CHUNK_HEADER_SIZE > buf.limit() || buf.getInt(pos) != CHUNK_SIGNATURE) {
-            throw new IOException("Not a valid JFR file");
-        }
-
-        int version = buf.getInt(pos + 4);
-        if (version < 0x20000 || version > 0x2ffff) {
-            throw new IOException("Unsupported JFR version: " + (version >>> 16) + "." + (version & 0xffff));
-        }
+        while (true) {
+            if (pos + CHUNK_HEADER_SIZE > buf.limit() || buf.getInt(pos) != CHUNK_SIGNATURE) {
+                throw new IOException("Not a valid JFR file");
+            }
 
-        long chunkStart = filePosition + pos;
-        long chunkSize = buf.getLong(pos + 8);
-        if (chunkStart + chunkSize > fileSize) {
-            state = STATE_INCOMPLETE;
-            return false;
-        }
+            int version = buf.getInt(pos + 4);
+            if (version < 0x20000 || version > 0x2ffff) {
+                throw new IOException("Unsupported JFR version: " + (version >>> 16) + "." + (version & 0xffff));
+            }
 
-        long cpOffset = buf.getLong(pos + 16);
-        long metaOffset = buf.getLong(pos + 24);
-        if (cpOffset == 0 || metaOffset == 0) {
-            state = STATE_INCOMPLETE;
-            return false;
-        }
+            long chunkStart = filePosition + pos;
+            long chunkSize = buf.getLong(pos + 8);
+            if (chunkStart + chunkSize > fileSize) {
+                state = STATE_INCOMPLETE;
+                return false;
+            }
 
-        chunkStartNanos = buf.getLong(pos + 32);
-        chunkEndNanos = buf.getLong(pos + 32) + buf.getLong(pos + 40);
-        chunkStartTicks = buf.getLong(pos + 48);
-        ticksPerSec = buf.getLong(pos + 56);
+            long cpOffset = buf.getLong(pos + 16);
+            long metaOffset = buf.getLong(pos + 24);
+            if (cpOffset == 0 || metaOffset == 0) {
+                state = STATE_INCOMPLETE;
+                return false;
+            }
 
-        startNanos = Math.min(startNanos, chunkStartNanos);
-        endNanos = Math.max(endNanos, chunkEndNanos);
-        startTicks = Math.min(startTicks, chunkStartTicks);
+            chunkStartNanos = buf.getLong(pos + 32);
+            chunkEndNanos = buf.getLong(pos + 32) + buf.getLong(pos + 40);
+            chunkStartTicks = buf.getLong(pos + 48);
+            ticksPerSec = buf.getLong(pos + 56);
+
+            startNanos = Math.min(startNanos, chunkStartNanos);
+            endNanos = Math.max(endNanos, chunkEndNanos);
+            startTicks = Math.min(startTicks, chunkStartTicks);
+            nextChunkPosition = chunkStart + chunkSize;
+
+            if (!inTimeRange(chunkStartNanos, chunkEndNanos)) {
+                seek(nextChunkPosition);
+                if (!ensureBytes(CHUNK_HEADER_SIZE)) {
+                    state = STATE_EOF;
+                    return false;
+                }
+                pos = buf.position();
+                continue;
+            }
 
-        types.clear();
-        typesByName.clear();
+            types.clear();
+            typesByName.clear();
 
-        readMeta(chunkStart + metaOffset);
-        readConstantPool(chunkStart + cpOffset);
-        cacheEventTypes();
+            readMeta(chunkStart + metaOffset);
+            readConstantPool(chunkStart + cpOffset);
+            cacheEventTypes();
 
-        seek(chunkStart + CHUNK_HEADER_SIZE);
-        state = STATE_READING;
-        return true;
+            seek(chunkStart + CHUNK_HEADER_SIZE);
+            state = STATE_READING;
+            return true;
+        }
     }
 
     private void readMeta(long metaOffset) throws IOException {
@@ -374,7 +571,10 @@ public class JfrReader implements Closeable {
             ensureBytes(5);
 
             int posBeforeSize = buf.position();
-            ensureBytes(getVarint() - (buf.position() - posBeforeSize));
+            cpoolSize = getVarint();
+            int sizeLength = buf.position() - posBeforeSize;
+            ensureBytes(cpoolSize - sizeLength);
+            cpoolStart = buf.position() - sizeLength;
             getVarint();
             getVarlong();
             getVarlong();
@@ -389,7 +589,7 @@ public class JfrReader implements Closeable {
         } while (delta != 0 && (cpOffset += delta) > 0);
     }
 
-    private void readConstants(JfrClass type) {
+    private void readConstants(JfrClass type) throws IOException {
         switch (type.name) {
             case "jdk.types.ChunkHeader":
                 buf.position(buf.position() + (CHUNK_HEADER_SIZE + 3));
@@ -410,7 +610,7 @@ public class JfrReader implements Closeable {
                 readMethods();
                 break;
             case "jdk.types.StackTrace":
-                readStackTraces();
+                readStackTraces(type.fields.size());
                 break;
             default:
                 if (type.simpleType && type.fields.size() == 1) {
@@ -460,12 +660,17 @@ public class JfrReader implements Closeable {
         }
     }
 
-    private void readStackTraces() {
+    private void readStackTraces(int fieldCount) {
         int count = stackTraces.preallocate(getVarint());
         for (int i = 0; i < count; i++) {
             long id = getVarlong();
             int truncated = getVarint();
             StackTrace stackTrace = readStackTrace();
+            if (fieldCount > 2) {
+                // Category computed by the profiler
+                stackTrace.category = getVarint();
+                readFields(fieldCount - 3);
+            }
             stackTraces.put(id, stackTrace);
         }
     }
@@ -492,14 +697,25 @@ public class JfrReader implements Closeable {
         }
     }
 
-    private void readSymbols() {
+    // Symbols are not copied: they refer to the constant pool of the mapped chunk and are decoded on access
+    private void readSymbols() throws IOException {
+        int base = 0;
+        if (ch == null) {
+            symbols.addSegment(buf);
+        } else {
+            symbols.addSegment(ch.map(FileChannel.MapMode.READ_ONLY, filePosition + cpoolStart, cpoolSize));
+            base = cpoolStart;
+        }
+
         int count = symbols.preallocate(getVarint());
         for (int i = 0; i < count; i++) {
             long id = getVarlong();
             if (buf.get() != 3) {
                 throw new IllegalArgumentException("Invalid symbol encoding");
             }
-            symbols.put(id, getBytes());
+            int offset = buf.position() - base;
+            buf.position(buf.position() + getVarint());
+            symbols.put(id, offset);
         }
     }
 
@@ -557,8 +773,14 @@ public class JfrReader implements Closeable {
         activeSetting = getTypeId("jdk.ActiveSetting");
         malloc = getTypeId("profiler.Malloc");
         free = getTypeId("profiler.Free");
+        mallocBatch = getTypeId("profiler.MallocBatch");
+        allocationBatch = getTypeId("profiler.AllocationBatch");
+        executionSampleContext = hasField("jdk.ExecutionSample", "spanId");
+        executionSampleCpu = hasField("jdk.ExecutionSample", "cpu");
+        wallClockSampleContext = hasField("profiler.WallClockSample", "spanId");
 
         registerEvent("jdk.CPULoad", CPULoad.class);
+        registerEvent("jdk.ThreadCPULoad", ThreadCPULoad.class);
         registerEvent("jdk.GCHeapSummary", GCHeapSummary.class);
         registerEvent("jdk.ObjectCount", ObjectCount.class);
         registerEvent("jdk.ObjectCountAfterGC", ObjectCount.class);
@@ -569,6 +791,11 @@ public class JfrReader implements Closeable {
         return type != null ? type.id : -1;
     }
 
+    private boolean hasField(String typeName, String fieldName) {
+        JfrClass type = typesByName.get(typeName);
+        return type != null && type.field(fieldName) != null;
+    }
+
     public int getEnumKey(String typeName, String value) {
         Map<Integer, String> enumValues = enums.get(typeName);
         if (enumValues != null) {
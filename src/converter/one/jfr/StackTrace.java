@@ -9,6 +9,7 @@ public class StackTrace {
     public final long[] methods;
     public final byte[] types;
     public final int[] locations;
+    public int category;  // Classifier.Category ordinal + 1, or 0 if not classified by the profiler
 
     public StackTrace(long[] methods, byte[] types, int[] locations) {
         this.methods = methods;
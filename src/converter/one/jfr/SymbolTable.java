@@ -0,0 +1,89 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package one.jfr;
+
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Symbols of the constant pool kept as offsets into the buffers they were read from.
+ * Bytes of a symbol are copied out on the first access only, since most symbols
+ * (signatures, packages, unused methods) are never looked at by converters.
+ */
+public class SymbolTable {
+    private static final int INITIAL_CAPACITY = 16;
+
+    private final DictionaryInt slots = new DictionaryInt();
+    private final List<ByteBuffer> segments = new ArrayList<>();
+    // Segment index in the high half, offset of the symbol length in the low half
+    private long[] positions = new long[INITIAL_CAPACITY];
+    private byte[][] decoded = new byte[INITIAL_CAPACITY][];
+    private int count;
+
+    public void clear() {
+        slots.clear();
+        segments.clear();
+        Arrays.fill(decoded, 0, count, null);
+        count = 0;
+    }
+
+    public int preallocate(int count) {
+        slots.preallocate(count);
+        ensureCapacity(this.count + count);
+        return count;
+    }
+
+    // Subsequent put() calls refer to offsets within this buffer
+    void addSegment(ByteBuffer segment) {
+        segments.add(segment);
+    }
+
+    void put(long id, int offset) {
+        ensureCapacity(count + 1);
+        positions[count] = (long) (segments.size() - 1) << 32 | (offset & 0xffffffffL);
+        slots.put(id, count++);
+    }
+
+    public byte[] get(long id) {
+        int slot = slots.get(id, -1);
+        if (slot < 0) {
+            return null;
+        }
+
+        byte[] bytes = decoded[slot];
+        if (bytes == null) {
+            decoded[slot] = bytes = decode(segments.get((int) (positions[slot] >>> 32)), (int) positions[slot]);
+        }
+        return bytes;
+    }
+
+    private static byte[] decode(ByteBuffer segment, int offset) {
+        int length = 0;
+        for (int shift = 0; ; shift += 7) {
+            byte b = segment.get(offset++);
+            length |= (b & 0x7f) << shift;
+            if (b >= 0) {
+                break;
+            }
+        }
+
+        byte[] bytes = new byte[length];
+        ByteBuffer src = segment.duplicate();
+        src.position(offset);
+        src.get(bytes);
+        return bytes;
+    }
+
+    private void ensureCapacity(int capacity) {
+        if (capacity > positions.length) {
+            int newCapacity = Math.max(capacity, positions.length * 2);
+            positions = Arrays.copyOf(positions, newCapacity);
+            decoded = Arrays.copyOf(decoded, newCapacity);
+        }
+    }
+}
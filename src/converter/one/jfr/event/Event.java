@@ -52,6 +52,14 @@ public abstract class Event implements Comparable<Event> {
         return 0;
     }
 
+    public int cpu() {
+        return -1;
+    }
+
+    public int numaNode() {
+        return -1;
+    }
+
     public long samples() {
         return 1;
     }
@@ -9,6 +9,7 @@ public class EventAggregator implements EventCollector {
     private static final int INITIAL_CAPACITY = 1024;
 
     private final boolean threads;
+    private final boolean cpus;
     private final double grain;
     private Event[] keys;
     private long[] samples;
@@ -17,7 +18,12 @@ public class EventAggregator implements EventCollector {
     private double fraction;
 
     public EventAggregator(boolean threads, double grain) {
+        this(threads, false, grain);
+    }
+
+    public EventAggregator(boolean threads, boolean cpus, double grain) {
         this.threads = threads;
+        this.cpus = cpus;
         this.grain = grain;
 
         beforeChunk();
@@ -116,11 +122,12 @@ public class EventAggregator implements EventCollector {
     }
 
     private int hashCode(Event e) {
-        return e.hashCode() + (threads ? e.tid * 31 : 0);
+        return e.hashCode() + (threads ? e.tid * 31 : 0) + (cpus ? e.cpu() * 17 : 0);
     }
 
     private boolean sameGroup(Event e1, Event e2) {
-        return e1.stackTraceId == e2.stackTraceId && (!threads || e1.tid == e2.tid) && e1.sameGroup(e2);
+        return e1.stackTraceId == e2.stackTraceId && (!threads || e1.tid == e2.tid)
+                && (!cpus || e1.cpu() == e2.cpu()) && e1.sameGroup(e2);
     }
 
     private void resize(int newCapacity) {
@@ -8,11 +8,41 @@ package one.jfr.event;
 public class ExecutionSample extends Event {
     public final int threadState;
     public final int samples;
+    public final long spanId;
+    public final long traceId;
+    public final int contextTag;
+    public final int cpu;       // -1 if unknown
+    public final int numaNode;  // -1 if unknown
 
     public ExecutionSample(long time, int tid, int stackTraceId, int threadState, int samples) {
+        this(time, tid, stackTraceId, threadState, samples, 0, 0, 0);
+    }
+
+    public ExecutionSample(long time, int tid, int stackTraceId, int threadState, int samples,
+                           long spanId, long traceId, int contextTag) {
+        this(time, tid, stackTraceId, threadState, samples, spanId, traceId, contextTag, -1, -1);
+    }
+
+    public ExecutionSample(long time, int tid, int stackTraceId, int threadState, int samples,
+                           long spanId, long traceId, int contextTag, int cpu, int numaNode) {
         super(time, tid, stackTraceId);
         this.threadState = threadState;
         this.samples = samples;
+        this.spanId = spanId;
+        this.traceId = traceId;
+        this.contextTag = contextTag;
+        this.cpu = cpu;
+        this.numaNode = numaNode;
+    }
+
+    @Override
+    public int cpu() {
+        return cpu;
+    }
+
+    @Override
+    public int numaNode() {
+        return numaNode;
     }
 
     @Override
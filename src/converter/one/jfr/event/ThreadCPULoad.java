@@ -0,0 +1,19 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package one.jfr.event;
+
+import one.jfr.JfrReader;
+
+public class ThreadCPULoad extends Event {
+    public final float user;
+    public final float system;
+
+    public ThreadCPULoad(JfrReader jfr) {
+        super(jfr.getVarlong(), jfr.getVarint(), 0);
+        this.user = jfr.getFloat();
+        this.system = jfr.getFloat();
+    }
+}
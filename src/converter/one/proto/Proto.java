@@ -5,6 +5,8 @@
 
 package one.proto;
 
+import java.io.IOException;
+import java.io.OutputStream;
 import java.nio.charset.StandardCharsets;
 import java.util.Arrays;
 
@@ -32,6 +34,12 @@ public class Proto {
         pos = 0;
     }
 
+    // Encoded fields of a message may be written in parts; the buffer is reused afterwards
+    public void writeTo(OutputStream out) throws IOException {
+        out.write(buf, 0, pos);
+        pos = 0;
+    }
+
     public Proto field(int index, int n) {
         tag(index, 0);
         writeInt(n);
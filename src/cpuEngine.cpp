@@ -9,6 +9,7 @@
 #include "j9StackTraces.h"
 #include "profiler.h"
 #include "stackWalker.h"
+#include "threadRegistry.h"
 #include "tsc.h"
 #include "vmStructs.h"
 
@@ -42,13 +43,15 @@ static int pthread_setspecific_hook(pthread_key_t key, const void* value) {
 }
 
 void CpuEngine::onThreadStart() {
+    ThreadRegistry::onThreadStart(OS::threadId());
     CpuEngine* current = __atomic_load_n(&_current, __ATOMIC_ACQUIRE);
     if (current != NULL) {
-        current->createForThread(OS::threadId());
+        current->createForNewThread(OS::threadId());
     }
 }
 
 void CpuEngine::onThreadEnd() {
+    ThreadRegistry::onThreadEnd(OS::threadId());
     CpuEngine* current = __atomic_load_n(&_current, __ATOMIC_ACQUIRE);
     if (current != NULL) {
         current->destroyForThread(OS::threadId());
@@ -117,6 +120,7 @@ void CpuEngine::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     ExecutionEvent event(TSC::ticks());
     // Count missed samples when estimating total CPU time
     u64 total_cpu_time = _count_overrun ? u64(_interval) * (1 + OS::overrun(siginfo)) : u64(_interval);
+    if (!Profiler::instance()->takeSample(total_cpu_time)) return;
     Profiler::instance()->recordSample(ucontext, total_cpu_time, EXECUTION_SAMPLE, &event);
 }
 
@@ -36,6 +36,9 @@ class CpuEngine : public Engine {
     virtual int createForThread(int tid) { return -1; }
     virtual void destroyForThread(int tid) {}
 
+    // Called from the thread start hook; engines may defer the actual creation
+    virtual int createForNewThread(int tid) { return createForThread(tid); }
+
   public:
     const char* title() {
         return "CPU profile";
@@ -6,7 +6,9 @@
 #ifndef _CTIMER_H
 #define _CTIMER_H
 
+#include <pthread.h>
 #include "cpuEngine.h"
+#include "mutex.h"
 
 #ifdef __linux__
 
@@ -15,7 +17,27 @@ class CTimer : public CpuEngine {
     static int _max_timers;
     static int* _timers;
 
+    // Threads started since the last run of the creator thread. Their timers are created
+    // with a delay, so that short-lived threads cost no timer syscalls at all.
+    static Mutex _pending_lock;
+    static int* _pending;
+    static int _pending_count;
+    static int _pending_capacity;
+
+    static volatile bool _creator_running;
+    static pthread_t _creator_thread;
+
+    static int createTimer(int tid);
+    static void createPendingTimers();
+    static void creatorLoop();
+
+    static void* creatorThreadEntry(void* unused) {
+        creatorLoop();
+        return NULL;
+    }
+
     int createForThread(int tid);
+    int createForNewThread(int tid);
     void destroyForThread(int tid);
 
   public:
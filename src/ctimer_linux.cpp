@@ -5,6 +5,7 @@
 
 #ifdef __linux__
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/syscall.h>
 #include <time.h>
@@ -25,15 +26,25 @@ static inline clockid_t thread_cpu_clock(unsigned int tid) {
 }
 
 
-int CTimer::_max_timers = 0;
-int* CTimer::_timers = NULL;
+// Timers of new threads are created at most this long after the thread start
+const u64 MAX_TIMER_CREATION_DELAY = 10000000;
 
-int CTimer::createForThread(int tid) {
-    if (tid >= _max_timers) {
-        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
-        return -1;
-    }
+// Special values of _timers[tid]; otherwise it holds timer ID + 1, or 0 for an empty slot
+const int TIMER_PENDING  = -1;  // waiting for the creator thread
+const int TIMER_CREATING = -2;  // the creator thread is making a timer
+const int TIMER_ENDED    = -3;  // the thread ended while its timer was being created
 
+int CTimer::_max_timers = 0;
+int* CTimer::_timers = NULL;
+Mutex CTimer::_pending_lock;
+int* CTimer::_pending = NULL;
+int CTimer::_pending_count = 0;
+int CTimer::_pending_capacity = 0;
+volatile bool CTimer::_creator_running = false;
+pthread_t CTimer::_creator_thread;
+
+// Returns kernel timer ID, or -1 on failure
+int CTimer::createTimer(int tid) {
     struct sigevent sev;
     sev.sigev_value.sival_ptr = NULL;
     sev.sigev_signo = _signal;
@@ -47,18 +58,50 @@ int CTimer::createForThread(int tid) {
         return -1;
     }
 
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = (time_t)(_interval / 1000000000);
+    ts.it_interval.tv_nsec = _interval % 1000000000;
+    ts.it_value = ts.it_interval;
+    syscall(__NR_timer_settime, timer, 0, &ts, NULL);
+    return timer;
+}
+
+int CTimer::createForThread(int tid) {
+    if (tid >= _max_timers) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
+        return -1;
+    }
+
+    int timer = createTimer(tid);
+    if (timer < 0) {
+        return -1;
+    }
+
     // Kernel timer ID may start with zero, but we use zero as an empty slot
     if (!__sync_bool_compare_and_swap(&_timers[tid], 0, timer + 1)) {
         // Lost race
         syscall(__NR_timer_delete, timer);
         return -1;
     }
+    return 0;
+}
 
-    struct itimerspec ts;
-    ts.it_interval.tv_sec = (time_t)(_interval / 1000000000);
-    ts.it_interval.tv_nsec = _interval % 1000000000;
-    ts.it_value = ts.it_interval;
-    syscall(__NR_timer_settime, timer, 0, &ts, NULL);
+int CTimer::createForNewThread(int tid) {
+    if (tid >= _max_timers) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_timers);
+        return -1;
+    }
+
+    if (!__sync_bool_compare_and_swap(&_timers[tid], 0, TIMER_PENDING)) {
+        return -1;
+    }
+
+    MutexLocker ml(_pending_lock);
+    if (_pending_count == _pending_capacity) {
+        _pending_capacity = _pending_capacity == 0 ? 256 : _pending_capacity * 2;
+        _pending = (int*)realloc(_pending, _pending_capacity * sizeof(int));
+    }
+    _pending[_pending_count++] = tid;
     return 0;
 }
 
@@ -67,9 +110,62 @@ void CTimer::destroyForThread(int tid) {
         return;
     }
 
-    int timer = _timers[tid];
-    if (timer != 0 && __sync_bool_compare_and_swap(&_timers[tid], timer--, 0)) {
-        syscall(__NR_timer_delete, timer);
+    while (true) {
+        int timer = _timers[tid];
+        if (timer == TIMER_PENDING || timer == TIMER_CREATING) {
+            // A pending timer costs nothing to cancel; a timer being created is deleted by its creator
+            int next = timer == TIMER_PENDING ? 0 : TIMER_ENDED;
+            if (__sync_bool_compare_and_swap(&_timers[tid], timer, next)) {
+                return;
+            }
+        } else if (timer > 0) {
+            if (__sync_bool_compare_and_swap(&_timers[tid], timer, 0)) {
+                syscall(__NR_timer_delete, timer - 1);
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+void CTimer::createPendingTimers() {
+    int* batch;
+    int count;
+    {
+        MutexLocker ml(_pending_lock);
+        if (_pending_count == 0) {
+            return;
+        }
+        batch = _pending;
+        count = _pending_count;
+        _pending = NULL;
+        _pending_count = _pending_capacity = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int tid = batch[i];
+        if (!__sync_bool_compare_and_swap(&_timers[tid], TIMER_PENDING, TIMER_CREATING)) {
+            continue;  // the thread has ended
+        }
+
+        int timer = createTimer(tid);
+        if (timer < 0) {
+            _timers[tid] = 0;
+        } else if (!__sync_bool_compare_and_swap(&_timers[tid], TIMER_CREATING, timer + 1)) {
+            syscall(__NR_timer_delete, timer);
+            _timers[tid] = 0;
+        }
+    }
+
+    free(batch);
+}
+
+void CTimer::creatorLoop() {
+    u64 delay = (u64)_interval < MAX_TIMER_CREATION_DELAY ? (u64)_interval : MAX_TIMER_CREATION_DELAY;
+    while (_creator_running) {
+        OS::sleep(delay);
+        createPendingTimers();
     }
 }
 
@@ -117,14 +213,20 @@ Error CTimer::start(Arguments& args) {
         OS::installSignalHandler(_signal, signalHandler);
     }
 
+    _creator_running = true;
+    if (pthread_create(&_creator_thread, NULL, creatorThreadEntry, NULL) != 0) {
+        _creator_running = false;
+        J9StackTraces::stop();
+        return Error("Unable to create timer thread");
+    }
+
     // Enable pthread hook before traversing currently running threads
     enableThreadHook();
 
     // Create timers for all existing threads
     int err = createForAllThreads();
     if (err) {
-        disableThreadHook();
-        J9StackTraces::stop();
+        stop();
         return Error("Failed to create CPU timer");
     }
     return Error::OK;
@@ -132,9 +234,19 @@ Error CTimer::start(Arguments& args) {
 
 void CTimer::stop() {
     disableThreadHook();
+
+    // The creator thread sleeps for no longer than MAX_TIMER_CREATION_DELAY
+    _creator_running = false;
+    pthread_join(_creator_thread, NULL);
+
     for (int i = 0; i < _max_timers; i++) {
         destroyForThread(i);
     }
+
+    free(_pending);
+    _pending = NULL;
+    _pending_count = _pending_capacity = 0;
+
     J9StackTraces::stop();
 }
 
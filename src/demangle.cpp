@@ -4,12 +4,29 @@
  */
 
 #include <cxxabi.h>
+#include <map>
 #include <stdlib.h>
 #include <string.h>
+#include "codeCache.h"
 #include "demangle.h"
+#include "mutex.h"
 #include "rustDemangle.h"
 
 
+// Bits of NativeFunc::demangled()
+enum {
+    DEMANGLED_BRIEF = 1,
+    DEMANGLED_FULL  = 2
+};
+
+// Frame names of native functions are demangled on every dump and JFR chunk.
+// Results are keyed by the NativeFunc name; the flag in NativeFunc tells whether the cached
+// entry belongs to this very symbol, since another one may later be allocated at the same address.
+static Mutex _demangle_lock;
+static std::map<const char*, char*> _demangled_brief;
+static std::map<const char*, char*> _demangled_full;
+
+
 char* Demangle::demangleCpp(const char* s) {
     int status;
     char* result = abi::__cxa_demangle(s, NULL, NULL, &status);
@@ -26,12 +43,7 @@ char* Demangle::demangleCpp(const char* s) {
     return result;
 }
 
-bool Demangle::isRustSymbol(const char* s) {
-    // "_R" symbols (Rust "mangling V0") symbols can always be easily distinguished from C++ symbols.
-    if (s[0] == '_' && s[1] == 'R') {
-        return true;
-    }
-
+bool Demangle::isRustLegacySymbol(const char* s) {
     // Rust symbols with the legacy demangling (`_ZN3foo3bar17h0123456789abcdefE`) look very much like valid
     // C++ demangling symbols, but we only want to use the Rust demangling for Rust symbols since
     // the Rust demangling does not support C++ anonymous namespaces (e.g. `_ZN12_GLOBAL__N_113single_threadE`
@@ -43,6 +55,9 @@ bool Demangle::isRustSymbol(const char* s) {
     // of the string since there can be `.lto.1` suffixes.
     //
     // FIXME: there might be a better heuristic if there are problems with this one
+    if (s[2] != 'N') {
+        return false;
+    }
     const char* e = strrchr(s, 'E');
     if (e != NULL && e - s > 22 && e[-19] == '1' && e[-18] == '7' && e[-17] == 'h') {
         const char* h = e - 16;
@@ -85,10 +100,40 @@ void Demangle::cutArguments(char* s) {
     }
 }
 
+const char* Demangle::demangleNative(const char* name, bool full_signature) {
+    char flag = full_signature ? DEMANGLED_FULL : DEMANGLED_BRIEF;
+    std::map<const char*, char*>& cache = full_signature ? _demangled_full : _demangled_brief;
+
+    MutexLocker ml(_demangle_lock);
+
+    char*& result = cache[name];
+    if (!(NativeFunc::demangled(name) & flag)) {
+        free(result);
+        result = demangle(name, full_signature);
+        NativeFunc::demangled(name, NativeFunc::demangled(name) | flag);
+    }
+    return result;
+}
+
+ManglingScheme Demangle::classify(const char* s) {
+    if (!needsDemangling(s)) {
+        return MANGLING_NONE;
+    } else if (s[1] == 'R') {
+        // "_R" symbols (Rust "mangling V0") can always be easily distinguished from C++ symbols
+        return MANGLING_RUST_V0;
+    }
+    return isRustLegacySymbol(s) ? MANGLING_RUST_LEGACY : MANGLING_CPP;
+}
+
 char* Demangle::demangle(const char* s, bool full_signature) {
-    if (isRustSymbol(s)) {
+    ManglingScheme scheme = classify(s);
+    if (scheme == MANGLING_NONE) {
+        // Plain C names would otherwise go through __cxa_demangle, which may even take them for type names
+        return NULL;
+    } else if (scheme == MANGLING_RUST_LEGACY || scheme == MANGLING_RUST_V0) {
+        // The scheme is already known, so the Rust demangler does not need to try both
         struct demangle demangle;
-        rust_demangle_demangle(s, &demangle);
+        rust_demangle_demangle_style(s, scheme == MANGLING_RUST_V0 ? DemangleStyleV0 : DemangleStyleLegacy, &demangle);
         if (rust_demangle_is_known(&demangle)) {
             return demangleRust(&demangle, full_signature);
         }
@@ -8,16 +8,30 @@
 
 struct demangle;
 
+enum ManglingScheme {
+    MANGLING_NONE,
+    MANGLING_CPP,
+    MANGLING_RUST_LEGACY,
+    MANGLING_RUST_V0
+};
+
 class Demangle {
   private:
     static char* demangleCpp(const char* s);
     static char* demangleRust(struct demangle const *demangle, bool full_signature);
-    static bool isRustSymbol(const char* s);
+    static bool isRustLegacySymbol(const char* s);
     static void cutArguments(char* s);
 
   public:
     static char* demangle(const char* s, bool full_signature);
 
+    // Tells which demangler a symbol is meant for by looking at its prefix and hash suffix only
+    static ManglingScheme classify(const char* s);
+
+    // Same as demangle() for a NativeFunc name, but the result is cached for the lifetime
+    // of the profiler and must not be freed
+    static const char* demangleNative(const char* name, bool full_signature);
+
     static bool needsDemangling(const char* s) {
         return s[0] == '_' && (s[1] == 'R' || s[1] == 'Z');
     }
@@ -65,6 +65,33 @@ size_t Dictionary::usedMemory(DictTable* table) {
     return bytes;
 }
 
+void Dictionary::stats(DictionaryStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    if (_table != NULL) {
+        Dictionary::stats(stats, _table, 1);
+    }
+}
+
+void Dictionary::stats(DictionaryStats& stats, DictTable* table, unsigned int depth) {
+    stats.tables++;
+    if (depth > stats.max_depth) {
+        stats.max_depth = depth;
+    }
+
+    for (int i = 0; i < ROWS; i++) {
+        DictRow* row = &table->rows[i];
+        for (int j = 0; j < CELLS; j++) {
+            if (row->keys[j] != NULL) {
+                stats.keys++;
+            }
+        }
+        if (row->next != NULL) {
+            stats.overflow_rows++;
+            Dictionary::stats(stats, row->next, depth + 1);
+        }
+    }
+}
+
 // Many popular symbols are quite short, e.g. "[B", "()V" etc.
 // FNV-1a is reasonably fast and sufficiently random.
 unsigned int Dictionary::hash(const char* key, size_t length) {
@@ -82,6 +109,8 @@ unsigned int Dictionary::lookup(const char* key) {
 unsigned int Dictionary::lookup(const char* key, size_t length) {
     DictTable* table = _table;
     unsigned int h = hash(key, length);
+    // Zero marks a cell whose hash has not been published yet
+    unsigned int fingerprint = h != 0 ? h : 1;
 
     while (true) {
         DictRow* row = &table->rows[h % ROWS];
@@ -89,11 +118,16 @@ unsigned int Dictionary::lookup(const char* key, size_t length) {
             if (row->keys[c] == NULL) {
                 char* new_key = allocateKey(key, length);
                 if (__sync_bool_compare_and_swap(&row->keys[c], NULL, new_key)) {
+                    __atomic_store_n(&row->hashes[c], fingerprint, __ATOMIC_RELEASE);
                     return table->index(h % ROWS, c);
                 }
                 free(new_key);
             }
-            if (keyEquals(row->keys[c], key, length)) {
+
+            // Most mismatches are rejected by the hash. A cell being published right now
+            // is compared by key to avoid inserting a duplicate.
+            unsigned int cell_hash = __atomic_load_n(&row->hashes[c], __ATOMIC_ACQUIRE);
+            if ((cell_hash == fingerprint || cell_hash == 0) && keyEquals(row->keys[c], key, length)) {
                 return table->index(h % ROWS, c);
             }
         }
@@ -21,6 +21,8 @@ struct DictTable;
 struct DictRow {
     char* keys[CELLS];
     DictTable* next;
+    // Full hashes of the keys, compared before touching key memory; 0 until published
+    unsigned int hashes[CELLS];
 };
 
 struct DictTable {
@@ -32,6 +34,14 @@ struct DictTable {
     }
 };
 
+struct DictionaryStats {
+    size_t keys;
+    unsigned int tables;
+    // Rows with all cells occupied that continue in the next level table
+    unsigned int overflow_rows;
+    unsigned int max_depth;
+};
+
 // Append-only concurrent hash table based on multi-level arrays
 class Dictionary {
   private:
@@ -40,6 +50,7 @@ class Dictionary {
 
     static void clear(DictTable* table);
     static size_t usedMemory(DictTable* table);
+    static void stats(DictionaryStats& stats, DictTable* table, unsigned int depth);
 
     static unsigned int hash(const char* key, size_t length);
 
@@ -51,6 +62,7 @@ class Dictionary {
 
     void clear();
     size_t usedMemory();
+    void stats(DictionaryStats& stats);
 
     unsigned int lookup(const char* key);
     unsigned int lookup(const char* key, size_t length);
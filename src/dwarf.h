@@ -77,6 +77,15 @@ struct FrameDesc {
     }
 };
 
+// Compact DWARF row: offset from the first row of its search block and index of a distinct FrameDesc
+struct DwarfRow {
+    u16 delta;
+    u16 rule;
+};
+
+const u32 MAX_DWARF_ROW_DELTA = 0xffff;
+const int MAX_DWARF_RULES = 0x10000;
+
 
 class DwarfParser {
   private:
@@ -7,30 +7,15 @@
 #define _ENGINE_H
 
 #include "arguments.h"
+#include "eventCounter.h"
 
 
 class Engine {
   protected:
     static volatile bool _enabled;
 
-    static bool updateCounter(volatile unsigned long long& counter, unsigned long long value, unsigned long long interval) {
-        if (interval <= 1) {
-            return true;
-        }
-
-        while (true) {
-            unsigned long long prev = counter;
-            unsigned long long next = prev + value;
-            if (next < interval) {
-                if (__sync_bool_compare_and_swap(&counter, prev, next)) {
-                    return false;
-                }
-            } else {
-                if (__sync_bool_compare_and_swap(&counter, prev, next % interval)) {
-                    return true;
-                }
-            }
-        }
+    static bool updateCounter(EventCounter& counter, u64 value, u64 interval) {
+        return counter.add(value, interval);
     }
 
   public:
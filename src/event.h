@@ -27,9 +27,19 @@ enum EventType {
     USER_EVENT,
 };
 
+// Hardware counters read together with a perf_events sample, see the counter option
+const int MAX_PERF_COUNTERS = 4;
+
 class Event {
 };
 
+// Tracing context of the sampled thread, see asprof_thread_local_data
+struct SampleContext {
+    u64 span_id;
+    u64 trace_id;
+    u32 tag;
+};
+
 class EventWithClassId : public Event {
   public:
     u32 _class_id;
@@ -39,8 +49,18 @@ class ExecutionEvent : public Event {
   public:
     u64 _start_time;
     ThreadState _thread_state;
-
-    ExecutionEvent(u64 start_time) : _start_time(start_time), _thread_state(THREAD_UNKNOWN) {}
+    int _cpu;  // -1 if not known, e.g. for samples taken from another thread
+    int _counter_count;
+    u64 _counters[MAX_PERF_COUNTERS];  // deltas since the previous sample of the thread
+    SampleContext _context;
+    // Memory access of a dataaddr sample: where the data came from, and what object holds it
+    const char* _data_source;
+    const char* _data_region;
+    u32 _data_class_id;
+
+    ExecutionEvent(u64 start_time) :
+        _start_time(start_time), _thread_state(THREAD_UNKNOWN), _cpu(-1), _counter_count(0), _context(),
+        _data_source(NULL), _data_region(NULL), _data_class_id(0) {}
 };
 
 class WallClockEvent : public Event {
@@ -48,6 +68,9 @@ class WallClockEvent : public Event {
     u64 _start_time;
     ThreadState _thread_state;
     u32 _samples;
+    SampleContext _context;
+
+    WallClockEvent() : _context() {}
 };
 
 class AllocEvent : public EventWithClassId {
@@ -0,0 +1,69 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _EVENTCOUNTER_H
+#define _EVENTCOUNTER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "arch.h"
+
+
+const u32 EVENT_COUNTER_SLOTS = 256;
+
+// Accumulates allocated bytes, lock wait time, etc. towards a sampling interval.
+// Every thread counts in its own cache line chosen by pthread_self(), so that threads
+// reporting events at a high rate do not contend on one shared word. The slots start
+// at random phases: a thread that reports less than an interval in total still has
+// a proportional chance to be sampled, and the expected number of samples remains
+// the total divided by the interval, as with a single shared counter.
+class EventCounter {
+  private:
+    struct Slot {
+        volatile u64 value;
+        char padding[64 - sizeof(u64)];  // one cache line per slot
+    };
+
+    Slot _slots[EVENT_COUNTER_SLOTS];
+
+    Slot* current() {
+        u64 self = (u64)(uintptr_t)pthread_self();
+        return &_slots[(u32)((self * 0x9e3779b97f4a7c15ULL) >> 40) & (EVENT_COUNTER_SLOTS - 1)];
+    }
+
+  public:
+    void reset(u64 interval, u64 seed) {
+        for (u32 i = 0; i < EVENT_COUNTER_SLOTS; i++) {
+            u64 x = (seed + i) * 0x9e3779b97f4a7c15ULL;
+            x ^= x >> 31;
+            _slots[i].value = interval > 1 ? x % interval : 0;
+        }
+    }
+
+    // Returns true if the event completes an interval in the slot of the current thread.
+    // Threads sharing a slot update it atomically, the same as a shared counter.
+    bool add(u64 value, u64 interval) {
+        if (interval <= 1) {
+            return true;
+        }
+
+        volatile u64& counter = current()->value;
+        while (true) {
+            u64 prev = counter;
+            u64 next = prev + value;
+            if (next < interval) {
+                if (__sync_bool_compare_and_swap(&counter, prev, next)) {
+                    return false;
+                }
+            } else {
+                if (__sync_bool_compare_and_swap(&counter, prev, next % interval)) {
+                    return true;
+                }
+            }
+        }
+    }
+};
+
+#endif // _EVENTCOUNTER_H
@@ -0,0 +1,175 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fileRotator.h"
+#include "log.h"
+#include "os.h"
+
+
+WaitableMutex FileRotator::_lock;
+int FileRotator::_pending[MAX_PENDING_FILES];
+int FileRotator::_head = 0;
+int FileRotator::_count = 0;
+
+char* FileRotator::_next_path = NULL;
+int FileRotator::_next_fd = -1;
+bool FileRotator::_next_created = false;
+volatile bool FileRotator::_busy = false;
+
+bool FileRotator::_started = false;
+pthread_t FileRotator::_thread;
+
+
+// Called with _lock held. The thread lives until the process exits.
+bool FileRotator::startThread() {
+    if (!_started) {
+        if (pthread_create(&_thread, NULL, threadEntry, NULL) != 0) {
+            Log::warn("Unable to create file rotator thread");
+            return false;
+        }
+        pthread_detach(_thread);
+        _started = true;
+    }
+    return true;
+}
+
+void FileRotator::run() {
+    _lock.lock();
+    while (true) {
+        bool need_open = _next_path != NULL && _next_fd < 0;
+        if (_count == 0 && !need_open) {
+            _lock.waitUntil(OS::micros() + 1000000);
+            continue;
+        }
+
+        _busy = true;
+        if (_count > 0) {
+            int fd = _pending[_head];
+            _head = (_head + 1) % MAX_PENDING_FILES;
+            _count--;
+            _lock.unlock();
+
+            close(fd);
+        } else {
+            char* path = strdup(_next_path);
+            _lock.unlock();
+
+            // Remember if the file is ours, so that it can be removed when not needed
+            bool created = true;
+            int fd = ::open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0 && errno == EEXIST) {
+                created = false;
+                fd = ::open(path, O_RDWR);
+            }
+
+            _lock.lock();
+            if (_next_path != NULL && strcmp(_next_path, path) == 0 && _next_fd < 0) {
+                _next_fd = fd;
+                _next_created = created;
+                if (fd < 0) {
+                    // Let open() retry and report the error
+                    free(_next_path);
+                    _next_path = NULL;
+                }
+            } else if (fd >= 0) {
+                // The file was dropped while being opened
+                if (created) unlink(path);
+                close(fd);
+            }
+            _lock.unlock();
+            free(path);
+        }
+
+        _lock.lock();
+        _busy = false;
+    }
+}
+
+// Called with _lock held
+void FileRotator::discardNext() {
+    if (_next_fd >= 0) {
+        if (_next_created) unlink(_next_path);
+        close(_next_fd);
+        _next_fd = -1;
+    }
+    free(_next_path);
+    _next_path = NULL;
+}
+
+void FileRotator::release(int fd) {
+    if (fd < 0) {
+        return;
+    }
+
+    _lock.lock();
+    if (_count < MAX_PENDING_FILES && startThread()) {
+        _pending[(_head + _count) % MAX_PENDING_FILES] = fd;
+        _count++;
+        _lock.notify();
+        _lock.unlock();
+    } else {
+        _lock.unlock();
+        close(fd);
+    }
+}
+
+void FileRotator::preopen(const char* path) {
+    MutexLocker ml(_lock);
+
+    if (_next_path != NULL && strcmp(_next_path, path) == 0) {
+        return;
+    }
+    discardNext();
+
+    if (startThread()) {
+        _next_path = strdup(path);
+        _lock.notify();
+    }
+}
+
+int FileRotator::open(const char* path) {
+    // The file being opened right now cannot be dropped, or it would be removed under the caller
+    while (true) {
+        _lock.lock();
+        if (!_busy || _next_path == NULL || _next_fd >= 0) break;
+        _lock.unlock();
+        OS::sleep(1000000);
+    }
+
+    int fd = -1;
+    if (_next_fd >= 0 && strcmp(_next_path, path) == 0) {
+        fd = _next_fd;
+        _next_fd = -1;
+    }
+    discardNext();
+    _lock.unlock();
+
+    if (fd >= 0) {
+        while (ftruncate(fd, 0) < 0 && errno == EINTR);  // restart if interrupted
+        return fd;
+    }
+    return ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+void FileRotator::sync() {
+    _lock.lock();
+    discardNext();
+    while (_count > 0) {
+        close(_pending[_head]);
+        _head = (_head + 1) % MAX_PENDING_FILES;
+        _count--;
+    }
+    _lock.unlock();
+
+    // A file taken by the rotator thread just before
+    while (_busy) {
+        OS::sleep(1000000);
+    }
+}
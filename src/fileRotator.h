@@ -0,0 +1,56 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _FILEROTATOR_H
+#define _FILEROTATOR_H
+
+#include <pthread.h>
+#include "mutex.h"
+
+
+const int MAX_PENDING_FILES = 4;
+
+// Takes file system work of loop and chunked output off the timer thread. Files of finished
+// iterations are closed by a background thread; the file of the next iteration can be opened
+// in advance. When more than MAX_PENDING_FILES files wait to be closed, the caller closes its own.
+class FileRotator {
+  private:
+    static WaitableMutex _lock;
+    static int _pending[MAX_PENDING_FILES];
+    static int _head;
+    static int _count;
+
+    static char* _next_path;
+    static int _next_fd;
+    static bool _next_created;
+    static volatile bool _busy;
+
+    static bool _started;
+    static pthread_t _thread;
+
+    static void* threadEntry(void* unused) {
+        run();
+        return NULL;
+    }
+
+    static bool startThread();
+    static void run();
+    static void discardNext();
+
+  public:
+    // Takes ownership of the file descriptor
+    static void release(int fd);
+
+    // Opens the file in background; an existing file is not truncated until open() asks for it
+    static void preopen(const char* path);
+
+    // Returns the file opened in advance, if any, or opens it now. The file is truncated.
+    static int open(const char* path);
+
+    // Waits until all released files are closed and drops the file opened in advance
+    static void sync();
+};
+
+#endif // _FILEROTATOR_H
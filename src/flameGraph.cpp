@@ -4,8 +4,10 @@
  */
 
 #include <algorithm>
+#include <new>
 #include <vector>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "flameGraph.h"
 #include "incbin.h"
@@ -13,6 +15,10 @@
 
 // Browsers refuse to draw on canvas larger than 32767 px
 const int MAX_CANVAS_HEIGHT = 32767;
+const size_t TRIE_ARENA_CHUNK = 4 * 1024 * 1024;
+const u32 MAX_LINEAR_CHILDREN = 8;
+const u32 INITIAL_CHILD_CAPACITY = 4096;
+const u32 INITIAL_NAME_CAPACITY = 4096;
 
 INCBIN(FLAMEGRAPH_TEMPLATE, "src/res/flame.html")
 INCBIN(TREE_TEMPLATE, "src/res/tree.html")
@@ -67,15 +73,15 @@ class Format {
 
 class Node {
   public:
-    u32 _key;
     u32 _order;
     const Trie* _trie;
 
-    Node(u32 key, u32 order, const Trie* trie) : _key(key), _order(order), _trie(trie) {
+    Node(u32 order, const Trie* trie) : _order(order), _trie(trie) {
     }
 
     static bool orderByName(const Node& a, const Node& b) {
-        return a._order < b._order;
+        // Frames of the same name differ in type
+        return a._order < b._order || (a._order == b._order && a._trie->_key < b._trie->_key);
     }
 
     static bool orderByTotal(const Node& a, const Node& b) {
@@ -84,35 +90,223 @@ class Node {
 };
 
 
-Trie* FlameGraph::addChild(Trie* f, const char* name, FrameTypeId type, u64 value) {
-    size_t len = strlen(name);
-    bool has_suffix = len > 4 && name[len - 4] == '_' && name[len - 3] == '[' && name[len - 1] == ']';
-    std::string s(name, has_suffix ? len - 4 : len);
+// Orders name indices by the names they refer to
+class NameComparator {
+  private:
+    const char* _pool;
+    const u32* _offsets;
+
+  public:
+    NameComparator(const char* pool, const u32* offsets) : _pool(pool), _offsets(offsets) {
+    }
+
+    bool operator()(u32 a, u32 b) const {
+        return strcmp(_pool + _offsets[a], _pool + _offsets[b]) < 0;
+    }
+};
+
+
+FlameGraph::FlameGraph(const char* title, Counter counter, double minwidth, bool reverse, bool inverted, bool diff) :
+    _root(),
+    _arena(TRIE_ARENA_CHUNK),
+    _child_capacity(INITIAL_CHILD_CAPACITY),
+    _child_count(0),
+    _name_capacity(INITIAL_NAME_CAPACITY),
+    _title(title),
+    _counter(counter),
+    _minwidth(minwidth),
+    _reverse(reverse),
+    _inverted(inverted),
+    _diff(diff),
+    _last_level(0),
+    _last_x(0),
+    _last_total(0) {
+    _buf[sizeof(_buf) - 1] = 0;
+    _child_slots = (ChildSlot*)calloc(_child_capacity, sizeof(ChildSlot));
+    _name_slots = (u32*)calloc(_name_capacity, sizeof(u32));
+    _name_pool.push_back(0);
+    _name_offsets.push_back(0);
+}
 
-    u32 name_index = _cpool[s];
-    if (name_index == 0) {
-        name_index = _cpool[s] = _cpool.size();
+FlameGraph::~FlameGraph() {
+    free(_child_slots);
+    free(_name_slots);
+}
+
+void FlameGraph::growChildIndex() {
+    u32 old_capacity = _child_capacity;
+    ChildSlot* old_slots = _child_slots;
+
+    _child_capacity = old_capacity * 2;
+    _child_slots = (ChildSlot*)calloc(_child_capacity, sizeof(ChildSlot));
+
+    u32 mask = _child_capacity - 1;
+    for (u32 i = 0; i < old_capacity; i++) {
+        if (old_slots[i].child != NULL) {
+            u32 slot = hashChild(old_slots[i].parent, old_slots[i].key) & mask;
+            while (_child_slots[slot].child != NULL) {
+                slot = (slot + 1) & mask;
+            }
+            _child_slots[slot] = old_slots[i];
+        }
     }
+    free(old_slots);
+}
+
+void FlameGraph::indexChild(Trie* parent, Trie* node) {
+    // Keep load factor under 3/4
+    if ((_child_count + 1) * 4 > _child_capacity * 3) {
+        growChildIndex();
+    }
+
+    u32 mask = _child_capacity - 1;
+    u32 slot = hashChild(parent, node->_key) & mask;
+    while (_child_slots[slot].child != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    _child_slots[slot].parent = parent;
+    _child_slots[slot].child = node;
+    _child_slots[slot].key = node->_key;
+    _child_count++;
+}
+
+Trie* FlameGraph::child(Trie* parent, u32 key) {
+    if (parent->_child_count <= MAX_LINEAR_CHILDREN) {
+        // Most frames have a few children, which are faster to scan than to look up in a big table
+        for (Trie* child = parent->_first_child; child != NULL; child = child->_next_sibling) {
+            if (child->_key == key) {
+                return child;
+            }
+        }
+    } else {
+        u32 mask = _child_capacity - 1;
+        for (u32 slot = hashChild(parent, key) & mask; _child_slots[slot].child != NULL; slot = (slot + 1) & mask) {
+            if (_child_slots[slot].parent == parent && _child_slots[slot].key == key) {
+                return _child_slots[slot].child;
+            }
+        }
+    }
+
+    void* memory = _arena.alloc(sizeof(Trie));
+    if (memory == NULL) {
+        // Out of memory: account the rest of the stack to the parent frame
+        return parent;
+    }
+
+    Trie* node = new(memory) Trie(key);
+    node->_next_sibling = parent->_first_child;
+    parent->_first_child = node;
+
+    if (++parent->_child_count == MAX_LINEAR_CHILDREN + 1) {
+        for (Trie* child = parent->_first_child; child != NULL; child = child->_next_sibling) {
+            indexChild(parent, child);
+        }
+    } else if (parent->_child_count > MAX_LINEAR_CHILDREN) {
+        indexChild(parent, node);
+    }
+    return node;
+}
+
+void FlameGraph::growNameIndex() {
+    u32 old_capacity = _name_capacity;
+    u32* old_slots = _name_slots;
+
+    _name_capacity = old_capacity * 2;
+    _name_slots = (u32*)calloc(_name_capacity, sizeof(u32));
+
+    u32 mask = _name_capacity - 1;
+    for (u32 i = 0; i < old_capacity; i++) {
+        u32 index = old_slots[i];
+        if (index != 0) {
+            const char* s = name(index);
+            u32 slot = hashName(s, strlen(s)) & mask;
+            while (_name_slots[slot] != 0) {
+                slot = (slot + 1) & mask;
+            }
+            _name_slots[slot] = index;
+        }
+    }
+    free(old_slots);
+}
+
+u32 FlameGraph::lookupName(const char* name, size_t len) {
+    u32 mask = _name_capacity - 1;
+    u32 slot = hashName(name, len) & mask;
+    for (u32 index; (index = _name_slots[slot]) != 0; slot = (slot + 1) & mask) {
+        const char* s = this->name(index);
+        if (strncmp(s, name, len) == 0 && s[len] == 0) {
+            return index;
+        }
+    }
+
+    if ((nameCount() + 1) * 4 > _name_capacity * 3) {
+        growNameIndex();
+        return lookupName(name, len);
+    }
+
+    u32 index = (u32)_name_offsets.size();
+    _name_offsets.push_back((u32)_name_pool.size());
+    _name_pool.insert(_name_pool.end(), name, name + len);
+    _name_pool.push_back(0);
+    _name_slots[slot] = index;
+    return index;
+}
+
+void FlameGraph::releaseNames() {
+    std::vector<char>().swap(_name_pool);
+    std::vector<u32>().swap(_name_offsets);
+    free(_name_slots);
+    _name_slots = NULL;
+}
+
+Trie* FlameGraph::addChild(Trie* f, const char* name, FrameTypeId type, u64 value, u64 baseline) {
+    size_t len = strlen(name);
+    bool has_suffix = len > 4 && name[len - 4] == '_' && name[len - 3] == '[' && name[len - 1] == ']';
+    u32 name_index = lookupName(name, has_suffix ? len - 4 : len);
 
     f->_total += value;
+    f->_baseline += baseline;
 
     switch (type) {
         case FRAME_INLINED:
-            (f = f->child(name_index, FRAME_JIT_COMPILED))->_inlined += value;
+            (f = child(f, name_index | FRAME_JIT_COMPILED << 28))->_inlined += value;
             return f;
         case FRAME_C1_COMPILED:
-            (f = f->child(name_index, FRAME_JIT_COMPILED))->_c1_compiled += value;
+            (f = child(f, name_index | FRAME_JIT_COMPILED << 28))->_c1_compiled += value;
             return f;
         case FRAME_INTERPRETED:
-            (f = f->child(name_index, FRAME_JIT_COMPILED))->_interpreted += value;
+            (f = child(f, name_index | FRAME_JIT_COMPILED << 28))->_interpreted += value;
             return f;
         default:
-            return f->child(name_index, type);
+            return child(f, name_index | type << 28);
+    }
+}
+
+void FlameGraph::merge(const FlameGraph& other) {
+    std::vector<u32> name_map(other.nameCount() + 1);
+    for (u32 i = 1; i <= other.nameCount(); i++) {
+        const char* s = other.name(i);
+        name_map[i] = lookupName(s, strlen(s));
+    }
+    mergeTrie(&_root, &other._root, name_map.data());
+}
+
+void FlameGraph::mergeTrie(Trie* dst, const Trie* src, const u32* name_map) {
+    dst->_total += src->_total;
+    dst->_self += src->_self;
+    dst->_inlined += src->_inlined;
+    dst->_c1_compiled += src->_c1_compiled;
+    dst->_interpreted += src->_interpreted;
+    dst->_baseline += src->_baseline;
+
+    for (const Trie* src_child = src->_first_child; src_child != NULL; src_child = src_child->_next_sibling) {
+        u32 key = name_map[src_child->nameIndex()] | (src_child->_key & ~((1U << 28) - 1));
+        mergeTrie(child(dst, key), src_child, name_map);
     }
 }
 
 void FlameGraph::dump(Writer& out, bool tree) {
-    _name_order = new u32[_cpool.size() + 1]();
+    _name_order = new u32[nameCount() + 1]();
     _mintotal = _minwidth == 0 && tree ? _root._total / 1000 : (u64)(_root._total * _minwidth / 100);
     int depth = _root.depth(_mintotal, _name_order);
 
@@ -128,14 +322,18 @@ void FlameGraph::dump(Writer& out, bool tree) {
         tail = printTill(out, tail, "/*count:*/");
         out << Format().thousands(_root._total);
 
-        tail = printTill(out, tail, "/*tree:*/");
+        tail = printTill(out, tail, "/*reverse:*/false");
+        out << (_reverse ? "true" : "false");
 
-        const char** names = new const char*[_cpool.size() + 1];
-        for (std::map<std::string, u32>::const_iterator it = _cpool.begin(); it != _cpool.end(); ++it) {
-            names[it->second] = it->first.c_str();
-        }
-        printTreeFrame(out, _root, 0, names);
-        delete[] names;
+        // Leaves of the tree may be below the cutoff, their names need to be in the constant pool as well
+        markTreeNames(_root);
+        tail = printTill(out, tail, "/*cpool:*/");
+        printCpool(out);
+
+        tail = printTill(out, tail, "/*tree:*/");
+        out << "unpackTree(\"";
+        printTreeFrame(out, _root);
+        out << "\");\n";
 
         out << tail;
     } else {
@@ -152,6 +350,9 @@ void FlameGraph::dump(Writer& out, bool tree) {
         // and for default stacktraces from flamegraphs to icicle.
         out << (_reverse ^ _inverted ? "true" : "false");
 
+        tail = printTill(out, tail, "/*diff:*/false");
+        out << (_diff ? "true" : "false");
+
         tail = printTill(out, tail, "/*depth:*/0");
         out << depth;
 
@@ -159,7 +360,9 @@ void FlameGraph::dump(Writer& out, bool tree) {
         printCpool(out);
 
         tail = printTill(out, tail, "/*frames:*/");
-        printFrame(out, FRAME_NATIVE << 28, _root, 0, 0);
+        out << "unpackFrames(\"";
+        printFrame(out, _root, 0, 0);
+        out << "\");\n";
 
         tail = printTill(out, tail, "/*highlight:*/");
 
@@ -169,129 +372,150 @@ void FlameGraph::dump(Writer& out, bool tree) {
     delete[] _name_order;
 }
 
-void FlameGraph::printFrame(Writer& out, u32 key, const Trie& f, int level, u64 x) {
-    u32 name_and_type = _name_order[f.nameIndex(key)] << 3 | f.type(key);
+void FlameGraph::printFrame(Writer& out, const Trie& f, int level, u64 x) {
+    u32 name_and_type = _name_order[f.nameIndex()] << 3 | f.type();
     bool has_extra_types = (f._inlined | f._c1_compiled | f._interpreted) &&
                            f._inlined < f._total && f._interpreted < f._total;
 
-    char* p = _buf;
+    u32 flags;
     if (level == _last_level + 1 && x == _last_x) {
-        p += snprintf(p, 100, "u(%u", name_and_type);
+        flags = PACKED_UP;
     } else if (level == _last_level && x == _last_x + _last_total) {
-        p += snprintf(p, 100, "n(%u", name_and_type);
+        flags = PACKED_NEXT;
     } else {
-        p += snprintf(p, 100, "f(%u,%d,%llu", name_and_type, level, x - _last_x);
+        flags = PACKED_AT;
     }
-
-    if (f._total != _last_total || has_extra_types) {
-        p += snprintf(p, 100, ",%llu", f._total);
-        if (has_extra_types) {
-            p += snprintf(p, 100, ",%llu,%llu,%llu", f._inlined, f._c1_compiled, f._interpreted);
-        }
+    // A diff needs the width of every frame to color it
+    if (f._total != _last_total || _diff) flags |= PACKED_WIDTH;
+    if (has_extra_types) flags |= PACKED_TYPES;
+
+    char* p = putPacked(_buf, (u64)name_and_type << 4 | flags);
+    if ((flags & PACKED_KIND) == PACKED_AT) {
+        p = putPacked(p, level);
+        p = putPacked(p, x - _last_x);
     }
-
-    strcpy(p, ")\n");
-    out << _buf;
+    if (flags & PACKED_WIDTH) {
+        p = putPacked(p, f._total);
+    }
+    if (flags & PACKED_TYPES) {
+        p = putPacked(p, f._inlined);
+        p = putPacked(p, f._c1_compiled);
+        p = putPacked(p, f._interpreted);
+    }
+    if (_diff) {
+        // Zigzag encoding of the change since the snapshot
+        u64 delta = f._total - f._baseline;
+        p = putPacked(p, (long long)delta < 0 ? ~delta << 1 | 1 : delta << 1);
+    }
+    out.write(_buf, p - _buf);
 
     _last_level = level;
     _last_x = x;
     _last_total = f._total;
 
-    if (f._children.empty()) {
+    if (!f.hasChildren()) {
         return;
     }
 
     std::vector<Node> children;
-    children.reserve(f._children.size());
-    for (auto it = f._children.begin(); it != f._children.end(); ++it) {
-        children.push_back(Node(it->first, _name_order[f.nameIndex(it->first)], it->second));
+    children.reserve(f.childCount());
+    for (const Trie* child = f._first_child; child != NULL; child = child->_next_sibling) {
+        children.push_back(Node(_name_order[child->nameIndex()], child));
     }
     std::sort(children.begin(), children.end(), Node::orderByName);
 
     x += f._self;
     for (size_t i = 0; i < children.size(); i++) {
-        u32 key = children[i]._key;
         const Trie* trie = children[i]._trie;
-        if (trie->_total >= _mintotal) {
-            printFrame(out, key, *trie, level + 1, x);
+        // Frames of a diff may have no samples left, only a baseline
+        if (trie->_total >= _mintotal && trie->_total > 0) {
+            printFrame(out, *trie, level + 1, x);
         }
         x += trie->_total;
     }
 }
 
-void FlameGraph::printTreeFrame(Writer& out, const Trie& f, int level, const char** names) {
+void FlameGraph::markTreeNames(const Trie& f) {
+    for (const Trie* child = f._first_child; child != NULL; child = child->_next_sibling) {
+        _name_order[child->nameIndex()] = 1;
+        if (child->_total >= _mintotal) {
+            markTreeNames(*child);
+        }
+    }
+}
+
+// Nodes are written in pre-order as packed numbers: name and type, total, self and the number
+// of children that follow. tree.html builds DOM elements only for the nodes a user expands.
+// All children of a node above the cutoff are written; children of a node below it are not.
+void FlameGraph::printTreeFrame(Writer& out, const Trie& f) {
+    bool expand = &f == &_root || f._total >= _mintotal;
+    u32 name_and_type = _name_order[f.nameIndex()] << 3 | f.type();
+    bool truncated = f.hasChildren() && !expand;
+
+    char* p = putPacked(_buf, (u64)name_and_type << 1 | (truncated ? 1 : 0));
+    p = putPacked(p, f._total);
+    p = putPacked(p, f._self);
+    p = putPacked(p, expand ? f.childCount() : 0);
+    out.write(_buf, p - _buf);
+
+    if (!expand || !f.hasChildren()) {
+        return;
+    }
+
     std::vector<Node> children;
-    children.reserve(f._children.size());
-    for (auto it = f._children.begin(); it != f._children.end(); ++it) {
-        children.push_back(Node(it->first, 0, it->second));
+    children.reserve(f.childCount());
+    for (const Trie* child = f._first_child; child != NULL; child = child->_next_sibling) {
+        children.push_back(Node(0, child));
     }
     std::sort(children.begin(), children.end(), Node::orderByTotal);
 
-    double pct = 100.0 / _root._total;
     for (size_t i = 0; i < children.size(); i++) {
-        u32 key = children[i]._key;
-        const Trie* trie = children[i]._trie;
-
-        u32 type = trie->type(key);
-        std::string name = names[trie->nameIndex(key)];
-        StringUtils::replace(name, '&', "&amp;", 5);
-        StringUtils::replace(name, '<', "&lt;", 4);
-        StringUtils::replace(name, '>', "&gt;", 4);
-
-        const char* div_class = trie->_children.empty() ? " class=\"o\"" : "";
-
-        if (_reverse) {
-            snprintf(_buf, sizeof(_buf) - 1,
-                     "<li><div%s>%.2f%% [%s]</div> <span class=\"t%d\">%s</span>\n",
-                     div_class, trie->_total * pct, Format().thousands(trie->_total),
-                     type, name.c_str());
-        } else {
-            snprintf(_buf, sizeof(_buf) - 1,
-                     "<li><div%s>%.2f%% [%s] &#8226; self: %.2f%% [%s]</div> <span class=\"t%d\">%s</span>\n",
-                     div_class, trie->_total * pct, Format().thousands(trie->_total),
-                     trie->_self * pct, Format().thousands(trie->_self),
-                     type, name.c_str());
-        }
-        out << _buf;
-
-        if (trie->_children.size() > 0) {
-            out << "<ul>\n";
-            if (trie->_total >= _mintotal) {
-                printTreeFrame(out, *trie, level + 1, names);
-            } else {
-                out << "<li>...\n";
-            }
-            out << "</ul>\n";
-        }
+        printTreeFrame(out, *children[i]._trie);
     }
 }
 
 void FlameGraph::printCpool(Writer& out) {
     out << "'all'";
 
-    std::string prev;
-    u32 index = 0;
-    for (std::map<std::string, u32>::const_iterator it = _cpool.begin(); it != _cpool.end(); ++it) {
-        if (_name_order[it->second]) {
-            _name_order[it->second] = ++index;
-
-            size_t prefix_len = StringUtils::getCommonPrefix(prev, it->first);
-            prev = it->first;
-
-            if (prefix_len > 95) prefix_len = 95;
-            std::string s(1, (char)(prefix_len + ' '));
-            s.append(it->first, prefix_len, std::string::npos);
-
-            StringUtils::replace(s, '\\', "\\\\", 2);
-            StringUtils::replace(s, '\'', "\\'", 2);
-            out << ",\n'";
-            out.write(s.data(), s.size());
-            out << "'";
+    // Names of visible frames are printed in sorted order to share common prefixes
+    std::vector<u32> visible;
+    for (u32 i = 1; i <= nameCount(); i++) {
+        if (_name_order[i]) {
+            visible.push_back(i);
         }
     }
+    std::sort(visible.begin(), visible.end(), NameComparator(&_name_pool[0], &_name_offsets[0]));
 
-    // Release cpool memory, since frame names are never used beyond this point
-    _cpool = std::map<std::string, u32>();
+    std::string prev;
+    for (size_t i = 0; i < visible.size(); i++) {
+        _name_order[visible[i]] = i + 1;
+
+        std::string name(this->name(visible[i]));
+        size_t prefix_len = StringUtils::getCommonPrefix(prev, name);
+        prev = name;
+
+        if (prefix_len > 95) prefix_len = 95;
+        std::string s(1, (char)(prefix_len + ' '));
+        s.append(name, prefix_len, std::string::npos);
+
+        StringUtils::replace(s, '\\', "\\\\", 2);
+        StringUtils::replace(s, '\'', "\\'", 2);
+        out << ",\n'";
+        out.write(s.data(), s.size());
+        out << "'";
+    }
+
+    // Release name memory, since frame names are never used beyond this point
+    releaseNames();
+}
+
+char* FlameGraph::putPacked(char* p, u64 value) {
+    while (value >= PACKED_BASE) {
+        *p++ = packedDigit(PACKED_BASE + value % PACKED_BASE);
+        value /= PACKED_BASE;
+    }
+    *p++ = packedDigit((u32)value);
+    return p;
 }
 
 const char* FlameGraph::printTill(Writer& out, const char* data, const char* till) {
@@ -6,31 +6,48 @@
 #ifndef _FLAMEGRAPH_H
 #define _FLAMEGRAPH_H
 
-#include <map>
 #include <string>
+#include <vector>
 #include "arch.h"
 #include "arguments.h"
+#include "linearAllocator.h"
 #include "vmEntry.h"
 #include "writer.h"
 
 
+// Frames are embedded in HTML as a string of variable-length numbers, lowest digits first.
+// A digit is a printable char except '"', '<' and '\'; digits >= PACKED_BASE continue the number.
+const u32 PACKED_BASE = 45;
+
+// Every packed frame starts with (name_and_type << 4 | flags)
+enum PackedFrameFlags {
+    PACKED_AT = 0,     // followed by level and x offset
+    PACKED_UP = 1,     // the first child of the previous frame
+    PACKED_NEXT = 2,   // the right neighbour of the previous frame
+    PACKED_KIND = 3,
+    PACKED_WIDTH = 4,  // width differs from the previous frame
+    PACKED_TYPES = 8   // followed by inlined, c1 and interpreted counts
+};
+
+// Frame of a FlameGraph. Nodes are allocated in the arena of FlameGraph, children
+// form a singly linked list; children of wide frames are also put in the hash index of FlameGraph.
 class Trie {
   public:
-    std::map<u32, Trie*> _children;
+    u32 _key;
+    u32 _child_count;
+    Trie* _first_child;
+    Trie* _next_sibling;
     u64 _total;
     u64 _self;
     u64 _inlined, _c1_compiled, _interpreted;
+    // Total at the snapshot a differential flame graph is compared with
+    u64 _baseline;
 
-    Trie() : _children(), _total(0), _self(0), _inlined(0), _c1_compiled(0), _interpreted(0) {
+    Trie(u32 key = FRAME_NATIVE << 28) : _key(key), _child_count(0), _first_child(NULL), _next_sibling(NULL),
+        _total(0), _self(0), _inlined(0), _c1_compiled(0), _interpreted(0), _baseline(0) {
     }
 
-    ~Trie() {
-        for (const auto& entry : _children) {
-            delete entry.second;
-        }
-    }
-
-    FrameTypeId type(u32 key) const {
+    FrameTypeId type() const {
         if (_inlined * 3 >= _total) {
             return FRAME_INLINED;
         } else if (_c1_compiled * 2 >= _total) {
@@ -38,28 +55,28 @@ class Trie {
         } else if (_interpreted * 2 >= _total) {
             return FRAME_INTERPRETED;
         } else {
-            return (FrameTypeId)(key >> 28);
+            return (FrameTypeId)(_key >> 28);
         }
     }
 
-    u32 nameIndex(u32 key) const {
-        return key & ((1 << 28) - 1);
+    u32 nameIndex() const {
+        return _key & ((1 << 28) - 1);
     }
 
-    Trie* child(u32 name_index, FrameTypeId type) {
-        Trie** ptr = &_children[name_index | type << 28];
-        if (*ptr == nullptr) {
-            *ptr = new Trie();
-        }
-        return *ptr;
+    bool hasChildren() const {
+        return _first_child != NULL;
+    }
+
+    size_t childCount() const {
+        return _child_count;
     }
 
     int depth(u64 cutoff, u32* name_order) const {
         int max_depth = 0;
-        for (auto it = _children.begin(); it != _children.end(); ++it) {
-            if (it->second->_total >= cutoff) {
-                name_order[nameIndex(it->first)] = 1;
-                int d = it->second->depth(cutoff, name_order);
+        for (const Trie* child = _first_child; child != NULL; child = child->_next_sibling) {
+            if (child->_total >= cutoff && child->_total > 0) {
+                name_order[child->nameIndex()] = 1;
+                int d = child->depth(cutoff, name_order);
                 if (d > max_depth) max_depth = d;
             }
         }
@@ -70,8 +87,26 @@ class Trie {
 
 class FlameGraph {
   private:
+    // The key is duplicated here to avoid touching the node on lookup
+    struct ChildSlot {
+        const Trie* parent;
+        Trie* child;
+        u32 key;
+    };
+
     Trie _root;
-    std::map<std::string, u32> _cpool;
+    LinearAllocator _arena;
+    ChildSlot* _child_slots;
+    u32 _child_capacity;
+    u32 _child_count;
+
+    // Frame names are kept NUL-terminated in one pool and referenced by offsets,
+    // _name_offsets[0] is reserved for the root
+    std::vector<char> _name_pool;
+    std::vector<u32> _name_offsets;
+    u32* _name_slots;
+    u32 _name_capacity;
+
     u32* _name_order;
     u64 _mintotal;
     char _buf[4096];
@@ -81,36 +116,69 @@ class FlameGraph {
     double _minwidth;
     bool _reverse;
     bool _inverted;
+    bool _diff;
 
     int _last_level;
     u64 _last_x;
     u64 _last_total;
 
-    void printFrame(Writer& out, u32 key, const Trie& f, int level, u64 x);
-    void printTreeFrame(Writer& out, const Trie& f, int level, const char** names);
+    static char packedDigit(u32 digit) {
+        char c = (char)('#' + digit);
+        if (c >= '<') c++;
+        if (c >= '\\') c++;
+        return c;
+    }
+
+    static char* putPacked(char* p, u64 value);
+
+    static u32 hashChild(const Trie* parent, u32 key) {
+        u64 h = ((u64)(uintptr_t)parent + key * 0x100000001b3ULL) * 0x9e3779b97f4a7c15ULL;
+        return (u32)(h >> 32);
+    }
+
+    static u32 hashName(const char* name, size_t len) {
+        // FNV-1a
+        u32 h = 2166136261U;
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ (unsigned char)name[i]) * 16777619U;
+        }
+        return h;
+    }
+
+    const char* name(u32 index) const {
+        return &_name_pool[_name_offsets[index]];
+    }
+
+    u32 nameCount() const {
+        return (u32)_name_offsets.size() - 1;
+    }
+
+    Trie* child(Trie* parent, u32 key);
+    void indexChild(Trie* parent, Trie* node);
+    u32 lookupName(const char* name, size_t len);
+    void growChildIndex();
+    void growNameIndex();
+    void releaseNames();
+    void mergeTrie(Trie* dst, const Trie* src, const u32* name_map);
+
+    void printFrame(Writer& out, const Trie& f, int level, u64 x);
+    void markTreeNames(const Trie& f);
+    void printTreeFrame(Writer& out, const Trie& f);
     void printCpool(Writer& out);
     const char* printTill(Writer& out, const char* data, const char* till);
 
   public:
-    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse, bool inverted) :
-        _root(),
-        _cpool(),
-        _title(title),
-        _counter(counter),
-        _minwidth(minwidth),
-        _reverse(reverse),
-        _inverted(inverted),
-        _last_level(0),
-        _last_x(0),
-        _last_total(0) {
-        _buf[sizeof(_buf) - 1] = 0;
-    }
+    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse, bool inverted, bool diff = false);
+    ~FlameGraph();
 
     Trie* root() {
         return &_root;
     }
 
-    Trie* addChild(Trie* f, const char* name, FrameTypeId type, u64 value);
+    Trie* addChild(Trie* f, const char* name, FrameTypeId type, u64 value, u64 baseline = 0);
+
+    // Adds all frames of a partial flame graph built by another thread
+    void merge(const FlameGraph& other);
 
     void dump(Writer& out, bool tree);
 };
@@ -3,28 +3,39 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
+#include <functional>
 #include <map>
 #include <string>
-#include <arpa/inet.h>
+#include <vector>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include "demangle.h"
 #include "flightRecorder.h"
 #include "incbin.h"
+#include "jfrBuffer.h"
+#include "jfrCompressor.h"
 #include "jfrMetadata.h"
+#include "jfrStreamer.h"
+#include "methodMap.h"
 #include "dictionary.h"
+#include "fileRotator.h"
 #include "os.h"
+#include "perfEvents.h"
 #include "profiler.h"
 #include "spinLock.h"
 #include "symbols.h"
 #include "threadFilter.h"
 #include "threadLocalData.h"
+#include "traceClassifier.h"
 #include "tsc.h"
 #include "userEvents.h"
 #include "vmStructs.h"
@@ -37,19 +48,34 @@ static void JNICALL JfrSync_stopProfiler(JNIEnv* env, jclass cls) {
 }
 
 
-const int SMALL_BUFFER_SIZE = 1024;
-const int SMALL_BUFFER_LIMIT = SMALL_BUFFER_SIZE - 128;
-const int RECORDING_BUFFER_SIZE = 65536;
-const int RECORDING_BUFFER_LIMIT = RECORDING_BUFFER_SIZE - 4096;
-const int MAX_STRING_LENGTH = 8191;
+const int USER_STAGE_SIZE = 32768;
+const int USER_STAGE_LIMIT = USER_STAGE_SIZE / 2;
+const int USER_STAGE_CAPACITY = USER_STAGE_SIZE - ASPROF_MAX_JFR_EVENT_LENGTH - 64;
+const u64 BUFFER_WRITER_INTERVAL = 2000000;  // 2 ms
+const u32 MAX_MARKED_CLASSES = 1 << 20;
+const u32 MAX_BATCH_ENTRIES = 256;
+const size_t PARALLEL_RESOLVE_THRESHOLD = 4096;
+const int MAX_RESOLVE_THREADS = 8;
 const u64 MAX_JLONG = 0x7fffffffffffffffULL;
 const u64 MIN_JLONG = 0x8000000000000000ULL;
+const int EVENT_TYPES = USER_EVENT + 1;
+const size_t CHUNK_TOP_TRACES = 10;
 
 enum GCWhen {
     BEFORE_GC,
     AFTER_GC
 };
 
+// An open batch event in a recording buffer, see Recording::openBatch
+struct EventBatch {
+    int start;
+    int count_offset;
+    u32 count;
+    int tid;
+    JfrType type;
+    u64 last_time;
+};
+
 
 static SpinLock _rec_lock(1);
 
@@ -60,6 +86,22 @@ static jmethodID _box_method;
 
 static const char* const SETTING_CSTACK[] = {NULL, "no", "fp", "dwarf", "lbr", "vm"};
 
+// Reported in chunk summaries by the event name, regardless of batching
+static const char* const EVENT_TYPE_NAME[EVENT_TYPES] = {
+    "jdk.ExecutionSample",              // PERF_SAMPLE
+    "jdk.ExecutionSample",              // EXECUTION_SAMPLE
+    "profiler.WallClockSample",         // WALL_CLOCK_SAMPLE
+    "jdk.ExecutionSample",              // INSTRUMENTED_METHOD
+    "profiler.Malloc",                  // MALLOC_SAMPLE
+    "jdk.ObjectAllocationInNewTLAB",    // ALLOC_SAMPLE
+    "jdk.ObjectAllocationOutsideTLAB",  // ALLOC_OUTSIDE_TLAB
+    "profiler.LiveObject",              // LIVE_OBJECT
+    "jdk.JavaMonitorEnter",             // LOCK_SAMPLE
+    "jdk.ThreadPark",                   // PARK_SAMPLE
+    "profiler.Window",                  // PROFILING_WINDOW
+    "profiler.UserEvent",               // USER_EVENT
+};
+
 
 struct CpuTime {
     u64 real;
@@ -72,58 +114,100 @@ struct CpuTimes {
     CpuTime total;
 };
 
+// User and system clock ticks by thread id
+typedef std::map<int, std::pair<u64, u64> > ThreadCpuTimes;
 
-class MethodInfo {
-  public:
-    MethodInfo() : _mark(false), _key(0) {
+static void collectThreadCpuTime(void* arg, int thread_id, u64 utime, u64 stime) {
+    (*(ThreadCpuTimes*)arg)[thread_id] = std::make_pair(utime, stime);
+}
+
+
+// Copies class name, method name and signature into one block: "class\0name\0signature\0"
+static char* packMethodNames(const char* class_name, size_t class_len, const char* method_name, size_t name_len,
+                             const char* method_sig, size_t sig_len) {
+    char* names = (char*)malloc(class_len + name_len + sig_len + 3);
+    if (names != NULL) {
+        char* p = names;
+        memcpy(p, class_name, class_len);
+        p[class_len] = 0;
+        p += class_len + 1;
+        memcpy(p, method_name, name_len);
+        p[name_len] = 0;
+        p += name_len + 1;
+        memcpy(p, method_sig, sig_len);
+        p[sig_len] = 0;
+    }
+    return names;
+}
+
+// Fetches names of a Java method through JVMTI. Names are left NULL on JVMTI error.
+static void loadJavaMethodNames(MethodInfo* mi, jmethodID method, JNIEnv* jni, jvmtiEnv* jvmti) {
+    jclass method_class = NULL;
+    char* class_name = NULL;
+    char* method_name = NULL;
+    char* method_sig = NULL;
+
+    if (jvmti->GetMethodName(method, &method_name, &method_sig, NULL) == 0 &&
+        jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
+        jvmti->GetClassSignature(method_class, &class_name, NULL) == 0) {
+        // Strip L and ; of the class signature
+        mi->_names = packMethodNames(class_name + 1, strlen(class_name) - 2, method_name, strlen(method_name),
+                                     method_sig, strlen(method_sig));
     }
 
-    bool _mark;
-    u32 _key;
-    u32 _class;
-    u32 _name;
-    u32 _sig;
-    jint _modifiers;
-    jint _line_number_table_size;
-    jvmtiLineNumberEntry* _line_number_table;
-    FrameTypeId _type;
+    if (method_class) {
+        jni->DeleteLocalRef(method_class);
+    }
+    jvmti->Deallocate((unsigned char*)method_sig);
+    jvmti->Deallocate((unsigned char*)method_name);
+    jvmti->Deallocate((unsigned char*)class_name);
+}
 
-    jint getLineNumber(jint bci) {
-        if (_line_number_table_size == 0) {
-            return 0;
+// Fetches names and attributes of a Java method; called concurrently for different methods
+// by resolver threads. Returns false if jmethodID is stale.
+static bool loadJavaMethod(MethodInfo* mi, jmethodID method, JNIEnv* jni) {
+    jvmtiEnv* jvmti = VM::jvmti();
+    bool names_loaded = false;
+
+    if (VMStructs::hasMethodStructs()) {
+        // Workaround for JDK-8313816
+        VMMethod* vm_method = VMMethod::fromMethodID(method);
+        if (vm_method == NULL || vm_method->id() == NULL) {
+            return false;
         }
 
-        int i = 1;
-        while (i < _line_number_table_size && bci >= _line_number_table[i].start_location) {
-            i++;
+        // Names are read right from HotSpot symbols, unless they look unusual
+        VMSymbol* class_name;
+        VMSymbol* method_name;
+        VMSymbol* method_sig;
+        if (VMStructs::hasMethodNames() && vm_method->symbols(&class_name, &method_name, &method_sig)) {
+            mi->_names = packMethodNames(class_name->body(), class_name->length(), method_name->body(),
+                                         method_name->length(), method_sig->body(), method_sig->length());
+            names_loaded = true;
         }
-        return _line_number_table[i - 1].line_number;
     }
-};
 
-class MethodMap : public std::map<jmethodID, MethodInfo> {
-  public:
-    MethodMap() {
+    if (!names_loaded) {
+        loadJavaMethodNames(mi, method, jni, jvmti);
     }
 
-    ~MethodMap() {
-        jvmtiEnv* jvmti = VM::jvmti();
-        for (const_iterator it = begin(); it != end(); ++it) {
-            jvmtiLineNumberEntry* line_number_table = it->second._line_number_table;
-            if (line_number_table != NULL) {
-                jvmti->Deallocate((unsigned char*)line_number_table);
-            }
+    if (!mi->_loaded) {
+        mi->_loaded = true;
+        if (jvmti->GetMethodModifiers(method, &mi->_modifiers) != 0) {
+            mi->_modifiers = 0;
         }
-    }
-
-    size_t usedMemory() {
-        size_t bytes = 0;
-        for (const_iterator it = begin(); it != end(); ++it) {
-            bytes += sizeof(jmethodID) + sizeof(MethodInfo);
-            bytes += it->second._line_number_table_size * sizeof(jvmtiLineNumberEntry);
+        if (jvmti->GetLineNumberTable(method, &mi->_line_number_table_size, &mi->_line_number_table) != 0) {
+            mi->_line_number_table_size = 0;
+            mi->_line_number_table = NULL;
         }
-        return bytes;
     }
+    return true;
+}
+
+struct ResolveTask {
+    const std::vector<std::pair<jmethodID, MethodInfo*> >* methods;
+    size_t start;
+    size_t step;
 };
 
 class Lookup {
@@ -132,6 +216,8 @@ class Lookup {
     Dictionary* _classes;
     Dictionary _packages;
     Dictionary _symbols;
+    // Methods referenced in the current chunk, in the order of resolution
+    std::vector<MethodInfo*> _marked;
 
   private:
     JNIEnv* _jni;
@@ -150,12 +236,12 @@ class Lookup {
         mi->_line_number_table = NULL;
 
         if (Demangle::needsDemangling(name)) {
-            char* demangled = Demangle::demangle(name, false);
+            const char* demangled = Demangle::demangleNative(name, false);
             if (demangled != NULL) {
                 mi->_name = _symbols.lookup(demangled);
                 mi->_sig = _symbols.lookup("()L;");
                 mi->_type = FRAME_CPP;
-                free(demangled);
+                mi->_hint = TraceClassifier::nativeHint(demangled, FRAME_CPP);
                 return;
             }
         }
@@ -165,61 +251,52 @@ class Lookup {
             mi->_name = _symbols.lookup(name, len - 4);
             mi->_sig = _symbols.lookup("(Lk;)L;");
             mi->_type = FRAME_KERNEL;
+            mi->_hint = HINT_NONE;
         } else {
             mi->_name = _symbols.lookup(name);
             mi->_sig = _symbols.lookup("()L;");
             mi->_type = FRAME_NATIVE;
+            mi->_hint = TraceClassifier::nativeHint(name, FRAME_NATIVE);
         }
     }
 
-    bool fillJavaMethodInfo(MethodInfo* mi, jmethodID method, bool first_time) {
-        if (VMStructs::hasMethodStructs()) {
-            // Workaround for JDK-8313816
-            VMMethod* vm_method = VMMethod::fromMethodID(method);
-            if (vm_method == NULL || vm_method->id() == NULL) {
-                return false;
-            }
+    bool fillJavaMethodInfo(MethodInfo* mi, jmethodID method) {
+        if (mi->_names == NULL && !loadJavaMethod(mi, method, _jni)) {
+            return false;
         }
 
-        jvmtiEnv* jvmti = VM::jvmti();
-
-        jclass method_class = NULL;
-        char* class_name = NULL;
-        char* method_name = NULL;
-        char* method_sig = NULL;
-
-        if (jvmti->GetMethodName(method, &method_name, &method_sig, NULL) == 0 &&
-            jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
-            jvmti->GetClassSignature(method_class, &class_name, NULL) == 0) {
-            mi->_class = _classes->lookup(class_name + 1, strlen(class_name) - 2);
+        if (mi->_names != NULL) {
+            const char* class_name = mi->_names;
+            const char* method_name = class_name + strlen(class_name) + 1;
+            const char* method_sig = method_name + strlen(method_name) + 1;
+            mi->_class = _classes->lookup(class_name);
             mi->_name = _symbols.lookup(method_name);
             mi->_sig = _symbols.lookup(method_sig);
+            mi->_hint = TraceClassifier::javaHint(class_name, method_name);
         } else {
             mi->_class = _classes->lookup("");
             mi->_name = _symbols.lookup("jvmtiError");
             mi->_sig = _symbols.lookup("()L;");
-        }
-
-        if (method_class) {
-            _jni->DeleteLocalRef(method_class);
-        }
-        jvmti->Deallocate((unsigned char*)method_sig);
-        jvmti->Deallocate((unsigned char*)method_name);
-        jvmti->Deallocate((unsigned char*)class_name);
-
-        if (first_time && jvmti->GetMethodModifiers(method, &mi->_modifiers) != 0) {
-            mi->_modifiers = 0;
-        }
-
-        if (first_time && jvmti->GetLineNumberTable(method, &mi->_line_number_table_size, &mi->_line_number_table) != 0) {
-            mi->_line_number_table_size = 0;
-            mi->_line_number_table = NULL;
+            mi->_hint = HINT_NONE;
         }
 
         mi->_type = FRAME_INTERPRETED;
         return true;
     }
 
+    static void* resolveThreadEntry(void* arg) {
+        ResolveTask* task = (ResolveTask*)arg;
+        JNIEnv* jni = VM::attachThread("Async-profiler Method Resolver");
+        if (jni != NULL) {
+            for (size_t i = task->start; i < task->methods->size(); i += task->step) {
+                const std::pair<jmethodID, MethodInfo*>& entry = (*task->methods)[i];
+                loadJavaMethod(entry.second, entry.first, jni);
+            }
+            VM::detachThread();
+        }
+        return NULL;
+    }
+
     void fillJavaClassInfo(MethodInfo* mi, u32 class_id) {
         mi->_class = class_id;
         mi->_name = _symbols.lookup("");
@@ -228,6 +305,7 @@ class Lookup {
         mi->_line_number_table_size = 0;
         mi->_line_number_table = NULL;
         mi->_type = FRAME_INLINED;
+        mi->_hint = HINT_NONE;
     }
 
   public:
@@ -235,31 +313,95 @@ class Lookup {
         _method_map(method_map), _classes(classes), _packages(), _symbols(), _jni(VM::jni()) {
     }
 
+    // Java methods seen for the first time are loaded by a pool of attached threads,
+    // since sequential JVMTI calls dominate the first chunk of a large application
+    void prefetchMethods(const std::map<u32, CallTrace*>& traces) {
+        std::vector<jmethodID> ids;
+        TraceFrames trace_frames;
+        for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
+            CallTrace* trace = it->second;
+            ASGCT_CallFrame* frames = trace_frames.get(trace);
+            for (int i = 0; i < trace->num_frames; i++) {
+                if (frames[i].bci > BCI_NATIVE_FRAME && frames[i].method_id != NULL) {
+                    ids.push_back(frames[i].method_id);
+                }
+            }
+        }
+        if (ids.size() < PARALLEL_RESOLVE_THRESHOLD) {
+            return;
+        }
+
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        std::vector<std::pair<jmethodID, MethodInfo*> > methods;
+        for (size_t i = 0; i < ids.size(); i++) {
+            MethodInfo* mi = &(*_method_map)[ids[i]];
+            if (mi->_names == NULL) {
+                methods.push_back(std::make_pair(ids[i], mi));
+            }
+        }
+        if (methods.size() < PARALLEL_RESOLVE_THRESHOLD) {
+            return;
+        }
+
+        int thread_count = OS::getCpuCount();
+        if (thread_count > MAX_RESOLVE_THREADS) thread_count = MAX_RESOLVE_THREADS;
+
+        ResolveTask tasks[MAX_RESOLVE_THREADS];
+        pthread_t threads[MAX_RESOLVE_THREADS];
+        int started = 0;
+        for (int i = 0; i < thread_count; i++) {
+            tasks[i].methods = &methods;
+            tasks[i].start = i;
+            tasks[i].step = thread_count;
+            if (pthread_create(&threads[started], NULL, resolveThreadEntry, &tasks[i]) == 0) {
+                started++;
+            }
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        // Whatever is left because of a failed thread start is resolved sequentially later
+    }
+
     MethodInfo* resolveMethod(ASGCT_CallFrame& frame) {
         jmethodID method = frame.method_id;
+        jint bci = frame.bci;
+        if (bci == BCI_NATIVE_PC) {
+            // Share the method with frames walked after the library symbols had been loaded
+            const char* name = Profiler::instance()->resolveNativePC(method);
+            if (name != NULL) {
+                method = (jmethodID)name;
+                bci = BCI_NATIVE_FRAME;
+            } else {
+                bci = BCI_ADDRESS;
+            }
+        }
+
         MethodInfo* mi = &(*_method_map)[method];
 
-        bool first_time = mi->_key == 0;
-        if (first_time) {
+        if (mi->_key == 0) {
             mi->_key = _method_map->size();
         }
 
         if (!mi->_mark) {
             mi->_mark = true;
+            _marked.push_back(mi);
             if (method == NULL) {
                 fillNativeMethodInfo(mi, "unknown", NULL);
-            } else if (frame.bci > BCI_NATIVE_FRAME) {
-                if (!fillJavaMethodInfo(mi, method, first_time)) {
+            } else if (bci > BCI_NATIVE_FRAME) {
+                if (!fillJavaMethodInfo(mi, method)) {
                     fillNativeMethodInfo(mi, "stale_jmethodID", NULL);
                 }
-            } else if (frame.bci == BCI_NATIVE_FRAME) {
+            } else if (bci == BCI_NATIVE_FRAME) {
                 const char* name = (const char*)method;
                 fillNativeMethodInfo(mi, name, Profiler::instance()->getLibraryName(name));
-            } else if (frame.bci == BCI_ADDRESS) {
+            } else if (bci == BCI_ADDRESS) {
                 char buf[32];
                 snprintf(buf, sizeof(buf), "%p", method);
                 fillNativeMethodInfo(mi, buf, NULL);
-            } else if (frame.bci == BCI_ERROR) {
+            } else if (bci == BCI_ERROR) {
                 fillNativeMethodInfo(mi, (const char*)method, NULL);
             } else {
                 fillJavaClassInfo(mi, (uintptr_t)method);
@@ -292,142 +434,90 @@ class Lookup {
 };
 
 
-class Buffer {
-  private:
-    int _offset;
-    char _data[0];
-
-  protected:
-    Buffer() : _offset(0) {
-    }
-
-  public:
-    const char* data() const {
-        return _data;
+static int createScratchFile() {
+    char path[] = "/tmp/async-profiler-chunk.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
     }
+    return fd;
+}
 
-    int offset() const {
-        return _offset;
-    }
+// Streamed chunks do not touch the disk where memory files are supported
+static int createChunkFile() {
+    int fd = OS::createMemoryFile("async-profiler-chunk");
+    return fd >= 0 ? fd : createScratchFile();
+}
 
-    int skip(int delta) {
-        int offset = _offset;
-        _offset = offset + delta;
-        return offset;
-    }
 
-    void reset() {
-        _offset = 0;
-    }
+class StageBuffer : public Buffer {
+  private:
+    char _buf[USER_STAGE_SIZE - sizeof(Buffer)];
 
-    void put(const char* v, u32 len) {
-        memcpy(_data + _offset, v, len);
-        _offset += (int)len;
+  public:
+    StageBuffer() : Buffer() {
     }
+};
 
-    void put8(char v) {
-        _data[_offset++] = v;
-    }
+// Per-thread staging area for buffered user events. The owner encodes events into it
+// without touching recording locks; the contents go to the recording once the stage
+// is half full, on every timer tick and before a chunk ends. Stages are never freed:
+// when the owner thread exits, another thread may pick up the emptied stage.
+struct UserEventStage {
+    UserEventStage* next;
+    SpinLock lock;
+    volatile int owner;  // 0 if the stage is free
+    int tid;             // the thread whose events are in the buffer
+    u32 events;          // the number of events in the buffer
+    StageBuffer buf;
+};
 
-    void put16(short v) {
-        *(short*)(_data + _offset) = htons(v);
-        _offset += 2;
-    }
+static UserEventStage* volatile _user_stages = NULL;
 
-    void put32(int v) {
-        *(int*)(_data + _offset) = htonl(v);
-        _offset += 4;
-    }
+static void releaseUserStage(void* stage) {
+    __atomic_store_n(&((UserEventStage*)stage)->owner, 0, __ATOMIC_RELEASE);
+}
 
-    void put64(u64 v) {
-        *(u64*)(_data + _offset) = OS::hton64(v);
-        _offset += 8;
+static pthread_key_t createUserStageKey() {
+    pthread_key_t key;
+    if (pthread_key_create(&key, releaseUserStage) != 0) {
+        return (pthread_key_t)-1;
     }
+    return key;
+}
 
-    void putFloat(float v) {
-        union {
-            float f;
-            int i;
-        } u;
-
-        u.f = v;
-        put32(u.i);
-    }
+static pthread_key_t _user_stage_key = createUserStageKey();
 
-    void putVar32(u32 v) {
-        while (v > 0x7f) {
-            _data[_offset++] = (char)v | 0x80;
-            v >>= 7;
-        }
-        _data[_offset++] = (char)v;
+static UserEventStage* acquireUserStage(int tid) {
+    if (_user_stage_key == (pthread_key_t)-1) {
+        return NULL;
     }
 
-    void putVar64(u64 v) {
-        int iter = 0;
-        while (v > 0x1fffff) {
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            _data[_offset++] = (char)v | 0x80; v >>= 7;
-            if (++iter == 3) return;
-        }
-        while (v > 0x7f) {
-            _data[_offset++] = (char)v | 0x80;
-            v >>= 7;
-        }
-        _data[_offset++] = (char)v;
+    UserEventStage* stage = (UserEventStage*)pthread_getspecific(_user_stage_key);
+    if (stage != NULL) {
+        return stage;
     }
 
-    void putUtf8(const char* v) {
-        if (v == NULL) {
-            put8(0);
-        } else {
-            size_t len = strlen(v);
-            putUtf8(v, len < MAX_STRING_LENGTH ? len : MAX_STRING_LENGTH);
+    // A free stage still holding events of its former owner is reused only after it is drained
+    for (stage = _user_stages; stage != NULL; stage = stage->next) {
+        if (stage->owner == 0 && stage->buf.offset() == 0 && __sync_bool_compare_and_swap(&stage->owner, 0, tid)) {
+            break;
         }
     }
 
-    void putUtf8(const char* v, u32 len) {
-        put8(3);
-        putVar32(len);
-        put(v, len);
-    }
-
-    void putByteString(const char* v, u32 len) {
-        put8(5); // STRING_ENCODING_LATIN1_BYTE_ARRAY
-        putVar32(len);
-        put(v, len);
-    }
-
-    void put8(int offset, char v) {
-        _data[offset] = v;
+    if (stage == NULL) {
+        stage = new UserEventStage();
+        stage->owner = tid;
+        stage->events = 0;
+        do {
+            stage->next = _user_stages;
+        } while (!__sync_bool_compare_and_swap(&_user_stages, stage->next, stage));
     }
 
-    void putVar32(int offset, u32 v) {
-        _data[offset] = v | 0x80;
-        _data[offset + 1] = (v >> 7) | 0x80;
-        _data[offset + 2] = (v >> 14) | 0x80;
-        _data[offset + 3] = (v >> 21) | 0x80;
-        _data[offset + 4] = (v >> 28);
-    }
-};
-
-class SmallBuffer : public Buffer {
-  private:
-    char _buf[SMALL_BUFFER_SIZE - sizeof(Buffer)];
-
-  public:
-    SmallBuffer() : Buffer() {
-    }
-};
-
-class RecordingBuffer : public Buffer {
-  private:
-    char _buf[RECORDING_BUFFER_SIZE - sizeof(Buffer)];
-
-  public:
-    RecordingBuffer() : Buffer() {
-    }
-};
+    stage->tid = tid;
+    pthread_setspecific(_user_stage_key, stage);
+    return stage;
+}
 
 
 class Recording {
@@ -438,12 +528,26 @@ class Recording {
     static char* _java_command;
 
     RecordingBuffer _buf[CONCURRENCY_LEVEL];
+    RecordingBuffer _spare_buf[CONCURRENCY_LEVEL];
+    Buffer* _active_buf[CONCURRENCY_LEVEL];
+    Buffer* _full_buf[CONCURRENCY_LEVEL];
+    EventBatch _batch[CONCURRENCY_LEVEL];
+    u64 _event_counts[CONCURRENCY_LEVEL][EVENT_TYPES];
+    volatile u64 _staged_user_events;
+    RecordingBuffer _chunk_buf;
+    Mutex _writer_lock;
+    pthread_t _writer;
+    volatile bool _writer_active;
     int _fd;
     int _memfd;
+    int _gzip_fd;
+    int _scratch_fd[2];
+    JfrCompressor* _compressor;
+    JfrStreamer* _streamer;
     char* _master_recording_file;
     off_t _chunk_start;
     ThreadFilter _thread_set;
-    MethodMap _method_map;
+    MethodMap* _method_map;
 
     u64 _start_time;
     u64 _start_ticks;
@@ -459,18 +563,141 @@ class Recording {
     int _recorded_lib_count;
 
     bool _in_memory;
+    bool _batch_events;
     bool _cpu_monitor_enabled;
+    bool _thread_cpu_enabled;
     bool _heap_monitor_enabled;
     u32 _last_gc_id;
     CpuTimes _last_times;
+    ThreadCpuTimes _last_thread_times;
     SmallBuffer _monitor_buf;
 
+    // Classes referenced in the current chunk
+    u64* _class_marks;
+    volatile bool _mark_all_classes;
+
+    // State of the chunk detached by detachChunk, until it is completed
+    volatile bool _rotating;
+    volatile u64 _rotation_drops;
+    u64* _pending_class_marks;
+    volatile bool _pending_mark_all_classes;
+    std::vector<int> _pending_threads;
+    std::map<u32, CallTrace*> _pending_traces;
+    std::vector<std::pair<u64, u32> > _pending_samples;
+    u64 _pending_event_counts[EVENT_TYPES];
+
+    // Resolved methods are kept for the lifetime of the process to avoid JVMTI calls on restart
+    static MethodMap* methodMap() {
+        static MethodMap* method_map = new MethodMap();
+        return method_map;
+    }
+
     static float ratio(float value) {
         return value < 0 ? 0 : value > 1 ? 1 : value;
     }
 
+    // Raw chunks are written to one of two scratch files, while the other one
+    // is being compressed into the actual output file in background
+    void startCompression() {
+        _scratch_fd[0] = createScratchFile();
+        _scratch_fd[1] = createScratchFile();
+        if (_scratch_fd[0] < 0 || _scratch_fd[1] < 0) {
+            Log::warn("Failed to create scratch files, JFR recording will not be compressed");
+            if (_scratch_fd[0] >= 0) close(_scratch_fd[0]);
+            if (_scratch_fd[1] >= 0) close(_scratch_fd[1]);
+            return;
+        }
+
+        _gzip_fd = _fd;
+        _fd = _scratch_fd[0];
+        _compressor = new JfrCompressor(_gzip_fd);
+    }
+
+    // Called from event writers concurrently; ids beyond the bitmap make the whole class pool written
+    static void markClass(u64* marks, volatile bool* mark_all, u32 class_id) {
+        if (class_id >= MAX_MARKED_CLASSES) {
+            *mark_all = true;
+            return;
+        }
+        u64* word = &marks[class_id / 64];
+        u64 bit = 1ULL << (class_id & 63);
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == 0) {
+            __sync_fetch_and_or(word, bit);
+        }
+    }
+
+    void markClass(u32 class_id) {
+        markClass(_class_marks, &_mark_all_classes, class_id);
+    }
+
+    // Class marks of the chunk being completed
+    bool isClassMarked(u32 class_id) {
+        return class_id >= MAX_MARKED_CLASSES || (_pending_class_marks[class_id / 64] & (1ULL << (class_id & 63))) != 0;
+    }
+
+    static void* writerEntry(void* recording) {
+        ((Recording*)recording)->writerLoop();
+        return NULL;
+    }
+
+    void startWriter() {
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            _active_buf[i] = &_buf[i];
+            _full_buf[i] = NULL;
+            _batch[i].count = 0;
+        }
+
+        _writer_active = true;
+        if (pthread_create(&_writer, NULL, writerEntry, this) != 0) {
+            Log::warn("Failed to start JFR writer thread, buffers will be flushed synchronously");
+            _writer_active = false;
+        }
+    }
+
+    void stopWriter() {
+        if (_writer_active) {
+            _writer_active = false;
+            pthread_join(_writer, NULL);
+        }
+    }
+
+    void writerLoop() {
+        while (_writer_active) {
+            writeFullBuffers();
+            OS::sleep(BUFFER_WRITER_INTERVAL);
+        }
+    }
+
+    // Writes out buffers handed over by flushAsync. A full slot is released only after
+    // its buffer is reset, so the recording thread may switch back to it right away.
+    void writeFullBuffers() {
+        MutexLocker ml(_writer_lock);
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            Buffer* buf = __atomic_load_n(&_full_buf[i], __ATOMIC_ACQUIRE);
+            if (buf != NULL) {
+                flush(buf);
+                __atomic_store_n(&_full_buf[i], (Buffer*)NULL, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
   public:
-    Recording(int fd, const char* master_recording_file, Arguments& args) : _fd(fd), _thread_set(), _method_map() {
+    Recording(int fd, const char* master_recording_file, Arguments& args, JfrStreamer* streamer = NULL) :
+        _fd(fd), _streamer(streamer), _thread_set(), _method_map(methodMap()) {
+        _gzip_fd = -1;
+        _compressor = NULL;
+        _class_marks = (u64*)calloc(MAX_MARKED_CLASSES / 64, sizeof(u64));
+        _mark_all_classes = false;
+        _pending_class_marks = (u64*)calloc(MAX_MARKED_CLASSES / 64, sizeof(u64));
+        _pending_mark_all_classes = false;
+        _rotating = false;
+        _rotation_drops = 0;
+        memset(_event_counts, 0, sizeof(_event_counts));
+        _staged_user_events = 0;
+        if (args.hasOption(GZIP_CHUNKS)) {
+            startCompression();
+        }
+
         _master_recording_file = master_recording_file == NULL ? NULL : strdup(master_recording_file);
         _chunk_start = lseek(_fd, 0, SEEK_END);
         _start_time = OS::micros();
@@ -479,47 +706,58 @@ class Recording {
         _bytes_written = 0;
         _memfd = -1;
         _in_memory = false;
+        _batch_events = args.hasOption(BATCH_EVENTS);
 
         _chunk_size = args._chunk_size <= 0 ? MAX_JLONG : (args._chunk_size < 262144 ? 262144 : args._chunk_size);
         _chunk_time = args._chunk_time <= 0 ? MAX_JLONG : (args._chunk_time < 5 ? 5 : args._chunk_time) * 1000000ULL;
 
         _available_processors = OS::getCpuCount();
 
-        writeHeader(_buf);
-        writeMetadata(_buf);
-        writeRecordingInfo(_buf);
-        writeSettings(_buf, args);
+        writeHeader(&_chunk_buf);
+        writeMetadata(&_chunk_buf);
+        writeRecordingInfo(&_chunk_buf);
+        writeSettings(&_chunk_buf, args);
         if (!args.hasOption(NO_SYSTEM_INFO)) {
-            writeOsCpuInfo(_buf);
-            writeJvmInfo(_buf);
+            writeOsCpuInfo(&_chunk_buf);
+            writeJvmInfo(&_chunk_buf);
         }
         if (!args.hasOption(NO_SYSTEM_PROPS)) {
-            writeSystemProperties(_buf);
+            writeSystemProperties(&_chunk_buf);
         }
         if (!args.hasOption(NO_NATIVE_LIBS)) {
             _recorded_lib_count = 0;
-            writeNativeLibraries(_buf);
+            writeNativeLibraries(&_chunk_buf);
         } else {
             _recorded_lib_count = -1;
         }
-        flush(_buf);
+        flush(&_chunk_buf);
 
         if (args.hasOption(IN_MEMORY) && (_memfd = OS::createMemoryFile("async-profiler-recording")) >= 0) {
             _in_memory = true;
         }
 
         _cpu_monitor_enabled = !args.hasOption(NO_CPU_LOAD);
-        if (_cpu_monitor_enabled) {
+        _thread_cpu_enabled = args.hasOption(THREAD_CPU_LOAD);
+        if (_cpu_monitor_enabled || _thread_cpu_enabled) {
             _last_times.proc.real = OS::getProcessCpuTime(&_last_times.proc.user, &_last_times.proc.system);
             _last_times.total.real = OS::getTotalCpuTime(&_last_times.total.user, &_last_times.total.system);
         }
+        if (_thread_cpu_enabled) {
+            _thread_cpu_enabled = OS::getThreadCpuTimes(collectThreadCpuTime, &_last_thread_times);
+        }
 
         _heap_monitor_enabled = !args.hasOption(NO_HEAP_SUMMARY) && VM::_totalMemory != NULL && VM::_freeMemory != NULL;
         _last_gc_id = 0;
+
+        startWriter();
     }
 
     ~Recording() {
-        off_t chunk_end = finishChunk();
+        stopWriter();
+        detachChunk();
+        off_t chunk_end = completeChunk();
+        free(_class_marks);
+        free(_pending_class_marks);
 
         if (_memfd >= 0) {
             close(_memfd);
@@ -530,35 +768,120 @@ class Recording {
             free(_master_recording_file);
         }
 
-        close(_fd);
-    }
+        if (_compressor != NULL) {
+            _compressor->submit(_fd, chunk_end);
+            delete _compressor;
+            close(_scratch_fd[0]);
+            close(_scratch_fd[1]);
+            _fd = _gzip_fd;
+        }
 
-    off_t finishChunk() {
-        flush(&_monitor_buf);
+        if (_streamer != NULL) {
+            // The streamer owns the last chunk and sends the remaining ones before returning
+            _streamer->submit(_fd);
+            delete _streamer;
+        } else {
+            // Closing may take long on network file systems; a loop iteration need not wait for it
+            FileRotator::release(_fd);
+        }
+    }
 
-        writeNativeLibraries(_buf);
+    // Called with all profiler locks held. Ends the current chunk: events recorded from now on
+    // belong to the next one, while the detached buffers and constant pool snapshot
+    // are written out by completeChunk without blocking the sampling threads.
+    void detachChunk() {
+        {
+            MutexLocker ml(_writer_lock);
+            for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+                closeBatch(i);
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            flush(&_buf[i]);
+                Buffer* buf = _active_buf[i];
+                if (buf->offset() == 0) {
+                    continue;
+                }
+                Buffer* full = __atomic_load_n(&_full_buf[i], __ATOMIC_ACQUIRE);
+                if (full != NULL) {
+                    // The writer has not caught up; the spare buffer is needed right now
+                    flush(full);
+                }
+                _active_buf[i] = buf == &_buf[i] ? &_spare_buf[i] : &_buf[i];
+                __atomic_store_n(&_full_buf[i], buf, __ATOMIC_RELEASE);
+            }
         }
 
         _stop_time = OS::micros();
         _stop_ticks = TSC::ticks();
 
+        // Everything events of the next chunk may add to is taken over by the detached chunk
+        Profiler::instance()->_call_trace_storage.collectTraces(_pending_traces, &_pending_samples);
+        _thread_set.collect(_pending_threads);
+        _thread_set.clear();
+
+        u64* marks = _pending_class_marks;
+        _pending_class_marks = _class_marks;
+        _pending_mark_all_classes = _mark_all_classes;
+        _class_marks = marks;
+        _mark_all_classes = false;
+
+        memset(_pending_event_counts, 0, sizeof(_pending_event_counts));
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            for (int j = 0; j < EVENT_TYPES; j++) {
+                _pending_event_counts[j] += _event_counts[i][j];
+            }
+        }
+        memset(_event_counts, 0, sizeof(_event_counts));
+        _pending_event_counts[USER_EVENT] += _staged_user_events;
+        _staged_user_events = 0;
+
+        _rotating = true;
+    }
+
+    // Called with the slot lock held, once per recorded event
+    void countEvent(int lock_index, EventType event_type) {
+        _event_counts[lock_index][event_type]++;
+    }
+
+    // Called under the shared recording lock when a user event stage is written out
+    void countStagedEvents(u32 count) {
+        atomicInc(_staged_user_events, count);
+    }
+
+    // Full buffers cannot be written out while the detached chunk is being completed:
+    // an event that does not fit into the slot buffer is dropped instead
+    bool acceptEvent(int lock_index) {
+        if (!_rotating || _active_buf[lock_index]->offset() < RECORDING_BUFFER_LIMIT) {
+            return true;
+        }
+        atomicInc(_rotation_drops);
+        return false;
+    }
+
+    off_t completeChunk() {
+        recordStorageStatistics(&_monitor_buf);
+        flush(&_monitor_buf);
+        recordSampleOverhead(&_monitor_buf);
+
+        recordChunkSummary(&_chunk_buf);
+        writeNativeLibraries(&_chunk_buf);
+
+        // Events of the chunk must be on disk before its constant pool
+        writeFullBuffers();
+        flush(&_chunk_buf);
+
         if (_memfd >= 0) {
             OS::copyFile(_memfd, _fd, 0, lseek(_memfd, 0, SEEK_CUR));
             _in_memory = false;
         }
 
         off_t cpool_offset = lseek(_fd, 0, SEEK_CUR);
-        writeCpool(_buf);
-        flush(_buf);
+        writeCpool(&_chunk_buf);
+        flush(&_chunk_buf);
 
         off_t chunk_end = lseek(_fd, 0, SEEK_CUR);
 
         // Patch cpool size field
-        _buf->putVar32(0, chunk_end - cpool_offset);
-        ssize_t result = pwrite(_fd, _buf->data(), 5, cpool_offset);
+        _chunk_buf.putVar32(0, chunk_end - cpool_offset);
+        ssize_t result = pwrite(_fd, _chunk_buf.data(), 5, cpool_offset);
         (void)result;
 
         // Workaround for JDK-8191415: compute actual TSC frequency, in case JFR is wrong
@@ -571,38 +894,63 @@ class Recording {
         }
 
         // Patch chunk header
-        _buf->put64(chunk_end - _chunk_start);
-        _buf->put64(cpool_offset - _chunk_start);
-        _buf->put64(68);
-        _buf->put64(_start_time * 1000);
-        _buf->put64((_stop_time - _start_time) * 1000);
-        _buf->put64(_start_ticks);
-        _buf->put64(tsc_frequency);
-        result = pwrite(_fd, _buf->data(), 56, _chunk_start + 8);
+        _chunk_buf.put64(chunk_end - _chunk_start);
+        _chunk_buf.put64(cpool_offset - _chunk_start);
+        _chunk_buf.put64(68);
+        _chunk_buf.put64(_start_time * 1000);
+        _chunk_buf.put64((_stop_time - _start_time) * 1000);
+        _chunk_buf.put64(_start_ticks);
+        _chunk_buf.put64(tsc_frequency);
+        result = pwrite(_fd, _chunk_buf.data(), 56, _chunk_start + 8);
         (void)result;
 
         OS::freePageCache(_fd, _chunk_start);
 
-        _buf->reset();
+        _chunk_buf.reset();
         return chunk_end;
     }
 
+    // Completes the chunk detached by detachChunk and starts writing the next one
     void switchChunk() {
-        _chunk_start = finishChunk();
+        _chunk_start = completeChunk();
+        if (_compressor != NULL) {
+            _compressor->submit(_fd, _chunk_start);
+            _fd = _fd == _scratch_fd[0] ? _scratch_fd[1] : _scratch_fd[0];
+            while (ftruncate(_fd, 0) < 0 && errno == EINTR);  // restart if interrupted
+            _chunk_start = lseek(_fd, 0, SEEK_SET);
+        } else if (_streamer != NULL) {
+            int fd = createChunkFile();
+            if (fd >= 0) {
+                _streamer->submit(_fd);
+                _fd = fd;
+            } else {
+                Log::warn("Failed to create JFR chunk file, dropped a chunk");
+                while (ftruncate(_fd, 0) < 0 && errno == EINTR);  // restart if interrupted
+            }
+            _chunk_start = lseek(_fd, 0, SEEK_SET);
+        }
         _start_time = _stop_time;
         _start_ticks = _stop_ticks;
         _base_id += 0x1000000;
         _bytes_written = 0;
 
-        writeHeader(_buf);
-        writeMetadata(_buf);
-        writeRecordingInfo(_buf);
-        flush(_buf);
+        writeHeader(&_chunk_buf);
+        writeMetadata(&_chunk_buf);
+        writeRecordingInfo(&_chunk_buf);
+        flush(&_chunk_buf);
 
         if (_memfd >= 0) {
             while (ftruncate(_memfd, 0) < 0 && errno == EINTR);  // restart if interrupted
             _in_memory = true;
         }
+
+        // Slot buffers of the new chunk may be written out from now on
+        __atomic_store_n(&_rotating, false, __ATOMIC_RELEASE);
+
+        u64 drops = __sync_lock_test_and_set(&_rotation_drops, 0);
+        if (drops > 0) {
+            Log::debug("Dropped %llu JFR events during chunk rotation", (unsigned long long)drops);
+        }
     }
 
     bool needSwitchChunk(u64 wall_time) {
@@ -610,17 +958,25 @@ class Recording {
     }
 
     size_t usedMemory() {
-        return _method_map.usedMemory() + _thread_set.usedMemory() +
+        return _method_map->usedMemory() + _thread_set.usedMemory() +
                (_memfd >= 0 ? lseek(_memfd, 0, SEEK_CUR) : 0);
     }
 
     void cpuMonitorCycle() {
-        if (!_cpu_monitor_enabled) return;
+        if (!_cpu_monitor_enabled && !_thread_cpu_enabled) return;
 
         CpuTimes times;
         times.proc.real = OS::getProcessCpuTime(&times.proc.user, &times.proc.system);
         times.total.real = OS::getTotalCpuTime(&times.total.user, &times.total.system);
 
+        if (_thread_cpu_enabled) {
+            threadCpuCycle(times.proc.real);
+        }
+        if (!_cpu_monitor_enabled) {
+            _last_times = times;
+            return;
+        }
+
         float proc_user = 0, proc_system = 0, machine_total = 0;
 
         if (times.proc.real != (u64)-1 && times.proc.real > _last_times.proc.real) {
@@ -644,6 +1000,32 @@ class Recording {
         _last_times = times;
     }
 
+    // Times of all threads are read in one pass; only threads that consumed CPU since the previous cycle
+    // produce an event, so that idle pools cost no recording space
+    void threadCpuCycle(u64 real) {
+        ThreadCpuTimes times;
+        OS::getThreadCpuTimes(collectThreadCpuTime, &times);
+
+        if (real != (u64)-1 && real > _last_times.proc.real) {
+            float delta = (real - _last_times.proc.real) * _available_processors;
+            for (ThreadCpuTimes::const_iterator it = times.begin(); it != times.end(); ++it) {
+                // A thread not seen before has started since the previous cycle
+                ThreadCpuTimes::const_iterator last = _last_thread_times.find(it->first);
+                u64 last_user = last != _last_thread_times.end() ? last->second.first : 0;
+                u64 last_system = last != _last_thread_times.end() ? last->second.second : 0;
+                if (it->second.first + it->second.second > last_user + last_system) {
+                    recordThreadCpuLoad(&_monitor_buf, it->first,
+                                        ratio((it->second.first - last_user) / delta),
+                                        ratio((it->second.second - last_system) / delta));
+                    flushIfNeeded(&_monitor_buf, SMALL_BUFFER_LIMIT);
+                    addThread(it->first);
+                }
+            }
+        }
+
+        _last_thread_times.swap(times);
+    }
+
     void heapMonitorCycle(u32 gc_id) {
         if (!_heap_monitor_enabled || gc_id == _last_gc_id) return;
 
@@ -653,6 +1035,36 @@ class Recording {
         _last_gc_id = gc_id;
     }
 
+    // Maps the finished chunks of an in-memory recording, so that they can be dumped without copying
+    const char* mapRecording(size_t* size) {
+        if (_memfd < 0 || _streamer != NULL) {
+            return NULL;
+        }
+
+        int fd = _gzip_fd >= 0 ? _gzip_fd : _fd;
+        off_t end = _gzip_fd >= 0 ? lseek(_gzip_fd, 0, SEEK_END) : _chunk_start;
+        if (end <= 0) {
+            return NULL;
+        }
+
+        void* addr = mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            return NULL;
+        }
+        *size = end;
+        return (const char*)addr;
+    }
+
+    void waitCompression() {
+        if (_compressor != NULL) {
+            _compressor->wait();
+        }
+    }
+
+    bool inMemory() const {
+        return _memfd >= 0;
+    }
+
     bool hasMasterRecording() const {
         return _master_recording_file != NULL;
     }
@@ -663,13 +1075,79 @@ class Recording {
             lseek(append_fd, 0, SEEK_END);
             OS::copyFile(_fd, append_fd, 0, size);
             close(append_fd);
+            // Our chunks are not read again; without reflink, copying has brought them back to page cache
+            OS::freePageCache(_fd, 0);
         } else {
             Log::warn("Failed to open JFR recording at %s: %s", target_file, strerror(errno));
         }
     }
 
     Buffer* buffer(int lock_index) {
-        return &_buf[lock_index];
+        return _active_buf[lock_index];
+    }
+
+    bool batchEvents() const {
+        return _batch_events;
+    }
+
+    // Batch events keep their size and entry count as padded varints, patched when the batch is closed
+    void openBatch(int lock_index, JfrType type, int tid, u64 time) {
+        Buffer* buf = _active_buf[lock_index];
+        EventBatch* batch = &_batch[lock_index];
+        batch->start = buf->skip(5);
+        buf->put8(type);
+        buf->putVar64(time);
+        buf->putVar32(tid);
+        batch->count_offset = buf->skip(5);
+        batch->count = 0;
+        batch->tid = tid;
+        batch->type = type;
+        batch->last_time = time;
+    }
+
+    void closeBatch(int lock_index) {
+        EventBatch* batch = &_batch[lock_index];
+        if (batch->count > 0) {
+            Buffer* buf = _active_buf[lock_index];
+            buf->putVar32(batch->count_offset, batch->count);
+            buf->putVar32(batch->start, buf->offset() - batch->start);
+            batch->count = 0;
+        }
+    }
+
+    // Entries of a batch share the thread and store the time relative to the previous entry
+    u64 nextBatchEntry(int lock_index, JfrType type, int tid, u64 time) {
+        EventBatch* batch = &_batch[lock_index];
+        if (batch->count == 0 || batch->type != type || batch->tid != tid ||
+            time < batch->last_time || batch->count >= MAX_BATCH_ENTRIES) {
+            closeBatch(lock_index);
+            openBatch(lock_index, type, tid, time);
+        }
+
+        u64 delta = time - batch->last_time;
+        batch->last_time = time;
+        batch->count++;
+        return delta;
+    }
+
+    // Called with the slot lock held. Rather than writing a full buffer synchronously, which stalls
+    // the sampling thread on a slow disk, hand it over to the writer thread and continue with the spare one.
+    void flushAsync(int lock_index) {
+        Buffer* buf = _active_buf[lock_index];
+        if (buf->offset() < RECORDING_BUFFER_LIMIT || _rotating) {
+            return;
+        }
+
+        closeBatch(lock_index);
+
+        if (!_writer_active || __atomic_load_n(&_full_buf[lock_index], __ATOMIC_ACQUIRE) != NULL) {
+            // The writer has not caught up with the previous buffer yet
+            flush(buf);
+            return;
+        }
+
+        _active_buf[lock_index] = buf == &_buf[lock_index] ? &_spare_buf[lock_index] : &_buf[lock_index];
+        __atomic_store_n(&_full_buf[lock_index], buf, __ATOMIC_RELEASE);
     }
 
     bool parseAgentProperties() {
@@ -774,6 +1252,22 @@ class Recording {
         buf->putVar32(0);
         buf->putVar32(0x7fffffff);  // must not clash with JFR metadata ID, or 'jfr print' will break
 
+        const std::string& body = metadataBody();
+        buf->put(body.data(), (u32)body.size());
+
+        buf->putVar32(metadata_start, buf->offset() - metadata_start);
+    }
+
+    // Metadata does not change at runtime: strings and the element tree
+    // are serialized once and copied into every chunk
+    static const std::string& metadataBody() {
+        static const std::string body = serializeMetadataBody();
+        return body;
+    }
+
+    static std::string serializeMetadataBody() {
+        RecordingBuffer* buf = new RecordingBuffer();
+
         std::vector<std::string>& strings = JfrMetadata::strings();
         buf->putVar32(strings.size());
         for (int i = 0; i < strings.size(); i++) {
@@ -782,10 +1276,12 @@ class Recording {
 
         writeElement(buf, JfrMetadata::root());
 
-        buf->putVar32(metadata_start, buf->offset() - metadata_start);
+        std::string body(buf->data(), buf->offset());
+        delete buf;
+        return body;
     }
 
-    void writeElement(Buffer* buf, const Element* e) {
+    static void writeElement(Buffer* buf, const Element* e) {
         buf->putVar32(e->_name);
 
         buf->putVar32(e->_attributes.size());
@@ -837,6 +1333,7 @@ class Recording {
         if (args._event != NULL) {
             writeIntSetting(buf, T_EXECUTION_SAMPLE, "interval", args._interval);
             writeBoolSetting(buf, T_EXECUTION_SAMPLE, "alluser", args._alluser);
+            writeListSetting(buf, T_COUNTER_SAMPLE, "counter", args._buf, args._perf_counters);
         }
         if (args._wall >= 0) {
             writeIntSetting(buf, T_EXECUTION_SAMPLE, "wall", args._wall);
@@ -1000,19 +1497,26 @@ class Recording {
         buf->putVar32(0);
         buf->putVar32(1);
 
-        buf->putVar32(11);
+        buf->putVar32(13);
+
+        // Native frames recorded with lazysyms are named in the constant pool
+        Profiler::instance()->loadDeferredSymbols();
 
-        Lookup lookup(&_method_map, Profiler::instance()->classMap());
+        Lookup lookup(_method_map, Profiler::instance()->classMap());
         writeFrameTypes(buf);
         writeThreadStates(buf);
         writeGCWhen(buf);
         writeThreads(buf);
-        writeStackTraces(buf, &lookup);
+        lookup.prefetchMethods(_pending_traces);
+        writeStackTraces(buf, &lookup, _pending_traces);
+        _pending_traces.clear();
         writeMethods(buf, &lookup);
         writeClasses(buf, &lookup);
         writePackages(buf, &lookup);
         writeSymbols(buf, &lookup);
         writeUserEventTypes(buf);
+        writeContextTags(buf);
+        writePerfCounters(buf);
         // Write log levels last. The order does not affect the JFR's validity,
         // but log levels have an easily-visible format that makes it easy
         // to see if a JFR file has been accidentally truncated.
@@ -1062,24 +1566,16 @@ class Recording {
 
     void writeThreads(Buffer* buf) {
         std::vector<int> threads;
-        _thread_set.collect(threads);
-        _thread_set.clear();
+        threads.swap(_pending_threads);
 
-        Profiler* profiler = Profiler::instance();
-        MutexLocker ml(profiler->_thread_names_lock);
-        std::map<int, std::string>& thread_names = profiler->_thread_names;
-        std::map<int, jlong>& thread_ids = profiler->_thread_ids;
+        ThreadNames& thread_names = Profiler::instance()->_thread_names;
         char name_buf[32];
 
         writePoolHeader(buf, T_THREAD, threads.size());
         for (int i = 0; i < threads.size(); i++) {
-            const char* thread_name;
             jlong thread_id;
-            std::map<int, std::string>::const_iterator it = thread_names.find(threads[i]);
-            if (it != thread_names.end()) {
-                thread_name = it->second.c_str();
-                thread_id = thread_ids[threads[i]];
-            } else {
+            const char* thread_name = thread_names.get(threads[i], &thread_id);
+            if (thread_name == NULL) {
                 snprintf(name_buf, sizeof(name_buf), "[tid=%d]", threads[i]);
                 thread_name = name_buf;
                 thread_id = 0;
@@ -1098,68 +1594,80 @@ class Recording {
         }
     }
 
-    void writeStackTraces(Buffer* buf, Lookup* lookup) {
-        std::map<u32, CallTrace*> traces;
-        Profiler::instance()->_call_trace_storage.collectTraces(traces);
-
+    void writeStackTraces(Buffer* buf, Lookup* lookup, const std::map<u32, CallTrace*>& traces) {
+        TraceFrames trace_frames;
+        std::vector<u8> hints;
+        std::vector<u8> types;
         writePoolHeader(buf, T_STACK_TRACE, traces.size());
         for (std::map<u32, CallTrace*>::const_iterator it = traces.begin(); it != traces.end(); ++it) {
             CallTrace* trace = it->second;
+            ASGCT_CallFrame* frames = trace_frames.get(trace);
+            hints.resize(trace->num_frames + 1);
+            types.resize(trace->num_frames + 1);
             buf->putVar32(it->first);
             buf->putVar32(0);  // truncated
             buf->putVar32(trace->num_frames);
             for (int i = 0; i < trace->num_frames; i++) {
-                MethodInfo* mi = lookup->resolveMethod(trace->frames[i]);
+                MethodInfo* mi = lookup->resolveMethod(frames[i]);
                 buf->putVar32(mi->_key);
                 if (mi->_type == FRAME_INTERPRETED) {
-                    jint bci = trace->frames[i].bci;
+                    jint bci = frames[i].bci;
                     FrameTypeId type = FrameType::decode(bci);
                     bci = (bci & 0x10000) ? 0 : (bci & 0xffff);
                     buf->putVar32(mi->getLineNumber(bci));
                     buf->putVar32(bci);
                     buf->put8(type);
+                    types[i] = type;
                 } else {
                     buf->put8(0);
                     buf->put8(0);
                     buf->put8(mi->_type);
+                    types[i] = mi->_type;
                 }
+                hints[i] = mi->_hint;
                 flushIfNeeded(buf);
             }
+            // Classified once per trace, so that converters need not match frame names
+            buf->putVar32(TraceClassifier::classify(trace->num_frames, hints.data(), types.data()));
             flushIfNeeded(buf);
         }
     }
 
     void writeMethods(Buffer* buf, Lookup* lookup) {
-        MethodMap* method_map = lookup->_method_map;
-
-        u32 marked_count = 0;
-        for (MethodMap::const_iterator it = method_map->begin(); it != method_map->end(); ++it) {
-            if (it->second._mark) {
-                marked_count++;
-            }
-        }
-
-        writePoolHeader(buf, T_METHOD, marked_count);
-        for (MethodMap::iterator it = method_map->begin(); it != method_map->end(); ++it) {
-            MethodInfo& mi = it->second;
-            if (mi._mark) {
-                mi._mark = false;
-                buf->putVar32(mi._key);
-                buf->putVar32(mi._class);
-                buf->putVar64(mi._name | _base_id);
-                buf->putVar64(mi._sig | _base_id);
-                buf->putVar32(mi._modifiers);
-                buf->putVar32(0);  // hidden
-                flushIfNeeded(buf);
-            }
+        const std::vector<MethodInfo*>& marked = lookup->_marked;
+
+        writePoolHeader(buf, T_METHOD, marked.size());
+        for (size_t i = 0; i < marked.size(); i++) {
+            MethodInfo* mi = marked[i];
+            mi->_mark = false;
+            markClass(_pending_class_marks, &_pending_mark_all_classes, mi->_class);
+            buf->putVar32(mi->_key);
+            buf->putVar32(mi->_class);
+            buf->putVar64(mi->_name | _base_id);
+            buf->putVar64(mi->_sig | _base_id);
+            buf->putVar32(mi->_modifiers);
+            buf->putVar32(0);  // hidden
+            flushIfNeeded(buf);
         }
     }
 
+    // Only classes referenced by methods or events of the current chunk are written
     void writeClasses(Buffer* buf, Lookup* lookup) {
         std::map<u32, const char*> classes;
         lookup->_classes->collect(classes);
 
-        writePoolHeader(buf, T_CLASS, classes.size());
+        bool all = _pending_mark_all_classes;
+        u32 marked_count = 0;
+        for (std::map<u32, const char*>::iterator it = classes.begin(); it != classes.end(); ) {
+            if (all || isClassMarked(it->first)) {
+                marked_count++;
+                ++it;
+            } else {
+                classes.erase(it++);
+            }
+        }
+
+        writePoolHeader(buf, T_CLASS, marked_count);
         for (std::map<u32, const char*>::const_iterator it = classes.begin(); it != classes.end(); ++it) {
             const char* name = it->second;
             buf->putVar32(it->first);
@@ -1169,6 +1677,9 @@ class Recording {
             buf->putVar32(0);  // access flags
             flushIfNeeded(buf);
         }
+
+        memset(_pending_class_marks, 0, MAX_MARKED_CLASSES / 8);
+        _pending_mark_all_classes = false;
     }
 
     void writePackages(Buffer* buf, Lookup* lookup) {
@@ -1204,6 +1715,15 @@ class Recording {
         }
     }
 
+    void writePerfCounters(Buffer* buf) {
+        int count = PerfEvents::counterCount();
+        writePoolHeader(buf, T_PERF_COUNTER, count);
+        for (int i = 0; i < count; i++) {
+            buf->putVar32(i);
+            buf->putUtf8(PerfEvents::counterName(i));
+        }
+    }
+
     void writeUserEventTypes(Buffer* buf) {
         std::map<u32, const char*> events;
         UserEvents::collect(events);
@@ -1216,6 +1736,18 @@ class Recording {
         }
     }
 
+    void writeContextTags(Buffer* buf) {
+        std::map<u32, const char*> tags;
+        UserEvents::collectContextTags(tags);
+
+        writePoolHeader(buf, T_CONTEXT_TAG, tags.size());
+        for (std::map<u32, const char*>::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+            flushIfNeeded(buf, RECORDING_BUFFER_LIMIT - MAX_STRING_LENGTH);
+            buf->putVar32(it->first);
+            buf->putUtf8(it->second);
+        }
+    }
+
     void recordExecutionSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
         int start = buf->skip(1);
         buf->put8(T_EXECUTION_SAMPLE);
@@ -1223,6 +1755,25 @@ class Recording {
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_thread_state);
+        buf->putVar64(event->_context.span_id);
+        buf->putVar64(event->_context.trace_id);
+        buf->putVar32(event->_context.tag);
+        buf->putVar32(event->_cpu);
+        buf->putVar32(OS::getCpuNode(event->_cpu));
+        buf->put8(start, buf->offset() - start);
+    }
+
+    void recordCounterSample(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_COUNTER_SAMPLE);
+        buf->putVar64(event->_start_time);
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        buf->putVar32(event->_counter_count);
+        for (int i = 0; i < event->_counter_count; i++) {
+            buf->putVar32(i);
+            buf->putVar64(event->_counters[i]);
+        }
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1234,6 +1785,9 @@ class Recording {
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_thread_state);
         buf->putVar32(event->_samples);
+        buf->putVar64(event->_context.span_id);
+        buf->putVar64(event->_context.trace_id);
+        buf->putVar32(event->_context.tag);
         buf->put8(start, buf->offset() - start);
     }
 
@@ -1243,6 +1797,7 @@ class Recording {
         buf->putVar64(event->_start_time);
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
+        markClass(event->_class_id);
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_instance_size);
         buf->putVar64(event->_total_size);
@@ -1255,11 +1810,32 @@ class Recording {
         buf->putVar64(event->_start_time);
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
+        markClass(event->_class_id);
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_total_size);
         buf->put8(start, buf->offset() - start);
     }
 
+    void recordAllocationBatched(int lock_index, int tid, u32 call_trace_id, AllocEvent* event) {
+        u64 delta = nextBatchEntry(lock_index, T_ALLOC_BATCH, tid, event->_start_time);
+        Buffer* buf = _active_buf[lock_index];
+        buf->putVar64(delta);
+        buf->putVar32(call_trace_id);
+        markClass(event->_class_id);
+        buf->putVar32(event->_class_id);
+        buf->putVar64(event->_instance_size);
+        buf->putVar64(event->_total_size);
+    }
+
+    void recordMallocBatched(int lock_index, int tid, u32 call_trace_id, MallocEvent* event) {
+        u64 delta = nextBatchEntry(lock_index, T_MALLOC_BATCH, tid, event->_start_time);
+        Buffer* buf = _active_buf[lock_index];
+        buf->putVar64(delta);
+        buf->putVar32(call_trace_id);
+        buf->putVar64(event->_address);
+        buf->putVar64(event->_size);
+    }
+
     void recordMallocSample(Buffer* buf, int tid, u32 call_trace_id, MallocEvent* event) {
         int start = buf->skip(1);
         buf->put8(event->_size != 0 ? T_MALLOC : T_FREE);
@@ -1273,7 +1849,7 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
-    void recordUserEvent(Buffer* buf, int tid, UserEvent* event) {
+    static void recordUserEvent(Buffer* buf, int tid, UserEvent* event) {
         // estimate of size of non-string fields of this event
         const size_t event_non_string_size_limit = 64;
         // When calling recordUserEvent, the buffer can be up to RECORDING_BUFFER_LIMIT bytes full.
@@ -1297,6 +1873,7 @@ class Recording {
         buf->putVar64(event->_start_time);
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
+        markClass(event->_class_id);
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_alloc_size);
         buf->putVar64(event->_alloc_time);
@@ -1310,6 +1887,7 @@ class Recording {
         buf->putVar64(event->_end_time - event->_start_time);
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
+        markClass(event->_class_id);
         buf->putVar32(event->_class_id);
         buf->put8(0);
         buf->putVar64(event->_address);
@@ -1323,6 +1901,7 @@ class Recording {
         buf->putVar64(event->_end_time - event->_start_time);
         buf->putVar32(tid);
         buf->putVar32(call_trace_id);
+        markClass(event->_class_id);
         buf->putVar32(event->_class_id);
         buf->putVar64(event->_timeout);
         buf->putVar64(MIN_JLONG);
@@ -1349,6 +1928,16 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
+    void recordThreadCpuLoad(Buffer* buf, int tid, float user, float system) {
+        int start = buf->skip(1);
+        buf->putVar32(T_THREAD_CPU_LOAD);
+        buf->putVar64(TSC::ticks());
+        buf->putVar32(tid);
+        buf->putFloat(user);
+        buf->putFloat(system);
+        buf->put8(start, buf->offset() - start);
+    }
+
     void recordHeapSummary(Buffer* buf, u32 id, GCWhen when, u64 total_memory, u64 free_memory) {
         CollectedHeap* heap = CollectedHeap::heap();
         u64 heap_start = heap != NULL ? heap->start() : 0;
@@ -1368,6 +1957,92 @@ class Recording {
         buf->put8(start, buf->offset() - start);
     }
 
+    void recordStorageStatistics(Buffer* buf) {
+        Profiler* profiler = Profiler::instance();
+        CallTraceStorageStats ts;
+        profiler->_call_trace_storage.stats(ts);
+        DictionaryStats cs, ss;
+        profiler->_class_map.stats(cs);
+        profiler->_symbol_map.stats(ss);
+
+        int start = buf->skip(1);
+        buf->put8(T_STORAGE_STATISTICS);
+        buf->putVar64(TSC::ticks());
+        buf->putVar64(ts.capacity);
+        buf->putVar64(ts.size);
+        buf->putFloat(ts.max_load);
+        buf->putFloat(ts.size == 0 ? 0 : (float)ts.total_probes / ts.size);
+        buf->putVar32(ts.max_probe);
+        buf->putVar64(ts.overflow);
+        buf->putVar64(ts.shared_prefixes);
+        buf->putVar64(cs.keys + ss.keys);
+        buf->putVar32(cs.overflow_rows + ss.overflow_rows);
+        buf->put8(start, buf->offset() - start);
+    }
+
+    // Cumulative since the profiler start; only collected with the 'stats' feature
+    void recordSampleOverhead(Buffer* buf) {
+        Profiler* profiler = Profiler::instance();
+        if (!profiler->_features.stats) {
+            return;
+        }
+
+        const OverheadStats& overhead = profiler->_overhead;
+        u64 ticks = TSC::ticks();
+        for (int i = 0; i < OVERHEAD_PHASES; i++) {
+            OverheadPhase phase = (OverheadPhase)i;
+            int start = buf->skip(1);
+            buf->put8(T_SAMPLE_OVERHEAD);
+            buf->putVar64(ticks);
+            buf->putUtf8(OverheadStats::name(phase));
+            buf->putVar64(overhead.count(phase));
+            buf->putVar64(overhead.average(phase));
+            buf->putVar64(overhead.percentile(phase, 50));
+            buf->putVar64(overhead.percentile(phase, 99));
+            buf->put8(start, buf->offset() - start);
+        }
+        flush(buf);
+    }
+
+    // Lets indexers get event counts and the hottest traces of a chunk without decoding all events
+    void recordChunkSummary(Buffer* buf) {
+        u64 ticks = TSC::ticks();
+
+        u64 counts[EVENT_TYPES];
+        memcpy(counts, _pending_event_counts, sizeof(counts));
+        for (int i = 0; i < EVENT_TYPES; i++) {
+            if (counts[i] == 0) {
+                continue;
+            }
+            // Event types sharing a name are reported together
+            for (int j = i + 1; j < EVENT_TYPES; j++) {
+                if (strcmp(EVENT_TYPE_NAME[i], EVENT_TYPE_NAME[j]) == 0) {
+                    counts[i] += counts[j];
+                    counts[j] = 0;
+                }
+            }
+            int start = buf->skip(1);
+            buf->put8(T_CHUNK_EVENT_COUNT);
+            buf->putVar64(ticks);
+            buf->putUtf8(EVENT_TYPE_NAME[i]);
+            buf->putVar64(counts[i]);
+            buf->put8(start, buf->offset() - start);
+        }
+
+        std::vector<std::pair<u64, u32> >& samples = _pending_samples;
+        size_t top = samples.size() < CHUNK_TOP_TRACES ? samples.size() : CHUNK_TOP_TRACES;
+        std::partial_sort(samples.begin(), samples.begin() + top, samples.end(), std::greater<std::pair<u64, u32> >());
+        for (size_t i = 0; i < top; i++) {
+            int start = buf->skip(1);
+            buf->putVar32(T_CHUNK_TOP_TRACE);
+            buf->putVar64(ticks);
+            buf->putVar32(samples[i].second);
+            buf->putVar64(samples[i].first);
+            buf->put8(start, buf->offset() - start);
+        }
+        samples.clear();
+    }
+
     void addThread(int tid) {
         if (!_thread_set.accept(tid)) {
             _thread_set.add(tid);
@@ -1387,6 +2062,21 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         return Error("Flight Recorder output file is not specified");
     }
 
+    if (args.hasOption(GZIP_CHUNKS)) {
+        if (args._jfr_sync != NULL) {
+            return Error("jfropts=gzip cannot be combined with jfrsync");
+        } else if (!JfrCompressor::available()) {
+            return Error("jfropts=gzip requires zlib");
+        }
+    }
+
+    // Samples look up the NUMA node of their CPU in a table that cannot be built in a signal handler
+    OS::getCpuNode(0);
+
+    if (Arguments::isStreamingAddress(filename)) {
+        return startStreaming(args, filename);
+    }
+
     char* filename_tmp = NULL;
     const char* master_recording_file = NULL;
     if (args._jfr_sync != NULL) {
@@ -1403,7 +2093,8 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
 
     TSC::enable(args._clock);
 
-    int fd = open(filename, O_CREAT | O_RDWR | (reset ? O_TRUNC : 0), 0644);
+    int fd = reset && args._jfr_sync == NULL ? FileRotator::open(filename)
+                                             : open(filename, O_CREAT | O_RDWR | (reset ? O_TRUNC : 0), 0644);
     if (fd == -1) {
         free(filename_tmp);
         return Error("Could not open Flight Recorder output file");
@@ -1419,9 +2110,57 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
     return Error::OK;
 }
 
+Error FlightRecorder::startStreaming(Arguments& args, const char* address) {
+    if (args._jfr_sync != NULL || args.hasOption(GZIP_CHUNKS)) {
+        return Error("Streaming to a collector cannot be combined with jfrsync or jfropts=gzip");
+    }
+
+    TSC::enable(args._clock);
+
+    int fd = createChunkFile();
+    if (fd == -1) {
+        return Error("Could not create JFR chunk file");
+    }
+
+    JfrStreamer* streamer = new JfrStreamer(address);
+    Error error = streamer->start();
+    if (error) {
+        delete streamer;
+        close(fd);
+        return error;
+    }
+
+    _rec = new Recording(fd, NULL, args, streamer);
+    _rec_lock.unlock();
+    return Error::OK;
+}
+
+// Writes out staged user events. Unless called under the exclusive recording lock,
+// stages being updated by their owners right now are left for the next time.
+void FlightRecorder::drainUserEvents(bool wait) {
+    for (UserEventStage* stage = _user_stages; stage != NULL; stage = stage->next) {
+        if (stage->buf.offset() == 0) {
+            continue;
+        }
+        if (wait) {
+            stage->lock.lock();
+        } else if (!stage->lock.tryLock()) {
+            continue;
+        }
+        if (stage->buf.offset() > 0) {
+            _rec->flush(&stage->buf);
+            _rec->addThread(stage->tid);
+            _rec->countStagedEvents(stage->events);
+            stage->events = 0;
+        }
+        stage->lock.unlock();
+    }
+}
+
 void FlightRecorder::stop() {
     if (_rec != NULL) {
         _rec_lock.lock();
+        drainUserEvents(true);
 
         if (_rec->hasMasterRecording()) {
             stopMasterRecording();
@@ -1432,14 +2171,53 @@ void FlightRecorder::stop() {
     }
 }
 
-void FlightRecorder::flush() {
+// Called with all profiler locks held. The recording stays locked until flush() completes the chunk.
+void FlightRecorder::detachChunk() {
     if (_rec != NULL) {
         _rec_lock.lock();
+        drainUserEvents(true);
+        _rec->detachChunk();
+    }
+}
+
+// Writes out the chunk detached by detachChunk(). Sampling may proceed meanwhile.
+void FlightRecorder::flush() {
+    if (_rec != NULL) {
         _rec->switchChunk();
         _rec_lock.unlock();
     }
 }
 
+Error FlightRecorder::dump(Writer& out) {
+    if (_rec == NULL) {
+        return Error("No active JFR recording");
+    }
+
+    // The recording file only grows, so the mapping stays valid after the lock is released
+    _rec_lock.lock();
+    size_t size = 0;
+    const char* data = _rec->mapRecording(&size);
+    _rec_lock.unlock();
+
+    if (data == NULL) {
+        return Error("JFR recording cannot be mapped");
+    }
+    out.write(data, size);
+    munmap((void*)data, size);
+    return Error::OK;
+}
+
+bool FlightRecorder::inMemory() {
+    return _rec != NULL && _rec->inMemory();
+}
+
+void FlightRecorder::waitCompression() {
+    // Called under the profiler state lock, so the recording cannot go away
+    if (_rec != NULL) {
+        _rec->waitCompression();
+    }
+}
+
 size_t FlightRecorder::usedMemory() {
     size_t bytes = 0;
     if (_rec != NULL) {
@@ -1458,6 +2236,7 @@ bool FlightRecorder::timerTick(u64 wall_time, u32 gc_id) {
 
     _rec->cpuMonitorCycle();
     _rec->heapMonitorCycle(gc_id);
+    drainUserEvents(false);
     bool need_switch_chunk = _rec->needSwitchChunk(wall_time);
 
     _rec_lock.unlockShared();
@@ -1533,14 +2312,31 @@ void FlightRecorder::stopMasterRecording() {
 
 void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                                  EventType event_type, Event* event) {
-    if (_rec != NULL) {
+    // Samples without an event only update call trace counters
+    if (_rec != NULL && event != NULL) {
+        if (!_rec->acceptEvent(lock_index)) {
+            return;
+        }
+        _rec->countEvent(lock_index, event_type);
+
         // Recording an event, increment the sample counter to allow
         // user code to attach metadata.
         ThreadLocalData::incrementSampleCounter();
 
+        bool batch = _rec->batchEvents();
+        if (batch && event_type != MALLOC_SAMPLE && event_type != ALLOC_SAMPLE) {
+            // Other events must not interleave with batch entries
+            _rec->closeBatch(lock_index);
+        }
+
         Buffer* buf = _rec->buffer(lock_index);
         switch (event_type) {
             case PERF_SAMPLE:
+                _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+                if (((ExecutionEvent*)event)->_counter_count > 0) {
+                    _rec->recordCounterSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+                }
+                break;
             case EXECUTION_SAMPLE:
             case INSTRUMENTED_METHOD:
                 _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
@@ -1549,10 +2345,18 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                 _rec->recordWallClockSample(buf, tid, call_trace_id, (WallClockEvent*)event);
                 break;
             case MALLOC_SAMPLE:
-                _rec->recordMallocSample(buf, tid, call_trace_id, (MallocEvent*)event);
+                if (batch) {
+                    _rec->recordMallocBatched(lock_index, tid, call_trace_id, (MallocEvent*)event);
+                } else {
+                    _rec->recordMallocSample(buf, tid, call_trace_id, (MallocEvent*)event);
+                }
                 break;
             case ALLOC_SAMPLE:
-                _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
+                if (batch) {
+                    _rec->recordAllocationBatched(lock_index, tid, call_trace_id, (AllocEvent*)event);
+                } else {
+                    _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
+                }
                 break;
             case ALLOC_OUTSIDE_TLAB:
                 _rec->recordAllocationOutsideTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
@@ -1573,11 +2377,67 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
                 _rec->recordUserEvent(buf, tid, (UserEvent*)event);
                 break;
         }
-        _rec->flushIfNeeded(buf);
+        _rec->flushAsync(lock_index);
         _rec->addThread(tid);
     }
 }
 
+void FlightRecorder::recordUserEvents(int lock_index, int tid, const asprof_jfr_event* events, size_t count) {
+    if (_rec == NULL) {
+        return;
+    }
+
+    if (_rec->batchEvents()) {
+        _rec->closeBatch(lock_index);
+    }
+
+    UserEvent event;
+    event._start_time = TSC::ticks();
+    for (size_t i = 0; i < count && _rec->acceptEvent(lock_index); i++) {
+        event._type = events[i].type;
+        event._data = events[i].data;
+        event._len = events[i].len;
+        _rec->countEvent(lock_index, USER_EVENT);
+        Recording::recordUserEvent(_rec->buffer(lock_index), tid, &event);
+        _rec->flushAsync(lock_index);
+    }
+    _rec->addThread(tid);
+}
+
+// Stashes events in the thread's stage; a full stage is written directly while holding
+// only the shared recording lock. If even that is busy, e.g. while a chunk is being
+// switched, events keep accumulating, and are dropped once the stage has no room left.
+void FlightRecorder::bufferUserEvents(int tid, const asprof_jfr_event* events, size_t count) {
+    UserEventStage* stage;
+    if (_rec == NULL || (stage = acquireUserStage(tid)) == NULL) {
+        return;
+    }
+
+    UserEvent event;
+    event._start_time = TSC::ticks();
+
+    stage->lock.lock();
+    for (size_t i = 0; i < count; i++) {
+        if (stage->buf.offset() >= USER_STAGE_LIMIT && _rec_lock.tryLockShared()) {
+            _rec->flush(&stage->buf);
+            _rec->addThread(tid);
+            _rec->countStagedEvents(stage->events);
+            stage->events = 0;
+            _rec_lock.unlockShared();
+        }
+        if (stage->buf.offset() >= USER_STAGE_CAPACITY) {
+            break;
+        }
+
+        event._type = events[i].type;
+        event._data = events[i].data;
+        event._len = events[i].len;
+        Recording::recordUserEvent(&stage->buf, tid, &event);
+        stage->events++;
+    }
+    stage->lock.unlock();
+}
+
 void FlightRecorder::recordLog(LogLevel level, const char* message, size_t len) {
     if (!_rec_lock.tryLockShared()) {
         // No active recording
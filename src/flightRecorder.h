@@ -10,6 +10,7 @@
 #include "arguments.h"
 #include "event.h"
 #include "log.h"
+#include "writer.h"
 
 class Recording;
 
@@ -18,7 +19,9 @@ class FlightRecorder {
     Recording* _rec;
 
     Error startMasterRecording(Arguments& args, const char* filename);
+    Error startStreaming(Arguments& args, const char* address);
     void stopMasterRecording();
+    void drainUserEvents(bool wait);
 
   public:
     FlightRecorder() : _rec(NULL) {
@@ -26,7 +29,11 @@ class FlightRecorder {
 
     Error start(Arguments& args, bool reset);
     void stop();
+    void detachChunk();
     void flush();
+    void waitCompression();
+    Error dump(Writer& out);
+    bool inMemory();
     size_t usedMemory();
     bool timerTick(u64 wall_time, u32 gc_id);
 
@@ -37,6 +44,9 @@ class FlightRecorder {
     void recordEvent(int lock_index, int tid, u32 call_trace_id,
                      EventType event_type, Event* event);
 
+    void recordUserEvents(int lock_index, int tid, const asprof_jfr_event* events, size_t count);
+    void bufferUserEvents(int tid, const asprof_jfr_event* events, size_t count);
+
     void recordLog(LogLevel level, const char* message, size_t len);
 };
 
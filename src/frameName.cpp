@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,10 @@
 #include "vmStructs.h"
 
 
+// Distinguishes native symbols from Java methods in the name cache
+const int NATIVE_NAME_KEY = 1 << 30;
+
+
 static inline bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
@@ -69,17 +74,140 @@ bool Matcher::matches(const char* s) {
 }
 
 
-JMethodCache FrameName::_cache;
+MatcherSet::MatcherSet() : _equals(), _prefixes(1), _suffixes(1), _contains(1), _size(0) {
+    _prefixes[0].terminal = false;
+    _suffixes[0].terminal = false;
+    _contains[0].terminal = false;
+}
+
+void MatcherSet::add(const Matcher& m) {
+    switch (m.type()) {
+        case MATCH_EQUALS:
+            _equals.push_back(m.pattern());
+            break;
+        case MATCH_STARTS_WITH:
+            insert(_prefixes, m.pattern(), m.length(), false);
+            break;
+        case MATCH_ENDS_WITH:
+            insert(_suffixes, m.pattern(), m.length(), true);
+            break;
+        case MATCH_CONTAINS:
+            insert(_contains, m.pattern(), m.length(), false);
+            break;
+    }
+    _size++;
+}
+
+void MatcherSet::build() {
+    std::sort(_equals.begin(), _equals.end());
+    linkFailures(_contains);
+}
+
+void MatcherSet::insert(std::vector<TrieNode>& trie, const char* pattern, int len, bool reverse) {
+    u32 node = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = pattern[reverse ? len - 1 - i : i];
+        std::map<unsigned char, u32>::const_iterator it = trie[node].next.find(c);
+        if (it != trie[node].next.end()) {
+            node = it->second;
+        } else {
+            u32 child = trie.size();
+            trie[node].next[c] = child;
+            TrieNode empty;
+            empty.fail = 0;
+            empty.terminal = false;
+            trie.push_back(empty);
+            node = child;
+        }
+    }
+    trie[node].terminal = true;
+}
+
+// Breadth-first, so that the failure link of a node is computed after those at smaller depth.
+// A node is terminal when any pattern ends at it or at a node on its failure chain.
+void MatcherSet::linkFailures(std::vector<TrieNode>& trie) {
+    std::vector<u32> queue;
+    for (std::map<unsigned char, u32>::const_iterator it = trie[0].next.begin(); it != trie[0].next.end(); ++it) {
+        trie[it->second].fail = 0;
+        queue.push_back(it->second);
+    }
+
+    for (size_t head = 0; head < queue.size(); head++) {
+        u32 node = queue[head];
+        for (std::map<unsigned char, u32>::const_iterator it = trie[node].next.begin(); it != trie[node].next.end(); ++it) {
+            u32 fail = trie[node].fail;
+            std::map<unsigned char, u32>::const_iterator link;
+            while ((link = trie[fail].next.find(it->first)) == trie[fail].next.end() && fail != 0) {
+                fail = trie[fail].fail;
+            }
+            u32 child = it->second;
+            trie[child].fail = link != trie[fail].next.end() ? link->second : 0;
+            trie[child].terminal |= trie[trie[child].fail].terminal;
+            queue.push_back(child);
+        }
+    }
+}
+
+bool MatcherSet::matches(const char* s) const {
+    if (!_equals.empty() && std::binary_search(_equals.begin(), _equals.end(), s)) {
+        return true;
+    }
+
+    if (_prefixes.size() > 1 || _prefixes[0].terminal) {
+        u32 node = 0;
+        for (const char* p = s; *p != 0 && !_prefixes[node].terminal; p++) {
+            std::map<unsigned char, u32>::const_iterator it = _prefixes[node].next.find(*p);
+            if (it == _prefixes[node].next.end()) break;
+            node = it->second;
+        }
+        if (_prefixes[node].terminal) return true;
+    }
+
+    size_t len = strlen(s);
+
+    if (_suffixes.size() > 1 || _suffixes[0].terminal) {
+        u32 node = 0;
+        for (size_t i = len; !_suffixes[node].terminal && i > 0; i--) {
+            std::map<unsigned char, u32>::const_iterator it = _suffixes[node].next.find(s[i - 1]);
+            if (it == _suffixes[node].next.end()) break;
+            node = it->second;
+        }
+        if (_suffixes[node].terminal) return true;
+    }
+
+    if (_contains.size() > 1 || _contains[0].terminal) {
+        u32 node = 0;
+        for (size_t i = 0; !_contains[node].terminal && i < len; i++) {
+            unsigned char c = s[i];
+            std::map<unsigned char, u32>::const_iterator it;
+            while ((it = _contains[node].next.find(c)) == _contains[node].next.end() && node != 0) {
+                node = _contains[node].fail;
+            }
+            if (it != _contains[node].next.end()) {
+                node = it->second;
+            }
+        }
+        if (_contains[node].terminal) return true;
+    }
+
+    return false;
+}
+
 
-FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names) :
+FrameNameCache FrameName::_cache;
+Mutex FrameName::_cache_lock;
+int FrameName::_cache_users = 0;
+
+FrameName::FrameName(Arguments& args, int style, int epoch, ThreadNames& thread_names) :
     _class_names(),
+    _thread_groups(),
     _include(),
     _exclude(),
+    _filter_cache(),
     _str(),
     _style(style),
     _cache_epoch((unsigned char)epoch),
     _cache_max_age(args._mcache),
-    _thread_names_lock(thread_names_lock),
     _thread_names(thread_names),
     _jni(VM::jni())
 {
@@ -90,18 +218,22 @@ FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_
     buildFilter(_exclude, args._buf, args._exclude);
 
     Profiler::instance()->classMap()->collect(_class_names);
+    Profiler::instance()->threadGroupMap()->collect(_thread_groups);
+
+    MutexLocker ml(_cache_lock);
+    _cache_users++;
 }
 
 FrameName::~FrameName() {
-    if (_cache_max_age == 0) {
-        _cache.clear();
-    } else {
-        // Remove stale methods from the cache, leave the fresh ones for the next profiling session
-        for (JMethodCache::iterator it = _cache.begin(); it != _cache.end(); ) {
-            if (_cache_epoch - (unsigned char)it->second[0] >= _cache_max_age) {
-                _cache.erase(it++);
+    {
+        MutexLocker ml(_cache_lock);
+        // Names returned by the cache remain valid while any FrameName is alive
+        if (--_cache_users == 0) {
+            if (_cache_max_age == 0) {
+                _cache.clear();
             } else {
-                ++it;
+                // Remove old names and methods of unloaded classes, leave the rest for the next dumps
+                _cache.prune(_cache_epoch, _cache_max_age, isStaleName);
             }
         }
     }
@@ -109,26 +241,32 @@ FrameName::~FrameName() {
     freelocale(uselocale(_saved_locale));
 }
 
-void FrameName::buildFilter(std::vector<Matcher>& vector, const char* base, int offset) {
+bool FrameName::isStaleName(const void* id, int style) {
+    if ((style & NATIVE_NAME_KEY) || !VMStructs::hasMethodStructs()) {
+        return false;
+    }
+    VMMethod* vm_method = VMMethod::fromMethodID((jmethodID)id);
+    return vm_method == NULL || vm_method->id() == NULL;
+}
+
+void FrameName::buildFilter(MatcherSet& set, const char* base, int offset) {
     while (offset != 0) {
-        vector.push_back(base + offset);
+        set.add(Matcher(base + offset));
         offset = ((int*)(base + offset))[-1];
     }
+    set.build();
 }
 
 const char* FrameName::decodeNativeSymbol(const char* name) {
     const char* lib_name = (_style & STYLE_LIB_NAMES) ? Profiler::instance()->getLibraryName(name) : NULL;
 
     if (Demangle::needsDemangling(name)) {
-        char* demangled = Demangle::demangle(name, _style & STYLE_SIGNATURES);
+        const char* demangled = Demangle::demangleNative(name, _style & STYLE_SIGNATURES);
         if (demangled != NULL) {
             if (lib_name != NULL) {
-                _str.assign(lib_name).append("`").append(demangled);
-            } else {
-                _str.assign(demangled);
+                return _str.assign(lib_name).append("`").append(demangled).c_str();
             }
-            free(demangled);
-            return _str.c_str();
+            return demangled;
         }
     }
 
@@ -139,6 +277,27 @@ const char* FrameName::decodeNativeSymbol(const char* name) {
     }
 }
 
+const char* FrameName::nativeName(const char* name) {
+    if (!(_style & STYLE_LIB_NAMES) && !Demangle::needsDemangling(name)) {
+        return name;
+    }
+
+    // Demangling and library lookup depend only on these style flags
+    int key_style = (_style & (STYLE_LIB_NAMES | STYLE_SIGNATURES)) | NATIVE_NAME_KEY;
+    const char* cached;
+    {
+        MutexLocker ml(_cache_lock);
+        cached = _cache.find(name, key_style, _cache_epoch);
+    }
+    if (cached != NULL) {
+        return cached;
+    }
+
+    const char* decoded = decodeNativeSymbol(name);
+    MutexLocker ml(_cache_lock);
+    return _cache.insert(name, key_style, _cache_epoch, decoded);
+}
+
 const char* FrameName::typeSuffix(FrameTypeId type) {
     if (_style & STYLE_ANNOTATE) {
         switch (type) {
@@ -160,6 +319,23 @@ void FrameName::javaMethodName(jmethodID method) {
             _str.assign("[stale_jmethodID]");
             return;
         }
+
+        // Fast path: read symbols directly, avoiding JVMTI calls and allocations
+        VMSymbol* class_name;
+        VMSymbol* method_name;
+        VMSymbol* method_sig;
+        if (VMStructs::hasMethodNames() && vm_method->symbols(&class_name, &method_name, &method_sig)) {
+            javaClassName(class_name->body(), class_name->length(), _style);
+            _str.append(".").append(method_name->body(), method_name->length());
+            if (_style & STYLE_SIGNATURES) {
+                size_t sig_start = _str.length();
+                _str.append(method_sig->body(), method_sig->length());
+                if (_style & STYLE_NO_SEMICOLON) {
+                    std::replace(_str.begin() + sig_start, _str.end(), ';', '|');
+                }
+            }
+            return;
+        }
     }
 
     jclass method_class = NULL;
@@ -261,12 +437,13 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
 
     switch (frame.bci) {
         case BCI_NATIVE_FRAME:
-            return decodeNativeSymbol((const char*)frame.method_id);
+            return nativeName((const char*)frame.method_id);
 
         case BCI_ALLOC:
         case BCI_ALLOC_OUTSIDE_TLAB:
         case BCI_LOCK:
-        case BCI_PARK: {
+        case BCI_PARK:
+        case BCI_DATA_OBJECT: {
             const char* symbol = _class_names[(uintptr_t)frame.method_id];
             javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED);
             if (!for_matching && !(_style & STYLE_DOTTED)) {
@@ -277,21 +454,43 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
 
         case BCI_THREAD_ID: {
             int tid = (int)(uintptr_t)frame.method_id;
-            MutexLocker ml(_thread_names_lock);
-            ThreadMap::iterator it = _thread_names.find(tid);
+            jlong java_thread_id;
+            const char* thread_name = _thread_names.get(tid, &java_thread_id);
             if (for_matching) {
-                return it != _thread_names.end() ? it->second.c_str() : "";
+                return thread_name != NULL ? thread_name : "";
             }
 
             char buf[32];
             snprintf(buf, sizeof(buf), "tid=%d]", tid);
-            if (it != _thread_names.end()) {
-                return _str.assign("[").append(it->second).append(" ").append(buf).c_str();
+            if (thread_name != NULL) {
+                return _str.assign("[").append(thread_name).append(" ").append(buf).c_str();
             } else {
                 return _str.assign("[").append(buf).c_str();
             }
         }
 
+        case BCI_VIRTUAL_THREAD: {
+            char buf[48];
+            snprintf(buf, sizeof(buf), "[vthread #%lld]", (long long)(uintptr_t)frame.method_id);
+            return for_matching ? _str.assign(buf + 1, strlen(buf) - 2).c_str() : _str.assign(buf).c_str();
+        }
+
+        case BCI_THREAD_GROUP: {
+            const char* group = _thread_groups[(uintptr_t)frame.method_id];
+            if (for_matching) {
+                return group;
+            }
+            return _str.assign("[").append(group).append("]").c_str();
+        }
+
+        case BCI_NATIVE_PC: {
+            const char* native_name = Profiler::instance()->resolveNativePC(frame.method_id);
+            if (native_name != NULL) {
+                return nativeName(native_name);
+            }
+            // Symbols are not loaded, fall back to the address
+        }
+
         case BCI_ADDRESS: {
             char buf[32];
             snprintf(buf, sizeof(buf), "%p", frame.method_id);
@@ -304,22 +503,23 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         default: {
             const char* type_suffix = typeSuffix(FrameType::decode(frame.bci));
 
-            JMethodCache::iterator it = _cache.lower_bound(frame.method_id);
-            if (it != _cache.end() && it->first == frame.method_id) {
-                it->second[0] = _cache_epoch;
-                const char* name = it->second.c_str() + 1;
-                if (type_suffix != NULL) {
-                    return _str.assign(name).append(type_suffix).c_str();
-                }
-                return name;
+            // The suffix is appended separately, so annotated and plain names share cache entries
+            int key_style = _style & ~STYLE_ANNOTATE;
+            const char* name;
+            {
+                MutexLocker ml(_cache_lock);
+                name = _cache.find(frame.method_id, key_style, _cache_epoch);
+            }
+            if (name == NULL) {
+                javaMethodName(frame.method_id);
+                MutexLocker ml(_cache_lock);
+                name = _cache.insert(frame.method_id, key_style, _cache_epoch, _str.c_str());
             }
 
-            javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, std::string(1, _cache_epoch) + _str));
             if (type_suffix != NULL) {
-                _str += type_suffix;
+                return _str.assign(name).append(type_suffix).c_str();
             }
-            return _str.c_str();
+            return name;
         }
     }
 }
@@ -330,9 +530,13 @@ FrameTypeId FrameName::type(ASGCT_CallFrame& frame) {
     }
 
     switch (frame.bci) {
+        case BCI_NATIVE_PC:
         case BCI_NATIVE_FRAME: {
-            const char* name = (const char*)frame.method_id;
-            if ((name[0] == '_' && name[1] == 'Z') ||
+            const char* name = frame.bci == BCI_NATIVE_FRAME ? (const char*)frame.method_id
+                                                             : Profiler::instance()->resolveNativePC(frame.method_id);
+            if (name == NULL) {
+                return FRAME_NATIVE;
+            } else if ((name[0] == '_' && name[1] == 'Z') ||
                 (name[0] == '_' && name[1] == 'R') ||
                 (name[0] == '+' && name[1] == '[') ||
                 (name[0] == '-' && name[1] == '[')) {
@@ -346,12 +550,15 @@ FrameTypeId FrameName::type(ASGCT_CallFrame& frame) {
         case BCI_ALLOC:
         case BCI_LOCK:
         case BCI_PARK:
+        case BCI_DATA_OBJECT:
             return FRAME_INLINED;
 
         case BCI_ALLOC_OUTSIDE_TLAB:
             return FRAME_KERNEL;
 
         case BCI_THREAD_ID:
+        case BCI_VIRTUAL_THREAD:
+        case BCI_THREAD_GROUP:
         case BCI_ADDRESS:
         case BCI_ERROR:
             return FRAME_NATIVE;
@@ -361,20 +568,16 @@ FrameTypeId FrameName::type(ASGCT_CallFrame& frame) {
     }
 }
 
-bool FrameName::include(const char* frame_name) {
-    for (int i = 0; i < _include.size(); i++) {
-        if (_include[i].matches(frame_name)) {
-            return true;
-        }
+int FrameName::filter(ASGCT_CallFrame& frame) {
+    std::pair<jmethodID, jint> key(frame.method_id, frame.bci);
+    std::map<std::pair<jmethodID, jint>, int>::const_iterator it = _filter_cache.find(key);
+    if (it != _filter_cache.end()) {
+        return it->second;
     }
-    return false;
-}
 
-bool FrameName::exclude(const char* frame_name) {
-    for (int i = 0; i < _exclude.size(); i++) {
-        if (_exclude[i].matches(frame_name)) {
-            return true;
-        }
-    }
-    return false;
+    const char* frame_name = name(frame, true);
+    int result = (_include.matches(frame_name) ? FILTER_INCLUDED : 0) |
+                 (_exclude.matches(frame_name) ? FILTER_EXCLUDED : 0);
+    _filter_cache[key] = result;
+    return result;
 }
@@ -12,7 +12,9 @@
 #include <vector>
 #include <string>
 #include "arguments.h"
+#include "frameNameCache.h"
 #include "mutex.h"
+#include "threadNames.h"
 #include "vmEntry.h"
 
 #ifdef __APPLE__
@@ -20,8 +22,6 @@
 #endif
 
 
-typedef std::map<jmethodID, std::string> JMethodCache;
-typedef std::map<int, std::string> ThreadMap;
 typedef std::map<unsigned int, const char*> ClassMap;
 
 
@@ -46,34 +46,84 @@ class Matcher {
     Matcher(const Matcher& m);
     Matcher& operator=(const Matcher& m);
 
+    MatchType type() const { return _type; }
+    const char* pattern() const { return _pattern; }
+    int length() const { return _len; }
+
     bool matches(const char* s);
 };
 
+// All include or exclude patterns compiled together, so that a frame name is scanned
+// once regardless of the number of patterns: exact names are found by binary search,
+// prefixes and suffixes by walking a trie from either end of the name,
+// and substrings by an Aho-Corasick automaton.
+class MatcherSet {
+  private:
+    struct TrieNode {
+        std::map<unsigned char, u32> next;
+        u32 fail;
+        bool terminal;
+    };
+
+    std::vector<std::string> _equals;
+    std::vector<TrieNode> _prefixes;
+    std::vector<TrieNode> _suffixes;
+    std::vector<TrieNode> _contains;
+    size_t _size;
+
+    static void insert(std::vector<TrieNode>& trie, const char* pattern, int len, bool reverse);
+    static void linkFailures(std::vector<TrieNode>& trie);
+
+  public:
+    MatcherSet();
+
+    bool empty() const { return _size == 0; }
+
+    void add(const Matcher& m);
+    // Must be called after the last add() and before matches()
+    void build();
+
+    bool matches(const char* s) const;
+};
+
+enum FilterResult {
+    FILTER_INCLUDED = 1,
+    FILTER_EXCLUDED = 2
+};
+
 
 class FrameName {
   private:
-    static JMethodCache _cache;
+    // Shared by FrameName instances of parallel dump workers; pruned when the last one is gone
+    static FrameNameCache _cache;
+    static Mutex _cache_lock;
+    static int _cache_users;
 
     JNIEnv* _jni;
     ClassMap _class_names;
-    std::vector<Matcher> _include;
-    std::vector<Matcher> _exclude;
+    ClassMap _thread_groups;
+    MatcherSet _include;
+    MatcherSet _exclude;
+    // Filter results per frame, since the same frames recur in many traces
+    std::map<std::pair<jmethodID, jint>, int> _filter_cache;
     std::string _str;
     int _style;
     unsigned char _cache_epoch;
     unsigned char _cache_max_age;
-    Mutex& _thread_names_lock;
-    ThreadMap& _thread_names;
+    ThreadNames& _thread_names;
     locale_t _saved_locale;
 
-    void buildFilter(std::vector<Matcher>& vector, const char* base, int offset);
+    static bool isStaleName(const void* id, int style);
+
+    void buildFilter(MatcherSet& set, const char* base, int offset);
+    const char* nativeName(const char* name);
     const char* decodeNativeSymbol(const char* name);
     const char* typeSuffix(FrameTypeId type);
     void javaMethodName(jmethodID method);
     void javaClassName(const char* symbol, size_t length, int style);
 
   public:
-    FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names);
+    FrameName(Arguments& args, int style, int epoch, ThreadNames& thread_names);
     ~FrameName();
 
     const char* name(ASGCT_CallFrame& frame, bool for_matching = false);
@@ -82,8 +132,11 @@ class FrameName {
     bool hasIncludeList() { return !_include.empty(); }
     bool hasExcludeList() { return !_exclude.empty(); }
 
-    bool include(const char* frame_name);
-    bool exclude(const char* frame_name);
+    bool include(const char* frame_name) { return _include.matches(frame_name); }
+    bool exclude(const char* frame_name) { return _exclude.matches(frame_name); }
+
+    // Combination of FilterResult flags for the frame name
+    int filter(ASGCT_CallFrame& frame);
 };
 
 #endif // _FRAMENAME_H
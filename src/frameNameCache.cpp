@@ -0,0 +1,114 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "frameNameCache.h"
+
+
+const u32 INITIAL_FRAME_NAME_CACHE_CAPACITY = 1024;
+
+
+FrameNameCache::FrameNameCache() : _capacity(INITIAL_FRAME_NAME_CACHE_CAPACITY), _size(0) {
+    _slots = (Slot*)calloc(_capacity, sizeof(Slot));
+}
+
+FrameNameCache::~FrameNameCache() {
+    clear();
+    free(_slots);
+}
+
+void FrameNameCache::rehash(u32 capacity) {
+    u32 old_capacity = _capacity;
+    Slot* old_slots = _slots;
+
+    _capacity = capacity;
+    _slots = (Slot*)calloc(_capacity, sizeof(Slot));
+
+    u32 mask = _capacity - 1;
+    for (u32 i = 0; i < old_capacity; i++) {
+        if (old_slots[i].name != NULL) {
+            u32 slot = hash(old_slots[i].id, old_slots[i].style) & mask;
+            while (_slots[slot].name != NULL) {
+                slot = (slot + 1) & mask;
+            }
+            _slots[slot] = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+const char* FrameNameCache::find(const void* id, int style, unsigned char epoch) {
+    u32 mask = _capacity - 1;
+    u32 slot = hash(id, style) & mask;
+    while (_slots[slot].name != NULL) {
+        if (_slots[slot].id == id && _slots[slot].style == style) {
+            _slots[slot].epoch = epoch;
+            return _slots[slot].name;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+const char* FrameNameCache::insert(const void* id, int style, unsigned char epoch, const char* name) {
+    // Keep load factor under 3/4
+    if ((_size + 1) * 4 > _capacity * 3) {
+        rehash(_capacity * 2);
+    }
+
+    u32 mask = _capacity - 1;
+    u32 slot = hash(id, style) & mask;
+    while (_slots[slot].name != NULL) {
+        if (_slots[slot].id == id && _slots[slot].style == style) {
+            _slots[slot].epoch = epoch;
+            return _slots[slot].name;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    _slots[slot].id = id;
+    _slots[slot].style = style;
+    _slots[slot].epoch = epoch;
+    _slots[slot].name = strdup(name);
+    _size++;
+    return _slots[slot].name;
+}
+
+void FrameNameCache::clear() {
+    for (u32 i = 0; i < _capacity; i++) {
+        free(_slots[i].name);
+    }
+    memset(_slots, 0, _capacity * sizeof(Slot));
+    _size = 0;
+}
+
+void FrameNameCache::prune(unsigned char epoch, unsigned char max_age, StaleCheck is_stale) {
+    u32 removed = 0;
+    for (u32 i = 0; i < _capacity; i++) {
+        Slot* s = &_slots[i];
+        if (s->name != NULL && ((unsigned char)(epoch - s->epoch) >= max_age || is_stale(s->id, s->style))) {
+            free(s->name);
+            s->name = NULL;
+            removed++;
+        }
+    }
+
+    if (removed > 0) {
+        // Removed slots may break probe sequences of the remaining ones
+        _size -= removed;
+        rehash(_capacity);
+    }
+}
+
+size_t FrameNameCache::usedMemory() {
+    size_t bytes = _capacity * sizeof(Slot);
+    for (u32 i = 0; i < _capacity; i++) {
+        if (_slots[i].name != NULL) {
+            bytes += strlen(_slots[i].name) + 1;
+        }
+    }
+    return bytes;
+}
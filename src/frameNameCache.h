@@ -0,0 +1,59 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _FRAMENAMECACHE_H
+#define _FRAMENAMECACHE_H
+
+#include <stddef.h>
+#include "arch.h"
+
+
+// Formatted frame names keyed by (frame id, style), kept across dumps.
+// Stored names are interned: a pointer returned by find() or insert() stays valid
+// until the entry is removed by clear() or prune(). Not thread safe.
+class FrameNameCache {
+  public:
+    // Tells if the name of the given frame can no longer be resolved, e.g. its class was unloaded
+    typedef bool (*StaleCheck)(const void* id, int style);
+
+  private:
+    struct Slot {
+        const void* id;
+        int style;
+        unsigned char epoch;
+        char* name;  // NULL marks an empty slot
+    };
+
+    Slot* _slots;
+    u32 _capacity;
+    u32 _size;
+
+    static u32 hash(const void* id, int style) {
+        u64 h = ((u64)(uintptr_t)id ^ (u64)style << 56) * 0x9e3779b97f4a7c15ULL;
+        return (u32)(h >> 32);
+    }
+
+    void rehash(u32 capacity);
+
+  public:
+    FrameNameCache();
+    ~FrameNameCache();
+
+    // Returns the cached name and marks it as used in the given epoch, or NULL
+    const char* find(const void* id, int style, unsigned char epoch);
+    const char* insert(const void* id, int style, unsigned char epoch, const char* name);
+
+    void clear();
+    // Removes names not used for max_age epochs and names that became stale
+    void prune(unsigned char epoch, unsigned char max_age, StaleCheck is_stale);
+
+    size_t size() const {
+        return _size;
+    }
+
+    size_t usedMemory();
+};
+
+#endif // _FRAMENAMECACHE_H
@@ -0,0 +1,80 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _GEOMETRICSAMPLER_H
+#define _GEOMETRICSAMPLER_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include "arch.h"
+
+
+const u32 SAMPLER_STATES = 1024;
+
+// Samples allocated bytes as a Poisson process: the distance between two samples
+// is exponentially distributed with the given mean, as in tcmalloc or JFR.
+// Unlike a shared byte counter crossing a threshold, every byte has the same chance
+// to be sampled, and the malloc path touches no shared atomic. The countdown is kept
+// per thread in a slot chosen by pthread_self(); threads that happen to share a slot
+// race on it without synchronization, which only blurs the sampling distance a bit.
+class GeometricSampler {
+  private:
+    struct State {
+        u64 bytes_left;
+        u64 random;
+        char padding[64 - 2 * sizeof(u64)];  // one cache line per state
+    };
+
+    State _states[SAMPLER_STATES];
+    double _interval;
+
+    static u64 nextRandom(u64& x) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    }
+
+    u64 nextDistance(State* s) {
+        // Uniform in (0, 1]
+        double u = ((nextRandom(s->random) >> 11) + 1) * (1.0 / (1ULL << 53));
+        double distance = -log(u) * _interval;
+        return distance < 1 ? 1 : (u64)distance;
+    }
+
+    State* current() {
+        u64 self = (u64)(uintptr_t)pthread_self();
+        return &_states[(u32)((self * 0x9e3779b97f4a7c15ULL) >> 40) & (SAMPLER_STATES - 1)];
+    }
+
+  public:
+    void init(u64 interval, u64 seed) {
+        _interval = (double)interval;
+        for (u32 i = 0; i < SAMPLER_STATES; i++) {
+            State* s = &_states[i];
+            s->random = (seed + i) * 0x9e3779b97f4a7c15ULL | 1;
+            s->bytes_left = nextDistance(s);
+        }
+    }
+
+    // Returns the number of bytes represented by the allocation if it is sampled, otherwise 0
+    u64 sample(size_t size) {
+        State* s = current();
+        u64 bytes_left = s->bytes_left;
+        if (size < bytes_left) {
+            s->bytes_left = bytes_left - size;
+            return 0;
+        }
+
+        s->bytes_left = nextDistance(s);
+
+        // An allocation of this size is sampled with probability 1 - exp(-size / interval)
+        double p = -expm1(-(double)size / _interval);
+        return p > 0 ? (u64)(size / p) : size;
+    }
+};
+
+#endif // _GEOMETRICSAMPLER_H
@@ -0,0 +1,101 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gzipWriter.h"
+
+
+const size_t GZIP_BUFFER_SIZE = 64 * 1024;
+
+// zlib constants
+const int Z_OK = 0;
+const int Z_STREAM_END = 1;
+const int Z_NO_FLUSH = 0;
+const int Z_FINISH = 4;
+const int Z_DEFAULT_COMPRESSION = -1;
+const int Z_DEFLATED = 8;
+const int Z_DEFAULT_STRATEGY = 0;
+// 15 bits of window, plus 16 to write gzip header and trailer instead of zlib ones
+const int GZIP_WINDOW_BITS = 15 + 16;
+
+typedef int (*deflateInit2_t)(ZStream* strm, int level, int method, int window_bits, int mem_level,
+                              int strategy, const char* version, int stream_size);
+typedef int (*deflate_t)(ZStream* strm, int flush);
+typedef int (*deflateEnd_t)(ZStream* strm);
+
+static deflateInit2_t _deflateInit2 = NULL;
+static deflate_t _deflate = NULL;
+static deflateEnd_t _deflateEnd = NULL;
+
+
+bool GzipWriter::available() {
+    if (_deflateEnd != NULL) {
+        return true;
+    }
+
+    void* lib = dlopen(ZLIB_NAME, RTLD_LAZY);
+    if (lib == NULL) {
+        return false;
+    }
+
+    _deflateInit2 = (deflateInit2_t)dlsym(lib, "deflateInit2_");
+    _deflate = (deflate_t)dlsym(lib, "deflate");
+    deflateEnd_t deflate_end = (deflateEnd_t)dlsym(lib, "deflateEnd");
+    if (_deflateInit2 == NULL || _deflate == NULL || deflate_end == NULL) {
+        dlclose(lib);
+        return false;
+    }
+
+    __atomic_store_n(&_deflateEnd, deflate_end, __ATOMIC_RELEASE);
+    return true;
+}
+
+GzipWriter::GzipWriter(Writer& out) : _out(out), _buf(NULL), _active(false) {
+    memset(&_stream, 0, sizeof(_stream));
+    if (available() && (_buf = (unsigned char*)malloc(GZIP_BUFFER_SIZE)) != NULL) {
+        // zlib only checks the major version and the structure size
+        _active = _deflateInit2(&_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                                Z_DEFAULT_STRATEGY, "1.2.11", sizeof(ZStream)) == Z_OK;
+    }
+}
+
+GzipWriter::~GzipWriter() {
+    if (_active) {
+        deflate(NULL, 0, Z_FINISH);
+        _deflateEnd(&_stream);
+    }
+    free(_buf);
+}
+
+void GzipWriter::deflate(const char* data, size_t len, int flush) {
+    _stream.next_in = (const unsigned char*)data;
+    _stream.avail_in = (unsigned int)len;
+
+    int result;
+    do {
+        _stream.next_out = _buf;
+        _stream.avail_out = GZIP_BUFFER_SIZE;
+        result = _deflate(&_stream, flush);
+        size_t bytes = GZIP_BUFFER_SIZE - _stream.avail_out;
+        if (bytes > 0) {
+            _out.write((const char*)_buf, bytes);
+        }
+    } while (_stream.avail_out == 0 || (flush == Z_FINISH && result == Z_OK));
+
+    if (!_out.good() || (result != Z_OK && result != Z_STREAM_END)) {
+        _err = EIO;
+    }
+}
+
+void GzipWriter::write(const char* data, size_t len) {
+    if (_active) {
+        deflate(data, len, Z_NO_FLUSH);
+    } else {
+        _out.write(data, len);
+    }
+}
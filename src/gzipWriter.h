@@ -0,0 +1,60 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _GZIPWRITER_H
+#define _GZIPWRITER_H
+
+#include "writer.h"
+
+#ifdef __APPLE__
+const char* const ZLIB_NAME = "libz.1.dylib";
+#else
+const char* const ZLIB_NAME = "libz.so.1";
+#endif
+
+
+// Layout of zlib's z_stream, which has been stable since zlib 1.0
+struct ZStream {
+    const unsigned char* next_in;
+    unsigned int avail_in;
+    unsigned long total_in;
+    unsigned char* next_out;
+    unsigned int avail_out;
+    unsigned long total_out;
+    const char* msg;
+    void* state;
+    void* zalloc;
+    void* zfree;
+    void* opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+};
+
+// Compresses everything written to it into a single gzip stream on top of another Writer.
+// zlib is loaded on demand; if it is not available, data is passed through uncompressed.
+class GzipWriter : public Writer {
+  private:
+    Writer& _out;
+    ZStream _stream;
+    unsigned char* _buf;
+    bool _active;
+
+    void deflate(const char* data, size_t len, int flush);
+
+  public:
+    GzipWriter(Writer& out);
+    ~GzipWriter();
+
+    static bool available();
+
+    bool active() const {
+        return _active;
+    }
+
+    virtual void write(const char* data, size_t len);
+};
+
+#endif // _GZIPWRITER_H
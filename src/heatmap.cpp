@@ -0,0 +1,437 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+#include "heatmap.h"
+#include "incbin.h"
+#include "os.h"
+#include "tsc.h"
+
+
+INCBIN(HEATMAP_TEMPLATE, "src/res/heatmap.html")
+
+// Frequent nodes are referenced by an index in a table of at most 61 * 61 synonyms,
+// i.e. take one or two characters instead of three or more
+const u32 MAX_HEATMAP_SYNONYMS = 61 * 61;
+
+// Block sizes are packed 27 bits at a time into 4 base-123 digits
+const int HUFFMAN_WORD_BITS = 27;
+
+
+void SampleTimeline::start(bool enabled, bool reset) {
+    if (reset || _start_nanos == 0) {
+        clear();
+        _start_nanos = TSC::nanos();
+        _start_millis = OS::micros() / 1000;
+    }
+    _enabled = enabled;
+}
+
+void SampleTimeline::clear() {
+    TimelinePage* page = _page;
+    while (page != NULL) {
+        TimelinePage* prev = page->prev;
+        OS::safeFree(page, sizeof(TimelinePage));
+        page = prev;
+    }
+    _page = NULL;
+    _dropped = 0;
+}
+
+void SampleTimeline::add(u32 call_trace_id) {
+    if (!_enabled || call_trace_id == 0) {
+        return;
+    }
+
+    u64 block = (TSC::nanos() - _start_nanos) / (HEATMAP_BLOCK_MS * 1000000);
+    u64 sample = block << 32 | call_trace_id;
+
+    while (true) {
+        TimelinePage* page = _page;
+        if (page != NULL) {
+            u32 slot = atomicInc(page->used);
+            if (slot < TIMELINE_PAGE_SAMPLES) {
+                page->samples[slot] = sample;
+                return;
+            }
+        }
+
+        TimelinePage* next = (TimelinePage*)OS::safeAlloc(sizeof(TimelinePage));
+        if (next == NULL) {
+            atomicInc(_dropped);
+            return;
+        }
+        next->prev = page;
+        next->used = 1;
+        next->samples[0] = sample;
+        if (__sync_bool_compare_and_swap(&_page, page, next)) {
+            return;
+        }
+        // Another thread has installed a new page in the meantime
+        OS::safeFree(next, sizeof(TimelinePage));
+    }
+}
+
+void SampleTimeline::collect(std::vector<u64>& samples) {
+    for (TimelinePage* page = _page; page != NULL; page = page->prev) {
+        u32 used = page->used < TIMELINE_PAGE_SAMPLES ? page->used : TIMELINE_PAGE_SAMPLES;
+        for (u32 i = 0; i < used; i++) {
+            // A slot may be claimed by a signal handler that has not written it yet
+            u64 sample = page->samples[i];
+            if (sample != 0) {
+                samples.push_back(sample);
+            }
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+}
+
+
+Heatmap::Heatmap() {
+    // Symbol 0 is the empty class name of every method; node 0 is the root of all stacks
+    _symbols.push_back("");
+    _symbol_index[""] = 0;
+    Node root = {0, 0};
+    _nodes.push_back(root);
+}
+
+u32 Heatmap::method(const char* name, FrameTypeId type) {
+    std::map<std::string, u32>::iterator it = _symbol_index.find(name);
+    u32 symbol;
+    if (it != _symbol_index.end()) {
+        symbol = it->second;
+    } else {
+        symbol = (u32)_symbols.size();
+        _symbols.push_back(name);
+        _symbol_index[name] = symbol;
+    }
+
+    u64 key = (u64)symbol << 8 | type;
+    std::map<u64, u32>::iterator mit = _method_index.find(key);
+    if (mit != _method_index.end()) {
+        return mit->second;
+    }
+
+    Method m = {symbol, (u32)type};
+    _methods.push_back(m);
+    u32 id = (u32)_methods.size();
+    _method_index[key] = id;
+    return id;
+}
+
+u32 Heatmap::child(u32 parent, u32 method) {
+    u64 key = (u64)method << 32 | parent;
+    std::map<u64, u32>::iterator it = _child_index.find(key);
+    if (it != _child_index.end()) {
+        return it->second;
+    }
+
+    Node node = {parent, method};
+    _nodes.push_back(node);
+    u32 id = (u32)_nodes.size() - 1;
+    _child_index[key] = id;
+    return id;
+}
+
+// Characters that HTML would alter are replaced in the same way the page reverts
+void Heatmap::nextByte(int c) {
+    switch (c) {
+        case 0:
+            c = 127;
+            break;
+        case '\r':
+            c = 126;
+            break;
+        case '&':
+            c = 125;
+            break;
+        case '<':
+            c = 124;
+            break;
+        case '>':
+            c = 123;
+            break;
+    }
+    _out += (char)c;
+}
+
+void Heatmap::writeVar(u64 v) {
+    while (v >= 61) {
+        nextByte(61 + (int)(v % 61));
+        v /= 61;
+    }
+    nextByte((int)v);
+}
+
+void Heatmap::write6(u32 v) {
+    nextByte(v & 0x3f);
+}
+
+void Heatmap::write18(u32 v) {
+    for (int i = 0; i < 3; i++) {
+        nextByte(v & 0x3f);
+        v >>= 6;
+    }
+}
+
+void Heatmap::write30(u32 v) {
+    for (int i = 0; i < 5; i++) {
+        nextByte(v & 0x3f);
+        v >>= 6;
+    }
+}
+
+// Canonical Huffman code of block sizes: the table lists (value, length) sorted by length,
+// followed by the codes of all blocks, the first bit in the lowest position of a 27-bit word
+void Heatmap::writeBlockSizes(const std::vector<u32>& block_sizes) {
+    std::map<u32, u64> frequencies;
+    for (size_t i = 0; i < block_sizes.size(); i++) {
+        frequencies[block_sizes[i]]++;
+    }
+
+    // Leaves come first, then internal nodes created by merging the two rarest ones
+    std::vector<u32> values;
+    std::vector<u32> parents;
+    std::priority_queue<std::pair<u64, u32>, std::vector<std::pair<u64, u32> >, std::greater<std::pair<u64, u32> > > heap;
+    for (std::map<u32, u64>::const_iterator it = frequencies.begin(); it != frequencies.end(); ++it) {
+        heap.push(std::make_pair(it->second, (u32)values.size()));
+        values.push_back(it->first);
+        parents.push_back(0);
+    }
+    while (heap.size() > 1) {
+        std::pair<u64, u32> left = heap.top();
+        heap.pop();
+        std::pair<u64, u32> right = heap.top();
+        heap.pop();
+        u32 node = (u32)parents.size();
+        parents[left.second] = node;
+        parents[right.second] = node;
+        parents.push_back(node);
+        heap.push(std::make_pair(left.first + right.first, node));
+    }
+
+    std::vector<u64> table;  // length << 56 | value
+    for (u32 i = 0; i < values.size(); i++) {
+        u64 length = 0;
+        for (u32 node = i; parents[node] != node; node = parents[node]) {
+            length++;
+        }
+        table.push_back(length << 56 | values[i]);
+    }
+    std::sort(table.begin(), table.end());
+
+    u32 max_bits = (u32)(table.back() >> 56);
+    writeVar(table.size());
+    writeVar(max_bits);
+
+    std::map<u32, u64> codes;  // value -> length << 56 | code
+    u64 code = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+        u64 length = table[i] >> 56;
+        if (i > 0) {
+            code = (code + 1) << (length - (table[i - 1] >> 56));
+        }
+        codes[(u32)table[i]] = length << 56 | code;
+        writeVar(table[i] & 0xffffffffffffffULL);
+        writeVar(length);
+    }
+
+    if (max_bits == 0) {
+        // The only block size is implied by the table
+        return;
+    }
+
+    u32 data = 0;
+    int bits = 0;
+    for (size_t i = 0; i <= block_sizes.size(); i++) {
+        int length;
+        u64 value;
+        if (i < block_sizes.size()) {
+            value = codes[block_sizes[i]];
+            length = (int)(value >> 56);
+        } else if (bits > 0) {
+            value = 0;
+            length = HUFFMAN_WORD_BITS - bits;
+        } else {
+            break;
+        }
+
+        for (int b = length; --b >= 0; ) {
+            data = data << 1 | (u32)(value >> b & 1);
+            if (++bits == HUFFMAN_WORD_BITS) {
+                u32 word = 0;
+                for (int k = 0; k < HUFFMAN_WORD_BITS; k++) {
+                    word = word << 1 | (data >> k & 1);
+                }
+                nextByte(word / (123 * 123 * 123));
+                nextByte(word / (123 * 123) % 123);
+                nextByte(word / 123 % 123);
+                nextByte(word % 123);
+                data = 0;
+                bits = 0;
+            }
+        }
+    }
+}
+
+// Most referenced nodes get the shortest synonyms; other nodes are written as synonyms count + node ID.
+// The page reads both tables into one array, so their size depends on the number of nodes only.
+void Heatmap::writeSynonyms(const std::vector<u32>& counts, std::vector<u32>& synonyms) {
+    std::vector<u64> order;
+    for (u32 node = 0; node < counts.size(); node++) {
+        order.push_back((u64)~counts[node] << 32 | node);
+    }
+    std::sort(order.begin(), order.end());
+
+    u32 count = order.size() < MAX_HEATMAP_SYNONYMS ? (u32)order.size() : MAX_HEATMAP_SYNONYMS;
+    synonyms.resize(counts.size());
+    for (u32 node = 0; node < counts.size(); node++) {
+        synonyms[node] = count + node;
+    }
+
+    writeVar(count);
+    for (u32 i = 0; i < count; i++) {
+        u32 node = (u32)order[i];
+        synonyms[node] = i;
+        writeVar(count + node);
+    }
+}
+
+void Heatmap::writeExecutions() {
+    u32 node_count = (u32)_nodes.size();
+
+    // Root frames mark the start of a sample
+    std::vector<u32> starts;
+    std::vector<bool> is_start(_methods.size() + 1);
+    for (u32 i = 1; i < node_count; i++) {
+        u32 method = _nodes[i].method;
+        if (_nodes[i].parent == 0 && !is_start[method]) {
+            is_start[method] = true;
+            starts.push_back(method);
+        }
+    }
+    writeVar(starts.size());
+    for (size_t i = 0; i < starts.size(); i++) {
+        writeVar(starts[i]);
+    }
+
+    u32 first_block = (u32)(_samples.front() >> 32);
+    u32 last_block = (u32)(_samples.back() >> 32);
+    std::vector<u32> block_sizes(last_block - first_block + 1);
+    for (size_t i = 0; i < _samples.size(); i++) {
+        block_sizes[(u32)(_samples[i] >> 32) - first_block]++;
+    }
+    writeBlockSizes(block_sizes);
+
+    // The page expands every leaf into the list of frames down to the root
+    std::vector<u32> children(node_count);
+    std::vector<u32> depth(node_count);
+    for (u32 i = 1; i < node_count; i++) {
+        children[_nodes[i].parent]++;
+        depth[i] = depth[_nodes[i].parent] + 1;
+    }
+    u64 storage_size = 0;
+    for (u32 i = 1; i < node_count; i++) {
+        if (children[i] == 0) {
+            storage_size += depth[i];
+        }
+    }
+
+    std::vector<u32> synonyms;
+    writeSynonyms(children, synonyms);
+    for (u32 i = 1; i < node_count; i++) {
+        writeVar(synonyms[_nodes[i].parent]);
+        writeVar(_nodes[i].method);
+    }
+
+    std::vector<u32> references(node_count);
+    for (size_t i = 0; i < _samples.size(); i++) {
+        references[(u32)_samples[i]]++;
+    }
+    writeSynonyms(references, synonyms);
+    for (size_t i = 0; i < _samples.size(); i++) {
+        writeVar(synonyms[(u32)_samples[i]]);
+    }
+
+    write30(node_count);
+    write30((u32)block_sizes.size());
+    write30((u32)storage_size);
+    write30((u32)_samples.size());
+    write30((u32)_samples.size());
+}
+
+void Heatmap::writeMethods() {
+    nextByte('A');
+    writeVar(_methods.size());
+    for (size_t i = 0; i < _methods.size(); i++) {
+        writeVar(0);
+        writeVar(_methods[i].name);
+        // No bci and line number: frame names already carry them when requested
+        write18(0xffff);
+        write18(0xffff);
+        write6(_methods[i].type);
+    }
+    nextByte('A');
+}
+
+void Heatmap::writeConstantPool() {
+    for (size_t i = 0; i < _symbols.size(); i++) {
+        _out += '"';
+        for (const char* s = _symbols[i].c_str(); *s != 0; s++) {
+            if (*s == '"' || *s == '\\') _out += '\\';
+            _out += *s;
+        }
+        _out += "\",";
+    }
+}
+
+static const char* printHeatmapTill(Writer& out, const char* data, const char* till) {
+    const char* pos = strstr(data, till);
+    out.write(data, pos - data);
+    return pos + strlen(till);
+}
+
+void Heatmap::dump(Writer& out, const char* title, u64 start_ms) {
+    if (_samples.empty()) {
+        out << "No samples found\n";
+        return;
+    }
+
+    std::sort(_samples.begin(), _samples.end());
+    start_ms += (_samples.front() >> 32) * HEATMAP_BLOCK_MS;
+
+    const char* tail = HEATMAP_TEMPLATE;
+
+    tail = printHeatmapTill(out, tail, "/*executionsHeatmap:*/");
+    _out = 'S';
+    writeExecutions();
+    _out += 'E';
+    out.write(_out.data(), _out.size());
+
+    tail = printHeatmapTill(out, tail, "/*methods:*/");
+    _out = 'S';
+    writeMethods();
+    _out += 'E';
+    out.write(_out.data(), _out.size());
+
+    tail = printHeatmapTill(out, tail, "/*title:*/");
+    out << (title == NULL ? "Heatmap" : title);
+
+    tail = printHeatmapTill(out, tail, "/*startMs:*/0");
+    char buf[32];
+    out.write(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long)start_ms));
+
+    tail = printHeatmapTill(out, tail, "/*cpool:*/");
+    _out.clear();
+    writeConstantPool();
+    out.write(_out.data(), _out.size());
+
+    out << tail;
+    _out.clear();
+}
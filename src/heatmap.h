@@ -0,0 +1,128 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HEATMAP_H
+#define _HEATMAP_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "arch.h"
+#include "vmEntry.h"
+#include "writer.h"
+
+
+// Duration of one heatmap square; heatmap.html assumes exactly 20 ms
+const u64 HEATMAP_BLOCK_MS = 20;
+
+const u32 TIMELINE_PAGE_SAMPLES = 128 * 1024 - 2;
+
+struct TimelinePage {
+    TimelinePage* prev;
+    volatile u32 used;
+    u32 _padding;
+    u64 samples[TIMELINE_PAGE_SAMPLES];  // block << 32 | call_trace_id
+};
+
+// Time-ordered log of samples for heatmap output: every recorded event appends its call trace
+// and the 20 ms block it falls in. Appending is lock-free and async signal safe, pages are
+// mmapped. Starting, clearing and freeing pages require all profiler locks.
+class SampleTimeline {
+  private:
+    TimelinePage* volatile _page;
+    bool _enabled;
+    u64 _start_nanos;
+    u64 _start_millis;
+    volatile u64 _dropped;
+
+  public:
+    SampleTimeline() : _page(NULL), _enabled(false), _start_nanos(0), _start_millis(0), _dropped(0) {
+    }
+
+    ~SampleTimeline() {
+        clear();
+    }
+
+    bool enabled() const {
+        return _enabled;
+    }
+
+    u64 startMillis() const {
+        return _start_millis;
+    }
+
+    u64 dropped() const {
+        return _dropped;
+    }
+
+    void start(bool enabled, bool reset);
+    void clear();
+
+    void add(u32 call_trace_id);
+
+    // Returns all complete samples sorted by time block
+    void collect(std::vector<u64>& samples);
+};
+
+// Encodes samples in the format of heatmap.html, which is also produced by the converter.
+// The converter splits stacks into LZ78 chunks; here every distinct stack is a node of a prefix tree,
+// and each sample is a single chunk referencing its node. The page decodes both the same way,
+// so the agent needs neither the JFR recording nor the second compression pass.
+class Heatmap {
+  private:
+    struct Node {
+        u32 parent;
+        u32 method;
+    };
+
+    struct Method {
+        u32 name;
+        u32 type;
+    };
+
+    std::vector<std::string> _symbols;
+    std::map<std::string, u32> _symbol_index;
+    std::vector<Method> _methods;
+    std::map<u64, u32> _method_index;
+    std::vector<Node> _nodes;
+    std::map<u64, u32> _child_index;
+    std::vector<u64> _samples;  // block << 32 | node
+
+    std::string _out;
+
+    void nextByte(int c);
+    void writeVar(u64 v);
+    void write6(u32 v);
+    void write18(u32 v);
+    void write30(u32 v);
+
+    void writeBlockSizes(const std::vector<u32>& block_sizes);
+    void writeSynonyms(const std::vector<u32>& counts, std::vector<u32>& synonyms);
+    void writeExecutions();
+    void writeMethods();
+    void writeConstantPool();
+
+  public:
+    Heatmap();
+
+    // Method IDs start from 1, 0 stands for the root
+    u32 method(const char* name, FrameTypeId type);
+
+    // Node IDs start from 1 as well, 0 is the root
+    u32 child(u32 parent, u32 method);
+
+    void addSample(u32 block, u32 node) {
+        _samples.push_back((u64)block << 32 | node);
+    }
+
+    size_t sampleCount() const {
+        return _samples.size();
+    }
+
+    // Samples must be added in the order of blocks
+    void dump(Writer& out, const char* title, u64 start_ms);
+};
+
+#endif // _HEATMAP_H
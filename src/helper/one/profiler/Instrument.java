@@ -13,5 +13,9 @@ public class Instrument {
     private Instrument() {
     }
 
-    public static native void recordSample();
+    public static native void recordSample(int method);
+
+    public static native void recordEntry();
+
+    public static native void recordExit(int method);
 }
@@ -93,8 +93,8 @@ static dlopen_t _orig_dlopen = NULL;
 static void* dlopen_hook_impl(const char* filename, int flags, bool patch) {
     Log::debug("dlopen: %s", filename);
     void* result = _orig_dlopen(filename, flags);
-    if (result != NULL && filename != NULL) {
-        Profiler::instance()->updateSymbols(false);
+    // Imports of the new libraries are patched by the calling thread, so parse them in place
+    if (result != NULL && filename != NULL && Profiler::instance()->updateSymbolsOnDlopen(patch)) {
         if (patch) {
             Hooks::patchLibraries();
         }
@@ -0,0 +1,36 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+#ifdef __linux__
+
+// Minimal HTTP endpoint for the server=ADDRESS option, served by a native thread.
+// GET /<command>?<options> runs the same command as execute() of the Java API,
+// e.g. /start?event=cpu&interval=1ms or /dump?collapsed&delta, and returns its output.
+// Unlike the Java helper built on com.sun.net.httpserver, it does not allocate on
+// the Java heap and also works in non-Java processes started with LD_PRELOAD.
+class HttpServer {
+  private:
+    static int _listener;
+
+    static void* threadEntry(void* unused);
+    static void serve(int fd, char* request);
+
+  public:
+    static bool start(const char* address);
+};
+
+#else
+
+class HttpServer {
+  public:
+    static bool start(const char* address) { return false; }
+};
+
+#endif // __linux__
+
+#endif // _HTTPSERVER_H
@@ -0,0 +1,331 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include "httpServer.h"
+#include "fdtransfer.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+#include "vmEntry.h"
+
+
+const size_t MAX_REQUEST_LENGTH = 8192;
+const size_t MAX_HTTP_CONNECTIONS = 16;
+const u64 HTTP_REQUEST_TIMEOUT_NS = 10000000000ULL;
+
+// The same set of commands as served by the Java helper
+static const char* const HTTP_COMMANDS[] = {
+    "start", "resume", "stop", "dump", "check", "status", "meminfo", "list", "version"
+};
+
+struct HttpConnection {
+    char* request;
+    size_t length;
+    u64 deadline;
+};
+
+int HttpServer::_listener = -1;
+
+// ADDRESS is either PORT or HOST:PORT
+static int bindHttpListener(const char* address) {
+    char host[256] = "";
+    const char* port = address;
+    const char* colon = strrchr(address, ':');
+    if (colon != NULL) {
+        size_t host_len = colon - address;
+        if (host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, address, host_len);
+        host[host_len] = 0;
+        port = colon + 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo* res;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+static bool sendHttpData(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t bytes = RESTARTABLE(send(fd, data, len, MSG_NOSIGNAL));
+        if (bytes <= 0) {
+            return false;
+        }
+        data += bytes;
+        len -= bytes;
+    }
+    return true;
+}
+
+static void sendHttpResponse(int fd, int code, const char* body, size_t length) {
+    const char* status = code == 200 ? "OK" :
+                         code == 400 ? "Bad Request" :
+                         code == 404 ? "Not Found" :
+                         code == 405 ? "Method Not Allowed" : "Internal Server Error";
+    const char* content_type = length >= 15 && strncmp(body, "<!DOCTYPE html>", 15) == 0
+        ? "text/html; charset=utf-8" : "text/plain";
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %llu\r\nConnection: close\r\n\r\n",
+                              code, status, content_type, (unsigned long long)length);
+
+    if (!sendHttpData(fd, header, header_len) || !sendHttpData(fd, body, length)) {
+        Log::debug("HTTP server send(): %s", strerror(errno));
+    }
+}
+
+static void sendHttpResponse(int fd, int code, const char* message) {
+    sendHttpResponse(fd, code, message, strlen(message));
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Query parameters become comma separated options, e.g. ?event=cpu&file=%2Ftmp%2Fout.jfr
+static void appendQuery(std::string& command, const char* query) {
+    for (const char* p = query; *p != 0; p++) {
+        int hi, lo;
+        if (*p == '&') {
+            command += ',';
+        } else if (*p == '%' && (hi = hexDigit(p[1])) >= 0 && (lo = hexDigit(p[2])) >= 0) {
+            command += (char)(hi << 4 | lo);
+            p += 2;
+        } else {
+            command += *p;
+        }
+    }
+}
+
+bool HttpServer::start(const char* address) {
+    if (_listener != -1) {
+        return true;
+    }
+
+    int fd = bindHttpListener(address);
+    if (fd == -1) {
+        Log::warn("HTTP server %s: %s", address, strerror(errno));
+        return false;
+    }
+
+    _listener = fd;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, threadEntry, NULL) != 0) {
+        Log::warn("Could not start HTTP server thread");
+        _listener = -1;
+        close(fd);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void* HttpServer::threadEntry(void* unused) {
+    // Commands may need JNI, e.g. to resolve class names
+    bool attached = VM::loaded() && VM::attachThread("Async-profiler Server") != NULL;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = _listener;
+    if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, _listener, &ev) != 0) {
+        Log::warn("HTTP server epoll: %s", strerror(errno));
+        if (attached) VM::detachThread();
+        return NULL;
+    }
+
+    // Requests are read without blocking from many clients; commands run one at a time
+    std::map<int, HttpConnection> connections;
+    struct epoll_event events[16];
+
+    while (true) {
+        int count = epoll_wait(epfd, events, 16, 1000);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            Log::warn("HTTP server epoll_wait(): %s", strerror(errno));
+            break;
+        }
+
+        u64 now = OS::nanotime();
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == _listener) {
+                int client;
+                while ((client = accept4(_listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    if (connections.size() >= MAX_HTTP_CONNECTIONS || epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) != 0) {
+                        close(client);
+                        continue;
+                    }
+                    HttpConnection conn = {new char[MAX_REQUEST_LENGTH + 1], 0, now + HTTP_REQUEST_TIMEOUT_NS};
+                    connections[client] = conn;
+                }
+                continue;
+            }
+
+            std::map<int, HttpConnection>::iterator it = connections.find(fd);
+            if (it == connections.end()) {
+                continue;
+            }
+
+            HttpConnection& conn = it->second;
+            ssize_t bytes = recv(fd, conn.request + conn.length, MAX_REQUEST_LENGTH - conn.length, 0);
+            if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+
+            if (bytes > 0) {
+                conn.length += bytes;
+                conn.request[conn.length] = 0;
+                if (strstr(conn.request, "\r\n\r\n") == NULL && strstr(conn.request, "\n\n") == NULL) {
+                    if (conn.length < MAX_REQUEST_LENGTH) continue;
+                    sendHttpResponse(fd, 400, "Request too long");
+                } else {
+                    serve(fd, conn.request);
+                }
+            }
+
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            close(fd);
+            delete[] conn.request;
+            connections.erase(it);
+        }
+
+        // Drop clients that never complete their request
+        for (std::map<int, HttpConnection>::iterator it = connections.begin(); it != connections.end(); ) {
+            if (it->second.deadline < now) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, it->first, NULL);
+                close(it->first);
+                delete[] it->second.request;
+                connections.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    close(epfd);
+    if (attached) VM::detachThread();
+    return NULL;
+}
+
+void HttpServer::serve(int fd, char* request) {
+    // The response is written with a blocking send bounded by a timeout
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    struct timeval tv = {10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (strncmp(request, "GET /", 5) != 0) {
+        sendHttpResponse(fd, 405, "Only GET requests are supported");
+        return;
+    }
+
+    char* path = request + 5;
+    path[strcspn(path, " \r\n")] = 0;
+    char* query = strchr(path, '?');
+    if (query != NULL) {
+        *query++ = 0;
+    }
+
+    if (*path == 0) {
+        sendHttpResponse(fd, 200, "Async-profiler server");
+        return;
+    }
+
+    bool known = false;
+    for (size_t i = 0; i < sizeof(HTTP_COMMANDS) / sizeof(HTTP_COMMANDS[0]); i++) {
+        if (strncmp(path, HTTP_COMMANDS[i], strlen(HTTP_COMMANDS[i])) == 0) {
+            known = true;
+            break;
+        }
+    }
+    if (!known) {
+        sendHttpResponse(fd, 404, "Unknown command");
+        return;
+    }
+
+    std::string command(path);
+    if (query != NULL) {
+        command += ',';
+        appendQuery(command, query);
+    }
+
+    Arguments args;
+    Error error = args.parse(command.c_str());
+    if (error) {
+        sendHttpResponse(fd, 400, error.message());
+        return;
+    }
+
+    Log::open(args);
+
+    if (!args.hasOutputFile()) {
+        BufferWriter out;
+        error = Profiler::instance()->runInternal(args, out);
+        if (!error) {
+            sendHttpResponse(fd, 200, out.buf(), out.size());
+            return;
+        }
+    } else {
+        FileWriter out(args.file());
+        if (!out.is_open()) {
+            sendHttpResponse(fd, 500, strerror(errno));
+            return;
+        }
+        error = Profiler::instance()->runInternal(args, out);
+        if (!error) {
+            sendHttpResponse(fd, 200, "OK");
+            return;
+        }
+    }
+
+    sendHttpResponse(fd, 500, error.message());
+}
+
+#endif // __linux__
@@ -4,10 +4,14 @@
  */
 
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "arch.h"
 #include "incbin.h"
+#include "latencyHistogram.h"
+#include "mutex.h"
 #include "profiler.h"
 #include "tsc.h"
 #include "vmEntry.h"
@@ -84,16 +88,14 @@ class Constant {
         }
     }
 
+    const char* utf8() {
+        return (const char*)_info + 2;
+    }
+
     bool equals(const char* value, u16 len) {
         return _tag == CONSTANT_Utf8 && info() == len && memcmp(_info + 2, value, len) == 0;
     }
 
-    bool matches(const char* value, u16 len) {
-        if (len > 0 && value[len - 1] == '*') {
-            return _tag == CONSTANT_Utf8 && info() >= len - 1 && memcmp(_info + 2, value, len - 1) == 0;
-        }
-        return equals(value, len);
-    }
 };
 
 enum Scope {
@@ -105,11 +107,135 @@ enum Scope {
 };
 
 enum PatchConstants {
-    EXTRA_CONSTANTS = 6,
-    EXTRA_BYTECODES = 4,
+    EXTRA_CONSTANTS = 16,
+    EXTRA_BYTECODES = 8,
     EXTRA_STACKMAPS = 1
 };
 
+// Offsets of the appended constants from the original constant pool length
+enum ExtraConstant {
+    EXTRA_RECORD_SAMPLE = 0,
+    EXTRA_INSTRUMENT_CLASS = 1,
+    EXTRA_RECORD_ENTRY = 6,
+    EXTRA_RECORD_EXIT = 9,
+    EXTRA_THROWABLE_CLASS = 13,
+    EXTRA_STACK_MAP_TABLE = 15
+};
+
+// In latency mode, every return is preceded by a call to recordExit;
+// nops pad the inserted code to keep tableswitch/lookupswitch alignment
+enum LatencyPatch {
+    ENTRY_BYTECODES = 4,
+    EXIT_BYTECODES = 8,
+    HANDLER_BYTECODES = 7
+};
+
+
+struct InstrumentedMethod {
+    char* name;
+    volatile u64 calls;
+    LatencyHistogram* histogram;
+};
+
+const int MAX_INSTRUMENTED_METHODS = 1024;
+const int MAX_LATENCY_DEPTH = 64;
+
+// Instrumented methods are identified by the index in this table, which is passed
+// as a constant to recordSample or recordExit. The table only grows, so that
+// the code of methods instrumented in a previous session keeps valid ids.
+static InstrumentedMethod instrumented_methods[MAX_INSTRUMENTED_METHODS];
+static volatile int instrumented_method_count = 0;
+static Mutex instrumented_methods_lock;
+
+// Start times of the instrumented methods being executed by the current thread
+struct LatencyFrames {
+    int depth;
+    u64 start[MAX_LATENCY_DEPTH];
+};
+
+static pthread_key_t latency_frames_key;
+
+// Histograms take several KB, hence they are allocated only for methods timed in latency mode
+static bool allocateHistogram(InstrumentedMethod* method) {
+    if (method->histogram == NULL) {
+        LatencyHistogram* histogram = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+        if (histogram == NULL) {
+            return false;
+        }
+        __sync_synchronize();
+        method->histogram = histogram;
+    }
+    return true;
+}
+
+static int registerInstrumentedMethod(const char* name, bool latency) {
+    MutexLocker ml(instrumented_methods_lock);
+
+    int count = instrumented_method_count;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(instrumented_methods[i].name, name) == 0) {
+            return !latency || allocateHistogram(&instrumented_methods[i]) ? i : -1;
+        }
+    }
+
+    if (count >= MAX_INSTRUMENTED_METHODS) {
+        return -1;
+    }
+
+    InstrumentedMethod* method = &instrumented_methods[count];
+    if ((method->name = strdup(name)) == NULL || (latency && !allocateHistogram(method))) {
+        free(method->name);
+        method->name = NULL;
+        return -1;
+    }
+
+    __sync_synchronize();
+    instrumented_method_count = count + 1;
+    return count;
+}
+
+// Length of the bytecode instruction at the given offset, or 0 if the opcode is unknown
+static int bytecodeLength(const u8* code, u32 pc) {
+    u8 opcode = code[pc];
+    if (opcode <= 0x0f || (opcode >= 0x1a && opcode <= 0x35) || (opcode >= 0x3b && opcode <= 0x83) ||
+        (opcode >= 0x85 && opcode <= 0x98) || (opcode >= 0xac && opcode <= 0xb1) ||
+        opcode == 0xbe || opcode == 0xbf || opcode == 0xc2 || opcode == 0xc3) {
+        return 1;
+    }
+
+    switch (opcode) {
+        case 0x10: case 0x12: case 0x15: case 0x16: case 0x17: case 0x18: case 0x19:
+        case 0x36: case 0x37: case 0x38: case 0x39: case 0x3a: case 0xa9: case 0xbc:
+            return 2;
+        case 0xb9: case 0xba: case 0xc8: case 0xc9:
+            return 5;
+        case 0xc5:
+            return 4;
+        case 0xc4:
+            // wide
+            return code[pc + 1] == 0x84 ? 6 : 4;
+        case 0xaa: {
+            // tableswitch
+            u32 base = (pc + 4) & ~3;
+            int low = (int)ntohl(*(u32*)(code + base + 4));
+            int high = (int)ntohl(*(u32*)(code + base + 8));
+            return high < low ? 0 : base - pc + 12 + (high - low + 1) * 4;
+        }
+        case 0xab: {
+            // lookupswitch
+            u32 base = (pc + 4) & ~3;
+            int npairs = (int)ntohl(*(u32*)(code + base + 4));
+            return npairs < 0 ? 0 : base - pc + 8 + npairs * 8;
+        }
+        default:
+            if (opcode <= 0xc7) {
+                // sipush, ldc_w, ldc2_w, iinc, branches, field and method access, new, etc.
+                return 3;
+            }
+            return 0;
+    }
+}
+
 
 class BytecodeRewriter {
   private:
@@ -123,12 +249,15 @@ class BytecodeRewriter {
     Constant** _cpool;
     u16 _cpool_len;
 
-    const char* _target_class;
-    u16 _target_class_len;
-    const char* _target_method;
-    u16 _target_method_len;
-    const char* _target_signature;
-    u16 _target_signature_len;
+    Constant* _class_name;
+    u64 _class_targets;
+
+    bool _latency;
+    u16 _major_version;
+    u16 _method_id;
+    u32* _pc_map;
+    u32 _code_length;
+    bool _stack_map_found;
 
     // Reader
 
@@ -219,6 +348,48 @@ class BytecodeRewriter {
         put16(ref2);
     }
 
+    // Latency mode
+
+    u32 mapPc(u32 pc) {
+        if (_pc_map == NULL) {
+            return EXTRA_BYTECODES + pc;
+        }
+        return pc <= _code_length ? _pc_map[pc] : pc + _pc_map[_code_length] - _code_length;
+    }
+
+    bool mapBranch(u32 pc, int offset, int* new_offset) {
+        u32 target = pc + offset;
+        if (target >= _code_length) {
+            return false;
+        }
+        *new_offset = (int)(_pc_map[target] - _pc_map[pc]);
+        return true;
+    }
+
+    void putRecordExit() {
+        // sipush method_id; invokestatic "one/profiler/Instrument.recordExit(I)V"
+        put8(0x11);
+        put16(_method_id);
+        put8(0xb8);
+        put16(_cpool_len + EXTRA_RECORD_EXIT);
+    }
+
+    void putHandlerFrame(u16 offset_delta) {
+        // full_frame with no locals and java/lang/Throwable on the stack
+        put8(255);
+        put16(offset_delta);
+        put16(0);
+        put16(1);
+        put8(7);
+        put16(_cpool_len + EXTRA_THROWABLE_CLASS);
+    }
+
+    bool registerMethod(Constant* name, Constant* signature);
+    bool buildPcMap(const u8* code, u32 code_length);
+    bool rewriteLatencyCodeAttribute();
+    void rewriteLatencyCode();
+    void rewriteLatencyStackMapTable();
+
     // BytecodeRewriter
 
     void rewriteCode();
@@ -230,29 +401,25 @@ class BytecodeRewriter {
     bool rewriteClass();
 
   public:
-    BytecodeRewriter(const u8* class_data, int class_data_len, const char* target_class) :
+    BytecodeRewriter(const u8* class_data, int class_data_len, bool latency) :
         _src(class_data),
         _src_limit(class_data + class_data_len),
         _dst(NULL),
         _dst_len(0),
         _dst_capacity(class_data_len + 400),
-        _cpool(NULL) {
-
-        _target_class = target_class;
-        _target_class_len = strlen(_target_class);
-
-        _target_method = _target_class + _target_class_len + 1;
-        _target_signature = strchr(_target_method, '(');
-
-        if (_target_signature == NULL) {
-            _target_method_len = strlen(_target_method);
-        } else {
-            _target_method_len = _target_signature - _target_method;
-            _target_signature_len = strlen(_target_signature);
-        }
+        _cpool(NULL),
+        _class_name(NULL),
+        _class_targets(0),
+        _latency(latency),
+        _major_version(0),
+        _method_id(0),
+        _pc_map(NULL),
+        _code_length(0),
+        _stack_map_found(false) {
     }
 
     ~BytecodeRewriter() {
+        delete[] _pc_map;
         delete[] _cpool;
     }
 
@@ -269,14 +436,286 @@ class BytecodeRewriter {
 };
 
 
+bool BytecodeRewriter::registerMethod(Constant* name, Constant* signature) {
+    // Constructors and static initializers are not wrapped
+    if (_latency && name->info() > 0 && name->utf8()[0] == '<') {
+        return false;
+    }
+
+    char buf[1024];
+    int class_name_len = _class_name->info();
+    snprintf(buf, sizeof(buf), "%.*s.%.*s%.*s", class_name_len, _class_name->utf8(),
+             name->info(), name->utf8(), signature->info(), signature->utf8());
+    for (int i = 0; i < class_name_len && buf[i] != 0; i++) {
+        if (buf[i] == '/') buf[i] = '.';
+    }
+
+    int id = registerInstrumentedMethod(buf, _latency);
+    if (id < 0) {
+        return false;
+    }
+    _method_id = (u16)id;
+    return true;
+}
+
+bool BytecodeRewriter::buildPcMap(const u8* code, u32 code_length) {
+    delete[] _pc_map;
+    _pc_map = new u32[code_length + 1];
+    _code_length = code_length;
+
+    u32 shift = ENTRY_BYTECODES;
+    for (u32 pc = 0; pc < code_length; ) {
+        int len = bytecodeLength(code, pc);
+        if (len == 0 || pc + len > code_length) {
+            return false;
+        }
+        for (int i = 0; i < len; i++) {
+            _pc_map[pc + i] = pc + i + shift;
+        }
+        if (code[pc] >= 0xac && code[pc] <= 0xb1) {
+            // Branches to a return land on the inserted recordExit call
+            shift += EXIT_BYTECODES;
+        }
+        pc += len;
+    }
+
+    _pc_map[code_length] = code_length + shift;
+    return true;
+}
+
+// The method is wrapped with calls to recordEntry() at the start and recordExit(id)
+// before every return and in a catch-all handler, appended to the code, that rethrows.
+// Unlike the single call inserted by rewriteCode, this shifts the original bytecodes,
+// so branches and all tables referring to bytecode offsets are remapped.
+bool BytecodeRewriter::rewriteLatencyCodeAttribute() {
+    u32 attribute_length = get32();
+    put32(attribute_length);
+
+    int code_begin = _dst_len;
+
+    // recordExit needs one more stack slot: above the return value or the exception
+    u16 max_stack = get16();
+    put16(max_stack < 1 ? 2 : max_stack + 1);
+
+    u16 max_locals = get16();
+    put16(max_locals);
+
+    u32 code_length = get32();
+    const u8* code = get(code_length);
+    if (code == NULL || !buildPcMap(code, code_length)) {
+        return false;
+    }
+
+    u32 handler_pc = _pc_map[code_length];
+    if (handler_pc + HANDLER_BYTECODES > 65535) {
+        return false;
+    }
+    put32(handler_pc + HANDLER_BYTECODES);
+
+    // invokestatic "one/profiler/Instrument.recordEntry()V"; nop
+    put8(0xb8);
+    put16(_cpool_len + EXTRA_RECORD_ENTRY);
+    put8(0);
+
+    for (u32 pc = 0; pc < code_length; ) {
+        u8 opcode = code[pc];
+        int len = bytecodeLength(code, pc);
+        int offset;
+
+        if (opcode >= 0xac && opcode <= 0xb1) {
+            // recordExit(id); nop; nop; return
+            putRecordExit();
+            put8(0);
+            put8(0);
+            put8(opcode);
+        } else if ((opcode >= 0x99 && opcode <= 0xa8) || opcode == 0xc6 || opcode == 0xc7) {
+            if (!mapBranch(pc, (short)ntohs(*(u16*)(code + pc + 1)), &offset) || offset < -32768 || offset > 32767) {
+                return false;
+            }
+            put8(opcode);
+            put16((u16)offset);
+        } else if (opcode == 0xc8 || opcode == 0xc9) {
+            if (!mapBranch(pc, (int)ntohl(*(u32*)(code + pc + 1)), &offset)) {
+                return false;
+            }
+            put8(opcode);
+            put32((u32)offset);
+        } else if (opcode == 0xaa || opcode == 0xab) {
+            // Inserted code is a multiple of 4 bytes, so the padding stays the same
+            u32 base = (pc + 4) & ~3;
+            put(code + pc, base - pc);
+            if (!mapBranch(pc, (int)ntohl(*(u32*)(code + base)), &offset)) {
+                return false;
+            }
+            put32((u32)offset);
+
+            u32 step = opcode == 0xaa ? 4 : 8;
+            u32 first = opcode == 0xaa ? base + 12 : base + 8;
+            put(code + base + 4, first - base - 4);
+            for (u32 p = first; p < pc + len; p += step) {
+                if (step == 8) {
+                    put(code + p, 4);
+                }
+                if (!mapBranch(pc, (int)ntohl(*(u32*)(code + p + step - 4)), &offset)) {
+                    return false;
+                }
+                put32((u32)offset);
+            }
+        } else {
+            put(code + pc, len);
+        }
+
+        pc += len;
+    }
+
+    // Catch-all handler: recordExit(id); athrow
+    putRecordExit();
+    put8(0xbf);
+
+    u16 exception_table_length = get16();
+    put16(exception_table_length + 1);
+
+    for (int i = 0; i < exception_table_length; i++) {
+        u16 start_pc = get16();
+        u16 end_pc = get16();
+        u16 handler = get16();
+        u16 catch_type = get16();
+        if (start_pc > code_length || end_pc > code_length || handler >= code_length) {
+            return false;
+        }
+        put16(_pc_map[start_pc]);
+        put16(_pc_map[end_pc]);
+        put16(_pc_map[handler]);
+        put16(catch_type);
+    }
+
+    // The last entry has the lowest priority, so the original handlers take precedence
+    put16(ENTRY_BYTECODES);
+    put16(handler_pc);
+    put16(handler_pc);
+    put16(0);
+
+    int attributes_begin = _dst_len;
+    _stack_map_found = false;
+    rewriteAttributes(SCOPE_REWRITE_CODE);
+
+    if (!_stack_map_found && _major_version >= 50) {
+        // The handler needs a stack map frame even if the method had none
+        u16 attributes_count = ntohs(*(u16*)(_dst + attributes_begin));
+        *(u16*)(_dst + attributes_begin) = htons(attributes_count + 1);
+
+        put16(_cpool_len + EXTRA_STACK_MAP_TABLE);
+        put32(12);
+        put16(1);
+        putHandlerFrame(handler_pc);
+    }
+
+    // Patch attribute length
+    *(u32*)(_dst + code_begin - 4) = htonl(_dst_len - code_begin);
+    return true;
+}
+
+void BytecodeRewriter::rewriteLatencyCode() {
+    const u8* src_begin = _src;
+    int dst_begin = _dst_len;
+
+    if (!rewriteLatencyCodeAttribute()) {
+        // The method cannot be wrapped (too large or unknown bytecodes): leave it intact
+        _src = src_begin;
+        _dst_len = dst_begin;
+        u32 attribute_length = get32();
+        put32(attribute_length);
+        put(get(attribute_length), attribute_length);
+    }
+
+    delete[] _pc_map;
+    _pc_map = NULL;
+}
+
+void BytecodeRewriter::rewriteLatencyStackMapTable() {
+    _stack_map_found = true;
+
+    u32 attribute_length = get32();
+    put32(attribute_length);
+
+    int table_begin = _dst_len;
+
+    u16 number_of_entries = get16();
+    put16(number_of_entries + EXTRA_STACKMAPS);
+
+    // Frame offsets are delta encoded; decode and encode them again with the new offsets
+    u32 offset = (u32)-1;
+    u32 new_offset = (u32)-1;
+
+    for (int i = 0; i < number_of_entries; i++) {
+        u8 frame_type = get8();
+        u32 delta = frame_type <= 63 ? frame_type : frame_type <= 127 ? frame_type - 64 : get16();
+
+        offset += delta + 1;
+        u32 mapped = mapPc(offset);
+        u16 new_delta = (u16)(mapped - new_offset - 1);
+        new_offset = mapped;
+
+        if (frame_type <= 63) {
+            // same_frame, becomes same_frame_extended if the offset does not fit
+            if (new_delta <= 63) {
+                put8(new_delta);
+            } else {
+                put8(251);
+                put16(new_delta);
+            }
+        } else if (frame_type <= 127) {
+            // same_locals_1_stack_item_frame, may become extended
+            if (new_delta <= 63) {
+                put8(64 + new_delta);
+            } else {
+                put8(247);
+                put16(new_delta);
+            }
+            rewriteVerificationTypeInfo();
+        } else {
+            put8(frame_type);
+            put16(new_delta);
+
+            if (frame_type == 247) {
+                // same_locals_1_stack_item_frame_extended
+                rewriteVerificationTypeInfo();
+            } else if (frame_type >= 252 && frame_type <= 254) {
+                // append_frame
+                for (int j = 0; j < frame_type - 251; j++) {
+                    rewriteVerificationTypeInfo();
+                }
+            } else if (frame_type == 255) {
+                // full_frame
+                u16 number_of_locals = get16();
+                put16(number_of_locals);
+                for (int j = 0; j < number_of_locals; j++) {
+                    rewriteVerificationTypeInfo();
+                }
+                u16 number_of_stack_items = get16();
+                put16(number_of_stack_items);
+                for (int j = 0; j < number_of_stack_items; j++) {
+                    rewriteVerificationTypeInfo();
+                }
+            }
+        }
+    }
+
+    putHandlerFrame(_pc_map[_code_length] - new_offset - 1);
+
+    // Patch attribute length
+    *(u32*)(_dst + table_begin - 4) = htonl(_dst_len - table_begin);
+}
+
 void BytecodeRewriter::rewriteCode() {
     u32 attribute_length = get32();
     put32(attribute_length);
 
     int code_begin = _dst_len;
 
+    // sipush needs a stack slot even in an empty method
     u16 max_stack = get16();
-    put16(max_stack);
+    put16(max_stack < 1 ? 1 : max_stack);
 
     u16 max_locals = get16();
     put16(max_locals);
@@ -284,10 +723,13 @@ void BytecodeRewriter::rewriteCode() {
     u32 code_length = get32();
     put32(code_length + EXTRA_BYTECODES);
 
-    // invokestatic "one/profiler/Instrument.recordSample()V"
-    // nop ensures that tableswitch/lookupswitch needs no realignment
+    // sipush method_id; invokestatic "one/profiler/Instrument.recordSample(I)V"
+    // nops ensure that tableswitch/lookupswitch needs no realignment
+    put8(0x11);
+    put16(_method_id);
     put8(0xb8);
-    put16(_cpool_len);
+    put16(_cpool_len + EXTRA_RECORD_SAMPLE);
+    put8(0);
     put8(0);
     // The rest of the code is unchanged
     put(get(code_length), code_length);
@@ -321,9 +763,16 @@ void BytecodeRewriter::rewriteBytecodeTable(int data_len) {
 
     for (int i = 0; i < table_length; i++) {
         u16 start_pc = get16();
-        put16(EXTRA_BYTECODES + start_pc);
+        put16(mapPc(start_pc));
 
-        put(get(data_len), data_len);
+        if (data_len == 8) {
+            // LocalVariableTable: the range may span inserted bytecodes
+            u16 length = get16();
+            put16(mapPc(start_pc + length) - mapPc(start_pc));
+            put(get(6), 6);
+        } else {
+            put(get(data_len), data_len);
+        }
     }
 }
 
@@ -381,7 +830,7 @@ void BytecodeRewriter::rewriteVerificationTypeInfo() {
     put8(tag);
     if (tag >= 7) {
         // Adjust ITEM_Uninitialized offset
-        put16(tag == 8 ? EXTRA_BYTECODES + get16() : get16());
+        put16(tag == 8 ? mapPc(get16()) : get16());
     }
 }
 
@@ -395,7 +844,11 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
 
         Constant* attribute_name = _cpool[attribute_name_index];
         if (scope == SCOPE_REWRITE_METHOD && attribute_name->equals("Code", 4)) {
-            rewriteCode();
+            if (_latency) {
+                rewriteLatencyCode();
+            } else {
+                rewriteCode();
+            }
             continue;
         } else if (scope == SCOPE_REWRITE_CODE) {
             if (attribute_name->equals("LineNumberTable", 15)) {
@@ -406,7 +859,11 @@ void BytecodeRewriter::rewriteAttributes(Scope scope) {
                 rewriteBytecodeTable(8);
                 continue;
             } else if (attribute_name->equals("StackMapTable", 13)) {
-                rewriteStackMapTable();
+                if (_pc_map != NULL) {
+                    rewriteLatencyStackMapTable();
+                } else {
+                    rewriteStackMapTable();
+                }
                 continue;
             }
         }
@@ -431,9 +888,11 @@ void BytecodeRewriter::rewriteMembers(Scope scope) {
         u16 descriptor_index = get16();
         put16(descriptor_index);
 
+        Constant* name = _cpool[name_index];
+        Constant* descriptor = _cpool[descriptor_index];
         bool need_rewrite = scope == SCOPE_METHOD
-            && _cpool[name_index]->matches(_target_method, _target_method_len)
-            && (_target_signature == NULL || _cpool[descriptor_index]->matches(_target_signature, _target_signature_len));
+            && Instrument::matchMethod(_class_targets, name->utf8(), name->info(), descriptor->utf8(), descriptor->info())
+            && registerMethod(name, descriptor);
 
         rewriteAttributes(need_rewrite ? SCOPE_REWRITE_METHOD : SCOPE_METHOD);
     }
@@ -445,6 +904,7 @@ bool BytecodeRewriter::rewriteClass() {
 
     u32 version = get32();
     put32(version);
+    _major_version = (u16)version;
 
     _cpool_len = get16();
     put16(_cpool_len + EXTRA_CONSTANTS);
@@ -461,10 +921,20 @@ bool BytecodeRewriter::rewriteClass() {
 
     putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 2);
     putConstant(CONSTANT_Class, _cpool_len + 3);
-    putConstant(CONSTANT_NameAndType, _cpool_len + 4, _cpool_len + 5);
+    putConstant(CONSTANT_NameAndType, _cpool_len + 4, _cpool_len + 12);
     putConstant("one/profiler/Instrument");
     putConstant("recordSample");
     putConstant("()V");
+    putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 7);
+    putConstant(CONSTANT_NameAndType, _cpool_len + 8, _cpool_len + 5);
+    putConstant("recordEntry");
+    putConstant(CONSTANT_Methodref, _cpool_len + 1, _cpool_len + 10);
+    putConstant(CONSTANT_NameAndType, _cpool_len + 11, _cpool_len + 12);
+    putConstant("recordExit");
+    putConstant("(I)V");
+    putConstant(CONSTANT_Class, _cpool_len + 14);
+    putConstant("java/lang/Throwable");
+    putConstant("StackMapTable");
 
     u16 access_flags = get16();
     put16(access_flags);
@@ -472,8 +942,10 @@ bool BytecodeRewriter::rewriteClass() {
     u16 this_class = get16();
     put16(this_class);
 
-    u16 class_name_index = _cpool[this_class]->info();
-    if (!_cpool[class_name_index]->equals(_target_class, _target_class_len)) {
+    // A class may match several patterns, each selecting its own methods
+    _class_name = _cpool[_cpool[this_class]->info()];
+    _class_targets = Instrument::matchClass(_class_name->utf8(), _class_name->info());
+    if (_class_targets == 0) {
         return false;
     }
 
@@ -492,11 +964,14 @@ bool BytecodeRewriter::rewriteClass() {
 }
 
 
-char* Instrument::_target_class = NULL;
+char* Instrument::_target_spec = NULL;
+InstrumentTarget Instrument::_targets[MAX_INSTRUMENT_TARGETS];
+int Instrument::_target_count = 0;
 bool Instrument::_instrument_class_loaded = false;
 u64 Instrument::_interval;
-volatile u64 Instrument::_calls;
 volatile bool Instrument::_running;
+long Instrument::_latency = -1;
+double Instrument::_ticks_to_nanos;
 
 Error Instrument::check(Arguments& args) {
     if (!_instrument_class_loaded) {
@@ -505,14 +980,19 @@ Error Instrument::check(Arguments& args) {
         }
 
         JNIEnv* jni = VM::jni();
-        const JNINativeMethod native_method = {(char*)"recordSample", (char*)"()V", (void*)recordSample};
+        const JNINativeMethod native_methods[] = {
+            {(char*)"recordSample", (char*)"(I)V", (void*)recordSample},
+            {(char*)"recordEntry", (char*)"()V", (void*)recordEntry},
+            {(char*)"recordExit", (char*)"(I)V", (void*)recordExit}
+        };
 
         jclass cls = jni->DefineClass(INSTRUMENT_NAME, NULL, (const jbyte*)INSTRUMENT_CLASS, INCBIN_SIZEOF(INSTRUMENT_CLASS));
-        if (cls == NULL || jni->RegisterNatives(cls, &native_method, 1) != 0) {
+        if (cls == NULL || jni->RegisterNatives(cls, native_methods, 3) != 0) {
             jni->ExceptionDescribe();
             return Error("Could not load Instrument class");
         }
 
+        pthread_key_create(&latency_frames_key, free);
         _instrument_class_loaded = true;
     }
 
@@ -529,9 +1009,22 @@ Error Instrument::start(Arguments& args) {
         return Error("interval must be positive");
     }
 
-    setupTargetClassAndMethod(args._event);
+    error = setupTargets(args._event);
+    if (error) {
+        return error;
+    }
+
     _interval = args._interval ? args._interval : 1;
-    _calls = 0;
+    _latency = args._latency;
+    _ticks_to_nanos = 1e9 / TSC::frequency();
+
+    for (int i = 0; i < instrumented_method_count; i++) {
+        instrumented_methods[i].calls = 0;
+        if (instrumented_methods[i].histogram != NULL) {
+            instrumented_methods[i].histogram->reset();
+        }
+    }
+
     _running = true;
 
     jvmtiEnv* jvmti = VM::jvmti();
@@ -549,17 +1042,126 @@ void Instrument::stop() {
     jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
 }
 
-void Instrument::setupTargetClassAndMethod(const char* event) {
-    char* new_class = strdup(event);
-    *strrchr(new_class, '.') = 0;
+// The event is a list of patterns separated by |, e.g. com.acme.api.*Controller.*|com.acme.Cache.get
+Error Instrument::setupTargets(const char* event) {
+    InstrumentTarget targets[MAX_INSTRUMENT_TARGETS];
+    int count = 0;
+
+    // Every pattern is stored as three strings: class, method and signature;
+    // each of them is not longer than the pattern, plus the terminating zero
+    char* spec = (char*)malloc(strlen(event) + 3 * MAX_INSTRUMENT_TARGETS);
+    char* dst = spec;
+    if (spec == NULL) {
+        return Error("Out of memory");
+    }
+
+    for (const char* pattern = event; ; ) {
+        const char* end = strchr(pattern, '|');
+        if (end == NULL) {
+            end = pattern + strlen(pattern);
+        }
+
+        const char* signature = (const char*)memchr(pattern, '(', end - pattern);
+        if (signature == NULL) {
+            signature = end;
+        }
+
+        const char* dot = NULL;
+        for (const char* p = pattern; p < signature; p++) {
+            if (*p == '.') dot = p;
+        }
+
+        if (dot == NULL || dot == pattern) {
+            free(spec);
+            return Error("Method pattern must be ClassName.methodName");
+        } else if (count >= MAX_INSTRUMENT_TARGETS) {
+            free(spec);
+            return Error("Too many method patterns");
+        }
+
+        InstrumentTarget* target = &targets[count++];
+
+        target->class_pattern = dst;
+        for (const char* p = pattern; p < dot; p++) {
+            *dst++ = *p == '.' ? '/' : *p;
+        }
+        *dst++ = 0;
+
+        target->method_pattern = dst;
+        memcpy(dst, dot + 1, signature - dot - 1);
+        dst += signature - dot - 1;
+        *dst++ = 0;
+
+        if (signature < end) {
+            target->signature = dst;
+            memcpy(dst, signature, end - signature);
+            dst += end - signature;
+            *dst++ = 0;
+        } else {
+            target->signature = NULL;
+        }
+
+        if (*end == 0) break;
+        pattern = end + 1;
+    }
+
+    memcpy(_targets, targets, count * sizeof(InstrumentTarget));
+    _target_count = count;
+
+    char* old_spec = _target_spec;
+    _target_spec = spec;
+    free(old_spec);
+
+    return Error::OK;
+}
+
+// Glob matching where * stands for any sequence of characters
+bool Instrument::matchesGlob(const char* s, size_t len, const char* pattern) {
+    const char* star = NULL;
+    size_t star_pos = 0;
+    size_t pos = 0;
+
+    while (pos < len) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            star_pos = pos;
+        } else if (*pattern != 0 && *pattern == s[pos]) {
+            pattern++;
+            pos++;
+        } else if (star != NULL) {
+            // Let the last * absorb one more character
+            pattern = star;
+            pos = ++star_pos;
+        } else {
+            return false;
+        }
+    }
 
-    for (char* s = new_class; *s; s++) {
-        if (*s == '.') *s = '/';
+    while (*pattern == '*') {
+        pattern++;
     }
+    return *pattern == 0;
+}
 
-    char* old_class = _target_class;
-    _target_class = new_class;
-    free(old_class);
+// Returns the bitmask of targets whose class pattern matches the internal class name
+u64 Instrument::matchClass(const char* name, size_t len) {
+    u64 targets = 0;
+    for (int i = 0; i < _target_count; i++) {
+        if (matchesGlob(name, len, _targets[i].class_pattern)) {
+            targets |= 1ULL << i;
+        }
+    }
+    return targets;
+}
+
+bool Instrument::matchMethod(u64 targets, const char* name, size_t name_len, const char* signature, size_t signature_len) {
+    for (int i = 0; i < _target_count; i++) {
+        if ((targets & (1ULL << i)) != 0 && matchesGlob(name, name_len, _targets[i].method_pattern) &&
+            (_targets[i].signature == NULL || matchesGlob(signature, signature_len, _targets[i].signature))) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void Instrument::retransformMatchedClasses(jvmtiEnv* jvmti) {
@@ -570,21 +1172,26 @@ void Instrument::retransformMatchedClasses(jvmtiEnv* jvmti) {
     }
 
     jint matched_count = 0;
-    size_t len = strlen(_target_class);
     for (int i = 0; i < class_count; i++) {
         char* signature;
         if (jvmti->GetClassSignature(classes[i], &signature, NULL) == 0) {
-            if (signature[0] == 'L' && strncmp(signature + 1, _target_class, len) == 0 && signature[len + 1] == ';') {
+            size_t len = strlen(signature);
+            if (signature[0] == 'L' && len > 2 && matchClass(signature + 1, len - 2) != 0) {
                 classes[matched_count++] = classes[i];
             }
             jvmti->Deallocate((unsigned char*)signature);
         }
     }
 
-    if (matched_count > 0) {
-        jvmti->RetransformClasses(matched_count, classes);
+    // All matched classes are transformed in one batch. A wildcard may also match
+    // an unmodifiable class that fails the entire batch; then retry one by one.
+    if (matched_count > 0 && jvmti->RetransformClasses(matched_count, classes) != 0) {
         VM::jni()->ExceptionClear();
+        for (int i = 0; i < matched_count; i++) {
+            jvmti->RetransformClasses(1, &classes[i]);
+        }
     }
+    VM::jni()->ExceptionClear();
 
     jvmti->Deallocate((unsigned char*)classes);
 }
@@ -597,17 +1204,100 @@ void JNICALL Instrument::ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* jni,
     // Do not retransform if the profiling has stopped
     if (!_running) return;
 
-    if (name == NULL || strcmp(name, _target_class) == 0) {
-        BytecodeRewriter rewriter(class_data, class_data_len, _target_class);
+    if (name == NULL || matchClass(name, strlen(name)) != 0) {
+        BytecodeRewriter rewriter(class_data, class_data_len, _latency >= 0);
         rewriter.rewrite(new_class_data, new_class_data_len);
     }
 }
 
-void JNICALL Instrument::recordSample(JNIEnv* jni, jobject unused) {
-    if (!_enabled) return;
+void JNICALL Instrument::recordSample(JNIEnv* jni, jobject unused, jint method) {
+    if (!_enabled || (u32)method >= (u32)instrumented_method_count) return;
 
-    if (_interval <= 1 || ((atomicInc(_calls) + 1) % _interval) == 0) {
+    // Every method has its own counter, so that the interval does not let a hot method
+    // take all samples from the rest
+    u64 calls = atomicInc(instrumented_methods[method].calls) + 1;
+    if (_interval <= 1 || calls % _interval == 0) {
         ExecutionEvent event(TSC::ticks());
         Profiler::instance()->recordSample(NULL, _interval, INSTRUMENTED_METHOD, &event);
     }
 }
+
+void JNICALL Instrument::recordEntry(JNIEnv* jni, jobject unused) {
+    LatencyFrames* frames = (LatencyFrames*)pthread_getspecific(latency_frames_key);
+    if (frames == NULL) {
+        frames = (LatencyFrames*)calloc(1, sizeof(LatencyFrames));
+        if (frames == NULL || pthread_setspecific(latency_frames_key, frames) != 0) {
+            free(frames);
+            return;
+        }
+    }
+
+    // Entries and exits are paired even when the profiler is not running,
+    // since a thread may call an instrumented method before the profiling starts
+    int depth = frames->depth++;
+    if (depth < MAX_LATENCY_DEPTH) {
+        frames->start[depth] = TSC::ticks();
+    }
+}
+
+void JNICALL Instrument::recordExit(JNIEnv* jni, jobject unused, jint method) {
+    LatencyFrames* frames = (LatencyFrames*)pthread_getspecific(latency_frames_key);
+    if (frames == NULL || frames->depth <= 0) {
+        return;
+    }
+
+    int depth = --frames->depth;
+    if (!_enabled || depth >= MAX_LATENCY_DEPTH || (u32)method >= (u32)instrumented_method_count) {
+        return;
+    }
+
+    LatencyHistogram* histogram = instrumented_methods[method].histogram;
+    if (histogram == NULL) {
+        return;
+    }
+
+    u64 end_time = TSC::ticks();
+    u64 duration = (u64)((end_time - frames->start[depth]) * _ticks_to_nanos);
+    histogram->record(duration);
+
+    // Stack traces are recorded only for slow calls
+    if (_latency > 0 && duration >= (u64)_latency) {
+        ExecutionEvent event(end_time);
+        Profiler::instance()->recordSample(NULL, duration, INSTRUMENTED_METHOD, &event);
+    }
+}
+
+void Instrument::dumpMethods(Writer& out) {
+    char buf[1280];
+    int count = instrumented_method_count;
+
+    if (_latency < 0) {
+        out << "--- Method calls ---\n"
+               "       calls  method\n";
+
+        for (int i = 0; i < count; i++) {
+            u64 calls = instrumented_methods[i].calls;
+            if (calls == 0) continue;
+
+            snprintf(buf, sizeof(buf), "%12llu  %s\n", calls, instrumented_methods[i].name);
+            out << buf;
+        }
+        out << "\n";
+        return;
+    }
+
+    out << "--- Method latency (ns) ---\n"
+           "       calls         avg         p50         p90         p99       p99.9         max  method\n";
+
+    for (int i = 0; i < count; i++) {
+        const LatencyHistogram* h = instrumented_methods[i].histogram;
+        u64 calls = h != NULL ? h->count() : 0;
+        if (calls == 0) continue;
+
+        snprintf(buf, sizeof(buf), "%12llu %11llu %11llu %11llu %11llu %11llu %11llu  %s\n",
+                 calls, h->total() / calls, h->percentile(0.5), h->percentile(0.9),
+                 h->percentile(0.99), h->percentile(0.999), h->max(), instrumented_methods[i].name);
+        out << buf;
+    }
+    out << "\n";
+}
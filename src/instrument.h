@@ -8,15 +8,29 @@
 
 #include <jvmti.h>
 #include "engine.h"
+#include "writer.h"
 
 
+const int MAX_INSTRUMENT_TARGETS = 64;
+
+// One pattern of the instrumented methods: ClassName.methodName(signature),
+// where every part may contain * wildcards; the signature is optional
+struct InstrumentTarget {
+    const char* class_pattern;
+    const char* method_pattern;
+    const char* signature;
+};
+
 class Instrument : public Engine {
   private:
-    static char* _target_class;
+    static char* _target_spec;
+    static InstrumentTarget _targets[MAX_INSTRUMENT_TARGETS];
+    static int _target_count;
     static bool _instrument_class_loaded;
     static u64 _interval;
-    static volatile u64 _calls;
     static volatile bool _running;
+    static long _latency;
+    static double _ticks_to_nanos;
 
   public:
     const char* type() {
@@ -28,24 +42,32 @@ class Instrument : public Engine {
     }
 
     const char* units() {
-        return "calls";
+        return _latency >= 0 ? "ns" : "calls";
     }
 
     Error check(Arguments& args);
     Error start(Arguments& args);
     void stop();
 
-    void setupTargetClassAndMethod(const char* event);
+    Error setupTargets(const char* event);
 
     void retransformMatchedClasses(jvmtiEnv* jvmti);
 
+    void dumpMethods(Writer& out);
+
+    static bool matchesGlob(const char* s, size_t len, const char* pattern);
+    static u64 matchClass(const char* name, size_t len);
+    static bool matchMethod(u64 targets, const char* name, size_t name_len, const char* signature, size_t signature_len);
+
     static void JNICALL ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* jni,
                                           jclass class_being_redefined, jobject loader,
                                           const char* name, jobject protection_domain,
                                           jint class_data_len, const u8* class_data,
                                           jint* new_class_data_len, u8** new_class_data);
 
-    static void JNICALL recordSample(JNIEnv* jni, jobject unused);
+    static void JNICALL recordSample(JNIEnv* jni, jobject unused, jint method);
+    static void JNICALL recordEntry(JNIEnv* jni, jobject unused);
+    static void JNICALL recordExit(JNIEnv* jni, jobject unused, jint method);
 };
 
 #endif // _INSTRUMENT_H
@@ -5,6 +5,7 @@
 
 #include "j9ObjectSampler.h"
 #include "j9Ext.h"
+#include "os.h"
 #include "vmEntry.h"
 
 
@@ -36,9 +37,9 @@ Error J9ObjectSampler::start(Arguments& args) {
     }
 
     _interval = args._alloc > 0 ? args._alloc : DEFAULT_ALLOC_INTERVAL;
-    _allocated_bytes = 0;
+    _allocated_bytes.reset(_interval, OS::nanotime());
 
-    initLiveRefs(args._live);
+    initLiveRefs(args);
 
     jvmtiEnv* jvmti = VM::jvmti();
     if (jvmti->SetExtensionEventCallback(J9Ext::InstrumentableObjectAlloc_id, (jvmtiExtensionEvent)JavaObjectAlloc) != 0) {
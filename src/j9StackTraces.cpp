@@ -7,10 +7,12 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 #include <map>
 #include "j9StackTraces.h"
 #include "j9Ext.h"
+#include "mutex.h"
 #include "profiler.h"
 #include "perfEvents.h"
 #include "tsc.h"
@@ -46,19 +48,77 @@ class J9VMThread {
 pthread_t J9StackTraces::_thread = 0;
 int J9StackTraces::_max_stack_depth;
 int J9StackTraces::_pipe[2];
+volatile bool J9StackTraces::_running = false;
+volatile bool J9StackTraces::_parked = false;
+J9NotificationRing J9StackTraces::_ring;
 
 static JNIEnv* _self_env = NULL;
 
+// Global references to Java threads by their J9VMThread, which is also the JNIEnv of the thread.
+// NULL marks a thread that was not found among all threads.
+static std::map<void*, jthread> _j9_threads;
+static Mutex _j9_threads_lock;
+
+
+bool J9NotificationRing::allocate() {
+    if (_slots == NULL && (_slots = (Slot*)malloc(J9_NOTIFICATION_SLOTS * sizeof(Slot))) == NULL) {
+        return false;
+    }
+
+    for (u32 i = 0; i < J9_NOTIFICATION_SLOTS; i++) {
+        _slots[i].seq = i;
+    }
+    _head = 0;
+    _tail = 0;
+    return true;
+}
+
+bool J9NotificationRing::push(J9StackTraceNotification* notif) {
+    while (true) {
+        u64 pos = _head;
+        Slot* slot = &_slots[pos % J9_NOTIFICATION_SLOTS];
+        u64 seq = loadAcquire(slot->seq);
+        if (seq == pos) {
+            if (__sync_bool_compare_and_swap(&_head, pos, pos + 1)) {
+                memcpy(&slot->notif, notif, notif->size());
+                storeRelease(slot->seq, pos + 1);
+                return true;
+            }
+        } else if (seq < pos) {
+            return false;
+        }
+    }
+}
+
+J9StackTraceNotification* J9NotificationRing::peek() {
+    Slot* slot = &_slots[_tail % J9_NOTIFICATION_SLOTS];
+    return loadAcquire(slot->seq) == _tail + 1 ? &slot->notif : NULL;
+}
+
+void J9NotificationRing::pop() {
+    Slot* slot = &_slots[_tail % J9_NOTIFICATION_SLOTS];
+    storeRelease(slot->seq, _tail + J9_NOTIFICATION_SLOTS);
+    _tail++;
+}
+
 
 Error J9StackTraces::start(Arguments& args) {
     _max_stack_depth = args._jstackdepth;
 
+    if (!_ring.allocate()) {
+        return Error("Failed to allocate notification ring");
+    }
+
+    // The pipe only wakes up the sampler thread when it has nothing to do
     if (pipe(_pipe) != 0) {
         return Error("Failed to create pipe");
     }
     fcntl(_pipe[1], F_SETFL, O_NONBLOCK);
 
+    _running = true;
+    _parked = false;
     if (pthread_create(&_thread, NULL, threadEntry, NULL) != 0) {
+        _running = false;
         close(_pipe[0]);
         close(_pipe[1]);
         return Error("Unable to create sampler thread");
@@ -69,83 +129,146 @@ Error J9StackTraces::start(Arguments& args) {
 
 void J9StackTraces::stop() {
     if (_thread != 0) {
-        close(_pipe[1]);
+        _running = false;
+        char c = 0;
+        ssize_t result = write(_pipe[1], &c, 1);
+        (void)result;
+
         pthread_join(_thread, NULL);
         close(_pipe[0]);
+        close(_pipe[1]);
         _thread = 0;
     }
 }
 
-void J9StackTraces::timerLoop() {
-    JNIEnv* jni = VM::attachThread("Async-profiler Sampler");
-    __atomic_store_n(&_self_env, jni, __ATOMIC_RELEASE);
+void J9StackTraces::onThreadStart(JNIEnv* jni, jthread thread) {
+    if (_running) {
+        MutexLocker ml(_j9_threads_lock);
+        jthread& ref = _j9_threads[jni];
+        if (ref != NULL) {
+            jni->DeleteGlobalRef(ref);
+        }
+        ref = (jthread)jni->NewGlobalRef(thread);
+    }
+}
 
-    jni->PushLocalFrame(64);
+void J9StackTraces::onThreadEnd(JNIEnv* jni, jthread thread) {
+    if (_running) {
+        MutexLocker ml(_j9_threads_lock);
+        std::map<void*, jthread>::iterator it = _j9_threads.find(jni);
+        if (it != _j9_threads.end()) {
+            if (it->second != NULL) {
+                jni->DeleteGlobalRef(it->second);
+            }
+            _j9_threads.erase(it);
+        }
+    }
+}
 
+// Rebuilds the thread map from scratch. Called with _j9_threads_lock held.
+void J9StackTraces::refreshThreads(JNIEnv* jni) {
     jvmtiEnv* jvmti = VM::jvmti();
-    char notification_buf[65536];
-    std::map<void*, jthread> known_threads;
+    jint thread_count;
+    jthread* threads;
+    if (jvmti->GetAllThreads(&thread_count, &threads) != 0) {
+        return;
+    }
+
+    for (std::map<void*, jthread>::const_iterator it = _j9_threads.begin(); it != _j9_threads.end(); ++it) {
+        if (it->second != NULL) {
+            jni->DeleteGlobalRef(it->second);
+        }
+    }
+    _j9_threads.clear();
+
+    for (jint i = 0; i < thread_count; i++) {
+        _j9_threads[J9Ext::GetJ9vmThread(threads[i])] = (jthread)jni->NewGlobalRef(threads[i]);
+        jni->DeleteLocalRef(threads[i]);
+    }
+    jvmti->Deallocate((unsigned char*)threads);
+}
+
+// Returns a local reference to the thread, or NULL if the thread is not known
+jthread J9StackTraces::findThread(JNIEnv* jni, void* vm_thread) {
+    MutexLocker ml(_j9_threads_lock);
+    std::map<void*, jthread>::iterator it = _j9_threads.find(vm_thread);
+    if (it == _j9_threads.end()) {
+        // Normally not reached, since ThreadStart adds new threads
+        refreshThreads(jni);
+        if ((it = _j9_threads.find(vm_thread)) == _j9_threads.end()) {
+            // Do not enumerate all threads again for the same one
+            _j9_threads[vm_thread] = NULL;
+            return NULL;
+        }
+    }
+    return it->second != NULL ? (jthread)jni->NewLocalRef(it->second) : NULL;
+}
+
+void J9StackTraces::timerLoop() {
+    JNIEnv* jni = VM::attachThread("Async-profiler Sampler");
+    {
+        MutexLocker ml(_j9_threads_lock);
+        refreshThreads(jni);
+    }
+    __atomic_store_n(&_self_env, jni, __ATOMIC_RELEASE);
 
     int max_frames = _max_stack_depth + MAX_J9_NATIVE_FRAMES + RESERVED_FRAMES;
     ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
     jvmtiFrameInfoExtended* jvmti_frames = (jvmtiFrameInfoExtended*)malloc(max_frames * sizeof(jvmtiFrameInfoExtended));
 
-    while (true) {
-        ssize_t bytes = read(_pipe[0], notification_buf, sizeof(notification_buf));
-        if (bytes <= 0) {
-            if (bytes < 0 && errno == EAGAIN) {
+    while (_running) {
+        // Handle all notifications posted since the last wakeup in one go
+        for (J9StackTraceNotification* notif; (notif = _ring.peek()) != NULL; _ring.pop()) {
+            u64 start_time = TSC::ticks();
+
+            jthread thread = findThread(jni, notif->env);
+            if (thread == NULL) {
                 continue;
             }
-            break;
-        }
 
-        ssize_t ptr = 0;
-        while (ptr < bytes) {
-            J9StackTraceNotification* notif = (J9StackTraceNotification*)(notification_buf + ptr);
-            u64 start_time = TSC::ticks();
-
-            jthread thread = known_threads[notif->env];
             jint num_jvmti_frames;
-            if (thread == NULL || J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) != 0) {
-                jni->PopLocalFrame(NULL);
-                jni->PushLocalFrame(64);
-
-                jint thread_count;
-                jthread* threads;
-                if (jvmti->GetAllThreads(&thread_count, &threads) == 0) {
-                    known_threads.clear();
-                    for (jint i = 0; i < thread_count; i++) {
-                        known_threads[J9Ext::GetJ9vmThread(threads[i])] = threads[i];
-                    }
-                    jvmti->Deallocate((unsigned char*)threads);
-                }
+            if (J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) == 0) {
+                int num_frames = Profiler::instance()->convertNativeTrace(notif->num_frames, notif->addr, frames, EXECUTION_SAMPLE);
 
-                if ((thread = known_threads[notif->env]) == NULL ||
-                    J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_jvmti_frames) != 0) {
-                    continue;
+                for (int j = 0; j < num_jvmti_frames; j++) {
+                    frames[num_frames].method_id = jvmti_frames[j].method;
+                    frames[num_frames].bci = FrameType::encode(jvmti_frames[j].type, jvmti_frames[j].location);
+                    num_frames++;
                 }
-            }
 
-            int num_frames = Profiler::instance()->convertNativeTrace(notif->num_frames, notif->addr, frames, EXECUTION_SAMPLE);
-
-            for (int j = 0; j < num_jvmti_frames; j++) {
-                frames[num_frames].method_id = jvmti_frames[j].method;
-                frames[num_frames].bci = FrameType::encode(jvmti_frames[j].type, jvmti_frames[j].location);
-                num_frames++;
+                int tid = J9Ext::GetOSThreadID(thread);
+                ExecutionEvent event(start_time);
+                Profiler::instance()->recordExternalSample(notif->counter, tid, EXECUTION_SAMPLE, &event, num_frames, frames);
             }
 
-            int tid = J9Ext::GetOSThreadID(thread);
-            ExecutionEvent event(start_time);
-            Profiler::instance()->recordExternalSample(notif->counter, tid, EXECUTION_SAMPLE, &event, num_frames, frames);
+            jni->DeleteLocalRef(thread);
+        }
 
-            ptr += notif->size();
+        // Sleep until a signal handler posts a notification; recheck to avoid a lost wakeup
+        _parked = true;
+        __sync_synchronize();
+        if (_ring.peek() == NULL && _running) {
+            char buf[64];
+            while (read(_pipe[0], buf, sizeof(buf)) < 0 && errno == EINTR);  // restart if interrupted
         }
+        _parked = false;
     }
 
     free(jvmti_frames);
     free(frames);
 
     __atomic_store_n(&_self_env, NULL, __ATOMIC_RELEASE);
+
+    {
+        MutexLocker ml(_j9_threads_lock);
+        for (std::map<void*, jthread>::const_iterator it = _j9_threads.begin(); it != _j9_threads.end(); ++it) {
+            if (it->second != NULL) {
+                jni->DeleteGlobalRef(it->second);
+            }
+        }
+        _j9_threads.clear();
+    }
+
     VM::detachThread();
 }
 
@@ -167,7 +290,13 @@ void J9StackTraces::checkpoint(u64 counter, J9StackTraceNotification* notif) {
             vm_thread->setOverflowMark();
             notif->env = env;
             notif->counter = counter;
-            if (write(_pipe[1], notif, notif->size()) > 0) {
+            if (_ring.push(notif)) {
+                __sync_synchronize();
+                if (_parked && __sync_bool_compare_and_swap(&_parked, true, false)) {
+                    char c = 0;
+                    ssize_t result = write(_pipe[1], &c, 1);
+                    (void)result;
+                }
                 return;
             }
         }
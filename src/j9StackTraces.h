@@ -6,12 +6,14 @@
 #ifndef _J9STACKTRACES_H
 #define _J9STACKTRACES_H
 
+#include <jvmti.h>
 #include <pthread.h>
 #include "arch.h"
 #include "arguments.h"
 
 
 const int MAX_J9_NATIVE_FRAMES = 128;
+const u32 J9_NOTIFICATION_SLOTS = 256;
 
 struct J9StackTraceNotification {
     void* env;
@@ -26,11 +28,42 @@ struct J9StackTraceNotification {
 };
 
 
+// Bounded lock-free queue of notifications posted by signal handlers, see LogRing
+class J9NotificationRing {
+  private:
+    struct Slot {
+        u64 seq;
+        J9StackTraceNotification notif;
+    };
+
+    Slot* _slots;
+    volatile u64 _head;
+    char _padding[56];
+    u64 _tail;
+
+  public:
+    J9NotificationRing() : _slots(NULL), _head(0), _tail(0) {
+    }
+
+    bool allocate();
+
+    // Async signal safe; returns false if the ring is full
+    bool push(J9StackTraceNotification* notif);
+
+    // Single consumer
+    J9StackTraceNotification* peek();
+    void pop();
+};
+
+
 class J9StackTraces {
   private:
     static pthread_t _thread;
     static int _max_stack_depth;
     static int _pipe[2];
+    static volatile bool _running;
+    static volatile bool _parked;
+    static J9NotificationRing _ring;
 
     static void* threadEntry(void* unused) {
         timerLoop();
@@ -38,11 +71,18 @@ class J9StackTraces {
     }
 
     static void timerLoop();
+    static jthread findThread(JNIEnv* jni, void* vm_thread);
+    static void refreshThreads(JNIEnv* jni);
 
   public:
     static Error start(Arguments& args);
     static void stop();
 
+    // Keep the map of J9VMThread to jthread current, so that the sampler
+    // does not have to enumerate all threads when it meets a new one
+    static void onThreadStart(JNIEnv* jni, jthread thread);
+    static void onThreadEnd(JNIEnv* jni, jthread thread);
+
     static void checkpoint(u64 counter, J9StackTraceNotification* notif);
 };
 
@@ -4,12 +4,30 @@
  */
 
 #include <stdlib.h>
+#include <map>
 #include "j9WallClock.h"
 #include "j9Ext.h"
 #include "profiler.h"
 #include "tsc.h"
 
 
+// Threads stopped for a stack walk at a time
+const int J9_THREADS_PER_TICK = 8;
+
+// How many cycles a stack trace of a blocked thread is reused before walking the thread again
+const u32 J9_MAX_REUSED_SAMPLES = 16;
+
+struct J9ThreadSample {
+    u64 cycle;
+    jint state;
+    u32 call_trace_id;
+    u32 reused;
+
+    J9ThreadSample() : cycle(0), state(0), call_trace_id(0), reused(0) {
+    }
+};
+
+
 long J9WallClock::_interval;
 
 Error J9WallClock::start(Arguments& args) {
@@ -34,43 +52,94 @@ void J9WallClock::stop() {
 void J9WallClock::timerLoop() {
     JNIEnv* jni = VM::attachThread("Async-profiler Sampler");
     jvmtiEnv* jvmti = VM::jvmti();
+    Profiler* profiler = Profiler::instance();
+    int self = OS::threadId();
 
     int max_frames = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
     ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
+    jvmtiFrameInfoExtended* jvmti_frames = (jvmtiFrameInfoExtended*)malloc(_max_stack_depth * sizeof(jvmtiFrameInfoExtended));
+
+    std::map<int, J9ThreadSample> thread_samples;
+    u64 cycle = 0;
 
     while (_running) {
-        if (!_enabled) {
+        jthread* threads;
+        jint thread_count;
+        if (!_enabled || jvmti->GetAllThreads(&thread_count, &threads) != 0) {
             OS::sleep(_interval);
             continue;
         }
 
-        jni->PushLocalFrame(64);
+        // Every thread is visited once per interval, a few threads per tick,
+        // so that the pause does not grow with the number of threads
+        u64 cycle_start_time = TSC::nanos();
+        cycle++;
+
+        for (int i = 0; i < thread_count && _running; ) {
+            for (int tick_end = i + J9_THREADS_PER_TICK; i < thread_count && i < tick_end; i++) {
+                jthread thread = threads[i];
+                int tid = J9Ext::GetOSThreadID(thread);
+                jint state;
+                if (tid <= 0 || tid == self || jvmti->GetThreadState(thread, &state) != 0 || !(state & JVMTI_THREAD_STATE_ALIVE)) {
+                    continue;
+                }
 
-        jvmtiStackInfoExtended* stack_infos;
-        jint thread_count;
-        if (J9Ext::GetAllStackTracesExtended(_max_stack_depth, (void**)&stack_infos, &thread_count) == 0) {
-            u64 start_time = TSC::ticks();
-            for (int i = 0; i < thread_count; i++) {
-                jvmtiStackInfoExtended* si = &stack_infos[i];
-                for (int j = 0; j < si->frame_count; j++) {
-                    jvmtiFrameInfoExtended* fi = &si->frame_buffer[j];
-                    frames[j].method_id = fi->method;
-                    frames[j].bci = FrameType::encode(fi->type, fi->location);
+                J9ThreadSample& ts = thread_samples[tid];
+                ExecutionEvent event(TSC::ticks());
+                event._thread_state = (state & JVMTI_THREAD_STATE_RUNNABLE) ? THREAD_RUNNING : THREAD_SLEEPING;
+
+                if (!(state & JVMTI_THREAD_STATE_RUNNABLE) && state == ts.state && ts.call_trace_id != 0 &&
+                    ts.reused < J9_MAX_REUSED_SAMPLES) {
+                    // A thread blocked in the same state since the previous cycle is most likely
+                    // at the same place: count the previous stack trace without stopping the thread
+                    profiler->recordExternalSamples(1, _interval, tid, ts.call_trace_id, EXECUTION_SAMPLE, &event);
+                    ts.reused++;
+                } else {
+                    jint num_frames;
+                    if (J9Ext::GetStackTraceExtended(thread, 0, _max_stack_depth, jvmti_frames, &num_frames) == 0) {
+                        for (int j = 0; j < num_frames; j++) {
+                            frames[j].method_id = jvmti_frames[j].method;
+                            frames[j].bci = FrameType::encode(jvmti_frames[j].type, jvmti_frames[j].location);
+                        }
+                        ts.call_trace_id = profiler->recordExternalSample(_interval, tid, EXECUTION_SAMPLE, &event, num_frames, frames);
+                    } else {
+                        ts.call_trace_id = 0;
+                    }
+                    ts.reused = 0;
                 }
+                ts.state = state;
+                ts.cycle = cycle;
+            }
 
-                int tid = J9Ext::GetOSThreadID(si->thread);
-                ExecutionEvent event(start_time);
-                event._thread_state = (si->state & JVMTI_THREAD_STATE_RUNNABLE) ? THREAD_RUNNING : THREAD_SLEEPING;
-                Profiler::instance()->recordExternalSample(_interval, tid, EXECUTION_SAMPLE, &event, si->frame_count, frames);
+            if (i < thread_count) {
+                long long sleep_time = cycle_start_time + (u64)_interval * i / thread_count - TSC::nanos();
+                if (sleep_time > 0) {
+                    OS::sleep(sleep_time);
+                }
             }
-            jvmti->Deallocate((unsigned char*)stack_infos);
         }
 
-        jni->PopLocalFrame(NULL);
+        for (int i = 0; i < thread_count; i++) {
+            jni->DeleteLocalRef(threads[i]);
+        }
+        jvmti->Deallocate((unsigned char*)threads);
+
+        // Forget threads that have ended
+        for (std::map<int, J9ThreadSample>::iterator it = thread_samples.begin(); it != thread_samples.end(); ) {
+            if (it->second.cycle != cycle) {
+                thread_samples.erase(it++);
+            } else {
+                ++it;
+            }
+        }
 
-        OS::sleep(_interval);
+        long long sleep_time = cycle_start_time + _interval - TSC::nanos();
+        if (sleep_time > 0) {
+            OS::sleep(sleep_time);
+        }
     }
 
+    free(jvmti_frames);
     free(frames);
 
     VM::detachThread();
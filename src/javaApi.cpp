@@ -10,6 +10,8 @@
 #include "javaApi.h"
 #include "os.h"
 #include "profiler.h"
+#include "threadLocalData.h"
+#include "userEvents.h"
 #include "vmStructs.h"
 
 
@@ -23,6 +25,61 @@ static void throwNew(JNIEnv* env, const char* exception_class, const char* messa
     }
 }
 
+// Passes the output to java.io.OutputStream in chunks through one reused byte array,
+// so that neither the whole output nor a String of it is ever created.
+// After the stream throws, the rest of the output is dropped and the exception is left pending.
+class StreamWriter : public Writer {
+  private:
+    enum { CHUNK_SIZE = 65536 };
+
+    JNIEnv* _env;
+    jobject _stream;
+    jmethodID _write;
+    jbyteArray _array;
+    size_t _size;
+    char _buf[CHUNK_SIZE];
+
+  public:
+    StreamWriter(JNIEnv* env, jobject stream) : _env(env), _stream(stream), _size(0) {
+        jclass cls = env->GetObjectClass(stream);
+        _write = env->GetMethodID(cls, "write", "([BII)V");
+        _array = _write != NULL ? env->NewByteArray(CHUNK_SIZE) : NULL;
+        if (_array == NULL) {
+            _err = 1;
+        }
+    }
+
+    ~StreamWriter() {
+        if (_array != NULL) {
+            _env->DeleteLocalRef(_array);
+        }
+    }
+
+    void flush() {
+        if (_size > 0 && _err == 0) {
+            _env->SetByteArrayRegion(_array, 0, (jsize)_size, (const jbyte*)_buf);
+            _env->CallVoidMethod(_stream, _write, _array, 0, (jint)_size);
+            if (_env->ExceptionCheck()) {
+                _err = 1;
+            }
+        }
+        _size = 0;
+    }
+
+    virtual void write(const char* data, size_t len) {
+        while (len > 0 && _err == 0) {
+            size_t bytes = len < CHUNK_SIZE - _size ? len : CHUNK_SIZE - _size;
+            memcpy(_buf + _size, data, bytes);
+            _size += bytes;
+            data += bytes;
+            len -= bytes;
+            if (_size == CHUNK_SIZE) {
+                flush();
+            }
+        }
+    }
+};
+
 
 extern "C" DLLEXPORT void JNICALL
 Java_one_profiler_AsyncProfiler_start0(JNIEnv* env, jobject unused, jstring event, jlong interval, jboolean reset) {
@@ -95,11 +152,54 @@ Java_one_profiler_AsyncProfiler_execute0(JNIEnv* env, jobject unused, jstring co
     return NULL;
 }
 
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_execute1(JNIEnv* env, jobject unused, jstring command, jobject stream) {
+    Arguments args;
+    const char* command_str = env->GetStringUTFChars(command, NULL);
+    Error error = args.parse(command_str);
+    env->ReleaseStringUTFChars(command, command_str);
+
+    if (error) {
+        throwNew(env, "java/lang/IllegalArgumentException", error.message());
+        return;
+    }
+
+    Log::open(args);
+
+    if (!args.hasOutputFile()) {
+        StreamWriter out(env, stream);
+        if (out.good()) {
+            error = Profiler::instance()->runInternal(args, out);
+            out.flush();
+        }
+        if (env->ExceptionCheck()) {
+            // Exception thrown by the stream or by the JNI calls
+            return;
+        }
+    } else {
+        FileWriter out(args.file());
+        if (!out.is_open()) {
+            throwNew(env, "java/io/IOException", strerror(errno));
+            return;
+        }
+        error = Profiler::instance()->runInternal(args, out);
+    }
+
+    if (error) {
+        throwNew(env, "java/lang/IllegalStateException", error.message());
+    }
+}
+
 extern "C" DLLEXPORT jlong JNICALL
 Java_one_profiler_AsyncProfiler_getSamples(JNIEnv* env, jobject unused) {
     return (jlong)Profiler::instance()->total_samples();
 }
 
+extern "C" DLLEXPORT jlong JNICALL
+Java_one_profiler_AsyncProfiler_getMetric0(JNIEnv* env, jobject unused, jint metric) {
+    return (jlong)Profiler::instance()->metric(metric);
+}
+
 extern "C" DLLEXPORT void JNICALL
 Java_one_profiler_AsyncProfiler_filterThread0(JNIEnv* env, jobject unused, jthread thread, jboolean enable) {
     int thread_id;
@@ -117,15 +217,50 @@ Java_one_profiler_AsyncProfiler_filterThread0(JNIEnv* env, jobject unused, jthre
     }
 }
 
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_setSamplingPriority0(JNIEnv* env, jobject unused, jint priority) {
+    asprof_thread_local_data* data = ThreadLocalData::getThreadLocalData();
+    if (data != NULL) {
+        data->sampling_priority = priority;
+    }
+}
+
+extern "C" DLLEXPORT void JNICALL
+Java_one_profiler_AsyncProfiler_setTracingContext0(JNIEnv* env, jobject unused, jlong span_id, jlong trace_id, jint tag) {
+    asprof_thread_local_data* data = ThreadLocalData::getThreadLocalData();
+    if (data != NULL) {
+        data->span_id = 0;
+        data->trace_id = (u64)trace_id;
+        data->context_tag = (u32)tag;
+        data->span_id = (u64)span_id;
+    }
+}
+
+extern "C" DLLEXPORT jint JNICALL
+Java_one_profiler_AsyncProfiler_registerContextTag0(JNIEnv* env, jobject unused, jstring tag) {
+    if (tag == NULL) {
+        return 0;
+    }
+    const char* tag_str = env->GetStringUTFChars(tag, NULL);
+    jint id = (jint)UserEvents::registerContextTag(tag_str);
+    env->ReleaseStringUTFChars(tag, tag_str);
+    return id;
+}
+
 
 #define F(name, sig)  {(char*)#name, (char*)sig, (void*)Java_one_profiler_AsyncProfiler_##name}
 
 static const JNINativeMethod profiler_natives[] = {
-    F(start0,        "(Ljava/lang/String;JZ)V"),
-    F(stop0,         "()V"),
-    F(execute0,      "(Ljava/lang/String;)Ljava/lang/String;"),
-    F(getSamples,    "()J"),
-    F(filterThread0, "(Ljava/lang/Thread;Z)V"),
+    F(start0,               "(Ljava/lang/String;JZ)V"),
+    F(stop0,                "()V"),
+    F(execute0,             "(Ljava/lang/String;)Ljava/lang/String;"),
+    F(getSamples,           "()J"),
+    F(filterThread0,        "(Ljava/lang/Thread;Z)V"),
+    F(setSamplingPriority0, "(I)V"),
+    F(setTracingContext0,   "(JJI)V"),
+    F(registerContextTag0,  "(Ljava/lang/String;)I"),
+    F(execute1,             "(Ljava/lang/String;Ljava/io/OutputStream;)V"),
+    F(getMetric0,           "(I)J"),
 };
 
 static const JNINativeMethod* execute0 = &profiler_natives[2];
@@ -0,0 +1,103 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "gzipWriter.h"
+#include "jfrCompressor.h"
+#include "log.h"
+
+const size_t COMPRESS_BUFFER_SIZE = 256 * 1024;
+
+// Subset of the zlib gzip API; gzFile is opaque, so no zlib headers are needed
+typedef void* (*gzdopen_t)(int fd, const char* mode);
+typedef int (*gzwrite_t)(void* file, const void* buf, unsigned len);
+typedef int (*gzclose_t)(void* file);
+
+static gzdopen_t _gzdopen = NULL;
+static gzwrite_t _gzwrite = NULL;
+static gzclose_t _gzclose = NULL;
+
+
+bool JfrCompressor::available() {
+    if (_gzclose != NULL) {
+        return true;
+    }
+
+    void* lib = dlopen(ZLIB_NAME, RTLD_LAZY);
+    if (lib == NULL) {
+        return false;
+    }
+
+    _gzdopen = (gzdopen_t)dlsym(lib, "gzdopen");
+    _gzwrite = (gzwrite_t)dlsym(lib, "gzwrite");
+    gzclose_t gzclose = (gzclose_t)dlsym(lib, "gzclose");
+    if (_gzdopen == NULL || _gzwrite == NULL || gzclose == NULL) {
+        dlclose(lib);
+        return false;
+    }
+
+    __atomic_store_n(&_gzclose, gzclose, __ATOMIC_RELEASE);
+    return true;
+}
+
+void JfrCompressor::compress() {
+    char* buf = (char*)malloc(COMPRESS_BUFFER_SIZE);
+    if (buf == NULL) {
+        return;
+    }
+
+    // gzclose releases the descriptor, hence dup
+    lseek(_out_fd, 0, SEEK_END);
+    int fd = dup(_out_fd);
+    void* gz = fd >= 0 ? _gzdopen(fd, "wb") : NULL;
+    if (gz == NULL) {
+        Log::warn("Failed to open compressed JFR output");
+        if (fd >= 0) close(fd);
+        free(buf);
+        return;
+    }
+
+    off_t offset = 0;
+    while ((size_t)offset < _size) {
+        size_t remaining = _size - offset;
+        ssize_t bytes = pread(_src_fd, buf, remaining < COMPRESS_BUFFER_SIZE ? remaining : COMPRESS_BUFFER_SIZE, offset);
+        if (bytes <= 0 || _gzwrite(gz, buf, (unsigned)bytes) != bytes) {
+            Log::warn("Failed to compress JFR chunk");
+            break;
+        }
+        offset += bytes;
+    }
+
+    _gzclose(gz);
+    free(buf);
+}
+
+void JfrCompressor::submit(int src_fd, size_t size) {
+    MutexLocker ml(_lock);
+    join();
+
+    _src_fd = src_fd;
+    _size = size;
+    if (pthread_create(&_thread, NULL, threadEntry, this) == 0) {
+        _busy = true;
+    } else {
+        // No thread to offload to, compress on the caller's side
+        compress();
+    }
+}
+
+void JfrCompressor::wait() {
+    MutexLocker ml(_lock);
+    join();
+}
+
+void JfrCompressor::join() {
+    if (_busy) {
+        pthread_join(_thread, NULL);
+        _busy = false;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _JFRCOMPRESSOR_H
+#define _JFRCOMPRESSOR_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "mutex.h"
+
+
+// Compresses finished JFR chunks into the output file in a background thread.
+// Every chunk becomes a separate gzip member, so the output is a valid .jfr.gz
+// even if the recording is read before it ends.
+// zlib is loaded on demand, the profiler library does not link against it.
+class JfrCompressor {
+  private:
+    int _out_fd;
+    int _src_fd;
+    size_t _size;
+    pthread_t _thread;
+    bool _busy;
+    Mutex _lock;
+
+    static void* threadEntry(void* compressor) {
+        ((JfrCompressor*)compressor)->compress();
+        return NULL;
+    }
+
+    void compress();
+    void join();
+
+  public:
+    JfrCompressor(int out_fd) : _out_fd(out_fd), _src_fd(-1), _size(0), _busy(false) {
+    }
+
+    ~JfrCompressor() {
+        join();
+    }
+
+    static bool available();
+
+    // Starts compressing the first size bytes of src_fd, which must stay intact until the next submit() or wait()
+    void submit(int src_fd, size_t size);
+
+    // Blocks until the previously submitted chunk is written out; safe to call from any thread
+    void wait();
+};
+
+#endif // _JFRCOMPRESSOR_H
@@ -50,7 +50,8 @@ JfrMetadata::JfrMetadata() : Element("root") {
 
             << (type("jdk.types.StackTrace", T_STACK_TRACE, "Stacktrace")
                 << field("truncated", T_BOOLEAN, "Truncated")
-                << field("frames", T_STACK_FRAME, "Stack Frames", F_ARRAY))
+                << field("frames", T_STACK_FRAME, "Stack Frames", F_ARRAY)
+                << field("category", T_INT, "Category"))
 
             << (type("jdk.types.StackFrame", T_STACK_FRAME)
                 << field("method", T_METHOD, "Java Method", F_CPOOL)
@@ -87,12 +88,23 @@ JfrMetadata::JfrMetadata() : Element("root") {
             << (type("profiler.types.UserEventType", T_USER_EVENT_TYPE, "User-Defined Event Type", true)
                 << field("name", T_STRING, "Name"))
 
+            << (type("profiler.types.PerfCounter", T_PERF_COUNTER, "Hardware Counter", true)
+                << field("name", T_STRING, "Name"))
+
+            << (type("profiler.types.ContextTag", T_CONTEXT_TAG, "Context Tag", true)
+                << field("name", T_STRING, "Name"))
+
             << (type("jdk.ExecutionSample", T_EXECUTION_SAMPLE, "Method Profiling Sample")
                 << category("Java Virtual Machine", "Profiling")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
                 << field("sampledThread", T_THREAD, "Thread", F_CPOOL)
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
-                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL))
+                << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
+                << field("spanId", T_LONG, "Span ID")
+                << field("traceId", T_LONG, "Trace ID")
+                << field("contextTag", T_CONTEXT_TAG, "Context Tag", F_CPOOL)
+                << field("cpu", T_INT, "CPU")
+                << field("numaNode", T_INT, "NUMA Node"))
 
             << (type("jdk.ObjectAllocationInNewTLAB", T_ALLOC_IN_NEW_TLAB, "Allocation in new TLAB")
                 << category("Java Application")
@@ -139,6 +151,13 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("jvmSystem", T_FLOAT, "JVM System", F_PERCENTAGE)
                 << field("machineTotal", T_FLOAT, "Machine Total", F_PERCENTAGE))
 
+            << (type("jdk.ThreadCPULoad", T_THREAD_CPU_LOAD, "Thread CPU Load")
+                << category("Operating System", "Processor")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("user", T_FLOAT, "User Mode CPU Load", F_PERCENTAGE)
+                << field("system", T_FLOAT, "System Mode CPU Load", F_PERCENTAGE))
+
             << (type("jdk.ActiveRecording", T_ACTIVE_RECORDING, "Async-profiler Recording")
                 << category("Flight Recorder")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -230,7 +249,10 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("sampledThread", T_THREAD, "Thread", F_CPOOL)
                 << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
                 << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
-                << field("samples", T_INT, "Samples", F_UNSIGNED))
+                << field("samples", T_INT, "Samples", F_UNSIGNED)
+                << field("spanId", T_LONG, "Span ID")
+                << field("traceId", T_LONG, "Trace ID")
+                << field("contextTag", T_CONTEXT_TAG, "Context Tag", F_CPOOL))
 
             << (type("profiler.Malloc", T_MALLOC, "malloc")
                 << category("Java Virtual Machine", "Native Memory")
@@ -257,6 +279,76 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 // when encountering a T_BYTE/F_ARRAY.
                 << field("data", T_STRING, "User Data"))
 
+            << (type("profiler.StorageStatistics", T_STORAGE_STATISTICS, "Profiler Storage Statistics")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("traceCapacity", T_LONG, "Call Trace Table Capacity", F_UNSIGNED)
+                << field("traceCount", T_LONG, "Call Trace Count", F_UNSIGNED)
+                << field("maxLoad", T_FLOAT, "Max Shard Load", F_PERCENTAGE)
+                << field("averageProbe", T_FLOAT, "Average Probe Length")
+                << field("maxProbe", T_INT, "Max Probe Length", F_UNSIGNED)
+                << field("overflowSamples", T_LONG, "Storage Overflow Samples", F_UNSIGNED)
+                << field("sharedPrefixes", T_LONG, "Shared Prefixes", F_UNSIGNED)
+                << field("dictionaryKeys", T_LONG, "Dictionary Keys", F_UNSIGNED)
+                << field("dictionaryOverflowRows", T_INT, "Dictionary Overflow Rows", F_UNSIGNED))
+
+            << (type("profiler.SampleOverhead", T_SAMPLE_OVERHEAD, "Profiler Sample Overhead")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("phase", T_STRING, "Phase")
+                << field("samples", T_LONG, "Samples", F_UNSIGNED)
+                << field("average", T_LONG, "Average Time", F_DURATION_NANOS)
+                << field("p50", T_LONG, "50th Percentile", F_DURATION_NANOS)
+                << field("p99", T_LONG, "99th Percentile", F_DURATION_NANOS))
+
+            << (type("profiler.MallocBatch", T_MALLOC_BATCH, "Batched malloc and free")
+                << category("Java Virtual Machine", "Native Memory")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("entries", T_MALLOC_ENTRY, "Entries", F_ARRAY))
+
+            << (type("profiler.types.MallocEntry", T_MALLOC_ENTRY)
+                << field("timeDelta", T_LONG, "Time since the previous entry", F_DURATION_TICKS)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("address", T_LONG, "Address", F_ADDRESS)
+                << field("size", T_LONG, "Size, 0 for free", F_BYTES))
+
+            << (type("profiler.AllocationBatch", T_ALLOC_BATCH, "Batched allocations in new TLAB")
+                << category("Java Application")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("entries", T_ALLOC_ENTRY, "Entries", F_ARRAY))
+
+            << (type("profiler.types.AllocationEntry", T_ALLOC_ENTRY)
+                << field("timeDelta", T_LONG, "Time since the previous entry", F_DURATION_TICKS)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("objectClass", T_CLASS, "Object Class", F_CPOOL)
+                << field("allocationSize", T_LONG, "Allocation Size", F_BYTES)
+                << field("tlabSize", T_LONG, "TLAB Size", F_BYTES))
+
+            << (type("profiler.CounterSample", T_COUNTER_SAMPLE, "Hardware Counters of a Sample")
+                << category("Java Virtual Machine", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventThread", T_THREAD, "Event Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("counters", T_PERF_COUNTER_VALUE, "Counters", F_ARRAY))
+
+            << (type("profiler.types.PerfCounterValue", T_PERF_COUNTER_VALUE)
+                << field("counter", T_PERF_COUNTER, "Counter", F_CPOOL)
+                << field("value", T_LONG, "Value since the previous sample", F_UNSIGNED))
+
+            << (type("profiler.ChunkEventCount", T_CHUNK_EVENT_COUNT, "Events of the Chunk")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("eventType", T_STRING, "Event Type")
+                << field("count", T_LONG, "Count", F_UNSIGNED))
+
+            << (type("profiler.ChunkTopTrace", T_CHUNK_TOP_TRACE, "Most Sampled Trace of the Chunk")
+                << category("Profiler")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("samples", T_LONG, "Samples", F_UNSIGNED))
+
             << (type("jdk.jfr.Label", T_LABEL, NULL)
                 << field("value", T_STRING))
 
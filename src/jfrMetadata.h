@@ -41,6 +41,11 @@ enum JfrType {
     T_GC_WHEN = 32,
     T_LOG_LEVEL = 33,
     T_USER_EVENT_TYPE = 34,
+    T_MALLOC_ENTRY = 35,
+    T_ALLOC_ENTRY = 36,
+    T_PERF_COUNTER = 37,
+    T_PERF_COUNTER_VALUE = 38,
+    T_CONTEXT_TAG = 39,
 
     // types between T_EVENT and T_ANNOTATION inherit from jdk.jfr.Event, see JfrMetadata::type
     T_EVENT = 100,
@@ -65,6 +70,14 @@ enum JfrType {
     T_MALLOC = 119,
     T_FREE = 120,
     T_USER_EVENT = 121,
+    T_STORAGE_STATISTICS = 122,
+    T_SAMPLE_OVERHEAD = 123,
+    T_MALLOC_BATCH = 124,
+    T_ALLOC_BATCH = 125,
+    T_COUNTER_SAMPLE = 126,
+    T_CHUNK_EVENT_COUNT = 127,
+    T_CHUNK_TOP_TRACE = 128,
+    T_THREAD_CPU_LOAD = 129,
 
     // types after T_ANNOTATION inherit from java.lang.annotation.Annotation, see JfrMetadata::type
     T_ANNOTATION = 200,
@@ -0,0 +1,209 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "jfrStreamer.h"
+#include "log.h"
+#include "os.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+const size_t STREAM_BUFFER_SIZE = 64 * 1024;
+const int STREAM_SEND_TIMEOUT = 5;  // seconds
+
+
+JfrStreamer::JfrStreamer(const char* address) : _socket(-1), _head(0), _count(0), _sent(0), _dropped(0),
+                                                _lock(), _active(false) {
+    _address = strdup(address);
+}
+
+JfrStreamer::~JfrStreamer() {
+    if (_active) {
+        _lock.lock();
+        _active = false;
+        _lock.notify();
+        _lock.unlock();
+        pthread_join(_thread, NULL);
+    }
+
+    for (; _count > 0; _count--) {
+        close(_pending[_head]);
+        _head = (_head + 1) % MAX_PENDING_CHUNKS;
+    }
+
+    if (_socket >= 0) {
+        close(_socket);
+    }
+    free(_address);
+}
+
+bool JfrStreamer::connectCollector() {
+    int fd = -1;
+
+    if (strncmp(_address, "unix:", 5) == 0) {
+        const char* path = _address + 5;
+        struct sockaddr_un sun;
+        size_t path_len = strlen(path);
+        if (path_len == 0 || path_len >= sizeof(sun.sun_path)) {
+            return false;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        memcpy(sun.sun_path, path, path_len);
+        if (sun.sun_path[0] == '@') {
+            // Linux abstract namespace
+            sun.sun_path[0] = 0;
+        }
+
+        socklen_t addrlen = (socklen_t)(sizeof(sun) - sizeof(sun.sun_path) + path_len);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 && connect(fd, (struct sockaddr*)&sun, addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        // tcp://host:port, where host may be a bracketed IPv6 address
+        char host[256];
+        const char* host_start = _address + 6;
+        const char* port = strrchr(host_start, ':');
+        if (port == NULL || port == host_start || port - host_start >= (ptrdiff_t)sizeof(host)) {
+            return false;
+        }
+
+        size_t host_len = port - host_start;
+        if (host_start[0] == '[' && host_start[host_len - 1] == ']') {
+            host_start++;
+            host_len -= 2;
+        }
+        memcpy(host, host_start, host_len);
+        host[host_len] = 0;
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo* res;
+        if (getaddrinfo(host, port + 1, &hints, &res) != 0) {
+            return false;
+        }
+
+        for (struct addrinfo* ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0 &&
+                connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+    }
+
+    if (fd < 0) {
+        return false;
+    }
+
+    // Bound the time a stalled collector can hold the sender, and thus profiler stop
+    struct timeval tv = {STREAM_SEND_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    _socket = fd;
+    return true;
+}
+
+Error JfrStreamer::start() {
+    if (!connectCollector()) {
+        return Error("Could not connect to JFR collector");
+    }
+
+    _active = true;
+    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+        _active = false;
+        return Error("Unable to create JFR streamer thread");
+    }
+    return Error::OK;
+}
+
+bool JfrStreamer::sendChunk(int fd) {
+    if (_socket < 0 && !connectCollector()) {
+        return false;
+    }
+
+    char buf[STREAM_BUFFER_SIZE];
+    off_t offset = 0;
+    ssize_t bytes;
+    while ((bytes = pread(fd, buf, sizeof(buf), offset)) > 0) {
+        for (ssize_t sent = 0; sent < bytes; ) {
+            ssize_t result = send(_socket, buf + sent, bytes - sent, MSG_NOSIGNAL);
+            if (result <= 0) {
+                if (result < 0 && errno == EINTR) continue;
+                // A partially sent chunk spoils the stream; the collector sees a new connection next time
+                Log::warn("JFR collector connection lost: %s", strerror(errno));
+                close(_socket);
+                _socket = -1;
+                return false;
+            }
+            sent += result;
+        }
+        offset += bytes;
+    }
+    return true;
+}
+
+void JfrStreamer::run() {
+    _lock.lock();
+    while (_active || _count > 0) {
+        if (_count == 0) {
+            _lock.waitUntil(OS::micros() + 1000000);
+            continue;
+        }
+
+        int fd = _pending[_head];
+        _head = (_head + 1) % MAX_PENDING_CHUNKS;
+        _count--;
+        _lock.unlock();
+
+        bool success = sendChunk(fd);
+        close(fd);
+
+        _lock.lock();
+        if (success) {
+            _sent++;
+        } else {
+            _dropped++;
+        }
+    }
+    _lock.unlock();
+}
+
+void JfrStreamer::submit(int fd) {
+    MutexLocker ml(_lock);
+
+    if (_count == MAX_PENDING_CHUNKS) {
+        // Collector is too slow: drop the oldest chunk rather than block the recording
+        close(_pending[_head]);
+        _head = (_head + 1) % MAX_PENDING_CHUNKS;
+        _count--;
+        _dropped++;
+        Log::warn("JFR collector does not keep up, dropped a chunk");
+    }
+
+    _pending[(_head + _count) % MAX_PENDING_CHUNKS] = fd;
+    _count++;
+    _lock.notify();
+}
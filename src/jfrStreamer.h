@@ -0,0 +1,60 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _JFRSTREAMER_H
+#define _JFRSTREAMER_H
+
+#include <pthread.h>
+#include "arch.h"
+#include "arguments.h"
+#include "mutex.h"
+
+
+const int MAX_PENDING_CHUNKS = 4;
+
+// Sends finished JFR chunks to a remote collector at tcp://host:port or unix:/path.
+// Chunks are queued and sent by a background thread; when the collector cannot keep up,
+// the oldest pending chunk is dropped, so the recording never blocks on the network.
+class JfrStreamer {
+  private:
+    char* _address;
+    int _socket;
+    int _pending[MAX_PENDING_CHUNKS];
+    int _head;
+    int _count;
+    u64 _sent;
+    u64 _dropped;
+    WaitableMutex _lock;
+    pthread_t _thread;
+    bool _active;
+
+    static void* threadEntry(void* streamer) {
+        ((JfrStreamer*)streamer)->run();
+        return NULL;
+    }
+
+    bool connectCollector();
+    bool sendChunk(int fd);
+    void run();
+
+  public:
+    JfrStreamer(const char* address);
+    ~JfrStreamer();
+
+    Error start();
+
+    // Takes ownership of the chunk file descriptor
+    void submit(int fd);
+
+    u64 sent() const {
+        return _sent;
+    }
+
+    u64 dropped() const {
+        return _dropped;
+    }
+};
+
+#endif // _JFRSTREAMER_H
@@ -0,0 +1,98 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _LATENCYHISTOGRAM_H
+#define _LATENCYHISTOGRAM_H
+
+#include <string.h>
+#include "arch.h"
+
+
+// Values below 2^LATENCY_LINEAR_BITS have a bucket each; above, every power of two
+// is split into 2^LATENCY_SUB_BITS buckets, so that precision is within 1/16 of the value
+const int LATENCY_SUB_BITS = 4;
+const int LATENCY_LINEAR_BITS = LATENCY_SUB_BITS + 1;
+const int LATENCY_BUCKETS = (1 << LATENCY_LINEAR_BITS) + (64 - LATENCY_LINEAR_BITS) * (1 << LATENCY_SUB_BITS);
+
+// Log-linear histogram in the spirit of HdrHistogram. Updated concurrently without locks.
+class LatencyHistogram {
+  private:
+    volatile u64 _count;
+    volatile u64 _total;
+    volatile u64 _max;
+    volatile u64 _buckets[LATENCY_BUCKETS];
+
+  public:
+    static int bucketOf(u64 value) {
+        if (value < (1ULL << LATENCY_LINEAR_BITS)) {
+            return (int)value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int sub = (int)(value >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+        return (1 << LATENCY_LINEAR_BITS) + ((msb - LATENCY_LINEAR_BITS) << LATENCY_SUB_BITS) + sub;
+    }
+
+    // The highest value that falls into the bucket
+    static u64 bucketLimit(int bucket) {
+        if (bucket < (1 << LATENCY_LINEAR_BITS)) {
+            return (u64)bucket;
+        }
+        int index = bucket - (1 << LATENCY_LINEAR_BITS);
+        int msb = (index >> LATENCY_SUB_BITS) + LATENCY_LINEAR_BITS;
+        u64 sub = (u64)(index & ((1 << LATENCY_SUB_BITS) - 1));
+        u64 low = ((1ULL << LATENCY_SUB_BITS) | sub) << (msb - LATENCY_SUB_BITS);
+        return low + (1ULL << (msb - LATENCY_SUB_BITS)) - 1;
+    }
+
+    void reset() {
+        memset((void*)this, 0, sizeof(LatencyHistogram));
+    }
+
+    void record(u64 value) {
+        atomicInc(_buckets[bucketOf(value)]);
+        atomicInc(_count);
+        atomicInc(_total, value);
+
+        u64 max;
+        while (value > (max = _max) && !__sync_bool_compare_and_swap(&_max, max, value)) {
+            // retry
+        }
+    }
+
+    u64 count() const {
+        return _count;
+    }
+
+    u64 total() const {
+        return _total;
+    }
+
+    u64 max() const {
+        return _max;
+    }
+
+    // Returns the value not exceeded by the given fraction of recorded values
+    u64 percentile(double fraction) const {
+        u64 count = _count;
+        if (count == 0) {
+            return 0;
+        }
+
+        u64 threshold = (u64)(fraction * count + 0.5);
+        if (threshold == 0) threshold = 1;
+
+        u64 seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += _buckets[i];
+            if (seen >= threshold) {
+                u64 limit = bucketLimit(i);
+                return limit < _max ? limit : _max;
+            }
+        }
+        return _max;
+    }
+};
+
+#endif // _LATENCYHISTOGRAM_H
@@ -9,37 +9,89 @@
 
 LinearAllocator::LinearAllocator(size_t chunk_size) {
     _chunk_size = chunk_size;
-    _reserve = _tail = allocateChunk(NULL);
+    _huge_pages = false;
+    _backing = 0;
+    _nodes = OS::getNumaNodeCount();
+    if (_nodes > MAX_NUMA_NODES) {
+        _nodes = MAX_NUMA_NODES;
+    }
+
+    for (int i = 0; i < MAX_NUMA_NODES; i++) {
+        _chains[i].tail = NULL;
+        _chains[i].reserve = NULL;
+        _chains[i].node = i;
+    }
+    _chains[0].reserve = _chains[0].tail = allocateChunk(&_chains[0], NULL);
 }
 
 LinearAllocator::~LinearAllocator() {
     clear();
-    freeChunk(_tail);
+    freeChunk(_chains[0].tail);
 }
 
 void LinearAllocator::clear() {
-    if (_reserve->prev == _tail) {
-        freeChunk(_reserve);
+    for (int i = 0; i < _nodes; i++) {
+        ChunkChain* chain = &_chains[i];
+        if (chain->tail == NULL) {
+            continue;
+        }
+
+        if (chain->reserve->prev == chain->tail) {
+            freeChunk(chain->reserve);
+        }
+        while (chain->tail->prev != NULL) {
+            Chunk* current = chain->tail;
+            chain->tail = chain->tail->prev;
+            freeChunk(current);
+        }
+
+        if (i == 0) {
+            // The first chunk of the first node is always kept
+            chain->reserve = chain->tail;
+            chain->tail->offs = sizeof(Chunk);
+        } else {
+            freeChunk(chain->tail);
+            chain->reserve = chain->tail = NULL;
+        }
     }
-    while (_tail->prev != NULL) {
-        Chunk* current = _tail;
-        _tail = _tail->prev;
-        freeChunk(current);
+}
+
+void LinearAllocator::setHugePages(bool enabled) {
+    if (enabled) {
+        // Initialize before the first allocation from a signal handler
+        OS::getHugePageSize();
     }
-    _reserve = _tail;
-    _tail->offs = sizeof(Chunk);
+    _huge_pages = enabled;
 }
 
 size_t LinearAllocator::usedMemory() {
-    size_t bytes = _reserve->prev == _tail ? _chunk_size : 0;
-    for (Chunk* chunk = _tail; chunk != NULL; chunk = chunk->prev) {
+    size_t bytes = 0;
+    for (int i = 0; i < _nodes; i++) {
+        bytes += usedMemory(i);
+    }
+    return bytes;
+}
+
+size_t LinearAllocator::usedMemory(int node) {
+    if (node >= _nodes || _chains[node].tail == NULL) {
+        return 0;
+    }
+
+    ChunkChain* chain = &_chains[node];
+
+    size_t bytes = chain->reserve->prev == chain->tail ? _chunk_size : 0;
+    for (Chunk* chunk = chain->tail; chunk != NULL; chunk = chunk->prev) {
         bytes += _chunk_size;
     }
     return bytes;
 }
 
 void* LinearAllocator::alloc(size_t size) {
-    Chunk* chunk = _tail;
+    ChunkChain* chain = &_chains[_nodes > 1 ? OS::getNumaNode() % _nodes : 0];
+    Chunk* chunk = chain->tail;
+    if (chunk == NULL && (chunk = getNextChunk(chain, NULL)) == NULL) {
+        return NULL;
+    }
 
     do {
         // Fast path: bump a pointer with CAS
@@ -47,19 +99,25 @@ void* LinearAllocator::alloc(size_t size) {
             if (__sync_bool_compare_and_swap(&chunk->offs, offs, offs + size)) {
                 if (_chunk_size / 2 - offs < size) {
                     // Stepped over a middle of the chunk - it's time to prepare a new one
-                    reserveChunk(chunk);
+                    reserveChunk(chain, chunk);
                 }
                 return (char*)chunk + offs;
             }
         }
-    } while ((chunk = getNextChunk(chunk)) != NULL);
+    } while ((chunk = getNextChunk(chain, chunk)) != NULL);
 
     return NULL;
 }
 
-Chunk* LinearAllocator::allocateChunk(Chunk* current) {
-    Chunk* chunk = (Chunk*)OS::safeAlloc(_chunk_size);
+Chunk* LinearAllocator::allocateChunk(ChunkChain* chain, Chunk* current) {
+    int backing = PAGES_REGULAR;
+    Chunk* chunk = (Chunk*)(_huge_pages ? OS::safeAllocHuge(_chunk_size, &backing) : OS::safeAlloc(_chunk_size));
     if (chunk != NULL) {
+        __sync_fetch_and_or(&_backing, backing);
+        if (_nodes > 1) {
+            // Set the policy before the first touch, which is when a page is actually placed
+            OS::bindToNumaNode(chunk, _chunk_size, chain->node);
+        }
         chunk->prev = current;
         chunk->offs = sizeof(Chunk);
     }
@@ -70,27 +128,27 @@ void LinearAllocator::freeChunk(Chunk* current) {
     OS::safeFree(current, _chunk_size);
 }
 
-void LinearAllocator::reserveChunk(Chunk* current) {
-    Chunk* reserve = allocateChunk(current);
-    if (reserve != NULL && !__sync_bool_compare_and_swap(&_reserve, current, reserve)) {
+void LinearAllocator::reserveChunk(ChunkChain* chain, Chunk* current) {
+    Chunk* reserve = allocateChunk(chain, current);
+    if (reserve != NULL && !__sync_bool_compare_and_swap(&chain->reserve, current, reserve)) {
         // Unlikely case that we are too late
         freeChunk(reserve);
     }
 }
 
-Chunk* LinearAllocator::getNextChunk(Chunk* current) {
-    Chunk* reserve = _reserve;
+Chunk* LinearAllocator::getNextChunk(ChunkChain* chain, Chunk* current) {
+    Chunk* reserve = chain->reserve;
 
     if (reserve == current) {
         // Unlikely case: no reserve yet.
         // It's probably being allocated right now, so let's compete
-        reserve = allocateChunk(current);
+        reserve = allocateChunk(chain, current);
         if (reserve == NULL) {
             // Not enough memory
             return NULL;
         }
 
-        Chunk* prev_reserve = __sync_val_compare_and_swap(&_reserve, current, reserve);
+        Chunk* prev_reserve = __sync_val_compare_and_swap(&chain->reserve, current, reserve);
         if (prev_reserve != current) {
             freeChunk(reserve);
             reserve = prev_reserve;
@@ -98,6 +156,6 @@ Chunk* LinearAllocator::getNextChunk(Chunk* current) {
     }
 
     // Expected case: a new chunk is already reserved
-    Chunk* tail = __sync_val_compare_and_swap(&_tail, current, reserve);
+    Chunk* tail = __sync_val_compare_and_swap(&chain->tail, current, reserve);
     return tail == current ? reserve : tail;
 }
@@ -16,16 +16,32 @@ struct Chunk {
     char _padding[56];
 };
 
+const int MAX_NUMA_NODES = 8;
+
+// Chain of chunks placed on one NUMA node
+struct ChunkChain {
+    Chunk* tail;
+    Chunk* reserve;
+    int node;
+    // To avoid false sharing
+    char _padding[44];
+};
+
+// Memory is allocated from the chain of the NUMA node the current thread runs on,
+// so that call trace data is written and later read from local memory.
+// Chunks of a node other than the first are allocated lazily.
 class LinearAllocator {
   private:
     size_t _chunk_size;
-    Chunk* _tail;
-    Chunk* _reserve;
+    int _nodes;
+    bool _huge_pages;
+    volatile int _backing;
+    ChunkChain _chains[MAX_NUMA_NODES];
 
-    Chunk* allocateChunk(Chunk* current);
+    Chunk* allocateChunk(ChunkChain* chain, Chunk* current);
     void freeChunk(Chunk* current);
-    void reserveChunk(Chunk* current);
-    Chunk* getNextChunk(Chunk* current);
+    void reserveChunk(ChunkChain* chain, Chunk* current);
+    Chunk* getNextChunk(ChunkChain* chain, Chunk* current);
 
   public:
     LinearAllocator(size_t chunk_size);
@@ -33,6 +49,15 @@ class LinearAllocator {
 
     void clear();
     size_t usedMemory();
+    size_t usedMemory(int node);
+
+    // New chunks will be backed by huge pages when possible
+    void setHugePages(bool enabled);
+
+    // Bitmask of PageBacking kinds of the chunks allocated so far
+    int backing() {
+        return _backing;
+    }
 
     void* alloc(size_t size);
 };
@@ -6,9 +6,11 @@
 #include <pthread.h>
 #include <string.h>
 #include "lockTracer.h"
+#include "classIdCache.h"
 #include "incbin.h"
 #include "profiler.h"
 #include "tsc.h"
+#include "vmStructs.h"
 
 
 // On 64-bit platforms, we can store lock time in a pthread local.
@@ -19,11 +21,19 @@ static pthread_key_t lock_tracer_tls = (pthread_key_t)0;
 
 INCLUDE_HELPER_CLASS(LOCK_TRACER_NAME, LOCK_TRACER_CLASS, "one/profiler/LockTracer")
 
+// Lock classes are encoded as class_id << 1 | concurrent, where concurrent marks
+// the synchronizers traced on Unsafe.park()
+static const u32 LOCK_CLASS_CONCURRENT = 1;
+
+static ClassIdCache lock_class_cache;
+
 
 bool LockTracer::_initialized = false;
 double LockTracer::_ticks_to_nanos;
 u64 LockTracer::_interval;
-volatile u64 LockTracer::_total_duration;  // for interval sampling
+EventCounter LockTracer::_total_duration;  // for interval sampling
+EventCounter LockTracer::_total_park_duration;
+u64 LockTracer::_park_threshold;
 u64 LockTracer::_start_time = 0;
 
 jclass LockTracer::_Unsafe = NULL;
@@ -39,7 +49,12 @@ Error LockTracer::start(Arguments& args) {
     // There is a JVM here, so TSC::frequency is calibrated from it
     _ticks_to_nanos = 1e9 / TSC::frequency();
     _interval = (u64)(args._lock * (TSC::frequency() / 1e9));
-    _total_duration = 0;
+    _total_duration.reset(_interval, OS::nanotime());
+    _total_park_duration.reset(_interval, OS::nanotime());
+    _park_threshold = (u64)(args._park_threshold * (TSC::frequency() / 1e9));
+
+    // Klass* of classes unloaded since the previous session may have been reused
+    lock_class_cache.reset();
 
     jvmtiEnv* jvmti = VM::jvmti();
     JNIEnv* env = VM::jni();
@@ -180,9 +195,8 @@ void JNICALL LockTracer::MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, j
     // When the duration accumulator overflows _interval, the event is sampled.
     const u64 duration = entered_time - enter_time;
     if (updateCounter(_total_duration, duration, _interval)) {
-        char* lock_name = getLockName(jvmti, env, object);
-        recordContendedLock(LOCK_SAMPLE, enter_time, entered_time, lock_name, object, 0);
-        jvmti->Deallocate((unsigned char*)lock_name);
+        u32 lock_class = getLockClass(jvmti, env, object);
+        recordContendedLock(LOCK_SAMPLE, enter_time, entered_time, lock_class, object, 0);
     }
 }
 
@@ -199,34 +213,32 @@ jint JNICALL LockTracer::RegisterNativesHook(JNIEnv* env, jclass cls, const JNIN
     return _orig_register_natives(env, cls, methods, nMethods);
 }
 
+// Parks are sampled by duration before looking at the blocker: most of them are short
+// or unrelated to locks, e.g. idle ForkJoinPool workers, and do not deserve any JNI call.
+// The blocker is still set when Unsafe.park() returns to LockSupport.
 void JNICALL LockTracer::UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time) {
-    while (_enabled) {
-        jvmtiEnv* jvmti = VM::jvmti();
-        jobject park_blocker = getParkBlocker(jvmti, env);
-        if (park_blocker == NULL) {
-            break;
-        }
-
-        char* lock_name = getLockName(jvmti, env, park_blocker);
-        if (lock_name == NULL || !isConcurrentLock(lock_name)) {
-            jvmti->Deallocate((unsigned char*)lock_name);
-            break;
-        }
-
-        u64 park_start_time = TSC::ticks();
+    if (!_enabled) {
         _orig_unsafe_park(env, instance, isAbsolute, time);
-        u64 park_end_time = TSC::ticks();
+        return;
+    }
 
-        const u64 duration = park_end_time - park_start_time;
-        if (updateCounter(_total_duration, duration, _interval)) {
-            recordContendedLock(PARK_SAMPLE, park_start_time, park_end_time, lock_name, park_blocker, time);
-        }
+    u64 park_start_time = TSC::ticks();
+    _orig_unsafe_park(env, instance, isAbsolute, time);
+    u64 park_end_time = TSC::ticks();
 
-        jvmti->Deallocate((unsigned char*)lock_name);
+    const u64 duration = park_end_time - park_start_time;
+    if (duration < _park_threshold || !updateCounter(_total_park_duration, duration, _interval)) {
         return;
     }
 
-    _orig_unsafe_park(env, instance, isAbsolute, time);
+    jvmtiEnv* jvmti = VM::jvmti();
+    jobject park_blocker = getParkBlocker(jvmti, env);
+    if (park_blocker != NULL) {
+        u32 lock_class = getLockClass(jvmti, env, park_blocker);
+        if (lock_class & LOCK_CLASS_CONCURRENT) {
+            recordContendedLock(PARK_SAMPLE, park_start_time, park_end_time, lock_class, park_blocker, time);
+        }
+    }
 }
 
 jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env) {
@@ -237,12 +249,46 @@ jobject LockTracer::getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env) {
     return env->GetObjectField(thread, _parkBlocker);
 }
 
-char* LockTracer::getLockName(jvmtiEnv* jvmti, JNIEnv* env, jobject lock) {
-    char* class_name;
-    if (jvmti->GetClassSignature(env->GetObjectClass(lock), &class_name, NULL) != 0) {
-        return NULL;
+// Returns class_id << 1 | concurrent flag of the lock object, or 0 if the class is unknown
+u32 LockTracer::getLockClass(jvmtiEnv* jvmti, JNIEnv* env, jobject lock) {
+    Dictionary* class_map = Profiler::instance()->classMap();
+
+    if (VMStructs::hasClassNames()) {
+        // Resolve the name from the VM structures, and only once per class
+        uintptr_t klass = (uintptr_t)VMKlass::fromOop(*(uintptr_t*)lock);
+        u32 lock_class = lock_class_cache.get(klass);
+        if (lock_class == 0) {
+            VMSymbol* symbol = ((VMKlass*)klass)->name();
+            char name[256];
+            size_t length = symbol->length() < sizeof(name) - 2 ? symbol->length() : sizeof(name) - 3;
+            name[0] = 'L';
+            memcpy(name + 1, symbol->body(), length);
+            name[length + 1] = ';';
+            name[length + 2] = 0;
+
+            lock_class = class_map->lookup(name + 1, length) << 1 | (isConcurrentLock(name) ? LOCK_CLASS_CONCURRENT : 0);
+            lock_class_cache.put(klass, lock_class);
+        }
+        return lock_class;
+    }
+
+    char* lock_name;
+    if (jvmti->GetClassSignature(env->GetObjectClass(lock), &lock_name, NULL) != 0) {
+        return 0;
+    }
+
+    u32 lock_class;
+    if (lock_name[0] == 'L') {
+        lock_class = class_map->lookup(lock_name + 1, strlen(lock_name) - 2) << 1;
+    } else {
+        lock_class = class_map->lookup(lock_name) << 1;
     }
-    return class_name;
+    if (isConcurrentLock(lock_name)) {
+        lock_class |= LOCK_CLASS_CONCURRENT;
+    }
+
+    jvmti->Deallocate((unsigned char*)lock_name);
+    return lock_class;
 }
 
 bool LockTracer::isConcurrentLock(const char* lock_name) {
@@ -252,22 +298,14 @@ bool LockTracer::isConcurrentLock(const char* lock_name) {
 }
 
 void LockTracer::recordContendedLock(EventType event_type, u64 start_time, u64 end_time,
-                                     const char* lock_name, jobject lock, jlong timeout) {
+                                     u32 lock_class, jobject lock, jlong timeout) {
     LockEvent event;
-    event._class_id = 0;
+    event._class_id = lock_class >> 1;
     event._start_time = start_time;
     event._end_time = end_time;
     event._address = *(uintptr_t*)lock;
     event._timeout = timeout;
 
-    if (lock_name != NULL) {
-        if (lock_name[0] == 'L') {
-            event._class_id = Profiler::instance()->classMap()->lookup(lock_name + 1, strlen(lock_name) - 2);
-        } else {
-            event._class_id = Profiler::instance()->classMap()->lookup(lock_name);
-        }
-    }
-
     u64 duration_nanos = (u64)((end_time - start_time) * _ticks_to_nanos);
     Profiler::instance()->recordSample(NULL, duration_nanos, event_type, &event);
 }
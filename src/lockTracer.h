@@ -20,7 +20,9 @@ class LockTracer : public Engine {
     static bool _initialized;
     static double _ticks_to_nanos;
     static u64 _interval;
-    static volatile u64 _total_duration;
+    static EventCounter _total_duration;
+    static EventCounter _total_park_duration;
+    static u64 _park_threshold;
     static u64 _start_time;
 
     static jclass _Unsafe;
@@ -40,11 +42,11 @@ class LockTracer : public Engine {
     static void JNICALL UnsafeParkHook(JNIEnv* env, jobject instance, jboolean isAbsolute, jlong time);
 
     static jobject getParkBlocker(jvmtiEnv* jvmti, JNIEnv* env);
-    static char* getLockName(jvmtiEnv* jvmti, JNIEnv* env, jobject lock);
+    static u32 getLockClass(jvmtiEnv* jvmti, JNIEnv* env, jobject lock);
     static bool isConcurrentLock(const char* lock_name);
 
     static void recordContendedLock(EventType event_type, u64 start_time, u64 end_time,
-                                    const char* lock_name, jobject lock, jlong timeout);
+                                    u32 lock_class, jobject lock, jlong timeout);
 
   public:
     const char* type() {
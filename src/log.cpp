@@ -3,13 +3,30 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "log.h"
+#include "logRing.h"
 #include "profiler.h"
 
 
+// Messages below WARN are written to the log file by a background thread
+const u64 LOG_DRAIN_INTERVAL = 10000000;  // 10 ms
+const int LOG_DRAINER_IDLE_ROUNDS = 100;
+
+enum DrainerState {
+    DRAINER_NONE,
+    DRAINER_RUNNING,
+    DRAINER_PARKED
+};
+
+static LogRing log_ring;
+
+
 const char* const Log::LEVEL_NAME[] = {
     "TRACE",
     "DEBUG",
@@ -22,6 +39,8 @@ const char* const Log::LEVEL_NAME[] = {
 Mutex Log::_lock;
 int Log::_fd = STDOUT_FILENO;
 LogLevel Log::_level = LOG_INFO;
+volatile int Log::_drainer_state = DRAINER_NONE;
+int Log::_wakeup_pipe[2] = {-1, -1};
 
 
 void Log::open(Arguments& args) {
@@ -44,6 +63,7 @@ void Log::open(const char* file_name, const char* level) {
     }
 
     MutexLocker ml(_lock);
+    drainLocked();
     _level = l;
 
     if (_fd > STDERR_FILENO) {
@@ -62,18 +82,19 @@ void Log::open(const char* file_name, const char* level) {
 
 void Log::close() {
     MutexLocker ml(_lock);
+    drainLocked();
     if (_fd > STDERR_FILENO) {
         ::close(_fd);
         _fd = STDOUT_FILENO;
     }
 }
 
-void Log::writeRaw(LogLevel level, const char* msg, size_t len) {
+void Log::flush() {
     MutexLocker ml(_lock);
-    if (level < _level) {
-        return;
-    }
+    drainLocked();
+}
 
+void Log::writeLocked(const char* msg, size_t len) {
     while (len > 0) {
         ssize_t bytes = ::write(_fd, msg, len);
         if (bytes <= 0) {
@@ -84,6 +105,102 @@ void Log::writeRaw(LogLevel level, const char* msg, size_t len) {
     }
 }
 
+// Writes queued messages in order; returns false if there were none
+bool Log::drainLocked() {
+    bool drained = false;
+    for (LogRecord* record; (record = log_ring.peek()) != NULL; log_ring.pop(record)) {
+        writeLocked(record->text, record->len);
+        drained = true;
+    }
+
+    u64 dropped = log_ring.takeDropped();
+    if (dropped > 0) {
+        char buf[64];
+        writeLocked(buf, snprintf(buf, sizeof(buf), "[WARN] %llu log messages dropped\n", (unsigned long long)dropped));
+        drained = true;
+    }
+    return drained;
+}
+
+static void flushLogAtExit() {
+    Log::flush();
+}
+
+// Called after a message is queued. The drainer thread is created once;
+// when idle, it parks on a pipe, which costs a write only for the first message after a pause.
+void Log::wakeDrainer() {
+    int state = _drainer_state;
+    if (state == DRAINER_RUNNING) {
+        return;
+    }
+
+    if (state == DRAINER_PARKED) {
+        if (__sync_bool_compare_and_swap(&_drainer_state, DRAINER_PARKED, DRAINER_RUNNING)) {
+            char c = 0;
+            ssize_t result = ::write(_wakeup_pipe[1], &c, 1);
+            (void)result;
+        }
+        return;
+    }
+
+    if (__sync_bool_compare_and_swap(&_drainer_state, DRAINER_NONE, DRAINER_RUNNING)) {
+        if (pipe(_wakeup_pipe) != 0) {
+            _wakeup_pipe[0] = _wakeup_pipe[1] = -1;
+        }
+        atexit(flushLogAtExit);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, drainerEntry, NULL) == 0) {
+            pthread_detach(thread);
+        } else {
+            // Queued messages will be written along with the next synchronous one
+            if (_wakeup_pipe[0] >= 0) {
+                ::close(_wakeup_pipe[0]);
+                ::close(_wakeup_pipe[1]);
+            }
+            _drainer_state = DRAINER_NONE;
+        }
+    }
+}
+
+void* Log::drainerEntry(void* unused) {
+    for (int idle_rounds = 0; ; OS::sleep(LOG_DRAIN_INTERVAL)) {
+        {
+            MutexLocker ml(_lock);
+            idle_rounds = drainLocked() ? 0 : idle_rounds + 1;
+        }
+
+        if (idle_rounds >= LOG_DRAINER_IDLE_ROUNDS && _wakeup_pipe[0] >= 0) {
+            _drainer_state = DRAINER_PARKED;
+            __sync_synchronize();
+
+            // A producer could have queued a message before seeing the new state
+            bool empty;
+            {
+                MutexLocker ml(_lock);
+                empty = log_ring.peek() == NULL;
+            }
+            if (empty || !__sync_bool_compare_and_swap(&_drainer_state, DRAINER_PARKED, DRAINER_RUNNING)) {
+                char c;
+                while (read(_wakeup_pipe[0], &c, 1) < 0 && errno == EINTR);  // restart if interrupted
+            }
+            idle_rounds = 0;
+        }
+    }
+    return NULL;
+}
+
+void Log::writeRaw(LogLevel level, const char* msg, size_t len) {
+    MutexLocker ml(_lock);
+    if (level < _level) {
+        return;
+    }
+
+    // Keep the order with messages still in the queue
+    drainLocked();
+    writeLocked(msg, len);
+}
+
 void Log::log(LogLevel level, const char* msg, va_list args) {
     char buf[1024];
 
@@ -100,9 +217,13 @@ void Log::log(LogLevel level, const char* msg, va_list args) {
         Profiler::instance()->writeLog(level, buf + prefix_len, msg_len);
     }
 
-    // Write a message with a prefix to a file
-    if (level >= _level) {
+    // Write a message with a prefix to a file. Warnings and errors are written immediately,
+    // less important messages are queued without blocking the caller.
+    if (level >= LOG_WARN) {
         writeRaw(level, buf, prefix_len + msg_len + 1);
+    } else if (level >= _level) {
+        log_ring.push(level, buf, prefix_len + msg_len + 1);
+        wakeDrainer();
     }
 }
 
@@ -33,6 +33,13 @@ class Log {
     static Mutex _lock;
     static int _fd;
     static LogLevel _level;
+    static volatile int _drainer_state;
+    static int _wakeup_pipe[2];
+
+    static void writeLocked(const char* msg, size_t len);
+    static bool drainLocked();
+    static void wakeDrainer();
+    static void* drainerEntry(void* unused);
 
   public:
     static const char* const LEVEL_NAME[];
@@ -40,6 +47,7 @@ class Log {
     static void open(Arguments& args);
     static void open(const char* file_name, const char* level);
     static void close();
+    static void flush();
 
     static void log(LogLevel level, const char* msg, va_list args);
     static void writeRaw(LogLevel level, const char* msg, size_t len);
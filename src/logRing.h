@@ -0,0 +1,91 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _LOGRING_H
+#define _LOGRING_H
+
+#include <string.h>
+#include "arch.h"
+
+
+const u32 LOG_RING_SIZE = 64;
+const u32 LOG_RECORD_SIZE = 1024;
+
+struct LogRecord {
+    u64 seq;
+    int level;
+    u32 len;
+    char text[LOG_RECORD_SIZE];
+};
+
+// Bounded lock-free multi-producer single-consumer queue of formatted log messages.
+// A slot is free for the producer at position N when its seq equals N,
+// and ready for the consumer when seq equals N + 1. Producers never wait:
+// a message that does not fit into the full ring is counted and dropped.
+// The consumer side must be serialized by the caller.
+class LogRing {
+  private:
+    LogRecord _records[LOG_RING_SIZE];
+    volatile u64 _head;
+    char _padding[56];
+    u64 _tail;
+    volatile u64 _dropped;
+
+  public:
+    LogRing() {
+        reset();
+    }
+
+    void reset() {
+        for (u32 i = 0; i < LOG_RING_SIZE; i++) {
+            _records[i].seq = i;
+        }
+        _head = 0;
+        _tail = 0;
+        _dropped = 0;
+    }
+
+    bool push(int level, const char* text, size_t len) {
+        if (len > LOG_RECORD_SIZE) {
+            len = LOG_RECORD_SIZE;
+        }
+
+        while (true) {
+            u64 pos = _head;
+            LogRecord* record = &_records[pos % LOG_RING_SIZE];
+            u64 seq = loadAcquire(record->seq);
+            if (seq == pos) {
+                if (__sync_bool_compare_and_swap(&_head, pos, pos + 1)) {
+                    record->level = level;
+                    record->len = (u32)len;
+                    memcpy(record->text, text, len);
+                    storeRelease(record->seq, pos + 1);
+                    return true;
+                }
+            } else if (seq < pos) {
+                // The slot still holds a message from the previous lap
+                atomicInc(_dropped);
+                return false;
+            }
+        }
+    }
+
+    LogRecord* peek() {
+        LogRecord* record = &_records[_tail % LOG_RING_SIZE];
+        return loadAcquire(record->seq) == _tail + 1 ? record : NULL;
+    }
+
+    void pop(LogRecord* record) {
+        storeRelease(record->seq, _tail + LOG_RING_SIZE);
+        _tail++;
+    }
+
+    // Returns the number of messages dropped since the previous call
+    u64 takeDropped() {
+        return __sync_lock_test_and_set(&_dropped, 0);
+    }
+};
+
+#endif // _LOGRING_H
@@ -8,14 +8,19 @@
 
 #ifdef __linux__
 
+#include <time.h>
 #include "../fdtransfer.h"
 
 class FdTransferServer {
   private:
     static int _server;
     static int _peer;
+    static int _kallsyms_cache;
+    static time_t _kallsyms_time;
 
     static int copyFile(const char* src_name, const char* dst_name, mode_t mode);
+    static int copyKallsyms(int* fd);
+    static void cacheKallsyms();
     static bool sendFd(int fd, struct fd_response *resp, size_t resp_size);
 
     static bool bindServer(struct sockaddr_un *sun, socklen_t addrlen, int accept_timeout);
@@ -24,8 +24,13 @@
 #include "../jattach/psutil.h"
 
 
+// A shared server reuses its copy of /proc/kallsyms for this long
+const int KALLSYMS_CACHE_TTL = 60;
+
 int FdTransferServer::_server;
 int FdTransferServer::_peer;
+int FdTransferServer::_kallsyms_cache = -1;
+time_t FdTransferServer::_kallsyms_time = 0;
 
 bool FdTransferServer::bindServer(struct sockaddr_un *sun, socklen_t addrlen, int accept_timeout) {
     _server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
@@ -50,7 +55,8 @@ bool FdTransferServer::bindServer(struct sockaddr_un *sun, socklen_t addrlen, in
         return false;
     }
 
-    if (listen(_server, 1) < 0) {
+    // A shared server may be approached by many agents at once
+    if (listen(_server, SOMAXCONN) < 0) {
         perror("FdTransfer listen()");
         close(_server);
         return false;
@@ -154,22 +160,16 @@ bool FdTransferServer::serveRequests(int peer_pid) {
         }
 
         case KALLSYMS_FD: {
-            // can't directly pass the fd of /proc/kallsyms, because before Linux 4.15 the permission check
-            // was conducted on each read.
-            // it's simpler to copy the file to a temporary location and pass the fd of it (compared to passing the
-            // entire contents over the peer socket)
-            char tmp_path[256];
-            snprintf(tmp_path, sizeof(tmp_path), "/tmp/async-profiler-kallsyms.%d", getpid());
-
             int kallsyms_fd = -1;
-            int error = copyFile("/proc/kallsyms", tmp_path, 0600);
-            if (error == 0) {
-                kallsyms_fd = open(tmp_path, O_RDONLY);
-                if (kallsyms_fd == -1) {
-                    error = errno;
-                } else {
-                    unlink(tmp_path);
-                }
+            int error;
+            if (_kallsyms_cache >= 0) {
+                // Reopen rather than dup, so that every peer gets its own file offset
+                char fd_path[64];
+                snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", _kallsyms_cache);
+                kallsyms_fd = open(fd_path, O_RDONLY);
+                error = kallsyms_fd == -1 ? errno : 0;
+            } else {
+                error = copyKallsyms(&kallsyms_fd);
             }
 
             struct fd_response resp;
@@ -215,6 +215,41 @@ int FdTransferServer::copyFile(const char* src_name, const char* dst_name, mode_
     return 0;
 }
 
+int FdTransferServer::copyKallsyms(int* fd) {
+    // can't directly pass the fd of /proc/kallsyms, because before Linux 4.15 the permission check
+    // was conducted on each read.
+    // it's simpler to copy the file to a temporary location and pass the fd of it (compared to passing the
+    // entire contents over the peer socket)
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "/tmp/async-profiler-kallsyms.%d", getpid());
+
+    int error = copyFile("/proc/kallsyms", tmp_path, 0600);
+    if (error == 0) {
+        *fd = open(tmp_path, O_RDONLY);
+        if (*fd == -1) {
+            error = errno;
+        } else {
+            unlink(tmp_path);
+        }
+    }
+    return error;
+}
+
+void FdTransferServer::cacheKallsyms() {
+    time_t now = time(NULL);
+    if (_kallsyms_cache >= 0 && now - _kallsyms_time < KALLSYMS_CACHE_TTL) {
+        return;
+    }
+
+    // Kernel modules may have been loaded since the last copy
+    int fd;
+    if (copyKallsyms(&fd) == 0) {
+        if (_kallsyms_cache >= 0) close(_kallsyms_cache);
+        _kallsyms_cache = fd;
+        _kallsyms_time = now;
+    }
+}
+
 bool FdTransferServer::sendFd(int fd, struct fd_response *resp, size_t resp_size) {
     struct msghdr msg = {0};
 
@@ -308,6 +343,11 @@ bool FdTransferServer::runLoop(const char *path) {
         return false;
     }
 
+    // A stale socket file is left behind if the previous server was killed
+    if (sun.sun_path[0] != '\0') {
+        unlink(sun.sun_path);
+    }
+
     if (!FdTransferServer::bindServer(&sun, addrlen, 0)) {
         return false;
     }
@@ -327,6 +367,10 @@ bool FdTransferServer::runLoop(const char *path) {
         }
 
         printf("Serving PID %d\n", peer_pid);
+        fflush(stdout);
+
+        // Served peers inherit the cached copy of kallsyms
+        cacheKallsyms();
 
         // We fork(), to actually move a PID namespace.
         if (fork() == 0) {
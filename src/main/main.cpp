@@ -6,16 +6,21 @@
 #include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "fdtransferServer.h"
+#include "../controlSocket.h"
+#include "../jattach/psutil.h"
 
 
 #ifdef __APPLE__
@@ -24,6 +29,7 @@
 
 
 #define APP_BINARY "asprof"
+#define DEFAULT_FDTRANSFER_PATH "@asprof-fdtransfer"
 
 static const char VERSION_STRING[] =
     "Async-profiler " PROFILER_VERSION " built on " __DATE__ "\n";
@@ -39,10 +45,12 @@ static const char USAGE_STRING[] =
     "  status            print profiling status\n"
     "  meminfo           print profiler memory stats\n"
     "  list              list profiling events supported by the target JVM\n"
+    "  snapshot          remember the collected profile as a baseline for --diff\n"
     "  load              load agent library (jattach action)\n"
     "  jcmd              run JVM diagnostic command (jattach action)\n"
     "  collect           collect profile for the specified period of time\n"
     "                    and then stop (default action)\n"
+    "  fdtransfer        run a shared fdtransfer server for many profiled processes\n"
     "Options:\n"
     "  -e event          profiling event: cpu|alloc|nativemem|lock|cache-misses etc.\n"
     "  -d duration       run profiling for <duration> seconds\n"
@@ -50,12 +58,13 @@ static const char USAGE_STRING[] =
     "  -i interval       sampling interval in nanoseconds\n"
     "  -j jstackdepth    maximum Java stack depth\n"
     "  -t, --threads     profile different threads separately\n"
+    "  --thread-groups   profile thread pools separately, merging threads with the same name but a number\n"
     "  -s, --simple      simple class names instead of FQN\n"
     "  -n, --norm        normalize names of hidden classes / lambdas\n"
     "  -g, --sig         print method signatures\n"
     "  -a, --ann         annotate Java methods\n"
     "  -l, --lib         prepend library names\n"
-    "  -o fmt            output format: flat|traces|collapsed|flamegraph|tree|jfr\n"
+    "  -o fmt            output format: flat|traces|collapsed|flamegraph|tree|jfr|pprof|heatmap\n"
     "  -I include        output only stack traces containing the specified pattern\n"
     "  -X exclude        exclude stack traces with the specified pattern\n"
     "  -L level          log level: debug|info|warn|error|none\n"
@@ -67,38 +76,71 @@ static const char USAGE_STRING[] =
     "  --reverse         generate stack-reversed FlameGraph / Call tree (defaults to icicle graph)\n"
     "  --inverted        toggles the layout for reversed stacktraces from icicle to flamegraph\n"
     "                    and for default stacktraces from flamegraph to icicle\n"
+    "  --diff            color FlameGraph by the change since the last snapshot\n"
+    "  --delta           dump only samples collected since the last snapshot or delta dump\n"
     "\n"
     "  --loop time       run profiler in a loop\n"
+    "  --recent time     keep recent samples in a ring, dump only the last time\n"
+    "  --spike pct       with --recent, dump to file whenever process CPU exceeds pct\n"
+    "  --memlimit bytes  limit profiler memory, shed load when exceeded\n"
     "  --alloc bytes     allocation profiling interval in bytes\n"
     "  --live            build allocation profile from live objects only\n"
+    "  --live-refs N     maximum number of tracked live objects\n"
+    "  --alloc-histo     count allocated bytes per class without stack traces\n"
     "  --nativemem bytes native allocation profiling interval in bytes\n"
     "  --nofree          do not collect free calls in native allocation profiling\n"
     "  --lock duration   lock profiling threshold in nanoseconds\n"
+    "  --park-threshold duration\n"
+    "                    ignore parks shorter than duration in lock profiling\n"
+    "  --latency duration\n"
+    "                    latency histograms of instrumented methods, stacks of calls over duration\n"
     "  --wall interval   wall clock profiling interval\n"
+    "  --wall-threads N  number of threads sampling wall clock\n"
+    "  --vthreads N      attribute samples to virtual threads; sample parked ones every N ns\n"
+    "  --pause-frames    do not walk threads stopped by GC or safepoint\n"
     "  --total           accumulate the total value (time, bytes, etc.)\n"
     "  --all-user        only include user-mode events\n"
+    "  --per-cpu         open one perf event per CPU instead of per thread\n"
+    "  --cgroup path     sample all processes of the cgroup, '.' for the target's own\n"
+    "  --counter event   read hardware counter with every perf event sample\n"
+    "  --data-addr       attribute PEBS memory samples to classes and cache lines\n"
     "  --sched           group threads by scheduling policy\n"
-    "  --cstack mode     how to traverse C stack: fp|dwarf|lbr|vm|no\n"
+    "  --cstack mode     how to traverse C stack: fp|dwarf|lbr|lbrx|vm|no\n"
+    "  --adaptive-depth N  start each thread at stack depth N, deepen it for truncated threads\n"
+    "  --stitch N        walk N frames, reuse the rest of a recent deeper stack (cstack=vm|vmx)\n"
     "  --signal num      use alternative signal for cpu or wall clock profiling\n"
     "  --clock source    clock source for JFR timestamps: tsc|monotonic\n"
+    "  --nonsafepoints mode\n"
+    "                    when to enable DebugNonSafepoints: always|exec|never\n"
     "  --begin function  begin profiling when function is executed\n"
     "  --end function    end profiling when function is executed\n"
     "  --ttsp            only time-to-safepoint profiling \n"
     "  --nostop          do not stop profiling outside --begin/--end window\n"
     "  --jfropts opts    JFR recording options: mem\n"
     "  --jfrsync config  synchronize profiler with JFR recording\n"
+    "  --hugepages       use huge pages for call trace storage\n"
+    "  --deferred        store CPU samples outside of signal handlers\n"
+    "  --overhead pct    adapt sampling rate to keep overhead under pct of CPU time\n"
     "  --libpath path    full path to libasyncProfiler.so in the container\n"
     "  --fdtransfer      use fdtransfer to serve perf requests\n"
+    "  --perfmap         publish JIT-compiled code in /tmp/perf-<pid>.map\n"
+    "  --fdtransfer-path path\n"
+    "                    address of a shared fdtransfer server (default: " DEFAULT_FDTRANSFER_PATH ")\n"
     "  --target-cpu cpu  sample threads on a specific CPU (perf_events only, default: -1)\n"
     "                    from the non-privileged target\n"
     "\n"
+    "  --cgroup path     profile all JVMs in the cgroup, e.g. system.slice/app.service\n"
+    "\n"
     "<pid> is a numeric process ID of the target JVM\n"
     "      or 'jps' keyword to find running JVM automatically\n"
     "      or the application name as it would appear in the jps tool\n"
+    "      or a glob pattern of application names, e.g. 'com.acme.*'\n"
+    "Several <pid>s are profiled in parallel; -f should then contain %%p\n"
     "\n"
     "Example: " APP_BINARY " -d 30 -f profile.html 3456\n"
     "         " APP_BINARY " start -i 1ms jps\n"
     "         " APP_BINARY " stop -o flat jps\n"
+    "         " APP_BINARY " -d 30 -f /tmp/profile-%%p.html 3456 3457 3458\n"
     "         " APP_BINARY " -d 5 -e alloc MyAppName\n";
 
 
@@ -209,17 +251,34 @@ class String {
 
 
 static String action = "collect";
-static String file, logfile, output, params, format, fdtransfer, libpath;
+static String file, logfile, output, params, format, fdtransfer, fdtransfer_path, libpath;
 static bool jattach_action = false;
 static bool use_tmp_file = false;
+static bool use_fdtransfer = false;
+static bool deferred_output = false;
 static int duration = 60;
+static int self_pid = 0;
 static int pid = 0;
 static volatile unsigned long long end_time;
 
+const int MAX_TARGETS = 1024;
+static int targets[MAX_TARGETS];
+static pid_t children[MAX_TARGETS];
+static int target_count = 0;
+
 static void sigint_handler(int sig) {
     end_time = 0;
 }
 
+static void forward_signal(int sig) {
+    for (int i = 0; i < target_count; i++) {
+        if (children[i] > 0) kill(children[i], sig);
+    }
+}
+
+static void nop_handler(int sig) {
+}
+
 static unsigned long long time_micros() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -228,13 +287,26 @@ static unsigned long long time_micros() {
 
 static void setup_output_files(int pid) {
     char current_dir[1024];
-    int self_pid = getpid();
 
+    // Collector addresses (tcp://host:port, unix:/path) are passed to the agent as is
     if (file == "") {
         file = String("/tmp/asprof.") << self_pid << "." << pid;
         use_tmp_file = true;
-    } else if (file.str()[0] != '/' && getcwd(current_dir, sizeof(current_dir)) != NULL) {
-        file = String(current_dir) << "/" << file;
+    } else if (getcwd(current_dir, sizeof(current_dir)) != NULL) {
+        // Every name of a FILE1+FILE2 list is resolved against the current directory
+        char* names = strdup(file.str());
+        String resolved;
+        for (char* name = strtok(names, "+"); name != NULL; name = strtok(NULL, "+")) {
+            if (resolved.str()[0] != 0) {
+                resolved << "+";
+            }
+            if (name[0] != '/' && strstr(name, "://") == NULL && strncmp(name, "unix:", 5) != 0) {
+                resolved << current_dir << "/";
+            }
+            resolved << name;
+        }
+        free(names);
+        file = resolved;
     }
 
     // The agent recognizes temporary log name, see Arguments::hasTemporaryLog()
@@ -300,26 +372,43 @@ static int wait_for_exit(int pid) {
     return ret;
 }
 
-static int jps(const char* cmd, const char* app_name = NULL) {
+static void add_target(int target) {
+    for (int i = 0; i < target_count; i++) {
+        if (targets[i] == target) return;
+    }
+    if (target_count >= MAX_TARGETS) {
+        error("Too many target processes");
+    }
+    targets[target_count++] = target;
+}
+
+// Adds the only process matching app_name, or all of them if app_name is a glob pattern
+static void jps(const char* cmd, const char* app_name = NULL) {
     FILE* pipe = popen(cmd, "r");
     if (pipe == NULL) {
         error("Failed to execute jps", errno);
     }
 
+    bool pattern = app_name != NULL && strpbrk(app_name, "*?[") != NULL;
     int pid = 0;
+    int found = 0;
     char* line = NULL;
     size_t size = 0;
     ssize_t len;
 
     while ((len = getline(&line, &size, pipe)) > 0) {
         line[--len] = 0;
-        if (app_name == NULL || ((len -= strlen(app_name)) > 0 &&
-                                 line[len - 1] == ' ' &&
-                                 strcmp(line + len, app_name) == 0)) {
-            if (pid != 0) {
+        const char* name = strchr(line, ' ');
+        if (pattern ? name != NULL && fnmatch(app_name, name + 1, 0) == 0
+                    : app_name == NULL || ((len -= strlen(app_name)) > 0 &&
+                                           line[len - 1] == ' ' &&
+                                           strcmp(line + len, app_name) == 0)) {
+            if (found++ > 0 && !pattern) {
                 error("Multiple Java processes found");
             }
-            pid = atoi(line);
+            if ((pid = atoi(line)) != 0) {
+                add_target(pid);
+            }
         }
     }
 
@@ -329,7 +418,51 @@ static int jps(const char* cmd, const char* app_name = NULL) {
     if (pid == 0) {
         error("No Java process");
     }
-    return pid;
+}
+
+static bool is_jvm(int pid) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/proc/%d/maps", pid);
+    FILE* maps = fopen(buf, "r");
+    if (maps == NULL) {
+        return false;
+    }
+
+    bool jvm = false;
+    char* line = NULL;
+    size_t size = 0;
+    while (!jvm && getline(&line, &size, maps) > 0) {
+        jvm = strstr(line, "/libjvm.") != NULL;
+    }
+
+    free(line);
+    fclose(maps);
+    return jvm;
+}
+
+// Adds all JVMs in the given cgroup; the path is relative to the cgroup v2 mount point
+static void add_cgroup_targets(const char* cgroup) {
+    String path = strncmp(cgroup, "/sys/fs/cgroup/", 15) == 0 ? String(cgroup) : String("/sys/fs/cgroup/") << cgroup;
+    path << "/cgroup.procs";
+
+    FILE* procs = fopen(path.str(), "r");
+    if (procs == NULL) {
+        error("Failed to read cgroup", errno);
+    }
+
+    int found = 0;
+    int pid;
+    while (fscanf(procs, "%d", &pid) == 1) {
+        if (is_jvm(pid)) {
+            add_target(pid);
+            found++;
+        }
+    }
+    fclose(procs);
+
+    if (found == 0) {
+        error("No Java process");
+    }
 }
 
 static void run_fdtransfer(int pid, String& fdtransfer) {
@@ -350,7 +483,79 @@ static void run_fdtransfer(int pid, String& fdtransfer) {
     }
 }
 
+// With several targets, output is printed by the parent process, see profile_targets()
+static void print_result(int ret) {
+    if (!deferred_output) print_file(logfile, STDERR_FILENO);
+    if (ret != 0) {
+        exit(ret);
+    }
+    if (use_tmp_file && !deferred_output) print_file(file, STDOUT_FILENO);
+}
+
+#ifdef __linux__
+
+// Passes the command to an already loaded agent through its control socket.
+// Returns false if there is no such socket, so that the command has to go through jattach.
+static bool run_control(int pid, String& cmd) {
+    uid_t uid;
+    gid_t gid;
+    int nspid;
+    char tmp[MAX_PATH];
+    if (get_process_info(pid, &uid, &gid, &nspid) != 0 || get_tmp_path_r(pid, tmp, sizeof(tmp)) != 0) {
+        return false;
+    }
+
+    struct sockaddr_un sun;
+    sun.sun_family = AF_UNIX;
+    if ((size_t)snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/" CONTROL_SOCKET_PREFIX "%d", tmp, nspid) >= sizeof(sun.sun_path)) {
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+
+    size_t len = strlen(cmd.str()) + 1;
+    if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0 || send(fd, cmd.str(), len, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return false;
+    }
+
+    // The command has been sent; from now on, failures cannot be retried with jattach
+    int result;
+    size_t received = 0;
+    while (received < sizeof(result)) {
+        ssize_t bytes = recv(fd, (char*)&result + received, sizeof(result) - received, 0);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            if (!deferred_output) print_file(logfile, STDERR_FILENO);
+            error("Lost connection to the profiler");
+        }
+        received += bytes;
+    }
+    close(fd);
+
+    print_result(result);
+    return true;
+}
+
+#else
+
+static bool run_control(int pid, String& cmd) {
+    return false;
+}
+
+#endif // __linux__
+
 static void run_jattach(int pid, String& cmd) {
+    if (run_control(pid, cmd)) {
+        return;
+    }
+
+    // Let subsequent commands reach the agent directly
+    cmd << ",control";
+
     pid_t child = fork();
     if (child == -1) {
         error("fork failed", errno);
@@ -360,14 +565,7 @@ static void run_jattach(int pid, String& cmd) {
         const char* argv[] = {"load", libpath.str(), libpath.str()[0] == '/' ? "true" : "false", cmd.str()};
         exit(jattach(pid, 4, argv, 0));
     } else {
-        int ret = wait_for_exit(child);
-        if (ret != 0) {
-            print_file(logfile, STDERR_FILENO);
-            exit(WEXITSTATUS(ret));
-        }
-
-        print_file(logfile, STDERR_FILENO);
-        if (use_tmp_file) print_file(file, STDOUT_FILENO);
+        print_result(WEXITSTATUS(wait_for_exit(child)));
     }
 }
 
@@ -400,13 +598,144 @@ static int get_tracepoint_id(const char* dir, const char* name) {
 }
 
 
+static int profile_target() {
+    setup_output_files(pid);
+
+    if (use_fdtransfer && fdtransfer_path == "") {
+        // Every asprof process serves its own target, so the socket name is per process
+        char buf[64];
+        snprintf(buf, sizeof(buf), "@asprof-%d-%08x", getpid(), (unsigned int)time_micros());
+        fdtransfer = buf;
+        params << ",fdtransfer=" << fdtransfer;
+    }
+
+    if (action == "collect") {
+        run_fdtransfer(pid, fdtransfer);
+        run_jattach(pid, String("start,quiet,file=") << file << "," << output << format << params << ",log=" << logfile);
+
+        if (!deferred_output) fprintf(stderr, "Profiling for %d seconds\n", duration);
+        end_time = time_micros() + duration * 1000000ULL;
+        signal(SIGINT, sigint_handler);
+        signal(SIGTERM, sigint_handler);
+
+        while (time_micros() < end_time) {
+            if (kill(pid, 0) != 0) {
+                if (deferred_output) {
+                    fprintf(stderr, "Process %d exited\n", pid);
+                } else {
+                    fprintf(stderr, "Process exited\n");
+                    if (use_tmp_file) print_file(file, STDOUT_FILENO);
+                }
+                return 0;
+            }
+            sleep(1);
+        }
+
+        if (!deferred_output) fprintf(stderr, end_time != 0 ? "Done\n" : "Interrupted\n");
+        signal(SIGINT, SIG_DFL);
+        // Do not reset SIGTERM handler to allow graceful shutdown
+
+        run_jattach(pid, String("stop,file=") << file << "," << output << format << ",log=" << logfile);
+    } else {
+        if (action == "start" || action == "resume") run_fdtransfer(pid, fdtransfer);
+        run_jattach(pid, String(action) << ",file=" << file << "," << output << format << params << ",log=" << logfile);
+    }
+
+    return 0;
+}
+
+static void print_target_output(int target, const String& user_file) {
+    pid = target;
+    file = user_file;
+    use_tmp_file = false;
+    setup_output_files(target);
+
+    fprintf(stderr, "--- Process %d ---\n", target);
+    print_file(logfile, STDERR_FILENO);
+    if (use_tmp_file) print_file(file, STDOUT_FILENO);
+}
+
+// Runs one asprof child per target, so that all targets are attached and profiled in parallel.
+// Outputs are printed as soon as the respective child completes, followed by a summary.
+static int profile_targets() {
+    if (file.str()[0] != 0 && strstr(file.str(), "%p") == NULL &&
+        strstr(file.str(), "://") == NULL && strncmp(file.str(), "unix:", 5) != 0) {
+        error("Output file name must contain %p when profiling multiple processes");
+    }
+
+    String user_file = file;
+    int results[MAX_TARGETS];
+    int running = 0;
+
+    deferred_output = true;
+    fflush(stdout);
+
+    for (int i = 0; i < target_count; i++) {
+        pid_t child = fork();
+        if (child == 0) {
+            pid = targets[i];
+            exit(profile_target());
+        }
+        children[i] = child;
+        results[i] = child > 0 ? 0 : -1;
+        if (child > 0) running++;
+    }
+
+    // Terminal interrupts reach children directly; SIGTERM is forwarded to let them stop profiling
+    signal(SIGINT, nop_handler);
+    signal(SIGTERM, forward_signal);
+
+    if (action == "collect") {
+        fprintf(stderr, "Profiling %d processes for %d seconds\n", running, duration);
+    }
+
+    while (running > 0) {
+        int status;
+        pid_t child = waitpid(-1, &status, 0);
+        if (child < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < target_count; i++) {
+            if (children[i] == child) {
+                results[i] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                children[i] = 0;
+                print_target_output(targets[i], user_file);
+                running--;
+                break;
+            }
+        }
+    }
+
+    int failed = 0;
+    fprintf(stderr, "--- Summary ---\n");
+    for (int i = 0; i < target_count; i++) {
+        if (results[i] == 0) {
+            fprintf(stderr, "%10d  OK\n", targets[i]);
+        } else if (results[i] < 0) {
+            fprintf(stderr, "%10d  fork failed\n", targets[i]);
+            failed++;
+        } else {
+            fprintf(stderr, "%10d  failed with exit code %d\n", targets[i], results[i]);
+            failed++;
+        }
+    }
+    fprintf(stderr, "%d of %d processes profiled successfully\n", target_count - failed, target_count);
+
+    return failed == 0 ? 0 : 1;
+}
+
 int main(int argc, const char** argv) {
+    self_pid = getpid();
+
     Args args(argc, argv);
-    while (args.count() > 0 && !(jattach_action && pid)) {
+    while (args.count() > 0 && !(jattach_action && target_count > 0)) {
         String arg = args.next();
 
         if (arg == "start" || arg == "resume" || arg == "stop" || arg == "dump" || arg == "check" ||
-            arg == "status" || arg == "meminfo" || arg == "list" || arg == "collect") {
+            arg == "status" || arg == "meminfo" || arg == "list" || arg == "collect" || arg == "snapshot" ||
+            arg == "fdtransfer") {
             action = arg;
 
         } else if (arg == "load" || arg == "jcmd" || arg == "threaddump" || arg == "dumpheap" || arg == "inspectheap") {
@@ -454,6 +783,9 @@ int main(int argc, const char** argv) {
         } else if (arg == "-t" || arg == "--threads") {
             params << ",threads";
 
+        } else if (arg == "--thread-groups") {
+            params << ",threads=group";
+
         } else if (arg == "-s" || arg == "--simple") {
             format << ",simple";
 
@@ -494,13 +826,16 @@ int main(int argc, const char** argv) {
             format << "," << (arg.str() + 2) << "=" << args.next();
 
         } else if (arg == "--reverse" || arg == "--inverted" || arg == "--samples" || arg == "--total" ||
-                   arg == "--sched" || arg == "--live" || arg == "--nofree") {
+                   arg == "--sched" || arg == "--live" || arg == "--nofree" ||
+                   arg == "--hugepages" || arg == "--deferred" || arg == "--diff" ||
+                   arg == "--delta") {
             format << "," << (arg.str() + 2);
 
         } else if (arg == "--alloc" || arg == "--nativemem" || arg == "--lock" || arg == "--wall" ||
-                   arg == "--chunksize" || arg == "--chunktime" ||
+                   arg == "--chunksize" || arg == "--chunktime" || arg == "--tracemem" ||
                    arg == "--cstack" || arg == "--signal" || arg == "--clock" || arg == "--begin" || arg == "--end" ||
-                   arg == "--target-cpu") {
+                   arg == "--target-cpu" || arg == "--overhead" || arg == "--counter" || arg == "--nonsafepoints" ||
+                   arg == "--recent" || arg == "--spike" || arg == "--memlimit" || arg == "--vthreads") {
             params << "," << (arg.str() + 2) << "=" << args.next();
 
         } else if (arg == "--ttsp") {
@@ -512,6 +847,47 @@ int main(int argc, const char** argv) {
         } else if (arg == "--all-user") {
             params << ",alluser";
 
+        } else if (arg == "--live-refs") {
+            params << ",liverefs=" << args.next();
+
+        } else if (arg == "--pause-frames") {
+            params << ",pauseframes";
+
+        } else if (arg == "--perfmap") {
+            params << ",perfmap";
+
+        } else if (arg == "--data-addr") {
+            params << ",dataaddr";
+
+        } else if (arg == "--alloc-histo") {
+            params << ",allochisto";
+
+        } else if (arg == "--park-threshold") {
+            params << ",parkthreshold=" << args.next();
+
+        } else if (arg == "--latency") {
+            params << ",latency=" << args.next();
+
+        } else if (arg == "--adaptive-depth") {
+            params << ",adaptivedepth=" << args.next();
+
+        } else if (arg == "--stitch") {
+            params << ",stitch=" << args.next();
+
+        } else if (arg == "--wall-threads") {
+            params << ",wallthreads=" << args.next();
+
+        } else if (arg == "--per-cpu") {
+            params << ",percpu";
+
+        } else if (arg == "--cgroup") {
+            String path = args.next();
+            if (path == ".") {
+                params << ",cgroup";
+            } else {
+                params << ",cgroup=" << path;
+            }
+
         } else if (arg == "--safe-mode") {
             params << ",safemode=" << args.next();
 
@@ -527,22 +903,27 @@ int main(int argc, const char** argv) {
             libpath = args.next();
 
         } else if (arg == "--fdtransfer") {
-            char buf[64];
-            snprintf(buf, sizeof(buf), "@asprof-%d-%08x", getpid(), (unsigned int)time_micros());
-            fdtransfer = buf;
-            params << ",fdtransfer=" << fdtransfer;
+            use_fdtransfer = true;
+
+        } else if (arg == "--fdtransfer-path") {
+            // The agent connects to an already running server, no need to start one per target
+            fdtransfer_path = args.next();
+            params << ",fdtransfer=" << fdtransfer_path;
 
-        } else if (arg.str()[0] >= '0' && arg.str()[0] <= '9' && pid == 0) {
-            pid = atoi(arg.str());
+        } else if (arg == "--cgroup") {
+            add_cgroup_targets(args.next());
 
-        } else if (arg == "jps" && pid == 0) {
+        } else if (arg.str()[0] >= '0' && arg.str()[0] <= '9') {
+            add_target(atoi(arg.str()));
+
+        } else if (arg == "jps" && target_count == 0) {
             // A shortcut for getting PID of a running Java application.
             // -XX:+PerfDisableSharedMem prevents jps from appearing in its own list
-            pid = jps("pgrep -n java || jps -q -J-XX:+PerfDisableSharedMem");
+            jps("pgrep -n java || jps -q -J-XX:+PerfDisableSharedMem");
 
-        } else if (arg.str()[0] != '-' && args.count() == 0 && pid == 0) {
+        } else if (arg.str()[0] != '-' && args.count() == 0 && target_count == 0) {
             // The last argument is the application name as it would appear in the jps tool
-            pid = jps("jps -J-XX:+PerfDisableSharedMem", arg.str());
+            jps("jps -J-XX:+PerfDisableSharedMem", arg.str());
 
         } else {
             fprintf(stderr, "Unrecognized option: %s\n", arg.str());
@@ -550,51 +931,36 @@ int main(int argc, const char** argv) {
         }
     }
 
-    if (pid == 0) {
+    if (action == "fdtransfer") {
+        if (!FdTransferServer::supported()) {
+            error("fdtransfer is not supported on this platform");
+        }
+        return FdTransferServer::runLoop(fdtransfer_path == "" ? DEFAULT_FDTRANSFER_PATH : fdtransfer_path.str()) ? 0 : 1;
+    }
+
+    if (target_count == 0) {
         printf(USAGE_STRING);
         return 1;
     }
 
     if (jattach_action) {
+        if (target_count > 1) {
+            error("jattach actions support a single process");
+        }
         argc = args.count() + 1;
         argv = (const char**)alloca(argc * sizeof(char*));
         argv[0] = action.str();
         memcpy(&argv[1], args.array(), (argc - 1) * sizeof(char*));
-        return jattach(pid, argc, argv, 1);
+        return jattach(targets[0], argc, argv, 1);
     }
 
-    setup_output_files(pid);
     if (libpath == "") {
         setup_lib_path();
     }
 
-    if (action == "collect") {
-        run_fdtransfer(pid, fdtransfer);
-        run_jattach(pid, String("start,quiet,file=") << file << "," << output << format << params << ",log=" << logfile);
-
-        fprintf(stderr, "Profiling for %d seconds\n", duration);
-        end_time = time_micros() + duration * 1000000ULL;
-        signal(SIGINT, sigint_handler);
-        signal(SIGTERM, sigint_handler);
-
-        while (time_micros() < end_time) {
-            if (kill(pid, 0) != 0) {
-                fprintf(stderr, "Process exited\n");
-                if (use_tmp_file) print_file(file, STDOUT_FILENO);
-                return 0;
-            }
-            sleep(1);
-        }
-
-        fprintf(stderr, end_time != 0 ? "Done\n" : "Interrupted\n");
-        signal(SIGINT, SIG_DFL);
-        // Do not reset SIGTERM handler to allow graceful shutdown
-
-        run_jattach(pid, String("stop,file=") << file << "," << output << format << ",log=" << logfile);
-    } else {
-        if (action == "start" || action == "resume") run_fdtransfer(pid, fdtransfer);
-        run_jattach(pid, String(action) << ",file=" << file << "," << output << format << params << ",log=" << logfile);
+    if (target_count == 1) {
+        pid = targets[0];
+        return profile_target();
     }
-
-    return 0;
+    return profile_targets();
 }
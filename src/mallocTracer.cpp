@@ -6,12 +6,14 @@
 #include "asprof.h"
 #include "assert.h"
 #include "codeCache.h"
+#include "log.h"
 #include "mallocTracer.h"
 #include "os.h"
 #include "profiler.h"
 #include "tsc.h"
 #include <dlfcn.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #ifdef __clang__
 #  define NO_OPTIMIZE __attribute__((optnone))
@@ -19,6 +21,15 @@
 #  define NO_OPTIMIZE __attribute__((optimize("O1")))
 #endif
 
+const u32 SAMPLED_ADDRESSES_CAPACITY = 1 << 20;
+
+// Unfreed allocation in the live mode, stored at the slot of its address in the sampled set
+struct LiveAllocation {
+    u64 trace;  // tid << 32 | call_trace_id
+    u64 size;
+    u64 time;
+};
+
 extern "C" void* malloc_hook(size_t size) {
     void* ret = malloc(size);
     if (MallocTracer::running() && ret && size) {
@@ -83,9 +94,73 @@ extern "C" void* aligned_alloc_hook(size_t alignment, size_t size) {
     return ret;
 }
 
+// Anonymous mappings are native memory, unlike file mappings and address space reservations.
+// MAP_FIXED typically commits memory in a reserved range, e.g. Java heap, which is not unmapped later.
+extern "C" void* mmap_hook(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    void* ret = mmap(addr, length, prot, flags, fd, offset);
+    if (MallocTracer::running() && ret != MAP_FAILED && length && prot != PROT_NONE &&
+        (flags & (MAP_ANONYMOUS | MAP_FIXED)) == MAP_ANONYMOUS) {
+        MallocTracer::recordMalloc(ret, length);
+    }
+    return ret;
+}
+
+extern "C" int munmap_hook(void* addr, size_t length) {
+    int ret = munmap(addr, length);
+    if (MallocTracer::running() && ret == 0 && !MallocTracer::nofree()) {
+        MallocTracer::recordFree(addr);
+    }
+    return ret;
+}
+
+// jemalloc non-standard API, resolved at runtime once the allocator is loaded
+static void* (*orig_mallocx)(size_t size, int flags) = NULL;
+static void* (*orig_rallocx)(void* addr, size_t size, int flags) = NULL;
+static void (*orig_dallocx)(void* addr, int flags) = NULL;
+static void (*orig_sdallocx)(void* addr, size_t size, int flags) = NULL;
+
+extern "C" void* mallocx_hook(size_t size, int flags) {
+    void* ret = orig_mallocx(size, flags);
+    if (MallocTracer::running() && ret && size) {
+        MallocTracer::recordMalloc(ret, size);
+    }
+    return ret;
+}
+
+extern "C" void* rallocx_hook(void* addr, size_t size, int flags) {
+    void* ret = orig_rallocx(addr, size, flags);
+    if (MallocTracer::running() && ret) {
+        if (addr && !MallocTracer::nofree()) {
+            MallocTracer::recordFree(addr);
+        }
+        if (size) {
+            MallocTracer::recordMalloc(ret, size);
+        }
+    }
+    return ret;
+}
+
+extern "C" void dallocx_hook(void* addr, int flags) {
+    orig_dallocx(addr, flags);
+    if (MallocTracer::running() && !MallocTracer::nofree() && addr) {
+        MallocTracer::recordFree(addr);
+    }
+}
+
+extern "C" void sdallocx_hook(void* addr, size_t size, int flags) {
+    orig_sdallocx(addr, size, flags);
+    if (MallocTracer::running() && !MallocTracer::nofree() && addr) {
+        MallocTracer::recordFree(addr);
+    }
+}
+
 u64 MallocTracer::_interval;
 bool MallocTracer::_nofree;
-volatile u64 MallocTracer::_allocated_bytes;
+GeometricSampler MallocTracer::_sampler;
+bool MallocTracer::_filter_frees;
+bool MallocTracer::_live;
+AddressSet MallocTracer::_sampled_addresses;
+LiveAllocation* MallocTracer::_live_allocations = NULL;
 
 Mutex MallocTracer::_patch_lock;
 int MallocTracer::_patched_libs = 0;
@@ -103,7 +178,13 @@ void MallocTracer::initialize() {
                 || strcmp(s, "realloc_hook") == 0
                 || strcmp(s, "free_hook") == 0
                 || strcmp(s, "posix_memalign_hook") == 0
-                || strcmp(s, "aligned_alloc_hook") == 0;
+                || strcmp(s, "aligned_alloc_hook") == 0
+                || strcmp(s, "mmap_hook") == 0
+                || strcmp(s, "munmap_hook") == 0
+                || strcmp(s, "mallocx_hook") == 0
+                || strcmp(s, "rallocx_hook") == 0
+                || strcmp(s, "dallocx_hook") == 0
+                || strcmp(s, "sdallocx_hook") == 0;
         },
         MARK_ASYNC_PROFILER);
 }
@@ -118,6 +199,15 @@ void MallocTracer::patchLibraries() {
     CodeCacheArray* native_libs = Profiler::instance()->nativeLibs();
     int native_lib_count = native_libs->count();
 
+    if (orig_mallocx == NULL && _patched_libs < native_lib_count) {
+        orig_rallocx = (void* (*)(void*, size_t, int))dlsym(RTLD_DEFAULT, "rallocx");
+        orig_dallocx = (void (*)(void*, int))dlsym(RTLD_DEFAULT, "dallocx");
+        orig_sdallocx = (void (*)(void*, size_t, int))dlsym(RTLD_DEFAULT, "sdallocx");
+        if (orig_rallocx != NULL && orig_dallocx != NULL && orig_sdallocx != NULL) {
+            orig_mallocx = (void* (*)(size_t, int))dlsym(RTLD_DEFAULT, "mallocx");
+        }
+    }
+
     while (_patched_libs < native_lib_count) {
         CodeCache* cc = (*native_libs)[_patched_libs++];
 
@@ -141,21 +231,70 @@ void MallocTracer::patchLibraries() {
             cc->patchImport(im_calloc, (void*)calloc_hook);
             cc->patchImport(im_posix_memalign, (void*)posix_memalign_hook);
         }
+
+        cc->patchImport(im_mmap, (void*)mmap_hook);
+        cc->patchImport(im_munmap, (void*)munmap_hook);
+
+        if (orig_mallocx != NULL) {
+            cc->patchImport(im_mallocx, (void*)mallocx_hook);
+            cc->patchImport(im_rallocx, (void*)rallocx_hook);
+            cc->patchImport(im_dallocx, (void*)dallocx_hook);
+            cc->patchImport(im_sdallocx, (void*)sdallocx_hook);
+        }
     }
 }
 
 void MallocTracer::recordMalloc(void* address, size_t size) {
-    if (updateCounter(_allocated_bytes, size, _interval)) {
+    u64 counter = _interval > 1 ? _sampler.sample(size) : size;
+    if (counter != 0 && Profiler::instance()->takeSample(counter)) {
         MallocEvent event;
         event._start_time = TSC::ticks();
         event._address = (uintptr_t)address;
         event._size = size;
 
-        Profiler::instance()->recordSample(NULL, size, MALLOC_SAMPLE, &event);
+        if (_live) {
+            // Only the call trace is stored now; events of unfreed allocations are written on stop
+            u64 trace = Profiler::instance()->recordSample(NULL, counter, MALLOC_SAMPLE, NULL);
+            if ((u32)trace != 0) {
+                int slot = _sampled_addresses.insert((uintptr_t)address);
+                if (slot >= 0) {
+                    LiveAllocation* a = &_live_allocations[slot];
+                    a->trace = trace;
+                    a->size = counter;
+                    a->time = event._start_time;
+                } else {
+                    // Not tracked, hence it will never be freed from the profile
+                    Profiler::instance()->releaseSample((u32)trace, counter);
+                }
+            }
+            return;
+        }
+
+        if (_filter_frees) {
+            _sampled_addresses.insert((uintptr_t)address);
+        }
+        Profiler::instance()->recordSample(NULL, counter, MALLOC_SAMPLE, &event);
     }
 }
 
 void MallocTracer::recordFree(void* address) {
+    if (_live) {
+        // Freed bytes leave the profile, so that it always shows unfreed memory
+        int slot = _sampled_addresses.find((uintptr_t)address);
+        if (slot >= 0) {
+            LiveAllocation a = _live_allocations[slot];
+            if (_sampled_addresses.removeAt(slot, (uintptr_t)address)) {
+                Profiler::instance()->releaseSample((u32)a.trace, a.size);
+            }
+        }
+        return;
+    }
+
+    // Only a free of a sampled address may close a leak candidate
+    if (_filter_frees && !_sampled_addresses.remove((uintptr_t)address)) {
+        return;
+    }
+
     MallocEvent event;
     event._start_time = TSC::ticks();
     event._address = (uintptr_t)address;
@@ -164,10 +303,71 @@ void MallocTracer::recordFree(void* address) {
     Profiler::instance()->recordEventOnly(MALLOC_SAMPLE, &event);
 }
 
+// The set and the live table are kept once allocated, since hooks may still be running after stop
+bool MallocTracer::initSampledAddresses() {
+    if (_sampled_addresses.initialized()) {
+        _sampled_addresses.reset();
+        return true;
+    }
+
+    void* memory = OS::safeAlloc(SAMPLED_ADDRESSES_CAPACITY * sizeof(uintptr_t));
+    if (memory == NULL) {
+        return false;
+    }
+
+    // Untouched pages of the live table cost nothing
+    _live_allocations = (LiveAllocation*)OS::safeAlloc(SAMPLED_ADDRESSES_CAPACITY * sizeof(LiveAllocation));
+    if (_live_allocations == NULL) {
+        OS::safeFree(memory, SAMPLED_ADDRESSES_CAPACITY * sizeof(uintptr_t));
+        return false;
+    }
+
+    _sampled_addresses.init(memory, SAMPLED_ADDRESSES_CAPACITY);
+    return true;
+}
+
+void MallocTracer::dumpLiveAllocations() {
+    Profiler* profiler = Profiler::instance();
+
+    // Reset counters before dumping to collect unfreed allocations only
+    profiler->tryResetCounters();
+
+    u32 capacity = _sampled_addresses.capacity();
+    for (u32 slot = 0; slot < capacity; slot++) {
+        uintptr_t address = _sampled_addresses.at(slot);
+        if (address != 0) {
+            LiveAllocation* a = &_live_allocations[slot];
+            MallocEvent event;
+            event._start_time = a->time;
+            event._address = address;
+            event._size = a->size;
+            profiler->recordExternalSamples(1, a->size, (int)(a->trace >> 32), (u32)a->trace, MALLOC_SAMPLE, &event);
+        }
+    }
+
+    if (_sampled_addresses.overflow()) {
+        Log::warn("Too many live native allocations, some of them are not reported");
+    }
+}
+
 Error MallocTracer::start(Arguments& args) {
     _interval = args._nativemem > 0 ? args._nativemem : 0;
     _nofree = args._nofree;
-    _allocated_bytes = 0;
+    if (_interval > 1) {
+        _sampler.init(_interval, OS::nanotime());
+    }
+
+    // With sampling, most freed addresses were never recorded: look them up in the set
+    // of sampled addresses instead of writing an event for every free() call.
+    // In the live mode, the set also finds unfreed allocations to be reported on stop.
+    _live = args._live && !_nofree;
+    _filter_frees = (_interval > 1 || _live) && !_nofree;
+    if (_filter_frees && !initSampledAddresses()) {
+        if (_live) {
+            return Error("Could not allocate the table of live native allocations");
+        }
+        _filter_frees = false;
+    }
 
     if (!_initialized) {
         initialize();
@@ -184,4 +384,8 @@ void MallocTracer::stop() {
     // Ideally, we should reset original malloc entries, but it's not currently safe
     // in the view of library unloading. Consider using dl_iterate_phdr.
     _running = false;
+
+    if (_live) {
+        dumpLiveAllocations();
+    }
 }
@@ -8,16 +8,24 @@
 
 #include <stdint.h>
 
+#include "addressSet.h"
 #include "engine.h"
 #include "event.h"
+#include "geometricSampler.h"
 #include "mutex.h"
 #include "trap.h"
 
+struct LiveAllocation;
+
 class MallocTracer : public Engine {
   private:
     static u64 _interval;
     static bool _nofree;
-    static volatile u64 _allocated_bytes;
+    static GeometricSampler _sampler;
+    static bool _filter_frees;
+    static bool _live;
+    static AddressSet _sampled_addresses;
+    static LiveAllocation* _live_allocations;
 
     static Mutex _patch_lock;
     static int _patched_libs;
@@ -26,6 +34,8 @@ class MallocTracer : public Engine {
 
     static void initialize();
     static void patchLibraries();
+    static bool initSampledAddresses();
+    static void dumpLiveAllocations();
 
   public:
     const char* type() {
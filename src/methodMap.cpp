@@ -0,0 +1,117 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include "methodMap.h"
+
+
+const u32 INITIAL_METHOD_MAP_CAPACITY = 4096;
+const size_t METHOD_ARENA_CHUNK = 1024 * 1024;
+
+
+MethodMap::MethodMap() : _capacity(INITIAL_METHOD_MAP_CAPACITY), _size(0), _null_value(NULL),
+                         _arena(METHOD_ARENA_CHUNK) {
+    _slots = (Slot*)calloc(_capacity, sizeof(Slot));
+}
+
+MethodMap::~MethodMap() {
+    if (_null_value != NULL) {
+        release(_null_value);
+    }
+    for (u32 i = 0; i < _capacity; i++) {
+        if (_slots[i].key != NULL) {
+            release(_slots[i].value);
+        }
+    }
+    free(_slots);
+}
+
+void MethodMap::release(MethodInfo* mi) {
+    if (mi->_line_number_table != NULL) {
+        VM::jvmti()->Deallocate((unsigned char*)mi->_line_number_table);
+    }
+    free(mi->_names);
+}
+
+size_t MethodMap::extraMemory(MethodInfo* mi) {
+    size_t bytes = mi->_line_number_table_size * sizeof(jvmtiLineNumberEntry);
+    if (mi->_names != NULL) {
+        const char* names = mi->_names;
+        size_t len = strlen(names) + 1;
+        len += strlen(names + len) + 1;
+        bytes += len + strlen(names + len) + 1;
+    }
+    return bytes;
+}
+
+MethodInfo* MethodMap::newValue() {
+    void* memory = _arena.alloc(sizeof(MethodInfo));
+    return memory == NULL ? NULL : new(memory) MethodInfo();
+}
+
+void MethodMap::grow() {
+    u32 old_capacity = _capacity;
+    Slot* old_slots = _slots;
+
+    _capacity = old_capacity * 2;
+    _slots = (Slot*)calloc(_capacity, sizeof(Slot));
+
+    u32 mask = _capacity - 1;
+    for (u32 i = 0; i < old_capacity; i++) {
+        if (old_slots[i].key != NULL) {
+            u32 slot = hash(old_slots[i].key) & mask;
+            while (_slots[slot].key != NULL) {
+                slot = (slot + 1) & mask;
+            }
+            _slots[slot] = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+MethodInfo& MethodMap::operator[](jmethodID key) {
+    if (key == NULL) {
+        if (_null_value == NULL) {
+            _null_value = newValue();
+            _size++;
+        }
+        return *_null_value;
+    }
+
+    u32 mask = _capacity - 1;
+    u32 slot = hash(key) & mask;
+    while (_slots[slot].key != NULL) {
+        if (_slots[slot].key == key) {
+            return *_slots[slot].value;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    // Keep load factor under 3/4
+    if ((_size + 1) * 4 > _capacity * 3) {
+        grow();
+        return (*this)[key];
+    }
+
+    _slots[slot].key = key;
+    _slots[slot].value = newValue();
+    _size++;
+    return *_slots[slot].value;
+}
+
+size_t MethodMap::usedMemory() {
+    size_t bytes = _capacity * sizeof(Slot) + _arena.usedMemory();
+    if (_null_value != NULL) {
+        bytes += extraMemory(_null_value);
+    }
+    for (u32 i = 0; i < _capacity; i++) {
+        if (_slots[i].key != NULL) {
+            bytes += extraMemory(_slots[i].value);
+        }
+    }
+    return bytes;
+}
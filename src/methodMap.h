@@ -0,0 +1,86 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _METHODMAP_H
+#define _METHODMAP_H
+
+#include "arch.h"
+#include "linearAllocator.h"
+#include "vmEntry.h"
+
+
+class MethodInfo {
+  public:
+    MethodInfo() : _mark(false), _loaded(false), _hint(0), _key(0), _names(NULL) {
+    }
+
+    bool _mark;
+    bool _loaded;  // modifiers and line numbers are fetched
+    u8 _hint;      // MethodHint for stack trace classification
+    u32 _key;
+    // JVMTI names of a Java method as "class\0name\0signature", cached across chunks and recordings
+    char* _names;
+    u32 _class;
+    u32 _name;
+    u32 _sig;
+    jint _modifiers;
+    jint _line_number_table_size;
+    jvmtiLineNumberEntry* _line_number_table;
+    FrameTypeId _type;
+
+    jint getLineNumber(jint bci) {
+        if (_line_number_table_size == 0) {
+            return 0;
+        }
+
+        int i = 1;
+        while (i < _line_number_table_size && bci >= _line_number_table[i].start_location) {
+            i++;
+        }
+        return _line_number_table[i - 1].line_number;
+    }
+};
+
+// Open addressing hash map from jmethodID (or other frame key) to MethodInfo.
+// Values are allocated in an arena and never move, so pointers to them stay valid.
+// Not thread safe: only the JFR writer thread inserts.
+class MethodMap {
+  private:
+    struct Slot {
+        jmethodID key;
+        MethodInfo* value;
+    };
+
+    Slot* _slots;
+    u32 _capacity;
+    u32 _size;
+    MethodInfo* _null_value;  // NULL is a valid key, but marks empty slots
+    LinearAllocator _arena;
+
+    static u32 hash(jmethodID key) {
+        u64 h = (u64)(uintptr_t)key * 0x9e3779b97f4a7c15ULL;
+        return (u32)(h >> 32);
+    }
+
+    MethodInfo* newValue();
+    void grow();
+
+    static void release(MethodInfo* mi);
+    static size_t extraMemory(MethodInfo* mi);
+
+  public:
+    MethodMap();
+    ~MethodMap();
+
+    MethodInfo& operator[](jmethodID key);
+
+    size_t size() const {
+        return _size;
+    }
+
+    size_t usedMemory();
+};
+
+#endif // _METHODMAP_H
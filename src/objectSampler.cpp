@@ -3,25 +3,46 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include "classIdCache.h"
+#include "log.h"
 #include "objectSampler.h"
 #include "profiler.h"
 #include "tsc.h"
+#include "vmStructs.h"
 
 
 u64 ObjectSampler::_interval;
 bool ObjectSampler::_live;
-volatile u64 ObjectSampler::_allocated_bytes;
+bool ObjectSampler::_histo;
+EventCounter ObjectSampler::_allocated_bytes;
 
 
-static u32 lookupClassId(jvmtiEnv* jvmti, jclass cls) {
+static ClassIdCache class_id_cache;
+
+static u32 lookupClassId(jvmtiEnv* jvmti, jobject object, jclass cls) {
+    Dictionary* class_map = Profiler::instance()->classMap();
+
+    if (VMStructs::hasClassNames()) {
+        // Class name symbol equals JVM TI signature without L and ; for instance classes
+        uintptr_t klass = (uintptr_t)VMKlass::fromOop(*(uintptr_t*)object);
+        u32 class_id = class_id_cache.get(klass);
+        if (class_id == 0) {
+            VMSymbol* symbol = ((VMKlass*)klass)->name();
+            class_id = class_map->lookup(symbol->body(), symbol->length());
+            class_id_cache.put(klass, class_id);
+        }
+        return class_id;
+    }
+
     u32 class_id = 0;
     char* class_name;
     if (jvmti->GetClassSignature(cls, &class_name, NULL) == 0) {
         if (class_name[0] == 'L') {
-            class_id = Profiler::instance()->classMap()->lookup(class_name + 1, strlen(class_name) - 2);
+            class_id = class_map->lookup(class_name + 1, strlen(class_name) - 2);
         } else {
-            class_id = Profiler::instance()->classMap()->lookup(class_name);
+            class_id = class_map->lookup(class_name);
         }
         jvmti->Deallocate((unsigned char*)class_name);
     }
@@ -29,73 +50,194 @@ static u32 lookupClassId(jvmtiEnv* jvmti, jclass cls) {
 }
 
 
+const u32 LIVE_REF_SHARDS = 16;
+const u32 LIVE_REF_INITIAL_CAPACITY = 64;
+const u32 LIVE_REF_SWEEP_STEP = 16;
+
+struct LiveRef {
+    jweak ref;
+    jlong size;
+    u64 counter;  // weight of the sample in the call trace storage
+    u64 trace;
+    u64 time;
+};
+
+// A part of the live object table with its own lock. Slots grow on demand up to the limit.
+// Objects collected by GC are not discovered at dump time: after every GC, additions to the shard
+// incrementally sweep a few slots, so that space of collected objects is reused.
+// Swept objects are taken back from the call trace storage: the profile dumped at any time
+// shows bytes retained by allocation stack and class.
+struct LiveRefShard {
+    SpinLock lock;
+    LiveRef* refs;
+    u32* free_slots;
+    u32 capacity;
+    u32 used;        // slots [0, used) have been taken at least once
+    u32 free_count;
+    u32 sweep_cursor;
+    u32 gc_count;    // GC count when the current sweep started
+
+    LiveRefShard() : lock(1), refs(NULL), free_slots(NULL), capacity(0), used(0),
+                     free_count(0), sweep_cursor(0), gc_count(0) {
+    }
+};
+
 class LiveRefs {
   private:
-    enum { MAX_REFS = 1024 };
-
-    SpinLock _lock;
-    jweak _refs[MAX_REFS];
-    struct {
-        jlong size;
-        u64 trace;
-        u64 time;
-    } _values[MAX_REFS];
-    bool _full;
+    LiveRefShard _shards[LIVE_REF_SHARDS];
+    u32 _shard_limit;
+    volatile u32 _gc_count;
+    volatile u64 _dropped;
 
     static inline bool collected(jweak w) {
         return *(void**)((uintptr_t)w & ~(uintptr_t)1) == NULL;
     }
 
-  public:
-    LiveRefs() : _lock(1) {
+    bool grow(LiveRefShard* shard) {
+        if (shard->capacity >= _shard_limit) {
+            return false;
+        }
+
+        u32 new_capacity = shard->capacity == 0 ? LIVE_REF_INITIAL_CAPACITY : shard->capacity * 2;
+        if (new_capacity > _shard_limit) new_capacity = _shard_limit;
+
+        LiveRef* refs = (LiveRef*)realloc(shard->refs, new_capacity * sizeof(LiveRef));
+        if (refs == NULL) {
+            return false;
+        }
+        shard->refs = refs;
+
+        u32* free_slots = (u32*)realloc(shard->free_slots, new_capacity * sizeof(u32));
+        if (free_slots == NULL) {
+            return false;
+        }
+        shard->free_slots = free_slots;
+        shard->capacity = new_capacity;
+        return true;
     }
 
-    void init() {
-        memset(_refs, 0, sizeof(_refs));
-        memset(_values, 0, sizeof(_values));
-        _full = false;
-        _lock.unlock();
+    // Releases weak refs of collected objects among the next slots; returns false when the sweep is over
+    bool sweep(JNIEnv* jni, LiveRefShard* shard, u32 slots) {
+        u32 end = shard->sweep_cursor + slots;
+        if (end > shard->used) end = shard->used;
+
+        for (u32 i = shard->sweep_cursor; i < end; i++) {
+            jweak w = shard->refs[i].ref;
+            if (w != NULL && collected(w)) {
+                Profiler::instance()->releaseSample((u32)shard->refs[i].trace, shard->refs[i].counter);
+                jni->DeleteWeakGlobalRef(w);
+                shard->refs[i].ref = NULL;
+                shard->free_slots[shard->free_count++] = i;
+            }
+        }
+        shard->sweep_cursor = end;
+        return end < shard->used;
     }
 
-    void gc() {
-        _full = false;
+    bool addToShard(JNIEnv* jni, LiveRefShard* shard, jweak wobject, jlong size, u64 counter, u64 trace) {
+        u32 gc_count = _gc_count;
+        if (shard->gc_count != gc_count) {
+            shard->gc_count = gc_count;
+            shard->sweep_cursor = 0;
+        }
+        bool sweeping = sweep(jni, shard, LIVE_REF_SWEEP_STEP);
+
+        if (shard->free_count == 0 && shard->used == shard->capacity && !grow(shard) && sweeping) {
+            // Complete the sweep before giving up
+            sweep(jni, shard, shard->used);
+        }
+
+        u32 slot;
+        if (shard->free_count > 0) {
+            slot = shard->free_slots[--shard->free_count];
+        } else if (shard->used < shard->capacity) {
+            slot = shard->used++;
+        } else {
+            return false;
+        }
+
+        LiveRef* r = &shard->refs[slot];
+        r->ref = wobject;
+        r->size = size;
+        r->counter = counter;
+        r->trace = trace;
+        r->time = TSC::ticks();
+        return true;
     }
 
-    void add(JNIEnv* jni, jobject object, jlong size, u64 trace) {
-        if (_full) {
-            return;
+  public:
+    LiveRefs() : _shard_limit(0), _gc_count(0), _dropped(0) {
+    }
+
+    void init(u32 capacity) {
+        _shard_limit = (capacity + LIVE_REF_SHARDS - 1) / LIVE_REF_SHARDS;
+        _dropped = 0;
+        for (u32 i = 0; i < LIVE_REF_SHARDS; i++) {
+            LiveRefShard* shard = &_shards[i];
+            shard->used = 0;
+            shard->free_count = 0;
+            shard->sweep_cursor = 0;
+            shard->gc_count = _gc_count;
+            if (shard->capacity > _shard_limit) {
+                // Keep allocated memory, but respect the new limit
+                shard->capacity = _shard_limit;
+            }
+            shard->lock.reset();
         }
+    }
 
+    void gc() {
+        // JNI is not allowed during GC; collected objects are swept by subsequent additions
+        atomicInc(_gc_count);
+    }
+
+    void add(JNIEnv* jni, jobject object, jlong size, u64 counter, u64 trace) {
         jweak wobject = jni->NewWeakGlobalRef(object);
         if (wobject == NULL) {
+            Profiler::instance()->releaseSample((u32)trace, counter);
             return;
         }
 
-        if (_lock.tryLock()) {
-            u32 start = (((uintptr_t)object >> 4) * 31 + ((uintptr_t)jni >> 4) + trace) & (MAX_REFS - 1);
-            u32 i = start;
-            do {
-                jweak w = _refs[i];
-                if (w == NULL || collected(w)) {
-                    if (w != NULL) jni->DeleteWeakGlobalRef(w);
-                    _refs[i] = wobject;
-                    _values[i].size = size;
-                    _values[i].trace = trace;
-                    _values[i].time = TSC::ticks();
-                    _lock.unlock();
+        // Start with a shard of the current thread, and take the first one not busy and not full
+        u32 start = (u32)(((uintptr_t)jni >> 4) * 0x9e3779b9U >> 16);
+        for (u32 i = 0; i < LIVE_REF_SHARDS; i++) {
+            LiveRefShard* shard = &_shards[(start + i) % LIVE_REF_SHARDS];
+            if (shard->lock.tryLock()) {
+                bool added = addToShard(jni, shard, wobject, size, counter, trace);
+                shard->lock.unlock();
+                if (added) {
                     return;
                 }
-            } while ((i = (i + 1) & (MAX_REFS - 1)) != start);
-
-            _full = true;
-            _lock.unlock();
+            }
         }
 
+        atomicInc(_dropped);
+        Profiler::instance()->releaseSample((u32)trace, counter);
         jni->DeleteWeakGlobalRef(wobject);
     }
 
+    // Completes sweeps after the last GC, so that the call trace storage holds live objects only
+    void sweepAll(JNIEnv* jni) {
+        u32 gc_count = _gc_count;
+        for (u32 i = 0; i < LIVE_REF_SHARDS; i++) {
+            LiveRefShard* shard = &_shards[i];
+            if (!shard->lock.tryLock()) {
+                // Not initialized or dumped
+                continue;
+            }
+            if (shard->gc_count != gc_count) {
+                shard->gc_count = gc_count;
+                shard->sweep_cursor = 0;
+            }
+            sweep(jni, shard, shard->used);
+            shard->lock.unlock();
+        }
+    }
+
     void dump(JNIEnv* jni) {
-        _lock.lock();
+        for (u32 i = 0; i < LIVE_REF_SHARDS; i++) {
+            _shards[i].lock.lock();
+        }
 
         jvmtiEnv* jvmti = VM::jvmti();
         Profiler* profiler = Profiler::instance();
@@ -103,27 +245,36 @@ class LiveRefs {
         // Reset counters before dumping to collect live objects only.
         profiler->tryResetCounters();
 
-        for (u32 i = 0; i < MAX_REFS; i++) {
-            if ((i % 32) == 0) jni->PushLocalFrame(64);
-
-            jweak w = _refs[i];
-            if (w != NULL) {
-                jobject obj = jni->NewLocalRef(w);
-                if (obj != NULL) {
-                    LiveObject event;
-                    event._start_time = TSC::ticks();
-                    event._alloc_size = _values[i].size;
-                    event._alloc_time = _values[i].time;
-                    event._class_id = lookupClassId(jvmti, jni->GetObjectClass(obj));
-
-                    int tid = _values[i].trace >> 32;
-                    u32 call_trace_id = (u32)_values[i].trace;
-                    profiler->recordExternalSamples(1, event._alloc_size, tid, call_trace_id, LIVE_OBJECT, &event);
+        for (u32 s = 0; s < LIVE_REF_SHARDS; s++) {
+            LiveRefShard* shard = &_shards[s];
+            for (u32 i = 0; i < shard->used; i++) {
+                if ((i % 32) == 0) jni->PushLocalFrame(64);
+
+                jweak w = shard->refs[i].ref;
+                if (w != NULL) {
+                    jobject obj = jni->NewLocalRef(w);
+                    if (obj != NULL) {
+                        LiveObject event;
+                        event._start_time = TSC::ticks();
+                        event._alloc_size = shard->refs[i].size;
+                        event._alloc_time = shard->refs[i].time;
+                        event._class_id = lookupClassId(jvmti, obj, jni->GetObjectClass(obj));
+
+                        int tid = shard->refs[i].trace >> 32;
+                        u32 call_trace_id = (u32)shard->refs[i].trace;
+                        profiler->recordExternalSamples(1, event._alloc_size, tid, call_trace_id, LIVE_OBJECT, &event);
+                    }
+                    jni->DeleteWeakGlobalRef(w);
                 }
-                jni->DeleteWeakGlobalRef(w);
+
+                if ((i % 32) == 31 || i == shard->used - 1) jni->PopLocalFrame(NULL);
             }
+            shard->used = 0;
+            shard->free_count = 0;
+        }
 
-            if ((i % 32) == 31 || i == MAX_REFS - 1) jni->PopLocalFrame(NULL);
+        if (_dropped > 0) {
+            Log::warn("%llu live object samples dropped, consider increasing liverefs", (unsigned long long)_dropped);
         }
     }
 };
@@ -144,35 +295,57 @@ void ObjectSampler::GarbageCollectionStart(jvmtiEnv* jvmti) {
 
 void ObjectSampler::recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, EventType event_type,
                                      jobject object, jclass object_klass, jlong size) {
+    u64 total_size = size > _interval ? size : _interval;
+    if (_histo) {
+        // No stack walk, hence no need to charge the overhead budget
+        Profiler::instance()->classHistogram()->add(lookupClassId(jvmti, object, object_klass), total_size);
+        return;
+    }
+
     AllocEvent event;
     event._start_time = TSC::ticks();
-    event._total_size = size > _interval ? size : _interval;
+    event._total_size = total_size;
     event._instance_size = size;
-    event._class_id = lookupClassId(jvmti, object_klass);
 
-    u64 trace = Profiler::instance()->recordSample(NULL, event._total_size, event_type, &event);
+    u64 counter = total_size;
+    if (!Profiler::instance()->takeSample(counter)) {
+        return;
+    }
+    event._class_id = lookupClassId(jvmti, object, object_klass);
+
+    u64 trace = Profiler::instance()->recordSample(NULL, counter, event_type, &event);
     if (_live && trace != 0) {
-        live_refs.add(jni, object, size, trace);
+        live_refs.add(jni, object, size, counter, trace);
     }
 }
 
-void ObjectSampler::initLiveRefs(bool live) {
-    _live = live;
+void ObjectSampler::initLiveRefs(Arguments& args) {
+    _live = args._live;
     if (_live) {
-        live_refs.init();
+        live_refs.init(args._live_refs);
     }
 }
 
 void ObjectSampler::dumpLiveRefs() {
     if (_live) {
         live_refs.dump(VM::jni());
+        _live = false;
+    }
+}
+
+void ObjectSampler::sweepLiveRefs() {
+    JNIEnv* jni;
+    if (_live && (jni = VM::jni()) != NULL) {
+        live_refs.sweepAll(jni);
     }
 }
 
 Error ObjectSampler::start(Arguments& args) {
     _interval = args._alloc > 0 ? args._alloc : DEFAULT_ALLOC_INTERVAL;
+    _histo = args._alloc_histo;
+    class_id_cache.reset();
 
-    initLiveRefs(args._live);
+    initLiveRefs(args);
 
     jvmtiEnv* jvmti = VM::jvmti();
     jvmti->SetHeapSamplingInterval(_interval);
@@ -16,9 +16,10 @@ class ObjectSampler : public Engine {
   protected:
     static u64 _interval;
     static bool _live;
-    static volatile u64 _allocated_bytes;
+    static bool _histo;
+    static EventCounter _allocated_bytes;
 
-    static void initLiveRefs(bool live);
+    static void initLiveRefs(Arguments& args);
     static void dumpLiveRefs();
 
     static void recordAllocation(jvmtiEnv* jvmti, JNIEnv* jni, EventType event_type,
@@ -44,6 +45,9 @@ class ObjectSampler : public Engine {
                                            jobject object, jclass object_klass, jlong size);
 
     static void JNICALL GarbageCollectionStart(jvmtiEnv* jvmti);
+
+    // Takes collected objects out of the live allocation profile
+    static void sweepLiveRefs();
 };
 
 #endif // _OBJECTSAMPLER_H
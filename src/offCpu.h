@@ -0,0 +1,97 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OFFCPU_H
+#define _OFFCPU_H
+
+#include <pthread.h>
+#include <signal.h>
+#include "engine.h"
+
+#ifdef __linux__
+
+struct OffCpuEvent;
+struct OffCpuThread;
+
+// Measures blocking intervals with context switch records of per-CPU perf events.
+// A thread is signaled to walk its stack only once it has been blocked for longer
+// than the threshold; the rest of the interval is attributed to the same stack.
+class OffCpu : public Engine {
+  private:
+    static long _threshold;
+    static int _signal;
+    static int _cpu_count;
+    static OffCpuEvent* _cpu_events;
+    static int _max_threads;
+    static OffCpuThread* _threads;
+
+    volatile bool _running;
+    pthread_t _thread;
+
+    // Threads switched out voluntarily, in no particular order
+    int* _blocked;
+    int _blocked_count;
+    int _blocked_capacity;
+
+    void addBlocked(int tid);
+    void removeBlocked(int tid);
+    void switchOut(int tid, u64 time);
+    void switchIn(int tid, u64 time);
+    void processRecords(OffCpuEvent* event, u32 self_pid);
+    void signalBlocked(u64 now);
+    void readerLoop();
+
+    static void* threadEntry(void* off_cpu) {
+        ((OffCpu*)off_cpu)->readerLoop();
+        return NULL;
+    }
+
+    static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
+
+    static void recordOffCpu(u64 duration, int tid, u32 call_trace_id);
+    static int openEvent(int cgroup_fd, int cpu);
+    static int createEvents();
+    static void destroyEvents();
+
+  public:
+    const char* type() {
+        return "offcpu";
+    }
+
+    const char* title() {
+        return "Off-CPU profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error check(Arguments& args);
+    Error start(Arguments& args);
+    void stop();
+
+    static bool supported();
+};
+
+#else
+
+class OffCpu : public Engine {
+  public:
+    Error check(Arguments& args) {
+        return Error("Off-CPU profiling is not supported on this platform");
+    }
+
+    Error start(Arguments& args) {
+        return Error("Off-CPU profiling is not supported on this platform");
+    }
+
+    static bool supported() {
+        return false;
+    }
+};
+
+#endif // __linux__
+
+#endif // _OFFCPU_H
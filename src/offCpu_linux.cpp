@@ -0,0 +1,461 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "offCpu.h"
+#include "arch.h"
+#include "log.h"
+#include "perfEvents.h"
+#include "profiler.h"
+#include "tsc.h"
+
+
+// Context switch records appeared in kernel 4.3
+#ifdef PERF_RECORD_MISC_SWITCH_OUT
+
+// Introduced in kernel 4.17: the task was preempted, i.e. it is still runnable
+#ifndef PERF_RECORD_MISC_SWITCH_OUT_PREEMPT
+#define PERF_RECORD_MISC_SWITCH_OUT_PREEMPT  (1 << 14)
+#endif
+
+#ifndef PERF_FLAG_FD_CLOEXEC
+#define PERF_FLAG_FD_CLOEXEC  8
+#endif
+
+#ifndef PERF_FLAG_PID_CGROUP
+#define PERF_FLAG_PID_CGROUP  4
+#endif
+
+// Record only blocking intervals longer than 1 ms by default
+const long DEFAULT_OFFCPU_THRESHOLD = 1000000;
+
+// A thread woken up by the profiling signal that blocks again within this time
+// is considered to continue the same blocking call
+const u64 OFFCPU_RESUME_NS = 1000000;
+
+// Size of the ring buffer of every per-CPU event
+const unsigned long OFFCPU_DATA_SIZE = 256 * 1024;
+
+enum OffCpuFlags {
+    OFFCPU_BLOCKED  = 1,
+    OFFCPU_SIGNALED = 2,
+    OFFCPU_RESUMED  = 4
+};
+
+struct OffCpuEvent {
+    int fd;
+    struct perf_event_mmap_page* page;
+};
+
+// Indexed by tid. Only the reader thread changes the state,
+// the signal handler publishes call_trace_id of the walked stack.
+struct OffCpuThread {
+    u64 time;  // the last context switch
+    volatile u32 call_trace_id;
+    u32 flags;
+    int blocked_index;
+};
+
+
+long OffCpu::_threshold;
+int OffCpu::_signal;
+int OffCpu::_cpu_count = 0;
+OffCpuEvent* OffCpu::_cpu_events = NULL;
+int OffCpu::_max_threads = 0;
+OffCpuThread* OffCpu::_threads = NULL;
+
+bool OffCpu::supported() {
+    return true;
+}
+
+int OffCpu::openEvent(int cgroup_fd, int cpu) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_DUMMY;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+    attr.sample_id_all = 1;
+    attr.context_switch = 1;
+    attr.disabled = 1;
+    attr.watermark = 1;
+    attr.wakeup_watermark = OFFCPU_DATA_SIZE / 4;
+    // Same clock as OS::nanotime()
+    attr.use_clockid = 1;
+    attr.clockid = CLOCK_MONOTONIC;
+
+    int pid = cgroup_fd >= 0 ? cgroup_fd : -1;
+    unsigned long flags = PERF_FLAG_FD_CLOEXEC | (cgroup_fd >= 0 ? PERF_FLAG_PID_CGROUP : 0);
+    return syscall(__NR_perf_event_open, &attr, pid, cpu, -1, flags);
+}
+
+int OffCpu::createEvents() {
+    int cpu_count = (int)sysconf(_SC_NPROCESSORS_CONF);
+    _cpu_events = (OffCpuEvent*)calloc(cpu_count, sizeof(OffCpuEvent));
+    _cpu_count = 0;
+
+    // Switches of other processes in the same cgroup are filtered out by the reader
+    int cgroup_fd = PerfEvents::openOwnCgroup();
+
+    int err = 0;
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        int fd = openEvent(cgroup_fd, cpu);
+        if (fd == -1 && cgroup_fd >= 0 && errno != ENODEV) {
+            // Kernel without cgroup events: trace the whole CPU
+            close(cgroup_fd);
+            cgroup_fd = -1;
+            fd = openEvent(cgroup_fd, cpu);
+        }
+
+        if (fd == -1) {
+            if (errno == ENODEV) {
+                continue;  // CPU is offline
+            }
+            err = errno;
+            Log::warn("perf_event_open for CPU %d failed: %s", cpu, strerror(err));
+            break;
+        }
+
+        void* page = mmap(NULL, OS::page_size + OFFCPU_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (page == MAP_FAILED) {
+            err = errno;
+            Log::warn("perf_event mmap failed: %s", strerror(err));
+            close(fd);
+            break;
+        }
+
+        OffCpuEvent* event = &_cpu_events[_cpu_count++];
+        event->fd = fd;
+        event->page = (struct perf_event_mmap_page*)page;
+    }
+
+    if (cgroup_fd >= 0) {
+        close(cgroup_fd);
+    }
+
+    if (err == 0 && _cpu_count == 0) {
+        err = ENODEV;
+    }
+    if (err != 0) {
+        destroyEvents();
+    }
+    return err;
+}
+
+void OffCpu::destroyEvents() {
+    for (int i = 0; i < _cpu_count; i++) {
+        OffCpuEvent* event = &_cpu_events[i];
+        ioctl(event->fd, PERF_EVENT_IOC_DISABLE, 0);
+        close(event->fd);
+        munmap(event->page, OS::page_size + OFFCPU_DATA_SIZE);
+    }
+
+    free(_cpu_events);
+    _cpu_events = NULL;
+    _cpu_count = 0;
+}
+
+void OffCpu::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
+    int tid = OS::threadId();
+    if (tid >= _max_threads) {
+        return;
+    }
+
+    // The thread is walked only once per blocking interval: account the time blocked so far
+    OffCpuThread* thread = &_threads[tid];
+    long long duration = OS::nanotime() - thread->time;
+
+    WallClockEvent event;
+    event._start_time = TSC::ticks();
+    event._thread_state = THREAD_SLEEPING;
+    event._samples = 1;
+    u64 trace = Profiler::instance()->recordSample(ucontext, duration > 0 ? duration : 0, WALL_CLOCK_SAMPLE, &event);
+    thread->call_trace_id = (u32)trace;
+}
+
+void OffCpu::recordOffCpu(u64 duration, int tid, u32 call_trace_id) {
+    WallClockEvent event;
+    event._start_time = TSC::ticks();
+    event._thread_state = THREAD_SLEEPING;
+    event._samples = 1;
+    Profiler::instance()->recordExternalSamples(1, duration, tid, call_trace_id, WALL_CLOCK_SAMPLE, &event);
+}
+
+void OffCpu::addBlocked(int tid) {
+    if (_blocked_count == _blocked_capacity) {
+        _blocked_capacity *= 2;
+        _blocked = (int*)realloc(_blocked, _blocked_capacity * sizeof(int));
+    }
+    _threads[tid].blocked_index = _blocked_count;
+    _blocked[_blocked_count++] = tid;
+}
+
+void OffCpu::removeBlocked(int tid) {
+    int index = _threads[tid].blocked_index;
+    int last = _blocked[--_blocked_count];
+    _blocked[index] = last;
+    _threads[last].blocked_index = index;
+}
+
+void OffCpu::switchOut(int tid, u64 time) {
+    OffCpuThread* thread = &_threads[tid];
+    if (thread->flags & OFFCPU_BLOCKED) {
+        return;
+    }
+
+    // Blocking again right after the profiling signal continues the interval of the walked stack
+    if (!(thread->flags & OFFCPU_RESUMED) || time - thread->time >= OFFCPU_RESUME_NS) {
+        thread->call_trace_id = 0;
+    }
+    thread->flags = OFFCPU_BLOCKED;
+    thread->time = time;
+    addBlocked(tid);
+}
+
+void OffCpu::switchIn(int tid, u64 time) {
+    OffCpuThread* thread = &_threads[tid];
+    if (!(thread->flags & OFFCPU_BLOCKED)) {
+        // Either preempted or switched out before the profiler started
+        return;
+    }
+    removeBlocked(tid);
+
+    if (thread->flags & OFFCPU_SIGNALED) {
+        // Woken up by the signal handler, which has already recorded the time
+        thread->flags = OFFCPU_RESUMED;
+        thread->time = time;
+        return;
+    }
+
+    u32 call_trace_id = thread->call_trace_id;
+    if (call_trace_id != 0 && _enabled) {
+        recordOffCpu(time - thread->time, tid, call_trace_id);
+    }
+    thread->flags = 0;
+}
+
+void OffCpu::processRecords(OffCpuEvent* event, u32 self_pid) {
+    struct perf_event_mmap_page* page = event->page;
+    u64 tail = page->data_tail;
+    u64 head = page->data_head;
+    rmb();
+
+    ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
+    const char* data = (const char*)page + OS::page_size;
+
+    while (tail < head) {
+        // The header is 8-byte aligned and never wraps, but the rest of the record may
+        u64 record[8];
+        unsigned long offset = (unsigned long)tail & (OFFCPU_DATA_SIZE - 1);
+        struct perf_event_header* hdr = (struct perf_event_header*)(data + offset);
+        unsigned long size = hdr->size;
+        if (size == 0) {
+            break;
+        }
+
+        if (hdr->type == PERF_RECORD_SWITCH_CPU_WIDE && size <= sizeof(record)) {
+            unsigned long tail_bytes = OFFCPU_DATA_SIZE - offset;
+            if (size <= tail_bytes) {
+                memcpy(record, data + offset, size);
+            } else {
+                memcpy(record, data + offset, tail_bytes);
+                memcpy((char*)record + tail_bytes, data, size - tail_bytes);
+            }
+
+            // header; u32 next_prev_pid, next_prev_tid; sample_id: u32 pid, tid; u64 time
+            u16 misc = ((struct perf_event_header*)record)->misc;
+            u32 pid = (u32)record[2];
+            int tid = (int)(record[2] >> 32);
+            u64 time = record[3];
+
+            if (pid == self_pid && tid > 0 && tid < _max_threads &&
+                (!thread_filter->enabled() || thread_filter->accept(tid))) {
+                if (!(misc & PERF_RECORD_MISC_SWITCH_OUT)) {
+                    switchIn(tid, time);
+                } else if (!(misc & PERF_RECORD_MISC_SWITCH_OUT_PREEMPT)) {
+                    switchOut(tid, time);
+                }
+            }
+        }
+
+        tail += size;
+    }
+
+    __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+}
+
+void OffCpu::signalBlocked(u64 now) {
+    if (!_enabled) {
+        return;
+    }
+
+    for (int i = _blocked_count - 1; i >= 0; i--) {
+        int tid = _blocked[i];
+        OffCpuThread* thread = &_threads[tid];
+        if ((thread->flags & OFFCPU_SIGNALED) || thread->call_trace_id != 0 ||
+            (long long)(now - thread->time) < _threshold) {
+            continue;
+        }
+
+        if (OS::sendSignalToThread(tid, _signal)) {
+            thread->flags |= OFFCPU_SIGNALED;
+        } else {
+            // The thread has terminated
+            removeBlocked(tid);
+            thread->flags = 0;
+        }
+    }
+}
+
+void OffCpu::readerLoop() {
+    struct pollfd* fds = (struct pollfd*)calloc(_cpu_count, sizeof(struct pollfd));
+    for (int i = 0; i < _cpu_count; i++) {
+        fds[i].fd = _cpu_events[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    // Wake up often enough to signal threads soon after they cross the threshold
+    long timeout = _threshold / 2000000;
+    int timeout_ms = timeout < 1 ? 1 : timeout > 100 ? 100 : (int)timeout;
+
+    u32 self_pid = (u32)OS::processId();
+
+    while (_running) {
+        if (poll(fds, _cpu_count, timeout_ms) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < _cpu_count; i++) {
+            processRecords(&_cpu_events[i], self_pid);
+        }
+        signalBlocked(OS::nanotime());
+    }
+
+    // Flush intervals that are still in progress
+    u64 now = OS::nanotime();
+    for (int i = 0; i < _blocked_count; i++) {
+        int tid = _blocked[i];
+        u32 call_trace_id = _threads[tid].call_trace_id;
+        if (call_trace_id != 0 && !(_threads[tid].flags & OFFCPU_SIGNALED)) {
+            recordOffCpu(now - _threads[tid].time, tid, call_trace_id);
+        }
+    }
+
+    free(fds);
+}
+
+Error OffCpu::check(Arguments& args) {
+    int cgroup_fd = PerfEvents::openOwnCgroup();
+    int fd = openEvent(cgroup_fd, 0);
+    if (fd == -1 && cgroup_fd >= 0) {
+        fd = openEvent(-1, 0);
+    }
+    int err = errno;
+
+    if (cgroup_fd >= 0) {
+        close(cgroup_fd);
+    }
+
+    if (fd == -1) {
+        if (err == EACCES || err == EPERM) {
+            return Error("Context switch events unavailable. Try 'sysctl kernel.perf_event_paranoid=0'");
+        }
+        return Error("Context switch events unavailable");
+    }
+
+    close(fd);
+    return Error::OK;
+}
+
+Error OffCpu::start(Arguments& args) {
+    if (args._interval < 0) {
+        return Error("interval must be positive");
+    }
+    _threshold = args._interval ? args._interval : DEFAULT_OFFCPU_THRESHOLD;
+
+    int max_threads = OS::getMaxThreadId();
+    if (max_threads != _max_threads) {
+        // Kept between sessions, since a late signal handler may still refer to it
+        _threads = (OffCpuThread*)realloc(_threads, max_threads * sizeof(OffCpuThread));
+        _max_threads = max_threads;
+    }
+    memset(_threads, 0, _max_threads * sizeof(OffCpuThread));
+
+    _blocked_capacity = 1024;
+    _blocked_count = 0;
+    _blocked = (int*)malloc(_blocked_capacity * sizeof(int));
+
+    int err = createEvents();
+    if (err != 0) {
+        free(_blocked);
+        _blocked = NULL;
+        if (err == EACCES || err == EPERM) {
+            return Error("Context switch events unavailable. Try 'sysctl kernel.perf_event_paranoid=0'");
+        }
+        return Error("Context switch events unavailable");
+    }
+
+    _signal = args._signal == 0 ? OS::getProfilingSignal(1)
+                                : ((args._signal >> 8) > 0 ? args._signal >> 8 : args._signal);
+    OS::installSignalHandler(_signal, signalHandler);
+
+    _running = true;
+    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+        _running = false;
+        destroyEvents();
+        free(_blocked);
+        _blocked = NULL;
+        return Error("Unable to create off-CPU reader thread");
+    }
+
+    for (int i = 0; i < _cpu_count; i++) {
+        ioctl(_cpu_events[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return Error::OK;
+}
+
+void OffCpu::stop() {
+    for (int i = 0; i < _cpu_count; i++) {
+        ioctl(_cpu_events[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    _running = false;
+    pthread_join(_thread, NULL);
+
+    destroyEvents();
+    free(_blocked);
+    _blocked = NULL;
+}
+
+#else // !PERF_RECORD_MISC_SWITCH_OUT
+
+bool OffCpu::supported() {
+    return false;
+}
+
+Error OffCpu::check(Arguments& args) {
+    return Error("Off-CPU profiling requires kernel headers 4.3+");
+}
+
+Error OffCpu::start(Arguments& args) {
+    return Error("Off-CPU profiling requires kernel headers 4.3+");
+}
+
+void OffCpu::stop() {
+}
+
+#endif // PERF_RECORD_MISC_SWITCH_OUT
+
+#endif // __linux__
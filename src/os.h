@@ -15,10 +15,18 @@
 typedef void (*SigAction)(int, siginfo_t*, void*);
 typedef void (*SigHandler)(int);
 typedef void (*TimerCallback)(void*);
+typedef void (*ThreadTimesCallback)(void* arg, int thread_id, u64 utime, u64 stime);
 
 // Interrupt threads with this signal. The same signal is used inside JDK to interrupt I/O operations.
 const int WAKEUP_SIGNAL = SIGIO;
 
+// Kinds of memory returned by OS::safeAllocHuge
+enum PageBacking {
+    PAGES_REGULAR     = 0x1,
+    PAGES_TRANSPARENT = 0x2,
+    PAGES_HUGETLB     = 0x4
+};
+
 enum ThreadState {
     THREAD_UNKNOWN,
     THREAD_RUNNING,
@@ -94,11 +102,21 @@ class OS {
 
     static void* safeAlloc(size_t size);
     static void safeFree(void* addr, size_t size);
+    static void* safeAllocHuge(size_t size, int* backing);
+    static size_t getHugePageSize();
+
+    static int getNumaNodeCount();
+    static int getNumaNode();
+    static int currentCpu();
+    static int getCpuNode(int cpu);
+    static void bindToNumaNode(void* addr, size_t size, int node);
 
     static bool getCpuDescription(char* buf, size_t size);
     static int getCpuCount();
     static u64 getProcessCpuTime(u64* utime, u64* stime);
     static u64 getTotalCpuTime(u64* utime, u64* stime);
+    // User and system time of every thread in clock ticks, collected in one pass over the thread list
+    static bool getThreadCpuTimes(ThreadTimesCallback callback, void* arg);
 
     static int createMemoryFile(const char* name);
     static void copyFile(int src_fd, int dst_fd, off_t offset, size_t size);
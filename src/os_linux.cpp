@@ -24,6 +24,7 @@
 #include <time.h>
 #include <unistd.h>
 #include "os.h"
+#include "threadRegistry.h"
 
 
 #ifdef __LP64__
@@ -78,9 +79,24 @@ class LinuxThreadList : public ThreadList {
         return _thread_array[_index++];
     }
 
+    // With the thread registry on, /proc/self/task is listed once per THREAD_RESCAN_INTERVAL
+    // to catch threads that the hooks have not seen
     void update() {
         _index = _count = 0;
-        fillThreadArray();
+        if (!ThreadRegistry::enabled()) {
+            fillThreadArray();
+        } else if (ThreadRegistry::claimRescan()) {
+            std::vector<int> known;
+            ThreadRegistry::collect(known);
+            fillThreadArray();
+            ThreadRegistry::rescan(known, _thread_array, _count);
+        } else {
+            std::vector<int> threads;
+            ThreadRegistry::collect(threads);
+            for (size_t i = 0; i < threads.size(); i++) {
+                addThread(threads[i]);
+            }
+        }
     }
 };
 
@@ -309,6 +325,135 @@ void OS::safeFree(void* addr, size_t size) {
     syscall(__NR_munmap, addr, size);
 }
 
+// Tries hugetlbfs pages first, then transparent huge pages. getHugePageSize() must be called
+// beforehand outside of a signal handler, since it reads /proc/meminfo on the first call.
+void* OS::safeAllocHuge(size_t size, int* backing) {
+#ifdef MAP_HUGETLB
+    // hugetlbfs mappings can be unmapped only in whole huge pages
+    size_t huge_page_size = getHugePageSize();
+    if (huge_page_size != 0 && (size & (huge_page_size - 1)) == 0) {
+        intptr_t result = syscall(MMAP_SYSCALL, NULL, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (!(result < 0 && result > -4096)) {
+            *backing = PAGES_HUGETLB;
+            return (void*)result;
+        }
+    }
+#endif
+
+    void* result = safeAlloc(size);
+    if (result != NULL) {
+#ifdef MADV_HUGEPAGE
+        *backing = syscall(__NR_madvise, result, size, MADV_HUGEPAGE) == 0 ? PAGES_TRANSPARENT : PAGES_REGULAR;
+#else
+        *backing = PAGES_REGULAR;
+#endif
+    }
+    return result;
+}
+
+size_t OS::getHugePageSize() {
+    static size_t huge_page_size = (size_t)-1;
+    if (huge_page_size == (size_t)-1) {
+        size_t size = 0;
+        FILE* f = fopen("/proc/meminfo", "r");
+        if (f != NULL) {
+            char line[256];
+            while (fgets(line, sizeof(line), f) != NULL) {
+                if (strncmp(line, "Hugepagesize:", 13) == 0) {
+                    size = strtoull(line + 13, NULL, 10) * 1024;
+                    break;
+                }
+            }
+            fclose(f);
+        }
+        huge_page_size = size;
+    }
+    return huge_page_size;
+}
+
+int OS::getNumaNodeCount() {
+    static int node_count = 0;
+    if (node_count == 0) {
+        // The file contains a range of node numbers, e.g. 0-3
+        int count = 1;
+        int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+        if (fd != -1) {
+            char buf[64];
+            ssize_t r = read(fd, buf, sizeof(buf) - 1);
+            if (r > 0) {
+                buf[r] = 0;
+                const char* last = strrchr(buf, '-');
+                count = atoi(last != NULL ? last + 1 : buf) + 1;
+            }
+            close(fd);
+        }
+        node_count = count;
+    }
+    return node_count;
+}
+
+int OS::getNumaNode() {
+    // Async signal safe, unlike libnuma
+    unsigned int cpu, node;
+    return syscall(__NR_getcpu, &cpu, &node, NULL) == 0 ? (int)node : 0;
+}
+
+int OS::currentCpu() {
+    // Served by vDSO or rseq without entering the kernel
+    return sched_getcpu();
+}
+
+// The table is built on the first call, which must happen outside a signal handler
+int OS::getCpuNode(int cpu) {
+    static const int MAX_NODE_CPUS = 4096;
+    static unsigned char cpu_nodes[MAX_NODE_CPUS];
+    static volatile bool initialized = false;
+
+    if (!initialized) {
+        int node_count = getNumaNodeCount();
+        for (int node = 1; node < node_count && node < 256; node++) {
+            // cpulist is a comma separated list of ranges, e.g. 0-3,8-11
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            int fd = open(path, O_RDONLY);
+            if (fd == -1) {
+                continue;
+            }
+            char buf[1024];
+            ssize_t r = read(fd, buf, sizeof(buf) - 1);
+            close(fd);
+            if (r <= 0) {
+                continue;
+            }
+            buf[r] = 0;
+
+            for (char* p = buf; *p >= '0' && *p <= '9'; ) {
+                int first = (int)strtol(p, &p, 10);
+                int last = *p == '-' ? (int)strtol(p + 1, &p, 10) : first;
+                for (int i = first; i <= last && i < MAX_NODE_CPUS; i++) {
+                    cpu_nodes[i] = (unsigned char)node;
+                }
+                if (*p == ',') p++;
+            }
+        }
+        __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
+    }
+
+    return cpu >= 0 && cpu < MAX_NODE_CPUS ? cpu_nodes[cpu] : -1;
+}
+
+void OS::bindToNumaNode(void* addr, size_t size, int node) {
+    // MPOL_PREFERRED falls back to other nodes instead of failing when the node runs out of memory
+    const int MPOL_PREFERRED = 1;
+    const int bits = sizeof(unsigned long) * 8;
+    unsigned long nodemask[256 / bits] = {0};
+    if (node >= 0 && node < 256) {
+        nodemask[node / bits] = 1UL << (node % bits);
+        syscall(__NR_mbind, addr, size, MPOL_PREFERRED, nodemask, 256, 0);
+    }
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     int fd = open("/proc/cpuinfo", O_RDONLY);
     if (fd == -1) {
@@ -364,12 +509,60 @@ u64 OS::getTotalCpuTime(u64* utime, u64* stime) {
     return real;
 }
 
+bool OS::getThreadCpuTimes(ThreadTimesCallback callback, void* arg) {
+    DIR* dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        return false;
+    }
+
+    // Paths are resolved relative to the open task directory, no lookup of /proc/self per thread
+    int dir_fd = dirfd(dir);
+    char buf[512];
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        snprintf(buf, sizeof(buf), "%s/stat", entry->d_name);
+        int fd = openat(dir_fd, buf, O_RDONLY);
+        if (fd == -1) continue;
+
+        ssize_t r = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (r <= 0) continue;
+        buf[r] = 0;
+
+        // Thread name in parentheses may contain spaces, fields after it start from the state (3rd)
+        char* s = strrchr(buf, ')');
+        u64 utime, stime;
+        if (s != NULL && sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+            callback(arg, atoi(entry->d_name), utime, stime);
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
 int OS::createMemoryFile(const char* name) {
     return syscall(__NR_memfd_create, name, 0);
 }
 
 void OS::copyFile(int src_fd, int dst_fd, off_t offset, size_t size) {
-    // copy_file_range() is probably better, but not supported on all kernels
+#ifdef __NR_copy_file_range
+    // Within one file system, copy_file_range() shares extents (reflink) or copies in the kernel
+    // without touching page cache of the source. It fails with EXDEV across file systems,
+    // EINVAL for special files and ENOSYS before Linux 4.5: the rest is then copied with sendfile()
+    loff_t src_offset = offset;
+    while (size > 0) {
+        ssize_t bytes = syscall(__NR_copy_file_range, src_fd, &src_offset, dst_fd, NULL, size, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        size -= (size_t)bytes;
+    }
+    offset = src_offset;
+#endif
+
     while (size > 0) {
         ssize_t bytes = sendfile(dst_fd, src_fd, &offset, size);
         if (bytes <= 0) {
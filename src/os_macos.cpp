@@ -288,6 +288,38 @@ void OS::safeFree(void* addr, size_t size) {
     munmap(addr, size);
 }
 
+void* OS::safeAllocHuge(size_t size, int* backing) {
+    void* result = safeAlloc(size);
+    if (result != NULL) {
+        *backing = PAGES_REGULAR;
+    }
+    return result;
+}
+
+size_t OS::getHugePageSize() {
+    return 0;
+}
+
+int OS::getNumaNodeCount() {
+    return 1;
+}
+
+int OS::getNumaNode() {
+    return 0;
+}
+
+int OS::currentCpu() {
+    return -1;
+}
+
+int OS::getCpuNode(int cpu) {
+    return cpu < 0 ? -1 : 0;
+}
+
+void OS::bindToNumaNode(void* addr, size_t size, int node) {
+    // Not supported on macOS
+}
+
 bool OS::getCpuDescription(char* buf, size_t size) {
     return sysctlbyname("machdep.cpu.brand_string", buf, &size, NULL, 0) == 0;
 }
@@ -334,6 +366,30 @@ u64 OS::getTotalCpuTime(u64* utime, u64* stime) {
     return user + system + idle;
 }
 
+bool OS::getThreadCpuTimes(ThreadTimesCallback callback, void* arg) {
+    task_t task = mach_task_self();
+    thread_array_t threads;
+    mach_msg_type_number_t count;
+    if (task_threads(task, &threads, &count) != KERN_SUCCESS) {
+        return false;
+    }
+
+    u64 ticks_per_sec = sysconf(_SC_CLK_TCK);
+    for (u32 i = 0; i < count; i++) {
+        struct thread_basic_info info;
+        mach_msg_type_number_t size = sizeof(info);
+        if (thread_info(threads[i], THREAD_BASIC_INFO, (thread_info_t)&info, &size) == 0) {
+            u64 utime = (u64)info.user_time.seconds * 1000000 + info.user_time.microseconds;
+            u64 stime = (u64)info.system_time.seconds * 1000000 + info.system_time.microseconds;
+            callback(arg, (int)threads[i], utime * ticks_per_sec / 1000000, stime * ticks_per_sec / 1000000);
+        }
+        mach_port_deallocate(task, threads[i]);
+    }
+
+    vm_deallocate(task, (vm_address_t)threads, count * sizeof(thread_t));
+    return true;
+}
+
 int OS::createMemoryFile(const char* name) {
     // Not supported on macOS
     return -1;
@@ -0,0 +1,108 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OVERHEADBUDGET_H
+#define _OVERHEADBUDGET_H
+
+#include "arch.h"
+
+
+const u32 MAX_SAMPLING_SCALE = 1024;
+// Grow the scale by at most this factor per adjustment to damp reaction to short spikes
+const u32 MAX_SCALE_STEP = 8;
+
+// Keeps the time spent recording samples within a fraction of the process CPU time.
+// When over budget, only every N-th sample is taken, and the taken one stands for N samples.
+class OverheadBudget {
+  private:
+    double _budget;  // fraction of process CPU time, 0 when disabled
+    volatile u32 _scale;
+    u32 _min_scale;
+    volatile u32 _counter;
+    volatile u64 _spent;
+    u64 _last_spent;
+    u64 _last_cpu_time;
+
+  public:
+    OverheadBudget() {
+        reset(0, 0);
+    }
+
+    void reset(double budget, u64 cpu_time) {
+        _budget = budget;
+        _scale = 1;
+        _min_scale = 1;
+        _counter = 0;
+        _spent = 0;
+        _last_spent = 0;
+        _last_cpu_time = cpu_time;
+    }
+
+    bool enabled() const {
+        return _budget > 0;
+    }
+
+    u32 scale() const {
+        return _scale;
+    }
+
+    // Keeps every N-th sample at most, regardless of the budget
+    void setMinScale(u32 min_scale) {
+        _min_scale = min_scale;
+        if (_scale < min_scale) {
+            _scale = min_scale;
+        }
+    }
+
+    // Called for every sample candidate; lock-free, safe in a signal handler.
+    // Returns the weight factor of the sample, or 0 if the sample should be dropped.
+    u32 take() {
+        u32 scale = _scale;
+        if (scale <= 1) {
+            return 1;
+        }
+        return (u32)atomicInc(_counter) % scale == 0 ? scale : 0;
+    }
+
+    void consume(u64 nanos) {
+        atomicInc(_spent, nanos);
+    }
+
+    // Called periodically with the current process CPU time in ns. Since the recorded time
+    // is inversely proportional to the scale, the scale that meets the budget is extrapolated
+    // from the last period. Returns true if the scale has changed.
+    bool adjust(u64 cpu_time) {
+        u64 spent = _spent;
+        u64 spent_delta = spent - _last_spent;
+        u64 cpu_delta = cpu_time - _last_cpu_time;
+        _last_spent = spent;
+        _last_cpu_time = cpu_time;
+        if (cpu_delta == 0) {
+            return false;
+        }
+
+        double overhead = (double)spent_delta / cpu_delta;
+        u32 scale = _scale;
+        u32 new_scale = scale;
+        if (overhead > _budget) {
+            double target = scale * overhead / _budget + 1;
+            new_scale = target > scale * MAX_SCALE_STEP ? scale * MAX_SCALE_STEP : (u32)target;
+        } else if (overhead < _budget / 4 && scale > 1) {
+            // Leave a margin, so that the scale does not swing around the budget
+            new_scale = scale / 2;
+        }
+
+        if (new_scale > MAX_SAMPLING_SCALE) {
+            new_scale = MAX_SAMPLING_SCALE;
+        }
+        if (new_scale < _min_scale) {
+            new_scale = _min_scale;
+        }
+        _scale = new_scale;
+        return new_scale != scale;
+    }
+};
+
+#endif // _OVERHEADBUDGET_H
@@ -0,0 +1,78 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OVERHEADSTATS_H
+#define _OVERHEADSTATS_H
+
+#include <string.h>
+#include "arch.h"
+
+
+enum OverheadPhase {
+    PHASE_NATIVE_UNWIND,
+    PHASE_JAVA_UNWIND,
+    PHASE_STORAGE,
+    PHASE_JFR,
+    OVERHEAD_PHASES
+};
+
+// Bucket N counts durations in [2^(N-1), 2^N) ns; the last one also holds everything longer
+const int OVERHEAD_BUCKETS = 32;
+
+// Lock-free histograms of the time spent in each phase of recording a sample
+class OverheadStats {
+  private:
+    u64 _count[OVERHEAD_PHASES];
+    u64 _total[OVERHEAD_PHASES];
+    u64 _buckets[OVERHEAD_PHASES][OVERHEAD_BUCKETS];
+
+  public:
+    OverheadStats() {
+        reset();
+    }
+
+    void reset() {
+        memset(this, 0, sizeof(OverheadStats));
+    }
+
+    void record(OverheadPhase phase, u64 nanos) {
+        int bucket = nanos == 0 ? 0 : 64 - __builtin_clzll(nanos);
+        atomicInc(_count[phase]);
+        atomicInc(_total[phase], nanos);
+        atomicInc(_buckets[phase][bucket < OVERHEAD_BUCKETS ? bucket : OVERHEAD_BUCKETS - 1]);
+    }
+
+    u64 count(OverheadPhase phase) const {
+        return _count[phase];
+    }
+
+    u64 total(OverheadPhase phase) const {
+        return _total[phase];
+    }
+
+    u64 average(OverheadPhase phase) const {
+        return _count[phase] == 0 ? 0 : _total[phase] / _count[phase];
+    }
+
+    // Upper bound of the bucket that contains the given percentile
+    u64 percentile(OverheadPhase phase, int percent) const {
+        u64 threshold = (_count[phase] * percent + 99) / 100;
+        u64 seen = 0;
+        for (int i = 0; i < OVERHEAD_BUCKETS; i++) {
+            seen += _buckets[phase][i];
+            if (seen >= threshold && seen > 0) {
+                return 1ULL << i;
+            }
+        }
+        return 0;
+    }
+
+    static const char* name(OverheadPhase phase) {
+        static const char* const names[OVERHEAD_PHASES] = {"native_unwind", "java_unwind", "storage", "jfr"};
+        return names[phase];
+    }
+};
+
+#endif // _OVERHEADSTATS_H
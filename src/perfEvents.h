@@ -6,14 +6,19 @@
 #ifndef _PERFEVENTS_H
 #define _PERFEVENTS_H
 
+#include <pthread.h>
 #include "arch.h"
 #include "cpuEngine.h"
+#include "event.h"
 
 #ifdef __linux__
 
+struct perf_event_attr;
 class PerfEvent;
 class PerfEventType;
+class RingBuffer;
 class StackContext;
+class UnwindCache;
 
 class PerfEvents : public CpuEngine {
   private:
@@ -22,9 +27,39 @@ class PerfEvents : public CpuEngine {
     static PerfEventType* _event_type;
     static bool _alluser;
     static bool _kernel_stack;
+    static bool _data_addr;
     static int _target_cpu;
 
-    static u64 readCounter(siginfo_t* siginfo, void* ucontext);
+    // With percpu, one event per CPU is drained by the reader thread
+    static bool _per_cpu;
+    static int _cpu_count;
+    static PerfEvent* _cpu_events;
+    static pthread_t _reader_thread;
+    static volatile bool _reader_running;
+    // With cgroup, samples of all processes in the cgroup are recorded
+    static const char* _cgroup;
+
+    // Counters of the group led by the sampling event
+    static int _counter_count;
+    static char _counter_names[MAX_PERF_COUNTERS][64];
+    static int* _counter_fds;
+
+    static void initAttr(struct perf_event_attr* attr);
+    static Error setupCounters(Arguments& args);
+    static void closeCounters(int tid);
+    static int createForCpus();
+    static void destroyForCpus();
+    static int openCgroup();
+    static void recordCpuSample(RingBuffer& ring, u32 self_pid);
+    static void readerLoop();
+
+    static void* readerThreadEntry(void* unused) {
+        readerLoop();
+        return NULL;
+    }
+
+    static u64 readCounter(siginfo_t* siginfo, void* ucontext, ExecutionEvent* event);
+    static void readDataAccess(int tid, ExecutionEvent* event);
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext);
 
@@ -43,16 +78,31 @@ class PerfEvents : public CpuEngine {
     const char* title();
     const char* units();
 
-    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx);
+    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx,
+                    UnwindCache* cache = NULL);
     static void resetBuffer(int tid);
 
     static bool supported();
     static const char* getEventName(int event_id);
+    static int openOwnCgroup();
+
+    // Short name of the memory level that served a PERF_SAMPLE_DATA_SRC sample
+    static const char* dataSourceName(u64 data_src);
+    static bool isHitm(u64 data_src);
+
+    static int counterCount() {
+        return _counter_count;
+    }
+
+    static const char* counterName(int index) {
+        return _counter_names[index];
+    }
 };
 
 #else
 
 class StackContext;
+class UnwindCache;
 
 class PerfEvents : public CpuEngine {
   public:
@@ -64,7 +114,8 @@ class PerfEvents : public CpuEngine {
         return Error("PerfEvents are not supported on this platform");
     }
 
-    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx) {
+    static int walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx,
+                    UnwindCache* cache = NULL) {
         return 0;
     }
 
@@ -78,6 +129,14 @@ class PerfEvents : public CpuEngine {
     static const char* getEventName(int event_id) {
         return NULL;
     }
+
+    static int counterCount() {
+        return 0;
+    }
+
+    static const char* counterName(int index) {
+        return NULL;
+    }
 };
 
 #endif // __linux__
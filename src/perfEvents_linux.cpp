@@ -14,6 +14,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
@@ -21,10 +23,12 @@
 #include <sys/syscall.h>
 #include <linux/perf_event.h>
 #include "arch.h"
+#include "classIdCache.h"
 #include "fdtransferClient.h"
 #include "j9StackTraces.h"
 #include "log.h"
 #include "perfEvents.h"
+#include "processMaps.h"
 #include "profiler.h"
 #include "spinLock.h"
 #include "stackFrame.h"
@@ -50,6 +54,10 @@ struct f_owner_ex {
 #define PERF_FLAG_FD_CLOEXEC  8
 #endif // PERF_FLAG_FD_CLOEXEC
 
+#ifndef PERF_FLAG_PID_CGROUP
+#define PERF_FLAG_PID_CGROUP  4
+#endif // PERF_FLAG_PID_CGROUP
+
 enum {
     HW_BREAKPOINT_R  = 1,
     HW_BREAKPOINT_W  = 2,
@@ -490,28 +498,51 @@ FunctionWithCounter PerfEventType::KNOWN_FUNCTIONS[] = {
 char PerfEventType::probe_func[256];
 
 
+// Callchain entries copied out of the ring buffer at once
+const unsigned long PERF_CALLCHAIN_CHUNK = 64;
+
 class RingBuffer {
   private:
     const char* _start;
+    unsigned long _mask;
     unsigned long _offset;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, unsigned long data_size = OS::page_size) {
         _start = (const char*)page + OS::page_size;
+        _mask = data_size - 1;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
+    // Copies the next words, splitting the copy at most once where the buffer wraps around
+    void read(u64* buf, unsigned long words) {
+        unsigned long offset = (_offset + sizeof(u64)) & _mask;
+        unsigned long bytes = words * sizeof(u64);
+        unsigned long tail_bytes = _mask + 1 - offset;
+        if (bytes <= tail_bytes) {
+            memcpy(buf, _start + offset, bytes);
+        } else {
+            memcpy(buf, _start + offset, tail_bytes);
+            memcpy((char*)buf + tail_bytes, _start, bytes - tail_bytes);
+        }
+        _offset = (offset + bytes - sizeof(u64)) & _mask;
+    }
+
+    void skip(unsigned long words) {
+        _offset = (_offset + words * sizeof(u64)) & _mask;
+    }
+
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
 };
@@ -526,54 +557,336 @@ class PerfEvent : public SpinLock {
 };
 
 
+// Size of the ring buffer of a per-CPU event. Unlike per-thread buffers, which are drained
+// by the signal handler after every sample, it holds samples between wakeups of the reader.
+const unsigned long PERCPU_DATA_SIZE = 256 * 1024;
+
 int PerfEvents::_max_events = 0;
 PerfEvent* PerfEvents::_events = NULL;
 PerfEventType* PerfEvents::_event_type = NULL;
 bool PerfEvents::_alluser;
 bool PerfEvents::_kernel_stack;
+bool PerfEvents::_data_addr;
 int PerfEvents::_target_cpu;
-
-int PerfEvents::createForThread(int tid) {
-    if (tid >= _max_events) {
-        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
+bool PerfEvents::_per_cpu = false;
+int PerfEvents::_cpu_count = 0;
+PerfEvent* PerfEvents::_cpu_events = NULL;
+pthread_t PerfEvents::_reader_thread;
+volatile bool PerfEvents::_reader_running = false;
+const char* PerfEvents::_cgroup = NULL;
+int PerfEvents::_counter_count = 0;
+char PerfEvents::_counter_names[MAX_PERF_COUNTERS][64];
+int* PerfEvents::_counter_fds = NULL;
+
+// Copies, since lookup of raw and PMU events reuses a shared PerfEventType
+static PerfEventType _perf_counter_types[MAX_PERF_COUNTERS];
+
+// Libraries of other processes in the profiled cgroup, used by the reader thread only
+static ProcessMaps _process_maps;
+
+// Sampled data addresses are attributed to an object that starts at most this far below
+const uintptr_t DATA_OBJECT_SPAN = 4096;
+
+// Class ids of objects whose fields were sampled by dataaddr
+static ClassIdCache data_class_cache;
+
+// Descriptor of the cgroup v2 directory of this process, or -1 if it is unknown or the root
+int PerfEvents::openOwnCgroup() {
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
         return -1;
     }
 
-    // Mark _events[tid] early to prevent duplicates. Real fd will be put later.
-    if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, -1)) {
-        // Lost race. The event is created either from PerfEvents::start() or from pthread hook.
+    int fd = -1;
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::/", 4) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            char path[PATH_MAX + 16];
+            if (line[4] != 0 && snprintf(path, sizeof(path), "/sys/fs/cgroup%s", line + 3) < (int)sizeof(path)) {
+                fd = open(path, O_RDONLY | O_DIRECTORY);
+            }
+            break;
+        }
+    }
+
+    fclose(f);
+    return fd;
+}
+
+// The cgroup given by the option: an absolute path, a path relative to /sys/fs/cgroup,
+// or the cgroup of this process if empty
+int PerfEvents::openCgroup() {
+    if (_cgroup[0] == 0) {
+        return openOwnCgroup();
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), _cgroup[0] == '/' ? "%s" : "/sys/fs/cgroup/%s", _cgroup) >= (int)sizeof(path)) {
         return -1;
     }
+    return open(path, O_RDONLY | O_DIRECTORY);
+}
 
+void PerfEvents::initAttr(struct perf_event_attr* attr) {
     PerfEventType* event_type = _event_type;
-    struct perf_event_attr attr = {0};
-    attr.size = sizeof(attr);
-    attr.type = event_type->type;
+    attr->size = sizeof(*attr);
+    attr->type = event_type->type;
 
-    if (attr.type == PERF_TYPE_BREAKPOINT) {
-        attr.bp_type = event_type->config;
+    if (attr->type == PERF_TYPE_BREAKPOINT) {
+        attr->bp_type = event_type->config;
     } else {
-        attr.config = event_type->config;
+        attr->config = event_type->config;
     }
-    attr.config1 = event_type->config1;
-    attr.config2 = event_type->config2;
+    attr->config1 = event_type->config1;
+    attr->config2 = event_type->config2;
 
     // Hardware events may not always support zero skid
-    if (attr.type == PERF_TYPE_SOFTWARE) {
-        attr.precise_ip = 2;
+    if (attr->type == PERF_TYPE_SOFTWARE) {
+        attr->precise_ip = 2;
     }
 
-    attr.sample_period = _interval;
-    attr.sample_type = PERF_SAMPLE_CALLCHAIN;
-    attr.disabled = 1;
-    attr.wakeup_events = 1;
+    attr->sample_period = _interval;
+    attr->sample_type = PERF_SAMPLE_CALLCHAIN;
+    attr->disabled = 1;
+    attr->wakeup_events = 1;
 
     if (_alluser) {
-        attr.exclude_kernel = 1;
+        attr->exclude_kernel = 1;
     }
 
     if (!_kernel_stack) {
-        attr.exclude_callchain_kernel = 1;
+        attr->exclude_callchain_kernel = 1;
+    }
+
+#ifdef PERF_MEM_LVL_HIT
+    if (_data_addr) {
+        // Data addresses are reported by precise events only, e.g. PEBS. General registers
+        // at the sampled instruction help to find the object that holds the address.
+        attr->sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_REGS_USER | PERF_SAMPLE_DATA_SRC;
+        attr->sample_regs_user = PERF_REGS_GENERAL;
+        if (attr->precise_ip == 0) {
+            attr->precise_ip = 1;
+        }
+    }
+#endif
+}
+
+int PerfEvents::createForCpus() {
+    struct perf_event_attr attr = {0};
+    initAttr(&attr);
+    // There is no signal handler on the sampled thread to walk the user stack
+    attr.sample_type |= PERF_SAMPLE_TID;
+    attr.wakeup_events = 0;
+    attr.watermark = 1;
+    attr.wakeup_watermark = PERCPU_DATA_SIZE / 4;
+
+    int cpu_count = (int)sysconf(_SC_NPROCESSORS_CONF);
+    _cpu_events = (PerfEvent*)calloc(cpu_count, sizeof(PerfEvent));
+    _cpu_count = 0;
+
+    // Restrict events to the cgroup of the process in the kernel; other processes
+    // of the same cgroup are filtered out by the reader, unless the whole cgroup is profiled
+    int cgroup_fd = _cgroup != NULL ? openCgroup() : openOwnCgroup();
+    if (cgroup_fd < 0 && _cgroup != NULL) {
+        free(_cpu_events);
+        _cpu_events = NULL;
+        return ENOENT;
+    }
+    int pid = cgroup_fd >= 0 ? cgroup_fd : -1;
+    unsigned long flags = PERF_FLAG_FD_CLOEXEC | (cgroup_fd >= 0 ? PERF_FLAG_PID_CGROUP : 0);
+
+    int err = 0;
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        if (_target_cpu >= 0 && cpu != _target_cpu) {
+            continue;
+        }
+
+        int fd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, flags);
+        if (fd == -1 && cgroup_fd >= 0 && errno != ENODEV && _cgroup == NULL) {
+            // Kernel without cgroup events: sample the whole CPU
+            close(cgroup_fd);
+            cgroup_fd = -1;
+            pid = -1;
+            flags = PERF_FLAG_FD_CLOEXEC;
+            fd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, flags);
+        }
+
+        if (fd == -1) {
+            if (errno == ENODEV) {
+                continue;  // CPU is offline
+            }
+            err = errno;
+            Log::warn("perf_event_open for CPU %d failed: %s", cpu, strerror(err));
+            break;
+        }
+
+        void* page = mmap(NULL, OS::page_size + PERCPU_DATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (page == MAP_FAILED) {
+            err = errno;
+            Log::warn("perf_event mmap failed: %s", strerror(err));
+            close(fd);
+            break;
+        }
+
+        PerfEvent* event = &_cpu_events[_cpu_count++];
+        event->_fd = fd;
+        event->_page = (struct perf_event_mmap_page*)page;
+    }
+
+    if (cgroup_fd >= 0) {
+        close(cgroup_fd);
+    }
+
+    if (err == 0 && _cpu_count == 0) {
+        err = ENODEV;
+    }
+    if (err == 0) {
+        _reader_running = true;
+        if (pthread_create(&_reader_thread, NULL, readerThreadEntry, NULL) != 0) {
+            err = EAGAIN;
+            _reader_running = false;
+        }
+    }
+    if (err != 0) {
+        destroyForCpus();
+        return err;
+    }
+
+    for (int i = 0; i < _cpu_count; i++) {
+        ioctl(_cpu_events[i]._fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return 0;
+}
+
+void PerfEvents::destroyForCpus() {
+    if (_reader_running) {
+        _reader_running = false;
+        pthread_join(_reader_thread, NULL);
+    }
+
+    for (int i = 0; i < _cpu_count; i++) {
+        PerfEvent* event = &_cpu_events[i];
+        ioctl(event->_fd, PERF_EVENT_IOC_DISABLE, 0);
+        close(event->_fd);
+        munmap(event->_page, OS::page_size + PERCPU_DATA_SIZE);
+    }
+
+    free(_cpu_events);
+    _cpu_events = NULL;
+    _cpu_count = 0;
+    _process_maps.clear();
+}
+
+void PerfEvents::recordCpuSample(RingBuffer& ring, u32 self_pid) {
+    // u32 pid, tid; u64 nr; u64 ips[nr]
+    u64 pid_tid = ring.next();
+    u32 pid = (u32)pid_tid;
+    bool foreign = pid != self_pid;
+    u64 counter = _interval;
+    if ((foreign && _cgroup == NULL) || !_enabled || !Profiler::instance()->takeSample(counter)) {
+        return;
+    }
+
+    // User frames of other processes cannot be resolved with our own libraries
+    const void* callchain[MAX_NATIVE_FRAMES];
+    const char* foreign_frames[MAX_NATIVE_FRAMES];
+    u64 ips[PERF_CALLCHAIN_CHUNK];
+    int depth = 0;
+    int foreign_depth = 0;
+    bool user = false;
+    for (u64 nr = ring.next(); nr > 0 && depth + foreign_depth < MAX_NATIVE_FRAMES; ) {
+        unsigned long count = nr < PERF_CALLCHAIN_CHUNK ? (unsigned long)nr : PERF_CALLCHAIN_CHUNK;
+        ring.read(ips, count);
+        nr -= count;
+
+        for (unsigned long i = 0; i < count && depth + foreign_depth < MAX_NATIVE_FRAMES; i++) {
+            if (ips[i] >= PERF_CONTEXT_MAX) {
+                user = ips[i] == PERF_CONTEXT_USER;
+            } else if (foreign && user) {
+                foreign_frames[foreign_depth++] = _process_maps.findLibrary(pid, ips[i]);
+            } else {
+                const void* ip = (const void*)ips[i];
+                if (!foreign && CodeHeap::contains(ip)) {
+                    // Java frames can only be walked on the thread itself
+                    nr = 0;
+                    break;
+                }
+                callchain[depth++] = ip;
+            }
+        }
+    }
+
+    ASGCT_CallFrame frames[MAX_NATIVE_FRAMES + RESERVED_FRAMES];
+    ExecutionEvent event(TSC::ticks());
+    int num_frames = Profiler::instance()->convertNativeTrace(depth, callchain, frames, PERF_SAMPLE);
+    if (foreign) {
+        for (int i = 0; i < foreign_depth; i++) {
+            frames[num_frames].bci = BCI_NATIVE_FRAME;
+            frames[num_frames].method_id = (jmethodID)foreign_frames[i];
+            num_frames++;
+        }
+        frames[num_frames].bci = BCI_NATIVE_FRAME;
+        frames[num_frames].method_id = (jmethodID)_process_maps.rootFrame(pid);
+        num_frames++;
+    }
+    Profiler::instance()->recordExternalSample(counter, (int)(pid_tid >> 32), PERF_SAMPLE, &event, num_frames, frames);
+}
+
+void PerfEvents::readerLoop() {
+    struct pollfd* fds = (struct pollfd*)calloc(_cpu_count, sizeof(struct pollfd));
+    for (int i = 0; i < _cpu_count; i++) {
+        fds[i].fd = _cpu_events[i]._fd;
+        fds[i].events = POLLIN;
+    }
+
+    u32 self_pid = (u32)getpid();
+
+    while (_reader_running) {
+        if (poll(fds, _cpu_count, 100) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < _cpu_count; i++) {
+            struct perf_event_mmap_page* page = _cpu_events[i]._page;
+            u64 tail = page->data_tail;
+            u64 head = page->data_head;
+            rmb();
+
+            RingBuffer ring(page, PERCPU_DATA_SIZE);
+
+            while (tail < head) {
+                struct perf_event_header* hdr = ring.seek(tail);
+                if (hdr->type == PERF_RECORD_SAMPLE) {
+                    recordCpuSample(ring, self_pid);
+                }
+                tail += hdr->size;
+            }
+
+            __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    free(fds);
+}
+
+int PerfEvents::createForThread(int tid) {
+    if (tid >= _max_events) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
+        return -1;
+    }
+
+    // Mark _events[tid] early to prevent duplicates. Real fd will be put later.
+    if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, -1)) {
+        // Lost race. The event is created either from PerfEvents::start() or from pthread hook.
+        return -1;
+    }
+
+    struct perf_event_attr attr = {0};
+    initAttr(&attr);
+
+    if (_counter_count > 0) {
+        attr.read_format = PERF_FORMAT_GROUP;
     }
 
     if (_cstack >= CSTACK_FP) {
@@ -581,7 +894,7 @@ int PerfEvents::createForThread(int tid) {
     }
 
 #ifdef PERF_ATTR_SIZE_VER5
-    if (_cstack == CSTACK_LBR) {
+    if (_cstack == CSTACK_LBR || _cstack == CSTACK_LBRX) {
         attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
         attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
         attr.sample_regs_user = 1ULL << PERF_REG_PC;
@@ -612,8 +925,26 @@ int PerfEvents::createForThread(int tid) {
         return err;
     }
 
+    // Counters join the group of the sampling event: they are scheduled on the PMU together,
+    // and a single read of the leader returns all values
+    for (int i = 0; i < _counter_count; i++) {
+        struct perf_event_attr counter_attr = {0};
+        counter_attr.size = sizeof(counter_attr);
+        counter_attr.type = _perf_counter_types[i].type;
+        counter_attr.config = _perf_counter_types[i].config;
+        counter_attr.config1 = _perf_counter_types[i].config1;
+        counter_attr.config2 = _perf_counter_types[i].config2;
+        counter_attr.exclude_kernel = _alluser ? 1 : 0;
+
+        int counter_fd = syscall(__NR_perf_event_open, &counter_attr, tid, _target_cpu, fd, PERF_FLAG_FD_CLOEXEC);
+        if (counter_fd == -1) {
+            Log::debug("perf_event_open for counter %s failed: %s", _counter_names[i], strerror(errno));
+        }
+        _counter_fds[tid * MAX_PERF_COUNTERS + i] = counter_fd;
+    }
+
     void* page = NULL;
-    if (_kernel_stack || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR) {
+    if (_kernel_stack || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR || _cstack == CSTACK_LBRX || _data_addr) {
         page = mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (page == MAP_FAILED) {
             Log::warn("perf_event mmap failed: %s", strerror(errno));
@@ -645,6 +976,7 @@ int PerfEvents::createForThread(int tid) {
         munmap(page, 2 * OS::page_size);
         _events[tid]._page = NULL;
     }
+    closeCounters(tid);
     close(fd);
     _events[tid]._fd = 0;
 
@@ -660,6 +992,7 @@ void PerfEvents::destroyForThread(int tid) {
     int fd = event->_fd;
     if (fd > 0 && __sync_bool_compare_and_swap(&event->_fd, fd, 0)) {
         ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        closeCounters(tid);
         close(fd);
     }
     if (event->_page != NULL) {
@@ -670,7 +1003,31 @@ void PerfEvents::destroyForThread(int tid) {
     }
 }
 
-u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
+void PerfEvents::closeCounters(int tid) {
+    for (int i = 0; i < _counter_count; i++) {
+        int* counter_fd = &_counter_fds[tid * MAX_PERF_COUNTERS + i];
+        if (*counter_fd > 0) {
+            close(*counter_fd);
+        }
+        *counter_fd = -1;
+    }
+}
+
+u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext, ExecutionEvent* event) {
+    if (_counter_count > 0) {
+        // u64 nr; u64 values[nr], the leader goes first
+        u64 values[2 + MAX_PERF_COUNTERS];
+        ssize_t bytes = read(siginfo->si_fd, values, sizeof(values));
+        // Values of the counters are not attributable if any of them failed to open
+        if (bytes >= 16 && values[0] == (u64)(1 + _counter_count) && event != NULL) {
+            event->_counter_count = _counter_count;
+            memcpy(event->_counters, values + 2, _counter_count * sizeof(u64));
+        }
+        if (_event_type->counter_arg == 0) {
+            return bytes >= 16 ? values[1] : 1;
+        }
+    }
+
     switch (_event_type->counter_arg) {
         case 1: return StackFrame(ucontext).arg0();
         case 2: return StackFrame(ucontext).arg1();
@@ -683,6 +1040,101 @@ u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     }
 }
 
+#ifdef PERF_MEM_LVL_HIT
+
+// Heap object that holds the sampled address. Data addresses point inside an object,
+// and the object itself is typically addressed by one of the general purpose registers.
+static u32 findDataClass(u64 addr, const u64* regs, int reg_count) {
+    if (!VMStructs::hasClassNames() || !CollectedHeap::created()) {
+        return 0;
+    }
+
+    CollectedHeap* heap = CollectedHeap::heap();
+    uintptr_t base = 0;
+    for (int i = 0; i < reg_count; i++) {
+        uintptr_t r = (uintptr_t)regs[i];
+        if (r <= addr && addr - r < DATA_OBJECT_SPAN && r > base && heap->contains(r)) {
+            base = r;
+        }
+    }
+    if (base == 0) {
+        return 0;
+    }
+
+    u32 class_id = data_class_cache.get(base);
+    if (class_id == 0) {
+        VMKlass* klass = VMKlass::fromOopSafe(base);
+        if (klass == NULL) {
+            return 0;
+        }
+        VMSymbol* symbol = klass->name();
+        class_id = Profiler::instance()->classMap()->lookup(symbol->body(), symbol->length());
+        data_class_cache.put(base, class_id);
+    }
+    return class_id;
+}
+
+static const char* findDataRegion(u64 addr) {
+    const void* ptr = (const void*)(uintptr_t)addr;
+    if (CollectedHeap::created() && CollectedHeap::heap()->contains((uintptr_t)addr)) {
+        return "java_heap";
+    } else if (CodeHeap::contains(ptr)) {
+        return "code_cache";
+    }
+    CodeCache* lib = Profiler::instance()->findLibraryByAddress(ptr);
+    return lib != NULL ? lib->name() : "native_memory";
+}
+
+#endif // PERF_MEM_LVL_HIT
+
+// Looks at the sample record without consuming it: the ring buffer is drained later by walk()
+void PerfEvents::readDataAccess(int tid, ExecutionEvent* event) {
+#ifdef PERF_MEM_LVL_HIT
+    PerfEvent* perf_event = &_events[tid];
+    if (!perf_event->tryLock()) {
+        return;
+    }
+
+    struct perf_event_mmap_page* page = perf_event->_page;
+    if (page != NULL) {
+        u64 tail = page->data_tail;
+        u64 head = page->data_head;
+        rmb();
+
+        RingBuffer ring(page);
+
+        while (tail < head) {
+            struct perf_event_header* hdr = ring.seek(tail);
+            if (hdr->type == PERF_RECORD_SAMPLE) {
+                u64 addr = ring.next();
+                ring.skip(ring.next());
+
+                u64 regs[64];
+                int reg_count = 0;
+                if (ring.next() != PERF_SAMPLE_REGS_ABI_NONE) {
+                    reg_count = __builtin_popcountll(PERF_REGS_GENERAL);
+                    ring.read(regs, reg_count);
+                }
+                u64 data_src = ring.next();
+
+                if (addr != 0) {
+                    u32 class_id = findDataClass(addr, regs, reg_count);
+                    bool hitm = isHitm(data_src);
+                    event->_data_class_id = class_id;
+                    event->_data_region = class_id != 0 ? NULL : findDataRegion(addr);
+                    event->_data_source = dataSourceName(data_src);
+                    Profiler::instance()->cacheLines()->add((uintptr_t)addr, hitm, class_id);
+                }
+                break;
+            }
+            tail += hdr->size;
+        }
+    }
+
+    perf_event->unlock();
+#endif
+}
+
 void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     if (siginfo->si_code <= 0) {
         // Looks like an external signal; don't treat as a profiling event
@@ -691,13 +1143,25 @@ void PerfEvents::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
 
     if (_enabled) {
         ExecutionEvent event(TSC::ticks());
-        u64 counter = readCounter(siginfo, ucontext);
-        Profiler::instance()->recordSample(ucontext, counter, PERF_SAMPLE, &event);
+        u64 counter = readCounter(siginfo, ucontext, &event);
+        if (Profiler::instance()->takeSample(counter)) {
+            if (_data_addr) {
+                readDataAccess(OS::threadId(), &event);
+            }
+            Profiler::instance()->recordSample(ucontext, counter, PERF_SAMPLE, &event);
+            if (_data_addr) {
+                // The stack walk does not consume the ring buffer when C stacks are off
+                resetBuffer(OS::threadId());
+            }
+        } else {
+            // Dropped to stay within the overhead budget, but the ring buffer still needs a reset
+            resetBuffer(OS::threadId());
+        }
     } else {
         resetBuffer(OS::threadId());
     }
 
-    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, _counter_count > 0 ? PERF_IOC_FLAG_GROUP : 0);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
@@ -708,7 +1172,7 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
     }
 
     if (_enabled) {
-        u64 counter = readCounter(siginfo, ucontext);
+        u64 counter = readCounter(siginfo, ucontext, NULL);
         J9StackTraceNotification notif;
         StackContext java_ctx;
         notif.num_frames = _cstack == CSTACK_NO ? 0 : walk(OS::threadId(), ucontext, notif.addr, MAX_J9_NATIVE_FRAMES, &java_ctx);
@@ -717,7 +1181,7 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
         resetBuffer(OS::threadId());
     }
 
-    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, _counter_count > 0 ? PERF_IOC_FLAG_GROUP : 0);
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
@@ -768,14 +1232,30 @@ Error PerfEvents::check(Arguments& args) {
     }
 
 #ifdef PERF_ATTR_SIZE_VER5
-    if (args._cstack == CSTACK_LBR) {
+    if (args._cstack == CSTACK_LBR || args._cstack == CSTACK_LBRX) {
         attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
         attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
         attr.sample_regs_user = 1ULL << PERF_REG_PC;
     }
 #endif
 
-    int fd = syscall(__NR_perf_event_open, &attr, 0, args._target_cpu, -1, 0);
+    if (args._data_addr) {
+#ifdef PERF_MEM_LVL_HIT
+        if (args._per_cpu || args._cstack == CSTACK_LBR || args._cstack == CSTACK_LBRX) {
+            return Error("dataaddr is not supported with percpu or LBR stacks");
+        }
+        attr.sample_type |= PERF_SAMPLE_ADDR | PERF_SAMPLE_REGS_USER | PERF_SAMPLE_DATA_SRC;
+        attr.sample_regs_user = PERF_REGS_GENERAL;
+        attr.precise_ip = 1;
+#else
+        return Error("dataaddr requires kernel headers 3.10+");
+#endif
+    }
+
+    // Per-CPU events observe every process on a CPU
+    int pid = args._per_cpu ? -1 : 0;
+    int cpu = args._per_cpu && args._target_cpu < 0 ? 0 : args._target_cpu;
+    int fd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, 0);
     if (fd == -1) {
         return Error(strerror(errno));
     }
@@ -784,7 +1264,44 @@ Error PerfEvents::check(Arguments& args) {
     return Error::OK;
 }
 
+Error PerfEvents::setupCounters(Arguments& args) {
+    _counter_count = 0;
+
+    // The embedded list holds the last option first
+    const char* names[MAX_PERF_COUNTERS + 1];
+    int count = 0;
+    for (int offset = args._perf_counters; offset != 0 && count <= MAX_PERF_COUNTERS; offset = ((int*)(args._buf + offset))[-1]) {
+        names[count++] = args._buf + offset;
+    }
+
+    if (count > MAX_PERF_COUNTERS) {
+        return Error("Too many counters");
+    } else if (count > 0 && (args._per_cpu || FdTransferClient::hasPeer())) {
+        return Error("Counters are not supported with percpu or fdtransfer");
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char* name = names[count - 1 - i];
+        PerfEventType* type = PerfEventType::forName(name);
+        if (type == NULL || type->type == PERF_TYPE_BREAKPOINT || type->type == PERF_TYPE_TRACEPOINT || type->counter_arg != 0) {
+            return Error("Counter must be a hardware, software or raw PMU event");
+        }
+        _perf_counter_types[i] = *type;
+        snprintf(_counter_names[i], sizeof(_counter_names[i]), "%s", name);
+    }
+
+    _counter_count = count;
+    return Error::OK;
+}
+
 Error PerfEvents::start(Arguments& args) {
+    // Counters are looked up first: they keep copies of event types, while the sampling
+    // event may occupy the same shared raw or PMU entry
+    Error error = setupCounters(args);
+    if (error) {
+        return error;
+    }
+
     _event_type = PerfEventType::forName(args._event);
     if (_event_type == NULL) {
         return Error("Unsupported event type");
@@ -807,6 +1324,17 @@ Error PerfEvents::start(Arguments& args) {
     _count_overrun = false;
 
     _alluser = args._alluser;
+    _data_addr = args._data_addr;
+    if (_data_addr) {
+#ifdef PERF_MEM_LVL_HIT
+        if (args._per_cpu || _cstack == CSTACK_LBR || _cstack == CSTACK_LBRX) {
+            return Error("dataaddr is not supported with percpu or LBR stacks");
+        }
+        data_class_cache.reset();
+#else
+        return Error("dataaddr requires kernel headers 3.10+");
+#endif
+    }
     _kernel_stack = !_alluser && _cstack != CSTACK_NO;
     if (_kernel_stack && !Symbols::haveKernelSymbols()) {
         Log::warn("Kernel symbols are unavailable due to restrictions. Try\n"
@@ -817,18 +1345,46 @@ Error PerfEvents::start(Arguments& args) {
         _alluser = strcmp(args._event, EVENT_CPU) != 0 && !supported();
     }
 
+    _per_cpu = args._per_cpu;
+    _cgroup = args._cgroup;
+    if (_per_cpu) {
+        if (_cstack == CSTACK_LBR || _cstack == CSTACK_LBRX) {
+            return Error("LBR stacks are not supported with percpu");
+        } else if (FdTransferClient::hasPeer()) {
+            return Error("percpu is not supported with fdtransfer");
+        }
+
+        int err = createForCpus();
+        if (err == ENOENT && _cgroup != NULL) {
+            return Error("Cannot open cgroup");
+        } else if (err == EACCES || err == EPERM) {
+            return Error("Per-CPU perf events unavailable. Try 'sysctl kernel.perf_event_paranoid=0'");
+        } else if (err) {
+            return Error("Per-CPU perf events unavailable");
+        }
+        return Error::OK;
+    }
+
     adjustFDLimit();
 
     int max_events = OS::getMaxThreadId();
     if (max_events != _max_events) {
         free(_events);
         _events = (PerfEvent*)calloc(max_events, sizeof(PerfEvent));
+        free(_counter_fds);
+        _counter_fds = NULL;
         _max_events = max_events;
     }
 
+    if (_counter_count > 0 && _counter_fds == NULL) {
+        size_t size = (size_t)_max_events * MAX_PERF_COUNTERS * sizeof(int);
+        _counter_fds = (int*)malloc(size);
+        memset(_counter_fds, 0xff, size);
+    }
+
     if (VM::isOpenJ9()) {
         OS::installSignalHandler(_signal, signalHandlerJ9);
-        Error error = J9StackTraces::start(args);
+        error = J9StackTraces::start(args);
         if (error) {
             return error;
         }
@@ -855,6 +1411,11 @@ Error PerfEvents::start(Arguments& args) {
 }
 
 void PerfEvents::stop() {
+    if (_per_cpu) {
+        destroyForCpus();
+        return;
+    }
+
     disableThreadHook();
     for (int i = 0; i < _max_events; i++) {
         destroyForThread(i);
@@ -862,13 +1423,17 @@ void PerfEvents::stop() {
     J9StackTraces::stop();
 }
 
-int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx) {
+int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx,
+                     UnwindCache* cache) {
     PerfEvent* event = &_events[tid];
     if (!event->tryLock()) {
         return 0;  // the event is being destroyed
     }
 
     int depth = 0;
+    // Deepest call site in the branch stack, below which LBRX continues with a regular stack walk
+    const void* lbr_bottom = NULL;
+    bool continue_lbr = false;
 
     struct perf_event_mmap_page* page = event->_page;
     if (page != NULL) {
@@ -881,21 +1446,31 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
         while (tail < head) {
             struct perf_event_header* hdr = ring.seek(tail);
             if (hdr->type == PERF_RECORD_SAMPLE) {
+                if (_data_addr) {
+                    ring.next();  // PERF_SAMPLE_ADDR precedes the callchain
+                }
                 u64 nr = ring.next();
-                while (nr-- > 0) {
-                    u64 ip = ring.next();
-                    if (ip < PERF_CONTEXT_MAX) {
-                        const void* iptr = (const void*)ip;
-                        if (CodeHeap::contains(iptr) || depth >= max_depth) {
-                            // Stop at the first Java frame
-                            java_ctx->pc = iptr;
-                            goto stack_complete;
+                u64 ips[PERF_CALLCHAIN_CHUNK];
+                while (nr > 0) {
+                    unsigned long count = nr < PERF_CALLCHAIN_CHUNK ? (unsigned long)nr : PERF_CALLCHAIN_CHUNK;
+                    ring.read(ips, count);
+                    nr -= count;
+
+                    for (unsigned long i = 0; i < count; i++) {
+                        u64 ip = ips[i];
+                        if (ip < PERF_CONTEXT_MAX) {
+                            const void* iptr = (const void*)ip;
+                            if (CodeHeap::contains(iptr) || depth >= max_depth) {
+                                // Stop at the first Java frame
+                                java_ctx->pc = iptr;
+                                goto stack_complete;
+                            }
+                            callchain[depth++] = iptr;
                         }
-                        callchain[depth++] = iptr;
                     }
                 }
 
-                if (_cstack == CSTACK_LBR) {
+                if (_cstack == CSTACK_LBR || _cstack == CSTACK_LBRX) {
                     u64 bnr = ring.next();
 
                     // Last userspace PC is stored right after branch stack
@@ -922,6 +1497,11 @@ int PerfEvents::walk(int tid, void* ucontext, const void** callchain, int max_de
                             goto stack_complete;
                         }
                         callchain[depth++] = from;
+                        lbr_bottom = from;
+                    }
+
+                    if (_cstack == CSTACK_LBRX) {
+                        continue_lbr = true;
                     }
                 }
 
@@ -936,10 +1516,18 @@ stack_complete:
 
     event->unlock();
 
-    if (_cstack == CSTACK_FP) {
+    if (continue_lbr) {
+        if (lbr_bottom != NULL) {
+            depth += StackWalker::walkBelow(lbr_bottom, ucontext, callchain + depth, max_depth - depth, java_ctx, cache);
+        } else {
+            // Empty branch stack: walk from the sampled PC, which the walker records again
+            depth--;
+            depth += StackWalker::walkFP(ucontext, callchain + depth, max_depth - depth, java_ctx);
+        }
+    } else if (_cstack == CSTACK_FP) {
         depth += StackWalker::walkFP(ucontext, callchain + depth, max_depth - depth, java_ctx);
     } else if (_cstack == CSTACK_DWARF) {
-        depth += StackWalker::walkDwarf(ucontext, callchain + depth, max_depth - depth, java_ctx);
+        depth += StackWalker::walkDwarf(ucontext, callchain + depth, max_depth - depth, java_ctx, cache);
     }
 
     return depth;
@@ -981,6 +1569,46 @@ bool PerfEvents::supported() {
     return true;
 }
 
+const char* PerfEvents::dataSourceName(u64 data_src) {
+#ifdef PERF_MEM_LVL_HIT
+    perf_mem_data_src src;
+    src.val = data_src;
+
+    if (src.mem_lvl & PERF_MEM_LVL_MISS) {
+        return "unknown";
+    } else if (src.mem_lvl & PERF_MEM_LVL_L1) {
+        return "L1";
+    } else if (src.mem_lvl & PERF_MEM_LVL_LFB) {
+        return "LFB";
+    } else if (src.mem_lvl & PERF_MEM_LVL_L2) {
+        return "L2";
+    } else if (src.mem_lvl & PERF_MEM_LVL_L3) {
+        return isHitm(data_src) ? "L3_hitm" : "L3";
+    } else if (src.mem_lvl & PERF_MEM_LVL_LOC_RAM) {
+        return "local_dram";
+    } else if (src.mem_lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2)) {
+        return "remote_dram";
+    } else if (src.mem_lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2)) {
+        return isHitm(data_src) ? "remote_hitm" : "remote_cache";
+    } else if (src.mem_lvl & PERF_MEM_LVL_IO) {
+        return "io";
+    } else if (src.mem_lvl & PERF_MEM_LVL_UNC) {
+        return "uncached";
+    }
+#endif
+    return "unknown";
+}
+
+bool PerfEvents::isHitm(u64 data_src) {
+#ifdef PERF_MEM_LVL_HIT
+    perf_mem_data_src src;
+    src.val = data_src;
+    return (src.mem_snoop & PERF_MEM_SNOOP_HITM) != 0;
+#else
+    return false;
+#endif
+}
+
 const char* PerfEvents::getEventName(int event_id) {
     if (event_id >= 0 && (size_t)event_id < sizeof(PerfEventType::AVAILABLE_EVENTS) / sizeof(PerfEventType)) {
         return PerfEventType::AVAILABLE_EVENTS[event_id].name;
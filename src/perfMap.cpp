@@ -0,0 +1,156 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "perfMap.h"
+#include "codeCache.h"
+#include "log.h"
+#include "os.h"
+#include "vmEntry.h"
+#include "vmStructs.h"
+
+
+// How often queued entries are written out. perf and eBPF tools read the map
+// when they symbolize samples, so a short delay does not lose anything.
+const u64 PERF_MAP_FLUSH_INTERVAL = 100 * 1000 * 1000;
+
+volatile bool PerfMap::_enabled = false;
+SpinLock PerfMap::_lock;
+std::vector<PerfMapEntry> PerfMap::_queue;
+int PerfMap::_fd = -1;
+volatile bool PerfMap::_running = false;
+pthread_t PerfMap::_thread;
+
+
+Error PerfMap::start() {
+    if (!VM::loaded()) {
+        return Error("perfmap requires a Java process");
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", OS::processId());
+    // Entries of the previous sessions stay valid for the code that has not been unloaded
+    _fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (_fd < 0) {
+        return Error("Could not open perf map file");
+    }
+
+    _running = true;
+    if (pthread_create(&_thread, NULL, threadEntry, NULL) != 0) {
+        _running = false;
+        close(_fd);
+        _fd = -1;
+        return Error("Unable to create perf map writer thread");
+    }
+
+    _enabled = true;
+
+    jvmtiEnv* jvmti = VM::jvmti();
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
+    // Methods compiled before start are replayed to the same callback
+    jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+    return Error::OK;
+}
+
+void PerfMap::stop() {
+    if (!_enabled) {
+        return;
+    }
+    _enabled = false;
+
+    // Without code heap bounds from VMStructs, the profiler itself needs CompiledMethodLoad
+    if (VM::hotspot_version() > 0 && CodeHeap::available()) {
+        VM::jvmti()->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
+    }
+
+    _running = false;
+    pthread_kill(_thread, WAKEUP_SIGNAL);
+    pthread_join(_thread, NULL);
+
+    close(_fd);
+    _fd = -1;
+}
+
+void PerfMap::addStub(const void* address, int length, const char* name) {
+    if (_enabled) {
+        PerfMapEntry e = {address, length, NULL, strdup(name)};
+        _lock.lock();
+        _queue.push_back(e);
+        _lock.unlock();
+    }
+}
+
+// Java frames are named the same way as in collapsed stacks: com/example/Class.method
+void PerfMap::flush(JNIEnv* jni, jvmtiEnv* jvmti, std::vector<PerfMapEntry>& entries) {
+    std::string buf;
+    char line[64];
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const PerfMapEntry& e = entries[i];
+        snprintf(line, sizeof(line), "%lx %x ", (unsigned long)(uintptr_t)e.address, e.length);
+
+        if (e.method == NULL) {
+            buf.append(line).append(e.name).append("\n");
+            free(e.name);
+            continue;
+        }
+
+        jclass method_class = NULL;
+        char* class_name = NULL;
+        char* method_name = NULL;
+        // A method may be unloaded by the time its entry is written
+        if (jvmti->GetMethodDeclaringClass(e.method, &method_class) == 0 &&
+            jvmti->GetClassSignature(method_class, &class_name, NULL) == 0 &&
+            jvmti->GetMethodName(e.method, &method_name, NULL, NULL) == 0) {
+            size_t len = strlen(class_name);
+            buf.append(line);
+            if (class_name[0] == 'L' && len >= 2) {
+                buf.append(class_name + 1, len - 2);
+            } else {
+                buf.append(class_name);
+            }
+            buf.append(".").append(method_name).append("\n");
+        }
+        jvmti->Deallocate((unsigned char*)method_name);
+        jvmti->Deallocate((unsigned char*)class_name);
+        jni->DeleteLocalRef(method_class);
+    }
+
+    if (!buf.empty() && write(_fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+        Log::warn("Failed to write perf map: %s", strerror(errno));
+    }
+}
+
+void PerfMap::writerLoop() {
+    JNIEnv* jni = VM::attachThread("Async-profiler Perf Map");
+    jvmtiEnv* jvmti = VM::jvmti();
+    std::vector<PerfMapEntry> entries;
+
+    while (true) {
+        bool running = _running;
+
+        _lock.lock();
+        entries.swap(_queue);
+        _lock.unlock();
+
+        if (jni != NULL) {
+            flush(jni, jvmti, entries);
+        }
+        entries.clear();
+
+        if (!running) {
+            break;
+        }
+        OS::sleep(PERF_MAP_FLUSH_INTERVAL);
+    }
+
+    VM::detachThread();
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PERFMAP_H
+#define _PERFMAP_H
+
+#include <jvmti.h>
+#include <pthread.h>
+#include <vector>
+#include "arguments.h"
+#include "spinLock.h"
+
+
+struct PerfMapEntry {
+    const void* address;
+    int length;
+    jmethodID method;
+    char* name;  // of a runtime stub, when method is NULL
+};
+
+// Publishes JIT-compiled code in /tmp/perf-<pid>.map, so that system-wide profilers
+// like perf or eBPF tools can symbolize Java frames. JVM TI callbacks only queue entries;
+// method names are resolved and appended to the file by a background thread.
+class PerfMap {
+  private:
+    static volatile bool _enabled;
+    static SpinLock _lock;
+    static std::vector<PerfMapEntry> _queue;
+
+    static int _fd;
+    static volatile bool _running;
+    static pthread_t _thread;
+
+    static void* threadEntry(void* unused) {
+        writerLoop();
+        return NULL;
+    }
+
+    static void writerLoop();
+    static void flush(JNIEnv* jni, jvmtiEnv* jvmti, std::vector<PerfMapEntry>& entries);
+
+  public:
+    static Error start();
+    static void stop();
+
+    static bool enabled() {
+        return _enabled;
+    }
+
+    static void add(const void* address, int length, jmethodID method) {
+        if (_enabled) {
+            PerfMapEntry e = {address, length, method, NULL};
+            _lock.lock();
+            _queue.push_back(e);
+            _lock.unlock();
+        }
+    }
+
+    static void addStub(const void* address, int length, const char* name);
+};
+
+#endif // _PERFMAP_H
@@ -0,0 +1,100 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "processMaps.h"
+#include "codeCache.h"
+#include "os.h"
+
+
+// Mappings are reread on a miss, but not more often than this
+const u64 MAPS_RELOAD_INTERVAL = 1000000;
+
+const char* ProcessMaps::intern(const char* name) {
+    char*& result = _names[name];
+    if (result == NULL) {
+        result = NativeFunc::create(name, -1);
+    }
+    return result;
+}
+
+void ProcessMaps::load(u32 pid, Process& process) {
+    process.loaded = OS::micros();
+    process.mappings.clear();
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%u/maps", pid);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // start-end perms offset dev inode [file]
+        unsigned long long start, end;
+        char perms[8];
+        int file_pos = 0;
+        if (sscanf(line, "%llx-%llx %7s %*s %*s %*s %n", &start, &end, perms, &file_pos) < 3 || perms[2] != 'x') {
+            continue;
+        }
+
+        line[strcspn(line, "\n")] = 0;
+        const char* file = file_pos > 0 ? line + file_pos : "";
+        Mapping m = {start, end, file[0] == '/' || file[0] == '[' ? intern(file) : NULL};
+        process.mappings.push_back(m);
+    }
+    fclose(f);
+
+    std::sort(process.mappings.begin(), process.mappings.end(),
+              [](const Mapping& a, const Mapping& b) { return a.start < b.start; });
+}
+
+ProcessMaps::Process& ProcessMaps::process(u32 pid) {
+    auto it = _processes.find(pid);
+    if (it != _processes.end()) {
+        return it->second;
+    }
+
+    Process& process = _processes[pid];
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%u/comm", pid);
+    char comm[32] = "";
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        if (fgets(comm, sizeof(comm), f) == NULL) comm[0] = 0;
+        comm[strcspn(comm, "\n")] = 0;
+        fclose(f);
+    }
+
+    snprintf(path, sizeof(path), comm[0] ? "[%s pid=%u]" : "[%spid=%u]", comm, pid);
+    process.root_frame = intern(path);
+    load(pid, process);
+    return process;
+}
+
+const char* ProcessMaps::rootFrame(u32 pid) {
+    return process(pid).root_frame;
+}
+
+const char* ProcessMaps::findLibrary(u32 pid, u64 address) {
+    Process& p = process(pid);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        auto it = std::upper_bound(p.mappings.begin(), p.mappings.end(), address,
+                                   [](u64 a, const Mapping& m) { return a < m.start; });
+        if (it != p.mappings.begin() && address < (--it)->end) {
+            return it->name;
+        }
+        // The process may have loaded a library since
+        if (attempt > 0 || OS::micros() - p.loaded < MAPS_RELOAD_INTERVAL) {
+            break;
+        }
+        load(pid, p);
+    }
+    return NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PROCESSMAPS_H
+#define _PROCESSMAPS_H
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "arch.h"
+
+
+// Executable mappings of other processes, e.g. those of a cgroup sampled by per-CPU events.
+// Symbols of these processes are not parsed: a user frame is named after the mapped file.
+// Names are created by NativeFunc and live as long as the process, since call traces refer to them.
+// Not thread safe.
+class ProcessMaps {
+  private:
+    struct Mapping {
+        u64 start;
+        u64 end;
+        const char* name;
+    };
+
+    struct Process {
+        const char* root_frame;
+        u64 loaded;
+        std::vector<Mapping> mappings;
+    };
+
+    std::unordered_map<u32, Process> _processes;
+    std::map<std::string, char*> _names;
+
+    const char* intern(const char* name);
+    void load(u32 pid, Process& process);
+    Process& process(u32 pid);
+
+  public:
+    // "[comm pid=N]", a pseudo frame at the bottom of the stack
+    const char* rootFrame(u32 pid);
+
+    // File mapped at the given address, or NULL for anonymous memory
+    const char* findLibrary(u32 pid, u64 address);
+
+    // Forgets the mappings, but not the names
+    void clear() {
+        _processes.clear();
+    }
+};
+
+#endif // _PROCESSMAPS_H
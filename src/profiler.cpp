@@ -18,6 +18,7 @@
 #include "mallocTracer.h"
 #include "lockTracer.h"
 #include "wallClock.h"
+#include "virtualThreads.h"
 #include "j9ObjectSampler.h"
 #include "j9StackTraces.h"
 #include "j9WallClock.h"
@@ -27,14 +28,20 @@
 #include "flameGraph.h"
 #include "flightRecorder.h"
 #include "fdtransferClient.h"
+#include "fileRotator.h"
 #include "frameName.h"
+#include "gzipWriter.h"
 #include "os.h"
+#include "protobuf.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "threadLocalData.h"
+#include "threadRegistry.h"
 #include "tsc.h"
 #include "vmStructs.h"
+#include "zstdWriter.h"
 
 
 // The instance is not deleted on purpose, since profiler structures
@@ -52,13 +59,24 @@ static LockTracer lock_tracer;
 static ObjectSampler object_sampler;
 static J9ObjectSampler j9_object_sampler;
 static WallClock wall_clock;
+static VirtualThreads virtual_threads;
 static J9WallClock j9_wall_clock;
 static CTimer ctimer;
 static ITimer itimer;
+static OffCpu off_cpu;
 static Instrument instrument;
 
 static ProfilingWindow profiling_window;
 
+// Minimum number of traces per flame graph worker thread
+const size_t PARALLEL_DUMP_THRESHOLD = 4096;
+const size_t MAX_DUMP_THREADS = 8;
+
+// Load shedding steps under memlimit: lower stack depth, sparser samples, frozen call trace storage
+const int MEMORY_SHED_LEVELS = 3;
+const int MEMORY_SHED_MIN_DEPTH = 64;
+const u32 MEMORY_SHED_SCALE = 4;
+
 
 // The same constants are used in JfrSync
 enum EventMask {
@@ -70,6 +88,17 @@ enum EventMask {
 };
 
 
+struct FlameGraphTask {
+    Arguments* args;
+    const std::vector<CallTraceSample*>* samples;
+    size_t start;
+    size_t end;
+    FlameGraph* flamegraph;
+    u64 printed_sample_count;
+    bool done;
+};
+
+
 struct MethodSample {
     u64 samples;
     u64 counter;
@@ -82,10 +111,21 @@ struct MethodSample {
 
 typedef std::pair<std::string, MethodSample> NamedMethodSample;
 
+// Leaf frames are aggregated before their names are resolved: the same frame of many traces is named once
+typedef std::map<std::pair<jmethodID, jint>, MethodSample> FrameHistogram;
+
 static bool sortByCounter(const NamedMethodSample& a, const NamedMethodSample& b) {
     return a.second.counter > b.second.counter;
 }
 
+static bool sortSamplesByCounter(const CallTraceSample& a, const CallTraceSample& b) {
+    return a.counter > b.counter;
+}
+
+static bool sortClassesByBytes(const ClassHistogramEntry& a, const ClassHistogramEntry& b) {
+    return a.bytes > b.bytes;
+}
+
 
 static inline int hasNativeStack(EventType event_type) {
     const int events_with_native_stack =
@@ -116,6 +156,29 @@ static inline int makeFrame(ASGCT_CallFrame* frames, jint type, const char* id)
     return makeFrame(frames, type, (jmethodID)id);
 }
 
+// Threads of a pool share one frame in group mode, so that their equal stacks merge into one trace.
+// Threads without a known name at start, e.g. non-Java threads, still get a frame of their own.
+// A carrier of a virtual thread is replaced with the virtual thread itself; all virtual threads form one group.
+int Profiler::makeThreadFrame(ASGCT_CallFrame* frames, int tid) {
+    jlong vthread = VirtualThreads::mounted(tid);
+    if (vthread != 0) {
+        return makeVirtualThreadFrame(frames, vthread);
+    }
+
+    u32 group = _group_threads ? _thread_names.group(tid) : 0;
+    if (group != 0) {
+        return makeFrame(frames, BCI_THREAD_GROUP, (uintptr_t)group);
+    }
+    return makeFrame(frames, BCI_THREAD_ID, (uintptr_t)tid);
+}
+
+int Profiler::makeVirtualThreadFrame(ASGCT_CallFrame* frames, jlong vthread) {
+    if (_group_threads) {
+        return makeFrame(frames, BCI_ERROR, "[virtual threads]");
+    }
+    return makeFrame(frames, BCI_VIRTUAL_THREAD, (uintptr_t)vthread);
+}
+
 
 // Avoid syscall when possible
 static inline int fastThreadId() {
@@ -136,8 +199,10 @@ void Profiler::addJavaMethod(const void* address, int length, jmethodID method)
 
 void Profiler::addRuntimeStub(const void* address, int length, const char* name) {
     _stubs_lock.lock();
-    _runtime_stubs.add(address, length, name, true);
+    char* name_copy = _runtime_stubs.add(address, length, name, true);
+    _stub_table.add(address, (const char*)address + length, name_copy);
     _stubs_lock.unlock();
+    PerfMap::addStub(address, length, name);
 
     if (strcmp(name, "call_stub") == 0) {
         _call_stub_begin = address;
@@ -147,23 +212,65 @@ void Profiler::addRuntimeStub(const void* address, int length, const char* name)
     CodeHeap::updateBounds(address, (const char*)address + length);
 }
 
+// Stubs generated before the perf map was enabled, e.g. the interpreter
+void Profiler::publishRuntimeStubs() {
+    _stubs_lock.lock();
+    for (int i = 0; i < _runtime_stubs.count(); i++) {
+        const CodeBlob* blob = _runtime_stubs.blob(i);
+        PerfMap::addStub(blob->_start, (int)((const char*)blob->_end - (const char*)blob->_start), blob->_name);
+    }
+    _stubs_lock.unlock();
+}
+
 void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    ThreadRegistry::onThreadStart(OS::threadId());
     if (_thread_filter.enabled()) {
         _thread_filter.remove(OS::threadId());
     }
     updateThreadName(jvmti, jni, thread);
+    if (VM::isOpenJ9()) {
+        J9StackTraces::onThreadStart(jni, thread);
+    }
 }
 
 void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+    ThreadRegistry::onThreadEnd(OS::threadId());
     if (_thread_filter.enabled()) {
         _thread_filter.remove(OS::threadId());
     }
     updateThreadName(jvmti, jni, thread);
+    if (VM::isOpenJ9()) {
+        J9StackTraces::onThreadEnd(jni, thread);
+    }
+}
+
+void Profiler::onGarbageCollectionStart() {
+    _gc_active = true;
 }
 
 void Profiler::onGarbageCollectionFinish() {
     // Called during GC pause, do not use JNI
     atomicInc(_gc_id);
+    _gc_active = false;
+}
+
+// During a stop-the-world pause, Java threads that are stopping or resuming are mostly
+// not walkable, and a failed walk costs as much as a successful one. Returns the frame
+// that replaces the stack of such a thread, or NULL if the stack should be walked.
+// A thread blocked for a pause takes CPU samples only while it spins in the pause protocol.
+const char* Profiler::pauseFrame(EventType event_type) {
+    if (!_gc_active && !VMStructs::safepointActive()) {
+        return NULL;
+    }
+
+    VMThread* vm_thread = VMThread::current();
+    if (vm_thread == NULL || VM::jni() == NULL) {
+        return NULL;
+    }
+    if (vm_thread->inTransition() || (event_type == EXECUTION_SAMPLE && vm_thread->isBlocked())) {
+        return _gc_active ? "[gc]" : "[safepoint]";
+    }
+    return NULL;
 }
 
 const char* Profiler::asgctError(int code) {
@@ -198,17 +305,55 @@ const char* Profiler::asgctError(int code) {
     }
 }
 
-inline u32 Profiler::getLockIndex(int tid) {
-    u32 lock_index = tid;
-    lock_index ^= lock_index >> 8;
-    lock_index ^= lock_index >> 4;
-    return lock_index % CONCURRENCY_LEVEL;
+// Returns the index of the acquired lock, or -1 if all locks are busy.
+// The search starts from the lock of the current CPU: signal handlers running on different CPUs
+// do not compete, and the lock is normally busy only if a handler has been preempted.
+inline int Profiler::tryLockAny(int tid, int cpu) {
+    u32 start = cpu;
+    if (cpu < 0) {
+        start = tid;
+        start ^= start >> 8;
+        start ^= start >> 4;
+    }
+
+    for (u32 i = 0; i < CONCURRENCY_LEVEL; i++) {
+        u32 lock_index = (start + i) % CONCURRENCY_LEVEL;
+        if (_locks[lock_index].tryLock()) {
+            return lock_index;
+        }
+    }
+    return -1;
+}
+
+inline int Profiler::tryLockAny(int tid) {
+    return tryLockAny(tid, OS::currentCpu());
 }
 
 void Profiler::updateSymbols(bool kernel_symbols) {
     Symbols::parseLibraries(&_native_libs, kernel_symbols);
 }
 
+// Called after a successful dlopen. Only newly loaded objects are parsed, so that reopening
+// a library costs nothing. Unless imports of the new libraries have to be patched right away,
+// parsing is left to a background thread, which handles a burst of dlopens in one pass.
+// Returns true if the libraries have been parsed in place.
+bool Profiler::updateSymbolsOnDlopen(bool sync) {
+    if (!Symbols::haveNewLibraries()) {
+        return false;
+    }
+    if (sync || MallocTracer::running()) {
+        updateSymbols(false);
+        return true;
+    }
+    // MallocTracer may start while parsing is pending
+    Symbols::parseLibrariesAsync(&_native_libs, MallocTracer::installHooks);
+    return false;
+}
+
+void Profiler::loadDeferredSymbols() {
+    Symbols::loadDeferredSymbols(&_native_libs);
+}
+
 void Profiler::mangle(const char* name, char* buf, size_t size) {
     char* buf_end = buf + size;
     strcpy(buf, "_ZN");
@@ -289,13 +434,7 @@ CodeCache* Profiler::findLibraryByName(const char* lib_name) {
 }
 
 CodeCache* Profiler::findLibraryByAddress(const void* address) {
-    const int native_lib_count = _native_libs.count();
-    for (int i = 0; i < native_lib_count; i++) {
-        if (_native_libs[i]->contains(address)) {
-            return _native_libs[i];
-        }
-    }
-    return NULL;
+    return _native_libs.findLibraryByAddress(address);
 }
 
 const char* Profiler::findNativeMethod(const void* address) {
@@ -303,8 +442,14 @@ const char* Profiler::findNativeMethod(const void* address) {
     return lib == NULL ? NULL : lib->binarySearch(address);
 }
 
-CodeBlob* Profiler::findRuntimeStub(const void* address) {
-    return _runtime_stubs.findBlobByAddress(address);
+// Names a BCI_NATIVE_PC frame, unless symbols of its library have not been loaded yet
+const char* Profiler::resolveNativePC(const void* pc) {
+    CodeCache* lib = findLibraryByAddress(pc);
+    return lib == NULL || lib->symbolsDeferred() ? NULL : lib->binarySearch(pc);
+}
+
+bool Profiler::findRuntimeStub(const void* address, CodeBlob& stub) {
+    return _runtime_stubs.contains(address) && _stub_table.find(address, stub);
 }
 
 bool Profiler::isAddressInCode(const void* pc) {
@@ -326,30 +471,41 @@ jmethodID Profiler::getCurrentCompileTask() {
     return NULL;
 }
 
-int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, StackContext* java_ctx) {
+int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, StackContext* java_ctx,
+                             UnwindCache* cache) {
     const void* callchain[MAX_NATIVE_FRAMES];
     int native_frames;
 
     // Use PerfEvents stack walker for execution samples, or basic stack walker for other events
     if (event_type == PERF_SAMPLE) {
-        native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
+        native_frames = PerfEvents::walk(tid, ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx, cache);
     } else if (_cstack >= CSTACK_VM) {
         return 0;
     } else if (_cstack == CSTACK_DWARF) {
-        native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
+        native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx, cache);
     } else {
         native_frames = StackWalker::walkFP(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
     }
 
-    return convertNativeTrace(native_frames, callchain, frames, event_type);
+    return convertNativeTrace(native_frames, callchain, frames, event_type, cache);
 }
 
-int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames, EventType event_type) {
+int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames, EventType event_type,
+                                 UnwindCache* cache) {
     int depth = 0;
     jmethodID prev_method = NULL;
 
     for (int i = 0; i < native_frames; i++) {
-        const char* current_method_name = findNativeMethod(callchain[i]);
+        CodeCache* lib = cache != NULL ? cache->findLibrary(callchain[i], &_native_libs) : findLibraryByAddress(callchain[i]);
+        if (lib != NULL && lib->symbolsDeferred()) {
+            // Symbols are still being loaded or left for the dump; keep the PC to resolve it then
+            frames[depth].bci = BCI_NATIVE_PC;
+            frames[depth].method_id = (jmethodID)callchain[i];
+            prev_method = NULL;
+            depth++;
+            continue;
+        }
+        const char* current_method_name = lib == NULL ? NULL : lib->binarySearch(callchain[i]);
         char mark;
         if (current_method_name != NULL && (mark = NativeFunc::mark(current_method_name)) != 0) {
             if (mark == MARK_VM_RUNTIME && event_type >= ALLOC_SAMPLE) {
@@ -375,7 +531,7 @@ int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGC
         }
 
         jmethodID current_method = (jmethodID)current_method_name;
-        if (current_method == prev_method && _cstack == CSTACK_LBR) {
+        if (current_method == prev_method && (_cstack == CSTACK_LBR || _cstack == CSTACK_LBRX)) {
             // Skip duplicates in LBR stack, where branch_stack[N].from == branch_stack[N+1].to
             prev_method = NULL;
         } else {
@@ -388,6 +544,23 @@ int Profiler::convertNativeTrace(int native_frames, const void** callchain, ASGC
     return depth;
 }
 
+int Profiler::getJavaTraceVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackDetail detail,
+                             int tid, int lock_index) {
+    if (_stitch_depth == 0) {
+        return StackWalker::walkVM(ucontext, frames, max_depth, detail, &_scope_caches[lock_index]);
+    }
+
+    StitchPoint stitch = {&_stack_stitcher, tid, _stitch_depth, -1};
+    int num_frames = StackWalker::walkVM(ucontext, frames, _stack_depth, detail, &_scope_caches[lock_index], &stitch);
+
+    // The walk did not find a matching stack, so its bottom part is the one to reuse next time
+    if (stitch.anchor_depth >= 0) {
+        _stack_stitcher.store(tid, stitch.pc, stitch.sp, stitch.fp,
+                              frames + stitch.anchor_depth, num_frames - stitch.anchor_depth);
+    }
+    return num_frames;
+}
+
 int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx) {
     // Workaround for JDK-8132510: it's not safe to call GetEnv() inside a signal handler
     // since JDK 9, so we do it only for threads already registered in ThreadLocalStorage
@@ -434,16 +607,10 @@ int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max
     }
 
     if ((trace.num_frames == ticks_unknown_Java || trace.num_frames == ticks_not_walkable_Java) && _features.unknown_java && ucontext != NULL) {
-        CodeBlob* stub = NULL;
-        _stubs_lock.lockShared();
-        if (_runtime_stubs.contains((const void*)frame.pc())) {
-            stub = findRuntimeStub((const void*)frame.pc());
-        }
-        _stubs_lock.unlockShared();
-
-        if (stub != NULL) {
+        CodeBlob stub;
+        if (findRuntimeStub((const void*)frame.pc(), stub)) {
             if (_cstack != CSTACK_NO) {
-                if (_features.vtable_target && isVTableStub(stub->_name)) {
+                if (_features.vtable_target && isVTableStub(stub._name)) {
                     uintptr_t receiver = frame.jarg0();
                     if (receiver != 0) {
                         VMSymbol* symbol = VMKlass::fromOop(receiver)->name();
@@ -451,9 +618,9 @@ int Profiler::getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max
                         max_depth -= makeFrame(trace.frames++, BCI_ALLOC, class_id);
                     }
                 }
-                max_depth -= makeFrame(trace.frames++, BCI_NATIVE_FRAME, stub->_name);
+                max_depth -= makeFrame(trace.frames++, BCI_NATIVE_FRAME, stub._name);
             }
-            if (_features.unwind_stub && frame.unwindStub((instruction_t*)stub->_start, stub->_name)
+            if (_features.unwind_stub && frame.unwindStub((instruction_t*)stub._start, stub._name)
                     && isAddressInCode((const void*)frame.pc())) {
                 java_ctx->pc = (const void*)frame.pc();
                 VM::_asyncGetCallTrace(&trace, max_depth, ucontext);
@@ -569,6 +736,30 @@ int Profiler::getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* f
     return num_frames;
 }
 
+// Lock and instrumentation events are recorded from JVM TI callbacks and JNI calls, where the thread
+// has left Java through a frame anchor. Walking from the anchor avoids a synchronous GetStackTrace,
+// which costs the most when a burst of threads contends for the same monitor.
+// There is no signal context: the walker sees zeroed registers and does not rely on them.
+int Profiler::getJavaTraceAnchor(VMThread* vm_thread, ASGCT_CallFrame* frames, int start_depth, int max_depth) {
+    ucontext_t uc;
+    memset(&uc, 0, sizeof(uc));
+#ifdef __APPLE__
+    _STRUCT_MCONTEXT mcontext;
+    memset(&mcontext, 0, sizeof(mcontext));
+    uc.uc_mcontext = &mcontext;
+#endif
+
+    int num_frames = StackWalker::walkVM(&uc, frames, max_depth + start_depth, vm_thread->anchor());
+    if (num_frames <= start_depth) {
+        return 0;
+    }
+    if (start_depth > 0) {
+        num_frames -= start_depth;
+        memmove(frames, frames + start_depth, num_frames * sizeof(ASGCT_CallFrame));
+    }
+    return num_frames;
+}
+
 void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod) {
     if (nmethod->isNMethod() && nmethod->isAlive()) {
         VMMethod* method = nmethod->method();
@@ -612,15 +803,47 @@ void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod*
     }
 }
 
+// Words at the top of the stack covered by the context digest. Together with the registers,
+// they tell apart different callers that reach the same frame with the same SP.
+const int CONTEXT_STACK_WORDS = 8;
+
+static u64 sampleContext(void* ucontext) {
+    StackFrame frame(ucontext);
+    uintptr_t sp = frame.sp();
+    u64 h = frame.pc() * 0x9e3779b97f4a7c15ULL ^ sp * 0xc2b2ae3d27d4eb4fULL ^ frame.fp();
+    for (int i = 0; i < CONTEXT_STACK_WORDS; i++) {
+        h = (h ^ (uintptr_t)SafeAccess::load((void**)sp + i)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
 u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Event* event) {
+    // Samples taken on the thread itself honor its sampling priority and carry its tracing context
+    ThreadLocalState* thread_state;
+    if (event_type <= INSTRUMENTED_METHOD && (thread_state = ThreadLocalData::current()) != NULL) {
+        if (event_type != INSTRUMENTED_METHOD && !ThreadLocalData::acceptSample(thread_state)) {
+            if (event_type == PERF_SAMPLE) {
+                PerfEvents::resetBuffer(fastThreadId());
+            }
+            return 0;
+        }
+        if (event != NULL) {
+            ThreadLocalData::getContext(thread_state, event_type == WALL_CLOCK_SAMPLE
+                ? ((WallClockEvent*)event)->_context : ((ExecutionEvent*)event)->_context);
+        }
+    }
+
     atomicInc(_total_samples);
 
+    // The handler runs on the sampled thread, so this is the CPU the thread was running on
+    int cpu = OS::currentCpu();
+    if (event != NULL && event_type <= INSTRUMENTED_METHOD && event_type != WALL_CLOCK_SAMPLE) {
+        ((ExecutionEvent*)event)->_cpu = cpu;
+    }
+
     int tid = fastThreadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    int lock_index = tryLockAny(tid, cpu);
+    if (lock_index < 0) {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
 
@@ -631,7 +854,26 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
         return 0;
     }
 
-    u64 stack_walk_begin = _features.stats ? OS::nanotime() : 0;
+    u64 stack_walk_begin = _features.stats ? TSC::nanos() : 0;
+    u64 budget_begin = _overhead_budget.enabled() ? (stack_walk_begin != 0 ? stack_walk_begin : TSC::nanos()) : 0;
+
+    // Timer and wall clock samples of a thread that has not moved since its last sample reuse the trace
+    u64 context = 0;
+    if (event_type == EXECUTION_SAMPLE || event_type == WALL_CLOCK_SAMPLE) {
+        context = sampleContext(ucontext);
+        u32 call_trace_id = _recent_contexts.get(tid, context);
+        if (call_trace_id != 0) {
+            _call_trace_storage.add(call_trace_id, 1, counter);
+            _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
+            _timeline.add(call_trace_id);
+            _history.add(call_trace_id, 1, counter);
+            if (budget_begin != 0) {
+                _overhead_budget.consume(TSC::nanos() - budget_begin);
+            }
+            _locks[lock_index].unlock();
+            return (u64)tid << 32 | call_trace_id;
+        }
+    }
 
     ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
     jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
@@ -644,48 +886,85 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
             jint frame_type = BCI_ALLOC - (event_type - ALLOC_SAMPLE);
             num_frames = makeFrame(frames, frame_type, class_id);
         }
+    } else if (_add_event_frame && event_type == PERF_SAMPLE && event != NULL) {
+        // The accessed class or memory region on top of the data source
+        ExecutionEvent* e = (ExecutionEvent*)event;
+        if (e->_data_class_id != 0) {
+            num_frames += makeFrame(frames + num_frames, BCI_DATA_OBJECT, e->_data_class_id);
+        } else if (e->_data_region != NULL) {
+            num_frames += makeFrame(frames + num_frames, BCI_ERROR, e->_data_region);
+        }
+        if (e->_data_source != NULL) {
+            num_frames += makeFrame(frames + num_frames, BCI_ERROR, e->_data_source);
+        }
     }
 
+    const char* pause = _pause_frames && event_type <= WALL_CLOCK_SAMPLE ? pauseFrame(event_type) : NULL;
+
     StackContext java_ctx = {0};
-    if (hasNativeStack(event_type)) {
+    if (pause != NULL) {
+        num_frames += makeFrame(frames + num_frames, BCI_ERROR, pause);
+    } else if (hasNativeStack(event_type)) {
         if (_features.pc_addr && event_type <= WALL_CLOCK_SAMPLE) {
             num_frames += makeFrame(frames + num_frames, BCI_ADDRESS, StackFrame(ucontext).pc());
         }
         if (_cstack != CSTACK_NO) {
-            num_frames += getNativeTrace(ucontext, frames + num_frames, event_type, tid, &java_ctx);
+            num_frames += getNativeTrace(ucontext, frames + num_frames, event_type, tid, &java_ctx,
+                                         &_unwind_caches[lock_index]);
         }
     }
 
-    if (_cstack == CSTACK_VMX) {
-        num_frames += StackWalker::walkVM(ucontext, frames + num_frames, _max_stack_depth, VM_EXPERT);
+    u64 native_walk_end = stack_walk_begin != 0 ? TSC::nanos() : 0;
+
+    // Stitched stacks are not truncated by the walk, so they always get the full depth
+    int java_depth = event_type <= WALL_CLOCK_SAMPLE && _stitch_depth == 0 ?
+                     _adaptive_depth.limit(tid, _stack_depth) : _stack_depth;
+
+    if (pause != NULL) {
+        // Neither Java nor native stack is walked during a pause
+    } else if (_cstack == CSTACK_VMX) {
+        int java_frames = getJavaTraceVM(ucontext, frames + num_frames, java_depth, VM_EXPERT, tid, lock_index);
+        _adaptive_depth.update(tid, java_depth, java_frames, _stack_depth);
+        num_frames += java_frames;
     } else if (event_type <= WALL_CLOCK_SAMPLE) {
         // Async events
+        int java_frames;
         if (_cstack == CSTACK_VM) {
-            num_frames += StackWalker::walkVM(ucontext, frames + num_frames, _max_stack_depth, VM_NORMAL);
+            java_frames = getJavaTraceVM(ucontext, frames + num_frames, java_depth, VM_NORMAL, tid, lock_index);
         } else {
-            int java_frames = getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx);
+            java_frames = getJavaTraceAsync(ucontext, frames + num_frames, java_depth, &java_ctx);
             if (java_frames > 0 && java_ctx.pc != NULL && VMStructs::hasMethodStructs()) {
                 NMethod* nmethod = CodeHeap::findNMethod(java_ctx.pc);
                 if (nmethod != NULL) {
                     fillFrameTypes(frames + num_frames, java_frames, nmethod);
                 }
             }
-            num_frames += java_frames;
         }
+        _adaptive_depth.update(tid, java_depth, java_frames, _stack_depth);
+        num_frames += java_frames;
     } else if (event_type >= ALLOC_SAMPLE && event_type <= ALLOC_OUTSIDE_TLAB && _alloc_engine == &alloc_tracer) {
         VMThread* vm_thread;
         if (VMStructs::hasStackStructs() && (vm_thread = VMThread::current()) != NULL) {
-            num_frames += StackWalker::walkVM(ucontext, frames + num_frames, _max_stack_depth, vm_thread->anchor());
+            num_frames += StackWalker::walkVM(ucontext, frames + num_frames, _stack_depth, vm_thread->anchor());
         } else {
-            num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx);
+            num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _stack_depth, &java_ctx);
         }
     } else if (event_type == MALLOC_SAMPLE) {
-        num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _max_stack_depth, &java_ctx);
+        num_frames += getJavaTraceAsync(ucontext, frames + num_frames, _stack_depth, &java_ctx);
     } else {
         // Lock events and instrumentation events can safely call synchronous JVM TI stack walker.
         // Skip Instrument.recordSample() method
         int start_depth = event_type == INSTRUMENTED_METHOD ? 1 : 0;
-        num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _max_stack_depth);
+        VMThread* vm_thread;
+        int java_frames = 0;
+        if ((event_type == INSTRUMENTED_METHOD || event_type == LOCK_SAMPLE || event_type == PARK_SAMPLE) &&
+            VMStructs::hasStackStructs() && (vm_thread = VMThread::current()) != NULL) {
+            java_frames = getJavaTraceAnchor(vm_thread, frames + num_frames, start_depth, _stack_depth);
+        }
+        if (java_frames == 0) {
+            java_frames = getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _stack_depth);
+        }
+        num_frames += java_frames;
     }
 
     if (num_frames == 0) {
@@ -693,63 +972,127 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
     }
 
     if (_add_thread_frame) {
-        num_frames += makeFrame(frames + num_frames, BCI_THREAD_ID, tid);
+        num_frames += makeThreadFrame(frames + num_frames, tid);
     }
     if (_add_sched_frame) {
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(0));
     }
 
+    u64 stack_walk_end = 0;
     if (stack_walk_begin != 0) {
-        u64 stack_walk_end = OS::nanotime();
+        stack_walk_end = TSC::nanos();
         atomicInc(_total_stack_walk_time, stack_walk_end - stack_walk_begin);
+        _overhead.record(PHASE_NATIVE_UNWIND, native_walk_end - stack_walk_begin);
+        _overhead.record(PHASE_JAVA_UNWIND, stack_walk_end - native_walk_end);
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
+    if (num_frames > _calltrace_depth[lock_index]) {
+        _calltrace_depth[lock_index] = num_frames;
+    }
+
+    if (_deferred && event_type <= EXECUTION_SAMPLE &&
+        _sample_rings[lock_index].push(tid, counter, event_type, (ExecutionEvent*)event, num_frames, frames)) {
+        // Hashing, storing the trace and encoding the event is left to the sample worker
+        if (budget_begin != 0) {
+            _overhead_budget.consume(TSC::nanos() - budget_begin);
+        }
+        _locks[lock_index].unlock();
+        return (u64)tid << 32;
+    }
+
+    u32 call_trace_id = recordTrace(lock_index, tid, counter, event_type, event, num_frames, frames, stack_walk_end);
+    if (_share_cpu_traces && event_type <= EXECUTION_SAMPLE && call_trace_id != 0) {
+        _recent_cpu_samples.put(tid, call_trace_id, TSC::nanos());
+    }
+    if (context != 0 && call_trace_id != 0) {
+        _recent_contexts.put(tid, call_trace_id, context);
+    }
 
+    if (budget_begin != 0) {
+        _overhead_budget.consume(TSC::nanos() - budget_begin);
+    }
     _locks[lock_index].unlock();
     return (u64)tid << 32 | call_trace_id;
 }
 
-void Profiler::recordExternalSample(u64 counter, int tid, EventType event_type, Event* event, int num_frames, ASGCT_CallFrame* frames) {
+// Stores the call trace and the JFR event; with stack walking stats, measures both phases
+// starting from begin_time, which is the current TSC::nanos() or 0
+u32 Profiler::recordTrace(int lock_index, int tid, u64 counter, EventType event_type, Event* event,
+                          int num_frames, ASGCT_CallFrame* frames, u64 begin_time) {
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter, lock_index);
+    u64 storage_end = begin_time != 0 ? TSC::nanos() : 0;
+
+    _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
+    _timeline.add(call_trace_id);
+    _history.add(call_trace_id, 1, counter);
+
+    if (begin_time != 0) {
+        _overhead.record(PHASE_STORAGE, storage_end - begin_time);
+        _overhead.record(PHASE_JFR, TSC::nanos() - storage_end);
+    }
+    return call_trace_id;
+}
+
+u32 Profiler::recordExternalSample(u64 counter, int tid, EventType event_type, Event* event, int num_frames, ASGCT_CallFrame* frames) {
     atomicInc(_total_samples);
 
     if (_add_thread_frame) {
-        num_frames += makeFrame(frames + num_frames, BCI_THREAD_ID, tid);
+        num_frames += makeThreadFrame(frames + num_frames, tid);
     }
     if (_add_sched_frame) {
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(tid));
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    // Storage is updated under the lock, since call trace eviction holds all locks
+    int lock_index = tryLockAny(tid);
+    if (lock_index < 0) {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
-        return;
+        return 0;
     }
 
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter, lock_index);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
+    _timeline.add(call_trace_id);
+    _history.add(call_trace_id, 1, counter);
 
     _locks[lock_index].unlock();
+    return call_trace_id;
 }
 
-void Profiler::recordExternalSamples(u64 samples, u64 counter, int tid, u32 call_trace_id, EventType event_type, Event* event) {
-    _call_trace_storage.add(call_trace_id, samples, counter);
+// Parked virtual threads have no OS thread, hence no JFR event: only the call trace is counted
+u32 Profiler::recordVirtualThreadSample(u64 counter, jlong vthread, int num_frames, ASGCT_CallFrame* frames) {
+    atomicInc(_total_samples);
 
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    if (_add_thread_frame) {
+        num_frames += makeVirtualThreadFrame(frames + num_frames, vthread);
+    }
+
+    int lock_index = tryLockAny(OS::threadId());
+    if (lock_index < 0) {
+        atomicInc(_failures[-ticks_skipped]);
+        return 0;
+    }
+
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter, lock_index);
+    _timeline.add(call_trace_id);
+    _history.add(call_trace_id, 1, counter);
+
+    _locks[lock_index].unlock();
+    return call_trace_id;
+}
+
+void Profiler::recordExternalSamples(u64 samples, u64 counter, int tid, u32 call_trace_id, EventType event_type, Event* event) {
+    int lock_index = tryLockAny(tid);
+    if (lock_index < 0) {
         return;
     }
 
+    _call_trace_storage.add(call_trace_id, samples, counter);
+
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
+    _timeline.add(call_trace_id);
+    _history.add(call_trace_id, samples, counter);
 
     _locks[lock_index].unlock();
 }
@@ -760,11 +1103,8 @@ void Profiler::recordEventOnly(EventType event_type, Event* event) {
     }
 
     int tid = fastThreadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    int lock_index = tryLockAny(tid);
+    if (lock_index < 0) {
         return;
     }
 
@@ -773,6 +1113,28 @@ void Profiler::recordEventOnly(EventType event_type, Event* event) {
     _locks[lock_index].unlock();
 }
 
+// One lock acquisition for the whole batch, or none at all when buffered
+void Profiler::recordUserEvents(const asprof_jfr_event* events, size_t count, bool buffered) {
+    if (!_jfr.active()) {
+        return;
+    }
+
+    int tid = fastThreadId();
+    if (buffered) {
+        _jfr.bufferUserEvents(tid, events, count);
+        return;
+    }
+
+    int lock_index = tryLockAny(tid);
+    if (lock_index < 0) {
+        return;
+    }
+
+    _jfr.recordUserEvents(lock_index, tid, events, count);
+
+    _locks[lock_index].unlock();
+}
+
 void Profiler::tryResetCounters() {
     // Reset counters only for non-JFR recording, otherwise resetting may cause missing stack traces for some
     // allocation events and skewed incorrect number of samples.
@@ -792,8 +1154,7 @@ void Profiler::writeLog(LogLevel level, const char* message, size_t len) {
 
 void* Profiler::dlopen_hook(const char* filename, int flags) {
     void* result = dlopen(filename, flags);
-    if (result != NULL) {
-        instance()->updateSymbols(false);
+    if (result != NULL && instance()->updateSymbolsOnDlopen(false)) {
         MallocTracer::installHooks();
     }
     return result;
@@ -916,9 +1277,12 @@ void Profiler::setupSignalHandlers() {
 }
 
 void Profiler::setThreadInfo(int tid, const char* name, jlong java_thread_id) {
-    MutexLocker ml(_thread_names_lock);
-    _thread_names[tid] = name;
-    _thread_ids[tid] = java_thread_id;
+    _thread_names.set(tid, name, java_thread_id);
+    if (_group_threads) {
+        char group[256];
+        ThreadNames::groupName(name, group, sizeof(group));
+        _thread_names.setGroup(tid, _thread_group_map.lookup(group));
+    }
 }
 
 void Profiler::updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
@@ -952,26 +1316,6 @@ void Profiler::updateJavaThreadNames() {
     }
 }
 
-void Profiler::updateNativeThreadNames() {
-    if (_update_thread_names) {
-        ThreadList* thread_list = OS::listThreads();
-        char name_buf[64];
-
-        while (thread_list->hasNext()) {
-            int tid = thread_list->next();
-            MutexLocker ml(_thread_names_lock);
-            std::map<int, std::string>::iterator it = _thread_names.lower_bound(tid);
-            if (it == _thread_names.end() || it->first != tid) {
-                if (OS::threadName(tid, name_buf, sizeof(name_buf))) {
-                    _thread_names.insert(it, std::map<int, std::string>::value_type(tid, name_buf));
-                }
-            }
-        }
-
-        delete thread_list;
-    }
-}
-
 bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
     bool checkInclude = fn->hasIncludeList();
     bool checkExclude = fn->hasExcludeList();
@@ -979,12 +1323,14 @@ bool Profiler::excludeTrace(FrameName* fn, CallTrace* trace) {
         return false;
     }
 
+    TraceFrames trace_frames;
+    ASGCT_CallFrame* frames = trace_frames.get(trace);
     for (int i = 0; i < trace->num_frames; i++) {
-        const char* frame_name = fn->name(trace->frames[i], true);
-        if (checkExclude && fn->exclude(frame_name)) {
+        int result = fn->filter(frames[i]);
+        if (checkExclude && (result & FILTER_EXCLUDED)) {
             return true;
         }
-        if (checkInclude && fn->include(frame_name)) {
+        if (checkInclude && (result & FILTER_INCLUDED)) {
             checkInclude = false;
             if (!checkExclude) break;
         }
@@ -1014,6 +1360,8 @@ Engine* Profiler::selectEngine(const char* event_name) {
         return &ctimer;
     } else if (strcmp(event_name, EVENT_ITIMER) == 0) {
         return &itimer;
+    } else if (strcmp(event_name, EVENT_OFFCPU) == 0) {
+        return &off_cpu;
     } else if (strchr(event_name, '.') != NULL && strchr(event_name, ':') == NULL) {
         return &instrument;
     } else {
@@ -1071,7 +1419,15 @@ Error Profiler::checkJvmCapabilities() {
     return Error::OK;
 }
 
-Error Profiler::start(Arguments& args, bool reset) {
+static u64 processCpuNanos() {
+    static const u64 nanos_per_tick = 1000000000ULL / sysconf(_SC_CLK_TCK);
+
+    u64 utime, stime;
+    OS::getProcessCpuTime(&utime, &stime);
+    return (utime + stime) * nanos_per_tick;
+}
+
+Error Profiler::start(Arguments& args, bool reset, bool restart) {
     MutexLocker ml(_state_lock);
     if (_state > IDLE) {
         return Error("Profiler already started");
@@ -1095,10 +1451,18 @@ Error Profiler::start(Arguments& args, bool reset) {
 
     if (_event_mask == 0) {
         return Error("No profiling events specified");
-    } else if ((_event_mask & (_event_mask - 1)) && args._output != OUTPUT_JFR) {
+    } else if ((_event_mask & (_event_mask - 1)) && (args._output != OUTPUT_JFR || args._extra_file_count > 0)) {
         return Error("Only JFR output supports multiple events");
     } else if (!VM::loaded() && (_event_mask & (EM_ALLOC | EM_LOCK))) {
         return Error("Profiling event is not supported with non-Java processes");
+    } else if (args._spike > 0 && (args._recent == 0 || args._file == NULL || args._output == OUTPUT_JFR)) {
+        return Error("spike option requires recent and file in a non-JFR format");
+    } else if (args._lazy_symbols && (VM::loaded() || !args._preloaded)) {
+        return Error("lazysyms is supported only for non-Java processes started with LD_PRELOAD");
+    } else if (args._alloc_histo && (args._alloc < 0 || args._live)) {
+        return Error("allochisto requires alloc and cannot be combined with live");
+    } else if (args._alloc_histo && !_class_histogram.init()) {
+        return Error("Not enough memory to allocate class histogram");
     }
 
     if (args._fdtransfer) {
@@ -1110,44 +1474,93 @@ Error Profiler::start(Arguments& args, bool reset) {
     // Save the arguments for shutdown or restart
     args.save();
 
+    // Inlined frames at arbitrary PCs matter for execution samples only.
+    // A loop iteration keeps the flag of the previous one, see stop()
+    VM::setDebugNonSafepoints(args._nonsafepoints == NONSAFEPOINTS_ALWAYS ||
+                              (args._nonsafepoints == NONSAFEPOINTS_EXEC && (_event_mask & (EM_CPU | EM_WALL))));
+
+    // Measuring the counter rate takes 10 ms, which is noticeable at the start of a short-lived process
+    if (!args._lazy_symbols) {
+        TSC::calibrate();
+    }
+
     if (reset || _start_time == 0) {
         // Reset counters
         _total_samples = 0;
         _total_stack_walk_time = 0;
+        _overhead.reset();
         memset(_failures, 0, sizeof(_failures));
 
-        // Reset dictionaries and bitmaps
+        // Reset dictionaries and bitmaps. Unwind and scope caches depend only on the code,
+        // and class and thread names stay valid, so the next loop iteration keeps them warm.
         lockAll();
-        _class_map.clear();
+        if (!restart) {
+            for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+                _unwind_caches[i].reset();
+                _scope_caches[i].reset();
+            }
+            _class_map.clear();
+        }
         _thread_filter.clear();
         _call_trace_storage.clear();
+        _class_histogram.reset();
+        _cache_lines.reset();
         // Make sure frame structure is consistent throughout the entire recording
         _add_event_frame = args._output != OUTPUT_JFR;
+        _pause_frames = args._pause_frames;
         _add_thread_frame = args._threads && args._output != OUTPUT_JFR;
+        _group_threads = _add_thread_frame && args._thread_groups;
+        _thread_group_map.clear();
         _add_sched_frame = args._sched;
         unlockAll();
 
         // Reset thread names and IDs
-        MutexLocker ml(_thread_names_lock);
-        _thread_names.clear();
-        _thread_ids.clear();
+        if (!restart) {
+            _thread_names.clear();
+        }
+    }
+
+    // Live object references keep call_trace_id for an arbitrary long time, so they cannot survive eviction
+    if (args._trace_mem > 0 && args._live) {
+        Log::warn("tracemem is ignored when profiling live objects");
     }
+    _call_trace_storage.setMemoryLimit(args._live ? 0 : args._trace_mem);
+    _call_trace_storage.setHugePages(args._huge_pages);
 
-    // (Re-)allocate calltrace buffers
+    // (Re-)allocate calltrace buffers. Anonymous mappings are committed page by page,
+    // so a large jstackdepth costs resident memory only when stacks are actually that deep.
     if (_max_stack_depth != args._jstackdepth) {
-        _max_stack_depth = args._jstackdepth;
-        size_t nelem = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
+        size_t nelem = args._jstackdepth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
+        size_t size = (nelem * sizeof(CallTraceBuffer) + OS::page_mask) & ~OS::page_mask;
+
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            if (_calltrace_buffer[i] != NULL) {
+                OS::safeFree(_calltrace_buffer[i], _calltrace_buffer_size);
+                _calltrace_buffer[i] = NULL;
+            }
+            _calltrace_depth[i] = 0;
+        }
+        _max_stack_depth = 0;
+        _calltrace_buffer_size = size;
 
         for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            free(_calltrace_buffer[i]);
-            _calltrace_buffer[i] = (CallTraceBuffer*)calloc(nelem, sizeof(CallTraceBuffer));
-            if (_calltrace_buffer[i] == NULL) {
-                _max_stack_depth = 0;
+            if ((_calltrace_buffer[i] = (CallTraceBuffer*)OS::safeAlloc(size)) == NULL) {
                 return Error("Not enough memory to allocate stack trace buffers (try smaller jstackdepth)");
             }
         }
+        _max_stack_depth = args._jstackdepth;
+    }
+    _stack_depth = _max_stack_depth;
+
+    if (!_adaptive_depth.init(args._adaptive_depth)) {
+        return Error("Not enough memory to allocate adaptive stack depth table");
     }
 
+    _memory_limit = args._mem_limit;
+    _memory_shed_level = 0;
+    _memory_shed_used = 0;
+    _call_trace_storage.setFrozen(false);
+
     _features = args._features;
     if (VM::hotspot_version() < 8) {
         _features.java_anchor = 0;
@@ -1160,6 +1573,18 @@ Error Profiler::start(Arguments& args, bool reset) {
         _features.comp_task = 0;
     }
 
+    _deferred = false;
+    if (args._deferred) {
+        _deferred = true;
+        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+            if (!_sample_rings[i].allocate()) {
+                return Error("Not enough memory to allocate deferred sample buffers");
+            }
+        }
+    }
+
+    _overhead_budget.reset(args._overhead / 100, processCpuNanos());
+
     _update_thread_names = args._threads || args._output == OUTPUT_JFR;
     _thread_filter.init(args._filter);
 
@@ -1168,22 +1593,43 @@ Error Profiler::start(Arguments& args, bool reset) {
         return Error("Cannot start wall clock with the selected event");
     } else if (_engine != &perf_events && args._target_cpu != -1) {
         return Error("target-cpu is only supported with perf_events");
+    } else if (_engine != &perf_events && args._data_addr) {
+        return Error("dataaddr is only supported with perf_events");
+    } else if (args._data_addr && !_cache_lines.init()) {
+        return Error("Not enough memory to allocate cache line table");
     }
 
     _cstack = args._cstack;
     if (_cstack == CSTACK_DWARF && !DWARF_SUPPORTED) {
         return Error("DWARF unwinding is not supported on this platform");
-    } else if (_cstack == CSTACK_LBR && _engine != &perf_events) {
+    } else if ((_cstack == CSTACK_LBR || _cstack == CSTACK_LBRX) && _engine != &perf_events) {
         return Error("Branch stack is supported only with PMU events");
     } else if (_cstack >= CSTACK_VM && !VMStructs::hasStackStructs()) {
         return Error("VMStructs stack walking is not supported on this JVM/platform");
     }
 
+    _stitch_depth = 0;
+    if (args._stitch > 0) {
+        if (_cstack < CSTACK_VM) {
+            Log::warn("stitch is ignored without cstack=vm or cstack=vmx");
+        } else if (!_stack_stitcher.init(_max_stack_depth)) {
+            return Error("Not enough memory to allocate stack stitching buffers (try smaller jstackdepth)");
+        } else {
+            _stitch_depth = args._stitch;
+        }
+    }
+
     if (VM::isOpenJ9() && _cstack == CSTACK_DEFAULT && DWARF_SUPPORTED) {
         // OpenJ9 libs are compiled with frame pointers omitted
         _cstack = CSTACK_DWARF;
     }
 
+    // Symbols of a short-lived native process are loaded only if the profile is dumped
+    Symbols::deferSymbols(args._lazy_symbols);
+    if (!args._lazy_symbols) {
+        loadDeferredSymbols();
+    }
+
     // Kernel symbols are useful only for perf_events without --all-user
     updateSymbols(_engine == &perf_events && !args._alluser);
 
@@ -1193,6 +1639,21 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
     switchLibraryTrap(true);
 
+    // Heatmap keeps the time of every sample, which the call trace storage aggregates away
+    lockAll();
+    _timeline.start(args._output == OUTPUT_HEATMAP, reset);
+    // Recent samples outlive the session to be dumped after stop, until the next start without them
+    bool history_ok = true;
+    if (args._recent == 0) {
+        _history.disable();
+    } else if (reset || !_history.enabled()) {
+        history_ok = _history.enable();
+    }
+    unlockAll();
+    if (!history_ok) {
+        Log::warn("Could not allocate memory for recent samples");
+    }
+
     if (args._output == OUTPUT_JFR) {
         error = _jfr.start(args, reset);
         if (error) {
@@ -1202,6 +1663,24 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    // The wall clock sampler reuses recent traces of the CPU engine instead of signaling running threads
+    _recent_cpu_samples.reset();
+    _recent_contexts.reset();
+    _share_cpu_traces = (_event_mask & EM_CPU) && (_event_mask & EM_WALL) && !args._nobatch;
+
+    if (args._perf_map && !PerfMap::enabled()) {
+        error = PerfMap::start();
+        if (error) {
+            goto error1;
+        }
+        publishRuntimeStubs();
+    }
+
+    if (_deferred && !startSampleWorker()) {
+        error = Error("Failed to start sample worker thread");
+        goto error1;
+    }
+
     error = _engine->start(args);
     if (error) {
         goto error1;
@@ -1232,23 +1711,47 @@ Error Profiler::start(Arguments& args, bool reset) {
             goto error5;
         }
     }
+    if (args._vthreads >= 0) {
+        error = virtual_threads.start(args);
+        if (error) {
+            goto error6;
+        }
+    }
 
+    // Names of threads started from now on come with ThreadStart events
     switchThreadEvents(JVMTI_ENABLE);
+    updateJavaThreadNames();
 
     _state = RUNNING;
-    _start_time = time(NULL);
+    // The same clock as timerLoop, which checks _stop_time: time() may lag behind by a scheduler tick,
+    // and a loop iteration started right after the boundary would stop immediately
+    _start_time = (time_t)(OS::micros() / 1000000);
     _epoch++;
 
-    if (args._timeout != 0 || args._output == OUTPUT_JFR) {
+    if (args._spike > 0) {
+        _spike_cpu_nanos = processCpuNanos();
+        _spike_check_micros = OS::micros();
+        _spike_dump_micros = 0;
+    }
+
+    if (args._timeout != 0 || args._output == OUTPUT_JFR || _overhead_budget.enabled() || args._spike > 0 ||
+        _memory_limit > 0) {
         _stop_time = addTimeout(_start_time, args._timeout);
         startTimer();
     }
 
+    if (args._loop) {
+        preopenNextFile(args);
+    }
+
     return Error::OK;
 
-error5:
+error6:
     if (_event_mask & EM_NATIVEMEM) malloc_tracer.stop();
 
+error5:
+    if (_event_mask & EM_WALL) wall_clock.stop();
+
 error4:
     if (_event_mask & EM_LOCK) lock_tracer.stop();
 
@@ -1259,6 +1762,8 @@ error2:
     _engine->stop();
 
 error1:
+    stopSampleWorker();
+    PerfMap::stop();
     uninstallTraps();
     switchLibraryTrap(false);
 
@@ -1282,13 +1787,22 @@ Error Profiler::stop(bool restart) {
     if (_event_mask & EM_LOCK) lock_tracer.stop();
     if (_event_mask & EM_ALLOC) _alloc_engine->stop();
     if (_event_mask & EM_NATIVEMEM) malloc_tracer.stop();
+    if (_global_args._vthreads >= 0) virtual_threads.stop();
 
     _engine->stop();
+    stopSampleWorker();
+    if (!restart) {
+        // The map stays current between loop iterations
+        PerfMap::stop();
+    }
 
     switchLibraryTrap(false);
     switchThreadEvents(JVMTI_DISABLE);
-    updateJavaThreadNames();
-    updateNativeThreadNames();
+
+    if (_global_args._nonsafepoints == NONSAFEPOINTS_EXEC && !restart) {
+        // Compile without extra debug info until the next session
+        VM::setDebugNonSafepoints(false);
+    }
 
     // Make sure no periodic events sent after JFR stops
     stopTimer();
@@ -1298,10 +1812,15 @@ Error Profiler::stop(bool restart) {
 
     // Acquire all spinlocks to avoid race with remaining signals
     lockAll();
+    if (_deferred) {
+        recordDeferredSamples(0);
+    }
     _jfr.stop();
     unlockAll();
 
     if (!restart) {
+        // The output is complete only when all files are closed
+        FileRotator::sync();
         FdTransferClient::closePeer();
     }
 
@@ -1339,7 +1858,7 @@ Error Profiler::check(Arguments& args) {
 
         if (args._cstack == CSTACK_DWARF && !DWARF_SUPPORTED) {
             return Error("DWARF unwinding is not supported on this platform");
-        } else if (args._cstack == CSTACK_LBR && _engine != &perf_events) {
+        } else if ((args._cstack == CSTACK_LBR || args._cstack == CSTACK_LBRX) && _engine != &perf_events) {
             return Error("Branch stack is supported only with PMU events");
         } else if (args._cstack >= CSTACK_VM && !VMStructs::hasStackStructs()) {
             return Error("VMStructs stack walking is not supported on this JVM/platform");
@@ -1355,13 +1874,21 @@ Error Profiler::flushJfr() {
         return Error("Profiler is not active");
     }
 
-    updateJavaThreadNames();
-    updateNativeThreadNames();
-
     lockAll();
-    _jfr.flush();
+    if (_call_trace_storage.needsEviction()) {
+        // Traces not sampled during the current chunk will not appear in its constant pool anyway
+        size_t evicted = _call_trace_storage.evictColdTraces();
+        Log::debug("Evicted %zu cold call traces", evicted);
+        // Remembered traces may refer to recycled ids
+        _recent_cpu_samples.reset();
+        _recent_contexts.reset();
+    }
+    _jfr.detachChunk();
     unlockAll();
 
+    // Sampling goes on into the next chunk while the previous one is written out
+    _jfr.flush();
+
     return Error::OK;
 }
 
@@ -1372,48 +1899,186 @@ Error Profiler::dump(Writer& out, Arguments& args) {
     }
 
     if (_state == RUNNING) {
-        updateJavaThreadNames();
-        updateNativeThreadNames();
+        if (_event_mask & EM_ALLOC) {
+            ObjectSampler::sweepLiveRefs();
+        }
     }
 
-    switch (args._output) {
-        case OUTPUT_COLLAPSED:
-            dumpCollapsed(out, args);
-            break;
-        case OUTPUT_FLAMEGRAPH:
-            dumpFlameGraph(out, args, false);
-            break;
-        case OUTPUT_TREE:
-            dumpFlameGraph(out, args, true);
-            break;
-        case OUTPUT_TEXT:
-            dumpText(out, args);
-            break;
-        case OUTPUT_JFR:
-            if (_state == RUNNING) {
-                lockAll();
-                _jfr.flush();
-                unlockAll();
-            }
-            break;
-        default:
-            return Error("No output format selected");
+    if (args._recent > 0 && !_history.enabled() && args._output != OUTPUT_JFR && args._output != OUTPUT_HEATMAP) {
+        return Error("Recent samples are not recorded. Start profiling with recent option");
     }
 
-    return Error::OK;
-}
-
-void Profiler::printUsedMemory(Writer& out) {
-    size_t call_trace_storage = _call_trace_storage.usedMemory();
-    size_t flight_recording = _jfr.usedMemory();
-    size_t dictionaries = _class_map.usedMemory() + _symbol_map.usedMemory() + _thread_filter.usedMemory();
+    loadDeferredSymbols();
 
-    size_t code_cache = _runtime_stubs.usedMemory();
-    int native_lib_count = _native_libs.count();
+    Compression compression = args._file == NULL ? COMPRESS_NONE : Arguments::detectCompression(args._file);
+    if (args._extra_file_count == 0) {
+        Error error = dumpOutput(out, args, args._output, compression);
+        if (error) {
+            return error;
+        }
+    } else {
+        // Names resolved for one output stay in the shared cache for the others while this FrameName lives
+        FrameName names(args, args._style, _epoch, _thread_names);
+
+        Error error = dumpOutput(out, args, args._output, compression);
+        if (error) {
+            return error;
+        }
+
+        for (int i = 0; i < args._extra_file_count; i++) {
+            FileWriter extra(args.file(args._extra_files[i]));
+            if (!extra.is_open()) {
+                return Error("Could not open output file");
+            }
+            error = dumpOutput(extra, args, args._extra_outputs[i], Arguments::detectCompression(args._extra_files[i]));
+            if (error) {
+                return error;
+            }
+        }
+    }
+
+    if (args._delta && (args._output == OUTPUT_COLLAPSED || args._output == OUTPUT_PPROF || args._extra_file_count > 0)) {
+        // The next delta dump starts where this one ended
+        _call_trace_storage.snapshot();
+    }
+
+    return Error::OK;
+}
+
+Error Profiler::dumpOutput(Writer& out, Arguments& args, Output output, Compression compression) {
+    // JFR chunks are compressed by the recorder itself
+    if (compression == COMPRESS_GZIP && output != OUTPUT_JFR) {
+        if (!GzipWriter::available()) {
+            return Error(".gz output requires zlib");
+        }
+        GzipWriter gz(out);
+        return dumpOutput(gz, args, output, COMPRESS_NONE);
+    } else if (compression == COMPRESS_ZSTD && output != OUTPUT_JFR) {
+        if (!ZstdWriter::available()) {
+            return Error(".zst output requires libzstd 1.4.0+");
+        }
+        ZstdWriter zst(out);
+        return dumpOutput(zst, args, output, COMPRESS_NONE);
+    }
+
+    switch (output) {
+        case OUTPUT_COLLAPSED:
+            dumpCollapsed(out, args);
+            break;
+        case OUTPUT_FLAMEGRAPH:
+            dumpFlameGraph(out, args, false);
+            break;
+        case OUTPUT_TREE:
+            dumpFlameGraph(out, args, true);
+            break;
+        case OUTPUT_TEXT:
+            dumpText(out, args);
+            break;
+        case OUTPUT_PPROF:
+            dumpPprof(out, args);
+            break;
+        case OUTPUT_HEATMAP:
+            dumpHeatmap(out, args);
+            break;
+        case OUTPUT_JFR:
+            if (_state == RUNNING) {
+                lockAll();
+                _jfr.detachChunk();
+                unlockAll();
+                _jfr.flush();
+                // The dumped file should be complete even if chunks are compressed in background
+                _jfr.waitCompression();
+                if (args._file == NULL && _jfr.inMemory()) {
+                    // Hand out the finished chunks straight from the mapped recording
+                    Error error = _jfr.dump(out);
+                    if (error) {
+                        return error;
+                    }
+                }
+            }
+            break;
+        default:
+            return Error("No output format selected");
+    }
+    return Error::OK;
+}
+
+// Returns the total and fills usage by category
+size_t Profiler::usedMemory(MemoryUsage& usage) {
+    usage.call_trace_storage = _call_trace_storage.usedMemory();
+    usage.flight_recording = _jfr.usedMemory();
+    usage.dictionaries = _class_map.usedMemory() + _symbol_map.usedMemory() + _thread_group_map.usedMemory() +
+                         _thread_filter.usedMemory();
+
+    size_t code_cache = _runtime_stubs.usedMemory() + _stub_table.usedMemory();
+    size_t dwarf = 0;
+    int native_lib_count = _native_libs.count();
     for (int i = 0; i < native_lib_count; i++) {
         code_cache += _native_libs[i]->usedMemory();
+        dwarf += _native_libs[i]->dwarfMemory();
+    }
+    usage.code_cache = code_cache + native_lib_count * sizeof(CodeCache) - dwarf;
+    usage.dwarf = dwarf;
+
+    // Pages of stack buffers are touched from the beginning up to the deepest recorded stack
+    size_t stack_buffers = 0;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        if (_calltrace_buffer[i] != NULL && _calltrace_depth[i] > 0) {
+            size_t touched = (_calltrace_depth[i] * sizeof(CallTraceBuffer) + OS::page_mask) & ~OS::page_mask;
+            stack_buffers += touched < _calltrace_buffer_size ? touched : _calltrace_buffer_size;
+        }
+    }
+    usage.stack_buffers = stack_buffers;
+
+    return usage.call_trace_storage + usage.flight_recording + usage.dictionaries +
+           usage.code_cache + usage.dwarf + usage.stack_buffers;
+}
+
+// Reads counters without the state lock, so that JMX scrapers do not wait for a dump in progress
+u64 Profiler::metric(int metric) {
+    switch (metric) {
+        case METRIC_SAMPLES:
+            return _total_samples;
+        case METRIC_SKIPPED_TICKS:
+            return _failures[-ticks_skipped];
+        case METRIC_FAILED_SAMPLES: {
+            u64 failed = 0;
+            for (int i = 1; i < ASGCT_FAILURE_TYPES; i++) {
+                if (i != -ticks_skipped) {
+                    failed += _failures[i];
+                }
+            }
+            return failed;
+        }
+        case METRIC_CALL_TRACE_STORAGE:
+            return _call_trace_storage.usedMemory();
+        case METRIC_USED_MEMORY: {
+            MemoryUsage usage;
+            return usedMemory(usage);
+        }
+        case METRIC_NATIVE_UNWIND_NANOS:
+            return _overhead.total(PHASE_NATIVE_UNWIND);
+        case METRIC_JAVA_UNWIND_NANOS:
+            return _overhead.total(PHASE_JAVA_UNWIND);
+        case METRIC_STORAGE_NANOS:
+            return _overhead.total(PHASE_STORAGE);
+        case METRIC_JFR_NANOS:
+            return _overhead.total(PHASE_JFR);
+        default:
+            return 0;
+    }
+}
+
+void Profiler::printUsedMemory(Writer& out) {
+    MemoryUsage usage;
+    size_t total = usedMemory(usage);
+
+    int max_depth = 0;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        if (_calltrace_depth[i] > max_depth) {
+            max_depth = _calltrace_depth[i];
+        }
     }
-    code_cache += native_lib_count * sizeof(CodeCache);
 
     char buf[1024];
     const size_t KB = 1024;
@@ -1422,11 +2087,68 @@ void Profiler::printUsedMemory(Writer& out) {
              "  Flight recording: %7zu KB\n"
              "      Dictionaries: %7zu KB\n"
              "        Code cache: %7zu KB\n"
+             "      DWARF tables: %7zu KB\n"
+             "     Stack buffers: %7zu KB\n"
              "------------------------------\n"
              "             Total: %7zu KB\n",
-             call_trace_storage / KB, flight_recording / KB, dictionaries / KB, code_cache / KB,
-             (call_trace_storage + flight_recording + dictionaries + code_cache) / KB);
+             usage.call_trace_storage / KB, usage.flight_recording / KB, usage.dictionaries / KB,
+             usage.code_cache / KB, usage.dwarf / KB, usage.stack_buffers / KB, total / KB);
+    out << buf;
+
+    snprintf(buf, sizeof(buf) - 1, "\nStack buffers: %d x %zu KB reserved, deepest stack %d of %d frames\n",
+             CONCURRENCY_LEVEL, _calltrace_buffer_size / KB, max_depth, _max_stack_depth);
+    out << buf;
+
+    if (_memory_limit > 0) {
+        snprintf(buf, sizeof(buf) - 1, "\nMemory limit: %zu KB, load shedding level %d of %d\n",
+                 _memory_limit / KB, _memory_shed_level, MEMORY_SHED_LEVELS);
+        out << buf;
+    }
+
+    int backing = _call_trace_storage.pageBacking();
+    snprintf(buf, sizeof(buf) - 1, "\nCall trace memory pages:%s%s%s\n",
+             backing & PAGES_HUGETLB ? " hugetlbfs" : "",
+             backing & PAGES_TRANSPARENT ? " transparent-huge" : "",
+             backing & PAGES_REGULAR ? " regular" : "");
     out << buf;
+
+    int numa_nodes = OS::getNumaNodeCount();
+    if (numa_nodes > 1) {
+        out << "\nCall trace frames by NUMA node:";
+        for (int node = 0; node < numa_nodes && node < MAX_NUMA_NODES; node++) {
+            snprintf(buf, sizeof(buf) - 1, " %d:%zu KB", node, _call_trace_storage.frameMemory(node) / KB);
+            out << buf;
+        }
+        out << "\n";
+    }
+
+    CallTraceStorageStats ts;
+    _call_trace_storage.stats(ts);
+    snprintf(buf, sizeof(buf) - 1,
+             "\nCall trace table: %llu of %llu slots used, max shard load %.0f%%, %llu overflow samples\n"
+             "   Shared prefixes: %llu, kernel stacks: %llu\n"
+             "     Probe lengths: avg %.2f, max %u, histogram 1:%llu 2:%llu 3-4:%llu 5-8:%llu"
+             " 9-16:%llu 17-32:%llu 33-64:%llu 65+:%llu\n",
+             ts.size, ts.capacity, ts.max_load * 100, ts.overflow, ts.shared_prefixes, ts.kernel_stacks,
+             ts.size == 0 ? 0.0 : (double)ts.total_probes / ts.size, ts.max_probe,
+             ts.probes[0], ts.probes[1], ts.probes[2], ts.probes[3],
+             ts.probes[4], ts.probes[5], ts.probes[6], ts.probes[7]);
+    out << buf;
+
+    DictionaryStats cs, ss;
+    _class_map.stats(cs);
+    _symbol_map.stats(ss);
+    snprintf(buf, sizeof(buf) - 1,
+             "      Dictionaries: classes %zu keys in %u tables (%u overflow rows, depth %u),"
+             " symbols %zu keys in %u tables (%u overflow rows, depth %u)\n",
+             cs.keys, cs.tables, cs.overflow_rows, cs.max_depth,
+             ss.keys, ss.tables, ss.overflow_rows, ss.max_depth);
+    out << buf;
+
+    if (_features.stats) {
+        out << "\n";
+        printOverhead(out);
+    }
 }
 
 void Profiler::logStats() {
@@ -1437,6 +2159,45 @@ void Profiler::logStats() {
     Log::info("Collected %llu stacks, avg time = %llu ns", stacks, avg_time);
 }
 
+void Profiler::printOverhead(Writer& out) {
+    char buf[256];
+    out << "Sample overhead, ns:   count     avg     p50     p99\n";
+    for (int i = 0; i < OVERHEAD_PHASES; i++) {
+        OverheadPhase phase = (OverheadPhase)i;
+        snprintf(buf, sizeof(buf) - 1, "  %-16s %10llu %7llu %7llu %7llu\n", OverheadStats::name(phase),
+                 _overhead.count(phase), _overhead.average(phase),
+                 _overhead.percentile(phase, 50), _overhead.percentile(phase, 99));
+        out << buf;
+    }
+
+    u64 hits = 0, misses = 0;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        hits += _unwind_caches[i].hits();
+        misses += _unwind_caches[i].misses();
+    }
+    snprintf(buf, sizeof(buf) - 1, "Unwind cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+             hits, misses, hits + misses == 0 ? 0.0 : 100.0 * hits / (hits + misses));
+    out << buf;
+
+    hits = 0;
+    misses = 0;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        hits += _scope_caches[i].hits();
+        misses += _scope_caches[i].misses();
+    }
+    snprintf(buf, sizeof(buf) - 1, "Scope cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+             hits, misses, hits + misses == 0 ? 0.0 : 100.0 * hits / (hits + misses));
+    out << buf;
+
+    if (_stitch_depth > 0) {
+        hits = _stack_stitcher.hits();
+        misses = _stack_stitcher.misses();
+        snprintf(buf, sizeof(buf) - 1, "Stack stitching: %llu hits, %llu misses (%.1f%% hit rate)\n",
+                 hits, misses, hits + misses == 0 ? 0.0 : 100.0 * hits / (hits + misses));
+        out << buf;
+    }
+}
+
 void Profiler::lockAll() {
     for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
 }
@@ -1459,23 +2220,47 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
  *
  * <frame>;<frame>;...;<topmost frame> <count>
  */
+// Counter accumulated since the baseline. A smaller value means the storage
+// has been cleared after the snapshot, so the whole value is new.
+static u64 sinceBaseline(u64 value, Counter counter, const CallTraceSample& baseline) {
+    u64 base = counter == COUNTER_SAMPLES ? baseline.samples : baseline.counter;
+    return value >= base ? value - base : value;
+}
+
 void Profiler::dumpCollapsed(Writer& out, Arguments& args) {
-    FrameName fn(args, args._style | STYLE_NO_SEMICOLON, _epoch, _thread_names_lock, _thread_names);
+    FrameName fn(args, args._style | STYLE_NO_SEMICOLON, _epoch, _thread_names);
     char buf[32];
     u64 printed_sample_count = 0;
+    TraceFrames trace_frames;
 
-    std::vector<CallTraceSample*> samples;
-    _call_trace_storage.collectSamples(samples);
+    // The same trace may be stored in several shards; merge them to print a single line.
+    // Merging is incremental, so periodic dumps visit only the traces sampled since the previous one.
+    // With recent option, the history replaces the aggregated samples and there is no baseline
+    std::vector<CallTraceSample> recent;
+    if (args._recent > 0) {
+        collectRecentSamples(args, recent);
+    }
+    bool delta = args._delta && args._recent == 0;
 
-    for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-        CallTrace* trace = (*it)->acquireTrace();
-        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+    const std::vector<CallTraceSample>& samples = args._recent > 0 ? recent : _call_trace_storage.mergeSamples();
+    std::vector<CallTraceSample> baselines;
+    if (delta) {
+        _call_trace_storage.collectBaselines(baselines);
+    }
 
-        u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
+    for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        u64 counter = args._counter == COUNTER_SAMPLES ? it->samples : it->counter;
+        if (delta) {
+            counter = sinceBaseline(counter, args._counter, baselines[it - samples.begin()]);
+        }
         if (counter == 0) continue;
 
+        CallTrace* trace = it->trace;
+        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+
+        ASGCT_CallFrame* frames = trace_frames.get(trace);
         for (int j = trace->num_frames - 1; j >= 0; j--) {
-            const char* frame_name = fn.name(trace->frames[j]);
+            const char* frame_name = fn.name(frames[j]);
             out << frame_name << (j == 0 ? ' ' : ';');
         }
         // Beware of locale-sensitive conversion
@@ -1485,6 +2270,146 @@ void Profiler::dumpCollapsed(Writer& out, Arguments& args) {
     logEmptyOutput(args, printed_sample_count, out);
 }
 
+// Reports the same traces as dumpCollapsed, but as name IDs instead of text.
+// Like in pprof output, names are interned per dump.
+Error Profiler::dumpBinary(Arguments& args, asprof_dump_handler* handler) {
+    MutexLocker ml(_state_lock);
+    if (_state != IDLE && _state != RUNNING) {
+        return Error("Profiler has not started");
+    }
+
+    if (_state == RUNNING && (_event_mask & EM_ALLOC)) {
+        ObjectSampler::sweepLiveRefs();
+    }
+
+    loadDeferredSymbols();
+
+    FrameName fn(args, args._style | STYLE_NO_SEMICOLON, _epoch, _thread_names);
+    std::map<std::string, u32> names;
+    TraceFrames trace_frames;
+    const std::vector<CallTraceSample>& samples = _call_trace_storage.mergeSamples();
+
+    for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        if (it->samples == 0 && it->counter == 0) continue;
+
+        CallTrace* trace = it->trace;
+        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+
+        ASGCT_CallFrame* frames = trace_frames.get(trace);
+        u32 num_frames = trace->num_frames < handler->max_frames ? trace->num_frames : handler->max_frames;
+        for (u32 j = 0; j < num_frames; j++) {
+            const char* frame_name = fn.name(frames[j]);
+            std::pair<std::map<std::string, u32>::iterator, bool> entry =
+                names.insert(std::make_pair(std::string(frame_name), (u32)names.size() + 1));
+            if (entry.second && handler->name != NULL) {
+                handler->name(handler->arg, entry.first->second, entry.first->first.data(), entry.first->first.size());
+            }
+            handler->frames[j] = entry.first->second;
+        }
+        handler->trace(handler->arg, handler->frames, num_frames, it->samples, it->counter);
+    }
+    return Error::OK;
+}
+
+void Profiler::addFlameGraphTrace(FlameGraph& flamegraph, FrameName& fn, Arguments& args,
+                                  ASGCT_CallFrame* frames, int num_frames, u64 counter, u64 baseline) {
+    Trie* f = flamegraph.root();
+    if (args._reverse) {
+        // Thread frames always come first
+        if (_add_sched_frame) {
+            const char* frame_name = fn.name(frames[--num_frames]);
+            f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter, baseline);
+        }
+        if (_add_thread_frame) {
+            const char* frame_name = fn.name(frames[--num_frames]);
+            f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter, baseline);
+        }
+
+        for (int j = 0; j < num_frames; j++) {
+            const char* frame_name = fn.name(frames[j]);
+            FrameTypeId frame_type = fn.type(frames[j]);
+            f = flamegraph.addChild(f, frame_name, frame_type, counter, baseline);
+        }
+    } else {
+        for (int j = num_frames - 1; j >= 0; j--) {
+            const char* frame_name = fn.name(frames[j]);
+            FrameTypeId frame_type = fn.type(frames[j]);
+            f = flamegraph.addChild(f, frame_name, frame_type, counter, baseline);
+        }
+    }
+    f->_total += counter;
+    f->_self += counter;
+    f->_baseline += baseline;
+}
+
+u64 Profiler::buildFlameGraph(FlameGraph& flamegraph, FrameName& fn, Arguments& args,
+                              const std::vector<CallTraceSample*>& samples, size_t start, size_t end) {
+    u64 printed_sample_count = 0;
+    TraceFrames trace_frames;
+
+    for (size_t i = start; i < end; i++) {
+        CallTraceSample* sample = samples[i];
+        CallTrace* trace = sample->acquireTrace();
+        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+
+        u64 counter = args._counter == COUNTER_SAMPLES ? sample->samples : sample->counter;
+        if (counter == 0) continue;
+
+        addFlameGraphTrace(flamegraph, fn, args, trace_frames.get(trace), trace->num_frames, counter, 0);
+        printed_sample_count++;
+    }
+
+    return printed_sample_count;
+}
+
+// Baselines are kept for merged samples, so a differential flame graph is built from them
+u64 Profiler::buildDiffFlameGraph(FlameGraph& flamegraph, FrameName& fn, Arguments& args) {
+    if (!_call_trace_storage.hasSnapshot()) {
+        Log::warn("No snapshot to compare with, all frames are shown as new");
+    }
+
+    const std::vector<CallTraceSample>& samples = _call_trace_storage.mergeSamples();
+    std::vector<CallTraceSample> baselines;
+    _call_trace_storage.collectBaselines(baselines);
+
+    u64 printed_sample_count = 0;
+    TraceFrames trace_frames;
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        CallTrace* trace = samples[i].trace;
+        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+
+        u64 counter = args._counter == COUNTER_SAMPLES ? samples[i].samples : samples[i].counter;
+        u64 baseline = args._counter == COUNTER_SAMPLES ? baselines[i].samples : baselines[i].counter;
+        // Traces that are gone since the snapshot still count in the baseline of their parents
+        if (counter == 0 && baseline == 0) continue;
+
+        addFlameGraphTrace(flamegraph, fn, args, trace_frames.get(trace), trace->num_frames, counter, baseline);
+        if (counter != 0) printed_sample_count++;
+    }
+
+    return printed_sample_count;
+}
+
+void Profiler::flameGraphWorker(FlameGraphTask* task) {
+    // Java method names are resolved through JNI, which requires an attached thread
+    bool attached = VM::loaded();
+    if (attached && VM::attachThread("Async-profiler Dump Worker") == NULL) {
+        return;
+    }
+
+    {
+        Arguments& args = *task->args;
+        FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names);
+        task->printed_sample_count = buildFlameGraph(*task->flamegraph, fn, args, *task->samples, task->start, task->end);
+        task->done = true;
+    }
+
+    if (attached) {
+        VM::detachThread();
+    }
+}
+
 void Profiler::dumpFlameGraph(Writer& out, Arguments& args, bool tree) {
     char title[64];
     if (args._title == NULL) {
@@ -1496,77 +2421,272 @@ void Profiler::dumpFlameGraph(Writer& out, Arguments& args, bool tree) {
         }
     }
 
-    FlameGraph flamegraph(args._title == NULL ? title : args._title, args._counter, args._minwidth, args._reverse, args._inverted);
+    const char* flamegraph_title = args._title == NULL ? title : args._title;
+    FlameGraph flamegraph(flamegraph_title, args._counter, args._minwidth, args._reverse, args._inverted, args._diff && !tree);
     u64 printed_sample_count = 0;
 
-    {
-        FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
+    if (args._diff && !tree) {
+        FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names);
+        printed_sample_count = buildDiffFlameGraph(flamegraph, fn, args);
+    } else {
+        FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names);
 
+        std::vector<CallTraceSample> recent;
         std::vector<CallTraceSample*> samples;
-        _call_trace_storage.collectSamples(samples);
+        if (args._recent > 0) {
+            collectRecentSamples(args, recent);
+            for (size_t i = 0; i < recent.size(); i++) {
+                samples.push_back(&recent[i]);
+            }
+        } else {
+            _call_trace_storage.collectSamples(samples);
+        }
+
+        // Large profiles are split into ranges of traces, each built into a separate tree
+        // by a worker thread. Partial trees are merged into the final one at the end.
+        size_t thread_count = samples.size() / PARALLEL_DUMP_THRESHOLD;
+        if (thread_count > (size_t)OS::getCpuCount()) thread_count = OS::getCpuCount();
+        if (thread_count > MAX_DUMP_THREADS) thread_count = MAX_DUMP_THREADS;
+        if (thread_count < 1) thread_count = 1;
+
+        size_t range = (samples.size() + thread_count - 1) / thread_count;
+        FlameGraphTask tasks[MAX_DUMP_THREADS];
+        pthread_t threads[MAX_DUMP_THREADS];
+        bool started[MAX_DUMP_THREADS];
+
+        for (size_t i = 1; i < thread_count; i++) {
+            tasks[i].args = &args;
+            tasks[i].samples = &samples;
+            tasks[i].start = i * range;
+            tasks[i].end = i * range + range < samples.size() ? i * range + range : samples.size();
+            tasks[i].flamegraph = new FlameGraph(flamegraph_title, args._counter, args._minwidth, args._reverse, args._inverted);
+            tasks[i].printed_sample_count = 0;
+            tasks[i].done = false;
+            started[i] = pthread_create(&threads[i], NULL, flameGraphWorkerEntry, &tasks[i]) == 0;
+        }
+
+        size_t end = range < samples.size() ? range : samples.size();
+        printed_sample_count = buildFlameGraph(flamegraph, fn, args, samples, 0, end);
+
+        for (size_t i = 1; i < thread_count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            }
+            if (tasks[i].done) {
+                flamegraph.merge(*tasks[i].flamegraph);
+                printed_sample_count += tasks[i].printed_sample_count;
+            } else {
+                // The worker could not start or attach: build its range here
+                printed_sample_count += buildFlameGraph(flamegraph, fn, args, samples, tasks[i].start, tasks[i].end);
+            }
+            delete tasks[i].flamegraph;
+        }
+    }
+
+    flamegraph.dump(out, tree);
+    logEmptyOutput(args, printed_sample_count, out);
+}
+
+// Produces the same profile.proto as JfrToPprof in the converter:
+// one location per function, locations and functions share ids
+void Profiler::dumpPprof(Writer& out, Arguments& args) {
+    FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names);
+    GzipWriter gz(out);
+    ProtoBuffer record(4096);
+    u64 printed_sample_count = 0;
 
-        for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-            CallTrace* trace = (*it)->acquireTrace();
-            if (trace == NULL || excludeTrace(&fn, trace)) continue;
+    const char* sample_type = _event_mask & EM_NATIVEMEM ? "malloc" :
+                              _event_mask & EM_ALLOC ? "allocations" :
+                              _event_mask & EM_LOCK ? "locks" :
+                              _event_mask & EM_WALL ? "wall" : "cpu";
+    const char* units = args._counter == COUNTER_SAMPLES ? "count" : activeEngine()->units();
+    if (strcmp(units, "ns") == 0) {
+        units = "nanoseconds";
+    }
 
-            u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
-            if (counter == 0) continue;
+    // Fixed entries of the string table; function names follow
+    const char* const strings[] = {"", sample_type, units, "async-profiler", "Produced by async-profiler"};
+    const u64 STR_MAPPING = 3, STR_COMMENT = 4, STR_FUNCTIONS = 5;
 
-            int num_frames = trace->num_frames;
+    size_t mark = record.startField(1);
+    record.field(1, (u64)1).field(2, (u64)2);
+    record.commitField(mark);
 
-            Trie* f = flamegraph.root();
-            if (args._reverse) {
-                // Thread frames always come first
-                if (_add_sched_frame) {
-                    const char* frame_name = fn.name(trace->frames[--num_frames]);
-                    f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter);
-                }
-                if (_add_thread_frame) {
-                    const char* frame_name = fn.name(trace->frames[--num_frames]);
-                    f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter);
-                }
+    std::map<std::string, u32> functions;
+    TraceFrames trace_frames;
+    // With recent option, the history replaces the aggregated samples and there is no baseline
+    std::vector<CallTraceSample> recent;
+    if (args._recent > 0) {
+        collectRecentSamples(args, recent);
+    }
+    bool delta = args._delta && args._recent == 0;
 
-                for (int j = 0; j < num_frames; j++) {
-                    const char* frame_name = fn.name(trace->frames[j]);
-                    FrameTypeId frame_type = fn.type(trace->frames[j]);
-                    f = flamegraph.addChild(f, frame_name, frame_type, counter);
-                }
-            } else {
-                for (int j = num_frames - 1; j >= 0; j--) {
-                    const char* frame_name = fn.name(trace->frames[j]);
-                    FrameTypeId frame_type = fn.type(trace->frames[j]);
-                    f = flamegraph.addChild(f, frame_name, frame_type, counter);
+    const std::vector<CallTraceSample>& samples = args._recent > 0 ? recent : _call_trace_storage.mergeSamples();
+    std::vector<CallTraceSample> baselines;
+    if (delta) {
+        _call_trace_storage.collectBaselines(baselines);
+    }
+
+    for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+        u64 counter = args._counter == COUNTER_SAMPLES ? it->samples : it->counter;
+        if (delta) {
+            counter = sinceBaseline(counter, args._counter, baselines[it - samples.begin()]);
+        }
+        if (counter == 0) continue;
+
+        CallTrace* trace = it->trace;
+        if (trace == NULL || excludeTrace(&fn, trace)) continue;
+
+        ASGCT_CallFrame* frames = trace_frames.get(trace);
+        size_t sample_mark = record.startField(2);
+        size_t locations_mark = record.startField(1);
+        // pprof lists locations from the leaf to the root
+        for (int j = 0; j < trace->num_frames; j++) {
+            u32& id = functions[fn.name(frames[j])];
+            if (id == 0) id = functions.size();
+            record.writeVarint(id);
+        }
+        record.commitField(locations_mark);
+        record.field(2, counter);
+        record.commitField(sample_mark);
+
+        gz.write(record.data(), record.size());
+        record.reset();
+        printed_sample_count++;
+    }
+
+    mark = record.startField(3);
+    record.field(1, (u64)1).field(2, (u64)0).field(3, (u64)0x7fffffffffffffffULL).field(5, STR_MAPPING);
+    record.commitField(mark);
+
+    std::vector<const std::string*> names(functions.size() + 1);
+    for (std::map<std::string, u32>::const_iterator it = functions.begin(); it != functions.end(); ++it) {
+        names[it->second] = &it->first;
+    }
+
+    for (u64 id = 1; id < names.size(); id++) {
+        mark = record.startField(4);
+        record.field(1, id);
+        size_t line_mark = record.startField(4);
+        record.field(1, id);
+        record.commitField(line_mark);
+        record.commitField(mark);
+
+        mark = record.startField(5);
+        record.field(1, id).field(2, STR_FUNCTIONS + id - 1);
+        record.commitField(mark);
+
+        if (record.size() >= 4096) {
+            gz.write(record.data(), record.size());
+            record.reset();
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        record.field(6, strings[i]);
+    }
+    for (size_t id = 1; id < names.size(); id++) {
+        record.field(6, names[id]->data(), names[id]->size());
+        if (record.size() >= 4096) {
+            gz.write(record.data(), record.size());
+            record.reset();
+        }
+    }
+
+    record.field(9, (u64)_start_time * 1000000000ULL);
+    if (_state == RUNNING) {
+        record.field(10, (u64)uptime() * 1000000000ULL);
+    }
+    record.field(13, STR_COMMENT);
+    gz.write(record.data(), record.size());
+
+    logEmptyOutput(args, printed_sample_count, gz);
+}
+
+// Aggregates the samples of the last args._recent seconds kept in the history.
+// Traces evicted from the storage since they were sampled are skipped.
+void Profiler::collectRecentSamples(Arguments& args, std::vector<CallTraceSample>& samples) {
+    std::map<u32, CallTrace*> traces;
+    _call_trace_storage.collectTraces(traces);
+
+    std::map<u32, HistoryTotal> totals;
+    _history.collect(args._recent * 1000ULL, totals);
+
+    for (std::map<u32, HistoryTotal>::const_iterator it = totals.begin(); it != totals.end(); ++it) {
+        std::map<u32, CallTrace*>::const_iterator trace = traces.find(it->first);
+        if (trace != traces.end()) {
+            CallTraceSample sample = {trace->second, it->second.samples, it->second.counter};
+            samples.push_back(sample);
+        }
+    }
+}
+
+// Every distinct call trace of the timeline becomes a node of the heatmap prefix tree
+void Profiler::dumpHeatmap(Writer& out, Arguments& args) {
+    FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names);
+    std::map<u32, CallTrace*> traces;
+    _call_trace_storage.collectTraces(traces);
+
+    std::vector<u64> samples;
+    _timeline.collect(samples);
+    if (_timeline.dropped() > 0) {
+        Log::warn("Heatmap misses %llu samples due to lack of memory", (unsigned long long)_timeline.dropped());
+    }
+
+    Heatmap heatmap;
+    std::map<u32, u32> nodes;  // call_trace_id -> node, 0 if filtered out
+    TraceFrames trace_frames;
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        u32 call_trace_id = (u32)samples[i];
+        u32 node = 0;
+        std::map<u32, u32>::const_iterator it = nodes.find(call_trace_id);
+        if (it != nodes.end()) {
+            node = it->second;
+        } else {
+            std::map<u32, CallTrace*>::const_iterator trace_it = traces.find(call_trace_id);
+            CallTrace* trace = trace_it != traces.end() ? trace_it->second : NULL;
+            if (trace != NULL && !excludeTrace(&fn, trace)) {
+                ASGCT_CallFrame* frames = trace_frames.get(trace);
+                for (int j = trace->num_frames - 1; j >= 0; j--) {
+                    FrameTypeId type = fn.type(frames[j]);
+                    node = heatmap.child(node, heatmap.method(fn.name(frames[j]), type));
                 }
             }
-            f->_total += counter;
-            f->_self += counter;
-            printed_sample_count++;
+            nodes[call_trace_id] = node;
+        }
+
+        if (node != 0) {
+            heatmap.addSample((u32)(samples[i] >> 32), node);
         }
     }
 
-    flamegraph.dump(out, tree);
-    logEmptyOutput(args, printed_sample_count, out);
+    heatmap.dump(out, args._title, _timeline.startMillis());
+    logEmptyOutput(args, heatmap.sampleCount(), out);
 }
 
 void Profiler::dumpText(Writer& out, Arguments& args) {
-    FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names);
+    FrameName fn(args, args._style | STYLE_DOTTED, _epoch, _thread_names);
     char buf[1024] = {0};
 
     std::vector<CallTraceSample> samples;
     u64 total_counter = 0;
     {
-        std::map<u64, CallTraceSample> map;
-        _call_trace_storage.collectSamples(map);
-        samples.reserve(map.size());
+        std::vector<CallTraceSample> recent;
+        if (args._recent > 0) {
+            collectRecentSamples(args, recent);
+        }
+        const std::vector<CallTraceSample>& merged = args._recent > 0 ? recent : _call_trace_storage.mergeSamples();
+        samples.reserve(merged.size());
 
-        for (std::map<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
-            CallTrace* trace = it->second.trace;
-            u64 counter = it->second.counter;
+        for (std::vector<CallTraceSample>::const_iterator it = merged.begin(); it != merged.end(); ++it) {
+            CallTrace* trace = it->trace;
+            u64 counter = it->counter;
             if (trace == NULL || counter == 0) continue;
 
             total_counter += counter;
             if (trace->num_frames == 0 || excludeTrace(&fn, trace)) continue;
-            samples.push_back(it->second);
+            samples.push_back(*it);
         }
     }
 
@@ -1587,15 +2707,23 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
     }
     out << "\n";
 
+    if (activeEngine() == &instrument) {
+        instrument.dumpMethods(out);
+    }
+
+    dumpClassHistogram(out, fn, args._dump_flat);
+    dumpCacheLines(out, fn, args._dump_flat);
+
     double cpercent = 100.0 / total_counter;
     const char* units_str = activeEngine()->units();
 
     // Print top call stacks
     if (args._dump_traces > 0) {
-        std::sort(samples.begin(), samples.end(), [](const CallTraceSample& a, const CallTraceSample& b) {
-            return a.counter > b.counter;
-        });
+        // Only the top N traces are printed, so there is no need to order the rest
+        size_t top = (size_t)args._dump_traces < samples.size() ? (size_t)args._dump_traces : samples.size();
+        std::partial_sort(samples.begin(), samples.begin() + top, samples.end(), sortSamplesByCounter);
 
+        TraceFrames trace_frames;
         int max_count = args._dump_traces;
         for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end() && --max_count >= 0; ++it) {
             snprintf(buf, sizeof(buf) - 1, "--- %lld %s (%.2f%%), %lld sample%s\n",
@@ -1604,8 +2732,9 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
             out << buf;
 
             CallTrace* trace = it->trace;
+            ASGCT_CallFrame* frames = trace_frames.get(trace);
             for (int j = 0; j < trace->num_frames; j++) {
-                const char* frame_name = fn.name(trace->frames[j]);
+                const char* frame_name = fn.name(frames[j]);
                 snprintf(buf, sizeof(buf) - 1, "  [%2d] %s\n", j, frame_name);
                 out << buf;
             }
@@ -1615,14 +2744,24 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
 
     // Print top methods
     if (args._dump_flat > 0) {
-        std::map<std::string, MethodSample> histogram;
+        FrameHistogram frames;
         for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-            const char* frame_name = fn.name(it->trace->frames[0]);
-            histogram[frame_name].add(it->samples, it->counter);
+            const ASGCT_CallFrame& leaf = it->trace->top();
+            frames[std::make_pair(leaf.method_id, leaf.bci)].add(it->samples, it->counter);
+        }
+
+        // Different frames may share a name, e.g. interpreted and compiled versions of a method
+        std::map<std::string, MethodSample> histogram;
+        for (FrameHistogram::const_iterator it = frames.begin(); it != frames.end(); ++it) {
+            ASGCT_CallFrame frame;
+            frame.bci = it->first.second;
+            frame.method_id = it->first.first;
+            histogram[fn.name(frame)].add(it->second.samples, it->second.counter);
         }
 
         std::vector<NamedMethodSample> methods(histogram.begin(), histogram.end());
-        std::sort(methods.begin(), methods.end(), sortByCounter);
+        size_t top = (size_t)args._dump_flat < methods.size() ? (size_t)args._dump_flat : methods.size();
+        std::partial_sort(methods.begin(), methods.begin() + top, methods.end(), sortByCounter);
 
         snprintf(buf, sizeof(buf) - 1, "%12s  percent  samples  top\n"
                                        "  ----------  -------  -------  ---\n", units_str);
@@ -1637,6 +2776,87 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
     }
 }
 
+// Top classes by allocated bytes, recorded in allochisto mode
+void Profiler::dumpClassHistogram(Writer& out, FrameName& fn, int max_count) {
+    std::vector<ClassHistogramEntry> classes;
+    _class_histogram.collect(classes);
+    if (classes.empty()) {
+        return;
+    }
+
+    u64 total_bytes = 0;
+    for (size_t i = 0; i < classes.size(); i++) {
+        total_bytes += classes[i].bytes;
+    }
+
+    size_t top = max_count > 0 && (size_t)max_count < classes.size() ? (size_t)max_count : classes.size();
+    std::partial_sort(classes.begin(), classes.begin() + top, classes.end(), sortClassesByBytes);
+
+    char buf[1024];
+    out << "--- Allocated classes ---\n"
+           "       bytes  percent  samples  class\n"
+           "  ----------  -------  -------  -----\n";
+
+    double percent = 100.0 / total_bytes;
+    for (size_t i = 0; i < top; i++) {
+        ASGCT_CallFrame frame;
+        frame.bci = BCI_ALLOC;
+        frame.method_id = (jmethodID)(uintptr_t)classes[i].class_id;
+        snprintf(buf, sizeof(buf) - 1, "%12llu  %6.2f%%  %7llu  %s\n",
+                 (unsigned long long)classes[i].bytes, classes[i].bytes * percent,
+                 (unsigned long long)classes[i].samples, fn.name(frame));
+        out << buf;
+    }
+
+    if (_class_histogram.dropped() > 0) {
+        snprintf(buf, sizeof(buf) - 1, "%llu samples of classes beyond the table capacity are not shown\n",
+                 (unsigned long long)_class_histogram.dropped());
+        out << buf;
+    }
+    out << "\n";
+}
+
+static bool sortCacheLines(const CacheLineEntry& a, const CacheLineEntry& b) {
+    return a.hitm > b.hitm || (a.hitm == b.hitm && a.samples > b.samples);
+}
+
+// Cache lines with the most HITM samples, recorded in dataaddr mode. Many accessed words
+// on a line that bounces between cores suggest false sharing rather than a shared variable.
+void Profiler::dumpCacheLines(Writer& out, FrameName& fn, int max_count) {
+    std::vector<CacheLineEntry> lines;
+    _cache_lines.collect(lines);
+
+    size_t contended = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (lines[i].hitm > 0) {
+            lines[contended++] = lines[i];
+        }
+    }
+    if (contended == 0) {
+        return;
+    }
+    lines.resize(contended);
+
+    size_t top = max_count > 0 && (size_t)max_count < lines.size() ? (size_t)max_count : lines.size();
+    std::partial_sort(lines.begin(), lines.begin() + top, lines.end(), sortCacheLines);
+
+    char buf[1024];
+    out << "--- Contended cache lines ---\n"
+           "             address      hitm   samples  words  class\n"
+           "  ------------------  --------  --------  -----  -----\n";
+
+    for (size_t i = 0; i < top; i++) {
+        ASGCT_CallFrame frame;
+        frame.bci = BCI_DATA_OBJECT;
+        frame.method_id = (jmethodID)(uintptr_t)lines[i].class_id;
+        snprintf(buf, sizeof(buf) - 1, "  0x%016llx  %8llu  %8llu  %5d  %s\n",
+                 (unsigned long long)lines[i].line << CACHE_LINE_BITS, (unsigned long long)lines[i].hitm,
+                 (unsigned long long)lines[i].samples, __builtin_popcount(lines[i].words), fn.name(frame));
+        out << buf;
+    }
+    out << "\n";
+}
+
 time_t Profiler::addTimeout(time_t start, int timeout) {
     if (timeout == 0) {
         return (time_t)0x7fffffff;
@@ -1713,7 +2933,9 @@ void Profiler::stopTimer() {
 void Profiler::timerLoop(void* timer_id) {
     u64 current_micros = OS::micros();
     u64 stop_micros = _stop_time * 1000000ULL;
-    u64 sleep_until = _jfr.active() ? current_micros + 1000000 : stop_micros;
+    bool spike = _global_args._spike > 0;
+    bool periodic = _jfr.active() || _overhead_budget.enabled() || spike || _memory_limit > 0;
+    u64 sleep_until = periodic ? current_micros + 1000000 : stop_micros;
 
     while (true) {
         {
@@ -1730,8 +2952,20 @@ void Profiler::timerLoop(void* timer_id) {
             return;
         }
 
+        if (_overhead_budget.enabled()) {
+            adjustSamplingScale();
+        }
+
+        if (spike) {
+            checkCpuSpike(current_micros);
+        }
+
+        if (_memory_limit > 0) {
+            checkMemoryLimit();
+        }
+
         bool need_switch_chunk = _jfr.timerTick(current_micros, _gc_id);
-        if (need_switch_chunk) {
+        if (need_switch_chunk || (_jfr.active() && _call_trace_storage.needsEviction())) {
             // Flush under profiler state lock
             flushJfr();
         }
@@ -1740,6 +2974,154 @@ void Profiler::timerLoop(void* timer_id) {
     }
 }
 
+// Dumps recent samples when process CPU usage over the last tick exceeds the spike threshold.
+// Once dumped, the same samples are not dumped again: the next dump waits for the recent window to pass.
+void Profiler::checkCpuSpike(u64 current_micros) {
+    u64 cpu_nanos = processCpuNanos();
+    u64 elapsed_micros = current_micros - _spike_check_micros;
+    // Percent of one CPU: nanos * 100 / (micros * 1000)
+    double load = elapsed_micros > 0 ? (cpu_nanos - _spike_cpu_nanos) / (elapsed_micros * 10.0) : 0;
+    _spike_cpu_nanos = cpu_nanos;
+    _spike_check_micros = current_micros;
+
+    if (load < _global_args._spike || current_micros < _spike_dump_micros + _global_args._recent * 1000000ULL) {
+        return;
+    }
+    _spike_dump_micros = current_micros;
+
+    MutexLocker ml(_state_lock);
+    if (_state != RUNNING) {
+        return;
+    }
+
+    Log::info("Process CPU %.0f%% exceeds spike threshold, dumping recent samples", load);
+    FileWriter out(_global_args.file());
+    if (!out.is_open()) {
+        Log::warn("Could not open output file");
+        return;
+    }
+    Error error = dump(out, _global_args);
+    if (error) {
+        Log::warn("%s", error.message());
+    }
+    _global_args._file_num++;
+}
+
+// Opens the output file of the next loop iteration in background, unless its name
+// depends on the time when the iteration ends
+void Profiler::preopenNextFile(Arguments& args) {
+    if (args._file == NULL || args._output == OUTPUT_NONE || args._jfr_sync != NULL ||
+        strstr(args._file, "%t") != NULL || Arguments::isStreamingAddress(args._file)) {
+        return;
+    }
+
+    if (args._output != OUTPUT_JFR) {
+        // Other formats are written when the iteration ends
+        FileRotator::preopen(args.file());
+        return;
+    }
+
+    // JFR writes to the file of the current iteration already
+    std::string current(args.file());
+    args._file_num++;
+    const char* next = args.file();
+    if (current != next) {
+        FileRotator::preopen(next);
+    }
+    args._file_num--;
+}
+
+void Profiler::adjustSamplingScale() {
+    if (_overhead_budget.adjust(processCpuNanos())) {
+        u32 scale = _overhead_budget.scale();
+        if (_engine == &wall_clock || (_event_mask & EM_WALL)) {
+            WallClock::setIntervalScale(scale);
+        }
+        Log::debug("Sampling scale changed to %u to meet overhead budget", scale);
+    }
+}
+
+// Sheds load one step at a time while the profiler uses more memory than allowed and keeps growing:
+// shallower stacks first, then sparser samples, and finally no new call traces at all.
+// Memory already taken is not released until the profiler is restarted.
+void Profiler::checkMemoryLimit() {
+    MemoryUsage usage;
+    size_t used = usedMemory(usage);
+    if (used <= _memory_limit || used <= _memory_shed_used || _memory_shed_level >= MEMORY_SHED_LEVELS) {
+        return;
+    }
+    _memory_shed_used = used;
+
+    switch (++_memory_shed_level) {
+        case 1:
+            _stack_depth = _stack_depth / 4 > MEMORY_SHED_MIN_DEPTH ? _stack_depth / 4 : MEMORY_SHED_MIN_DEPTH;
+            Log::warn("Profiler memory %zu KB exceeds memlimit, reducing stack depth to %d", used / 1024, _stack_depth);
+            break;
+        case 2:
+            _overhead_budget.setMinScale(MEMORY_SHED_SCALE);
+            if (_engine == &wall_clock || (_event_mask & EM_WALL)) {
+                WallClock::setIntervalScale(_overhead_budget.scale());
+            }
+            Log::warn("Profiler memory %zu KB exceeds memlimit, taking every %u-th sample", used / 1024, MEMORY_SHED_SCALE);
+            break;
+        default:
+            _call_trace_storage.setFrozen(true);
+            Log::warn("Profiler memory %zu KB exceeds memlimit, new call traces are recorded as overflow", used / 1024);
+            break;
+    }
+}
+
+bool Profiler::startSampleWorker() {
+    _sample_worker_active = true;
+    if (pthread_create(&_sample_worker, NULL, sampleWorkerEntry, NULL) != 0) {
+        _sample_worker_active = false;
+        return false;
+    }
+    return true;
+}
+
+void Profiler::stopSampleWorker() {
+    if (_sample_worker_active) {
+        _sample_worker_active = false;
+        pthread_join(_sample_worker, NULL);
+    }
+}
+
+void Profiler::sampleWorkerLoop() {
+    int tid = OS::threadId();
+    while (_sample_worker_active) {
+        bool recorded = false;
+        int lock_index = tryLockAny(tid);
+        if (lock_index >= 0) {
+            recorded = recordDeferredSamples(lock_index);
+            _locks[lock_index].unlock();
+        }
+        if (!recorded) {
+            OS::sleep(DEFERRED_SAMPLE_POLL_INTERVAL);
+        }
+    }
+}
+
+// Stores samples captured by signal handlers in deferred mode. The caller must hold _locks[lock_index],
+// which protects the JFR buffer; sample rings themselves are consumed without locking.
+bool Profiler::recordDeferredSamples(int lock_index) {
+    bool recorded = false;
+    for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        SampleRing* ring = &_sample_rings[i];
+        RawSample* sample;
+        for (int count = 0; count < DEFERRED_SAMPLE_BATCH && (sample = ring->peek()) != NULL; count++) {
+            ExecutionEvent event(sample->start_time);
+            event._thread_state = sample->thread_state;
+            event._cpu = sample->cpu;
+            recordTrace(lock_index, sample->tid, sample->counter, sample->event_type, &event,
+                        sample->num_frames, sample->frames(), _features.stats ? TSC::nanos() : 0);
+            ring->pop(sample);
+            recorded = true;
+        }
+    }
+    return recorded;
+}
+
 void Profiler::logEmptyOutput(Arguments& args, u64 printed_samples_count, Writer& out) {
     if (!out.good()) {
         Log::warn("Output file may be incomplete");
@@ -1803,6 +3185,9 @@ Error Profiler::runInternal(Arguments& args, Writer& out) {
             MutexLocker ml(_state_lock);
             if (_state == RUNNING) {
                 out << "Profiling is running for " << uptime() << " seconds\n";
+                if (_features.stats) {
+                    printOverhead(out);
+                }
             } else {
                 out << "Profiler is not active\n";
             }
@@ -1824,6 +3209,9 @@ Error Profiler::runInternal(Arguments& args, Writer& out) {
             if (CTimer::supported()) {
                 out << "  " << EVENT_CTIMER << "\n";
             }
+            if (OffCpu::supported()) {
+                out << "  " << EVENT_OFFCPU << "\n";
+            }
 
             out << "Java method calls:\n";
             out << "  ClassName.methodName\n";
@@ -1841,6 +3229,14 @@ Error Profiler::runInternal(Arguments& args, Writer& out) {
         case ACTION_VERSION:
             out << PROFILER_VERSION;
             break;
+        case ACTION_SNAPSHOT: {
+            MutexLocker ml(_state_lock);
+            size_t traces = _call_trace_storage.snapshot();
+            if (!args._quiet) {
+                out << "Snapshot of " << (long)traces << " call traces taken\n";
+            }
+            break;
+        }
         default:
             break;
     }
@@ -1871,11 +3267,21 @@ Error Profiler::restart(Arguments& args) {
     }
 
     if (args._file != NULL && args._output != OUTPUT_NONE && args._output != OUTPUT_JFR) {
-        FileWriter out(args.file());
+        FileWriter out(FileRotator::open(args.file()));
         if (!out.is_open()) {
             return Error("Could not open output file");
         }
         error = dump(out, args);
+        if (args._loop) {
+            FileRotator::release(out.detach());
+        }
+        if (error) {
+            return error;
+        }
+    } else if (args._output == OUTPUT_JFR && args._extra_file_count > 0) {
+        // The recording is complete after stop, other formats come from the call trace storage
+        LogWriter out;
+        error = dump(out, args);
         if (error) {
             return error;
         }
@@ -1884,7 +3290,7 @@ Error Profiler::restart(Arguments& args) {
     if (args._loop) {
         args._fdtransfer = false;  // keep the previous connection
         args._file_num++;
-        return start(args, true);
+        return start(args, true, true);
     }
 
     return Error::OK;
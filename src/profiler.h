@@ -7,28 +7,47 @@
 #define _PROFILER_H
 
 #include <map>
+#include <pthread.h>
 #include <string>
 #include <time.h>
+#include "adaptiveDepth.h"
 #include "arch.h"
 #include "arguments.h"
+#include "cacheLineTable.h"
 #include "callTraceStorage.h"
+#include "classHistogram.h"
 #include "codeCache.h"
 #include "dictionary.h"
 #include "engine.h"
 #include "event.h"
 #include "flightRecorder.h"
+#include "heatmap.h"
 #include "log.h"
 #include "mutex.h"
+#include "overheadBudget.h"
+#include "overheadStats.h"
+#include "perfMap.h"
+#include "recentSamples.h"
+#include "sampleHistory.h"
+#include "sampleRing.h"
+#include "scopeCache.h"
 #include "spinLock.h"
+#include "stackStitcher.h"
+#include "stackWalker.h"
 #include "threadFilter.h"
+#include "threadNames.h"
 #include "trap.h"
+#include "unwindCache.h"
 #include "vmEntry.h"
 #include "writer.h"
 
 
 const int MAX_NATIVE_FRAMES = 128;
 const int RESERVED_FRAMES   = 10;  // for synthetic frames
-const int CONCURRENCY_LEVEL = 16;
+const int CONCURRENCY_LEVEL = 64;
+
+const u64 DEFERRED_SAMPLE_POLL_INTERVAL = 10000000;  // 10 ms
+const int DEFERRED_SAMPLE_BATCH = 256;
 
 
 union CallTraceBuffer {
@@ -37,9 +56,12 @@ union CallTraceBuffer {
 };
 
 
+class FlameGraph;
 class FrameName;
 class NMethod;
+struct FlameGraphTask;
 class StackContext;
+class VMThread;
 
 enum State {
     NEW,
@@ -48,6 +70,30 @@ enum State {
     TERMINATED
 };
 
+// Memory used by the profiler, as reported by meminfo
+struct MemoryUsage {
+    size_t call_trace_storage;
+    size_t flight_recording;
+    size_t dictionaries;
+    size_t code_cache;
+    size_t dwarf;
+    size_t stack_buffers;
+};
+
+// Numeric counters for AsyncProfilerMXBean attributes. The order is shared with AsyncProfiler.java
+enum ProfilerMetric {
+    METRIC_SAMPLES,
+    METRIC_SKIPPED_TICKS,
+    METRIC_FAILED_SAMPLES,
+    METRIC_CALL_TRACE_STORAGE,
+    METRIC_USED_MEMORY,
+    METRIC_NATIVE_UNWIND_NANOS,
+    METRIC_JAVA_UNWIND_NANOS,
+    METRIC_STORAGE_NANOS,
+    METRIC_JFR_NANOS,
+    PROFILER_METRICS
+};
+
 class Profiler {
   private:
     Mutex _state_lock;
@@ -55,14 +101,14 @@ class Profiler {
     Trap _begin_trap;
     Trap _end_trap;
     bool _nostop;
-    Mutex _thread_names_lock;
-    // TODO: single map?
-    std::map<int, std::string> _thread_names;
-    std::map<int, jlong> _thread_ids;
+    ThreadNames _thread_names;
     Dictionary _class_map;
     Dictionary _symbol_map;
+    Dictionary _thread_group_map;
     ThreadFilter _thread_filter;
     CallTraceStorage _call_trace_storage;
+    ClassHistogram _class_histogram;
+    CacheLineTable _cache_lines;
     FlightRecorder _jfr;
     Engine* _engine;
     Engine* _alloc_engine;
@@ -72,26 +118,57 @@ class Profiler {
     time_t _stop_time;
     int _epoch;
     u32 _gc_id;
+    volatile bool _gc_active;
     WaitableMutex _timer_lock;
     void* _timer_id;
 
     u64 _total_samples;
     u64 _total_stack_walk_time;
+    OverheadStats _overhead;
+    OverheadBudget _overhead_budget;
     u64 _failures[ASGCT_FAILURE_TYPES];
 
     SpinLock _locks[CONCURRENCY_LEVEL];
+    // Buffers are mapped with the full size, but only the pages touched by deep stacks get committed
     CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    int _calltrace_depth[CONCURRENCY_LEVEL];
+    size_t _calltrace_buffer_size;
+    SampleRing _sample_rings[CONCURRENCY_LEVEL];
+    UnwindCache _unwind_caches[CONCURRENCY_LEVEL];
+    ScopeCache _scope_caches[CONCURRENCY_LEVEL];
+    StackStitcher _stack_stitcher;
+    int _stitch_depth;
+    RecentSamples _recent_cpu_samples;
+    RecentContexts _recent_contexts;
+    SampleTimeline _timeline;
+    SampleHistory _history;
+    u64 _spike_cpu_nanos;
+    u64 _spike_check_micros;
+    u64 _spike_dump_micros;
+    bool _share_cpu_traces;
+    bool _deferred;
+    volatile bool _sample_worker_active;
+    pthread_t _sample_worker;
     int _max_stack_depth;
+    int _stack_depth;  // may go below _max_stack_depth under the memory limit
+    AdaptiveDepth _adaptive_depth;
+    size_t _memory_limit;
+    int _memory_shed_level;
+    size_t _memory_shed_used;
     StackWalkFeatures _features;
     CStack _cstack;
     bool _add_event_frame;
+    bool _pause_frames;
     bool _add_thread_frame;
+    bool _group_threads;
     bool _add_sched_frame;
     bool _update_thread_names;
     volatile jvmtiEventMode _thread_events_state;
 
+    // Serializes writers only: samples look stubs up in the published _stub_table
     SpinLock _stubs_lock;
     CodeCache _runtime_stubs;
+    StubTable _stub_table;
     CodeCacheArray _native_libs;
     const void* _call_stub_begin;
     const void* _call_stub_end;
@@ -109,19 +186,23 @@ class Profiler {
 
     void onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
     void onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
+    void onGarbageCollectionStart();
     void onGarbageCollectionFinish();
 
     const char* asgctError(int code);
-    u32 getLockIndex(int tid);
+    int tryLockAny(int tid, int cpu);
+    int tryLockAny(int tid);
     jmethodID getCurrentCompileTask();
-    int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, StackContext* java_ctx);
+    int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, StackContext* java_ctx,
+                       UnwindCache* cache);
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx);
+    int getJavaTraceVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackDetail detail, int tid, int lock_index);
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
+    int getJavaTraceAnchor(VMThread* vm_thread, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod);
     void setThreadInfo(int tid, const char* name, jlong java_thread_id);
     void updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
     void updateJavaThreadNames();
-    void updateNativeThreadNames();
     bool excludeTrace(FrameName* fn, CallTrace* trace);
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectEngine(const char* event_name);
@@ -133,6 +214,15 @@ class Profiler {
     void startTimer();
     void stopTimer();
     void timerLoop(void* timer_id);
+    void adjustSamplingScale();
+    void checkMemoryLimit();
+
+    bool startSampleWorker();
+    void stopSampleWorker();
+    void sampleWorkerLoop();
+    bool recordDeferredSamples(int lock_index);
+    u32 recordTrace(int lock_index, int tid, u64 counter, EventType event_type, Event* event,
+                    int num_frames, ASGCT_CallFrame* frames, u64 begin_time);
 
     void logEmptyOutput(Arguments& args, u64 printed_samples_count, Writer& out);
 
@@ -145,12 +235,43 @@ class Profiler {
         return NULL;
     }
 
+    static void* sampleWorkerEntry(void* unused) {
+        instance()->sampleWorkerLoop();
+        return NULL;
+    }
+
+    static void* flameGraphWorkerEntry(void* arg) {
+        instance()->flameGraphWorker((FlameGraphTask*)arg);
+        return NULL;
+    }
+
     void lockAll();
     void unlockAll();
 
+    int makeThreadFrame(ASGCT_CallFrame* frames, int tid);
+    const char* pauseFrame(EventType event_type);
+    int makeVirtualThreadFrame(ASGCT_CallFrame* frames, jlong vthread);
+    void publishRuntimeStubs();
+
+    void printOverhead(Writer& out);
+
+    Error dumpOutput(Writer& out, Arguments& args, Output output, Compression compression);
     void dumpCollapsed(Writer& out, Arguments& args);
     void dumpFlameGraph(Writer& out, Arguments& args, bool tree);
+    void addFlameGraphTrace(FlameGraph& flamegraph, FrameName& fn, Arguments& args,
+                            ASGCT_CallFrame* frames, int num_frames, u64 counter, u64 baseline);
+    u64 buildFlameGraph(FlameGraph& flamegraph, FrameName& fn, Arguments& args,
+                        const std::vector<CallTraceSample*>& samples, size_t start, size_t end);
+    u64 buildDiffFlameGraph(FlameGraph& flamegraph, FrameName& fn, Arguments& args);
+    void flameGraphWorker(FlameGraphTask* task);
     void dumpText(Writer& out, Arguments& args);
+    void dumpClassHistogram(Writer& out, FrameName& fn, int max_count);
+    void dumpCacheLines(Writer& out, FrameName& fn, int max_count);
+    void dumpPprof(Writer& out, Arguments& args);
+    void dumpHeatmap(Writer& out, Arguments& args);
+    void collectRecentSamples(Arguments& args, std::vector<CallTraceSample>& samples);
+    void checkCpuSpike(u64 current_micros);
+    void preopenNextFile(Arguments& args);
 
     static Profiler* const _instance;
 
@@ -165,18 +286,33 @@ class Profiler {
         _start_time(0),
         _epoch(0),
         _gc_id(0),
+        _gc_active(false),
         _timer_id(NULL),
         _max_stack_depth(0),
+        _stack_depth(0),
+        _memory_limit(0),
+        _memory_shed_level(0),
+        _memory_shed_used(0),
+        _stitch_depth(0),
+        _spike_cpu_nanos(0),
+        _spike_check_micros(0),
+        _spike_dump_micros(0),
+        _share_cpu_traces(false),
+        _deferred(false),
+        _sample_worker_active(false),
         _thread_events_state(JVMTI_DISABLE),
         _stubs_lock(),
         _runtime_stubs("[stubs]"),
+        _stub_table(),
         _native_libs(),
         _call_stub_begin(NULL),
         _call_stub_end(NULL),
         _dlopen_entry(NULL) {
 
+        _calltrace_buffer_size = 0;
         for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
             _calltrace_buffer[i] = NULL;
+            _calltrace_depth[i] = 0;
         }
     }
 
@@ -185,9 +321,13 @@ class Profiler {
     }
 
     u64 total_samples() { return _total_samples; }
+    u64 metric(int metric);
     long uptime()       { return time(NULL) - _start_time; }
 
     Dictionary* classMap() { return &_class_map; }
+    ClassHistogram* classHistogram() { return &_class_histogram; }
+    CacheLineTable* cacheLines() { return &_cache_lines; }
+    Dictionary* threadGroupMap() { return &_thread_group_map; }
     ThreadFilter* threadFilter() { return &_thread_filter; }
     CodeCacheArray* nativeLibs() { return &_native_libs; }
 
@@ -196,30 +336,57 @@ class Profiler {
     Error restart(Arguments& args);
     void shutdown(Arguments& args);
     Error check(Arguments& args);
-    Error start(Arguments& args, bool reset);
+    Error start(Arguments& args, bool reset, bool restart = false);
     Error stop(bool restart = false);
     Error flushJfr();
     Error dump(Writer& out, Arguments& args);
+    Error dumpBinary(Arguments& args, asprof_dump_handler* handler);
+    size_t usedMemory(MemoryUsage& usage);
     void printUsedMemory(Writer& out);
     void logStats();
     void switchThreadEvents(jvmtiEventMode mode);
-    int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames, EventType event_type);
+    int convertNativeTrace(int native_frames, const void** callchain, ASGCT_CallFrame* frames, EventType event_type,
+                           UnwindCache* cache = NULL);
     u64 recordSample(void* ucontext, u64 counter, EventType event_type, Event* event);
-    void recordExternalSample(u64 counter, int tid, EventType event_type, Event* event, int num_frames, ASGCT_CallFrame* frames);
+
+    // Called by engines with a fixed sampling period before recording a sample.
+    // To keep within the overhead budget, drops some samples and scales the weight of the rest.
+    bool takeSample(u64& counter) {
+        u32 weight = _overhead_budget.take();
+        counter *= weight;
+        return weight != 0;
+    }
+    u32 recordExternalSample(u64 counter, int tid, EventType event_type, Event* event, int num_frames, ASGCT_CallFrame* frames);
     void recordExternalSamples(u64 samples, u64 counter, int tid, u32 call_trace_id, EventType event_type, Event* event);
+    u32 recordVirtualThreadSample(u64 counter, jlong vthread, int num_frames, ASGCT_CallFrame* frames);
     void recordEventOnly(EventType event_type, Event* event);
+    void recordUserEvents(const asprof_jfr_event* events, size_t count, bool buffered);
+
+    // Takes back a sample previously recorded with this counter, e.g. a freed native allocation
+    void releaseSample(u32 call_trace_id, u64 counter) {
+        _call_trace_storage.add(call_trace_id, (u64)-1, (u64)0 - counter);
+    }
+
+    // A call trace of the thread recorded by the CPU engine since min_time, or 0.
+    // Available only when CPU and wall clock profiling run together.
+    u32 recentCpuTrace(int tid, u64 min_time) {
+        return _share_cpu_traces ? _recent_cpu_samples.get(tid, min_time) : 0;
+    }
     void tryResetCounters();
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
 
     void updateSymbols(bool kernel_symbols);
+    bool updateSymbolsOnDlopen(bool sync);
+    void loadDeferredSymbols();
     const void* resolveSymbol(const char* name);
     const char* getLibraryName(const char* native_symbol);
     CodeCache* findJvmLibrary(const char* lib_name);
     CodeCache* findLibraryByName(const char* lib_name);
     CodeCache* findLibraryByAddress(const void* address);
     const char* findNativeMethod(const void* address);
-    CodeBlob* findRuntimeStub(const void* address);
+    const char* resolveNativePC(const void* pc);
+    bool findRuntimeStub(const void* address, CodeBlob& stub);
     bool isAddressInCode(const void* pc);
 
     void trapHandler(int signo, siginfo_t* siginfo, void* ucontext);
@@ -233,6 +400,7 @@ class Profiler {
                                            jint map_length, const jvmtiAddrLocationMap* map,
                                            const void* compile_info) {
         instance()->addJavaMethod(code_addr, code_size, method);
+        PerfMap::add(code_addr, code_size, method);
     }
 
     static void JNICALL DynamicCodeGenerated(jvmtiEnv* jvmti, const char* name,
@@ -248,6 +416,10 @@ class Profiler {
         instance()->onThreadEnd(jvmti, jni, thread);
     }
 
+    static void JNICALL GarbageCollectionStart(jvmtiEnv* jvmti) {
+        instance()->onGarbageCollectionStart();
+    }
+
     static void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti) {
         instance()->onGarbageCollectionFinish();
     }
@@ -0,0 +1,103 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PROTOBUF_H
+#define _PROTOBUF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "arch.h"
+
+
+enum ProtoWireType {
+    PROTO_VARINT = 0,
+    PROTO_LEN    = 2
+};
+
+// Simplified Protobuf writer, capable of encoding varints, strings and embedded messages.
+// The C++ counterpart of one.proto.Proto in the converter.
+class ProtoBuffer {
+  private:
+    char* _buf;
+    size_t _size;
+    size_t _capacity;
+
+    void ensureCapacity(size_t length) {
+        if (_size + length > _capacity) {
+            _capacity = _size + length > _capacity * 2 ? _size + length : _capacity * 2;
+            _buf = (char*)realloc(_buf, _capacity);
+        }
+    }
+
+    void tag(int index, ProtoWireType type) {
+        writeVarint((u64)(index << 3 | type));
+    }
+
+  public:
+    ProtoBuffer(size_t capacity = 256) : _size(0), _capacity(capacity) {
+        _buf = (char*)malloc(capacity);
+    }
+
+    ~ProtoBuffer() {
+        free(_buf);
+    }
+
+    const char* data() const {
+        return _buf;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    void reset() {
+        _size = 0;
+    }
+
+    ProtoBuffer& field(int index, u64 n) {
+        tag(index, PROTO_VARINT);
+        writeVarint(n);
+        return *this;
+    }
+
+    ProtoBuffer& field(int index, const char* s, size_t len) {
+        tag(index, PROTO_LEN);
+        writeVarint(len);
+        ensureCapacity(len);
+        memcpy(_buf + _size, s, len);
+        _size += len;
+        return *this;
+    }
+
+    ProtoBuffer& field(int index, const char* s) {
+        return field(index, s, strlen(s));
+    }
+
+    // An embedded message or a packed field is written in place; its length is filled in
+    // by commitField() as a 3-byte varint, which limits the field to 2 MB
+    size_t startField(int index) {
+        tag(index, PROTO_LEN);
+        ensureCapacity(3);
+        return _size += 3;
+    }
+
+    void commitField(size_t mark) {
+        size_t length = _size - mark;
+        _buf[mark - 3] = (char)(0x80 | (length & 0x7f));
+        _buf[mark - 2] = (char)(0x80 | ((length >> 7) & 0x7f));
+        _buf[mark - 1] = (char)((length >> 14) & 0x7f);
+    }
+
+    void writeVarint(u64 n) {
+        ensureCapacity(10);
+        while ((n >> 7) != 0) {
+            _buf[_size++] = (char)(0x80 | (n & 0x7f));
+            n >>= 7;
+        }
+        _buf[_size++] = (char)n;
+    }
+};
+
+#endif // _PROTOBUF_H
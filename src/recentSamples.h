@@ -0,0 +1,103 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _RECENTSAMPLES_H
+#define _RECENTSAMPLES_H
+
+#include <string.h>
+#include "arch.h"
+
+
+const u32 RECENT_SAMPLES_SIZE = 4096;
+
+// The last call trace recorded by a CPU engine for every thread, keyed by tid modulo the table size.
+// When CPU and wall clock profiling run together, the wall clock sampler attributes a recent
+// CPU trace of a running thread to the wall clock event instead of walking the same stack again.
+// Writers are signal handlers of different threads, hence entries may be torn. This is harmless,
+// since a trace is returned only if the tid in the key matches, and any trace of the thread
+// stored under that key is a valid sample of it.
+class RecentSamples {
+  private:
+    struct Entry {
+        volatile u64 key;  // tid << 32 | call_trace_id
+        volatile u64 time;
+    };
+
+    Entry _entries[RECENT_SAMPLES_SIZE];
+
+  public:
+    RecentSamples() {
+        reset();
+    }
+
+    void reset() {
+        memset((void*)_entries, 0, sizeof(_entries));
+    }
+
+    void put(int tid, u32 call_trace_id, u64 time) {
+        Entry* e = &_entries[(u32)tid & (RECENT_SAMPLES_SIZE - 1)];
+        e->key = (u64)(u32)tid << 32 | call_trace_id;
+        e->time = time;
+    }
+
+    // Returns the call trace of the thread recorded not earlier than min_time, or 0
+    u32 get(int tid, u64 min_time) const {
+        const Entry* e = &_entries[(u32)tid & (RECENT_SAMPLES_SIZE - 1)];
+        u64 key = e->key;
+        u64 time = e->time;
+        if ((u32)(key >> 32) != (u32)tid || time < min_time || key != e->key) {
+            return 0;
+        }
+        return (u32)key;
+    }
+};
+
+// The call trace of the last signal-based sample of every thread, together with a digest
+// of its execution context: registers and the top of the stack. A thread interrupted again
+// in the very same context, e.g. spinning in a tight loop or blocked in a syscall, reuses
+// the trace instead of unwinding the same stack. The digest also covers the key, so that
+// an entry torn by concurrent writers of colliding threads never matches.
+class RecentContexts {
+  private:
+    struct Entry {
+        volatile u64 key;  // tid << 32 | call_trace_id
+        volatile u64 digest;
+    };
+
+    Entry _entries[RECENT_SAMPLES_SIZE];
+
+    static u64 mix(u64 key, u64 context) {
+        u64 h = (key ^ context) * 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 32);
+    }
+
+  public:
+    RecentContexts() {
+        reset();
+    }
+
+    void reset() {
+        memset((void*)_entries, 0, sizeof(_entries));
+    }
+
+    void put(int tid, u32 call_trace_id, u64 context) {
+        Entry* e = &_entries[(u32)tid & (RECENT_SAMPLES_SIZE - 1)];
+        u64 key = (u64)(u32)tid << 32 | call_trace_id;
+        e->key = key;
+        e->digest = mix(key, context);
+    }
+
+    // Returns the call trace recorded by the thread in the same context, or 0
+    u32 get(int tid, u64 context) const {
+        const Entry* e = &_entries[(u32)tid & (RECENT_SAMPLES_SIZE - 1)];
+        u64 key = e->key;
+        if ((u32)(key >> 32) != (u32)tid || (u32)key == 0 || e->digest != mix(key, context)) {
+            return 0;
+        }
+        return (u32)key;
+    }
+};
+
+#endif // _RECENTSAMPLES_H
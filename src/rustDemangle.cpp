@@ -1904,6 +1904,11 @@ static bool is_symbol_like(const char *s, size_t len) {
 }
 
 void rust_demangle_demangle(const char *s, struct demangle *res)
+{
+    rust_demangle_demangle_style(s, DemangleStyleUnknown, res);
+}
+
+void rust_demangle_demangle_style(const char *s, enum demangle_style style, struct demangle *res)
 {
     // During ThinLTO LLVM may import and rename internal symbols, so strip out
     // those endings first as they're one of the last manglings applied to symbol
@@ -1930,7 +1935,8 @@ void rust_demangle_demangle(const char *s, struct demangle *res)
 
     const char *suffix;
     struct demangle_legacy legacy;
-    demangle_status st = rust_demangle_legacy_demangle(s, s_len, &legacy, &suffix);
+    demangle_status st = style == DemangleStyleV0 ? DemangleInvalid
+        : rust_demangle_legacy_demangle(s, s_len, &legacy, &suffix);
     if (st == DemangleOk) {
         *res = (struct demangle) {
             .style=DemangleStyleLegacy,
@@ -1944,7 +1950,8 @@ void rust_demangle_demangle(const char *s, struct demangle *res)
         };
     } else {
         struct demangle_v0 v0;
-        st = rust_demangle_v0_demangle(s, s_len, &v0, &suffix);
+        st = style == DemangleStyleLegacy ? DemangleInvalid
+            : rust_demangle_v0_demangle(s, s_len, &v0, &suffix);
         if (st == DemangleOk) {
             *res = (struct demangle) {
                 .style=DemangleStyleV0,
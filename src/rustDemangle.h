@@ -55,6 +55,10 @@ struct demangle {
 /// Use `rust_demangle_display_demangle` to convert it to an actual string.
 void rust_demangle_demangle(const char *s, struct demangle *res);
 
+/// Same as `rust_demangle_demangle`, but when `style` is not `DemangleStyleUnknown`,
+/// only the given mangling scheme is tried.
+void rust_demangle_demangle_style(const char *s, enum demangle_style style, struct demangle *res);
+
 /// Write the string in a `struct demangle` into a buffer.
 ///
 /// Return `OverflowOk` if the output buffer was sufficiently big, `OverflowOverflow` if it wasn't.
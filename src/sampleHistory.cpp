@@ -0,0 +1,71 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "sampleHistory.h"
+#include "os.h"
+#include "tsc.h"
+
+
+bool SampleHistory::enable() {
+    if (_ring == NULL) {
+        _ring = (HistorySample*)OS::safeAlloc(SAMPLE_HISTORY_CAPACITY * sizeof(HistorySample));
+        if (_ring == NULL) {
+            return false;
+        }
+    } else {
+        memset(_ring, 0, SAMPLE_HISTORY_CAPACITY * sizeof(HistorySample));
+    }
+    _next = 0;
+    _start_nanos = TSC::nanos();
+    return true;
+}
+
+void SampleHistory::disable() {
+    if (_ring != NULL) {
+        OS::safeFree(_ring, SAMPLE_HISTORY_CAPACITY * sizeof(HistorySample));
+        _ring = NULL;
+    }
+}
+
+void SampleHistory::add(u32 call_trace_id, u64 samples, u64 counter) {
+    HistorySample* ring = _ring;
+    if (ring == NULL || call_trace_id == 0) {
+        return;
+    }
+
+    // Time 0 is reserved for empty slots
+    u64 millis = (TSC::nanos() - _start_nanos) / 1000000 + 1;
+
+    HistorySample* s = &ring[atomicInc(_next) % SAMPLE_HISTORY_CAPACITY];
+    s->key = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->samples = samples;
+    s->counter = counter;
+    __atomic_store_n(&s->key, millis << 32 | call_trace_id, __ATOMIC_RELEASE);
+}
+
+u64 SampleHistory::collect(u64 millis, std::map<u32, HistoryTotal>& totals) {
+    if (_ring == NULL) {
+        return 0;
+    }
+
+    u64 now = (TSC::nanos() - _start_nanos) / 1000000 + 1;
+    u64 since = now > millis ? now - millis : 1;
+    u64 count = 0;
+
+    for (u32 i = 0; i < SAMPLE_HISTORY_CAPACITY; i++) {
+        // A slot overwritten during the scan may mix old and new values; it still counts once
+        u64 key = __atomic_load_n(&_ring[i].key, __ATOMIC_ACQUIRE);
+        if ((key >> 32) < since) {
+            continue;
+        }
+        HistoryTotal& total = totals[(u32)key];
+        total.samples += _ring[i].samples;
+        total.counter += _ring[i].counter;
+        count += _ring[i].samples;
+    }
+    return count;
+}
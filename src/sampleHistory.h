@@ -0,0 +1,57 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SAMPLEHISTORY_H
+#define _SAMPLEHISTORY_H
+
+#include <map>
+#include "arch.h"
+
+
+// Fixed number of samples kept in the history; the oldest are overwritten
+const u32 SAMPLE_HISTORY_CAPACITY = 1024 * 1024;
+
+struct HistorySample {
+    volatile u64 key;  // millis since start << 32 | call_trace_id, 0 for an empty slot
+    u64 samples;
+    u64 counter;
+};
+
+struct HistoryTotal {
+    u64 samples;
+    u64 counter;
+};
+
+// Bounded ring of recent samples for dumping the last N seconds of a long-running profile.
+// Unlike SampleTimeline, memory is allocated once when the history is enabled, and never grows.
+// Appending is lock-free and async signal safe. Enabling and disabling require all profiler locks.
+class SampleHistory {
+  private:
+    HistorySample* _ring;
+    volatile u64 _next;
+    u64 _start_nanos;
+
+  public:
+    SampleHistory() : _ring(NULL), _next(0), _start_nanos(0) {
+    }
+
+    ~SampleHistory() {
+        disable();
+    }
+
+    bool enabled() const {
+        return _ring != NULL;
+    }
+
+    bool enable();
+    void disable();
+
+    void add(u32 call_trace_id, u64 samples, u64 counter);
+
+    // Sums up samples of the last MILLIS per call trace; returns the total number of samples
+    u64 collect(u64 millis, std::map<u32, HistoryTotal>& totals);
+};
+
+#endif // _SAMPLEHISTORY_H
@@ -0,0 +1,77 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "sampleRing.h"
+#include "os.h"
+
+
+bool SampleRing::allocate() {
+    if (_data == NULL) {
+        _data = (char*)OS::safeAlloc(SAMPLE_RING_SIZE);
+    }
+    return _data != NULL;
+}
+
+// Returns false if the ring has no room for the sample; the caller then records it directly
+bool SampleRing::push(int tid, u64 counter, EventType event_type, ExecutionEvent* event,
+                      int num_frames, ASGCT_CallFrame* frames) {
+    u32 size = (sizeof(RawSample) + num_frames * sizeof(ASGCT_CallFrame) + 7) & ~7;
+    if (_data == NULL || size > SAMPLE_RING_SIZE / 2) {
+        return false;
+    }
+
+    u64 head = _head;
+    u32 offset = head & (SAMPLE_RING_SIZE - 1);
+    u32 space_to_end = SAMPLE_RING_SIZE - offset;
+    u32 needed = size <= space_to_end ? size : space_to_end + size;
+    if (head + needed - loadAcquire(_tail) > SAMPLE_RING_SIZE) {
+        return false;
+    }
+
+    if (size > space_to_end) {
+        // Records are contiguous; skip the tail of the ring
+        ((RawSample*)(_data + offset))->size = 0;
+        head += space_to_end;
+        offset = 0;
+    }
+
+    RawSample* sample = (RawSample*)(_data + offset);
+    sample->size = size;
+    sample->tid = tid;
+    sample->event_type = event_type;
+    sample->num_frames = num_frames;
+    sample->counter = counter;
+    sample->start_time = event->_start_time;
+    sample->thread_state = event->_thread_state;
+    sample->cpu = event->_cpu;
+    memcpy(sample->frames(), frames, num_frames * sizeof(ASGCT_CallFrame));
+
+    storeRelease(_head, head + size);
+    return true;
+}
+
+RawSample* SampleRing::peek() {
+    u64 tail = _tail;
+    if (_data == NULL || tail == loadAcquire(_head)) {
+        return NULL;
+    }
+
+    u32 offset = tail & (SAMPLE_RING_SIZE - 1);
+    RawSample* sample = (RawSample*)(_data + offset);
+    if (sample->size == 0) {
+        tail += SAMPLE_RING_SIZE - offset;
+        storeRelease(_tail, tail);
+        if (tail == loadAcquire(_head)) {
+            return NULL;
+        }
+        sample = (RawSample*)_data;
+    }
+    return sample;
+}
+
+void SampleRing::pop(RawSample* sample) {
+    storeRelease(_tail, _tail + sample->size);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SAMPLERING_H
+#define _SAMPLERING_H
+
+#include "arch.h"
+#include "event.h"
+#include "vmEntry.h"
+
+
+const u32 SAMPLE_RING_SIZE = 256 * 1024;
+
+// Execution sample captured by a signal handler, followed by num_frames raw frames
+struct RawSample {
+    u32 size;  // Record size in bytes; 0 marks the unused tail of the ring before wrapping
+    int tid;
+    EventType event_type;
+    int num_frames;
+    u64 counter;
+    u64 start_time;
+    ThreadState thread_state;
+    int cpu;
+
+    ASGCT_CallFrame* frames() {
+        return (ASGCT_CallFrame*)(this + 1);
+    }
+};
+
+// Lock-free single-producer single-consumer ring of RawSamples.
+// The producer is a signal handler holding the profiler lock that owns the ring;
+// the consumer is the thread that stores deferred samples.
+class SampleRing {
+  private:
+    char* _data;
+    u64 _head;
+    char _padding1[48];
+    u64 _tail;
+    char _padding2[56];
+
+  public:
+    SampleRing() : _data(NULL), _head(0), _tail(0) {
+    }
+
+    bool allocate();
+
+    bool push(int tid, u64 counter, EventType event_type, ExecutionEvent* event,
+              int num_frames, ASGCT_CallFrame* frames);
+
+    RawSample* peek();
+    void pop(RawSample* sample);
+};
+
+#endif // _SAMPLERING_H
@@ -0,0 +1,86 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SCOPECACHE_H
+#define _SCOPECACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "arch.h"
+#include "vmEntry.h"
+
+
+const u32 SCOPE_CACHE_SIZE = 256;
+const int SCOPE_CACHE_FRAMES = 8;
+
+// Direct-mapped cache of Java frames decoded from nmethod scopes while walking stacks,
+// including inlined ones. Like UnwindCache, every profiler lock slot owns one cache,
+// so entries need no synchronization. The compile ID in the key tells apart a new nmethod
+// that happens to occupy the address of a freed one.
+class ScopeCache {
+  private:
+    struct Entry {
+        const void* pc;
+        const void* nmethod;
+        int compile_id;
+        int count;
+        ASGCT_CallFrame frames[SCOPE_CACHE_FRAMES];
+    };
+
+    Entry _entries[SCOPE_CACHE_SIZE];
+    u64 _hits;
+    u64 _misses;
+
+    Entry* entryFor(const void* pc) {
+        return &_entries[(u32)(((uintptr_t)pc * 0x9e3779b97f4a7c15ULL) >> 56) & (SCOPE_CACHE_SIZE - 1)];
+    }
+
+  public:
+    ScopeCache() {
+        reset();
+    }
+
+    void reset() {
+        memset(this, 0, sizeof(ScopeCache));
+    }
+
+    // Copies at most max_depth cached frames for the given pc; returns 0 if there are none
+    int lookup(const void* pc, const void* nmethod, int compile_id, ASGCT_CallFrame* frames, int max_depth) {
+        Entry* e = entryFor(pc);
+        if (e->pc != pc || pc == NULL || e->nmethod != nmethod || e->compile_id != compile_id) {
+            _misses++;
+            return 0;
+        }
+
+        _hits++;
+        int count = e->count < max_depth ? e->count : max_depth;
+        memcpy(frames, e->frames, count * sizeof(ASGCT_CallFrame));
+        return count;
+    }
+
+    // Only complete scope chains that fit in an entry are cached
+    void store(const void* pc, const void* nmethod, int compile_id, const ASGCT_CallFrame* frames, int count) {
+        if (count <= 0 || count > SCOPE_CACHE_FRAMES) {
+            return;
+        }
+
+        Entry* e = entryFor(pc);
+        e->pc = pc;
+        e->nmethod = nmethod;
+        e->compile_id = compile_id;
+        e->count = count;
+        memcpy(e->frames, frames, count * sizeof(ASGCT_CallFrame));
+    }
+
+    u64 hits() const {
+        return _hits;
+    }
+
+    u64 misses() const {
+        return _misses;
+    }
+};
+
+#endif // _SCOPECACHE_H
@@ -0,0 +1,133 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _STACKSTITCHER_H
+#define _STACKSTITCHER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arch.h"
+#include "spinLock.h"
+#include "vmEntry.h"
+
+
+const u32 STITCH_SLOTS = 64;
+const int STITCH_MAX_REUSE = 16;
+
+// Bottom parts of recent deep stacks, one per thread slot. A stack walk that arrives
+// at the same frame (pc, sp, fp) of the same thread at the stitch depth takes the stored
+// frames instead of unwinding the rest of the stack. An entry is reused a limited number
+// of times, then the stack is walked to the end again to catch up with changes.
+// Slots are only tried, never waited for, so the stitcher is safe to use in signal handlers.
+class StackStitcher {
+  private:
+    struct Slot {
+        SpinLock lock;
+        int tid;
+        int reuse;
+        const void* pc;
+        uintptr_t sp;
+        uintptr_t fp;
+        int num_frames;
+        ASGCT_CallFrame* frames;
+    };
+
+    Slot _slots[STITCH_SLOTS];
+    ASGCT_CallFrame* _arena;
+    int _max_frames;
+    volatile u64 _hits;
+    volatile u64 _misses;
+
+    Slot* slotFor(int tid) {
+        return &_slots[(u32)tid & (STITCH_SLOTS - 1)];
+    }
+
+  public:
+    StackStitcher() : _arena(NULL), _max_frames(0) {
+        reset();
+    }
+
+    // Every slot keeps up to max_frames; returns false if there is not enough memory
+    bool init(int max_frames) {
+        if (max_frames != _max_frames) {
+            free(_arena);
+            _arena = (ASGCT_CallFrame*)malloc((size_t)max_frames * STITCH_SLOTS * sizeof(ASGCT_CallFrame));
+            _max_frames = _arena != NULL ? max_frames : 0;
+        }
+        reset();
+        return _arena != NULL;
+    }
+
+    void reset() {
+        for (u32 i = 0; i < STITCH_SLOTS; i++) {
+            Slot* s = &_slots[i];
+            s->lock.reset();
+            s->tid = 0;
+            s->num_frames = 0;
+            s->frames = _arena + (size_t)i * _max_frames;
+        }
+        _hits = 0;
+        _misses = 0;
+    }
+
+    // Copies the stored bottom of the stack continuing at the given frame;
+    // returns the number of copied frames, or 0 if the stack has to be walked
+    int stitch(int tid, const void* pc, uintptr_t sp, uintptr_t fp, ASGCT_CallFrame* frames, int max_frames) {
+        Slot* s = slotFor(tid);
+        int num_frames = 0;
+        if (_arena != NULL && s->lock.tryLock()) {
+            if (s->tid == tid && s->pc == pc && s->sp == sp && s->fp == fp &&
+                s->num_frames > 0 && s->reuse < STITCH_MAX_REUSE) {
+                num_frames = s->num_frames < max_frames ? s->num_frames : max_frames;
+                memcpy(frames, s->frames, num_frames * sizeof(ASGCT_CallFrame));
+                s->reuse++;
+            }
+            s->lock.unlock();
+        }
+
+        atomicInc(num_frames > 0 ? _hits : _misses);
+        return num_frames;
+    }
+
+    void store(int tid, const void* pc, uintptr_t sp, uintptr_t fp, const ASGCT_CallFrame* frames, int num_frames) {
+        Slot* s = slotFor(tid);
+        if (num_frames <= 0 || _arena == NULL || !s->lock.tryLock()) {
+            return;
+        }
+
+        if (num_frames > _max_frames) num_frames = _max_frames;
+        memcpy(s->frames, frames, num_frames * sizeof(ASGCT_CallFrame));
+        s->tid = tid;
+        s->reuse = 0;
+        s->pc = pc;
+        s->sp = sp;
+        s->fp = fp;
+        s->num_frames = num_frames;
+        s->lock.unlock();
+    }
+
+    u64 hits() const {
+        return _hits;
+    }
+
+    u64 misses() const {
+        return _misses;
+    }
+};
+
+// A stack walk limited by the stitch depth: either finds the stored bottom of the stack,
+// or remembers the frame where it has passed the stitch depth
+struct StitchPoint {
+    StackStitcher* stitcher;
+    int tid;
+    int depth;
+    int anchor_depth;  // -1 unless the walk has passed the stitch depth without a match
+    const void* pc;
+    uintptr_t sp;
+    uintptr_t fp;
+};
+
+#endif // _STACKSTITCHER_H
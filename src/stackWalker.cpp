@@ -4,11 +4,15 @@
  */
 
 #include <setjmp.h>
+#include <string.h>
 #include "stackWalker.h"
 #include "dwarf.h"
 #include "profiler.h"
 #include "safeAccess.h"
+#include "scopeCache.h"
 #include "stackFrame.h"
+#include "stackStitcher.h"
+#include "unwindCache.h"
 #include "vmStructs.h"
 
 
@@ -17,6 +21,8 @@ const uintptr_t MAX_WALK_SIZE = 0x100000;
 const intptr_t MAX_FRAME_SIZE = 0x40000;
 const intptr_t MAX_INTERPRETER_FRAME_SIZE = 0x1000;
 const intptr_t DEAD_ZONE = 0x1000;
+// Longest call instruction: a return address follows its call site by at most this many bytes
+const uintptr_t MAX_CALL_SIZE = 15;
 
 
 static inline bool aligned(uintptr_t ptr) {
@@ -112,7 +118,8 @@ int StackWalker::walkFP(void* ucontext, const void** callchain, int max_depth, S
     return depth;
 }
 
-int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx) {
+int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx,
+                           UnwindCache* cache) {
     const void* pc;
     uintptr_t fp;
     uintptr_t sp;
@@ -144,8 +151,13 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
         callchain[depth++] = pc;
 
         uintptr_t prev_sp = sp;
-        CodeCache* cc = profiler->findLibraryByAddress(pc);
-        FrameDesc* f = cc != NULL ? cc->findFrameDesc(pc) : &FrameDesc::default_frame;
+        FrameDesc* f;
+        if (cache != NULL) {
+            f = cache->findFrameDesc(pc, profiler->nativeLibs());
+        } else {
+            CodeCache* cc = profiler->findLibraryByAddress(pc);
+            f = cc != NULL ? cc->findFrameDesc(pc) : &FrameDesc::default_frame;
+        }
 
         u8 cfa_reg = (u8)f->cfa;
         int cfa_off = f->cfa >> 8;
@@ -201,14 +213,46 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
     return depth;
 }
 
-int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackDetail detail) {
+int StackWalker::findCallSite(const void* call_site, const void** callchain, int depth) {
+    for (int i = 0; i < depth; i++) {
+        uintptr_t distance = (uintptr_t)callchain[i] - (uintptr_t)call_site;
+        if (distance - 1 < MAX_CALL_SIZE) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int StackWalker::walkBelow(const void* call_site, void* ucontext, const void** callchain, int max_depth,
+                           StackContext* java_ctx, UnwindCache* cache) {
+    const void* full[MAX_NATIVE_FRAMES];
+    StackContext saved_ctx = *java_ctx;
+
+    // Frame pointers are cheap to follow, but frameless code may hide the call site from them
+    for (int attempt = 0; attempt < (DWARF_SUPPORTED ? 2 : 1); attempt++) {
+        int depth = attempt == 0 ? walkFP(ucontext, full, MAX_NATIVE_FRAMES, java_ctx)
+                                 : walkDwarf(ucontext, full, MAX_NATIVE_FRAMES, java_ctx, cache);
+        int index = findCallSite(call_site, full, depth);
+        if (index >= 0) {
+            int count = depth - index - 1;
+            if (count > max_depth) count = max_depth;
+            memcpy(callchain, full + index + 1, count * sizeof(const void*));
+            return count;
+        }
+        *java_ctx = saved_ctx;
+    }
+    return 0;
+}
+
+int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackDetail detail,
+                        ScopeCache* cache, StitchPoint* stitch) {
     if (ucontext == NULL) {
         return walkVM(ucontext, frames, max_depth, detail,
-                      callerPC(), (uintptr_t)callerSP(), (uintptr_t)callerFP());
+                      callerPC(), (uintptr_t)callerSP(), (uintptr_t)callerFP(), cache, stitch);
     } else {
         StackFrame frame(ucontext);
         return walkVM(ucontext, frames, max_depth, detail,
-                      (const void*)frame.pc(), frame.sp(), frame.fp());
+                      (const void*)frame.pc(), frame.sp(), frame.fp(), cache, stitch);
     }
 }
 
@@ -228,11 +272,12 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
         pc = ((const void**)sp)[-1];
     }
 
-    return walkVM(ucontext, frames, max_depth, VM_BASIC, pc, sp, fp);
+    return walkVM(ucontext, frames, max_depth, VM_BASIC, pc, sp, fp, NULL, NULL);
 }
 
 int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
-                        StackDetail detail, const void* pc, uintptr_t sp, uintptr_t fp) {
+                        StackDetail detail, const void* pc, uintptr_t sp, uintptr_t fp,
+                        ScopeCache* cache, StitchPoint* stitch) {
     StackFrame frame(ucontext);
     uintptr_t bottom = (uintptr_t)&frame + MAX_WALK_SIZE;
 
@@ -259,6 +304,18 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
 
     // Walk until the bottom of the stack or until the first Java frame
     while (depth < max_depth) {
+        if (stitch != NULL && depth >= stitch->depth && stitch->anchor_depth < 0) {
+            int stitched = stitch->stitcher->stitch(stitch->tid, pc, sp, fp, frames + depth, max_depth - depth);
+            if (stitched > 0) {
+                depth += stitched;
+                break;
+            }
+            stitch->anchor_depth = depth;
+            stitch->pc = pc;
+            stitch->sp = sp;
+            stitch->fp = fp;
+        }
+
         if (CodeHeap::contains(pc)) {
             NMethod* nm = CodeHeap::findNMethod(pc);
             if (nm == NULL) {
@@ -269,18 +326,28 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                 fillFrame(frames[depth++], type, 0, nm->method()->id());
 
                 if (nm->isFrameCompleteAt(pc)) {
-                    int scope_offset = nm->findScopeOffset(pc);
-                    if (scope_offset > 0) {
-                        depth--;
-                        ScopeDesc scope(nm);
-                        do {
-                            scope_offset = scope.decode(scope_offset);
-                            if (detail != VM_BASIC) {
-                                type = scope_offset > 0 ? FRAME_INLINED :
-                                       level >= 1 && level <= 3 ? FRAME_C1_COMPILED : FRAME_JIT_COMPILED;
-                            }
-                            fillFrame(frames[depth++], type, scope.bci(), scope.method()->id());
-                        } while (scope_offset > 0 && depth < max_depth);
+                    int compile_id = cache != NULL ? nm->compileId() : -1;
+                    int cached = compile_id >= 0 ? cache->lookup(pc, nm, compile_id, frames + depth - 1, max_depth - depth + 1) : 0;
+                    if (cached > 0) {
+                        depth += cached - 1;
+                    } else {
+                        int scope_begin = depth - 1;
+                        int scope_offset = nm->findScopeOffset(pc);
+                        if (scope_offset > 0) {
+                            depth--;
+                            ScopeDesc scope(nm);
+                            do {
+                                scope_offset = scope.decode(scope_offset);
+                                if (detail != VM_BASIC) {
+                                    type = scope_offset > 0 ? FRAME_INLINED :
+                                           level >= 1 && level <= 3 ? FRAME_C1_COMPILED : FRAME_JIT_COMPILED;
+                                }
+                                fillFrame(frames[depth++], type, scope.bci(), scope.method()->id());
+                            } while (scope_offset > 0 && depth < max_depth);
+                        }
+                        if (compile_id >= 0 && scope_offset <= 0) {
+                            cache->store(pc, nm, compile_id, frames + scope_begin, depth - scope_begin);
+                        }
                     }
 
                     // Handle situations when sp is temporarily changed in the compiled code
@@ -362,9 +429,10 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
                 }
                 continue;
             } else {
-                CodeBlob* stub = profiler->findRuntimeStub(pc);
-                const void* start = stub != NULL ? stub->_start : nm->code();
-                const char* name = stub != NULL ? stub->_name : nm->name();
+                CodeBlob stub;
+                bool found = profiler->findRuntimeStub(pc, stub);
+                const void* start = found ? stub._start : nm->code();
+                const char* name = found ? stub._name : nm->name();
 
                 if (detail != VM_BASIC) {
                     fillFrame(frames[depth++], BCI_NATIVE_FRAME, name);
@@ -11,6 +11,9 @@
 
 
 class JavaFrameAnchor;
+class ScopeCache;
+class UnwindCache;
+struct StitchPoint;
 
 struct StackContext {
     const void* pc;
@@ -34,12 +37,23 @@ enum StackDetail {
 class StackWalker {
   private:
     static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
-                      StackDetail detail, const void* pc, uintptr_t sp, uintptr_t fp);
+                      StackDetail detail, const void* pc, uintptr_t sp, uintptr_t fp,
+                      ScopeCache* cache, StitchPoint* stitch);
 
   public:
     static int walkFP(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx);
-    static int walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx);
-    static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackDetail detail);
+    static int walkDwarf(void* ucontext, const void** callchain, int max_depth, StackContext* java_ctx,
+                         UnwindCache* cache = NULL);
+
+    // Continues a call stack known down to the given call site, e.g. from a branch stack,
+    // with the frames of a full FP, or else DWARF walk that are below the call site
+    static int walkBelow(const void* call_site, void* ucontext, const void** callchain, int max_depth,
+                         StackContext* java_ctx, UnwindCache* cache = NULL);
+    // Index of the frame that returns right after the call site, or -1
+    static int findCallSite(const void* call_site, const void** callchain, int depth);
+
+    static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackDetail detail,
+                      ScopeCache* cache = NULL, StitchPoint* stitch = NULL);
     static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, JavaFrameAnchor* anchor);
 
     static void checkFault();
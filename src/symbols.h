@@ -15,11 +15,31 @@ class Symbols {
     static Mutex _parse_lock;
     static bool _have_kernel_symbols;
     static bool _libs_limit_reported;
+    static bool _defer_symbols;
+    static volatile bool _have_deferred_symbols;
 
   public:
     static void parseKernelSymbols(CodeCache* cc);
     static void parseLibraries(CodeCacheArray* array, bool kernel_symbols);
 
+    // Cheap check if the dynamic linker has loaded anything since the last parseLibraries
+    static bool haveNewLibraries();
+
+    // Parses new libraries in a background thread, coalescing a burst of requests into one pass.
+    // The callback is invoked by that thread after parsing.
+    static void parseLibrariesAsync(CodeCacheArray* array, void (*callback)());
+
+    // Libraries parsed from now on get only their dynamic symbols until loadDeferredSymbols
+    static void deferSymbols(bool defer) {
+        _defer_symbols = defer;
+    }
+
+    // Loads symbols of all libraries parsed while deferSymbols was on
+    static void loadDeferredSymbols(CodeCacheArray* array);
+
+    // Wakes up the parser of DWARF tables requested by stack walkers. Async signal safe.
+    static void requestDwarf();
+
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
     }
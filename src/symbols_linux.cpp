@@ -7,6 +7,8 @@
 
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +16,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <elf.h>
 #include <errno.h>
 #include <unistd.h>
@@ -186,12 +190,27 @@ typedef Elf32_Dyn  ElfDyn;
 
 static char _debuginfod_cache_buf[PATH_MAX] = {0};
 
+// Directory for symbol caches shared by profiler sessions, or NULL if caching is off
+static const char* getSymbolCacheDir() {
+    const char* cache_dir = getenv("ASPROF_SYMBOL_CACHE");
+    if (cache_dir == NULL || !cache_dir[0]) {
+        return NULL;
+    }
+    mkdir(cache_dir, 0755);
+    return cache_dir;
+}
+
+// Libraries whose DWARF tables are parsed by the background loader, or NULL if it is not running
+static CodeCacheArray* _dwarf_libs = NULL;
+static sem_t _dwarf_requests;
+
 class ElfParser {
   private:
     CodeCache* _cc;
     const char* _base;
     const char* _file_name;
     bool _relocate_dyn;
+    bool _pinned;
     ElfHeader* _header;
     const char* _sections;
     const char* _vaddr_diff;
@@ -201,6 +220,7 @@ class ElfParser {
         _base = base;
         _file_name = file_name;
         _relocate_dyn = relocate_dyn;
+        _pinned = false;
         _header = (ElfHeader*)addr;
         _sections = (const char*)addr + _header->e_shoff;
     }
@@ -248,14 +268,15 @@ class ElfParser {
     void loadSymbols(bool use_debug);
     bool loadSymbolsFromDebug(const char* build_id, const int build_id_len);
     bool loadSymbolsFromDebuginfodCache(const char* build_id, const int build_id_len);
+    bool getSymbolCachePath(char* path, const char* build_id, const int build_id_len);
     bool loadSymbolsUsingBuildId();
     bool loadSymbolsUsingDebugLink();
     void loadSymbolTable(const char* symbols, size_t total_size, size_t ent_size, const char* strings);
     void addRelocationSymbols(ElfSection* reltab, const char* plt);
-    const char* getDebuginfodCache();
 
   public:
-    static void parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn);
+    static const char* getDebuginfodCache();
+    static void parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn, bool pinned);
     static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug);
 };
 
@@ -311,8 +332,9 @@ bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name
     return true;
 }
 
-void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn) {
+void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn, bool pinned) {
     ElfParser elf(cc, base, base, NULL, relocate_dyn);
+    elf._pinned = pinned;
     if (elf.validHeader() && base + elf._header->e_phoff < end) {
         cc->setTextBase(base);
         elf.calcVirtualLoadAddress();
@@ -436,7 +458,9 @@ void ElfParser::parseDwarfInfo() {
 
     ElfProgramHeader* eh_frame_hdr = findProgramHeader(PT_GNU_EH_FRAME);
     if (eh_frame_hdr != NULL) {
-        if (eh_frame_hdr->p_vaddr != 0) {
+        if (eh_frame_hdr->p_vaddr != 0 && _dwarf_libs != NULL) {
+            _cc->setLazyDwarf(_base, at(eh_frame_hdr), _pinned);
+        } else if (eh_frame_hdr->p_vaddr != 0) {
             DwarfParser dwarf(_cc->name(), _base, at(eh_frame_hdr));
             _cc->setDwarfTable(dwarf.table(), dwarf.count());
         } else if (strcmp(_cc->name(), "[vdso]") == 0) {
@@ -564,8 +588,44 @@ bool ElfParser::loadSymbolsUsingBuildId() {
     const char* build_id = (const char*)note + sizeof(*note) + 4;
     int build_id_len = note->n_descsz;
 
-    return loadSymbolsFromDebug(build_id, build_id_len)
-        || loadSymbolsFromDebuginfodCache(build_id, build_id_len);
+    char cache_path[PATH_MAX];
+    bool use_cache = getSymbolCachePath(cache_path, build_id, build_id_len);
+    if (use_cache && _cc->readSymbolCache(cache_path, base())) {
+        _cc->setDebugSymbols(true);
+        return true;
+    }
+
+    int first = _cc->count();
+    if (!loadSymbolsFromDebug(build_id, build_id_len) && !loadSymbolsFromDebuginfodCache(build_id, build_id_len)) {
+        return false;
+    }
+
+    if (use_cache && !_cc->writeSymbolCache(cache_path, base(), first)) {
+        Log::debug("Could not write symbol cache %s", cache_path);
+    }
+    return true;
+}
+
+// Symbols loaded from a debug file are cached in $ASPROF_SYMBOL_CACHE/abcdef1234.sym,
+// so that the next start does not parse the debug file again
+bool ElfParser::getSymbolCachePath(char* path, const char* build_id, const int build_id_len) {
+    const char* cache_dir = getSymbolCacheDir();
+    if (cache_dir == NULL) {
+        return false;
+    }
+
+    int cache_dir_len = strlen(cache_dir);
+    if (cache_dir_len + build_id_len * 2 + strlen("/.sym") >= PATH_MAX) {
+        Log::warn("Path too long, skipping symbol cache: %s", cache_dir);
+        return false;
+    }
+
+    char* p = path + snprintf(path, PATH_MAX, "%s/", cache_dir);
+    for (int i = 0; i < build_id_len; i++) {
+        p += snprintf(p, 3, "%02hhx", build_id[i]);
+    }
+    strcpy(p, ".sym");
+    return true;
 }
 
 // Look for debuginfo file specified in .gnu_debuglink section
@@ -653,9 +713,60 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
 bool Symbols::_libs_limit_reported = false;
+bool Symbols::_defer_symbols = false;
+volatile bool Symbols::_have_deferred_symbols = false;
 static std::unordered_set<u64> _parsed_inodes;
 
+// Kernel symbols stay the same until reboot, except for modules: loading or unloading one
+// moves its symbols. The cache is therefore keyed by boot id and names with addresses of modules.
+static bool getKernelSymbolCachePath(char* path) {
+    const char* cache_dir = getSymbolCacheDir();
+    if (cache_dir == NULL) {
+        return false;
+    }
+
+    char boot_id[64];
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t len = read(fd, boot_id, sizeof(boot_id) - 1);
+    close(fd);
+    if (len <= 0) {
+        return false;
+    }
+    boot_id[len] = 0;
+    boot_id[strcspn(boot_id, "\n")] = 0;
+
+    // FNV-1a over the first (name) and the last (address) field of every module
+    u64 hash = 0xcbf29ce484222325ULL;
+    FILE* f = fopen("/proc/modules", "r");
+    if (f != NULL) {
+        char line[1024];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            size_t name_len = strcspn(line, " ");
+            const char* addr = strrchr(line, ' ');
+            for (size_t i = 0; i < name_len; i++) {
+                hash = (hash ^ (u8)line[i]) * 0x100000001b3ULL;
+            }
+            for (; addr != NULL && *addr != 0 && *addr != '\n'; addr++) {
+                hash = (hash ^ (u8)*addr) * 0x100000001b3ULL;
+            }
+        }
+        fclose(f);
+    }
+
+    return snprintf(path, PATH_MAX, "%s/kallsyms-%s-%016llx.sym", cache_dir, boot_id, (unsigned long long)hash) < PATH_MAX;
+}
+
 void Symbols::parseKernelSymbols(CodeCache* cc) {
+    char cache_path[PATH_MAX];
+    bool use_cache = getKernelSymbolCachePath(cache_path);
+    if (use_cache && cc->readSymbolCache(cache_path, NULL)) {
+        _have_kernel_symbols = cc->count() > 0;
+        return;
+    }
+
     int fd;
     if (FdTransferClient::hasPeer()) {
         fd = FdTransferClient::requestKallsymsFd();
@@ -698,6 +809,10 @@ void Symbols::parseKernelSymbols(CodeCache* cc) {
     }
 
     fclose(f);
+
+    if (use_cache && _have_kernel_symbols && !cc->writeSymbolCache(cache_path, NULL, 0)) {
+        Log::debug("Could not write symbol cache %s", cache_path);
+    }
 }
 
 static void collectSharedLibraries(std::unordered_map<u64, SharedLibrary>& libs, int max_count) {
@@ -754,8 +869,208 @@ static void collectSharedLibraries(std::unordered_map<u64, SharedLibrary>& libs,
     fclose(f);
 }
 
+static void loadDwarf(CodeCache* cc) {
+    // Protect the library from unloading while parsing; if it is gone already, unwind it without DWARF
+    void* handle = NULL;
+    if (!cc->dwarfPinned() && (handle = dlopen(cc->name(), RTLD_LAZY | RTLD_NOLOAD)) == NULL) {
+        cc->setDwarfTable(NULL, 0);
+        return;
+    }
+
+    DwarfParser dwarf(cc->name(), cc->dwarfBase(), cc->ehFrameHdr());
+    cc->setDwarfTable(dwarf.table(), dwarf.count());
+
+    if (handle != NULL) {
+        dlclose(handle);
+    }
+}
+
+static void* dwarfLoaderEntry(void* arg) {
+    CodeCacheArray* array = (CodeCacheArray*)arg;
+    while (true) {
+        if (sem_wait(&_dwarf_requests) != 0) {
+            continue;  // EINTR
+        }
+        int count = array->count();
+        for (int i = 0; i < count; i++) {
+            if ((*array)[i]->dwarfRequested()) {
+                loadDwarf((*array)[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// The loader thread lives as long as the process and sleeps unless a stack walker requests a table
+static void startDwarfLoader(CodeCacheArray* array) {
+    if (_dwarf_libs != NULL || sem_init(&_dwarf_requests, 0, 0) != 0) {
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dwarfLoaderEntry, array) == 0) {
+        pthread_detach(thread);
+        _dwarf_libs = array;
+    } else {
+        sem_destroy(&_dwarf_requests);
+    }
+}
+
+void Symbols::requestDwarf() {
+    if (_dwarf_libs != NULL) {
+        sem_post(&_dwarf_requests);
+    }
+}
+
+// How long the background updater waits for more dlopens before parsing
+const u64 UPDATE_COALESCE_NANOS = 5000000;
+
+// Number of objects ever loaded by the dynamic linker, as of the last parseLibraries
+static volatile unsigned long long _parsed_adds = 0;
+
+static CodeCacheArray* _update_libs = NULL;
+static void (*_update_callback)() = NULL;
+static volatile int _updater_state = 0;  // 0 - not started, 1 - starting, 2 - running
+static sem_t _update_requests;
+
+// Returns 0 if the dynamic linker does not count loaded objects
+static unsigned long long loadedObjects() {
+    unsigned long long adds = 0;
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t size, void* data) {
+        if (size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds)) {
+            *(unsigned long long*)data = info->dlpi_adds;
+        }
+        return 1;
+    }, &adds);
+    return adds;
+}
+
+bool Symbols::haveNewLibraries() {
+    unsigned long long adds = loadedObjects();
+    return adds == 0 || adds != _parsed_adds;
+}
+
+static void* updaterEntry(void* arg) {
+    while (true) {
+        if (sem_wait(&_update_requests) != 0) {
+            continue;  // EINTR
+        }
+        // Libraries are often loaded in bursts; let the burst finish and drain the requests
+        OS::sleep(UPDATE_COALESCE_NANOS);
+        while (sem_trywait(&_update_requests) == 0) {
+        }
+
+        if (Symbols::haveNewLibraries()) {
+            Symbols::parseLibraries(_update_libs, false);
+            _update_callback();
+        }
+    }
+    return NULL;
+}
+
+void Symbols::parseLibrariesAsync(CodeCacheArray* array, void (*callback)()) {
+    if (_updater_state != 2) {
+        if (!__sync_bool_compare_and_swap(&_updater_state, 0, 1)) {
+            // Another thread is starting the updater, or failed to; parse in place
+            parseLibraries(array, false);
+            callback();
+            return;
+        }
+
+        _update_libs = array;
+        _update_callback = callback;
+        pthread_t thread;
+        if (sem_init(&_update_requests, 0, 0) != 0 || pthread_create(&thread, NULL, updaterEntry, NULL) != 0) {
+            parseLibraries(array, false);
+            callback();
+            return;
+        }
+        pthread_detach(thread);
+        __atomic_store_n(&_updater_state, 2, __ATOMIC_RELEASE);
+    }
+    sem_post(&_update_requests);
+}
+
+const int MAX_PARSER_THREADS = 4;
+
+// A library parsed by one of the parser threads
+struct ParseTask {
+    SharedLibrary* lib;
+    CodeCache* cc;
+    void* handle;        // keeps the library loaded until all tasks are done
+    bool parse_headers;  // in-memory program headers are safe to read
+    bool defer_symbols;  // the file is parsed later by loadDeferredSymbols
+    bool done;
+};
+
+struct ParseQueue {
+    ParseTask* tasks;
+    int count;
+    volatile int next;
+    int published;
+    Mutex publish_lock;
+    CodeCacheArray* array;
+};
+
+static void parseLibrary(ParseTask* task) {
+    SharedLibrary& lib = *task->lib;
+    CodeCache* cc = task->cc;
+
+    if (strchr(lib.file, ':') != NULL) {
+        // Do not try to parse pseudofiles like anon_inode:name, /memfd:name
+    } else if (strcmp(lib.file, "[vdso]") == 0) {
+        ElfParser::parseProgramHeaders(cc, lib.map_start, lib.map_end, true, true);
+    } else if (lib.image_base == NULL) {
+        // Unlikely case when image base has not been found: not safe to access program headers.
+        // Be careful: executable file is not always ELF, e.g. classes.jsa
+        if (task->defer_symbols) {
+            cc->deferSymbols(lib.map_start, lib.file);
+        } else {
+            ElfParser::parseFile(cc, lib.map_start, lib.file, true);
+        }
+    } else {
+        // Parse debug symbols first
+        if (task->defer_symbols) {
+            cc->deferSymbols(lib.image_base, lib.file);
+        } else {
+            ElfParser::parseFile(cc, lib.image_base, lib.file, true);
+        }
+
+        if (task->parse_headers) {
+            ElfParser::parseProgramHeaders(cc, lib.image_base, lib.map_end, OS::isMusl(), task->handle == NULL);
+        }
+    }
+
+    free(lib.file);
+    cc->sort();
+}
+
+static void* parserThreadEntry(void* arg) {
+    ParseQueue* queue = (ParseQueue*)arg;
+    int index;
+    while ((index = __sync_fetch_and_add(&queue->next, 1)) < queue->count) {
+        parseLibrary(&queue->tasks[index]);
+
+        // Libraries are published in order, since their lib_index must match the position in the array
+        MutexLocker ml(queue->publish_lock);
+        queue->tasks[index].done = true;
+        while (queue->published < queue->count && queue->tasks[queue->published].done) {
+            CodeCache* cc = queue->tasks[queue->published++].cc;
+            applyPatch(cc);
+            queue->array->add(cc);
+        }
+    }
+    return NULL;
+}
+
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
     MutexLocker ml(_parse_lock);
+    // Anything loaded from now on is picked up by the next call
+    _parsed_adds = loadedObjects();
+
+    if (DWARF_SUPPORTED) {
+        startDwarfLoader(array);
+    }
 
     if (array->count() >= MAX_NATIVE_LIBS) {
         return;
@@ -781,18 +1096,31 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
         Log::warn("Cannot determine base address of the loader");
     }
 
+    const char* self = (const char*)(void*)parseLibrary;
+
     const void* main_phdr = NULL;
     dl_iterate_phdr([](struct dl_phdr_info* info, size_t size, void* data) {
         *(const void**)data = info->dlpi_phdr;
         return 1;
     }, &main_phdr);
 
+    std::vector<ParseTask> tasks;
     for (auto& it : libs) {
         u64 inode = it.first;
         _parsed_inodes.insert(inode);
 
         SharedLibrary& lib = it.second;
-        CodeCache* cc = new CodeCache(lib.file, array->count(), false, lib.map_start, lib.map_end);
+        ParseTask task;
+        task.lib = &lib;
+        task.cc = new CodeCache(lib.file, array->count() + tasks.size(), false, lib.map_start, lib.map_end);
+        task.handle = NULL;
+        task.parse_headers = false;
+        // The profiler's own symbols mark frames of its hooks at sampling time
+        task.defer_symbols = _defer_symbols && !(self >= lib.map_start && self < lib.map_end);
+        task.done = false;
+        if (task.defer_symbols) {
+            _have_deferred_symbols = true;
+        }
 
         // Strip " (deleted)" suffix so that removed library can be reopened
         size_t len = strlen(lib.file);
@@ -800,43 +1128,56 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
             lib.file[len - 10] = 0;
         }
 
-        if (strchr(lib.file, ':') != NULL) {
-            // Do not try to parse pseudofiles like anon_inode:name, /memfd:name
-        } else if (strcmp(lib.file, "[vdso]") == 0) {
-            ElfParser::parseProgramHeaders(cc, lib.map_start, lib.map_end, true);
-        } else if (lib.image_base == NULL) {
-            // Unlikely case when image base has not been found: not safe to access program headers.
-            // Be careful: executable file is not always ELF, e.g. classes.jsa
-            ElfParser::parseFile(cc, lib.map_start, lib.file, true);
-        } else {
-            // Parse debug symbols first
-            ElfParser::parseFile(cc, lib.image_base, lib.file, true);
-
+        if (lib.image_base != NULL && strchr(lib.file, ':') == NULL && strcmp(lib.file, "[vdso]") != 0) {
             dlerror();  // reset any error from previous dl function calls
 
             // Protect library from unloading while parsing in-memory ELF program headers.
             // Also, dlopen() ensures the library is fully loaded.
             // Main executable and ld-linux interpreter cannot be dlopen'ed, but dlerror() returns NULL for them on some systems.
-            void* handle = dlopen(lib.file, RTLD_LAZY | RTLD_NOLOAD);
+            // Libraries are opened here rather than by parser threads, since dlopen() may be hooked
+            // to update symbols, which would wait for this thread to release _parse_lock.
+            task.handle = dlopen(lib.file, RTLD_LAZY | RTLD_NOLOAD);
 
             // Parse main executable and the loader (ld.so) regardless of dlopen result, since they cannot be unloaded.
             bool is_main_exe = main_phdr >= lib.image_base && main_phdr < lib.map_end;
             bool is_loader = ld_base == lib.image_base;
+            task.parse_headers = task.handle != NULL || is_main_exe || is_loader;
+        }
 
-            if (handle != NULL || is_main_exe || is_loader) {
-                ElfParser::parseProgramHeaders(cc, lib.image_base, lib.map_end, OS::isMusl());
-            }
+        tasks.push_back(task);
+    }
 
-            if (handle != NULL) {
-                dlclose(handle);
-            }
+    if (!tasks.empty()) {
+        ParseQueue queue;
+        queue.tasks = &tasks[0];
+        queue.count = (int)tasks.size();
+        queue.next = 0;
+        queue.published = 0;
+        queue.array = array;
+
+        // Resolve the cache directory once, before parser threads look up debug symbols
+        ElfParser::getDebuginfodCache();
+
+        int thread_count = OS::getCpuCount();
+        if (thread_count > MAX_PARSER_THREADS) thread_count = MAX_PARSER_THREADS;
+        if (thread_count > queue.count) thread_count = queue.count;
+
+        // The current thread is one of the parsers
+        pthread_t threads[MAX_PARSER_THREADS];
+        int started = 0;
+        while (started < thread_count - 1 && pthread_create(&threads[started], NULL, parserThreadEntry, &queue) == 0) {
+            started++;
+        }
+        parserThreadEntry(&queue);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
         }
 
-        free(lib.file);
-
-        cc->sort();
-        applyPatch(cc);
-        array->add(cc);
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (tasks[i].handle != NULL) {
+                dlclose(tasks[i].handle);
+            }
+        }
     }
 
     if (array->count() >= MAX_NATIVE_LIBS && !_libs_limit_reported) {
@@ -845,4 +1186,24 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
     }
 }
 
+void Symbols::loadDeferredSymbols(CodeCacheArray* array) {
+    if (!_have_deferred_symbols) {
+        return;
+    }
+
+    MutexLocker ml(_parse_lock);
+    ElfParser::getDebuginfodCache();
+
+    int count = array->count();
+    for (int i = 0; i < count; i++) {
+        CodeCache* cc = (*array)[i];
+        if (cc->symbolsDeferred()) {
+            ElfParser::parseFile(cc, cc->deferredBase(), cc->deferredFile(), true);
+            cc->sort();
+            cc->clearDeferredSymbols();
+        }
+    }
+    _have_deferred_symbols = false;
+}
+
 #endif // __linux__
@@ -127,11 +127,29 @@ class MachOParser {
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
 bool Symbols::_libs_limit_reported = false;
+bool Symbols::_defer_symbols = false;
+volatile bool Symbols::_have_deferred_symbols = false;
 static std::unordered_set<const void*> _parsed_libraries;
 
 void Symbols::parseKernelSymbols(CodeCache* cc) {
 }
 
+void Symbols::requestDwarf() {
+}
+
+bool Symbols::haveNewLibraries() {
+    return true;
+}
+
+// Mach-O symbols are parsed from memory, which is cheap enough to do right away
+void Symbols::loadDeferredSymbols(CodeCacheArray* array) {
+}
+
+void Symbols::parseLibrariesAsync(CodeCacheArray* array, void (*callback)()) {
+    parseLibraries(array, false);
+    callback();
+}
+
 void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
     MutexLocker ml(_parse_lock);
     uint32_t images = _dyld_image_count();
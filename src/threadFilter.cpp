@@ -11,7 +11,7 @@
 
 ThreadFilter::ThreadFilter() {
     memset(_bitmap, 0, sizeof(_bitmap));
-    _bitmap[0] = (u32*)OS::safeAlloc(BITMAP_SIZE);
+    _bitmap[0] = (ThreadBitmap*)OS::safeAlloc(sizeof(ThreadBitmap));
 
     _enabled = false;
     _size = 0;
@@ -20,7 +20,7 @@ ThreadFilter::ThreadFilter() {
 ThreadFilter::~ThreadFilter() {
     for (int i = 0; i < MAX_BITMAPS; i++) {
         if (_bitmap[i] != NULL) {
-            OS::safeFree(_bitmap[i], BITMAP_SIZE);
+            OS::safeFree(_bitmap[i], sizeof(ThreadBitmap));
         }
     }
 }
@@ -53,10 +53,21 @@ void ThreadFilter::init(const char* filter) {
     _enabled = true;
 }
 
+// Only words marked in the summary may have bits set, so a sparse bitmap is cleared quickly
 void ThreadFilter::clear() {
     for (int i = 0; i < MAX_BITMAPS; i++) {
-        if (_bitmap[i] != NULL) {
-            memset(_bitmap[i], 0, BITMAP_SIZE);
+        ThreadBitmap* b = _bitmap[i];
+        if (b != NULL && b->size != 0) {
+            for (u32 j = 0; j < SUMMARY_WORDS; j++) {
+                u32 summary = b->summary[j];
+                while (summary != 0) {
+                    u32 bit = __builtin_ctz(summary);
+                    b->words[j * 32 + bit] = 0;
+                    summary &= summary - 1;
+                }
+                b->summary[j] = 0;
+            }
+            b->size = 0;
         }
     }
     _size = 0;
@@ -66,59 +77,84 @@ size_t ThreadFilter::usedMemory() {
     size_t bytes = 0;
     for (int i = 0; i < MAX_BITMAPS; i++) {
         if (_bitmap[i] != NULL) {
-            bytes += BITMAP_SIZE;
+            bytes += sizeof(ThreadBitmap);
         }
     }
     return bytes;
 }
 
 bool ThreadFilter::accept(int thread_id) {
-    u32* b = bitmap(thread_id);
-    return b != NULL && (word(b, thread_id) & (1 << (thread_id & 0x1f)));
+    ThreadBitmap* b = bitmap(thread_id);
+    return b != NULL && (b->words[wordIndex(thread_id)] & (1 << (thread_id & 0x1f)));
 }
 
 void ThreadFilter::add(int thread_id) {
-    u32* b = bitmap(thread_id);
+    ThreadBitmap* b = bitmap(thread_id);
     if (b == NULL) {
-        b = (u32*)OS::safeAlloc(BITMAP_SIZE);
-        u32* oldb = __sync_val_compare_and_swap(&_bitmap[(u32)thread_id / BITMAP_CAPACITY], NULL, b);
+        b = (ThreadBitmap*)OS::safeAlloc(sizeof(ThreadBitmap));
+        ThreadBitmap* oldb = __sync_val_compare_and_swap(&_bitmap[(u32)thread_id / BITMAP_CAPACITY], NULL, b);
         if (oldb != NULL) {
-            OS::safeFree(b, BITMAP_SIZE);
+            OS::safeFree(b, sizeof(ThreadBitmap));
             b = oldb;
         }
     }
 
+    u32 index = wordIndex(thread_id);
     u32 bit = 1 << (thread_id & 0x1f);
-    if (!(__sync_fetch_and_or(&word(b, thread_id), bit) & bit)) {
+    if (!(__sync_fetch_and_or(&b->words[index], bit) & bit)) {
+        // The summary bit is set after the word, see collect()
+        u32 summary_bit = 1 << (index & 0x1f);
+        if (!(b->summary[index >> 5] & summary_bit)) {
+            __sync_fetch_and_or(&b->summary[index >> 5], summary_bit);
+        }
+        atomicInc(b->size);
         atomicInc(_size);
     }
 }
 
 void ThreadFilter::remove(int thread_id) {
-    u32* b = bitmap(thread_id);
+    ThreadBitmap* b = bitmap(thread_id);
     if (b == NULL) {
         return;
     }
 
+    // The summary bit is left as is: clearing it here would race with add()
     u32 bit = 1 << (thread_id & 0x1f);
-    if (__sync_fetch_and_and(&word(b, thread_id), ~bit) & bit) {
+    if (__sync_fetch_and_and(&b->words[wordIndex(thread_id)], ~bit) & bit) {
+        atomicInc(b->size, -1);
         atomicInc(_size, -1);
     }
 }
 
+// Visits only bitmaps with threads in them and only non-zero words of those
 void ThreadFilter::collect(std::vector<int>& v) {
     for (int i = 0; i < MAX_BITMAPS; i++) {
-        u32* b = _bitmap[i];
-        if (b != NULL) {
-            int start_id = i * BITMAP_CAPACITY;
-            for (int j = 0; j < BITMAP_SIZE / sizeof(u32); j++) {
-                u32 word = b[j];
-                if (word) {
-                    for (int bit = 0; bit < 32; bit++) {
-                        if (word & (1 << bit)) {
-                            v.push_back(start_id + j * 32 + bit);
-                        }
+        ThreadBitmap* b = _bitmap[i];
+        if (b == NULL || b->size == 0) {
+            continue;
+        }
+
+        int start_id = i * BITMAP_CAPACITY;
+        for (u32 j = 0; j < SUMMARY_WORDS; j++) {
+            u32 summary = b->summary[j];
+            while (summary != 0) {
+                u32 index = j * 32 + __builtin_ctz(summary);
+                summary &= summary - 1;
+
+                u32 word = b->words[index];
+                if (word == 0) {
+                    // Drop the stale summary bit; restore it if a thread was added meanwhile
+                    u32 summary_bit = 1 << (index & 0x1f);
+                    __sync_fetch_and_and(&b->summary[j], ~summary_bit);
+                    if ((word = b->words[index]) == 0) {
+                        continue;
                     }
+                    __sync_fetch_and_or(&b->summary[j], summary_bit);
+                }
+
+                while (word != 0) {
+                    v.push_back(start_id + index * 32 + __builtin_ctz(word));
+                    word &= word - 1;
                 }
             }
         }
@@ -17,21 +17,34 @@ const u32 BITMAP_CAPACITY = BITMAP_SIZE * 8;
 // Total number of bitmaps required to hold the entire range of thread IDs
 const u32 MAX_BITMAPS = (1 << 31) / BITMAP_CAPACITY;
 
+const u32 BITMAP_WORDS = BITMAP_SIZE / sizeof(u32);
+const u32 SUMMARY_WORDS = BITMAP_WORDS / 32;
+
+
+// Bits of thread IDs, plus a summary with one bit per non-zero word of the bitmap,
+// so that iterating a sparse bitmap touches only words with threads in them.
+// A summary bit may be set for a word that has become empty, but never the opposite.
+struct ThreadBitmap {
+    u32 words[BITMAP_WORDS];
+    u32 summary[SUMMARY_WORDS];
+    volatile int size;
+};
+
 
 // ThreadFilter query operations must be lock-free and signal-safe;
 // update operations are mostly lock-free, except rare bitmap allocations
 class ThreadFilter {
   private:
-    u32* _bitmap[MAX_BITMAPS];
+    ThreadBitmap* _bitmap[MAX_BITMAPS];
     bool _enabled;
     volatile int _size;
 
-    u32* bitmap(int thread_id) {
+    ThreadBitmap* bitmap(int thread_id) {
         return _bitmap[(u32)thread_id / BITMAP_CAPACITY];
     }
 
-    u32& word(u32* bitmap, int thread_id) {
-        return bitmap[((u32)thread_id % BITMAP_CAPACITY) >> 5];
+    static u32 wordIndex(int thread_id) {
+        return ((u32)thread_id % BITMAP_CAPACITY) >> 5;
     }
 
   public:
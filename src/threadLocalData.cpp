@@ -18,21 +18,29 @@ static pthread_key_t init_profiler_data_key() {
 
 // A key that points to a malloc'd asprof_thread_local_data
 pthread_key_t ThreadLocalData::_profiler_data_key = init_profiler_data_key();
+// Set once any thread has allocated its data, so that sampling need not look it up before
+volatile bool ThreadLocalData::_initialized = false;
 
 // Initialize the *thread-local* profiler data key. The global data key (_profiler_data_key)
 // should be initialized beforehand.
 asprof_thread_local_data* ThreadLocalData::initThreadLocalData(pthread_key_t profiler_data_key) {
     // Initialize. Since this is a thread-local, it is not racy.
-    asprof_thread_local_data* val = (asprof_thread_local_data*) malloc(sizeof(asprof_thread_local_data));
-    if (val == NULL) {
+    ThreadLocalState* state = (ThreadLocalState*) malloc(sizeof(ThreadLocalState));
+    if (state == NULL) {
         // would rather not insert random aborts into code. This
         // will make the code try again next time, which is fine.
         return NULL;
     }
-    val->sample_counter = 0;
-    if (pthread_setspecific(profiler_data_key, (void*)val) < 0) {
-        free((void*)val);
+    state->data.sample_counter = 0;
+    state->data.sampling_priority = ASPROF_PRIORITY_NORMAL;
+    state->data.span_id = 0;
+    state->data.trace_id = 0;
+    state->data.context_tag = 0;
+    state->skipped_samples = 0;
+    if (pthread_setspecific(profiler_data_key, (void*)state) < 0) {
+        free((void*)state);
         return NULL;
     }
-    return val;
+    _initialized = true;
+    return &state->data;
 }
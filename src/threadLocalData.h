@@ -7,8 +7,15 @@
 #define _ASPROF_THREAD_LOCAL_H
 
 #include "asprof.h"
+#include "event.h"
 #include <pthread.h>
 
+// Thread-local data as allocated by the profiler: the public part with private state after it
+struct ThreadLocalState {
+    asprof_thread_local_data data;
+    uint32_t skipped_samples;
+};
+
 class ThreadLocalData {
   public:
     // Increment the thread-local sample counter. See the `asprof_thread_local_data` docs.
@@ -25,6 +32,35 @@ class ThreadLocalData {
         }
     }
 
+    // Returns the data of the current thread only if it already exists. Async-signal safe.
+    // Until some thread has asked for its thread-local data, this is a single load of a global flag.
+    static ThreadLocalState* current() {
+        if (!_initialized) return NULL;
+        return (ThreadLocalState*) pthread_getspecific(_profiler_data_key);
+    }
+
+    // Decides whether a signal-driven sample of the thread should be recorded,
+    // according to its `sampling_priority`. Async-signal safe.
+    static bool acceptSample(ThreadLocalState* state) {
+        int32_t priority = state->data.sampling_priority;
+        if (priority >= 0) {
+            return true;
+        } else if (priority < -31) {
+            return false;
+        }
+        return (state->skipped_samples++ & ((1U << -priority) - 1)) == 0;
+    }
+
+    // Copies the tracing context of the thread, if there is one. Async-signal safe.
+    static void getContext(ThreadLocalState* state, SampleContext& context) {
+        u64 span_id = state->data.span_id;
+        if (span_id != 0) {
+            context.trace_id = state->data.trace_id;
+            context.tag = state->data.context_tag;
+            context.span_id = span_id;
+        }
+    }
+
     // Get the `asprof_thread_local_data`. See the `asprof_get_thread_local_data` docs.
     static asprof_thread_local_data* getThreadLocalData(void)  {
         if (_profiler_data_key == -1) {
@@ -42,6 +78,7 @@ class ThreadLocalData {
   private:
     static asprof_thread_local_data* initThreadLocalData(pthread_key_t profiler_data_key);
     static pthread_key_t _profiler_data_key;
+    static volatile bool _initialized;
 };
 
 #endif // _ASPROF_THREAD_LOCAL_H
@@ -0,0 +1,179 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "threadNames.h"
+#include "os.h"
+
+
+const size_t THREAD_NAMES_CHUNK = 65536;
+const u32 INITIAL_INTERNED_CAPACITY = 1024;
+
+// Marks a thread whose name could not be found, so that the OS is not asked again
+static const char UNKNOWN_THREAD_NAME[] = "";
+
+
+ThreadNames::ThreadNames() : _arena(THREAD_NAMES_CHUNK), _interned_capacity(INITIAL_INTERNED_CAPACITY), _interned_size(0) {
+    memset(_pages, 0, sizeof(_pages));
+    _interned = (const char**)calloc(_interned_capacity, sizeof(const char*));
+}
+
+ThreadNames::~ThreadNames() {
+    for (int i = 0; i < THREAD_NAMES_MAX_PAGES; i++) {
+        free(_pages[i]);
+    }
+    free(_interned);
+}
+
+ThreadNames::Entry* ThreadNames::entry(int thread_id, bool create) {
+    u32 page = (u32)thread_id / THREAD_NAMES_PAGE_SIZE;
+    if (page >= (u32)THREAD_NAMES_MAX_PAGES) {
+        return NULL;
+    }
+
+    if (_pages[page] == NULL) {
+        if (!create || (_pages[page] = (Entry*)calloc(THREAD_NAMES_PAGE_SIZE, sizeof(Entry))) == NULL) {
+            return NULL;
+        }
+    }
+    return &_pages[page][(u32)thread_id % THREAD_NAMES_PAGE_SIZE];
+}
+
+static u32 hashName(const char* name) {
+    u32 h = 2166136261U;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619U;
+    }
+    return h;
+}
+
+const char* ThreadNames::intern(const char* name) {
+    if (name[0] == 0) {
+        return UNKNOWN_THREAD_NAME;
+    }
+
+    // Keep load factor under 3/4
+    if ((_interned_size + 1) * 4 > _interned_capacity * 3) {
+        u32 capacity = _interned_capacity * 2;
+        const char** interned = (const char**)calloc(capacity, sizeof(const char*));
+        if (interned == NULL) {
+            return NULL;
+        }
+        for (u32 i = 0; i < _interned_capacity; i++) {
+            if (_interned[i] != NULL) {
+                u32 slot = hashName(_interned[i]) & (capacity - 1);
+                while (interned[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+                interned[slot] = _interned[i];
+            }
+        }
+        free(_interned);
+        _interned = interned;
+        _interned_capacity = capacity;
+    }
+
+    u32 mask = _interned_capacity - 1;
+    u32 slot = hashName(name) & mask;
+    while (_interned[slot] != NULL) {
+        if (strcmp(_interned[slot], name) == 0) {
+            return _interned[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    size_t size = strlen(name) + 1;
+    char* copy = (char*)_arena.alloc(size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, name, size);
+    _interned_size++;
+    return _interned[slot] = copy;
+}
+
+void ThreadNames::assign(Entry* e, const char* name, jlong java_thread_id) {
+    const char* interned = intern(name);
+    if (interned != NULL) {
+        e->name = interned;
+    }
+    e->java_thread_id = java_thread_id;
+}
+
+void ThreadNames::clear() {
+    MutexLocker ml(_lock);
+
+    for (int i = 0; i < THREAD_NAMES_MAX_PAGES; i++) {
+        if (_pages[i] != NULL) {
+            memset(_pages[i], 0, THREAD_NAMES_PAGE_SIZE * sizeof(Entry));
+        }
+    }
+
+    memset(_interned, 0, _interned_capacity * sizeof(const char*));
+    _interned_size = 0;
+    _arena.clear();
+}
+
+void ThreadNames::set(int thread_id, const char* name, jlong java_thread_id) {
+    MutexLocker ml(_lock);
+
+    Entry* e = entry(thread_id, true);
+    if (e != NULL) {
+        assign(e, name, java_thread_id);
+    }
+}
+
+void ThreadNames::setGroup(int thread_id, u32 group) {
+    MutexLocker ml(_lock);
+
+    Entry* e = entry(thread_id, true);
+    if (e != NULL) {
+        e->group = group;
+    }
+}
+
+u32 ThreadNames::group(int thread_id) {
+    Entry* e = entry(thread_id, false);
+    return e != NULL ? e->group : 0;
+}
+
+void ThreadNames::groupName(const char* name, char* buf, size_t size) {
+    size_t len = strlen(name);
+    size_t end = len;
+    while (end > 0 && name[end - 1] >= '0' && name[end - 1] <= '9') {
+        end--;
+    }
+
+    // A name that is all digits stays as is
+    if (end == len || end == 0) {
+        snprintf(buf, size, "%s", name);
+    } else {
+        snprintf(buf, size, "%.*s*", (int)end, name);
+    }
+}
+
+const char* ThreadNames::get(int thread_id, jlong* java_thread_id) {
+    MutexLocker ml(_lock);
+
+    Entry* e = entry(thread_id, true);
+    if (e == NULL) {
+        return NULL;
+    }
+
+    if (e->name == NULL) {
+        char name_buf[64];
+        assign(e, OS::threadName(thread_id, name_buf, sizeof(name_buf)) ? name_buf : "", 0);
+        if (e->name == NULL) {
+            return NULL;
+        }
+    }
+
+    if (e->name[0] == 0) {
+        return NULL;
+    }
+
+    *java_thread_id = e->java_thread_id;
+    return e->name;
+}
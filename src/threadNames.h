@@ -0,0 +1,65 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _THREADNAMES_H
+#define _THREADNAMES_H
+
+#include <jni.h>
+#include "arch.h"
+#include "linearAllocator.h"
+#include "mutex.h"
+
+
+// Thread IDs are split into pages of this many entries, allocated on demand
+const int THREAD_NAMES_PAGE_SIZE = 4096;
+// Covers the entire range of Linux thread IDs (pid_max is at most 4M) with a good margin
+const int THREAD_NAMES_MAX_PAGES = 16384;
+
+
+// Names and Java IDs of threads, indexed by native thread ID.
+// Java threads are registered by ThreadStart/ThreadEnd events as they come;
+// other threads get their name from the OS on the first lookup.
+// Names are interned in an arena: threads sharing a name or renamed back and forth
+// cost no allocation, and a returned name stays valid until clear().
+class ThreadNames {
+  private:
+    struct Entry {
+        const char* name;
+        jlong java_thread_id;
+        u32 group;
+    };
+
+    Mutex _lock;
+    Entry* _pages[THREAD_NAMES_MAX_PAGES];
+    LinearAllocator _arena;
+    const char** _interned;
+    u32 _interned_capacity;
+    u32 _interned_size;
+
+    Entry* entry(int thread_id, bool create);
+    const char* intern(const char* name);
+    void assign(Entry* e, const char* name, jlong java_thread_id);
+
+  public:
+    ThreadNames();
+    ~ThreadNames();
+
+    void clear();
+
+    void set(int thread_id, const char* name, jlong java_thread_id);
+
+    // Returns NULL if the thread has no known name; java_thread_id is 0 for non-Java threads
+    const char* get(int thread_id, jlong* java_thread_id);
+
+    void setGroup(int thread_id, u32 group);
+
+    // Lock-free and async signal safe; 0 if the thread has no group
+    u32 group(int thread_id);
+
+    // Threads of a pool differ only in a trailing number: "pool-1-thread-17" becomes "pool-1-thread-*"
+    static void groupName(const char* name, char* buf, size_t size);
+};
+
+#endif // _THREADNAMES_H
@@ -0,0 +1,44 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include "threadRegistry.h"
+#include "os.h"
+
+
+ThreadFilter ThreadRegistry::_threads;
+volatile bool ThreadRegistry::_enabled = false;
+volatile u64 ThreadRegistry::_next_rescan = 0;
+
+
+void ThreadRegistry::enable() {
+    _threads.clear();
+    _next_rescan = 0;
+    _enabled = true;
+}
+
+void ThreadRegistry::disable() {
+    _enabled = false;
+}
+
+bool ThreadRegistry::claimRescan() {
+    u64 now = OS::nanotime();
+    u64 next = _next_rescan;
+    return now >= next && __sync_bool_compare_and_swap(&_next_rescan, next, now + THREAD_RESCAN_INTERVAL);
+}
+
+void ThreadRegistry::rescan(const std::vector<int>& known, int* threads, u32 count) {
+    std::sort(threads, threads + count);
+    for (u32 i = 0; i < count; i++) {
+        _threads.add(threads[i]);
+    }
+
+    // A thread started after the list was taken is not among the known ones, so it stays
+    for (size_t i = 0; i < known.size(); i++) {
+        if (!std::binary_search(threads, threads + count, known[i])) {
+            _threads.remove(known[i]);
+        }
+    }
+}
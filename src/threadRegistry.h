@@ -0,0 +1,59 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _THREADREGISTRY_H
+#define _THREADREGISTRY_H
+
+#include <vector>
+#include "arch.h"
+#include "threadFilter.h"
+
+
+// Threads started some other way are found by rescanning the OS thread list this often
+const u64 THREAD_RESCAN_INTERVAL = 1000000000ULL;
+
+// Live threads of the process, maintained from pthread hooks and JVM TI thread events,
+// so that samplers do not list /proc/self/task every cycle. Threads the hooks do not see,
+// e.g. the ones started before the profiler was loaded, come from a periodic rescan.
+class ThreadRegistry {
+  private:
+    static ThreadFilter _threads;
+    static volatile bool _enabled;
+    static volatile u64 _next_rescan;
+
+  public:
+    static bool enabled() {
+        return _enabled;
+    }
+
+    // Starts with an empty registry; the first claimRescan() succeeds immediately
+    static void enable();
+    static void disable();
+
+    static void onThreadStart(int thread_id) {
+        if (_enabled) {
+            _threads.add(thread_id);
+        }
+    }
+
+    static void onThreadEnd(int thread_id) {
+        if (_enabled) {
+            _threads.remove(thread_id);
+        }
+    }
+
+    static void collect(std::vector<int>& threads) {
+        _threads.collect(threads);
+    }
+
+    // Only one of the concurrent callers is allowed to rescan per interval
+    static bool claimRescan();
+
+    // Merges a fresh OS thread list. Threads that were known before the list was taken
+    // and are missing in it have exited unnoticed. Reorders the list.
+    static void rescan(const std::vector<int>& known, int* threads, u32 count);
+};
+
+#endif // _THREADREGISTRY_H
@@ -0,0 +1,169 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _TRACECLASSIFIER_H
+#define _TRACECLASSIFIER_H
+
+#include <string.h>
+#include "arch.h"
+#include "vmEntry.h"
+
+
+// Stack trace categories written to JFR as Category ordinal + 1 of the converter's Classifier
+enum TraceCategory {
+    CATEGORY_NONE,
+    CATEGORY_GC,
+    CATEGORY_JIT,
+    CATEGORY_VM,
+    CATEGORY_VTABLE_STUBS,
+    CATEGORY_NATIVE,
+    CATEGORY_INTERPRETER,
+    CATEGORY_C1_COMP,
+    CATEGORY_C2_COMP,
+    CATEGORY_ADAPTER,
+    CATEGORY_CLASS_INIT,
+    CATEGORY_CLASS_LOAD,
+    CATEGORY_CLASS_RESOLVE,
+    CATEGORY_CLASS_VERIFY,
+    CATEGORY_LAMBDA_INIT
+};
+
+// What a single method means for classification. Computed once per method by name,
+// so that classifying a stack trace only looks at frame types and hints.
+enum MethodHint {
+    HINT_NONE,
+    HINT_JIT_THREAD,     // root of a compiler thread
+    HINT_GC_THREAD,      // root of a GC worker
+    HINT_VM_THREAD,      // root of any other VM thread
+    HINT_CLASS_VERIFY,
+    HINT_CLASS_INIT,
+    HINT_CLASS_RESOLVE,
+    HINT_CLASS_LOAD,
+    HINT_LAMBDA_INIT,
+    HINT_VTABLE_STUB,
+    HINT_INTERPRETER,
+    HINT_ADAPTER,
+    HINT_VM_ENTRY,       // JVM_, Unsafe_, jni_ functions and VM stubs
+    HINT_PASS_THROUGH,   // native frame that does not leave Java, e.g. arraycopy
+    HINT_C1_RUNTIME
+};
+
+class TraceClassifier {
+  private:
+    static bool startsWith(const char* s, const char* prefix) {
+        return strncmp(s, prefix, strlen(prefix)) == 0;
+    }
+
+    static bool endsWith(const char* s, const char* suffix) {
+        size_t len = strlen(s);
+        size_t suffix_len = strlen(suffix);
+        return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+    }
+
+    static bool isClassLoading(u8 hint) {
+        return hint >= HINT_CLASS_VERIFY && hint <= HINT_ADAPTER;
+    }
+
+  public:
+    // Hint of a native or C++ function by its demangled name
+    static u8 nativeHint(const char* name, FrameTypeId type) {
+        if (type == FRAME_CPP) {
+            if (strcmp(name, "CompileBroker::compiler_thread_loop") == 0) return HINT_JIT_THREAD;
+            if (strcmp(name, "GCTaskThread::run") == 0 || strcmp(name, "WorkerThread::run") == 0) return HINT_GC_THREAD;
+            if (strcmp(name, "java_start") == 0 || strcmp(name, "thread_native_entry") == 0) return HINT_VM_THREAD;
+        }
+
+        if (strcmp(name, "Verifier::verify") == 0) return HINT_CLASS_VERIFY;
+        if (startsWith(name, "InstanceKlass::initialize")) return HINT_CLASS_INIT;
+        if (startsWith(name, "LinkResolver::") || startsWith(name, "InterpreterRuntime::resolve") ||
+            startsWith(name, "SystemDictionary::resolve")) return HINT_CLASS_RESOLVE;
+        if (endsWith(name, "table stub")) return HINT_VTABLE_STUB;
+        if (strcmp(name, "Interpreter") == 0) return HINT_INTERPRETER;
+        if (startsWith(name, "I2C/C2I")) return HINT_ADAPTER;
+
+        if (type == FRAME_NATIVE) {
+            if (startsWith(name, "JVM_") || startsWith(name, "Unsafe_") || startsWith(name, "MHN_") ||
+                startsWith(name, "jni_") || strcmp(name, "call_stub") == 0 || strcmp(name, "deoptimization") == 0 ||
+                strcmp(name, "unknown_Java") == 0 || strcmp(name, "not_walkable_Java") == 0 ||
+                strcmp(name, "InlineCacheBuffer") == 0) return HINT_VM_ENTRY;
+            if (endsWith(name, "_arraycopy") || strstr(name, "pthread_cond") != NULL) return HINT_PASS_THROUGH;
+        } else if (type == FRAME_CPP && startsWith(name, "Runtime1::")) {
+            return HINT_C1_RUNTIME;
+        }
+        return HINT_NONE;
+    }
+
+    // Hint of a Java method by its class name in the internal form and the method name
+    static u8 javaHint(const char* class_name, const char* method_name) {
+        if (endsWith(class_name, "ClassLoader") && strcmp(method_name, "loadClass") == 0) {
+            return HINT_CLASS_LOAD;
+        }
+        if (endsWith(class_name, "LambdaMetafactory") &&
+            (strcmp(method_name, "metafactory") == 0 || strcmp(method_name, "altMetafactory") == 0)) {
+            return HINT_LAMBDA_INIT;
+        }
+        return HINT_NONE;
+    }
+
+    // Frames go from the top of the stack to the root, as in JFR. Same rules as Classifier.getCategory().
+    static u8 classify(int num_frames, const u8* hints, const u8* types) {
+        // GC, JIT and other VM threads are recognized by the root frames
+        bool vm_thread = false;
+        for (int i = num_frames; --i >= 0; ) {
+            if (types[i] == FRAME_CPP) {
+                if (hints[i] == HINT_JIT_THREAD) return CATEGORY_JIT;
+                if (hints[i] == HINT_GC_THREAD) return CATEGORY_GC;
+                if (hints[i] == HINT_VM_THREAD) vm_thread = true;
+            } else if (types[i] != FRAME_NATIVE) {
+                break;
+            }
+        }
+        if (vm_thread) {
+            return CATEGORY_VM;
+        }
+
+        for (int i = 0; i < num_frames; i++) {
+            u8 hint = hints[i];
+            if (!isClassLoading(hint)) continue;
+
+            switch (hint) {
+                case HINT_CLASS_VERIFY:  return CATEGORY_CLASS_VERIFY;
+                case HINT_CLASS_INIT:    return CATEGORY_CLASS_INIT;
+                case HINT_CLASS_RESOLVE: return CATEGORY_CLASS_RESOLVE;
+                case HINT_CLASS_LOAD:    return CATEGORY_CLASS_LOAD;
+                case HINT_LAMBDA_INIT:   return CATEGORY_LAMBDA_INIT;
+                case HINT_VTABLE_STUB:   return CATEGORY_VTABLE_STUBS;
+                case HINT_INTERPRETER:   return CATEGORY_INTERPRETER;
+                default:
+                    return i + 1 < num_frames && types[i + 1] == FRAME_INTERPRETED ? CATEGORY_INTERPRETER : CATEGORY_ADAPTER;
+            }
+        }
+
+        bool in_java = true;
+        for (int i = 0; i < num_frames; i++) {
+            switch (types[i]) {
+                case FRAME_INTERPRETED:
+                    return in_java ? CATEGORY_INTERPRETER : CATEGORY_NATIVE;
+                case FRAME_JIT_COMPILED:
+                    return in_java ? CATEGORY_C2_COMP : CATEGORY_NATIVE;
+                case FRAME_INLINED:
+                    in_java = true;
+                    break;
+                case FRAME_NATIVE:
+                    if (hints[i] == HINT_VM_ENTRY) return CATEGORY_VM;
+                    if (hints[i] != HINT_PASS_THROUGH) in_java = false;
+                    break;
+                case FRAME_CPP:
+                    if (hints[i] == HINT_C1_RUNTIME) return CATEGORY_C1_COMP;
+                    break;
+                case FRAME_C1_COMPILED:
+                    return in_java ? CATEGORY_C1_COMP : CATEGORY_NATIVE;
+            }
+        }
+        return CATEGORY_NATIVE;
+    }
+};
+
+#endif // _TRACECLASSIFIER_H
@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <string.h>
 #include <sys/mman.h>
 #include "trap.h"
 #include "os.h"
@@ -45,6 +46,42 @@ void Trap::pair(Trap& second) {
     }
 }
 
+bool Trap::prepareJump(const void* target) {
+#ifdef __x86_64__
+    intptr_t offset = (intptr_t)target - (intptr_t)(_entry + JUMP_SIZE);
+    if (_entry == 0 || offset != (int32_t)offset || (_entry & -OS::page_size) != ((_entry + JUMP_SIZE - 1) & -OS::page_size)) {
+        return false;
+    }
+
+    int32_t rel32 = (int32_t)offset;
+    _jump_code[0] = 0xe9;
+    memcpy(_jump_code + 1, &rel32, sizeof(rel32));
+    memcpy(_saved_code, (const void*)_entry, JUMP_SIZE);
+    _has_jump = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Patch bytes [from, to) of the code at the entry point
+bool Trap::patch(const unsigned char* code, int from, int to) {
+    if (_unprotect) {
+        int prot = WX_MEMORY ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_WRITE | PROT_EXEC);
+        if (mprotect((void*)(_entry & -OS::page_size), OS::page_size, prot) != 0) {
+            return false;
+        }
+    }
+
+    memcpy((unsigned char*)_entry + from, code + from, to - from);
+    __builtin___clear_cache((char*)_entry + from, (char*)_entry + to);
+
+    if (_protect) {
+        mprotect((void*)(_entry & -OS::page_size), OS::page_size, PROT_READ | PROT_EXEC);
+    }
+    return true;
+}
+
 // Patch instruction at the entry point
 bool Trap::patch(instruction_t insn) {
     if (_unprotect) {
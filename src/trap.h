@@ -12,6 +12,9 @@
 
 const int TRAP_COUNT = 4;
 
+// Size of "jmp rel32" written over a function entry on x86-64
+const int JUMP_SIZE = 5;
+
 
 class Trap {
   private:
@@ -21,13 +24,18 @@ class Trap {
     uintptr_t _entry;
     instruction_t _breakpoint_insn;
     instruction_t _saved_insn;
+    bool _has_jump;
+    unsigned char _jump_code[JUMP_SIZE];
+    unsigned char _saved_code[JUMP_SIZE];
 
     bool patch(instruction_t insn);
+    bool patch(const unsigned char* code, int from, int to);
 
     static uintptr_t _page_start[TRAP_COUNT];
 
   public:
-    Trap(int id) : _id(id), _unprotect(true), _protect(WX_MEMORY), _entry(0), _breakpoint_insn(BREAKPOINT) {
+    Trap(int id) : _id(id), _unprotect(true), _protect(WX_MEMORY), _entry(0), _breakpoint_insn(BREAKPOINT),
+                   _has_jump(false) {
     }
 
     uintptr_t entry() {
@@ -50,6 +58,25 @@ class Trap {
         return _entry == 0 || patch(_saved_insn);
     }
 
+    // A jump to the target replaces the function the same way as the breakpoint does,
+    // but without a signal. Supported on x86-64 if the target is within reach of rel32.
+    bool prepareJump(const void* target);
+
+    bool hasJump() const {
+        return _has_jump;
+    }
+
+    // The jump is written while the breakpoint is installed: first the bytes after the breakpoint,
+    // then the opcode over it. Removal goes in reverse, starting with install() over the jump.
+    // Between the breakpoint and the tail, threads must be given time to leave the first bytes.
+    bool patchJumpTail(bool jump) {
+        return patch(jump ? _jump_code : _saved_code, 1, JUMP_SIZE);
+    }
+
+    bool patchJumpHead() {
+        return patch(_jump_code, 0, 1);
+    }
+
     static bool isFaultInstruction(uintptr_t pc);
 };
 
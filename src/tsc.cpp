@@ -14,6 +14,38 @@ bool TSC::_enabled = false;
 u64 TSC::_offset = 0;
 u64 TSC::_frequency = NANOTIME_FREQ;
 
+bool TSC::_calibrated = false;
+u64 TSC::_counter_frequency = 0;
+u64 TSC::_base_ticks = 0;
+u64 TSC::_base_nanos = 0;
+double TSC::_nanos_per_tick = 1.0;
+
+void TSC::calibrate() {
+    if (!TSC_SUPPORTED || _calibrated || !cpuHasGoodTimestampCounter()) {
+        return;
+    }
+
+    u64 frequency = counterFrequency();
+    if (frequency == 0) {
+        // Measure against the monotonic clock; 10 ms keeps the error well below 0.1%
+        u64 ticks0 = rdtsc();
+        u64 nanos0 = OS::nanotime();
+        OS::sleep(10000000);
+        u64 ticks1 = rdtsc();
+        u64 nanos1 = OS::nanotime();
+        if (ticks1 <= ticks0 || nanos1 <= nanos0) {
+            return;
+        }
+        frequency = (ticks1 - ticks0) * NANOTIME_FREQ / (nanos1 - nanos0);
+    }
+
+    _counter_frequency = frequency;
+    _nanos_per_tick = (double)NANOTIME_FREQ / frequency;
+    _base_ticks = rdtsc();
+    _base_nanos = OS::nanotime();
+    _calibrated = true;
+}
+
 void TSC::enable(Clock clock) {
     if (!TSC_SUPPORTED || clock == CLK_MONOTONIC) {
         _enabled = false;
@@ -42,9 +74,13 @@ void TSC::enable(Clock clock) {
             }
 
             env->ExceptionClear();
-        } else if (cpuHasGoodTimestampCounter()) {
-            _offset = 0;
-            _available = true;
+        } else {
+            calibrate();
+            if (_calibrated) {
+                _offset = 0;
+                _frequency = _counter_frequency;
+                _available = true;
+            }
         }
 
         _initialized = true;
@@ -48,6 +48,11 @@ static bool cpuHasGoodTimestampCounter() {
     return (edx & (1 << 8)) != 0;
 }
 
+// TSC rate is not reported architecturally; it has to be measured
+static inline u64 counterFrequency() {
+    return 0;
+}
+
 #elif defined(__aarch64__)
 
 #define TSC_SUPPORTED true
@@ -63,6 +68,12 @@ static bool cpuHasGoodTimestampCounter() {
     return true;
 }
 
+static inline u64 counterFrequency() {
+    u64 value;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(value));
+    return value;
+}
+
 #else
 
 #define TSC_SUPPORTED false
@@ -72,6 +83,10 @@ static bool cpuHasGoodTimestampCounter() {
     return false;
 }
 
+static inline u64 counterFrequency() {
+    return 0;
+}
+
 #endif
 
 
@@ -83,7 +98,17 @@ class TSC {
     static u64 _offset;
     static u64 _frequency;
 
+    static bool _calibrated;
+    static u64 _counter_frequency;
+    static u64 _base_ticks;
+    static u64 _base_nanos;
+    static double _nanos_per_tick;
+
   public:
+    // Determines the counter rate once per process, so that nanos() can avoid
+    // a system call even when no JVM is around to report the frequency
+    static void calibrate();
+
     static void enable(Clock clock);
 
     static bool enabled() {
@@ -95,11 +120,20 @@ class TSC {
     }
 
     // Frequency is only used for Java lock profiling. When using the TSC with
-    // no JVM, since there is no calibration, this function will return
-    // an incorrect value.
+    // no JVM, it is the rate measured by calibrate().
     static u64 frequency() {
         return enabled() ? _frequency : NANOTIME_FREQ;
     }
+
+    // Monotonic nanoseconds for measuring intervals on the sampling path.
+    // Derived from the invariant counter when calibrated, otherwise OS::nanotime().
+    // The two clocks have different origins: values must not be mixed.
+    static u64 nanos() {
+        if (TSC_SUPPORTED && _calibrated) {
+            return _base_nanos + (u64)((double)(rdtsc() - _base_ticks) * _nanos_per_tick);
+        }
+        return OS::nanotime();
+    }
 };
 
 #endif // _TSC_H
@@ -0,0 +1,93 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _UNWINDCACHE_H
+#define _UNWINDCACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "arch.h"
+#include "codeCache.h"
+#include "dwarf.h"
+
+
+const u32 UNWIND_CACHE_SIZE = 256;
+
+// Direct-mapped cache of native PC lookups made while walking stacks.
+// Every profiler lock slot owns one cache: it is only touched by the signal handler
+// holding that lock, so entries need no synchronization. Loading a library resets the cache,
+// since a PC formerly outside of any library may now belong to the new one.
+class UnwindCache {
+  private:
+    struct Entry {
+        const void* pc;
+        CodeCache* lib;
+        FrameDesc* frame_desc;  // NULL until the first DWARF lookup of this PC
+    };
+
+    Entry _entries[UNWIND_CACHE_SIZE];
+    int _lib_count;
+    u64 _hits;
+    u64 _misses;
+
+    Entry* lookup(const void* pc, CodeCacheArray* libs) {
+        int lib_count = libs->count();
+        if (lib_count != _lib_count) {
+            memset(_entries, 0, sizeof(_entries));
+            _lib_count = lib_count;
+        }
+
+        Entry* e = &_entries[(u32)(((uintptr_t)pc * 0x9e3779b97f4a7c15ULL) >> 56) & (UNWIND_CACHE_SIZE - 1)];
+        if (e->pc == pc && pc != NULL) {
+            _hits++;
+        } else {
+            _misses++;
+            e->pc = pc;
+            e->lib = libs->findLibraryByAddress(pc);
+            e->frame_desc = NULL;
+        }
+        return e;
+    }
+
+  public:
+    UnwindCache() {
+        reset();
+    }
+
+    void reset() {
+        memset(this, 0, sizeof(UnwindCache));
+    }
+
+    CodeCache* findLibrary(const void* pc, CodeCacheArray* libs) {
+        return lookup(pc, libs)->lib;
+    }
+
+    FrameDesc* findFrameDesc(const void* pc, CodeCacheArray* libs) {
+        Entry* e = lookup(pc, libs);
+        if (e->frame_desc != NULL) {
+            return e->frame_desc;
+        } else if (e->lib == NULL) {
+            return e->frame_desc = &FrameDesc::default_frame;
+        }
+
+        // Do not keep the fallback frame of a library whose DWARF table is not parsed yet
+        bool pending = e->lib->dwarfPending();
+        FrameDesc* f = e->lib->findFrameDesc(pc);
+        if (!pending) {
+            e->frame_desc = f;
+        }
+        return f;
+    }
+
+    u64 hits() const {
+        return _hits;
+    }
+
+    u64 misses() const {
+        return _misses;
+    }
+};
+
+#endif // _UNWINDCACHE_H
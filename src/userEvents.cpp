@@ -6,6 +6,7 @@
 #include "userEvents.h"
 
 Dictionary UserEvents::_dict;
+Dictionary UserEvents::_context_tags;
 
 // No (extra) lock is needed here since Dictionary is thread-safe.
 
@@ -16,3 +17,11 @@ int UserEvents::registerEvent(const char* event) {
 void UserEvents::collect(std::map<unsigned int, const char*>& map) {
     _dict.collect(map);
 }
+
+unsigned int UserEvents::registerContextTag(const char* tag) {
+    return _context_tags.lookup(tag);
+}
+
+void UserEvents::collectContextTags(std::map<unsigned int, const char*>& map) {
+    _context_tags.collect(map);
+}
@@ -12,10 +12,14 @@
 class UserEvents {
   private:
     static Dictionary _dict;
+    static Dictionary _context_tags;
 
   public:
     static int registerEvent(const char* event);
     static void collect(std::map<unsigned int, const char*>& map);
+
+    static unsigned int registerContextTag(const char* tag);
+    static void collectContextTags(std::map<unsigned int, const char*>& map);
 };
 
 #endif // _USEREVENTS_H
@@ -0,0 +1,251 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "virtualThreads.h"
+#include "os.h"
+#include "profiler.h"
+#include "tsc.h"
+#include "vmStructs.h"
+
+
+// Parked virtual threads walked in one cycle. The rest wait for the following cycles,
+// and the walked ones are weighted accordingly.
+const u32 VTHREAD_MAX_SAMPLES = 1024;
+
+// Thread containers nest when executors start executors; deeper ones are not visited
+const int VTHREAD_MAX_CONTAINER_DEPTH = 8;
+
+int VirtualThreads::_max_tid = 0;
+volatile jlong* VirtualThreads::_mounted = NULL;
+long VirtualThreads::_interval;
+
+
+static int carrierThreadId() {
+    VMThread* vm_thread;
+    if (VMStructs::hasNativeThreadId() && (vm_thread = VMThread::current()) != NULL) {
+        int thread_id = vm_thread->osThreadId();
+        if (thread_id > 0) {
+            return thread_id;
+        }
+    }
+    return OS::threadId();
+}
+
+void JNICALL VirtualThreads::VirtualThreadMount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread) {
+    int tid = carrierThreadId();
+    if (tid < _max_tid) {
+        _mounted[tid] = VMThread::javaThreadId(jni, vthread);
+    }
+}
+
+void JNICALL VirtualThreads::VirtualThreadUnmount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread) {
+    int tid = carrierThreadId();
+    if (tid < _max_tid) {
+        _mounted[tid] = 0;
+    }
+}
+
+// Mount and unmount events are HotSpot extensions, enabled by setting a callback
+static bool setMountCallbacks(jvmtiExtensionEvent mount, jvmtiExtensionEvent unmount) {
+    jvmtiEnv* jvmti = VM::jvmti();
+    int found = 0;
+
+    jint ext_count;
+    jvmtiExtensionEventInfo* ext_events;
+    if (jvmti->GetExtensionEvents(&ext_count, &ext_events) == 0) {
+        for (int i = 0; i < ext_count; i++) {
+            if (strcmp(ext_events[i].id, "com.sun.hotspot.events.VirtualThreadMount") == 0) {
+                found += jvmti->SetExtensionEventCallback(ext_events[i].extension_event_index, mount) == 0;
+            } else if (strcmp(ext_events[i].id, "com.sun.hotspot.events.VirtualThreadUnmount") == 0) {
+                found += jvmti->SetExtensionEventCallback(ext_events[i].extension_event_index, unmount) == 0;
+            }
+        }
+        jvmti->Deallocate((unsigned char*)ext_events);
+    }
+    return found == 2;
+}
+
+// jdk.internal.vm.ThreadContainers tracks all virtual threads, the same way as jcmd Thread.dump_to_file
+// sees them. JNI does not check module boundaries, so no --add-exports is needed.
+bool VirtualThreads::resolveContainers(JNIEnv* jni) {
+    jclass containers = jni->FindClass("jdk/internal/vm/ThreadContainers");
+    jclass container = containers != NULL ? jni->FindClass("jdk/internal/vm/ThreadContainer") : NULL;
+    jclass stream = container != NULL ? jni->FindClass("java/util/stream/Stream") : NULL;
+    jclass thread = stream != NULL ? jni->FindClass("java/lang/Thread") : NULL;
+
+    if (thread == NULL
+        || (_root = jni->GetStaticMethodID(containers, "root", "()Ljdk/internal/vm/ThreadContainer;")) == NULL
+        || (_children = jni->GetMethodID(container, "children", "()Ljava/util/stream/Stream;")) == NULL
+        || (_threads = jni->GetMethodID(container, "threads", "()Ljava/util/stream/Stream;")) == NULL
+        || (_to_array = jni->GetMethodID(stream, "toArray", "()[Ljava/lang/Object;")) == NULL
+        || (_is_virtual = jni->GetMethodID(thread, "isVirtual", "()Z")) == NULL) {
+        jni->ExceptionClear();
+        return false;
+    }
+
+    _containers_class = (jclass)jni->NewGlobalRef(containers);
+    return _containers_class != NULL;
+}
+
+Error VirtualThreads::start(Arguments& args) {
+    JNIEnv* jni = VM::jni();
+    if (jni == NULL || !VMStructs::hasJavaThreadId()) {
+        return Error("vthreads requires a HotSpot JVM");
+    }
+
+    _interval = args._vthreads;
+    _max_stack_depth = args._jstackdepth;
+    _cursor = 0;
+
+    if (_interval > 0) {
+        if (_containers_class == NULL && !resolveContainers(jni)) {
+            return Error("Parked virtual threads cannot be sampled on this JVM");
+        }
+    }
+
+    if (_mounted == NULL) {
+        _max_tid = OS::getMaxThreadId();
+        _mounted = (volatile jlong*)calloc(_max_tid, sizeof(jlong));
+        if (_mounted == NULL) {
+            return Error("Not enough memory to map virtual threads");
+        }
+    }
+
+    if (!VM::addVirtualThreadsCapability()) {
+        return Error("Virtual threads are not supported on this JVM");
+    }
+    if (!setMountCallbacks((jvmtiExtensionEvent)VirtualThreadMount, (jvmtiExtensionEvent)VirtualThreadUnmount)) {
+        setMountCallbacks(NULL, NULL);
+        return Error("Virtual thread mount events are not available");
+    }
+
+    if (_interval > 0) {
+        _running = true;
+        if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+            _running = false;
+            setMountCallbacks(NULL, NULL);
+            return Error("Unable to create virtual thread sampler");
+        }
+    }
+
+    return Error::OK;
+}
+
+void VirtualThreads::stop() {
+    setMountCallbacks(NULL, NULL);
+    // Threads mounted now would otherwise keep their ids until the next session
+    memset((void*)_mounted, 0, _max_tid * sizeof(jlong));
+
+    if (_interval > 0) {
+        _running = false;
+        pthread_kill(_thread, WAKEUP_SIGNAL);
+        pthread_join(_thread, NULL);
+    }
+}
+
+jobjectArray VirtualThreads::toArray(JNIEnv* jni, jobject stream) {
+    if (stream == NULL) {
+        return NULL;
+    }
+    jobjectArray array = (jobjectArray)jni->CallObjectMethod(stream, _to_array);
+    jni->DeleteLocalRef(stream);
+    return array;
+}
+
+void VirtualThreads::collectThreads(JNIEnv* jni, jobject container, std::vector<jthread>& threads, int depth) {
+    jobjectArray array = toArray(jni, jni->CallObjectMethod(container, _threads));
+    if (array != NULL) {
+        jint count = jni->GetArrayLength(array);
+        for (jint i = 0; i < count; i++) {
+            jthread thread = (jthread)jni->GetObjectArrayElement(array, i);
+            if (thread != NULL && jni->CallBooleanMethod(thread, _is_virtual)) {
+                threads.push_back(thread);
+            } else {
+                jni->DeleteLocalRef(thread);
+            }
+        }
+        jni->DeleteLocalRef(array);
+    }
+
+    if (depth < VTHREAD_MAX_CONTAINER_DEPTH && (array = toArray(jni, jni->CallObjectMethod(container, _children))) != NULL) {
+        jint count = jni->GetArrayLength(array);
+        for (jint i = 0; i < count; i++) {
+            jobject child = jni->GetObjectArrayElement(array, i);
+            if (child != NULL) {
+                collectThreads(jni, child, threads, depth + 1);
+                jni->DeleteLocalRef(child);
+            }
+        }
+        jni->DeleteLocalRef(array);
+    }
+
+    if (jni->ExceptionCheck()) {
+        jni->ExceptionClear();
+    }
+}
+
+void VirtualThreads::timerLoop() {
+    JNIEnv* jni = VM::attachThread("Async-profiler VThread Sampler");
+    jvmtiEnv* jvmti = VM::jvmti();
+    Profiler* profiler = Profiler::instance();
+
+    int max_frames = _max_stack_depth + RESERVED_FRAMES;
+    ASGCT_CallFrame* frames = (ASGCT_CallFrame*)malloc(max_frames * sizeof(ASGCT_CallFrame));
+    jvmtiFrameInfo* jvmti_frames = (jvmtiFrameInfo*)malloc(_max_stack_depth * sizeof(jvmtiFrameInfo));
+    std::vector<jthread> threads;
+
+    while (_running) {
+        u64 cycle_start_time = TSC::nanos();
+
+        if (_enabled && jni != NULL && jni->PushLocalFrame(64) == 0) {
+            threads.clear();
+            jobject root = jni->CallStaticObjectMethod(_containers_class, _root);
+            if (root != NULL) {
+                collectThreads(jni, root, threads, 0);
+            }
+            jni->ExceptionClear();
+
+            // Mounted threads are seen through their carriers, only parked ones are walked here.
+            // The visited slice moves every cycle, so that each thread gets its turn.
+            u32 count = (u32)threads.size();
+            u32 limit = count < VTHREAD_MAX_SAMPLES ? count : VTHREAD_MAX_SAMPLES;
+            u64 counter = limit > 0 ? (u64)_interval * count / limit : 0;
+
+            for (u32 i = 0; i < limit && _running; i++) {
+                jthread thread = threads[(_cursor + i) % count];
+                jint state;
+                if (jvmti->GetThreadState(thread, &state) != 0 || !(state & JVMTI_THREAD_STATE_ALIVE) ||
+                    (state & JVMTI_THREAD_STATE_RUNNABLE)) {
+                    continue;
+                }
+
+                jint num_frames;
+                if (jvmti->GetStackTrace(thread, 0, _max_stack_depth, jvmti_frames, &num_frames) == 0 && num_frames > 0) {
+                    for (int j = 0; j < num_frames; j++) {
+                        frames[j].method_id = jvmti_frames[j].method;
+                        frames[j].bci = (jint)jvmti_frames[j].location;
+                        LP64_ONLY(frames[j].padding = 0;)
+                    }
+                    profiler->recordVirtualThreadSample(counter, VMThread::javaThreadId(jni, thread), num_frames, frames);
+                }
+            }
+            _cursor += limit;
+
+            jni->PopLocalFrame(NULL);
+        }
+
+        long long sleep_time = cycle_start_time + _interval - TSC::nanos();
+        if (sleep_time > 0) {
+            OS::sleep(sleep_time);
+        }
+    }
+
+    free(jvmti_frames);
+    free(frames);
+
+    VM::detachThread();
+}
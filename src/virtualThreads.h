@@ -0,0 +1,71 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _VIRTUALTHREADS_H
+#define _VIRTUALTHREADS_H
+
+#include <jvmti.h>
+#include <pthread.h>
+#include <vector>
+#include "engine.h"
+
+
+// Attributes samples of carrier threads to the mounted virtual threads (JDK 21+),
+// and optionally samples stacks of parked virtual threads, which have no carrier to signal.
+class VirtualThreads : public Engine {
+  private:
+    static int _max_tid;
+    static volatile jlong* _mounted;
+    static long _interval;
+
+    int _max_stack_depth;
+    volatile bool _running;
+    pthread_t _thread;
+    u32 _cursor;
+
+    jclass _containers_class;
+    jmethodID _root;
+    jmethodID _children;
+    jmethodID _threads;
+    jmethodID _to_array;
+    jmethodID _is_virtual;
+
+    static void JNICALL VirtualThreadMount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread);
+    static void JNICALL VirtualThreadUnmount(jvmtiEnv* jvmti, JNIEnv* jni, jthread vthread);
+
+    static void* threadEntry(void* virtual_threads) {
+        ((VirtualThreads*)virtual_threads)->timerLoop();
+        return NULL;
+    }
+
+    bool resolveContainers(JNIEnv* jni);
+    jobjectArray toArray(JNIEnv* jni, jobject stream);
+    void collectThreads(JNIEnv* jni, jobject container, std::vector<jthread>& threads, int depth);
+    void timerLoop();
+
+  public:
+    const char* type() {
+        return "vthreads";
+    }
+
+    const char* title() {
+        return "Wall clock profile";
+    }
+
+    const char* units() {
+        return "ns";
+    }
+
+    Error start(Arguments& args);
+    void stop();
+
+    // Java id of the virtual thread mounted on the given carrier, or 0. Async-signal safe.
+    static jlong mounted(int tid) {
+        volatile jlong* mounted = _mounted;
+        return mounted != NULL && tid >= 0 && tid < _max_tid ? mounted[tid] : 0;
+    }
+};
+
+#endif // _VIRTUALTHREADS_H
@@ -10,6 +10,8 @@
 #include "vmEntry.h"
 #include "arguments.h"
 #include "asprof.h"
+#include "controlSocket.h"
+#include "httpServer.h"
 #include "j9Ext.h"
 #include "j9ObjectSampler.h"
 #include "javaApi.h"
@@ -18,6 +20,7 @@
 #include "instrument.h"
 #include "lockTracer.h"
 #include "log.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
@@ -31,6 +34,8 @@ jvmtiEnv* VM::_jvmti = NULL;
 int VM::_hotspot_version = 0;
 bool VM::_openj9 = false;
 bool VM::_zing = false;
+bool VM::_manage_non_safepoints = false;
+bool VM::_non_safepoints = false;
 
 GetCreatedJavaVMs VM::_getCreatedJavaVMs = NULL;
 
@@ -176,7 +181,11 @@ bool VM::init(JavaVM* vm, bool attach) {
     _totalMemory = (JVM_MemoryFunc)dlsym(libjvm, "JVM_TotalMemory");
     _freeMemory = (JVM_MemoryFunc)dlsym(libjvm, "JVM_FreeMemory");
 
+    // The JVM may be loaded into a native process profiled with lazysyms
     Profiler* profiler = Profiler::instance();
+    Symbols::deferSymbols(false);
+    profiler->loadDeferredSymbols();
+
     if (VMStructs::libjvm() == NULL) {
         profiler->updateSymbols(false);
         VMStructs::init(profiler->findLibraryByAddress((const void*)_asyncGetCallTrace));
@@ -258,6 +267,7 @@ bool VM::init(JavaVM* vm, bool attach) {
     callbacks.VMObjectAlloc = J9ObjectSampler::VMObjectAlloc;
     callbacks.SampledObjectAlloc = ObjectSampler::SampledObjectAlloc;
     callbacks.GarbageCollectionStart = ObjectSampler::GarbageCollectionStart;
+    callbacks.GarbageCollectionStart = Profiler::GarbageCollectionStart;
     callbacks.GarbageCollectionFinish = Profiler::GarbageCollectionFinish;
     _jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
 
@@ -265,17 +275,21 @@ bool VM::init(JavaVM* vm, bool attach) {
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_LOAD, NULL);
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DYNAMIC_CODE_GENERATED, NULL);
+    _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
     _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
 
-    if (hotspot_version() == 0 || !CodeHeap::available()) {
+    // Code heap bounds are read through VMStructs, so compiled methods need not be reported
+    bool code_heap_known = hotspot_version() > 0 && CodeHeap::available();
+    if (!code_heap_known) {
         // Workaround for JDK-8173361: avoid CompiledMethodLoad events when possible
         _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
     } else {
         // DebugNonSafepoints is automatically enabled with CompiledMethodLoad,
-        // otherwise we set the flag manually
+        // otherwise we set the flag manually: at startup, or when profiling starts
         JVMFlag* f = JVMFlag::find("DebugNonSafepoints");
-        if (f != NULL && f->isDefault()) {
-            f->set(1);
+        _manage_non_safepoints = f != NULL && f->isDefault() && !f->get();
+        if (!attach && _global_args._nonsafepoints == NONSAFEPOINTS_ALWAYS) {
+            setDebugNonSafepoints(true);
         }
     }
 
@@ -292,7 +306,10 @@ bool VM::init(JavaVM* vm, bool attach) {
     if (attach) {
         loadAllMethodIDs(jvmti(), jni());
         _jvmti->GenerateEvents(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
-        _jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+        if (!code_heap_known) {
+            // Replaying every nmethod pauses a JVM with a full code cache for a long time
+            _jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+        }
     } else {
         _jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
     }
@@ -300,6 +317,16 @@ bool VM::init(JavaVM* vm, bool attach) {
     return true;
 }
 
+void VM::setDebugNonSafepoints(bool enable) {
+    if (_manage_non_safepoints && enable != _non_safepoints) {
+        JVMFlag* f = JVMFlag::find("DebugNonSafepoints");
+        if (f != NULL) {
+            f->set(enable ? 1 : 0);
+            _non_safepoints = enable;
+        }
+    }
+}
+
 // Try to find a running JVM instance and attach to it
 void VM::tryAttach() {
     if (_getCreatedJavaVMs == NULL) {
@@ -401,7 +428,8 @@ void JNICALL VM::VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
 
     // Allow profiler server only at JVM startup
     if (_global_args._server != NULL) {
-        if (JavaAPI::startHttpServer(jvmti, jni, _global_args._server)) {
+        // The Java helper remains for platforms without the native server
+        if (HttpServer::start(_global_args._server) || JavaAPI::startHttpServer(jvmti, jni, _global_args._server)) {
             Log::info("Profiler server started at %s", _global_args._server);
         } else {
             Log::error("Failed to start profiler server");
@@ -419,6 +447,7 @@ void JNICALL VM::VMInit(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
 
 void JNICALL VM::VMDeath(jvmtiEnv* jvmti, JNIEnv* jni) {
     Profiler::instance()->shutdown(_global_args);
+    Log::flush();
 }
 
 jvmtiError VM::RedefineClassesHook(jvmtiEnv* jvmti, jint class_count, const jvmtiClassDefinition* class_definitions) {
@@ -475,8 +504,8 @@ Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     return 0;
 }
 
-extern "C" DLLEXPORT jint JNICALL
-Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
+// Runs a launcher command received either by Dynamic Attach or through the control socket
+static jint runLauncherCommand(JavaVM* vm, const char* options) {
     Arguments args;
     Error error = args.parse(options);
 
@@ -487,7 +516,7 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
         return ARGUMENTS_ERROR;
     }
 
-    if (!VM::init(vm, true)) {
+    if (vm != NULL && !VM::init(vm, true)) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
     }
@@ -499,14 +528,30 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
         return COMMAND_ERROR;
     }
 
+    if (args._control) {
+        ControlSocket::start();
+    }
+
     if (args._action == ACTION_STOP && args.hasTemporaryLog()) {
         // The launcher immediately deletes logs after printing
         Log::close();
+    } else {
+        // The launcher reads the log as soon as the command returns
+        Log::flush();
     }
 
     return 0;
 }
 
+int VM::executeCommand(const char* options) {
+    return runLauncherCommand(NULL, options);
+}
+
+extern "C" DLLEXPORT jint JNICALL
+Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
+    return runLauncherCommand(vm, options);
+}
+
 extern "C" DLLEXPORT jint JNICALL
 JNI_OnLoad(JavaVM* vm, void* reserved) {
     if (!VM::init(vm, true)) {
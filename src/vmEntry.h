@@ -50,6 +50,10 @@ enum ASGCT_CallFrameType {
     BCI_THREAD_ID           = -16,  // method_id designates a thread
     BCI_ADDRESS             = -17,  // method_id is a PC address
     BCI_ERROR               = -18,  // method_id is an error string
+    BCI_THREAD_GROUP        = -19,  // method_id is an ID of the normalized thread name
+    BCI_NATIVE_PC           = -20,  // method_id is a PC in a library with deferred symbols
+    BCI_DATA_OBJECT         = -21,  // class name of the object at the sampled data address
+    BCI_VIRTUAL_THREAD      = -22,  // method_id is a Java id of the virtual thread
 };
 
 // See hotspot/src/share/vm/prims/forte.cpp
@@ -103,6 +107,9 @@ class VM {
     static int _hotspot_version;
     static bool _openj9;
     static bool _zing;
+    // DebugNonSafepoints is ours to switch: HotSpot with known code heap, and the user did not set the flag
+    static bool _manage_non_safepoints;
+    static bool _non_safepoints;
 
     static GetCreatedJavaVMs _getCreatedJavaVMs;
 
@@ -124,6 +131,12 @@ class VM {
 
     static void tryAttach();
 
+    // Turns DebugNonSafepoints on, or back off if the profiler turned it on
+    static void setDebugNonSafepoints(bool enable);
+
+    // Executes asprof command on behalf of the control socket; returns the same codes as Agent_OnAttach
+    static int executeCommand(const char* options);
+
     static bool loaded() {
         return _jvmti != NULL;
     }
@@ -165,6 +178,14 @@ class VM {
         return _jvmti->AddCapabilities(&capabilities) == 0;
     }
 
+    // can_support_virtual_threads is declared only in JDK 21+ headers:
+    // it follows can_generate_sampled_object_alloc_events in the second word of the bit set
+    static bool addVirtualThreadsCapability() {
+        jvmtiCapabilities capabilities = {0};
+        ((u32*)&capabilities)[1] = 1U << 12;
+        return _jvmti->AddCapabilities(&capabilities) == 0;
+    }
+
     static void releaseSampleObjectsCapability() {
         jvmtiCapabilities capabilities = {0};
         capabilities.can_generate_sampled_object_alloc_events = 1;
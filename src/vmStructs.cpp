@@ -8,6 +8,8 @@
 #include "vmStructs.h"
 #include "vmEntry.h"
 #include "j9Ext.h"
+#include "log.h"
+#include "os.h"
 #include "safeAccess.h"
 
 
@@ -15,6 +17,7 @@ CodeCache* VMStructs::_libjvm = NULL;
 
 bool VMStructs::_has_class_names = false;
 bool VMStructs::_has_method_structs = false;
+bool VMStructs::_has_method_names = false;
 bool VMStructs::_has_compiler_structs = false;
 bool VMStructs::_has_stack_structs = false;
 bool VMStructs::_has_class_loader_data = false;
@@ -57,20 +60,26 @@ int VMStructs::_nmethod_method_offset = -1;
 int VMStructs::_nmethod_entry_offset = -1;
 int VMStructs::_nmethod_state_offset = -1;
 int VMStructs::_nmethod_level_offset = -1;
+int VMStructs::_nmethod_compile_id_offset = -1;
 int VMStructs::_nmethod_metadata_offset = -1;
 int VMStructs::_nmethod_immutable_offset = -1;
 int VMStructs::_method_constmethod_offset = -1;
 int VMStructs::_method_code_offset = -1;
 int VMStructs::_constmethod_constants_offset = -1;
 int VMStructs::_constmethod_idnum_offset = -1;
+int VMStructs::_constmethod_name_index_offset = -1;
+int VMStructs::_constmethod_signature_index_offset = -1;
 int VMStructs::_constmethod_size = -1;
 int VMStructs::_pool_holder_offset = -1;
+int VMStructs::_pool_length_offset = -1;
+int VMStructs::_pool_size = -1;
 int VMStructs::_array_len_offset = 0;
 int VMStructs::_array_data_offset = -1;
 int VMStructs::_code_heap_memory_offset = -1;
 int VMStructs::_code_heap_segmap_offset = -1;
 int VMStructs::_code_heap_segment_shift = -1;
 int VMStructs::_heap_block_used_offset = -1;
+int VMStructs::_heap_block_length_offset = -1;
 int VMStructs::_vs_low_bound_offset = -1;
 int VMStructs::_vs_high_bound_offset = -1;
 int VMStructs::_vs_low_offset = -1;
@@ -95,6 +104,7 @@ int VMStructs::_narrow_klass_shift = -1;
 char** VMStructs::_collected_heap_addr = NULL;
 char* VMStructs::_collected_heap = NULL;
 int VMStructs::_collected_heap_reserved_offset = -1;
+volatile int* VMStructs::_safepoint_state_addr = NULL;
 int VMStructs::_region_start_offset = -1;
 int VMStructs::_region_size_offset = -1;
 int VMStructs::_markword_klass_shift = -1;
@@ -116,38 +126,99 @@ VMStructs::LockFunc VMStructs::_lock_func;
 VMStructs::LockFunc VMStructs::_unlock_func;
 
 
-uintptr_t VMStructs::readSymbol(const char* symbol_name) {
-    const void* symbol = _libjvm->findSymbol(symbol_name);
-    if (symbol == NULL) {
+// Exported libjvm symbols describing VMStructs tables. They are looked up together,
+// since every lookup by name is a linear scan over all libjvm symbols.
+enum VMStructsSymbol {
+    VMS_STRUCTS,
+    VMS_STRUCT_STRIDE,
+    VMS_STRUCT_TYPE_NAME,
+    VMS_STRUCT_FIELD_NAME,
+    VMS_STRUCT_OFFSET,
+    VMS_STRUCT_ADDRESS,
+    VMS_TYPES,
+    VMS_TYPE_STRIDE,
+    VMS_TYPE_TYPE_NAME,
+    VMS_TYPE_SIZE,
+    VMS_LONG_CONSTANTS,
+    VMS_LONG_CONSTANT_STRIDE,
+    VMS_LONG_CONSTANT_NAME,
+    VMS_LONG_CONSTANT_VALUE,
+    VMS_INT_CONSTANTS,
+    VMS_INT_CONSTANT_STRIDE,
+    VMS_INT_CONSTANT_NAME,
+    VMS_INT_CONSTANT_VALUE,
+    VMS_SYMBOL_COUNT
+};
+
+static const char* const VMSTRUCTS_SYMBOL_NAMES[VMS_SYMBOL_COUNT] = {
+    "gHotSpotVMStructs",
+    "gHotSpotVMStructEntryArrayStride",
+    "gHotSpotVMStructEntryTypeNameOffset",
+    "gHotSpotVMStructEntryFieldNameOffset",
+    "gHotSpotVMStructEntryOffsetOffset",
+    "gHotSpotVMStructEntryAddressOffset",
+    "gHotSpotVMTypes",
+    "gHotSpotVMTypeEntryArrayStride",
+    "gHotSpotVMTypeEntryTypeNameOffset",
+    "gHotSpotVMTypeEntrySizeOffset",
+    "gHotSpotVMLongConstants",
+    "gHotSpotVMLongConstantEntryArrayStride",
+    "gHotSpotVMLongConstantEntryNameOffset",
+    "gHotSpotVMLongConstantEntryValueOffset",
+    "gHotSpotVMIntConstants",
+    "gHotSpotVMIntConstantEntryArrayStride",
+    "gHotSpotVMIntConstantEntryNameOffset",
+    "gHotSpotVMIntConstantEntryValueOffset",
+};
+
+void VMStructs::readSymbols(uintptr_t* values) {
+    const void* symbols[VMS_SYMBOL_COUNT];
+    _libjvm->findSymbols(VMSTRUCTS_SYMBOL_NAMES, symbols, VMS_SYMBOL_COUNT);
+    for (int i = 0; i < VMS_SYMBOL_COUNT; i++) {
         // Avoid JVM crash in case of missing symbols
-        return 0;
+        values[i] = symbols[i] != NULL ? *(uintptr_t*)symbols[i] : 0;
     }
-    return *(uintptr_t*)symbol;
 }
 
 // Run at agent load time
 void VMStructs::init(CodeCache* libjvm) {
     if (libjvm != NULL) {
         _libjvm = libjvm;
+
+        u64 start_time = OS::nanotime();
         initOffsets();
+        u64 offsets_time = OS::nanotime();
         initJvmFunctions();
+        u64 end_time = OS::nanotime();
+
+        Log::debug("VMStructs: offsets read in %llu us, JVM functions found in %llu us",
+                   (offsets_time - start_time) / 1000, (end_time - offsets_time) / 1000);
     }
 }
 
 // Run when VM is initialized and JNI is available
 void VMStructs::ready() {
+    u64 start_time = OS::nanotime();
     resolveOffsets();
+    u64 resolve_time = OS::nanotime();
     patchSafeFetch();
     initThreadBridge();
+    u64 end_time = OS::nanotime();
+
+    Log::debug("VMStructs: offsets resolved in %llu us, thread bridge set up in %llu us",
+               (resolve_time - start_time) / 1000, (end_time - resolve_time) / 1000);
 }
 
 void VMStructs::initOffsets() {
-    uintptr_t entry = readSymbol("gHotSpotVMStructs");
-    uintptr_t stride = readSymbol("gHotSpotVMStructEntryArrayStride");
-    uintptr_t type_offset = readSymbol("gHotSpotVMStructEntryTypeNameOffset");
-    uintptr_t field_offset = readSymbol("gHotSpotVMStructEntryFieldNameOffset");
-    uintptr_t offset_offset = readSymbol("gHotSpotVMStructEntryOffsetOffset");
-    uintptr_t address_offset = readSymbol("gHotSpotVMStructEntryAddressOffset");
+    uintptr_t sym[VMS_SYMBOL_COUNT];
+    readSymbols(sym);
+
+    uintptr_t entry = sym[VMS_STRUCTS];
+    uintptr_t stride = sym[VMS_STRUCT_STRIDE];
+    uintptr_t type_offset = sym[VMS_STRUCT_TYPE_NAME];
+    uintptr_t field_offset = sym[VMS_STRUCT_FIELD_NAME];
+    uintptr_t offset_offset = sym[VMS_STRUCT_OFFSET];
+    uintptr_t address_offset = sym[VMS_STRUCT_ADDRESS];
 
     if (entry != 0 && stride != 0) {
         for (;; entry += stride) {
@@ -181,6 +252,10 @@ void VMStructs::initOffsets() {
                 } else if (strcmp(field, "_collectedHeap") == 0) {
                     _collected_heap_addr = *(char***)(entry + address_offset);
                 }
+            } else if (strcmp(type, "SafepointSynchronize") == 0) {
+                if (strcmp(field, "_state") == 0) {
+                    _safepoint_state_addr = *(volatile int**)(entry + address_offset);
+                }
             } else if (strcmp(type, "CollectedHeap") == 0) {
                 if (strcmp(field, "_reserved") == 0) {
                     _collected_heap_reserved_offset = *(int*)(entry + offset_offset);
@@ -202,6 +277,8 @@ void VMStructs::initOffsets() {
                     _nmethod_state_offset = *(int*)(entry + offset_offset);
                 } else if (strcmp(field, "_comp_level") == 0) {
                     _nmethod_level_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_compile_id") == 0) {
+                    _nmethod_compile_id_offset = *(int*)(entry + offset_offset);
                 } else if (strcmp(field, "_metadata_offset") == 0) {
                     _nmethod_metadata_offset = *(int*)(entry + offset_offset);
                 } else if (strcmp(field, "_immutable_data") == 0) {
@@ -224,10 +301,16 @@ void VMStructs::initOffsets() {
                     _constmethod_constants_offset = *(int*)(entry + offset_offset);
                 } else if (strcmp(field, "_method_idnum") == 0) {
                     _constmethod_idnum_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_name_index") == 0) {
+                    _constmethod_name_index_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_signature_index") == 0) {
+                    _constmethod_signature_index_offset = *(int*)(entry + offset_offset);
                 }
             } else if (strcmp(type, "ConstantPool") == 0) {
                 if (strcmp(field, "_pool_holder") == 0) {
                     _pool_holder_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_length") == 0) {
+                    _pool_length_offset = *(int*)(entry + offset_offset);
                 }
             } else if (strcmp(type, "InstanceKlass") == 0) {
                 if (strcmp(field, "_class_loader_data") == 0) {
@@ -331,6 +414,8 @@ void VMStructs::initOffsets() {
             } else if (strcmp(type, "HeapBlock::Header") == 0) {
                 if (strcmp(field, "_used") == 0) {
                     _heap_block_used_offset = *(int*)(entry + offset_offset);
+                } else if (strcmp(field, "_length") == 0) {
+                    _heap_block_length_offset = *(int*)(entry + offset_offset);
                 }
             } else if (strcmp(type, "VirtualSpace") == 0) {
                 if (strcmp(field, "_low_boundary") == 0) {
@@ -374,10 +459,10 @@ void VMStructs::initOffsets() {
         }
     }
 
-    entry = readSymbol("gHotSpotVMTypes");
-    stride = readSymbol("gHotSpotVMTypeEntryArrayStride");
-    type_offset = readSymbol("gHotSpotVMTypeEntryTypeNameOffset");
-    uintptr_t size_offset = readSymbol("gHotSpotVMTypeEntrySizeOffset");
+    entry = sym[VMS_TYPES];
+    stride = sym[VMS_TYPE_STRIDE];
+    type_offset = sym[VMS_TYPE_TYPE_NAME];
+    uintptr_t size_offset = sym[VMS_TYPE_SIZE];
 
     if (entry != 0 && stride != 0) {
         for (;; entry += stride) {
@@ -390,14 +475,16 @@ void VMStructs::initOffsets() {
                 _flag_size = *(int*)(entry + size_offset);
             } else if (strcmp(type, "ConstMethod") == 0) {
                 _constmethod_size = *(int*)(entry + size_offset);
+            } else if (strcmp(type, "ConstantPool") == 0) {
+                _pool_size = *(int*)(entry + size_offset);
             }
         }
     }
 
-    entry = readSymbol("gHotSpotVMLongConstants");
-    stride = readSymbol("gHotSpotVMLongConstantEntryArrayStride");
-    uintptr_t name_offset = readSymbol("gHotSpotVMLongConstantEntryNameOffset");
-    uintptr_t value_offset = readSymbol("gHotSpotVMLongConstantEntryValueOffset");
+    entry = sym[VMS_LONG_CONSTANTS];
+    stride = sym[VMS_LONG_CONSTANT_STRIDE];
+    uintptr_t name_offset = sym[VMS_LONG_CONSTANT_NAME];
+    uintptr_t value_offset = sym[VMS_LONG_CONSTANT_VALUE];
 
     if (entry != 0 && stride != 0) {
         for (;; entry += stride) {
@@ -416,10 +503,10 @@ void VMStructs::initOffsets() {
         }
     }
 
-    entry = readSymbol("gHotSpotVMIntConstants");
-    stride = readSymbol("gHotSpotVMIntConstantEntryArrayStride");
-    name_offset = readSymbol("gHotSpotVMIntConstantEntryNameOffset");
-    value_offset = readSymbol("gHotSpotVMIntConstantEntryValueOffset");
+    entry = sym[VMS_INT_CONSTANTS];
+    stride = sym[VMS_INT_CONSTANT_STRIDE];
+    name_offset = sym[VMS_INT_CONSTANT_NAME];
+    value_offset = sym[VMS_INT_CONSTANT_VALUE];
 
     if (entry != 0 && stride != 0) {
         for (;; entry += stride) {
@@ -474,6 +561,14 @@ void VMStructs::resolveOffsets() {
             && _constmethod_size >= 0
             && _pool_holder_offset >= 0;
 
+    // Symbols of a method are read right from its constant pool, where they follow the ConstantPool header
+    _has_method_names = _has_method_structs
+            && _has_class_names
+            && _constmethod_name_index_offset >= 0
+            && _constmethod_signature_index_offset >= 0
+            && _pool_length_offset >= 0
+            && _pool_size > 0;
+
     _has_compiler_structs = _comp_env_offset >= 0
             && _comp_task_offset >= 0
             && _comp_method_offset >= 0;
@@ -552,8 +647,14 @@ void VMStructs::resolveOffsets() {
 
 void VMStructs::initJvmFunctions() {
     if (VM::hotspot_version() == 8) {
-        _lock_func = (LockFunc)_libjvm->findSymbol("_ZN7Monitor28lock_without_safepoint_checkEv");
-        _unlock_func = (LockFunc)_libjvm->findSymbol("_ZN7Monitor6unlockEv");
+        static const char* const lock_names[] = {
+            "_ZN7Monitor28lock_without_safepoint_checkEv",
+            "_ZN7Monitor6unlockEv"
+        };
+        const void* lock_funcs[2];
+        _libjvm->findSymbols(lock_names, lock_funcs, 2);
+        _lock_func = (LockFunc)lock_funcs[0];
+        _unlock_func = (LockFunc)lock_funcs[1];
     }
 
     if (VM::hotspot_version() > 0) {
@@ -635,6 +736,59 @@ int VMThread::nativeThreadId(JNIEnv* jni, jthread thread) {
     return VM::isOpenJ9() ? J9Ext::GetOSThreadID(thread) : -1;
 }
 
+VMKlass* VMKlass::fromOopSafe(uintptr_t oop) {
+    if (!goodPtr((const void*)oop)) {
+        return NULL;
+    }
+
+    uintptr_t klass;
+    if (_narrow_klass_shift >= 0) {
+        uintptr_t narrow_klass;
+        if (_compact_object_headers) {
+            uintptr_t mark = (uintptr_t)SafeAccess::loadPtr((void**)oop, NULL);
+            if (mark & MONITOR_BIT) {
+                // The header is displaced to a monitor, which is not worth the risk
+                return NULL;
+            }
+            narrow_klass = mark >> _markword_klass_shift;
+        } else {
+            narrow_klass = SafeAccess::load32((u32*)(oop + _oop_klass_offset), 0);
+        }
+        if (narrow_klass == 0) {
+            return NULL;
+        }
+        klass = (uintptr_t)_narrow_klass_base + (narrow_klass << _narrow_klass_shift);
+    } else {
+        klass = (uintptr_t)SafeAccess::loadPtr((void**)(oop + _oop_klass_offset), NULL);
+    }
+
+    if (!goodPtr((const void*)klass)) {
+        return NULL;
+    }
+    const char* symbol = (const char*)SafeAccess::loadPtr((void**)(klass + _klass_name_offset), NULL);
+    if (!goodPtr(symbol)) {
+        return NULL;
+    }
+
+    u32 length = _symbol_length_offset >= 0
+        ? SafeAccess::load32((u32*)(symbol + _symbol_length_offset), 0) & 0xffff
+        : SafeAccess::load32((u32*)(symbol + _symbol_length_and_refcount_offset), 0) >> 16;
+    if (length == 0 || length > 1024) {
+        return NULL;
+    }
+
+    // Class names start with a letter, array names with '['
+    char first = (char)SafeAccess::load32((u32*)(symbol + _symbol_body_offset), 0);
+    if (!((first >= 'a' && first <= 'z') || (first >= 'A' && first <= 'Z') || first == '[' || first == '_' || first == '$')) {
+        return NULL;
+    }
+    // The last byte must be readable as well, since the name is copied afterwards
+    if (length >= 4 && SafeAccess::load32((u32*)(symbol + _symbol_body_offset + length - 4), 0) == 0) {
+        return NULL;
+    }
+    return (VMKlass*)klass;
+}
+
 jmethodID VMMethod::id() {
     // We may find a bogus NMethod during stack walking, it does not always point to a valid VMMethod
     const char* const_method = (const char*) SafeAccess::load((void**) at(_method_constmethod_offset));
@@ -656,6 +810,44 @@ jmethodID VMMethod::id() {
     return NULL;
 }
 
+bool VMMethod::symbols(VMSymbol** class_name, VMSymbol** method_name, VMSymbol** signature) {
+    const char* const_method = *(const char**) at(_method_constmethod_offset);
+    if (!goodPtr(const_method)) {
+        return false;
+    }
+
+    const char* cpool = *(const char**) (const_method + _constmethod_constants_offset);
+    if (!goodPtr(cpool)) {
+        return false;
+    }
+
+    unsigned short name_index = *(unsigned short*) (const_method + _constmethod_name_index_offset);
+    unsigned short signature_index = *(unsigned short*) (const_method + _constmethod_signature_index_offset);
+    int pool_length = *(int*) (cpool + _pool_length_offset);
+    if (name_index == 0 || name_index >= pool_length || signature_index == 0 || signature_index >= pool_length) {
+        return false;
+    }
+
+    VMSymbol** pool_base = (VMSymbol**) (cpool + _pool_size);
+    VMKlass* holder = *(VMKlass**) (cpool + _pool_holder_offset);
+    if (!goodPtr(holder)) {
+        return false;
+    }
+
+    *class_name = holder->name();
+    *method_name = pool_base[name_index];
+    *signature = pool_base[signature_index];
+    if (!goodPtr(*class_name) || !goodPtr(*method_name) || !goodPtr(*signature)) {
+        return false;
+    }
+
+    // JVM TI names hidden classes differently from their Klass, see Klass::signature_name()
+    VMSymbol* name = *class_name;
+    return name->length() > 0 && memchr(name->body(), '+', name->length()) == NULL;
+}
+
+unsigned char* volatile CodeHeap::_block_cache[CODE_BLOCK_CACHE_SIZE];
+
 NMethod* CodeHeap::findNMethod(char* heap, const void* pc) {
     unsigned char* heap_start = *(unsigned char**)(heap + _code_heap_memory_offset + _vs_low_offset);
     unsigned char* segmap = *(unsigned char**)(heap + _code_heap_segmap_offset + _vs_low_offset);
@@ -664,11 +856,30 @@ NMethod* CodeHeap::findNMethod(char* heap, const void* pc) {
     if (segmap[idx] == 0xff) {
         return NULL;
     }
+
+    size_t slot = (size_t)(((uintptr_t)pc >> 8) * 0x9e3779b97f4a7c15ULL >> 40) & (CODE_BLOCK_CACHE_SIZE - 1);
+    unsigned char* block = _block_cache[slot];
+
+    // Blocks never overlap, and segmap is 0 exactly at block starts. Hence, if a block still starts
+    // at the cached address and spans pc, it is the right one, even if the code cache has changed since.
+    // This makes invalidation on nmethod unloading unnecessary.
+    if (block != NULL && block >= heap_start && block <= (unsigned char*)pc &&
+        segmap[(block - heap_start) >> _code_heap_segment_shift] == 0 &&
+        ((block - heap_start) >> _code_heap_segment_shift) + *(size_t*)(block + _heap_block_length_offset) > idx) {
+        block += _heap_block_used_offset;
+        return *block ? align<NMethod*>(block + sizeof(uintptr_t)) : NULL;
+    }
+
     while (segmap[idx] > 0) {
         idx -= segmap[idx];
     }
 
-    unsigned char* block = heap_start + (idx << _code_heap_segment_shift) + _heap_block_used_offset;
+    block = heap_start + (idx << _code_heap_segment_shift);
+    if (_heap_block_length_offset >= 0) {
+        _block_cache[slot] = block;
+    }
+
+    block += _heap_block_used_offset;
     return *block ? align<NMethod*>(block + sizeof(uintptr_t)) : NULL;
 }
 
@@ -20,6 +20,7 @@ class VMStructs {
 
     static bool _has_class_names;
     static bool _has_method_structs;
+    static bool _has_method_names;
     static bool _has_compiler_structs;
     static bool _has_stack_structs;
     static bool _has_class_loader_data;
@@ -62,20 +63,26 @@ class VMStructs {
     static int _nmethod_entry_offset;
     static int _nmethod_state_offset;
     static int _nmethod_level_offset;
+    static int _nmethod_compile_id_offset;
     static int _nmethod_metadata_offset;
     static int _nmethod_immutable_offset;
     static int _method_constmethod_offset;
     static int _method_code_offset;
     static int _constmethod_constants_offset;
     static int _constmethod_idnum_offset;
+    static int _constmethod_name_index_offset;
+    static int _constmethod_signature_index_offset;
     static int _constmethod_size;
     static int _pool_holder_offset;
+    static int _pool_length_offset;
+    static int _pool_size;
     static int _array_len_offset;
     static int _array_data_offset;
     static int _code_heap_memory_offset;
     static int _code_heap_segmap_offset;
     static int _code_heap_segment_shift;
     static int _heap_block_used_offset;
+    static int _heap_block_length_offset;
     static int _vs_low_bound_offset;
     static int _vs_high_bound_offset;
     static int _vs_low_offset;
@@ -100,6 +107,7 @@ class VMStructs {
     static char** _collected_heap_addr;
     static char* _collected_heap;
     static int _collected_heap_reserved_offset;
+    static volatile int* _safepoint_state_addr;
     static int _region_start_offset;
     static int _region_size_offset;
     static int _markword_klass_shift;
@@ -121,7 +129,7 @@ class VMStructs {
     static LockFunc _lock_func;
     static LockFunc _unlock_func;
 
-    static uintptr_t readSymbol(const char* symbol_name);
+    static void readSymbols(uintptr_t* values);
     static void initOffsets();
     static void resolveOffsets();
     static void patchSafeFetch();
@@ -158,6 +166,10 @@ class VMStructs {
         return _has_method_structs;
     }
 
+    static bool hasMethodNames() {
+        return _has_method_names;
+    }
+
     static bool hasCompilerStructs() {
         return _has_compiler_structs;
     }
@@ -181,6 +193,11 @@ class VMStructs {
     static bool isInterpretedFrameValidFunc(const void* pc) {
         return pc >= _interpreted_frame_valid_start && pc < _interpreted_frame_valid_end;
     }
+
+    // SafepointSynchronize is synchronizing or synchronized
+    static bool safepointActive() {
+        return _safepoint_state_addr != NULL && *_safepoint_state_addr != 0;
+    }
 };
 
 
@@ -281,6 +298,10 @@ class VMKlass : VMStructs {
         }
     }
 
+    // Same as fromOop for an address that may not be an object at all: every load is guarded,
+    // and the result is NULL unless the header refers to a Klass with a plausible name
+    static VMKlass* fromOopSafe(uintptr_t oop);
+
     VMSymbol* name() {
         return *(VMSymbol**) at(_klass_name_offset);
     }
@@ -360,6 +381,16 @@ class VMThread : VMStructs {
         return state() == 8;
     }
 
+    // Between two thread states, e.g. stopping for a safepoint or resuming after it
+    bool inTransition() {
+        int s = state();
+        return s == 5 || s == 6 || s == 7 || s == 9 || s == 11;
+    }
+
+    bool isBlocked() {
+        return state() == 10;
+    }
+
     bool inDeopt() {
         return *(void**) at(_thread_vframe_offset) != NULL;
     }
@@ -392,6 +423,10 @@ class VMMethod : VMStructs {
 
     jmethodID id();
 
+    // Reads names of the method and its holder class without JVMTI.
+    // Returns false if any of them looks invalid, so that the caller falls back to JVMTI.
+    bool symbols(VMSymbol** class_name, VMSymbol** method_name, VMSymbol** signature);
+
     const char* bytecode() {
         return *(const char**) at(_method_constmethod_offset) + _constmethod_size;
     }
@@ -489,6 +524,11 @@ class NMethod : VMStructs {
         return _nmethod_level_offset >= 0 ? *(signed char*) at(_nmethod_level_offset) : 0;
     }
 
+    // -1 if unknown
+    int compileId() {
+        return _nmethod_compile_id_offset >= 0 ? *(int*) at(_nmethod_compile_id_offset) : -1;
+    }
+
     VMMethod** metadata() {
         if (_mutable_data_offset >= 0) {
             // Since JDK 25
@@ -503,8 +543,15 @@ class NMethod : VMStructs {
     int findScopeOffset(const void* pc);
 };
 
+// Number of remembered CodeHeap blocks for fast nmethod lookup; must be a power of 2
+const size_t CODE_BLOCK_CACHE_SIZE = 4096;
+
 class CodeHeap : VMStructs {
   private:
+    // Start of the last block found for a range of addresses. Entries are single words,
+    // so they are written from signal handlers without locks, and validated on every hit.
+    static unsigned char* volatile _block_cache[CODE_BLOCK_CACHE_SIZE];
+
     static bool contains(char* heap, const void* pc) {
         return heap != NULL &&
                pc >= *(const void**)(heap + _code_heap_memory_offset + _vs_low_offset) &&
@@ -556,6 +603,10 @@ class CollectedHeap : VMStructs {
     uintptr_t size() {
         return (*(uintptr_t*) at(_region_size_offset)) * sizeof(uintptr_t);
     }
+
+    bool contains(uintptr_t address) {
+        return address - start() < size();
+    }
 };
 
 class JVMFlag : VMStructs {
@@ -3,17 +3,19 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include "wallClock.h"
 #include "profiler.h"
 #include "stackFrame.h"
+#include "threadRegistry.h"
 #include "tsc.h"
 
 
-// Maximum number of threads sampled in one iteration. This limit serves as a throttle
-// when generating profiling signals. Otherwise applications with too many threads may
+// Maximum number of threads sampled in one iteration of each sampler thread. This limit serves
+// as a throttle when generating profiling signals. Otherwise applications with too many threads may
 // suffer from a big profiling overhead. Also, keeping this limit low enough helps
 // to avoid contention on a spin lock inside Profiler::recordSample().
 const int THREADS_PER_TICK = 8;
@@ -29,15 +31,97 @@ const u64 RUNNABLE_THRESHOLD_NS = 10000;
 // How many skipped idle samples can be recorded in a single WallClock event.
 const u32 MAX_IDLE_BATCH = 1000;
 
+// CPU time of a thread idle for this many cycles is polled every other cycle,
+// after twice as many cycles every 4th cycle, and so on up to MAX_IDLE_PROBE_PERIOD.
+const u32 IDLE_BACKOFF_CYCLES = 16;
+const u32 MAX_IDLE_PROBE_PERIOD = 8;
+
+// A CPU sample of a thread not older than this is used as its wall clock sample
+// when CPU and wall clock profiling run together
+const u64 MAX_CPU_TRACE_AGE = 10000000;
+
+// One sampler thread is started per this number of CPUs by default
+const int CPUS_PER_SAMPLER = 16;
+
 
 struct ThreadSleepState {
-    u64 start_time;
-    u64 last_cpu_time;
+    int thread_id;
     u32 call_trace_id;
     u32 counter;
+    u64 start_time;
+    u64 last_cpu_time;
 };
 
-typedef std::map<int, ThreadSleepState> ThreadSleepMap;
+// Open addressing table of ThreadSleepState keyed by thread id.
+// Owned by a single sampler thread, so it needs no synchronization.
+class ThreadSleepTable {
+  private:
+    enum {
+        INITIAL_CAPACITY = 1024
+    };
+
+    ThreadSleepState* _table;
+    u32 _capacity;
+    u32 _size;
+
+    static u32 hash(int thread_id) {
+        u32 h = (u32)thread_id * 0x9e3779b9;
+        return h ^ (h >> 16);
+    }
+
+    ThreadSleepState* find(int thread_id) {
+        u32 mask = _capacity - 1;
+        for (u32 i = hash(thread_id) & mask; ; i = (i + 1) & mask) {
+            ThreadSleepState* tss = &_table[i];
+            if (tss->thread_id == thread_id || tss->thread_id == 0) {
+                return tss;
+            }
+        }
+    }
+
+    void rehash() {
+        ThreadSleepState* old_table = _table;
+        u32 old_capacity = _capacity;
+
+        _capacity = old_capacity * 2;
+        _table = (ThreadSleepState*)calloc(_capacity, sizeof(ThreadSleepState));
+        for (u32 i = 0; i < old_capacity; i++) {
+            if (old_table[i].thread_id != 0) {
+                *find(old_table[i].thread_id) = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+  public:
+    ThreadSleepTable() : _capacity(INITIAL_CAPACITY), _size(0) {
+        _table = (ThreadSleepState*)calloc(_capacity, sizeof(ThreadSleepState));
+    }
+
+    ~ThreadSleepTable() {
+        free(_table);
+    }
+
+    u32 capacity() const {
+        return _capacity;
+    }
+
+    const ThreadSleepState& at(u32 index) const {
+        return _table[index];
+    }
+
+    ThreadSleepState& operator[](int thread_id) {
+        ThreadSleepState* tss = find(thread_id);
+        if (tss->thread_id == 0) {
+            if (++_size * 2 > _capacity) {
+                rehash();
+                tss = find(thread_id);
+            }
+            tss->thread_id = thread_id;
+        }
+        return *tss;
+    }
+};
 
 struct ThreadCpuTime {
     u64 cpu_time;
@@ -75,7 +159,7 @@ class ThreadCpuTimeBuffer {
         storeRelease(t.cpu_time, OS::threadCpuTime(0));
     }
 
-    void drain(ThreadSleepMap& thread_sleep_state) {
+    void drain(ThreadSleepTable& thread_sleep_state) {
         u64 read_limit = _read_ptr + RINGBUF_SIZE;
         do {
             ThreadCpuTime& t = _ringbuf[_read_ptr & (RINGBUF_SIZE - 1)];
@@ -97,12 +181,15 @@ class ThreadCpuTimeBuffer {
     }
 };
 
-static ThreadCpuTimeBuffer _thread_cpu_time_buf;
+// One buffer per sampler thread, so that every buffer is drained by the owner of the thread state
+static ThreadCpuTimeBuffer _thread_cpu_time_buf[MAX_WALL_SAMPLERS];
 
 
 long WallClock::_interval;
+long WallClock::_base_interval;
 int WallClock::_signal;
 WallClock::Mode WallClock::_mode;
+int WallClock::_sampler_count;
 
 ThreadState WallClock::getThreadState(void* ucontext) {
     StackFrame frame(ucontext);
@@ -133,7 +220,7 @@ void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
         event._samples = 1;
         u64 trace = Profiler::instance()->recordSample(ucontext, _interval, WALL_CLOCK_SAMPLE, &event);
         if (event._thread_state == THREAD_SLEEPING && trace != 0) {
-            _thread_cpu_time_buf.add(trace);
+            _thread_cpu_time_buf[(u32)(trace >> 32) % _sampler_count].add(trace);
         }
     } else {
         ExecutionEvent event(TSC::ticks());
@@ -142,6 +229,12 @@ void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
     }
 }
 
+// Whether the CPU time of a thread in an idle batch of the given length needs to be polled this cycle
+static inline bool needIdleProbe(u32 counter) {
+    u32 period = counter < IDLE_BACKOFF_CYCLES * 3 ? 1 << (counter / IDLE_BACKOFF_CYCLES) : MAX_IDLE_PROBE_PERIOD;
+    return counter % period == 0 || counter + 1 >= MAX_IDLE_BATCH;
+}
+
 void WallClock::recordWallClock(u64 start_time, ThreadState state, u32 samples, int tid, u32 call_trace_id) {
     WallClockEvent event;
     event._start_time = start_time;
@@ -162,15 +255,31 @@ Error WallClock::start(Arguments& args) {
         // Increase default interval for wall clock mode due to larger number of sampled threads
         _interval = _mode == CPU_ONLY ? DEFAULT_INTERVAL : DEFAULT_INTERVAL * 5;
     }
+    _base_interval = _interval;
 
     _signal = args._signal == 0 ? OS::getProfilingSignal(1)
                                 : ((args._signal >> 8) > 0 ? args._signal >> 8 : args._signal);
     OS::installSignalHandler(_signal, signalHandler);
 
+    _sampler_count = args._wall_threads > 0 ? args._wall_threads : OS::getCpuCount() / CPUS_PER_SAMPLER;
+    if (_sampler_count < 1) {
+        _sampler_count = 1;
+    } else if (_sampler_count > MAX_WALL_SAMPLERS) {
+        _sampler_count = MAX_WALL_SAMPLERS;
+    }
+
+    ThreadRegistry::enable();
     _running = true;
 
-    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
-        return Error("Unable to create timer thread");
+    for (int i = 0; i < _sampler_count; i++) {
+        _samplers[i].wall_clock = this;
+        _samplers[i].index = i;
+        _samplers[i].thread_id = 0;
+        if (pthread_create(&_samplers[i].thread, NULL, threadEntry, &_samplers[i]) != 0) {
+            _sampler_count = i;
+            stop();
+            return Error("Unable to create timer thread");
+        }
     }
 
     return Error::OK;
@@ -178,27 +287,44 @@ Error WallClock::start(Arguments& args) {
 
 void WallClock::stop() {
     _running = false;
-    pthread_kill(_thread, WAKEUP_SIGNAL);
-    pthread_join(_thread, NULL);
+    for (int i = 0; i < _sampler_count; i++) {
+        pthread_kill(_samplers[i].thread, WAKEUP_SIGNAL);
+    }
+    for (int i = 0; i < _sampler_count; i++) {
+        pthread_join(_samplers[i].thread, NULL);
+    }
+    ThreadRegistry::disable();
 }
 
-void WallClock::timerLoop() {
-    int self = OS::threadId();
-    ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
+bool WallClock::isSamplerThread(int thread_id) {
+    for (int i = 0; i < _sampler_count; i++) {
+        if (_samplers[i].thread_id == thread_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void WallClock::timerLoop(int index) {
+    Profiler* profiler = Profiler::instance();
+    ThreadFilter* thread_filter = profiler->threadFilter();
     bool thread_filter_enabled = thread_filter->enabled();
     Mode mode = _mode;
+    u32 sampler_count = _sampler_count;
+    u64 cpu_trace_age = (u64)_interval < MAX_CPU_TRACE_AGE ? (u64)_interval : MAX_CPU_TRACE_AGE;
 
-    ThreadSleepMap thread_sleep_state;
+    ThreadSleepTable thread_sleep_state;
+    ThreadCpuTimeBuffer& thread_cpu_time_buf = _thread_cpu_time_buf[index];
     ThreadList* thread_list = OS::listThreads();
-    _thread_cpu_time_buf.reset();
-    u64 cycle_start_time = OS::nanotime();
+    thread_cpu_time_buf.reset();
+    u64 cycle_start_time = TSC::nanos();
 
     while (_running) {
         bool enabled = _enabled;
 
         for (int signaled_threads = 0; signaled_threads < THREADS_PER_TICK && thread_list->hasNext(); ) {
             int thread_id = thread_list->next();
-            if (thread_id == self || thread_id <= 0) {
+            if (thread_id <= 0 || (u32)thread_id % sampler_count != (u32)index || isSamplerThread(thread_id)) {
                 // On macOS, task_threads() may sporadically return 0 or -1 among thread IDs
                 continue;
             }
@@ -207,11 +333,27 @@ void WallClock::timerLoop() {
             }
 
             if (mode == CPU_ONLY) {
-                if (!enabled || OS::threadState(thread_id) == THREAD_SLEEPING) {
+                if (!enabled) {
+                    continue;
+                }
+                // A thread that has not consumed CPU since the previous cycle is skipped
+                // without reading its state: idle threads are the majority in large applications
+                ThreadSleepState& tss = thread_sleep_state[thread_id];
+                u64 new_thread_cpu_time = OS::threadCpuTime(thread_id);
+                if (new_thread_cpu_time != 0 && new_thread_cpu_time == tss.last_cpu_time) {
+                    continue;
+                }
+                tss.last_cpu_time = new_thread_cpu_time;
+                if (OS::threadState(thread_id) == THREAD_SLEEPING) {
                     continue;
                 }
             } else if (mode == WALL_BATCH) {
                 ThreadSleepState& tss = thread_sleep_state[thread_id];
+                if (enabled && tss.counter != 0 && !needIdleProbe(tss.counter)) {
+                    // Long idle threads are assumed to stay idle between probes
+                    tss.counter++;
+                    continue;
+                }
                 u64 new_thread_cpu_time = enabled ? OS::threadCpuTime(thread_id) : 0;
                 if (new_thread_cpu_time != 0 && new_thread_cpu_time - tss.last_cpu_time <= RUNNABLE_THRESHOLD_NS) {
                     if (++tss.counter < MAX_IDLE_BATCH) {
@@ -223,6 +365,14 @@ void WallClock::timerLoop() {
                     recordWallClock(tss.start_time, THREAD_SLEEPING, tss.counter, thread_id, tss.call_trace_id);
                     tss.counter = 0;
                 }
+
+                // The thread is running and has just been walked by the CPU engine
+                u32 cpu_trace = enabled ? profiler->recentCpuTrace(thread_id, TSC::nanos() - cpu_trace_age) : 0;
+                if (cpu_trace != 0) {
+                    recordWallClock(TSC::ticks(), THREAD_RUNNING, 1, thread_id, cpu_trace);
+                    signaled_threads++;
+                    continue;
+                }
             }
 
             if (enabled && OS::sendSignalToThread(thread_id, _signal)) {
@@ -230,7 +380,7 @@ void WallClock::timerLoop() {
             }
         }
 
-        u64 current_time = OS::nanotime();
+        u64 current_time = TSC::nanos();
         if (thread_list->hasNext()) {
             // Try to keep interval stable regardless of the number of profiled threads
             long long sleep_time = cycle_start_time + (u64)_interval * thread_list->index() / thread_list->count() - current_time;
@@ -248,16 +398,16 @@ void WallClock::timerLoop() {
         }
 
         // Sync thread CPU times updated since the previous iteration
-        _thread_cpu_time_buf.drain(thread_sleep_state);
+        thread_cpu_time_buf.drain(thread_sleep_state);
     }
 
     delete thread_list;
 
     // Flush remaining WallClock batches
-    for (ThreadSleepMap::const_iterator it = thread_sleep_state.begin(); it != thread_sleep_state.end(); ++it) {
-        const ThreadSleepState& tss = it->second;
+    for (u32 i = 0; i < thread_sleep_state.capacity(); i++) {
+        const ThreadSleepState& tss = thread_sleep_state.at(i);
         if (tss.counter != 0) {
-            recordWallClock(tss.start_time, THREAD_SLEEPING, tss.counter, it->first, tss.call_trace_id);
+            recordWallClock(tss.start_time, THREAD_SLEEPING, tss.counter, tss.thread_id, tss.call_trace_id);
         }
     }
 }
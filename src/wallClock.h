@@ -13,6 +13,8 @@
 #include "os.h"
 
 
+const int MAX_WALL_SAMPLERS = 8;
+
 class WallClock : public Engine {
   private:
     enum Mode {
@@ -22,16 +24,30 @@ class WallClock : public Engine {
     };
 
     static long _interval;
+    static long _base_interval;
     static int _signal;
     static Mode _mode;
 
+    // Every sampler thread walks the threads with tid % _sampler_count == index
+    struct Sampler {
+        WallClock* wall_clock;
+        int index;
+        volatile int thread_id;
+        pthread_t thread;
+    };
+
+    static int _sampler_count;
+
     volatile bool _running;
-    pthread_t _thread;
+    Sampler _samplers[MAX_WALL_SAMPLERS];
 
-    void timerLoop();
+    bool isSamplerThread(int thread_id);
+    void timerLoop(int index);
 
-    static void* threadEntry(void* wall_clock) {
-        ((WallClock*)wall_clock)->timerLoop();
+    static void* threadEntry(void* sampler) {
+        Sampler* s = (Sampler*)sampler;
+        s->thread_id = OS::threadId();
+        s->wall_clock->timerLoop(s->index);
         return NULL;
     }
 
@@ -56,6 +72,11 @@ class WallClock : public Engine {
 
     Error start(Arguments& args);
     void stop();
+
+    // Stretches the sampling interval to stay within the overhead budget
+    static void setIntervalScale(u32 scale) {
+        _interval = _base_interval * scale;
+    }
 };
 
 #endif // _WALLCLOCK_H
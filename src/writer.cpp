@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "writer.h"
 
 
@@ -34,43 +35,66 @@ Writer& Writer::operator<<(long n) {
     return *this;
 }
 
-FileWriter::FileWriter(const char* file_name) : _size(0) {
+FileWriter::FileWriter(const char* file_name, size_t buf_size) : _size(0), _capacity(buf_size) {
     _fd = open(file_name, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-    _buf = (char*)malloc(BUF_SIZE);
+    _buf = (char*)malloc(buf_size);
 }
 
-FileWriter::FileWriter(int fd) : _fd(fd), _size(0) {
-    _buf = (char*)malloc(BUF_SIZE);
+FileWriter::FileWriter(int fd, size_t buf_size) : _fd(fd), _size(0), _capacity(buf_size) {
+    _buf = (char*)malloc(buf_size);
 }
 
 FileWriter::~FileWriter() {
-    flush(_buf, _size);
+    flush(NULL, 0);
     free(_buf);
     if (_fd > STDERR_FILENO) {
         close(_fd);
     }
 }
 
+int FileWriter::detach() {
+    flush(NULL, 0);
+    int fd = _fd;
+    _fd = -1;
+    return fd;
+}
+
 void FileWriter::flush(const char* data, size_t len) {
-    while (len > 0) {
-        ssize_t bytes = ::write(_fd, data, len);
+    struct iovec iov[2] = {{_buf, _size}, {(void*)data, len}};
+    struct iovec* v = iov;
+    int count = 2;
+    _size = 0;
+
+    while (count > 0) {
+        if (v->iov_len == 0) {
+            v++;
+            count--;
+            continue;
+        }
+
+        ssize_t bytes = ::writev(_fd, v, count);
         if (bytes < 0) {
             _err = errno;
             break;
         }
-        data += bytes;
-        len -= (size_t)bytes;
+        for (; count > 0 && (size_t)bytes >= v->iov_len; v++, count--) {
+            bytes -= v->iov_len;
+        }
+        if (count > 0) {
+            v->iov_base = (char*)v->iov_base + bytes;
+            v->iov_len -= bytes;
+        }
     }
 }
 
 void FileWriter::write(const char* data, size_t len) {
-    if (_size + len > BUF_SIZE) {
-        flush(_buf, _size);
-        _size = 0;
-        if (len > BUF_SIZE) {
+    if (_size + len > _capacity) {
+        if (len >= _capacity / 2) {
+            // Large data goes to the file directly after the buffered part, skipping the copy
             flush(data, len);
             return;
         }
+        flush(NULL, 0);
     }
     memcpy(_buf + _size, data, len);
     _size += len;
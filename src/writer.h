@@ -35,20 +35,25 @@ class FileWriter : public Writer {
     int _fd;
     char* _buf;
     size_t _size;
+    size_t _capacity;
 
-    enum { BUF_SIZE = 8192 };
-
+    // Writes the buffered data followed by the given data with a single writev
     void flush(const char* data, size_t len);
 
   public:
-    FileWriter(const char* file_name);
-    FileWriter(int fd);
+    enum { DEFAULT_BUF_SIZE = 65536 };
+
+    FileWriter(const char* file_name, size_t buf_size = DEFAULT_BUF_SIZE);
+    FileWriter(int fd, size_t buf_size = DEFAULT_BUF_SIZE);
     ~FileWriter();
 
     bool is_open() const {
         return _fd >= 0;
     }
 
+    // Flushes buffered data and hands the file descriptor over to the caller
+    int detach();
+
     virtual void write(const char* data, size_t len);
 };
 
@@ -6,7 +6,9 @@
 #include <dlfcn.h>
 #include <stdlib.h>
 #include "hooks.h"
+#include "httpServer.h"
 #include "profiler.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
@@ -23,8 +25,11 @@ class LateInitializer {
             dlopen(dl_info.dli_fname, RTLD_LAZY | RTLD_NODELETE);
         }
 
+        // A short-lived native process should not wait for symbols of all its libraries at startup
+        const char* command = getenv("ASPROF_COMMAND");
+        Symbols::deferSymbols(command != NULL && lazySymbols(command));
+
         if (!checkJvmLoaded()) {
-            const char* command = getenv("ASPROF_COMMAND");
             if (command != NULL && Hooks::init(false)) {
                 startProfiler(command);
             }
@@ -32,11 +37,21 @@ class LateInitializer {
     }
 
   private:
+    bool lazySymbols(const char* command) {
+        Arguments args;
+        return !args.parse(command) && args._lazy_symbols;
+    }
+
     bool checkJvmLoaded() {
         Profiler* profiler = Profiler::instance();
         profiler->updateSymbols(false);
 
         CodeCache* libjvm = profiler->findLibraryByName(OS::isLinux() ? "libjvm.so" : "libjvm.dylib");
+        if (libjvm != NULL) {
+            // Java profiling relies on complete symbols of the JVM
+            Symbols::deferSymbols(false);
+            profiler->loadDeferredSymbols();
+        }
         if (libjvm != NULL && libjvm->findSymbol("AsyncGetCallTrace") != NULL) {
             VMStructs::init(libjvm);
             if (CollectedHeap::created()) {  // heap is already created => this is dynamic attach
@@ -59,6 +74,14 @@ class LateInitializer {
         if (error || (error = Profiler::instance()->run(_global_args))) {
             Log::error("%s", error.message());
         }
+
+        if (_global_args._server != NULL) {
+            if (HttpServer::start(_global_args._server)) {
+                Log::info("Profiler server started at %s", _global_args._server);
+            } else {
+                Log::error("Failed to start profiler server");
+            }
+        }
     }
 };
 
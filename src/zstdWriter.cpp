@@ -0,0 +1,95 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include "zstdWriter.h"
+
+
+const size_t ZSTD_BUFFER_SIZE = 64 * 1024;
+
+// ZSTD_EndDirective values
+const int ZSTD_E_CONTINUE = 0;
+const int ZSTD_E_END = 2;
+
+typedef void* (*ZSTD_createCCtx_t)();
+typedef size_t (*ZSTD_freeCCtx_t)(void* cctx);
+typedef size_t (*ZSTD_compressStream2_t)(void* cctx, ZstdOutBuffer* output, ZstdInBuffer* input, int end_op);
+typedef unsigned (*ZSTD_isError_t)(size_t code);
+
+static ZSTD_createCCtx_t _ZSTD_createCCtx = NULL;
+static ZSTD_compressStream2_t _ZSTD_compressStream2 = NULL;
+static ZSTD_isError_t _ZSTD_isError = NULL;
+static ZSTD_freeCCtx_t _ZSTD_freeCCtx = NULL;
+
+
+bool ZstdWriter::available() {
+    if (_ZSTD_freeCCtx != NULL) {
+        return true;
+    }
+
+    void* lib = dlopen(ZSTD_LIB_NAME, RTLD_LAZY);
+    if (lib == NULL) {
+        return false;
+    }
+
+    _ZSTD_createCCtx = (ZSTD_createCCtx_t)dlsym(lib, "ZSTD_createCCtx");
+    _ZSTD_compressStream2 = (ZSTD_compressStream2_t)dlsym(lib, "ZSTD_compressStream2");
+    _ZSTD_isError = (ZSTD_isError_t)dlsym(lib, "ZSTD_isError");
+    ZSTD_freeCCtx_t free_cctx = (ZSTD_freeCCtx_t)dlsym(lib, "ZSTD_freeCCtx");
+    if (_ZSTD_createCCtx == NULL || _ZSTD_compressStream2 == NULL || _ZSTD_isError == NULL || free_cctx == NULL) {
+        // ZSTD_compressStream2 appeared in zstd 1.4.0
+        dlclose(lib);
+        return false;
+    }
+
+    __atomic_store_n(&_ZSTD_freeCCtx, free_cctx, __ATOMIC_RELEASE);
+    return true;
+}
+
+ZstdWriter::ZstdWriter(Writer& out) : _out(out), _cctx(NULL), _buf(NULL) {
+    if (available() && (_buf = (char*)malloc(ZSTD_BUFFER_SIZE)) != NULL) {
+        _cctx = _ZSTD_createCCtx();
+    }
+}
+
+ZstdWriter::~ZstdWriter() {
+    if (_cctx != NULL) {
+        compress(NULL, 0, ZSTD_E_END);
+        _ZSTD_freeCCtx(_cctx);
+    }
+    free(_buf);
+}
+
+void ZstdWriter::compress(const char* data, size_t len, int mode) {
+    ZstdInBuffer input = {data, len, 0};
+
+    size_t remaining;
+    do {
+        ZstdOutBuffer output = {_buf, ZSTD_BUFFER_SIZE, 0};
+        remaining = _ZSTD_compressStream2(_cctx, &output, &input, mode);
+        if (output.pos > 0) {
+            _out.write(_buf, output.pos);
+        }
+        if (_ZSTD_isError(remaining)) {
+            _err = EIO;
+            return;
+        }
+        // With ZSTD_e_end, a non-zero result means the frame epilogue is not flushed yet
+    } while (input.pos < input.size || (mode == ZSTD_E_END && remaining != 0));
+
+    if (!_out.good()) {
+        _err = EIO;
+    }
+}
+
+void ZstdWriter::write(const char* data, size_t len) {
+    if (_cctx != NULL) {
+        compress(data, len, ZSTD_E_CONTINUE);
+    } else {
+        _out.write(data, len);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _ZSTDWRITER_H
+#define _ZSTDWRITER_H
+
+#include "writer.h"
+
+#ifdef __APPLE__
+const char* const ZSTD_LIB_NAME = "libzstd.1.dylib";
+#else
+const char* const ZSTD_LIB_NAME = "libzstd.so.1";
+#endif
+
+
+// Layouts of ZSTD_inBuffer and ZSTD_outBuffer, part of the stable zstd API
+struct ZstdInBuffer {
+    const void* src;
+    size_t size;
+    size_t pos;
+};
+
+struct ZstdOutBuffer {
+    void* dst;
+    size_t size;
+    size_t pos;
+};
+
+// Compresses everything written to it into a single zstd frame on top of another Writer.
+// libzstd (1.4.0+) is loaded on demand; if it is not available, data is passed through uncompressed.
+class ZstdWriter : public Writer {
+  private:
+    Writer& _out;
+    void* _cctx;
+    char* _buf;
+
+    void compress(const char* data, size_t len, int mode);
+
+  public:
+    ZstdWriter(Writer& out);
+    ~ZstdWriter();
+
+    static bool available();
+
+    bool active() const {
+        return _cctx != NULL;
+    }
+
+    virtual void write(const char* data, size_t len);
+};
+
+#endif // _ZSTDWRITER_H
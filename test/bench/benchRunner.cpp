@@ -0,0 +1,164 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "benchRunner.hpp"
+#include "os.h"
+
+// Latency is measured over batches of operations, since timing a single one costs more than most of them
+const int BENCH_BATCH_OPS = 64;
+const u64 DEFAULT_BENCH_MILLIS = 1000;
+const u64 BENCH_WARMUP_MILLIS = 200;
+
+struct BenchThread {
+    pthread_t thread;
+    int index;
+    Benchmark* benchmark;
+    long max_ops;
+    volatile bool* start;
+    volatile bool* stop;
+    u64 ops;
+    u64 nanos;
+    std::vector<u32> batch_nanos;
+};
+
+static void* benchThreadEntry(void* arg) {
+    BenchThread* t = (BenchThread*)arg;
+    while (!*t->start) {
+        // Spin so that all threads begin together
+    }
+
+    // Warm-up batches are neither counted nor timed
+    u64 warmup_end = OS::nanotime() + BENCH_WARMUP_MILLIS * 1000000;
+    long warmup_ops = 0;
+    while (!*t->stop && OS::nanotime() < warmup_end && (t->max_ops < 0 || warmup_ops < t->max_ops / 10)) {
+        t->benchmark->run(t->index, BENCH_BATCH_OPS);
+        warmup_ops += BENCH_BATCH_OPS;
+    }
+
+    while (!*t->stop && (t->max_ops < 0 || (long)t->ops < t->max_ops)) {
+        u64 start = OS::nanotime();
+        t->benchmark->run(t->index, BENCH_BATCH_OPS);
+        u64 elapsed = OS::nanotime() - start;
+        t->nanos += elapsed;
+        t->ops += BENCH_BATCH_OPS;
+        t->batch_nanos.push_back(elapsed > 0xffffffff ? 0xffffffff : (u32)elapsed);
+    }
+    return NULL;
+}
+
+static double batchPercentile(std::vector<u32>& v, double p) {
+    if (v.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + index, v.end());
+    return (double)v[index] / BENCH_BATCH_OPS;
+}
+
+// One JSON object per line: per-op latency is averaged over a batch, throughput is for all threads
+static void runBenchmark(const std::string& name, BenchmarkFactory factory, int threads, u64 millis) {
+    Benchmark* benchmark = factory();
+    benchmark->setUp(threads);
+
+    volatile bool start = false;
+    volatile bool stop = false;
+    std::vector<BenchThread> t(threads);
+    for (int i = 0; i < threads; i++) {
+        t[i].index = i;
+        t[i].benchmark = benchmark;
+        t[i].max_ops = benchmark->maxOps();
+        t[i].start = &start;
+        t[i].stop = &stop;
+        t[i].ops = 0;
+        t[i].nanos = 0;
+        pthread_create(&t[i].thread, NULL, benchThreadEntry, &t[i]);
+    }
+
+    u64 begin = OS::nanotime();
+    start = true;
+    OS::sleep((BENCH_WARMUP_MILLIS + millis) * 1000000);
+    stop = true;
+
+    u64 ops = 0;
+    u64 nanos = 0;
+    std::vector<u32> batches;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(t[i].thread, NULL);
+        ops += t[i].ops;
+        nanos += t[i].nanos;
+        batches.insert(batches.end(), t[i].batch_nanos.begin(), t[i].batch_nanos.end());
+    }
+    double seconds = (OS::nanotime() - begin) / 1e9;
+    delete benchmark;
+
+    double thread_seconds = nanos / 1e9 / threads;
+    printf("{\"benchmark\":\"%s\",\"threads\":%d,\"ops\":%llu,\"seconds\":%.3f,"
+           "\"ops_per_sec\":%.0f,\"ns_per_op\":%.2f,\"p50_ns\":%.2f,\"p99_ns\":%.2f}\n",
+           name.c_str(), threads, (unsigned long long)ops, seconds,
+           thread_seconds > 0 ? ops / thread_seconds : 0, ops > 0 ? (double)nanos / ops : 0,
+           batchPercentile(batches, 0.5), batchPercentile(batches, 0.99));
+    fflush(stdout);
+}
+
+static void parseThreads(const char* list, std::vector<int>& threads) {
+    threads.clear();
+    for (const char* p = list; *p; ) {
+        int n = atoi(p);
+        if (n > 0) threads.push_back(n);
+        const char* comma = strchr(p, ',');
+        if (comma == NULL) break;
+        p = comma + 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    return BenchRunner::instance()->runAll(argc, argv);
+}
+
+BenchRunner* BenchRunner::instance() {
+    static BenchRunner instance;
+    return &instance;
+}
+
+// Usage: benchmarks [-t THREADS,...] [-d MILLIS] [FILTER...]
+// A benchmark runs if its name contains any of the filters
+int BenchRunner::runAll(int argc, char** argv) {
+    std::vector<int> threads;
+    int cpus = OS::getCpuCount();
+    for (int n = 1; n <= 8 && n <= (cpus > 1 ? cpus : 1); n *= 2) {
+        threads.push_back(n);
+    }
+    u64 millis = DEFAULT_BENCH_MILLIS;
+    std::vector<const char*> filters;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            parseThreads(argv[++i], threads);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            millis = strtoull(argv[++i], NULL, 10);
+        } else {
+            filters.push_back(argv[i]);
+        }
+    }
+
+    for (auto& it : _benchmarks) {
+        bool selected = filters.empty();
+        for (size_t i = 0; i < filters.size() && !selected; i++) {
+            selected = strstr(it.first.c_str(), filters[i]) != NULL;
+        }
+        if (selected) {
+            for (size_t i = 0; i < threads.size(); i++) {
+                runBenchmark(it.first, it.second, threads[i], millis);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _BENCHRUNNER_HPP
+#define _BENCHRUNNER_HPP
+
+#include <map>
+#include <string>
+
+// A benchmark measures one operation of a profiler data structure. A new instance is created
+// for every thread count, so that each run starts from the same state.
+class Benchmark {
+  public:
+    virtual ~Benchmark() {
+    }
+
+    // Called before the threads start
+    virtual void setUp(int threads) {
+    }
+
+    // Performs the given number of operations on the thread with index 0 .. threads - 1
+    virtual void run(int thread, int ops) = 0;
+
+    // Upper bound of operations per thread, for benchmarks whose memory grows with every operation
+    virtual long maxOps() {
+        return -1;
+    }
+};
+
+typedef Benchmark* (*BenchmarkFactory)();
+
+class BenchRunner {
+  private:
+    std::map<std::string, BenchmarkFactory> _benchmarks;
+
+  public:
+    static BenchRunner* instance();
+
+    void add(const char* name, BenchmarkFactory factory) {
+        _benchmarks[name] = factory;
+    }
+
+    int runAll(int argc, char** argv);
+};
+
+struct BenchRegistrar {
+    BenchRegistrar(const char* name, BenchmarkFactory factory) {
+        BenchRunner::instance()->add(name, factory);
+    }
+};
+
+#define BENCHMARK(name, cls)                                          \
+    static Benchmark* create_##cls() {                                \
+        return new cls();                                             \
+    }                                                                 \
+    static BenchRegistrar registrar_##cls(name, create_##cls)
+
+#endif // _BENCHRUNNER_HPP
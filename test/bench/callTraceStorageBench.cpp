@@ -0,0 +1,42 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "benchRunner.hpp"
+#include "callTraceStorage.h"
+
+// Distinct stacks drawn by every thread; most puts find an existing trace, as in a real profile
+const int PUT_BENCH_TRACES = 4096;
+const int PUT_BENCH_DEPTH = 32;
+
+class CallTraceStoragePut : public Benchmark {
+  private:
+    CallTraceStorage _storage;
+    ASGCT_CallFrame _frames[PUT_BENCH_TRACES][PUT_BENCH_DEPTH];
+    u64 _next[64][8];  // per thread, padded to a cache line
+
+  public:
+    void setUp(int threads) {
+        for (int i = 0; i < PUT_BENCH_TRACES; i++) {
+            for (int j = 0; j < PUT_BENCH_DEPTH; j++) {
+                _frames[i][j].bci = j;
+                _frames[i][j].method_id = (jmethodID)(uintptr_t)(1 + (j < 24 ? j : i * 8 + j));
+            }
+        }
+        for (int i = 0; i < 64; i++) {
+            _next[i][0] = i * 7919;
+        }
+    }
+
+    void run(int thread, int ops) {
+        u64 next = _next[thread & 63][0];
+        for (int i = 0; i < ops; i++) {
+            next = next * 6364136223846793005ULL + 1442695040888963407ULL;
+            _storage.put(PUT_BENCH_DEPTH, _frames[(next >> 33) % PUT_BENCH_TRACES], 1, thread);
+        }
+        _next[thread & 63][0] = next;
+    }
+};
+
+BENCHMARK("CallTraceStorage.put", CallTraceStoragePut);
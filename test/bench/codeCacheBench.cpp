@@ -0,0 +1,83 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "benchRunner.hpp"
+#include "codeCache.h"
+#include "dwarf.h"
+
+// A large library such as libjvm: functions of 64 bytes on average, one DWARF row per 16 bytes.
+// Addresses are never dereferenced.
+const int SEARCH_BENCH_SYMBOLS = 100000;
+static const char* const SEARCH_BENCH_BASE = (const char*)0x7f0000000000;
+const u32 SEARCH_BENCH_TEXT_SIZE = SEARCH_BENCH_SYMBOLS * 64;
+
+static u32 nextBenchAddress(u32& seed) {
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 4) ^ (seed << 9)) % SEARCH_BENCH_TEXT_SIZE;
+}
+
+class CodeCacheBinarySearch : public Benchmark {
+  private:
+    CodeCache _cc;
+    const char* volatile _sink;
+
+  public:
+    CodeCacheBinarySearch() : _cc("libbench.so", 0, false, SEARCH_BENCH_BASE, SEARCH_BENCH_BASE + SEARCH_BENCH_TEXT_SIZE) {
+    }
+
+    void setUp(int threads) {
+        char name[32];
+        u32 seed = 1;
+        for (int i = 0; i < SEARCH_BENCH_SYMBOLS; i++) {
+            snprintf(name, sizeof(name), "function%d", i);
+            _cc.add(SEARCH_BENCH_BASE + i * 64, 16 + (nextBenchAddress(seed) & 47), name);
+        }
+        _cc.sort();
+    }
+
+    void run(int thread, int ops) {
+        u32 seed = thread * 7919 + 1;
+        for (int i = 0; i < ops; i++) {
+            _sink = _cc.binarySearch(SEARCH_BENCH_BASE + nextBenchAddress(seed));
+        }
+    }
+};
+
+class CodeCacheFindFrameDesc : public Benchmark {
+  private:
+    CodeCache _cc;
+    FrameDesc* volatile _sink;
+
+  public:
+    CodeCacheFindFrameDesc() : _cc("libbench.so") {
+    }
+
+    void setUp(int threads) {
+        int rows = SEARCH_BENCH_TEXT_SIZE / 16;
+        FrameDesc* table = (FrameDesc*)malloc(rows * sizeof(FrameDesc));
+        for (int i = 0; i < rows; i++) {
+            // Prologue, body and epilogue of every function
+            int phase = i % 4 == 0 ? 0 : i % 4 == 3 ? 2 : 1;
+            table[i].loc = i * 16;
+            table[i].cfa = DW_REG_SP | (phase == 1 ? 16 : 8) << 8;
+            table[i].fp_off = phase == 1 ? -16 : DW_SAME_FP;
+            table[i].pc_off = -8;
+        }
+        _cc.setTextBase(SEARCH_BENCH_BASE);
+        _cc.setDwarfTable(table, rows);
+    }
+
+    void run(int thread, int ops) {
+        u32 seed = thread * 7919 + 1;
+        for (int i = 0; i < ops; i++) {
+            _sink = _cc.findFrameDesc(SEARCH_BENCH_BASE + nextBenchAddress(seed));
+        }
+    }
+};
+
+BENCHMARK("CodeCache.binarySearch", CodeCacheBinarySearch);
+BENCHMARK("CodeCache.findFrameDesc", CodeCacheFindFrameDesc);
@@ -0,0 +1,36 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "benchRunner.hpp"
+#include "dictionary.h"
+
+// Class names of a mid-sized application, all present before the measurement
+const int LOOKUP_BENCH_KEYS = 16384;
+
+class DictionaryLookup : public Benchmark {
+  private:
+    Dictionary _dictionary;
+    char _keys[LOOKUP_BENCH_KEYS][48];
+
+  public:
+    void setUp(int threads) {
+        for (int i = 0; i < LOOKUP_BENCH_KEYS; i++) {
+            snprintf(_keys[i], sizeof(_keys[i]), "com/example/package%d/Class%d", i % 97, i);
+            _dictionary.lookup(_keys[i]);
+        }
+    }
+
+    void run(int thread, int ops) {
+        unsigned int index = thread * 7919;
+        for (int i = 0; i < ops; i++) {
+            index = (index + 40503) % LOOKUP_BENCH_KEYS;
+            _dictionary.lookup(_keys[index]);
+        }
+    }
+};
+
+BENCHMARK("Dictionary.lookup", DictionaryLookup);
@@ -0,0 +1,47 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <vector>
+#include "benchRunner.hpp"
+#include "jfrBuffer.h"
+
+// Encodes an execution sample the way Recording does: size placeholder, type, varint fields
+class JfrBufferEncode : public Benchmark {
+  private:
+    std::vector<RecordingBuffer*> _buffers;
+
+  public:
+    void setUp(int threads) {
+        for (int i = 0; i < threads; i++) {
+            _buffers.push_back(new RecordingBuffer());
+        }
+    }
+
+    ~JfrBufferEncode() {
+        for (size_t i = 0; i < _buffers.size(); i++) {
+            delete _buffers[i];
+        }
+    }
+
+    void run(int thread, int ops) {
+        Buffer* buf = _buffers[thread];
+        u64 time = 0x123456789aULL + thread;
+        for (int i = 0; i < ops; i++) {
+            if (buf->offset() >= RECORDING_BUFFER_LIMIT) {
+                buf->reset();
+            }
+            int start = buf->skip(1);
+            buf->putVar64(101);
+            buf->putVar64(time += 997);
+            buf->putVar32(thread + 1000);
+            buf->putVar32(i * 31 + 1);
+            buf->putVar32(i & 7);
+            buf->putVar64((u64)i << 20);
+            buf->put8(start, buf->offset() - start);
+        }
+    }
+};
+
+BENCHMARK("JfrBuffer.encode", JfrBufferEncode);
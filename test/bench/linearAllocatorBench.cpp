@@ -0,0 +1,32 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "benchRunner.hpp"
+#include "linearAllocator.h"
+
+// Size of a short call trace; memory is never reused, hence the bounded number of operations
+const int ALLOC_BENCH_SIZE = 48;
+const long ALLOC_BENCH_OPS = 2000000;
+
+class LinearAllocatorAlloc : public Benchmark {
+  private:
+    LinearAllocator _allocator;
+
+  public:
+    LinearAllocatorAlloc() : _allocator(8 * 1024 * 1024) {
+    }
+
+    void run(int thread, int ops) {
+        for (int i = 0; i < ops; i++) {
+            *(volatile char*)_allocator.alloc(ALLOC_BENCH_SIZE) = 0;
+        }
+    }
+
+    long maxOps() {
+        return ALLOC_BENCH_OPS;
+    }
+};
+
+BENCHMARK("LinearAllocator.alloc", LinearAllocatorAlloc);
@@ -0,0 +1,35 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "benchRunner.hpp"
+#include "threadFilter.h"
+
+const int ACCEPT_BENCH_THREADS = 100000;
+
+class ThreadFilterAccept : public Benchmark {
+  private:
+    ThreadFilter _filter;
+    int _sink;
+
+  public:
+    void setUp(int threads) {
+        _filter.init("");
+        for (int tid = 1; tid < ACCEPT_BENCH_THREADS; tid += 3) {
+            _filter.add(tid);
+        }
+    }
+
+    void run(int thread, int ops) {
+        int tid = thread * 7919;
+        int accepted = 0;
+        for (int i = 0; i < ops; i++) {
+            tid = (tid + 40503) % ACCEPT_BENCH_THREADS;
+            accepted += _filter.accept(tid) ? 1 : 0;
+        }
+        *(volatile int*)&_sink = accepted;
+    }
+};
+
+BENCHMARK("ThreadFilter.accept", ThreadFilterAccept);
@@ -0,0 +1,45 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "adaptiveDepth.h"
+#include "testRunner.hpp"
+
+TEST_CASE(AdaptiveDepth_disabled_uses_max_depth) {
+    AdaptiveDepth depth;
+    ASSERT(depth.init(0));
+    CHECK(!depth.enabled());
+    CHECK_EQ(depth.limit(100, 2048), 2048);
+
+    depth.update(100, 2048, 2048, 2048);
+    CHECK_EQ(depth.limit(100, 2048), 2048);
+}
+
+TEST_CASE(AdaptiveDepth_grows_for_truncated_threads) {
+    AdaptiveDepth depth;
+    ASSERT(depth.init(64));
+    CHECK(depth.enabled());
+    CHECK_EQ(depth.limit(100, 2048), 64);
+    CHECK_EQ(depth.limit(100, 32), 32);
+
+    // A complete stack keeps the limit
+    depth.update(100, 64, 40, 2048);
+    CHECK_EQ(depth.limit(100, 2048), 64);
+
+    // Every truncated stack doubles it until the maximum depth
+    depth.update(100, 64, 64, 2048);
+    CHECK_EQ(depth.limit(100, 2048), 128);
+    CHECK_EQ(depth.limit(101, 2048), 64);
+
+    for (int i = 0; i < 10; i++) {
+        int limit = depth.limit(100, 2048);
+        depth.update(100, limit, limit, 2048);
+    }
+    CHECK_EQ(depth.limit(100, 2048), 2048);
+    CHECK_EQ(depth.limit(100, 100000), 100000);
+
+    // A new session starts over
+    ASSERT(depth.init(16));
+    CHECK_EQ(depth.limit(100, 2048), 16);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include "addressSet.h"
+#include "testRunner.hpp"
+
+TEST_CASE(AddressSet_insert_remove) {
+    const u32 capacity = 1024;
+    uintptr_t* memory = (uintptr_t*)calloc(capacity, sizeof(uintptr_t));
+    AddressSet set;
+    set.init(memory, capacity);
+
+    for (uintptr_t a = 0x1000; a < 0x1000 + 500 * 16; a += 16) {
+        set.insert(a);
+    }
+    CHECK(!set.overflow());
+    CHECK(set.contains(0x1000));
+    CHECK(!set.contains(0x1008));
+
+    CHECK(set.remove(0x1000));
+    CHECK(!set.remove(0x1000));
+    CHECK(!set.contains(0x1000));
+    CHECK(set.contains(0x1010));
+
+    // A tombstone does not break the probe sequence of other addresses
+    int found = 0;
+    for (uintptr_t a = 0x1010; a < 0x1000 + 500 * 16; a += 16) {
+        found += set.remove(a) ? 1 : 0;
+    }
+    CHECK_EQ(found, 499);
+
+    set.reset();
+    CHECK(!set.contains(0x1010));
+    free(memory);
+}
+
+TEST_CASE(AddressSet_overflow_accepts_everything) {
+    const u32 capacity = 64;
+    uintptr_t* memory = (uintptr_t*)calloc(capacity, sizeof(uintptr_t));
+    AddressSet set;
+    set.init(memory, capacity);
+
+    for (uintptr_t a = 1; a <= capacity + 1; a++) {
+        set.insert(a * 8);
+    }
+    CHECK(set.overflow());
+    CHECK(set.contains(0x123456));
+    CHECK(set.remove(0x123456));
+
+    set.reset();
+    CHECK(!set.overflow());
+    CHECK(!set.contains(0x123456));
+    free(memory);
+}
+
+TEST_CASE(AddressSet_slots_of_live_addresses) {
+    const u32 capacity = 256;
+    uintptr_t* memory = (uintptr_t*)calloc(capacity, sizeof(uintptr_t));
+    AddressSet set;
+    set.init(memory, capacity);
+
+    int slot = set.insert(0x7000);
+    ASSERT_OP(slot, >=, 0);
+    CHECK_EQ(set.find(0x7000), slot);
+    CHECK_EQ(set.at(slot), (uintptr_t)0x7000);
+    CHECK_EQ(set.find(0x7010), -1);
+
+    CHECK(set.removeAt(slot, 0x7000));
+    CHECK(!set.removeAt(slot, 0x7000));
+    CHECK_EQ(set.at(slot), (uintptr_t)0);
+    CHECK_EQ(set.find(0x7000), -1);
+    free(memory);
+}
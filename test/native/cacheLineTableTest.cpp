@@ -0,0 +1,35 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "cacheLineTable.h"
+#include "testRunner.hpp"
+
+static CacheLineTable cache_line_table;
+
+TEST_CASE(CacheLineTable_groups_words_by_line) {
+    ASSERT(cache_line_table.init());
+    cache_line_table.reset();
+
+    // Two fields of the same line written by different cores, one field on another line
+    cache_line_table.add(0x10000, true, 7);
+    cache_line_table.add(0x10008, true, 7);
+    cache_line_table.add(0x10008, false, 0);
+    cache_line_table.add(0x10040, false, 8);
+
+    std::vector<CacheLineEntry> entries;
+    cache_line_table.collect(entries);
+    ASSERT_EQ(entries.size(), (size_t)2);
+
+    const CacheLineEntry& first = entries[0].line == (0x10000 >> CACHE_LINE_BITS) ? entries[0] : entries[1];
+    CHECK_EQ(first.samples, (u64)3);
+    CHECK_EQ(first.hitm, (u64)2);
+    CHECK_EQ(first.words, (u32)0x3);
+    CHECK_EQ(first.class_id, (u32)7);
+
+    cache_line_table.reset();
+    entries.clear();
+    cache_line_table.collect(entries);
+    CHECK_EQ(entries.size(), (size_t)0);
+}
@@ -0,0 +1,367 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include <set>
+#include "callTraceStorage.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+static u32 putTestTrace(CallTraceStorage& storage, int n, u64 counter, u32 shard = 0) {
+    ASGCT_CallFrame frames[2];
+    memset(frames, 0, sizeof(frames));
+    frames[0].bci = n;
+    frames[0].method_id = (jmethodID)(uintptr_t)(n * 8 + 8);
+    frames[1].bci = 0;
+    frames[1].method_id = (jmethodID)(uintptr_t)0x1000;
+    return storage.put(2, frames, counter, shard);
+}
+
+TEST_CASE(CallTraceStorage_ids_survive_resize) {
+    CallTraceStorage storage;
+    const int count = 200000;
+
+    std::vector<u32> ids(count);
+    for (int i = 0; i < count; i++) {
+        ids[i] = putTestTrace(storage, i, 1);
+    }
+    CHECK_OP(storage.capacity(), >, 65536U);
+
+    for (int i = 0; i < count; i++) {
+        ASSERT_EQ(putTestTrace(storage, i, 1), ids[i]);
+    }
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    CHECK_EQ(samples.size(), (size_t)count);
+
+    u64 total = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        total += samples[i]->samples;
+    }
+    CHECK_EQ(total, (u64)count * 2);
+}
+
+TEST_CASE(CallTraceStorage_add_and_collect) {
+    CallTraceStorage storage;
+
+    u32 id = putTestTrace(storage, 1, 0);
+    storage.add(id, 3, 300);
+    storage.add(0x7fffffff, 1, 1);
+
+    CallTraceStorageStats stats;
+    storage.stats(stats);
+    CHECK_EQ(stats.size, (u64)1);
+    CHECK_EQ(stats.probes[0], (u64)1);
+    CHECK_EQ(stats.max_probe, 1U);
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    ASSERT_EQ(traces.size(), (size_t)1);
+    CHECK_EQ(traces.begin()->first, id);
+    CHECK_EQ(traces[id]->num_frames, 2);
+
+    // Samples are reset by collectTraces
+    traces.clear();
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), (size_t)0);
+
+    storage.clear();
+    CHECK_EQ(storage.capacity(), 65536U);
+    CHECK_EQ(putTestTrace(storage, 2, 1), 1U);
+}
+
+TEST_CASE(CallTraceStorage_collect_sample_counts) {
+    CallTraceStorage storage;
+
+    u32 hot = putTestTrace(storage, 1, 1);
+    u32 cold = putTestTrace(storage, 2, 1);
+    storage.add(hot, 4, 0);
+
+    std::map<u32, CallTrace*> traces;
+    std::vector<std::pair<u64, u32> > samples;
+    storage.collectTraces(traces, &samples);
+    ASSERT_EQ(samples.size(), (size_t)2);
+
+    std::sort(samples.begin(), samples.end());
+    CHECK_EQ(samples[0].second, cold);
+    CHECK_EQ(samples[0].first, (u64)1);
+    CHECK_EQ(samples[1].second, hot);
+    CHECK_EQ(samples[1].first, (u64)5);
+
+    // Counts are per collection
+    samples.clear();
+    storage.add(cold, 2, 0);
+    storage.collectTraces(traces, &samples);
+    ASSERT_EQ(samples.size(), (size_t)1);
+    CHECK_EQ(samples[0].first, (u64)2);
+}
+
+TEST_CASE(CallTraceStorage_merge_shards) {
+    CallTraceStorage storage;
+
+    u32 id1 = putTestTrace(storage, 5, 10, 1);
+    u32 id2 = putTestTrace(storage, 5, 20, 2);
+    CHECK_NE(id1, id2);
+
+    const std::vector<CallTraceSample>& merged = storage.mergeSamples();
+    ASSERT_EQ(merged.size(), (size_t)1);
+    CHECK_EQ(merged[0].samples, (u64)2);
+    CHECK_EQ(merged[0].counter, (u64)30);
+}
+
+TEST_CASE(CallTraceStorage_merge_incremental) {
+    CallTraceStorage storage;
+
+    putTestTrace(storage, 1, 10, 1);
+    putTestTrace(storage, 2, 20, 1);
+    ASSERT_EQ(storage.mergeSamples().size(), (size_t)2);
+
+    // Only the changed slots contribute, but merged totals stay cumulative
+    putTestTrace(storage, 1, 5, 3);
+    const std::vector<CallTraceSample>& merged = storage.mergeSamples();
+    ASSERT_EQ(merged.size(), (size_t)2);
+    CHECK_EQ(merged[0].samples, (u64)2);
+    CHECK_EQ(merged[0].counter, (u64)15);
+    CHECK_EQ(merged[1].counter, (u64)20);
+
+    storage.resetCounters();
+    putTestTrace(storage, 2, 7, 1);
+    storage.mergeSamples();
+    CHECK_EQ(merged[0].counter, (u64)0);
+    CHECK_EQ(merged[1].counter, (u64)7);
+
+    storage.clear();
+    CHECK_EQ(storage.mergeSamples().size(), (size_t)0);
+}
+
+TEST_CASE(CallTraceStorage_snapshot_baselines) {
+    CallTraceStorage storage;
+
+    putTestTrace(storage, 1, 10, 1);
+    putTestTrace(storage, 2, 20, 2);
+    CHECK_EQ(storage.hasSnapshot(), false);
+    CHECK_EQ(storage.snapshot(), (size_t)2);
+
+    putTestTrace(storage, 1, 5, 3);
+    putTestTrace(storage, 3, 7, 1);
+    const std::vector<CallTraceSample>& merged = storage.mergeSamples();
+    std::vector<CallTraceSample> baselines;
+    storage.collectBaselines(baselines);
+
+    ASSERT_EQ(merged.size(), (size_t)3);
+    ASSERT_EQ(baselines.size(), (size_t)3);
+    CHECK_EQ(merged[0].counter, (u64)15);
+    CHECK_EQ(baselines[0].counter, (u64)10);
+    CHECK_EQ(baselines[1].counter, (u64)20);
+    // The trace first seen after the snapshot has no baseline
+    CHECK_EQ(baselines[2].samples, (u64)0);
+    CHECK_EQ(baselines[2].counter, (u64)0);
+
+    storage.resetCounters();
+    CHECK_EQ(storage.hasSnapshot(), false);
+}
+
+TEST_CASE(CallTraceStorage_shared_prefix) {
+    CallTraceStorage storage;
+    const int depth = 100;
+
+    ASGCT_CallFrame frames[depth];
+    for (int i = 0; i < depth; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(uintptr_t)(i * 8 + 8);
+    }
+    storage.put(depth, frames, 1);
+    frames[0].bci = -1;
+    storage.put(depth, frames, 1);
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    ASSERT_EQ(samples.size(), (size_t)2);
+
+    CallTrace* trace1 = samples[0]->trace;
+    CallTrace* trace2 = samples[1]->trace;
+    ASSERT(trace1->parent);
+    CHECK_EQ(trace1->parent, trace2->parent);
+    CHECK_EQ(trace1->num_frames, depth);
+    CHECK_EQ(trace2->num_frames, depth);
+
+    TraceFrames trace_frames;
+    const ASGCT_CallFrame* all = trace_frames.get(trace2);
+    for (int i = 0; i < depth; i++) {
+        ASSERT_EQ(all[i].bci, frames[i].bci);
+        ASSERT_EQ(all[i].method_id, frames[i].method_id);
+    }
+}
+
+TEST_CASE(CallTraceStorage_shared_kernel_stack) {
+    CallTraceStorage storage;
+    static const char* kernel_names[] = {"__futex_wait_[k]", "futex_wait_[k]", "do_syscall_64_[k]"};
+    const int depth = 50;
+
+    ASGCT_CallFrame frames[depth];
+    for (int i = 0; i < depth; i++) {
+        if (i < 3) {
+            frames[i].bci = BCI_NATIVE_FRAME;
+            frames[i].method_id = (jmethodID)kernel_names[i];
+        } else {
+            frames[i].bci = i;
+            frames[i].method_id = (jmethodID)(uintptr_t)(i * 8 + 8);
+        }
+    }
+    storage.put(depth, frames, 1);
+    frames[3].bci = -1;
+    storage.put(depth, frames, 1);
+    // Kernel frames alone are stored inline
+    storage.put(3, frames, 1);
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    ASSERT_EQ(samples.size(), (size_t)3);
+
+    CallTrace* trace1 = samples[0]->trace;
+    CallTrace* trace2 = samples[1]->trace;
+    ASSERT(trace1->kernelStack());
+    CHECK_EQ(trace1->kernelStack(), trace2->kernelStack());
+    CHECK_EQ(trace1->kernel_frames, 3);
+    CHECK_EQ(trace2->num_frames, depth);
+    CHECK_EQ(trace2->top().method_id, (jmethodID)kernel_names[0]);
+    CHECK(samples[2]->trace->kernelStack() == NULL);
+
+    CallTraceStorageStats stats;
+    storage.stats(stats);
+    CHECK_EQ(stats.kernel_stacks, 1ULL);
+
+    TraceFrames trace_frames;
+    const ASGCT_CallFrame* all = trace_frames.get(trace2);
+    for (int i = 0; i < depth; i++) {
+        ASSERT_EQ(all[i].bci, frames[i].bci);
+        ASSERT_EQ(all[i].method_id, frames[i].method_id);
+    }
+}
+
+// MurmurHash64A, the previous implementation of CallTraceStorage::calcHash
+static u64 scalarTraceHash(int num_frames, ASGCT_CallFrame* frames) {
+    const u64 M = 0xc6a4a7935bd1e995ULL;
+    const int R = 47;
+
+    int len = num_frames * sizeof(ASGCT_CallFrame);
+    u64 h = len * M;
+
+    typedef u64 __attribute__((may_alias)) word_t;
+    const word_t* data = (const word_t*)frames;
+    const word_t* end = data + len / 8;
+    while (data != end) {
+        u64 k = *data++;
+        k *= M;
+        k ^= k >> R;
+        k *= M;
+        h ^= k;
+        h *= M;
+    }
+
+    h ^= h >> R;
+    h *= M;
+    h ^= h >> R;
+    return h;
+}
+
+TEST_CASE(CallTraceStorage_hash_distinct) {
+    const int depth = 256;
+    ASGCT_CallFrame frames[depth];
+    memset(frames, 0, sizeof(frames));
+
+    // Every frame position and stack depth must affect the hash
+    std::set<u64> hashes;
+    int count = 0;
+    for (int n = 1; n <= depth; n++) {
+        for (int i = 0; i < n; i += 7) {
+            frames[i].method_id = (jmethodID)(uintptr_t)0x1234;
+            hashes.insert(CallTraceStorage::calcHash(n, frames));
+            frames[i].method_id = NULL;
+            count++;
+        }
+    }
+    CHECK_EQ(hashes.size(), (size_t)count);
+}
+
+TEST_CASE(CallTraceStorage_hash_benchmark) {
+    const int depth = 256;
+    const int iterations = 200000;
+    ASGCT_CallFrame frames[depth];
+    for (int i = 0; i < depth; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(uintptr_t)(0x7f0000001000ULL + i * 64);
+    }
+
+    u64 sink = 0;
+    u64 start = OS::nanotime();
+    for (int i = 0; i < iterations; i++) {
+        frames[0].bci = i;
+        sink += scalarTraceHash(depth, frames);
+    }
+    u64 scalar_time = OS::nanotime() - start;
+
+    start = OS::nanotime();
+    for (int i = 0; i < iterations; i++) {
+        frames[0].bci = i;
+        sink += CallTraceStorage::calcHash(depth, frames);
+    }
+    u64 current_time = OS::nanotime() - start;
+
+    printf("calcHash at depth %d: MurmurHash64A %.1f ns, current %.1f ns (%llx)\n", depth,
+           (double)scalar_time / iterations, (double)current_time / iterations, sink & 0xf);
+    CHECK(sink != 0);
+}
+
+TEST_CASE(CallTraceStorage_evict_cold_traces) {
+    CallTraceStorage storage;
+
+    u32 hot = putTestTrace(storage, 1, 1);
+    u32 cold = putTestTrace(storage, 2, 1);
+
+    // Emulate a JFR chunk boundary: only the hot trace is sampled afterwards
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    putTestTrace(storage, 1, 1);
+
+    size_t evicted = storage.evictColdTraces();
+    CHECK_EQ(evicted, (size_t)1);
+    u32 hot_again = putTestTrace(storage, 1, 1);
+    CHECK_EQ(hot_again, hot);
+
+    // The id of the evicted trace is recycled
+    u32 recycled = putTestTrace(storage, 3, 1);
+    CHECK_EQ(recycled, cold);
+
+    traces.clear();
+    storage.collectTraces(traces);
+    ASSERT_EQ(traces.size(), (size_t)2);
+    CHECK_EQ(traces[hot]->frames[0].bci, 1);
+    CHECK_EQ(traces[cold]->frames[0].bci, 3);
+}
+
+TEST_CASE(CallTraceStorage_collect_sampled_only) {
+    CallTraceStorage storage;
+    for (int i = 0; i < 100000; i++) {
+        putTestTrace(storage, i, 1, i % 4);
+    }
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), (size_t)100000);
+
+    // Only the traces sampled after the previous collection are reported
+    u32 id = putTestTrace(storage, 77777, 1, 77777 % 4);
+    storage.add(putTestTrace(storage, 5, 0, 1), 1, 1);
+    traces.clear();
+    storage.collectTraces(traces);
+    ASSERT_EQ(traces.size(), (size_t)2);
+    CHECK_EQ(traces[id]->frames[0].bci, 77777);
+
+    traces.clear();
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), (size_t)0);
+}
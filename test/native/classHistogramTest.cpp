@@ -0,0 +1,96 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include "classHistogram.h"
+#include "testRunner.hpp"
+
+static ClassHistogram class_histogram;
+
+static u64 histogramBytes(const std::vector<ClassHistogramEntry>& entries, u32 class_id, u64* samples) {
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].class_id == class_id) {
+            *samples = entries[i].samples;
+            return entries[i].bytes;
+        }
+    }
+    *samples = 0;
+    return 0;
+}
+
+static void* addConcurrently(void* arg) {
+    for (u32 i = 0; i < 100000; i++) {
+        class_histogram.add(i % 100 + 1, 8);
+    }
+    return NULL;
+}
+
+TEST_CASE(ClassHistogram_accumulates_per_class) {
+    ASSERT(class_histogram.init());
+    class_histogram.reset();
+
+    class_histogram.add(1, 100);
+    class_histogram.add(2, 50);
+    class_histogram.add(1, 28);
+    class_histogram.add(0, 16);
+
+    std::vector<ClassHistogramEntry> entries;
+    class_histogram.collect(entries);
+    CHECK_EQ(entries.size(), (size_t)3);
+
+    u64 samples;
+    CHECK_EQ(histogramBytes(entries, 1, &samples), (u64)128);
+    CHECK_EQ(samples, (u64)2);
+    CHECK_EQ(histogramBytes(entries, 2, &samples), (u64)50);
+    CHECK_EQ(samples, (u64)1);
+    CHECK_EQ(histogramBytes(entries, 0, &samples), (u64)16);
+    CHECK_EQ(samples, (u64)1);
+
+    class_histogram.reset();
+    entries.clear();
+    class_histogram.collect(entries);
+    CHECK_EQ(entries.size(), (size_t)0);
+}
+
+TEST_CASE(ClassHistogram_concurrent_updates) {
+    ASSERT(class_histogram.init());
+    class_histogram.reset();
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, addConcurrently, NULL);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    std::vector<ClassHistogramEntry> entries;
+    class_histogram.collect(entries);
+    CHECK_EQ(entries.size(), (size_t)100);
+
+    u64 samples = 0;
+    u64 bytes = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        samples += entries[i].samples;
+        bytes += entries[i].bytes;
+    }
+    CHECK_EQ(samples, (u64)400000);
+    CHECK_EQ(bytes, (u64)400000 * 8);
+    CHECK_EQ(class_histogram.dropped(), (u64)0);
+}
+
+TEST_CASE(ClassHistogram_counts_overflow) {
+    ASSERT(class_histogram.init());
+    class_histogram.reset();
+
+    for (u32 id = 1; id <= CLASS_HISTOGRAM_CAPACITY + 100; id++) {
+        class_histogram.add(id, 1);
+    }
+
+    std::vector<ClassHistogramEntry> entries;
+    class_histogram.collect(entries);
+    CHECK_OP(entries.size(), <=, (size_t)CLASS_HISTOGRAM_CAPACITY);
+    CHECK_EQ(entries.size() + class_histogram.dropped(), (size_t)CLASS_HISTOGRAM_CAPACITY + 100);
+}
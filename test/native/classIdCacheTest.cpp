@@ -0,0 +1,41 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "classIdCache.h"
+#include "testRunner.hpp"
+
+TEST_CASE(ClassIdCache_get_put) {
+    ClassIdCache cache;
+    uintptr_t klass = 0x7f0012345678;
+    CHECK_EQ(cache.get(klass), 0u);
+
+    cache.put(klass, 42);
+    CHECK_EQ(cache.get(klass), 42u);
+    CHECK_EQ(cache.get(klass + 8), 0u);
+
+    cache.put(klass, 43);
+    CHECK_EQ(cache.get(klass), 43u);
+
+    cache.reset();
+    CHECK_EQ(cache.get(klass), 0u);
+}
+
+TEST_CASE(ClassIdCache_colliding_classes) {
+    ClassIdCache cache;
+    // Fill many slots: distinct classes are either found with their own id or missed
+    for (uintptr_t k = 1; k <= 4 * CLASS_ID_CACHE_SIZE; k++) {
+        cache.put(k * 64, (u32)k);
+    }
+    int hits = 0;
+    for (uintptr_t k = 1; k <= 4 * CLASS_ID_CACHE_SIZE; k++) {
+        u32 value = cache.get(k * 64);
+        if (value != 0) {
+            CHECK_EQ(value, (u32)k);
+            hits++;
+        }
+    }
+    CHECK_OP(hits, >, 0);
+    CHECK_OP(hits, <=, (int)CLASS_ID_CACHE_SIZE);
+}
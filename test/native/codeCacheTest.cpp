@@ -0,0 +1,311 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "codeCache.h"
+#include "dwarf.h"
+#include "testRunner.hpp"
+
+static char code_cache_test_text[64 * 1024];
+
+struct MarkEvenFunctions {
+    bool operator()(const char* name) const {
+        int n = atoi(name + 4);
+        return n % 2 == 0;
+    }
+};
+
+TEST_CASE(CodeCacheArray_finds_library_by_address) {
+    const int count = 64;
+    CodeCache* libs[count];
+    CodeCacheArray array;
+
+    // Libraries of 1K each, added out of address order, with a gap after every library
+    for (int i = 0; i < count; i++) {
+        int slot = (i * 37) % count;
+        const char* start = code_cache_test_text + slot * 1024;
+        libs[slot] = new CodeCache("libtest.so", i, false, start, start + 768);
+        array.add(libs[slot]);
+    }
+    CHECK_EQ(array.count(), count);
+
+    for (int slot = 0; slot < count; slot++) {
+        const char* start = code_cache_test_text + slot * 1024;
+        CHECK_EQ(array.findLibraryByAddress(start), libs[slot]);
+        CHECK_EQ(array.findLibraryByAddress(start + 767), libs[slot]);
+        CHECK(array.findLibraryByAddress(start + 768) == NULL);
+    }
+    CHECK(array.findLibraryByAddress(code_cache_test_text - 1) == NULL);
+
+    for (int i = 0; i < count; i++) {
+        delete libs[i];
+    }
+}
+
+TEST_CASE(CodeCacheArray_finds_overlapped_library) {
+    // A wide library covers the smaller one that starts inside of it
+    CodeCache outer("libouter.so", 0, false, code_cache_test_text, code_cache_test_text + 4096);
+    CodeCache inner("libinner.so", 1, false, code_cache_test_text + 1024, code_cache_test_text + 2048);
+    CodeCache empty("[empty]");
+
+    CodeCacheArray array;
+    array.add(&outer);
+    array.add(&inner);
+    array.add(&empty);
+
+    CHECK_EQ(array.findLibraryByAddress(code_cache_test_text + 1500), &inner);
+    CHECK_EQ(array.findLibraryByAddress(code_cache_test_text + 3000), &outer);
+    CHECK(array.findLibraryByAddress(code_cache_test_text + 4096) == NULL);
+}
+
+TEST_CASE(CodeCacheArray_maps_libraries_by_page) {
+    // Addresses are never dereferenced. Libraries far apart, one crossing a region boundary,
+    // and two sharing a granule.
+    const char* base = (const char*)0x7f0000000000;
+    CodeCache first("libfirst.so", 0, false, base, base + 0x30000);
+    CodeCache crossing("libcrossing.so", 1, false, base + 0x3fff0000, base + 0x40020000);
+    CodeCache shared1("libshared1.so", 2, false, base + 0x80000000, base + 0x80001000);
+    CodeCache shared2("libshared2.so", 3, false, base + 0x80002000, base + 0x80003000);
+
+    CodeCacheArray array;
+    array.add(&first);
+    array.add(&crossing);
+    array.add(&shared1);
+    array.add(&shared2);
+
+    CHECK_EQ(array.findLibraryByAddress(base), &first);
+    CHECK_EQ(array.findLibraryByAddress(base + 0x2ffff), &first);
+    CHECK(array.findLibraryByAddress(base + 0x30000) == NULL);
+    CHECK(array.findLibraryByAddress(base - 1) == NULL);
+
+    CHECK_EQ(array.findLibraryByAddress(base + 0x3fff0000), &crossing);
+    CHECK_EQ(array.findLibraryByAddress(base + 0x40010000), &crossing);
+    CHECK(array.findLibraryByAddress(base + 0x40020000) == NULL);
+
+    CHECK_EQ(array.findLibraryByAddress(base + 0x80000800), &shared1);
+    CHECK_EQ(array.findLibraryByAddress(base + 0x80002800), &shared2);
+    CHECK(array.findLibraryByAddress(base + 0x80001800) == NULL);
+
+    // Regions without libraries
+    CHECK(array.findLibraryByAddress(base + 0x100000000) == NULL);
+    CHECK(array.findLibraryByAddress((const void*)0x1000) == NULL);
+}
+
+TEST_CASE(CodeCacheArray_falls_back_when_map_is_full) {
+    // More 1 GB regions than the map holds
+    const int count = LIB_MAP_REGIONS + 8;
+    CodeCache* libs[count];
+    CodeCacheArray array;
+    for (int i = 0; i < count; i++) {
+        const char* start = (const char*)0x100000000000 + ((uintptr_t)i << LIB_MAP_REGION_SHIFT);
+        libs[i] = new CodeCache("libtest.so", i, false, start, start + 4096);
+        array.add(libs[i]);
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char* start = (const char*)libs[i]->minAddress();
+        CHECK_EQ(array.findLibraryByAddress(start + 100), libs[i]);
+        CHECK(array.findLibraryByAddress(start + 8192) == NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        delete libs[i];
+    }
+}
+
+TEST_CASE(CodeCache_searches_blocks_of_symbols) {
+    CodeCache cc("libtest.so", 0, false, code_cache_test_text, code_cache_test_text + sizeof(code_cache_test_text));
+    char name[32];
+    // Functions of 40 bytes with 8-byte gaps, added in reverse order
+    for (int i = 999; i >= 0; i--) {
+        snprintf(name, sizeof(name), "func%d", i);
+        cc.add(code_cache_test_text + i * 48, 40, name);
+    }
+    cc.sort();
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "func%d", i);
+        CHECK_EQ(strcmp(cc.binarySearch(code_cache_test_text + i * 48), name), 0);
+        CHECK_EQ(strcmp(cc.binarySearch(code_cache_test_text + i * 48 + 39), name), 0);
+        // A return address right past the end still belongs to the function
+        CHECK_EQ(strcmp(cc.binarySearch(code_cache_test_text + i * 48 + 40), name), 0);
+        CHECK_EQ(cc.binarySearch(code_cache_test_text + i * 48 + 44), cc.name());
+    }
+}
+
+TEST_CASE(CodeCache_finds_symbols_in_one_pass) {
+    CodeCache cc("libtest.so", 0, false, code_cache_test_text, code_cache_test_text + sizeof(code_cache_test_text));
+    char name[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "func%d", i);
+        cc.add(code_cache_test_text + i * 48, 40, name);
+    }
+
+    const char* const names[] = {"func42", "missing", "func7", "func99"};
+    const void* addresses[4];
+    CHECK_EQ(cc.findSymbols(names, addresses, 4), 3);
+    CHECK(addresses[0] == code_cache_test_text + 42 * 48);
+    CHECK(addresses[1] == NULL);
+    CHECK(addresses[2] == code_cache_test_text + 7 * 48);
+    CHECK(addresses[3] == code_cache_test_text + 99 * 48);
+}
+
+TEST_CASE(CodeCache_searches_blocks_of_frame_descs) {
+    CodeCache cc("libtest.so", 0, false, code_cache_test_text, code_cache_test_text + sizeof(code_cache_test_text));
+    cc.setTextBase(code_cache_test_text);
+
+    const int rows = 1000;
+    FrameDesc* table = (FrameDesc*)malloc(rows * sizeof(FrameDesc));
+    for (int i = 0; i < rows; i++) {
+        table[i].loc = 100 + i * 10;
+        table[i].cfa = DW_REG_SP | i << 8;
+        table[i].fp_off = DW_SAME_FP;
+        table[i].pc_off = -8;
+    }
+    cc.setDwarfTable(table, rows);
+
+    for (int i = 0; i < rows; i++) {
+        CHECK_EQ(cc.findFrameDesc(code_cache_test_text + 100 + i * 10)->cfa, DW_REG_SP | i << 8);
+        CHECK_EQ(cc.findFrameDesc(code_cache_test_text + 109 + i * 10)->cfa, DW_REG_SP | i << 8);
+    }
+    CHECK_EQ(cc.findFrameDesc(code_cache_test_text + 99), &FrameDesc::default_frame);
+}
+
+TEST_CASE(CodeCache_compresses_dwarf_table) {
+    CodeCache cc("libtest.so");
+    cc.setTextBase(code_cache_test_text);
+
+    // Functions alternate between two frame layouts; every 100th row follows a gap wider than a row delta
+    const int rows = 10000;
+    FrameDesc* table = (FrameDesc*)malloc(rows * sizeof(FrameDesc));
+    u32 loc = 0;
+    for (int i = 0; i < rows; i++) {
+        table[i].loc = loc;
+        table[i].cfa = DW_REG_SP | (i % 2 ? 16 : 8) << 8;
+        table[i].fp_off = DW_SAME_FP;
+        table[i].pc_off = i % 2 ? -16 : -8;
+        loc += i % 100 == 99 ? 0x12345 : 7;
+    }
+    cc.setDwarfTable(table, rows);
+    CHECK_OP(cc.dwarfMemory(), <, rows * 5);
+
+    loc = 0;
+    for (int i = 0; i < rows; i++) {
+        FrameDesc* f = cc.findFrameDesc(code_cache_test_text + loc);
+        CHECK_EQ(f->cfa, DW_REG_SP | (i % 2 ? 16 : 8) << 8);
+        CHECK_EQ(f->pc_off, i % 2 ? -16 : -8);
+        u32 next = loc + (i % 100 == 99 ? 0x12345 : 7);
+        CHECK_EQ(cc.findFrameDesc(code_cache_test_text + next - 1)->pc_off, i % 2 ? -16 : -8);
+        loc = next;
+    }
+}
+
+TEST_CASE(CodeCache_defers_dwarf_parsing) {
+    CodeCache cc("libtest.so");
+    cc.setTextBase(code_cache_test_text);
+    cc.setLazyDwarf(code_cache_test_text, code_cache_test_text, true);
+    CHECK(cc.dwarfPending());
+    CHECK(!cc.dwarfRequested());
+
+    // The first lookup asks for the table and falls back to the default frame
+    CHECK_EQ(cc.findFrameDesc(code_cache_test_text + 100), &FrameDesc::default_frame);
+    CHECK(cc.dwarfRequested());
+
+    FrameDesc* table = (FrameDesc*)malloc(sizeof(FrameDesc));
+    table->loc = 0;
+    table->cfa = DW_REG_SP | 24 << 8;
+    table->fp_off = DW_SAME_FP;
+    table->pc_off = -8;
+    cc.setDwarfTable(table, 1);
+    CHECK(!cc.dwarfPending());
+    CHECK_EQ(cc.findFrameDesc(code_cache_test_text + 100)->cfa, DW_REG_SP | 24 << 8);
+}
+
+TEST_CASE(CodeCache_reads_written_symbol_cache) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/asprof-symcache-%d.sym", (int)getpid());
+
+    CodeCache cc("libtest.so");
+    cc.add(code_cache_test_text + 4000, 16, "imported");
+    char name[32];
+    for (int i = 99; i >= 0; i--) {
+        snprintf(name, sizeof(name), "func%d", i);
+        cc.add(code_cache_test_text + i * 32, 24, name);
+    }
+    // Only symbols past the first one are saved
+    CHECK(cc.writeSymbolCache(path, code_cache_test_text, 1));
+
+    // The cache holds offsets, so it applies to another load address
+    char* base = code_cache_test_text + 8192;
+    CodeCache loaded("libtest.so");
+    CHECK(loaded.readSymbolCache(path, base));
+    CHECK_EQ(loaded.count(), 100);
+    loaded.sort();
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "func%d", i);
+        CHECK_EQ(strcmp(loaded.binarySearch(base + i * 32 + 10), name), 0);
+    }
+
+    // A truncated file is rejected as a whole
+    CHECK_EQ(truncate(path, 100), 0);
+    CodeCache truncated("libtest.so");
+    CHECK(!truncated.readSymbolCache(path, base));
+    CHECK_EQ(truncated.count(), 0);
+
+    unlink(path);
+    CHECK(!truncated.readSymbolCache(path, base));
+}
+
+TEST_CASE(CodeCache_packs_symbol_names) {
+    CodeCache cc("libtest.so", 7, false, code_cache_test_text, code_cache_test_text + sizeof(code_cache_test_text));
+    char name[64];
+    // Enough names of odd lengths to spill over several chunks
+    for (int i = 0; i < 2000; i++) {
+        snprintf(name, sizeof(name), "func%d_%.*s", i, i % 17, "xxxxxxxxxxxxxxxxx");
+        cc.add(code_cache_test_text + i * 32, 24, name);
+    }
+    cc.sort();
+    cc.mark(MarkEvenFunctions(), MARK_INTERPRETER);
+
+    for (int i = 0; i < 2000; i++) {
+        snprintf(name, sizeof(name), "func%d_%.*s", i, i % 17, "xxxxxxxxxxxxxxxxx");
+        const char* found = cc.binarySearch(code_cache_test_text + i * 32);
+        CHECK_EQ(strcmp(found, name), 0);
+        CHECK_EQ(NativeFunc::libIndex(found), 7);
+        CHECK_EQ(NativeFunc::mark(found), i % 2 == 0 ? MARK_INTERPRETER : 0);
+    }
+}
+
+TEST_CASE(StubTable_finds_sorted_and_recent_stubs) {
+    CodeCache stubs("[stubs]");
+    StubTable table;
+    CodeBlob blob;
+    CHECK(!table.find(code_cache_test_text, blob));
+
+    // Stubs arrive in a scattered order; every STUB_TABLE_TAIL + 1 of them rebuild the table
+    char name[32];
+    for (int i = 0; i < 500; i++) {
+        int slot = (i * 37) % 500;
+        snprintf(name, sizeof(name), "stub%d", slot);
+        const char* start = code_cache_test_text + slot * 64;
+        table.add(start, start + 48, stubs.add(start, 48, name));
+
+        CHECK(table.find(start + 47, blob));
+        CHECK_EQ(strcmp(blob._name, name), 0);
+    }
+
+    for (int slot = 0; slot < 500; slot++) {
+        snprintf(name, sizeof(name), "stub%d", slot);
+        ASSERT(table.find(code_cache_test_text + slot * 64 + 10, blob));
+        CHECK_EQ(strcmp(blob._name, name), 0);
+        CHECK(blob._start == code_cache_test_text + slot * 64);
+        // Gaps between stubs
+        CHECK(!table.find(code_cache_test_text + slot * 64 + 48, blob));
+    }
+    CHECK(table.usedMemory() >= 500 * sizeof(CodeBlob));
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "arguments.h"
+#include "ctimer.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+// Counts POSIX timers of this process that signal the given thread
+static int countThreadTimers(int tid) {
+    FILE* f = fopen("/proc/self/timers", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char expected[64];
+    snprintf(expected, sizeof(expected), "notify: signal/tid.%d\n", tid);
+
+    int count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strcmp(line, expected) == 0) {
+            count++;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+struct HookedThread {
+    u64 run_time;
+    int timers;
+};
+
+// Reports start and end of the thread to the engine like the pthread_setspecific hook does
+static void* hookedThreadEntry(void* arg) {
+    HookedThread* t = (HookedThread*)arg;
+    CpuEngine::onThreadStart();
+    u64 deadline = OS::nanotime() + t->run_time;
+    while (OS::nanotime() < deadline) {
+        // busy
+    }
+    t->timers = countThreadTimers(OS::threadId());
+    CpuEngine::onThreadEnd();
+    return NULL;
+}
+
+static u64 runHookedThreads(int count, u64 run_time) {
+    HookedThread t = {run_time, 0};
+    u64 start = OS::nanotime();
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, hookedThreadEntry, &t) == 0) {
+            pthread_join(thread, NULL);
+        }
+    }
+    return OS::nanotime() - start;
+}
+
+TEST_CASE(CTimer_creates_timers_lazily) {
+    Arguments args;
+    ASSERT(!args.parse("interval=1ms"));
+
+    CTimer ctimer;
+    if (ctimer.start(args)) {
+        printf("CTimer unavailable, skipping\n");
+        return;
+    }
+
+    // Short-lived threads end before their timers are due
+    HookedThread short_lived = {0, -1};
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, NULL, hookedThreadEntry, &short_lived), 0);
+    pthread_join(thread, NULL);
+
+    // Long enough to be reached by the creator thread
+    HookedThread long_lived = {50000000, -1};
+    ASSERT_EQ(pthread_create(&thread, NULL, hookedThreadEntry, &long_lived), 0);
+    pthread_join(thread, NULL);
+
+    ctimer.stop();
+
+    if (short_lived.timers >= 0) {
+        CHECK_EQ(short_lived.timers, 0);
+        CHECK_EQ(long_lived.timers, 1);
+    }
+}
+
+TEST_CASE(CTimer_thread_start_benchmark) {
+    const int count = 2000;
+    Arguments args;
+    ASSERT(!args.parse("interval=10ms"));
+
+    u64 base_time = runHookedThreads(count, 0);
+
+    CTimer ctimer;
+    if (ctimer.start(args)) {
+        printf("CTimer unavailable, skipping\n");
+        return;
+    }
+    u64 profiled_time = runHookedThreads(count, 0);
+    ctimer.stop();
+
+    printf("Thread start+join: %.1f us without profiler, %.1f us with ctimer\n",
+           base_time / 1000.0 / count, profiled_time / 1000.0 / count);
+    CHECK_OP(profiled_time, >, (u64)0);
+}
+
+#endif // __linux__
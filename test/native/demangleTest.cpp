@@ -4,8 +4,10 @@
  */
 
 #include "arch.h"
+#include "codeCache.h"
 #include "testRunner.hpp"
 #include "demangle.h"
+#include "os.h"
 #include <stdio.h>
 
 TEST_CASE(Demangle_test_needs_demangling) {
@@ -20,6 +22,56 @@ TEST_CASE(Demangle_test_needs_demangling) {
     CHECK_EQ(Demangle::needsDemangling("_malloc"), false);
 }
 
+TEST_CASE(Demangle_test_classify) {
+    CHECK_EQ(Demangle::classify("_ZN12panic_unwind3imp5panic17exception_cleanup17he4cf772173d90f46E"), MANGLING_RUST_LEGACY);
+    CHECK_EQ(Demangle::classify("_ZN12panic_unwind3imp5panic17exception_cleanup17he4cf772173d90f46E.lto.1"), MANGLING_RUST_LEGACY);
+    CHECK_EQ(Demangle::classify("_RNvCs6KtT2fMGqXk_8infiloop4main"), MANGLING_RUST_V0);
+    CHECK_EQ(Demangle::classify("_ZNKSbIwSt11char_traitsIwESaIwEE4_Rep12_M_is_sharedEv"), MANGLING_CPP);
+    CHECK_EQ(Demangle::classify("_ZN12_GLOBAL__N_113single_threadE"), MANGLING_CPP);
+    CHECK_EQ(Demangle::classify("_Z3fooPKc17h0123456789abcdefE"), MANGLING_CPP);
+    CHECK_EQ(Demangle::classify("malloc"), MANGLING_NONE);
+    CHECK_EQ(Demangle::classify("_malloc"), MANGLING_NONE);
+}
+
+// Demangles COUNT distinct symbols made from the printf-style FORMAT, returns nanoseconds per symbol
+// and counts symbols that are not classified as EXPECTED
+static double demangleSymbols(const char* format, int count, ManglingScheme expected, int& mismatched) {
+    char** symbols = new char*[count];
+    for (int i = 0; i < count; i++) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), format, i % 10, i / 10 % 10, i / 100 % 10, i / 1000 % 10);
+        symbols[i] = strdup(buf);
+    }
+
+    u64 start = OS::nanotime();
+    for (int i = 0; i < count; i++) {
+        mismatched += Demangle::classify(symbols[i]) != expected;
+        char* s = Demangle::demangle(symbols[i], false);
+        free(s);
+    }
+    u64 elapsed = OS::nanotime() - start;
+
+    for (int i = 0; i < count; i++) {
+        free(symbols[i]);
+    }
+    delete[] symbols;
+
+    return (double)elapsed / count;
+}
+
+TEST_CASE(Demangle_test_classify_benchmark) {
+    const int count = 10000;
+    int mismatched = 0;
+    double cpp = demangleSymbols("_ZN6Parser4scanILi%d%d%d%dEEEvPKci", count, MANGLING_CPP, mismatched);
+    double legacy = demangleSymbols("_ZN4core3fmt5write4scan17h%d%d%d%d456789abcdefE", count, MANGLING_RUST_LEGACY, mismatched);
+    double v0 = demangleSymbols("_RNvCs6KtT2fMGqXk_8infiloop5s%d%d%d%d", count, MANGLING_RUST_V0, mismatched);
+    double plain = demangleSymbols("scan_%d%d%d%d", count, MANGLING_NONE, mismatched);
+    CHECK_EQ(mismatched, 0);
+
+    printf("Demangle: %.0f ns C++, %.0f ns Rust legacy, %.0f ns Rust v0, %.0f ns plain per symbol\n",
+           cpp, legacy, v0, plain);
+}
+
 TEST_CASE(Demangle_test_demangle_cpp) {
     char *s = Demangle::demangle("_ZNSt15basic_streambufIwSt11char_traitsIwEE9pbackfailEj", false);
     // 2 different demangling formats between libc++ (Mac) and libstdc++ (most Linux)
@@ -159,3 +211,23 @@ TEST_CASE(Demangle_test_demangle_rust_v0_infinite) {
     char *s = Demangle::demangle("_RNvMC0" "TTTTTTTTTTTTTTTT" "p" "Bk_Bk_Bk_Bk_Bk_Bk_Bk_Bk_E" "Bj_E" "Bi_E" "Bh_E" "Bg_E" "Bf_E" "Be_E" "Bd_E" "Bc_E" "Bb_E" "Ba_E" "B9_E" "B8_E" "B7_E" "B6_E" "B5_E" "3run", false);
     CHECK_EQ(s, NULL);
 }
+
+TEST_CASE(Demangle_test_demangle_native_cached) {
+    char* name = NativeFunc::create("_ZN6Parser5parseEPKci", 0);
+
+    const char* brief = Demangle::demangleNative(name, false);
+    CHECK_EQ(brief, "Parser::parse");
+    CHECK(Demangle::demangleNative(name, false) == brief);
+
+    const char* full = Demangle::demangleNative(name, true);
+    CHECK_EQ(full, "Parser::parse(char const*, int)");
+    CHECK(Demangle::demangleNative(name, true) == full);
+    CHECK(Demangle::demangleNative(name, false) == brief);
+
+    NativeFunc::destroy(name);
+
+    // A new symbol at a reused address is demangled again
+    char* other = NativeFunc::create("_ZN6Parser4skipEv", 0);
+    CHECK_EQ(Demangle::demangleNative(other, false), "Parser::skip");
+    NativeFunc::destroy(other);
+}
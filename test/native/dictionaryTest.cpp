@@ -0,0 +1,35 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <vector>
+#include "dictionary.h"
+#include "testRunner.hpp"
+
+TEST_CASE(Dictionary_lookup_many_keys) {
+    Dictionary dict;
+    const int count = 100000;
+    char buf[64];
+
+    std::vector<unsigned int> ids(count);
+    for (int i = 0; i < count; i++) {
+        snprintf(buf, sizeof(buf), "Lambda$%d/0x%x", i, i * 31);
+        ids[i] = dict.lookup(buf);
+    }
+
+    for (int i = 0; i < count; i++) {
+        snprintf(buf, sizeof(buf), "Lambda$%d/0x%x", i, i * 31);
+        ASSERT_EQ(dict.lookup(buf), ids[i]);
+    }
+
+    std::map<unsigned int, const char*> map;
+    dict.collect(map);
+    CHECK_EQ(map.size(), (size_t)count);
+
+    // Prefix of an existing key is a different key
+    unsigned int prefix = dict.lookup("Lambda$1", 8);
+    CHECK_NE(prefix, ids[1]);
+    CHECK_EQ(dict.lookup("Lambda$1"), prefix);
+}
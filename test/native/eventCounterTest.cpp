@@ -0,0 +1,80 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include "eventCounter.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+static EventCounter test_counter;
+
+struct CounterTask {
+    u64 interval;
+    u64 value;
+    int count;
+    int samples;
+};
+
+static void* addEvents(void* arg) {
+    CounterTask* task = (CounterTask*)arg;
+    for (int i = 0; i < task->count; i++) {
+        task->samples += test_counter.add(task->value, task->interval);
+    }
+    return NULL;
+}
+
+TEST_CASE(EventCounter_single_thread) {
+    test_counter.reset(1000, 42);
+    CounterTask task = {1000, 10, 100000, 0};
+    addEvents(&task);
+    // One sample per 1000 units, give or take the initial phase
+    CHECK_OP(task.samples, >=, 999);
+    CHECK_OP(task.samples, <=, 1000);
+}
+
+TEST_CASE(EventCounter_no_interval) {
+    test_counter.reset(0, 42);
+    CounterTask task = {1, 10, 100, 0};
+    addEvents(&task);
+    CHECK_EQ(task.samples, 100);
+}
+
+TEST_CASE(EventCounter_threads_keep_rate) {
+    const int threads = 8;
+    test_counter.reset(1000, OS::nanotime());
+    CounterTask tasks[threads];
+    pthread_t ids[threads];
+    for (int i = 0; i < threads; i++) {
+        CounterTask task = {1000, 7, 200000, 0};
+        tasks[i] = task;
+        ASSERT(pthread_create(&ids[i], NULL, addEvents, &tasks[i]) == 0);
+    }
+
+    int samples = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        samples += tasks[i].samples;
+    }
+
+    // 8 threads * 200000 events * 7 units / 1000 = 11200 samples, and at most one more per thread
+    CHECK_OP(samples, >=, 11200 - threads);
+    CHECK_OP(samples, <=, 11200 + threads);
+}
+
+// Short-lived threads reporting less than an interval each are still sampled in proportion
+TEST_CASE(EventCounter_threads_below_interval) {
+    test_counter.reset(1000, 7);
+    int samples = 0;
+    for (int i = 0; i < 2000; i++) {
+        CounterTask task = {1000, 100, 1, 0};
+        pthread_t id;
+        ASSERT(pthread_create(&id, NULL, addEvents, &task) == 0);
+        pthread_join(id, NULL);
+        samples += task.samples;
+    }
+    // 2000 * 100 / 1000 = 200 expected
+    CHECK_OP(samples, >, 100);
+    CHECK_OP(samples, <, 300);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fileRotator.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+static bool fileExists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static void waitForFile(const char* path) {
+    for (int i = 0; i < 1000 && !fileExists(path); i++) {
+        OS::sleep(1000000);
+    }
+}
+
+TEST_CASE(FileRotator_opens_next_file_in_advance) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/file-rotator-test.%d", getpid());
+    unlink(path);
+
+    FileRotator::preopen(path);
+    waitForFile(path);
+    CHECK(fileExists(path));
+
+    int fd = FileRotator::open(path);
+    ASSERT(fd >= 0);
+    CHECK_EQ(write(fd, "data", 4), 4);
+    FileRotator::release(fd);
+    FileRotator::sync();
+
+    struct stat st;
+    CHECK_EQ(stat(path, &st), 0);
+    CHECK_EQ(st.st_size, 4);
+    unlink(path);
+}
+
+TEST_CASE(FileRotator_truncates_existing_file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/file-rotator-test.%d", getpid());
+    FILE* f = fopen(path, "w");
+    ASSERT(f != NULL);
+    fputs("previous iteration", f);
+    fclose(f);
+
+    // Not truncated until the iteration actually needs the file
+    FileRotator::preopen(path);
+    OS::sleep(10000000);
+    struct stat st;
+    CHECK_EQ(stat(path, &st), 0);
+    CHECK_EQ(st.st_size, 18);
+
+    int fd = FileRotator::open(path);
+    ASSERT(fd >= 0);
+    CHECK_EQ(fstat(fd, &st), 0);
+    CHECK_EQ(st.st_size, 0);
+    FileRotator::release(fd);
+    FileRotator::sync();
+    unlink(path);
+}
+
+TEST_CASE(FileRotator_removes_unused_file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/file-rotator-test.%d", getpid());
+    unlink(path);
+
+    FileRotator::preopen(path);
+    waitForFile(path);
+    FileRotator::sync();
+    CHECK(!fileExists(path));
+}
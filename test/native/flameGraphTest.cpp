@@ -0,0 +1,379 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <vector>
+#include "flameGraph.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+// Children map and name pool as used by the flame graph builder before the arena
+class MapTrie {
+  public:
+    std::map<u32, MapTrie*> _children;
+    u64 _total;
+
+    MapTrie() : _children(), _total(0) {
+    }
+
+    ~MapTrie() {
+        for (std::map<u32, MapTrie*>::iterator it = _children.begin(); it != _children.end(); ++it) {
+            delete it->second;
+        }
+    }
+
+    MapTrie* child(u32 key) {
+        MapTrie** ptr = &_children[key];
+        if (*ptr == NULL) {
+            *ptr = new MapTrie();
+        }
+        return *ptr;
+    }
+};
+
+// Stacks of a typical service: a few entry points, deep framework layers and varied leaves
+static void generateTraces(std::vector<std::vector<std::string> >& traces, u32 count) {
+    u64 seed = 42;
+    traces.resize(count);
+    for (u32 i = 0; i < count; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        u32 r = (u32)(seed >> 33);
+        int depth = 20 + r % 40;
+        char name[64];
+        for (int d = 0; d < depth; d++) {
+            u32 fanout = d < 5 ? 3 : d < 30 ? 8 : 200;
+            snprintf(name, sizeof(name), "com/example/Layer%d.method%u", d, (r >> (d % 16)) % fanout);
+            traces[i].push_back(name);
+        }
+    }
+}
+
+struct PackedFrame {
+    u32 flags;
+    u32 key;
+    u64 values[6];
+};
+
+// Mirrors unpackFrames() of flame.html
+static void unpackFrames(const std::string& html, bool diff, std::vector<PackedFrame>& frames) {
+    size_t start = html.find("unpackFrames(\"") + 14;
+    size_t end = html.find('"', start);
+    size_t pos = start;
+    while (pos < end) {
+        u64 numbers[8];
+        int count = 0;
+        int expected = 1;
+        while (count < expected) {
+            u64 value = 0;
+            for (u64 scale = 1; ; scale *= PACKED_BASE) {
+                char c = html[pos++];
+                u32 digit = c - '#' - (c > '<') - (c > '\\');
+                if (digit < PACKED_BASE) {
+                    value += digit * scale;
+                    break;
+                }
+                value += (digit - PACKED_BASE) * scale;
+            }
+            numbers[count++] = value;
+            if (count == 1) {
+                u32 flags = (u32)value & 15;
+                expected += ((flags & PACKED_KIND) == PACKED_AT ? 2 : 0) + (flags & PACKED_WIDTH ? 1 : 0) +
+                            (flags & PACKED_TYPES ? 3 : 0) + (diff ? 1 : 0);
+            }
+        }
+        PackedFrame frame;
+        frame.flags = (u32)numbers[0] & 15;
+        frame.key = (u32)(numbers[0] >> 4);
+        for (int i = 1; i < count; i++) {
+            frame.values[i - 1] = numbers[i];
+        }
+        frames.push_back(frame);
+    }
+}
+
+// Mirrors unpack() of flame.html and tree.html
+static void unpackCpool(const std::string& html, std::vector<std::string>& names) {
+    size_t pos = html.find("const cpool = [\n'") + 16;
+    std::string prev;
+    while (pos < html.size() && html[pos] == '\'') {
+        std::string s;
+        for (pos++; html[pos] != '\''; pos++) {
+            if (html[pos] == '\\') pos++;
+            s += html[pos];
+        }
+        pos = html.find_first_not_of(",\n", pos + 1);
+        if (!names.empty()) {
+            s = prev.substr(0, s[0] - ' ') + s.substr(1);
+        }
+        names.push_back(s);
+        prev = s;
+    }
+}
+
+struct TreeNode {
+    u32 key;
+    bool truncated;
+    u64 total;
+    u64 self;
+    u64 children;
+};
+
+// Mirrors unpackTree() of tree.html
+static void unpackTree(const std::string& html, std::vector<TreeNode>& nodes) {
+    size_t pos = html.find("unpackTree(\"") + 12;
+    size_t end = html.find('"', pos);
+    u64 numbers[4];
+    int count = 0;
+    while (pos < end) {
+        u64 value = 0;
+        for (u64 scale = 1; ; scale *= PACKED_BASE) {
+            char c = html[pos++];
+            u32 digit = c - '#' - (c > '<') - (c > '\\');
+            if (digit < PACKED_BASE) {
+                value += digit * scale;
+                break;
+            }
+            value += (digit - PACKED_BASE) * scale;
+        }
+        numbers[count++] = value;
+        if (count == 4) {
+            TreeNode node = {(u32)(numbers[0] >> 1), (numbers[0] & 1) != 0, numbers[1], numbers[2], numbers[3]};
+            nodes.push_back(node);
+            count = 0;
+        }
+    }
+}
+
+TEST_CASE(FlameGraph_merges_frames) {
+    FlameGraph fg("test", COUNTER_SAMPLES, 0, false, false);
+
+    const char* stack1[] = {"main", "foo", "bar"};
+    const char* stack2[] = {"main", "foo", "baz_[j]"};
+    const char* stack3[] = {"main", "foo", "baz_[i]"};
+    const char** stacks[] = {stack1, stack2, stack3};
+
+    for (int i = 0; i < 3; i++) {
+        Trie* f = fg.root();
+        for (int j = 0; j < 3; j++) {
+            f = fg.addChild(f, stacks[i][j], FRAME_JIT_COMPILED, 10);
+        }
+        f->_total += 10;
+        f->_self += 10;
+    }
+
+    Trie* root = fg.root();
+    CHECK_EQ(root->_total, 30ULL);
+    CHECK_EQ(root->childCount(), (size_t)1);
+
+    Trie* foo = root->_first_child->_first_child;
+    CHECK_EQ(foo->_total, 30ULL);
+    // "baz_[j]" and "baz_[i]" share the name, but differ in frame type
+    CHECK_EQ(foo->childCount(), (size_t)2);
+
+    BufferWriter out;
+    fg.dump(out, true);
+    std::string html(out.buf(), out.size());
+    CHECK(html.find("baz_[") == std::string::npos);
+
+    std::vector<std::string> names;
+    unpackCpool(html, names);
+    std::vector<TreeNode> nodes;
+    unpackTree(html, nodes);
+    // all, main, foo, bar and baz
+    ASSERT_EQ(nodes.size(), (size_t)5);
+    CHECK_EQ(nodes[2].children, 2ULL);
+
+    int bar = 0, baz = 0;
+    for (size_t i = 3; i < nodes.size(); i++) {
+        const std::string& name = names[nodes[i].key >> 3];
+        bar += name == "bar";
+        baz += name == "baz";
+    }
+    CHECK_EQ(bar, 1);
+    CHECK_EQ(baz, 1);
+}
+
+TEST_CASE(FlameGraph_tree_truncates_cold_nodes) {
+    FlameGraph fg("test", COUNTER_SAMPLES, 20, false, false);
+
+    const char* hot[] = {"main", "hot", "leaf"};
+    const char* cold[] = {"main", "cold", "coldLeaf"};
+    const char** stacks[] = {hot, cold};
+    const u64 values[] = {90, 10};
+
+    for (int i = 0; i < 2; i++) {
+        Trie* f = fg.root();
+        for (int j = 0; j < 3; j++) {
+            f = fg.addChild(f, stacks[i][j], FRAME_NATIVE, values[i]);
+        }
+        f->_total += values[i];
+        f->_self += values[i];
+    }
+
+    BufferWriter out;
+    fg.dump(out, true);
+    std::string html(out.buf(), out.size());
+
+    std::vector<std::string> names;
+    unpackCpool(html, names);
+    std::vector<TreeNode> nodes;
+    unpackTree(html, nodes);
+
+    // all, main, hot, leaf, cold: children of a node below the cutoff are omitted
+    ASSERT_EQ(nodes.size(), (size_t)5);
+    CHECK_EQ(nodes[0].total, 100ULL);
+    CHECK_EQ(nodes[0].children, 1ULL);
+    CHECK(names[nodes[1].key >> 3] == "main");
+    CHECK_EQ(nodes[1].children, 2ULL);
+    CHECK(names[nodes[2].key >> 3] == "hot");
+    CHECK_EQ(nodes[3].self, 90ULL);
+    CHECK(!nodes[3].truncated);
+    CHECK(names[nodes[4].key >> 3] == "cold");
+    CHECK_EQ(nodes[4].total, 10ULL);
+    CHECK_EQ(nodes[4].children, 0ULL);
+    CHECK(nodes[4].truncated);
+    CHECK(html.find("coldLeaf") == std::string::npos);
+}
+
+TEST_CASE(FlameGraph_packs_frames) {
+    FlameGraph fg("test", COUNTER_SAMPLES, 0, false, false);
+
+    const char* stack1[] = {"main", "foo", "bar"};
+    const char* stack2[] = {"main", "foo", "baz"};
+    const char** stacks[] = {stack1, stack2};
+
+    for (int i = 0; i < 2; i++) {
+        Trie* f = fg.root();
+        for (int j = 0; j < 3; j++) {
+            f = fg.addChild(f, stacks[i][j], FRAME_JIT_COMPILED, 10);
+        }
+        f->_total += 10;
+        f->_self += 10;
+    }
+
+    BufferWriter out;
+    fg.dump(out, false);
+    std::string html(out.buf(), out.size());
+
+    // all, main, foo, bar, baz; the root starts right at the origin
+    std::vector<PackedFrame> frames;
+    unpackFrames(html, false, frames);
+    ASSERT_EQ(frames.size(), (size_t)5);
+    CHECK_EQ(frames[0].flags, (u32)(PACKED_NEXT | PACKED_WIDTH));
+    CHECK_EQ(frames[0].values[0], 20ULL);
+    CHECK_EQ(frames[1].flags, (u32)PACKED_UP);
+    CHECK_EQ(frames[2].flags, (u32)PACKED_UP);
+    CHECK_EQ(frames[3].flags, (u32)(PACKED_UP | PACKED_WIDTH));
+    CHECK_EQ(frames[3].values[0], 10ULL);
+    CHECK_EQ(frames[4].flags, (u32)PACKED_NEXT);
+    CHECK_NE(frames[3].key, frames[4].key);
+}
+
+TEST_CASE(FlameGraph_merge_matches_single_build) {
+    const u32 count = 2000;
+    std::vector<std::vector<std::string> > traces;
+    generateTraces(traces, count);
+
+    FlameGraph single("test", COUNTER_SAMPLES, 0, false, false);
+    FlameGraph merged("test", COUNTER_SAMPLES, 0, false, false);
+    FlameGraph partial("test", COUNTER_SAMPLES, 0, false, false);
+    for (u32 i = 0; i < count; i++) {
+        FlameGraph* targets[] = {&single, i < count / 3 ? &merged : &partial};
+        for (int t = 0; t < 2; t++) {
+            Trie* f = targets[t]->root();
+            for (size_t j = 0; j < traces[i].size(); j++) {
+                f = targets[t]->addChild(f, traces[i][j].c_str(), j % 2 ? FRAME_INTERPRETED : FRAME_JIT_COMPILED, 1);
+            }
+            f->_total++;
+            f->_self++;
+        }
+    }
+    merged.merge(partial);
+
+    CHECK_EQ(merged.root()->_total, (u64)count);
+
+    BufferWriter single_out(1024 * 1024);
+    BufferWriter merged_out(1024 * 1024);
+    single.dump(single_out, false);
+    merged.dump(merged_out, false);
+    CHECK_EQ(merged_out.size(), single_out.size());
+    CHECK(memcmp(merged_out.buf(), single_out.buf(), single_out.size()) == 0);
+}
+
+TEST_CASE(FlameGraph_diff_prints_deltas) {
+    FlameGraph fg("test", COUNTER_SAMPLES, 0, false, false, true);
+
+    // "grown" is sampled 30 times, was 10 at the snapshot; "gone" is only in the snapshot
+    Trie* f = fg.addChild(fg.addChild(fg.root(), "main", FRAME_JIT_COMPILED, 30, 10), "grown", FRAME_JIT_COMPILED, 30, 10);
+    f->_total += 30;
+    f->_self += 30;
+    f->_baseline += 10;
+    f = fg.addChild(fg.addChild(fg.root(), "main", FRAME_JIT_COMPILED, 0, 25), "gone", FRAME_JIT_COMPILED, 0, 25);
+    f->_baseline += 25;
+
+    BufferWriter out;
+    fg.dump(out, false);
+    std::string html(out.buf(), out.size());
+    CHECK(html.find("const diff = true;") != std::string::npos);
+    // Frames without samples are not printed
+    CHECK(html.find("gone'") == std::string::npos);
+
+    // all, main, grown: width and delta follow every frame
+    std::vector<PackedFrame> frames;
+    unpackFrames(html, true, frames);
+    ASSERT_EQ(frames.size(), (size_t)3);
+    // main: 30 now, 35 at the snapshot
+    CHECK_EQ(frames[1].flags, (u32)(PACKED_UP | PACKED_WIDTH));
+    CHECK_EQ(frames[1].values[0], 30ULL);
+    CHECK_EQ(frames[1].values[1], 9ULL);
+    CHECK_EQ(frames[2].values[0], 30ULL);
+    CHECK_EQ(frames[2].values[1], 40ULL);
+}
+
+TEST_CASE(FlameGraph_build_benchmark) {
+    const u32 count = 30000;
+    std::vector<std::vector<std::string> > traces;
+    generateTraces(traces, count);
+
+    u64 start = OS::nanotime();
+    std::map<std::string, u32> cpool;
+    MapTrie* map_root = new MapTrie();
+    u64 frames = 0;
+    for (u32 i = 0; i < count; i++) {
+        MapTrie* f = map_root;
+        for (size_t j = 0; j < traces[i].size(); j++) {
+            u32& name_index = cpool[traces[i][j]];
+            if (name_index == 0) name_index = cpool.size();
+            f->_total++;
+            f = f->child(name_index | FRAME_JIT_COMPILED << 28);
+            frames++;
+        }
+    }
+    delete map_root;
+    u64 map_time = OS::nanotime() - start;
+
+    start = OS::nanotime();
+    FlameGraph fg("test", COUNTER_SAMPLES, 0, false, false);
+    for (u32 i = 0; i < count; i++) {
+        Trie* f = fg.root();
+        for (size_t j = 0; j < traces[i].size(); j++) {
+            f = fg.addChild(f, traces[i][j].c_str(), FRAME_JIT_COMPILED, 1);
+        }
+        f->_total++;
+        f->_self++;
+    }
+    u64 fg_time = OS::nanotime() - start;
+
+    printf("Flame graph build: std::map %.1f Mframes/s, arena %.1f Mframes/s\n",
+           frames * 1000.0 / map_time, frames * 1000.0 / fg_time);
+
+    BufferWriter out(1024 * 1024);
+    fg.dump(out, false);
+    CHECK_EQ(fg.root()->_total, (u64)count);
+    CHECK_OP(out.size(), >, (size_t)0);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "frameNameCache.h"
+#include "testRunner.hpp"
+
+static const void* testFrame(u32 n) {
+    return (const void*)(uintptr_t)(0x7f0000000000ULL + n * 8);
+}
+
+static bool isOddFrame(const void* id, int style) {
+    return ((uintptr_t)id / 8) % 2 == 1;
+}
+
+TEST_CASE(FrameNameCache_keys_by_style) {
+    FrameNameCache cache;
+    char name[32];
+    for (u32 i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "Class%u.method", i);
+        cache.insert(testFrame(i), 0, 0, name);
+        snprintf(name, sizeof(name), "Class%u.method()V", i);
+        cache.insert(testFrame(i), 8, 0, name);
+    }
+    CHECK_EQ(cache.size(), (size_t)10000);
+
+    const char* plain = cache.find(testFrame(1234), 0, 0);
+    ASSERT(plain != NULL);
+    CHECK(strcmp(plain, "Class1234.method") == 0);
+    CHECK(strcmp(cache.find(testFrame(1234), 8, 0), "Class1234.method()V") == 0);
+    CHECK(cache.find(testFrame(1234), 2, 0) == NULL);
+
+    // Interned: inserting the same key returns the stored name
+    CHECK_EQ(cache.insert(testFrame(1234), 0, 0, "other"), plain);
+}
+
+TEST_CASE(FrameNameCache_prunes_old_and_stale_names) {
+    FrameNameCache cache;
+    for (u32 i = 0; i < 100; i++) {
+        cache.insert(testFrame(i), 0, 1, "name");
+    }
+    // Frames below 50 are used again in epoch 3
+    for (u32 i = 0; i < 50; i++) {
+        cache.find(testFrame(i), 0, 3);
+    }
+
+    cache.prune(3, 2, isOddFrame);
+    CHECK_EQ(cache.size(), (size_t)25);
+    for (u32 i = 0; i < 100; i++) {
+        bool expected = i < 50 && i % 2 == 0;
+        ASSERT_EQ(cache.find(testFrame(i), 0, 3) != NULL, expected);
+    }
+
+    cache.clear();
+    CHECK_EQ(cache.size(), (size_t)0);
+    CHECK(cache.find(testFrame(0), 0, 3) == NULL);
+}
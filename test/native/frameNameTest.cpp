@@ -0,0 +1,58 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "frameName.h"
+#include "testRunner.hpp"
+
+static MatcherSet matcherSet(const char** patterns, int count) {
+    MatcherSet set;
+    for (int i = 0; i < count; i++) {
+        set.add(Matcher(patterns[i]));
+    }
+    set.build();
+    return set;
+}
+
+TEST_CASE(MatcherSet_agrees_with_Matcher) {
+    const char* patterns[] = {
+        "java/lang/Thread.run", "java/util/*", "*Handler.handle", "*HashMap*", "*ashMa*",
+        "jdk/internal/misc/Unsafe.park", "*Object.wait", "sun/nio/*", "*she*", "*hers*", "*his*"
+    };
+    const char* names[] = {
+        "java/lang/Thread.run", "java/lang/Thread.run0", "java/util/ArrayList.add", "java/util",
+        "com/example/HttpHandler.handle", "HttpHandler.handle2", "java/util/HashMap.put",
+        "com/example/MyHashMap.get", "jdk/internal/misc/Unsafe.park", "java/lang/Object.wait",
+        "sun/nio/ch/EPoll.wait", "ushers", "ahishe", "", "memcpy", "Thread.run"
+    };
+    int pattern_count = sizeof(patterns) / sizeof(patterns[0]);
+    int name_count = sizeof(names) / sizeof(names[0]);
+
+    // Every subset of the first patterns, one at a time and all together
+    for (int n = 0; n <= pattern_count; n++) {
+        MatcherSet set = matcherSet(patterns, n);
+        CHECK_EQ(set.empty(), n == 0);
+        for (int i = 0; i < name_count; i++) {
+            bool expected = false;
+            for (int j = 0; j < n; j++) {
+                expected |= Matcher(patterns[j]).matches(names[i]);
+            }
+            CHECK_EQ(set.matches(names[i]), expected);
+        }
+    }
+
+    for (int j = 0; j < pattern_count; j++) {
+        MatcherSet set = matcherSet(patterns + j, 1);
+        for (int i = 0; i < name_count; i++) {
+            CHECK_EQ(set.matches(names[i]), Matcher(patterns[j]).matches(names[i]));
+        }
+    }
+}
+
+TEST_CASE(MatcherSet_wildcard_only) {
+    const char* patterns[] = {"*"};
+    MatcherSet set = matcherSet(patterns, 1);
+    CHECK(set.matches(""));
+    CHECK(set.matches("anything"));
+}
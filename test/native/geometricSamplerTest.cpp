@@ -0,0 +1,40 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "geometricSampler.h"
+#include "testRunner.hpp"
+
+static GeometricSampler test_sampler;
+
+// Total weight of sampled allocations estimates the allocated bytes
+static double estimateRatio(u64 interval, size_t size, u64 count) {
+    test_sampler.init(interval, 42);
+    u64 estimate = 0;
+    for (u64 i = 0; i < count; i++) {
+        estimate += test_sampler.sample(size);
+    }
+    return (double)estimate / (double)(size * count);
+}
+
+TEST_CASE(GeometricSampler_small_allocations) {
+    double ratio = estimateRatio(64 * 1024, 48, 20000000);
+    CHECK_OP(ratio, >, 0.97);
+    CHECK_OP(ratio, <, 1.03);
+}
+
+TEST_CASE(GeometricSampler_interval_sized_allocations) {
+    double ratio = estimateRatio(64 * 1024, 64 * 1024, 200000);
+    CHECK_OP(ratio, >, 0.97);
+    CHECK_OP(ratio, <, 1.03);
+}
+
+TEST_CASE(GeometricSampler_large_allocations_always_sampled) {
+    test_sampler.init(1024, 1);
+    for (int i = 0; i < 100; i++) {
+        u64 weight = test_sampler.sample(1024 * 1024);
+        CHECK_OP(weight, >=, (u64)1024 * 1024);
+        CHECK_OP(weight, <, (u64)1024 * 1024 + 2);
+    }
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <string>
+#include "heatmap.h"
+#include "testRunner.hpp"
+
+static int heatmapByte(char c) {
+    switch ((unsigned char)c) {
+        case 127: return 0;
+        case 126: return '\r';
+        case 125: return '&';
+        case 124: return '<';
+        case 123: return '>';
+    }
+    return (unsigned char)c;
+}
+
+// Reads the INDEX-th int30 from the end of the executions section, as the page does
+static u32 heatmapTrailer(const std::string& section, int index) {
+    const char* p = section.data() + section.size() - index * 5;
+    u32 v = 0;
+    for (int i = 0; i < 5; i++) {
+        v |= (u32)heatmapByte(p[i]) << (i * 6);
+    }
+    return v;
+}
+
+static std::string heatmapSection(const std::string& html, const char* id) {
+    std::string start = std::string("<pre id=\"") + id + "\">S";
+    size_t begin = html.find(start);
+    if (begin == std::string::npos) {
+        return "";
+    }
+    begin += start.size();
+    return html.substr(begin, html.find("E</pre>", begin) - begin);
+}
+
+TEST_CASE(Heatmap_prefix_tree) {
+    Heatmap heatmap;
+    u32 main_method = heatmap.method("main", FRAME_NATIVE);
+    u32 work_method = heatmap.method("work", FRAME_NATIVE);
+    CHECK_EQ(main_method, 1u);
+    CHECK_EQ(work_method, 2u);
+    CHECK_EQ(heatmap.method("main", FRAME_NATIVE), main_method);
+    CHECK(heatmap.method("main", FRAME_CPP) != main_method);
+
+    u32 main_node = heatmap.child(0, main_method);
+    u32 work_node = heatmap.child(main_node, work_method);
+    CHECK_EQ(main_node, 1u);
+    CHECK_EQ(work_node, 2u);
+    CHECK_EQ(heatmap.child(main_node, work_method), work_node);
+    CHECK(heatmap.child(0, work_method) != work_node);
+}
+
+TEST_CASE(Heatmap_encoding) {
+    Heatmap heatmap;
+    u32 root = heatmap.child(0, heatmap.method("Thread.run", FRAME_INTERPRETED));
+    u32 leaves[8];
+    for (int i = 0; i < 8; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Worker.task%d", i);
+        leaves[i] = heatmap.child(root, heatmap.method(name, FRAME_JIT_COMPILED));
+    }
+    u32 deep = heatmap.child(leaves[3], heatmap.method("memcpy", FRAME_NATIVE));
+
+    // Irregular block sizes with gaps, so that the Huffman table has codes of different lengths
+    u32 seed = 12345;
+    heatmap.addSample(10, root);
+    u32 samples = 1;
+    for (u32 block = 0; block < 500; block++) {
+        seed = seed * 1103515245 + 12345;
+        u32 count = (seed >> 16) % 7 == 0 ? 0 : (seed >> 20) % 30;
+        for (u32 i = 0; i < count; i++) {
+            heatmap.addSample(block + 10, i % 9 == 8 ? deep : i % 9 == 7 ? root : leaves[i % 8]);
+            samples++;
+        }
+    }
+    heatmap.addSample(1000, deep);
+    samples++;
+
+    BufferWriter out;
+    heatmap.dump(out, "Test & heatmap", 1700000000000ULL);
+    std::string html(out.buf(), out.size());
+
+    CHECK(html.find("Test & heatmap") != std::string::npos);
+    CHECK(html.find("/*executionsHeatmap:*/") == std::string::npos);
+    CHECK(html.find("\"Worker.task7\",") != std::string::npos);
+    // The first sample is in block 10
+    CHECK(html.find("let startMs = 1700000000200;") != std::string::npos);
+
+    std::string executions = heatmapSection(html, "executionsHeatmap");
+    ASSERT(executions.size() > 25);
+    CHECK(executions.find_first_of("&<>\r") == std::string::npos);
+    CHECK_EQ(heatmapTrailer(executions, 1), samples);
+    CHECK_EQ(heatmapTrailer(executions, 2), samples);
+    CHECK_EQ(heatmapTrailer(executions, 3), 7u * 2 + 3);  // total depth of leaves
+    CHECK_EQ(heatmapTrailer(executions, 4), 991u);
+    CHECK_EQ(heatmapTrailer(executions, 5), 11u);
+
+    // One start method, Thread.run
+    CHECK_EQ(heatmapByte(executions[0]), 1);
+    CHECK_EQ(heatmapByte(executions[1]), 1);
+
+    std::string methods = heatmapSection(html, "methods");
+    ASSERT(methods.size() > 2);
+    CHECK_EQ(methods[0], 'A');
+    CHECK_EQ(heatmapByte(methods[1]), 10);
+    CHECK_EQ(methods[methods.size() - 1], 'A');
+}
+
+TEST_CASE(Heatmap_no_samples) {
+    Heatmap heatmap;
+    BufferWriter out;
+    heatmap.dump(out, NULL, 0);
+    CHECK(std::string(out.buf(), out.size()) == "No samples found\n");
+}
+
+TEST_CASE(SampleTimeline_collect) {
+    SampleTimeline timeline;
+    timeline.add(1);
+
+    timeline.start(true, true);
+    for (u32 i = 1; i <= TIMELINE_PAGE_SAMPLES + 100; i++) {
+        timeline.add(i);
+    }
+    // Trace 0 stands for a failed sample
+    timeline.add(0);
+
+    std::vector<u64> samples;
+    timeline.collect(samples);
+    CHECK_EQ(samples.size(), (size_t)TIMELINE_PAGE_SAMPLES + 100);
+    bool sorted = true;
+    for (size_t i = 1; i < samples.size(); i++) {
+        sorted &= samples[i - 1] < samples[i];
+    }
+    CHECK(sorted);
+
+    timeline.start(false, true);
+    timeline.add(1);
+    samples.clear();
+    timeline.collect(samples);
+    CHECK_EQ(samples.size(), (size_t)0);
+}
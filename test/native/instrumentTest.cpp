@@ -0,0 +1,41 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "instrument.h"
+#include "testRunner.hpp"
+
+static bool globMatches(const char* s, const char* pattern) {
+    return Instrument::matchesGlob(s, strlen(s), pattern);
+}
+
+TEST_CASE(Instrument_glob_exact) {
+    CHECK(globMatches("java/util/Properties", "java/util/Properties"));
+    CHECK(!globMatches("java/util/Properties", "java/util/Propertie"));
+    CHECK(!globMatches("java/util/Propertie", "java/util/Properties"));
+    CHECK(globMatches("", ""));
+    CHECK(!globMatches("a", ""));
+}
+
+TEST_CASE(Instrument_glob_wildcards) {
+    CHECK(globMatches("com/acme/api/OrderController", "com/acme/api/*Controller"));
+    CHECK(globMatches("com/acme/api/Controller", "com/acme/api/*Controller"));
+    CHECK(!globMatches("com/acme/api/OrderControllerImpl", "com/acme/api/*Controller"));
+    CHECK(globMatches("com/acme/api/v2/UserController", "com/acme/*/*Controller"));
+    CHECK(globMatches("getProperty", "get*"));
+    CHECK(globMatches("anything", "*"));
+    CHECK(globMatches("", "*"));
+    CHECK(globMatches("abcabcabd", "*abd"));
+    CHECK(globMatches("aXbXc", "a*b*c"));
+    CHECK(!globMatches("aXbXd", "a*b*c"));
+    CHECK(globMatches("(Ljava/lang/String;)V", "(Ljava/lang/String;*"));
+}
+
+TEST_CASE(Instrument_glob_length_bounded) {
+    // Names in the constant pool are not zero terminated
+    const char* name = "OrderControllerImpl";
+    CHECK(Instrument::matchesGlob(name, 15, "*Controller"));
+    CHECK(!Instrument::matchesGlob(name, 14, "*Controller"));
+}
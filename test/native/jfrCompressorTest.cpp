@@ -0,0 +1,46 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "jfrCompressor.h"
+#include "testRunner.hpp"
+
+static int writeTestChunk(size_t size) {
+    FILE* f = tmpfile();
+    char line[64];
+    for (size_t written = 0; written < size; ) {
+        int len = snprintf(line, sizeof(line), "FLR chunk data %zu\n", written % 1000);
+        fwrite(line, 1, len, f);
+        written += len;
+    }
+    fflush(f);
+    return dup(fileno(f));
+}
+
+TEST_CASE(JfrCompressor_gzip_members, JfrCompressor::available()) {
+    const size_t size = 1024 * 1024;
+    int chunk1 = writeTestChunk(size);
+    int chunk2 = writeTestChunk(size);
+    FILE* out = tmpfile();
+
+    JfrCompressor compressor(fileno(out));
+    compressor.submit(chunk1, size);
+    compressor.submit(chunk2, size);
+    compressor.wait();
+
+    unsigned char header[2];
+    off_t out_size = lseek(fileno(out), 0, SEEK_END);
+    ASSERT_EQ(pread(fileno(out), header, 2, 0), (ssize_t)2);
+    CHECK_EQ(header[0], 0x1f);
+    CHECK_EQ(header[1], 0x8b);
+    CHECK_OP(out_size, >, (off_t)0);
+    CHECK_OP(out_size, <, (off_t)size);
+
+    close(chunk1);
+    close(chunk2);
+    fclose(out);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "jfrStreamer.h"
+#include "testRunner.hpp"
+
+static int listenUnix(const char* path) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int createChunk(const char* data) {
+    FILE* f = tmpfile();
+    fputs(data, f);
+    fflush(f);
+    return dup(fileno(f));
+}
+
+TEST_CASE(JfrStreamer_sends_chunks) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/jfr-streamer-test.%d", getpid());
+    int server = listenUnix(path);
+    ASSERT(server >= 0);
+
+    char address[80];
+    snprintf(address, sizeof(address), "unix:%s", path);
+    JfrStreamer* streamer = new JfrStreamer(address);
+    ASSERT(!streamer->start());
+
+    streamer->submit(createChunk("FLR chunk 1;"));
+    streamer->submit(createChunk("FLR chunk 2;"));
+    delete streamer;
+
+    int conn = accept(server, NULL, NULL);
+    ASSERT(conn >= 0);
+    char buf[64] = {0};
+    size_t len = 0;
+    for (ssize_t bytes; (bytes = read(conn, buf + len, sizeof(buf) - 1 - len)) > 0; ) {
+        len += bytes;
+    }
+    CHECK_EQ(strcmp(buf, "FLR chunk 1;FLR chunk 2;"), 0);
+
+    close(conn);
+    close(server);
+    unlink(path);
+}
+
+TEST_CASE(JfrStreamer_connect_failure) {
+    JfrStreamer streamer("unix:/nonexistent/jfr-collector");
+    CHECK(streamer.start());
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "latencyHistogram.h"
+#include "testRunner.hpp"
+
+static LatencyHistogram test_histogram;
+
+TEST_CASE(LatencyHistogram_buckets_cover_values) {
+    u64 values[] = {0, 1, 31, 32, 33, 63, 64, 1000, 123456789, 1ULL << 40, (1ULL << 63) + 12345, ~0ULL};
+    for (int i = 0; i < (int)(sizeof(values) / sizeof(values[0])); i++) {
+        int bucket = LatencyHistogram::bucketOf(values[i]);
+        CHECK_OP(bucket, >=, 0);
+        CHECK_OP(bucket, <, LATENCY_BUCKETS);
+        CHECK_OP(LatencyHistogram::bucketLimit(bucket), >=, values[i]);
+        if (bucket > 0) {
+            CHECK_OP(LatencyHistogram::bucketLimit(bucket - 1), <, values[i]);
+        }
+    }
+    CHECK_EQ(LatencyHistogram::bucketOf(~0ULL), LATENCY_BUCKETS - 1);
+}
+
+TEST_CASE(LatencyHistogram_relative_precision) {
+    for (u64 value = 32; value < 100000000; value = value * 3 / 2 + 7) {
+        u64 limit = LatencyHistogram::bucketLimit(LatencyHistogram::bucketOf(value));
+        CHECK_OP((double)(limit - value) / value, <, 1.0 / (1 << LATENCY_SUB_BITS));
+    }
+}
+
+TEST_CASE(LatencyHistogram_percentiles) {
+    test_histogram.reset();
+    for (u64 i = 1; i <= 10000; i++) {
+        test_histogram.record(i * 1000);
+    }
+
+    CHECK_EQ(test_histogram.count(), (u64)10000);
+    CHECK_EQ(test_histogram.max(), (u64)10000000);
+    CHECK_EQ(test_histogram.total(), (u64)10000 * 10001 / 2 * 1000);
+
+    u64 p50 = test_histogram.percentile(0.5);
+    CHECK_OP(p50, >=, (u64)5000000);
+    CHECK_OP(p50, <, (u64)5000000 * 17 / 16);
+
+    u64 p99 = test_histogram.percentile(0.99);
+    CHECK_OP(p99, >=, (u64)9900000);
+    CHECK_OP(p99, <=, (u64)10000000);
+
+    CHECK_EQ(test_histogram.percentile(1.0), (u64)10000000);
+
+    test_histogram.reset();
+    CHECK_EQ(test_histogram.count(), (u64)0);
+    CHECK_EQ(test_histogram.percentile(0.5), (u64)0);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "linearAllocator.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+TEST_CASE(LinearAllocator_per_node_usage) {
+    const size_t chunk_size = 64 * 1024;
+    LinearAllocator allocator(chunk_size);
+
+    for (int i = 0; i < 100; i++) {
+        ASSERT(allocator.alloc(4000) != NULL);
+    }
+
+    int nodes = OS::getNumaNodeCount();
+    size_t total = 0;
+    for (int node = 0; node < nodes && node < MAX_NUMA_NODES; node++) {
+        total += allocator.usedMemory(node);
+    }
+    CHECK_EQ(total, allocator.usedMemory());
+    CHECK_OP(allocator.usedMemory(), >=, 100 * 4000);
+
+    allocator.clear();
+    CHECK_EQ(allocator.usedMemory(), chunk_size);
+    CHECK(allocator.alloc(4000) != NULL);
+}
+
+TEST_CASE(LinearAllocator_huge_pages_fallback) {
+    const size_t chunk_size = 8 * 1024 * 1024;
+    LinearAllocator allocator(chunk_size);
+    allocator.setHugePages(true);
+
+    // Whatever backing is available, allocation must succeed and be reported
+    for (int i = 0; i < 3; i++) {
+        ASSERT(allocator.alloc(chunk_size / 2) != NULL);
+    }
+    CHECK((allocator.backing() & (PAGES_HUGETLB | PAGES_TRANSPARENT | PAGES_REGULAR)) != 0);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include "logRing.h"
+#include "testRunner.hpp"
+
+static LogRing test_log_ring;
+
+TEST_CASE(LogRing_fifo_and_drops) {
+    test_log_ring.reset();
+    char buf[32];
+
+    for (u32 i = 0; i < LOG_RING_SIZE; i++) {
+        int len = snprintf(buf, sizeof(buf), "message %u", i);
+        CHECK(test_log_ring.push(1, buf, len));
+    }
+    CHECK(!test_log_ring.push(1, "overflow", 8));
+    CHECK(!test_log_ring.push(1, "overflow", 8));
+    CHECK_EQ(test_log_ring.takeDropped(), (u64)2);
+    CHECK_EQ(test_log_ring.takeDropped(), (u64)0);
+
+    for (u32 i = 0; i < LOG_RING_SIZE; i++) {
+        LogRecord* record = test_log_ring.peek();
+        ASSERT(record != NULL);
+        int len = snprintf(buf, sizeof(buf), "message %u", i);
+        CHECK_EQ(record->len, (u32)len);
+        CHECK(memcmp(record->text, buf, len) == 0);
+        test_log_ring.pop(record);
+
+        // A freed slot is reused on the next lap
+        if (i == 0) {
+            CHECK(test_log_ring.push(2, "wrapped", 7));
+        }
+    }
+
+    LogRecord* record = test_log_ring.peek();
+    ASSERT(record != NULL);
+    CHECK_EQ(record->level, 2);
+    test_log_ring.pop(record);
+    CHECK(test_log_ring.peek() == NULL);
+}
+
+static void* pushLogMessages(void* arg) {
+    for (int i = 0; i < 10000; i++) {
+        test_log_ring.push(0, "x", 1);
+    }
+    return NULL;
+}
+
+TEST_CASE(LogRing_concurrent_producers) {
+    test_log_ring.reset();
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, pushLogMessages, NULL);
+    }
+
+    u64 received = 0;
+    for (int alive = 4; alive > 0 || test_log_ring.peek() != NULL; ) {
+        LogRecord* record = test_log_ring.peek();
+        if (record != NULL) {
+            received++;
+            test_log_ring.pop(record);
+        } else if (alive > 0) {
+            pthread_join(threads[--alive], NULL);
+        }
+    }
+
+    CHECK_EQ(received + test_log_ring.takeDropped(), (u64)40000);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <map>
+#include <stdio.h>
+#include <vector>
+#include "methodMap.h"
+#include "os.h"
+#include "testRunner.hpp"
+
+static jmethodID testMethod(u32 n) {
+    // jmethodIDs are aligned pointers
+    return (jmethodID)(uintptr_t)(0x7f0000000000ULL + n * 8);
+}
+
+TEST_CASE(MethodMap_insert_and_find) {
+    MethodMap map;
+    const u32 count = 100000;
+
+    std::vector<MethodInfo*> values;
+    for (u32 i = 0; i < count; i++) {
+        MethodInfo& mi = map[testMethod(i)];
+        CHECK_EQ(mi._key, 0U);
+        mi._key = i + 1;
+        values.push_back(&mi);
+    }
+    CHECK_EQ(map.size(), (size_t)count);
+
+    // Values do not move when the table grows
+    for (u32 i = 0; i < count; i++) {
+        ASSERT_EQ(&map[testMethod(i)], values[i]);
+        ASSERT_EQ(map[testMethod(i)]._key, i + 1);
+    }
+
+    MethodInfo& unknown = map[(jmethodID)NULL];
+    unknown._key = 7;
+    CHECK_EQ(map[(jmethodID)NULL]._key, 7U);
+    CHECK_EQ(map.size(), (size_t)count + 1);
+    CHECK_OP(map.usedMemory(), >, count * sizeof(MethodInfo));
+}
+
+// Emulates frame lookups of writeStackTraces: many frames resolved against a large method set
+TEST_CASE(MethodMap_lookup_benchmark) {
+    const u32 methods = 300000;
+    const u32 frames = 1000000;
+
+    std::vector<jmethodID> trace_frames(frames);
+    u64 seed = 12345;
+    for (u32 i = 0; i < frames; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        trace_frames[i] = testMethod((u32)(seed >> 33) % methods);
+    }
+
+    std::map<jmethodID, MethodInfo> tree;
+    u64 start = OS::nanotime();
+    u64 tree_sum = 0;
+    for (u32 i = 0; i < frames; i++) {
+        MethodInfo& mi = tree[trace_frames[i]];
+        if (mi._key == 0) mi._key = tree.size();
+        tree_sum += mi._key;
+    }
+    u64 tree_time = OS::nanotime() - start;
+
+    MethodMap map;
+    start = OS::nanotime();
+    u64 map_sum = 0;
+    for (u32 i = 0; i < frames; i++) {
+        MethodInfo& mi = map[trace_frames[i]];
+        if (mi._key == 0) mi._key = map.size();
+        map_sum += mi._key;
+    }
+    u64 map_time = OS::nanotime() - start;
+
+    printf("Frame lookups: std::map %.1f Mframes/s, MethodMap %.1f Mframes/s\n",
+           frames * 1000.0 / tree_time, frames * 1000.0 / map_time);
+    CHECK_EQ(map_sum, tree_sum);
+    CHECK_EQ(map.size(), tree.size());
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "os.h"
+#include "testRunner.hpp"
+
+struct BurnerThread {
+    volatile int tid;
+    volatile bool done;
+    volatile bool stop;
+};
+
+static void* burnCpu(void* arg) {
+    BurnerThread* t = (BurnerThread*)arg;
+    t->tid = OS::threadId();
+    u64 end = OS::threadCpuTime(0) + 100000000;
+    while (OS::threadCpuTime(0) < end) {
+        // spin
+    }
+    t->done = true;
+    while (!t->stop) {
+        usleep(1000);
+    }
+    return NULL;
+}
+
+struct CollectedTimes {
+    int burner_tid;
+    int self_tid;
+    u64 burner_ticks;
+    bool self_found;
+};
+
+static void collectTimes(void* arg, int thread_id, u64 utime, u64 stime) {
+    CollectedTimes* c = (CollectedTimes*)arg;
+    if (thread_id == c->burner_tid) {
+        c->burner_ticks = utime + stime;
+    } else if (thread_id == c->self_tid) {
+        c->self_found = true;
+    }
+}
+
+TEST_CASE(OS_getThreadCpuTimes) {
+    BurnerThread burner = {0, false, false};
+    pthread_t thread;
+    ASSERT(pthread_create(&thread, NULL, burnCpu, &burner) == 0);
+    while (!burner.done) {
+        usleep(1000);
+    }
+
+    CollectedTimes times = {burner.tid, OS::threadId(), 0, false};
+    bool result = OS::getThreadCpuTimes(collectTimes, &times);
+    burner.stop = true;
+    pthread_join(thread, NULL);
+
+    CHECK(result);
+    CHECK(times.self_found);
+    // 100 ms of CPU time, with a margin for the clock tick granularity
+    CHECK_OP(times.burner_ticks, >=, (u64)sysconf(_SC_CLK_TCK) / 20);
+}
+
+// Copies the tail of SRC_FD starting at offset 3 to the end of a file that already has a header
+static bool copyAndCompare(int src_fd, const char* data, size_t size) {
+    if (write(src_fd, data, size) != (ssize_t)size) {
+        return false;
+    }
+
+    FILE* dst = tmpfile();
+    int dst_fd = fileno(dst);
+    if (write(dst_fd, "head", 4) != 4) {
+        fclose(dst);
+        return false;
+    }
+    OS::copyFile(src_fd, dst_fd, 3, size - 3);
+
+    char buf[8192];
+    ssize_t bytes = pread(dst_fd, buf, sizeof(buf), 0);
+    fclose(dst);
+    return bytes == (ssize_t)(size + 1) && memcmp(buf, "head", 4) == 0 && memcmp(buf + 4, data + 3, size - 3) == 0;
+}
+
+TEST_CASE(OS_copyFile) {
+    char data[6000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 7 + i / 256);
+    }
+
+    // The same file system and a memory file, which cannot share extents with a regular file
+    FILE* src = tmpfile();
+    CHECK(copyAndCompare(fileno(src), data, sizeof(data)));
+    fclose(src);
+
+    int memfd = OS::createMemoryFile("copyFile-test");
+    if (memfd >= 0) {
+        CHECK(copyAndCompare(memfd, data, sizeof(data)));
+        close(memfd);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "overheadBudget.h"
+#include "testRunner.hpp"
+
+const u64 SECOND = 1000000000ULL;
+
+TEST_CASE(OverheadBudget_takes_every_sample_within_budget) {
+    OverheadBudget budget;
+    budget.reset(0.01, 0);
+
+    budget.consume(SECOND / 200);
+    CHECK_EQ(budget.adjust(SECOND), false);
+    CHECK_EQ(budget.scale(), 1U);
+    for (int i = 0; i < 10; i++) {
+        CHECK_EQ(budget.take(), 1U);
+    }
+}
+
+TEST_CASE(OverheadBudget_scales_down_and_recovers) {
+    OverheadBudget budget;
+    budget.reset(0.01, 0);
+
+    // 5% overhead with 1% budget
+    budget.consume(SECOND / 20);
+    CHECK_EQ(budget.adjust(SECOND), true);
+    u32 scale = budget.scale();
+    CHECK_OP(scale, >=, 5U);
+    CHECK_OP(scale, <=, MAX_SCALE_STEP);
+
+    u32 taken = 0;
+    u64 weight = 0;
+    for (u32 i = 0; i < scale * 100; i++) {
+        u32 w = budget.take();
+        if (w != 0) {
+            taken++;
+            weight += w;
+        }
+    }
+    CHECK_EQ(taken, 100U);
+    CHECK_EQ(weight, (u64)scale * 100);
+
+    // Traffic is gone: the scale goes back step by step
+    for (int i = 2; i < 20; i++) {
+        budget.adjust(SECOND * i);
+    }
+    CHECK_EQ(budget.scale(), 1U);
+}
+
+TEST_CASE(OverheadBudget_limits_scale) {
+    OverheadBudget budget;
+    budget.reset(0.001, 0);
+
+    for (int i = 1; i < 10; i++) {
+        budget.consume(SECOND);
+        budget.adjust(SECOND * i);
+    }
+    CHECK_EQ(budget.scale(), MAX_SAMPLING_SCALE);
+}
+
+TEST_CASE(OverheadBudget_min_scale) {
+    OverheadBudget budget;
+    budget.reset(0, 0);
+    CHECK_EQ(budget.take(), 1U);
+
+    // Disabled budget still thins samples to the minimum scale
+    budget.setMinScale(4);
+    CHECK_EQ(budget.scale(), 4U);
+    u32 taken = 0;
+    for (int i = 0; i < 400; i++) {
+        if (budget.take() != 0) taken++;
+    }
+    CHECK_EQ(taken, 100U);
+
+    // An idle period does not take the scale below the minimum
+    budget.reset(0.01, 0);
+    budget.setMinScale(4);
+    for (int i = 1; i < 10; i++) {
+        budget.adjust(SECOND * i);
+    }
+    CHECK_EQ(budget.scale(), 4U);
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "overheadStats.h"
+#include "testRunner.hpp"
+
+TEST_CASE(OverheadStats_percentiles) {
+    OverheadStats stats;
+    for (int i = 0; i < 98; i++) {
+        stats.record(PHASE_STORAGE, 100);
+    }
+    stats.record(PHASE_STORAGE, 5000);
+    stats.record(PHASE_STORAGE, 100000);
+
+    CHECK_EQ(stats.count(PHASE_STORAGE), (u64)100);
+    CHECK_EQ(stats.average(PHASE_STORAGE), (u64)(98 * 100 + 5000 + 100000) / 100);
+    CHECK_EQ(stats.percentile(PHASE_STORAGE, 50), (u64)128);
+    CHECK_EQ(stats.percentile(PHASE_STORAGE, 99), (u64)8192);
+    CHECK_EQ(stats.percentile(PHASE_JFR, 50), (u64)0);
+}
@@ -286,4 +286,28 @@ TEST_CASE(ForName_kernel_tracepoint, fileReadable("/sys/kernel/tracing/events/oo
     ASSERT_EVENT_TYPE_NONZERO_CONFIG(event_type, "trace:tracepoint", PERF_TYPE_TRACEPOINT, 1);
 }
 
+#ifdef PERF_MEM_LVL_HIT
+
+static u64 dataSource(u64 mem_lvl, u64 mem_snoop) {
+    perf_mem_data_src src;
+    src.val = 0;
+    src.mem_lvl = mem_lvl;
+    src.mem_snoop = mem_snoop;
+    return src.val;
+}
+
+TEST_CASE(DataSourceName_levels) {
+    CHECK_EQ(PerfEvents::dataSourceName(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_L1, PERF_MEM_SNOOP_NONE)), "L1");
+    CHECK_EQ(PerfEvents::dataSourceName(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3, PERF_MEM_SNOOP_HIT)), "L3");
+    CHECK_EQ(PerfEvents::dataSourceName(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3, PERF_MEM_SNOOP_HITM)), "L3_hitm");
+    CHECK_EQ(PerfEvents::dataSourceName(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_LOC_RAM, 0)), "local_dram");
+    CHECK_EQ(PerfEvents::dataSourceName(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_REM_CCE1, PERF_MEM_SNOOP_HITM)), "remote_hitm");
+    CHECK_EQ(PerfEvents::dataSourceName(0), "unknown");
+
+    CHECK(PerfEvents::isHitm(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3, PERF_MEM_SNOOP_HITM)));
+    CHECK(!PerfEvents::isHitm(dataSource(PERF_MEM_LVL_HIT | PERF_MEM_LVL_L3, PERF_MEM_SNOOP_HIT)));
+}
+
+#endif // PERF_MEM_LVL_HIT
+
 #endif // __linux__
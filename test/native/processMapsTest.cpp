@@ -0,0 +1,40 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "processMaps.h"
+#include "testRunner.hpp"
+
+TEST_CASE(ProcessMaps_findLibrary) {
+    ProcessMaps maps;
+    u32 pid = (u32)getpid();
+
+    const char* lib = maps.findLibrary(pid, (u64)(uintptr_t)&snprintf);
+    ASSERT(lib != NULL);
+    CHECK(strstr(lib, "libc") != NULL);
+    // Names are interned
+    CHECK_EQ(maps.findLibrary(pid, (u64)(uintptr_t)&strlen), lib);
+
+    // Not mapped
+    CHECK(maps.findLibrary(pid, 16) == NULL);
+
+    const char* root = maps.rootFrame(pid);
+    char expected[32];
+    snprintf(expected, sizeof(expected), " pid=%u]", pid);
+    CHECK(root[0] == '[');
+    CHECK(strstr(root, expected) != NULL);
+}
+
+TEST_CASE(ProcessMaps_no_process) {
+    ProcessMaps maps;
+    CHECK(maps.findLibrary(0x7fffffff, 0x1000) == NULL);
+    CHECK(strcmp(maps.rootFrame(0x7fffffff), "[pid=2147483647]") == 0);
+}
+
+#endif // __linux__
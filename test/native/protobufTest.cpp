@@ -0,0 +1,59 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "gzipWriter.h"
+#include "protobuf.h"
+#include "testRunner.hpp"
+
+TEST_CASE(ProtoBuffer_encodes_fields) {
+    ProtoBuffer buf(4);
+    buf.field(1, (u64)150);
+    buf.field(2, "testing");
+
+    const unsigned char expected[] = {0x08, 0x96, 0x01, 0x12, 0x07, 't', 'e', 's', 't', 'i', 'n', 'g'};
+    CHECK_EQ(buf.size(), sizeof(expected));
+    CHECK(memcmp(buf.data(), expected, sizeof(expected)) == 0);
+}
+
+TEST_CASE(ProtoBuffer_commits_embedded_length) {
+    ProtoBuffer buf;
+    size_t mark = buf.startField(3);
+    for (int i = 0; i < 200; i++) {
+        buf.writeVarint(i);
+    }
+    buf.commitField(mark);
+
+    // 128 one-byte and 72 two-byte varints
+    size_t length = 128 + 72 * 2;
+    const unsigned char* data = (const unsigned char*)buf.data();
+    CHECK_EQ(buf.size(), 4 + length);
+    CHECK_EQ(data[0], 0x1a);
+    CHECK_EQ((size_t)((data[1] & 0x7f) | (data[2] & 0x7f) << 7 | data[3] << 14), length);
+}
+
+TEST_CASE(GzipWriter_writes_gzip_stream) {
+    if (!GzipWriter::available()) {
+        return;
+    }
+
+    BufferWriter out;
+    {
+        GzipWriter gz(out);
+        CHECK(gz.active());
+        for (int i = 0; i < 10000; i++) {
+            gz << "compressible line\n";
+        }
+    }
+
+    const unsigned char* data = (const unsigned char*)out.buf();
+    ASSERT(out.size() > 18);
+    CHECK_EQ(data[0], 0x1f);
+    CHECK_EQ(data[1], 0x8b);
+    CHECK_OP(out.size(), <, (size_t)10000);
+    // The trailer holds the uncompressed size
+    const unsigned char* isize = data + out.size() - 4;
+    CHECK_EQ((u32)(isize[0] | isize[1] << 8 | isize[2] << 16 | isize[3] << 24), 180000U);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "recentSamples.h"
+#include "testRunner.hpp"
+
+TEST_CASE(RecentSamples_returns_fresh_traces) {
+    RecentSamples samples;
+    CHECK_EQ(samples.get(100, 0), 0u);
+
+    samples.put(100, 7, 1000);
+    CHECK_EQ(samples.get(100, 500), 7u);
+    CHECK_EQ(samples.get(100, 1000), 7u);
+    // Too old
+    CHECK_EQ(samples.get(100, 1001), 0u);
+    // Another thread
+    CHECK_EQ(samples.get(101, 0), 0u);
+
+    samples.put(100, 8, 2000);
+    CHECK_EQ(samples.get(100, 1500), 8u);
+
+    samples.reset();
+    CHECK_EQ(samples.get(100, 0), 0u);
+}
+
+TEST_CASE(RecentSamples_evicts_colliding_threads) {
+    RecentSamples samples;
+    int tid = 5;
+    int other = tid + RECENT_SAMPLES_SIZE;
+
+    samples.put(tid, 1, 100);
+    samples.put(other, 2, 100);
+    CHECK_EQ(samples.get(tid, 0), 0u);
+    CHECK_EQ(samples.get(other, 0), 2u);
+}
+
+TEST_CASE(RecentContexts_match_same_context) {
+    RecentContexts contexts;
+    CHECK_EQ(contexts.get(100, 0x1234), 0u);
+
+    contexts.put(100, 7, 0x1234);
+    CHECK_EQ(contexts.get(100, 0x1234), 7u);
+    // The thread has moved
+    CHECK_EQ(contexts.get(100, 0x1235), 0u);
+    // Another thread in the same context
+    CHECK_EQ(contexts.get(100 + RECENT_SAMPLES_SIZE, 0x1234), 0u);
+
+    contexts.put(100, 8, 0x5678);
+    CHECK_EQ(contexts.get(100, 0x1234), 0u);
+    CHECK_EQ(contexts.get(100, 0x5678), 8u);
+
+    contexts.reset();
+    CHECK_EQ(contexts.get(100, 0x5678), 0u);
+}
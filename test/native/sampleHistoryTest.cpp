@@ -0,0 +1,48 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "sampleHistory.h"
+#include "testRunner.hpp"
+
+TEST_CASE(SampleHistory_collect_recent) {
+    SampleHistory history;
+    history.add(1, 1, 100);
+    CHECK(!history.enabled());
+
+    ASSERT(history.enable());
+    history.add(1, 1, 100);
+    history.add(2, 3, 30);
+    history.add(1, 1, 50);
+    history.add(0, 1, 10);  // failed sample
+
+    std::map<u32, HistoryTotal> totals;
+    CHECK_EQ(history.collect(60000, totals), 5ULL);
+    CHECK_EQ(totals.size(), (size_t)2);
+    CHECK_EQ(totals[1].samples, 2ULL);
+    CHECK_EQ(totals[1].counter, 150ULL);
+    CHECK_EQ(totals[2].samples, 3ULL);
+    CHECK_EQ(totals[2].counter, 30ULL);
+
+    // Re-enabling starts over
+    ASSERT(history.enable());
+    totals.clear();
+    CHECK_EQ(history.collect(60000, totals), 0ULL);
+}
+
+TEST_CASE(SampleHistory_overwrites_oldest) {
+    SampleHistory history;
+    ASSERT(history.enable());
+    for (u32 i = 0; i < SAMPLE_HISTORY_CAPACITY + 10; i++) {
+        history.add(i < 10 ? 1 : 2, 1, 1);
+    }
+
+    std::map<u32, HistoryTotal> totals;
+    CHECK_EQ(history.collect(60000, totals), (u64)SAMPLE_HISTORY_CAPACITY);
+    CHECK(totals.find(1) == totals.end());
+    CHECK_EQ(totals[2].samples, (u64)SAMPLE_HISTORY_CAPACITY);
+
+    history.disable();
+    CHECK(!history.enabled());
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "sampleRing.h"
+#include "testRunner.hpp"
+
+TEST_CASE(SampleRing_wraps_around) {
+    SampleRing ring;
+    ASSERT(ring.allocate());
+
+    const int depth = 1000;
+    ASGCT_CallFrame frames[depth];
+    memset(frames, 0, sizeof(frames));
+    ExecutionEvent event(123);
+
+    // Each sample takes ~16K, so the ring wraps several times
+    int pushed = 0;
+    for (int i = 0; i < 100; i++) {
+        frames[0].bci = i;
+        ASSERT(ring.push(i, 10, EXECUTION_SAMPLE, &event, depth, frames));
+        if (i % 20 == 19) {
+            continue;
+        }
+        RawSample* sample = ring.peek();
+        ASSERT(sample != NULL);
+        CHECK_EQ(sample->tid, pushed);
+        CHECK_EQ(sample->frames()[0].bci, pushed);
+        CHECK_EQ(sample->start_time, (u64)123);
+        ring.pop(sample);
+        pushed++;
+    }
+
+    // Fill the ring up: push fails instead of overwriting unread samples
+    int extra = 0;
+    while (ring.push(1000 + extra, 10, EXECUTION_SAMPLE, &event, depth, frames)) {
+        extra++;
+    }
+    CHECK_OP(extra, <, (int)(SAMPLE_RING_SIZE / (depth * sizeof(ASGCT_CallFrame))));
+
+    int remaining = 0;
+    for (RawSample* sample; (sample = ring.peek()) != NULL; ring.pop(sample)) {
+        remaining++;
+    }
+    CHECK_EQ(remaining, 100 - pushed + extra);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "scopeCache.h"
+#include "testRunner.hpp"
+
+static char scope_test_code[256];
+static ScopeCache test_scope_cache;
+
+static void fillTestFrames(ASGCT_CallFrame* frames, int count) {
+    for (int i = 0; i < count; i++) {
+        frames[i].bci = i * 10;
+        frames[i].method_id = (jmethodID)(scope_test_code + i);
+    }
+}
+
+TEST_CASE(ScopeCache_returns_stored_frames) {
+    test_scope_cache.reset();
+    const void* pc = scope_test_code + 64;
+    const void* nm = scope_test_code;
+
+    ASGCT_CallFrame frames[SCOPE_CACHE_FRAMES];
+    CHECK_EQ(test_scope_cache.lookup(pc, nm, 5, frames, SCOPE_CACHE_FRAMES), 0);
+
+    ASGCT_CallFrame stored[3];
+    fillTestFrames(stored, 3);
+    test_scope_cache.store(pc, nm, 5, stored, 3);
+
+    ASSERT_EQ(test_scope_cache.lookup(pc, nm, 5, frames, SCOPE_CACHE_FRAMES), 3);
+    for (int i = 0; i < 3; i++) {
+        CHECK_EQ(frames[i].bci, stored[i].bci);
+        CHECK_EQ(frames[i].method_id, stored[i].method_id);
+    }
+
+    // Truncated to the remaining stack depth
+    CHECK_EQ(test_scope_cache.lookup(pc, nm, 5, frames, 2), 2);
+
+    CHECK_EQ(test_scope_cache.hits(), (u64)2);
+    CHECK_EQ(test_scope_cache.misses(), (u64)1);
+}
+
+TEST_CASE(ScopeCache_rejects_other_nmethods) {
+    test_scope_cache.reset();
+    const void* pc = scope_test_code + 64;
+    const void* nm = scope_test_code;
+
+    ASGCT_CallFrame frames[SCOPE_CACHE_FRAMES];
+    fillTestFrames(frames, 2);
+    test_scope_cache.store(pc, nm, 5, frames, 2);
+
+    // A recompiled method at the same address has a different compile ID
+    CHECK_EQ(test_scope_cache.lookup(pc, nm, 6, frames, SCOPE_CACHE_FRAMES), 0);
+    CHECK_EQ(test_scope_cache.lookup(pc, scope_test_code + 8, 5, frames, SCOPE_CACHE_FRAMES), 0);
+    CHECK_EQ(test_scope_cache.lookup(NULL, nm, 5, frames, SCOPE_CACHE_FRAMES), 0);
+}
+
+TEST_CASE(ScopeCache_skips_deep_scopes) {
+    test_scope_cache.reset();
+    const void* pc = scope_test_code + 128;
+
+    ASGCT_CallFrame frames[SCOPE_CACHE_FRAMES + 1];
+    fillTestFrames(frames, SCOPE_CACHE_FRAMES + 1);
+    test_scope_cache.store(pc, scope_test_code, 1, frames, SCOPE_CACHE_FRAMES + 1);
+    CHECK_EQ(test_scope_cache.lookup(pc, scope_test_code, 1, frames, SCOPE_CACHE_FRAMES + 1), 0);
+
+    test_scope_cache.store(pc, scope_test_code, 1, frames, SCOPE_CACHE_FRAMES);
+    CHECK_EQ(test_scope_cache.lookup(pc, scope_test_code, 1, frames, SCOPE_CACHE_FRAMES + 1), SCOPE_CACHE_FRAMES);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "stackStitcher.h"
+#include "testRunner.hpp"
+
+static StackStitcher test_stitcher;
+
+static void fillBottomFrames(ASGCT_CallFrame* frames, int count) {
+    for (int i = 0; i < count; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(uintptr_t)(0x1000 + i);
+    }
+}
+
+TEST_CASE(StackStitcher_reuses_bottom_of_the_stack) {
+    ASSERT(test_stitcher.init(64));
+    const void* pc = (const void*)0x7000;
+
+    ASGCT_CallFrame bottom[40];
+    fillBottomFrames(bottom, 40);
+    test_stitcher.store(123, pc, 0x8000, 0x8010, bottom, 40);
+
+    ASGCT_CallFrame frames[64];
+    ASSERT_EQ(test_stitcher.stitch(123, pc, 0x8000, 0x8010, frames, 64), 40);
+    CHECK_EQ(frames[39].bci, 39);
+    CHECK_EQ(frames[39].method_id, bottom[39].method_id);
+
+    // Truncated to the remaining stack depth
+    CHECK_EQ(test_stitcher.stitch(123, pc, 0x8000, 0x8010, frames, 10), 10);
+
+    // Another frame or another thread
+    CHECK_EQ(test_stitcher.stitch(123, pc, 0x8100, 0x8010, frames, 64), 0);
+    CHECK_EQ(test_stitcher.stitch(123, (const void*)0x7004, 0x8000, 0x8010, frames, 64), 0);
+    CHECK_EQ(test_stitcher.stitch(123 + STITCH_SLOTS, pc, 0x8000, 0x8010, frames, 64), 0);
+
+    CHECK_EQ(test_stitcher.hits(), (u64)2);
+    CHECK_EQ(test_stitcher.misses(), (u64)3);
+}
+
+TEST_CASE(StackStitcher_limits_reuse) {
+    ASSERT(test_stitcher.init(64));
+    const void* pc = (const void*)0x7000;
+
+    ASGCT_CallFrame frames[64];
+    fillBottomFrames(frames, 20);
+    test_stitcher.store(5, pc, 0x8000, 0x8010, frames, 20);
+
+    for (int i = 0; i < STITCH_MAX_REUSE; i++) {
+        CHECK_EQ(test_stitcher.stitch(5, pc, 0x8000, 0x8010, frames, 64), 20);
+    }
+    // The stack has to be walked again, which refreshes the entry
+    CHECK_EQ(test_stitcher.stitch(5, pc, 0x8000, 0x8010, frames, 64), 0);
+    test_stitcher.store(5, pc, 0x8000, 0x8010, frames, 20);
+    CHECK_EQ(test_stitcher.stitch(5, pc, 0x8000, 0x8010, frames, 64), 20);
+}
+
+TEST_CASE(StackStitcher_caps_stored_frames) {
+    ASSERT(test_stitcher.init(16));
+    const void* pc = (const void*)0x7000;
+
+    ASGCT_CallFrame frames[32];
+    fillBottomFrames(frames, 32);
+    test_stitcher.store(7, pc, 0x8000, 0x8010, frames, 32);
+    CHECK_EQ(test_stitcher.stitch(7, pc, 0x8000, 0x8010, frames, 32), 16);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "profiler.h"
+#include "stackWalker.h"
+#include "testRunner.hpp"
+
+TEST_CASE(StackWalker_findCallSite) {
+    // Return addresses of a walked stack, top first
+    const void* callchain[] = {(const void*)0x1000, (const void*)0x2005, (const void*)0x3010, (const void*)0x4002};
+
+    CHECK_EQ(StackWalker::findCallSite((const void*)0x2000, callchain, 4), 1);
+    CHECK_EQ(StackWalker::findCallSite((const void*)0x3001, callchain, 4), 2);
+    CHECK_EQ(StackWalker::findCallSite((const void*)0x4000, callchain, 4), 3);
+
+    // A return address never equals its call site, and calls are at most 15 bytes long
+    CHECK_EQ(StackWalker::findCallSite((const void*)0x1000, callchain, 4), -1);
+    CHECK_EQ(StackWalker::findCallSite((const void*)0x3000, callchain, 4), -1);
+    CHECK_EQ(StackWalker::findCallSite((const void*)0x4000, callchain, 3), -1);
+}
+
+TEST_CASE(StackWalker_walkBelow) {
+    StackContext java_ctx = {NULL, 0, 0};
+    const void* callchain[MAX_NATIVE_FRAMES];
+
+    // No frame of a real stack returns to this address
+    CHECK_EQ(StackWalker::walkBelow((const void*)0x10, NULL, callchain, MAX_NATIVE_FRAMES, &java_ctx), 0);
+    CHECK(java_ctx.pc == NULL);
+}
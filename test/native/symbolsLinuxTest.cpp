@@ -7,8 +7,12 @@
 
 #include "codeCache.h"
 #include "profiler.h"
+#include "symbols.h"
 #include "testRunner.hpp"
+#include <dirent.h>
 #include <dlfcn.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 const void* resolveSymbol(const char* lib, const char* name) {
     void* result = dlopen(lib, RTLD_NOW);
@@ -71,4 +75,58 @@ TEST_CASE(MultipleMatchingSymbols) {
     ASSERT_NE(sym, sym_cold);
 }
 
+TEST_CASE(ParsedLibrariesMatchTheirIndex) {
+    ASSERT(dlopen("libvaddrdif.so", RTLD_NOW));
+    Profiler::instance()->updateSymbols(false);
+
+    // Libraries are parsed in parallel, but published in the order of their lib_index
+    CodeCacheArray* libs = Profiler::instance()->nativeLibs();
+    ASSERT_OP(libs->count(), >, 1);
+    for (int i = 0; i < libs->count(); i++) {
+        CodeCache* cc = (*libs)[i];
+        const void* first = cc->findSymbolByPrefix("");
+        if (first != NULL) {
+            const char* name = cc->binarySearch(first);
+            CHECK(name == cc->name() || NativeFunc::libIndex(name) == i);
+        }
+    }
+}
+
+TEST_CASE(KernelSymbolsAreCached) {
+    char dir[] = "/tmp/asprof-kallsyms-XXXXXX";
+    ASSERT(mkdtemp(dir));
+    setenv("ASPROF_SYMBOL_CACHE", dir, 1);
+
+    CodeCache parsed("[kernel]");
+    Symbols::parseKernelSymbols(&parsed);
+    CodeCache cached("[kernel]");
+    if (Symbols::haveKernelSymbols()) {
+        Symbols::parseKernelSymbols(&cached);
+    }
+    unsetenv("ASPROF_SYMBOL_CACHE");
+
+    int files = 0;
+    DIR* d = opendir(dir);
+    for (struct dirent* entry; d != NULL && (entry = readdir(d)) != NULL; ) {
+        if (strncmp(entry->d_name, "kallsyms-", 9) == 0) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+            files++;
+        }
+    }
+    if (d != NULL) closedir(d);
+    rmdir(dir);
+
+    // Without access to kernel addresses, nothing is cached
+    CHECK_EQ(files, Symbols::haveKernelSymbols() ? 1 : 0);
+    CHECK_EQ(cached.count(), parsed.count());
+    if (parsed.count() > 0) {
+        cached.sort();
+        parsed.sort();
+        const void* addr = parsed.findSymbolByPrefix("");
+        CHECK_EQ(strcmp(cached.binarySearch(addr), parsed.binarySearch(addr)), 0);
+    }
+}
+
 #endif // __linux__
@@ -0,0 +1,74 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "threadFilter.h"
+#include "testRunner.hpp"
+
+static ThreadFilter test_thread_filter;
+
+TEST_CASE(ThreadFilter_add_remove_collect) {
+    test_thread_filter.clear();
+
+    int tids[] = {1, 31, 32, 1000, 3000000, 4000000};
+    for (int i = sizeof(tids) / sizeof(tids[0]) - 1; i >= 0; i--) {
+        test_thread_filter.add(tids[i]);
+    }
+    test_thread_filter.add(1000);
+    CHECK_EQ(test_thread_filter.size(), 6);
+
+    CHECK(test_thread_filter.accept(31));
+    CHECK(test_thread_filter.accept(4000000));
+    CHECK(!test_thread_filter.accept(33));
+    CHECK(!test_thread_filter.accept(3999999));
+
+    std::vector<int> v;
+    test_thread_filter.collect(v);
+    ASSERT_EQ(v.size(), 6);
+    for (int i = 0; i < 6; i++) {
+        CHECK_EQ(v[i], tids[i]);
+    }
+
+    test_thread_filter.remove(31);
+    test_thread_filter.remove(3000000);
+    test_thread_filter.remove(3000000);
+    CHECK_EQ(test_thread_filter.size(), 4);
+    CHECK(!test_thread_filter.accept(3000000));
+
+    // Emptied words must not show up, and re-added threads must
+    v.clear();
+    test_thread_filter.collect(v);
+    ASSERT_EQ(v.size(), 4);
+    CHECK_EQ(v[0], 1);
+    CHECK_EQ(v[1], 32);
+    CHECK_EQ(v[3], 4000000);
+
+    test_thread_filter.add(3000000);
+    v.clear();
+    test_thread_filter.collect(v);
+    ASSERT_EQ(v.size(), 5);
+    CHECK_EQ(v[3], 3000000);
+
+    test_thread_filter.clear();
+    CHECK_EQ(test_thread_filter.size(), 0);
+    CHECK(!test_thread_filter.accept(1000));
+    v.clear();
+    test_thread_filter.collect(v);
+    CHECK_EQ(v.size(), 0);
+}
+
+TEST_CASE(ThreadFilter_init_ranges) {
+    ThreadFilter* filter = new ThreadFilter();
+    filter->init("1-3,7");
+    CHECK(filter->enabled());
+    CHECK_EQ(filter->size(), 4);
+
+    std::vector<int> v;
+    filter->collect(v);
+    ASSERT_EQ(v.size(), 4);
+    CHECK_EQ(v[0], 1);
+    CHECK_EQ(v[2], 3);
+    CHECK_EQ(v[3], 7);
+    delete filter;
+}
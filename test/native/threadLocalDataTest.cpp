@@ -0,0 +1,53 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "threadLocalData.h"
+#include "userEvents.h"
+#include "testRunner.hpp"
+
+TEST_CASE(ThreadLocalData_sampling_priority) {
+    asprof_thread_local_data* data = ThreadLocalData::getThreadLocalData();
+    ASSERT(data != NULL);
+    ThreadLocalState* state = ThreadLocalData::current();
+    ASSERT(state != NULL);
+    CHECK_EQ(data->sampling_priority, ASPROF_PRIORITY_NORMAL);
+    CHECK(ThreadLocalData::acceptSample(state));
+
+    data->sampling_priority = -2;
+    int accepted = 0;
+    for (int i = 0; i < 40; i++) {
+        if (ThreadLocalData::acceptSample(state)) accepted++;
+    }
+    CHECK_EQ(accepted, 10);
+
+    data->sampling_priority = ASPROF_PRIORITY_NONE;
+    CHECK(!ThreadLocalData::acceptSample(state));
+
+    data->sampling_priority = ASPROF_PRIORITY_NORMAL;
+    CHECK(ThreadLocalData::acceptSample(state));
+}
+
+TEST_CASE(ThreadLocalData_tracing_context) {
+    asprof_thread_local_data* data = ThreadLocalData::getThreadLocalData();
+    ASSERT(data != NULL);
+    ThreadLocalState* state = ThreadLocalData::current();
+
+    ExecutionEvent event(0);
+    ThreadLocalData::getContext(state, event._context);
+    CHECK_EQ(event._context.span_id, (u64)0);
+
+    data->span_id = 0;
+    data->trace_id = 0x1234;
+    data->context_tag = UserEvents::registerContextTag("/checkout");
+    data->span_id = 0xabcd;
+
+    ThreadLocalData::getContext(state, event._context);
+    CHECK_EQ(event._context.span_id, (u64)0xabcd);
+    CHECK_EQ(event._context.trace_id, (u64)0x1234);
+    CHECK_EQ(event._context.tag, UserEvents::registerContextTag("/checkout"));
+    CHECK(event._context.tag != 0);
+
+    data->span_id = 0;
+}
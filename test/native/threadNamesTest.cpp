@@ -0,0 +1,108 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "os.h"
+#include "threadNames.h"
+#include "testRunner.hpp"
+
+static ThreadNames test_thread_names;
+
+TEST_CASE(ThreadNames_set_and_update) {
+    test_thread_names.clear();
+    const char* name;
+    jlong java_thread_id;
+
+    test_thread_names.set(12345, "worker-1", 17);
+    ASSERT((name = test_thread_names.get(12345, &java_thread_id)) != NULL);
+    CHECK_EQ(name, "worker-1");
+    CHECK_EQ(java_thread_id, (jlong)17);
+
+    // Renamed thread
+    test_thread_names.set(12345, "worker-renamed", 17);
+    ASSERT((name = test_thread_names.get(12345, &java_thread_id)) != NULL);
+    CHECK_EQ(name, "worker-renamed");
+
+    // Far apart thread IDs live in different pages
+    test_thread_names.set(4000000, "high-tid", 18);
+    ASSERT((name = test_thread_names.get(4000000, &java_thread_id)) != NULL);
+    CHECK_EQ(name, "high-tid");
+    CHECK_EQ(java_thread_id, (jlong)18);
+
+    test_thread_names.clear();
+    CHECK(test_thread_names.get(4000000, &java_thread_id) == NULL);
+}
+
+TEST_CASE(ThreadNames_out_of_range) {
+    jlong java_thread_id;
+
+    test_thread_names.set(-1, "negative", 1);
+    CHECK(test_thread_names.get(-1, &java_thread_id) == NULL);
+}
+
+TEST_CASE(ThreadNames_interned) {
+    test_thread_names.clear();
+    jlong java_thread_id;
+
+    test_thread_names.set(100, "pool-worker", 1);
+    test_thread_names.set(101, "pool-worker", 2);
+    const char* first = test_thread_names.get(100, &java_thread_id);
+    ASSERT(first != NULL);
+    CHECK(test_thread_names.get(101, &java_thread_id) == first);
+
+    // A name returned before renaming remains valid
+    test_thread_names.set(100, "pool-worker-busy", 1);
+    CHECK_EQ(first, "pool-worker");
+    test_thread_names.set(100, "pool-worker", 1);
+    CHECK(test_thread_names.get(100, &java_thread_id) == first);
+
+    // Growing the table keeps names
+    char buf[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "thread-%d", i);
+        test_thread_names.set(200 + i, buf, i);
+    }
+    CHECK_EQ(test_thread_names.get(200 + 4321, &java_thread_id), "thread-4321");
+    CHECK(test_thread_names.get(101, &java_thread_id) == first);
+}
+
+TEST_CASE(ThreadNames_native_thread_resolved_by_os) {
+    test_thread_names.clear();
+    int tid = OS::threadId();
+
+    char os_name[64];
+    if (!OS::threadName(tid, os_name, sizeof(os_name))) {
+        printf("Thread names unavailable, skipping\n");
+        return;
+    }
+
+    jlong java_thread_id = -1;
+    const char* name = test_thread_names.get(tid, &java_thread_id);
+    ASSERT(name != NULL);
+    CHECK_EQ(name, os_name);
+    CHECK_EQ(java_thread_id, (jlong)0);
+}
+
+TEST_CASE(ThreadNames_groups) {
+    char buf[64];
+    ThreadNames::groupName("pool-1-thread-17", buf, sizeof(buf));
+    CHECK_EQ((const char*)buf, "pool-1-thread-*");
+    ThreadNames::groupName("C2 CompilerThread0", buf, sizeof(buf));
+    CHECK_EQ((const char*)buf, "C2 CompilerThread*");
+    ThreadNames::groupName("main", buf, sizeof(buf));
+    CHECK_EQ((const char*)buf, "main");
+    ThreadNames::groupName("12345", buf, sizeof(buf));
+    CHECK_EQ((const char*)buf, "12345");
+    ThreadNames::groupName("", buf, sizeof(buf));
+    CHECK_EQ((const char*)buf, "");
+
+    test_thread_names.clear();
+    CHECK_EQ(test_thread_names.group(300), 0u);
+    test_thread_names.set(300, "pool-1-thread-1", 1);
+    test_thread_names.setGroup(300, 7);
+    CHECK_EQ(test_thread_names.group(300), 7u);
+
+    test_thread_names.clear();
+    CHECK_EQ(test_thread_names.group(300), 0u);
+}
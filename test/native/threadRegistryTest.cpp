@@ -0,0 +1,57 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <algorithm>
+#include "threadRegistry.h"
+#include "testRunner.hpp"
+
+static std::vector<int> registeredThreads() {
+    std::vector<int> threads;
+    ThreadRegistry::collect(threads);
+    std::sort(threads.begin(), threads.end());
+    return threads;
+}
+
+TEST_CASE(ThreadRegistry_tracks_thread_events) {
+    ThreadRegistry::enable();
+    ThreadRegistry::onThreadStart(100);
+    ThreadRegistry::onThreadStart(200);
+    ThreadRegistry::onThreadStart(300);
+    ThreadRegistry::onThreadEnd(200);
+
+    std::vector<int> threads = registeredThreads();
+    CHECK_EQ(threads.size(), (size_t)2);
+    CHECK_EQ(threads[0], 100);
+    CHECK_EQ(threads[1], 300);
+
+    // Events are ignored while the registry is off, and enabling it again starts over
+    ThreadRegistry::disable();
+    ThreadRegistry::onThreadStart(400);
+    ThreadRegistry::enable();
+    CHECK_EQ(registeredThreads().size(), (size_t)0);
+    ThreadRegistry::disable();
+}
+
+TEST_CASE(ThreadRegistry_rescan_merges_os_threads) {
+    ThreadRegistry::enable();
+    CHECK(ThreadRegistry::claimRescan());
+    CHECK(!ThreadRegistry::claimRescan());
+
+    ThreadRegistry::onThreadStart(100);
+    ThreadRegistry::onThreadStart(200);
+    std::vector<int> known = registeredThreads();
+
+    // 200 has exited without an event, 300 comes from elsewhere, 400 starts during the rescan
+    int os_threads[] = {300, 100};
+    ThreadRegistry::onThreadStart(400);
+    ThreadRegistry::rescan(known, os_threads, 2);
+
+    std::vector<int> threads = registeredThreads();
+    CHECK_EQ(threads.size(), (size_t)3);
+    CHECK_EQ(threads[0], 100);
+    CHECK_EQ(threads[1], 300);
+    CHECK_EQ(threads[2], 400);
+    ThreadRegistry::disable();
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "traceClassifier.h"
+#include "testRunner.hpp"
+
+// Frames are listed from the top of the stack
+static int classifyFrames(int num_frames, const char* const* names, const u8* types) {
+    u8 hints[16];
+    for (int i = 0; i < num_frames; i++) {
+        hints[i] = types[i] == FRAME_NATIVE || types[i] == FRAME_CPP
+            ? TraceClassifier::nativeHint(names[i], (FrameTypeId)types[i]) : HINT_NONE;
+    }
+    return TraceClassifier::classify(num_frames, hints, types);
+}
+
+TEST_CASE(TraceClassifier_vm_threads) {
+    const char* gc[] = {"G1ParTask::work", "WorkerThread::run", "Thread::call_run", "thread_native_entry", "start_thread"};
+    const u8 gc_types[] = {FRAME_CPP, FRAME_CPP, FRAME_CPP, FRAME_CPP, FRAME_NATIVE};
+    CHECK_EQ(classifyFrames(5, gc, gc_types), CATEGORY_GC);
+
+    const char* jit[] = {"C2Compiler::compile_method", "CompileBroker::compiler_thread_loop", "thread_native_entry"};
+    const u8 jit_types[] = {FRAME_CPP, FRAME_CPP, FRAME_CPP};
+    CHECK_EQ(classifyFrames(3, jit, jit_types), CATEGORY_JIT);
+
+    const char* vm[] = {"VMThread::loop", "Thread::call_run", "thread_native_entry"};
+    const u8 vm_types[] = {FRAME_CPP, FRAME_CPP, FRAME_CPP};
+    CHECK_EQ(classifyFrames(3, vm, vm_types), CATEGORY_VM);
+}
+
+TEST_CASE(TraceClassifier_java_frames) {
+    const char* c2[] = {"memcpy", "", "", "call_stub"};
+    const u8 c2_types[] = {FRAME_NATIVE, FRAME_JIT_COMPILED, FRAME_INTERPRETED, FRAME_NATIVE};
+    CHECK_EQ(classifyFrames(4, c2, c2_types), CATEGORY_NATIVE);
+
+    const char* copy[] = {"jint_disjoint_arraycopy", "", ""};
+    const u8 copy_types[] = {FRAME_NATIVE, FRAME_JIT_COMPILED, FRAME_INTERPRETED};
+    CHECK_EQ(classifyFrames(3, copy, copy_types), CATEGORY_C2_COMP);
+
+    const char* unsafe[] = {"Unsafe_Park", ""};
+    const u8 unsafe_types[] = {FRAME_NATIVE, FRAME_INLINED};
+    CHECK_EQ(classifyFrames(2, unsafe, unsafe_types), CATEGORY_VM);
+
+    const char* resolve[] = {"SymbolTable::lookup", "LinkResolver::resolve_invoke", "InterpreterRuntime::resolve_from_cache", ""};
+    const u8 resolve_types[] = {FRAME_CPP, FRAME_CPP, FRAME_CPP, FRAME_INTERPRETED};
+    CHECK_EQ(classifyFrames(4, resolve, resolve_types), CATEGORY_CLASS_RESOLVE);
+}
+
+TEST_CASE(TraceClassifier_java_hints) {
+    CHECK_EQ(TraceClassifier::javaHint("java/lang/ClassLoader", "loadClass"), HINT_CLASS_LOAD);
+    CHECK_EQ(TraceClassifier::javaHint("jdk/internal/loader/ClassLoaders$AppClassLoader", "loadClass"), HINT_CLASS_LOAD);
+    CHECK_EQ(TraceClassifier::javaHint("java/lang/invoke/LambdaMetafactory", "altMetafactory"), HINT_LAMBDA_INIT);
+    CHECK_EQ(TraceClassifier::javaHint("java/lang/String", "loadClass"), HINT_NONE);
+}
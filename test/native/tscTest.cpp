@@ -0,0 +1,23 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "tsc.h"
+#include "testRunner.hpp"
+
+TEST_CASE(TSC_nanos_follows_monotonic_clock) {
+    TSC::calibrate();
+
+    u64 nanos0 = TSC::nanos();
+    u64 os0 = OS::nanotime();
+    OS::sleep(50000000);
+    u64 nanos1 = TSC::nanos();
+    u64 os1 = OS::nanotime();
+
+    CHECK_OP(nanos1, >, nanos0);
+    double elapsed = (double)(nanos1 - nanos0);
+    double expected = (double)(os1 - os0);
+    CHECK_OP(elapsed, >, expected * 0.95);
+    CHECK_OP(elapsed, <, expected * 1.05);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "unwindCache.h"
+#include "testRunner.hpp"
+
+static char unwind_test_text[4096];
+
+TEST_CASE(UnwindCache_hits_repeated_pcs) {
+    CodeCache lib("libtest.so", 0, false, unwind_test_text, unwind_test_text + sizeof(unwind_test_text));
+    lib.setTextBase(unwind_test_text);
+    // The library owns its DWARF table
+    FrameDesc* table = (FrameDesc*)malloc(2 * sizeof(FrameDesc));
+    FrameDesc frames[2] = {{0, DW_REG_SP | 16 << 8, DW_SAME_FP, -8}, {1024, DW_REG_SP | 32 << 8, DW_SAME_FP, -8}};
+    memcpy(table, frames, sizeof(frames));
+    lib.setDwarfTable(table, 2);
+
+    CodeCacheArray libs;
+    libs.add(&lib);
+
+    UnwindCache cache;
+    const void* pc1 = unwind_test_text + 100;
+    const void* pc2 = unwind_test_text + 2000;
+    for (int i = 0; i < 10; i++) {
+        CHECK_EQ(cache.findFrameDesc(pc1, &libs)->cfa, DW_REG_SP | 16 << 8);
+        CHECK_EQ(cache.findFrameDesc(pc2, &libs)->cfa, DW_REG_SP | 32 << 8);
+    }
+    CHECK_EQ(cache.findLibrary(pc1, &libs), &lib);
+    CHECK_EQ(cache.misses(), (u64)2);
+    CHECK_EQ(cache.hits(), (u64)19);
+
+    // Addresses outside of known libraries unwind with the default frame
+    const void* outside = unwind_test_text + sizeof(unwind_test_text);
+    CHECK(cache.findLibrary(outside, &libs) == NULL);
+    CHECK_EQ(cache.findFrameDesc(outside, &libs), &FrameDesc::default_frame);
+}
+
+TEST_CASE(UnwindCache_resets_on_library_load) {
+    CodeCache lib1("libfirst.so", 0, false, unwind_test_text, unwind_test_text + 2048);
+    CodeCache lib2("libsecond.so", 1, false, unwind_test_text + 2048, unwind_test_text + 4096);
+
+    CodeCacheArray libs;
+    libs.add(&lib1);
+
+    UnwindCache cache;
+    const void* pc = unwind_test_text + 3000;
+    CHECK(cache.findLibrary(pc, &libs) == NULL);
+
+    libs.add(&lib2);
+    CHECK_EQ(cache.findLibrary(pc, &libs), &lib2);
+    CHECK_EQ(cache.misses(), (u64)2);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "arguments.h"
+#include "testRunner.hpp"
+#include "writer.h"
+#include "zstdWriter.h"
+
+TEST_CASE(FileWriter_mixes_buffered_and_direct_writes) {
+    char path[] = "/tmp/writerTestXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0);
+
+    std::string expected;
+    {
+        FileWriter out(fd, 64);
+        char buf[200];
+        for (int i = 0; i < 1000; i++) {
+            // Lengths vary from tiny writes to ones larger than the buffer
+            size_t len = (i * 37) % sizeof(buf);
+            memset(buf, 'a' + i % 26, len);
+            out.write(buf, len);
+            expected.append(buf, len);
+        }
+        CHECK(out.good());
+    }
+
+    int in = open(path, O_RDONLY);
+    ASSERT(in >= 0);
+    std::string actual;
+    char buf[4096];
+    ssize_t bytes;
+    while ((bytes = read(in, buf, sizeof(buf))) > 0) {
+        actual.append(buf, bytes);
+    }
+    close(in);
+    unlink(path);
+
+    CHECK_EQ(actual.size(), expected.size());
+    CHECK(actual == expected);
+}
+
+TEST_CASE(ZstdWriter_writes_zstd_frame) {
+    if (!ZstdWriter::available()) {
+        return;
+    }
+
+    BufferWriter out;
+    {
+        ZstdWriter zst(out);
+        CHECK(zst.active());
+        for (int i = 0; i < 10000; i++) {
+            zst << "compressible line\n";
+        }
+        CHECK(zst.good());
+    }
+
+    const unsigned char* data = (const unsigned char*)out.buf();
+    ASSERT(out.size() > 8);
+    CHECK_EQ((u32)(data[0] | data[1] << 8 | data[2] << 16 | data[3] << 24), 0xFD2FB528U);
+    CHECK_OP(out.size(), <, (size_t)10000);
+}
+
+TEST_CASE(Arguments_compressed_output_files) {
+    Arguments collapsed;
+    ASSERT(!collapsed.parse("file=/tmp/profile.collapsed.gz"));
+    CHECK_EQ(collapsed._output, OUTPUT_COLLAPSED);
+    CHECK_EQ(Arguments::detectCompression(collapsed._file), COMPRESS_GZIP);
+
+    Arguments html;
+    ASSERT(!html.parse("file=/tmp/profile.html.zst"));
+    CHECK_EQ(html._output, OUTPUT_FLAMEGRAPH);
+    CHECK_EQ(Arguments::detectCompression(html._file), COMPRESS_ZSTD);
+
+    Arguments pprof;
+    ASSERT(!pprof.parse("file=/tmp/profile.pb.gz"));
+    CHECK_EQ(pprof._output, OUTPUT_PPROF);
+    CHECK_EQ(Arguments::detectCompression(pprof._file), COMPRESS_NONE);
+
+    Arguments jfr;
+    ASSERT(!jfr.parse("file=/tmp/profile.jfr.gz"));
+    CHECK_EQ(jfr._output, OUTPUT_JFR);
+    CHECK(jfr.hasOption(GZIP_CHUNKS));
+
+    Arguments text;
+    ASSERT(!text.parse("file=/tmp/profile.gz"));
+    CHECK_EQ(text._output, OUTPUT_TEXT);
+
+    Arguments zstd_jfr;
+    CHECK(zstd_jfr.parse("file=/tmp/profile.jfr.zst"));
+
+    Arguments gzip_pprof;
+    CHECK(gzip_pprof.parse("file=/tmp/profile.pprof.gz"));
+}
@@ -41,6 +41,14 @@ public class AllocTests {
         assert out.contains("java\\.util\\.HashMap\\$Node\\[]");
     }
 
+    @Test(mainClass = MapReaderOpt.class, jvmArgs = "-XX:+UseParallelGC -Xmx1g -Xms1g", jvm = {Jvm.HOTSPOT, Jvm.ZING})
+    public void allocHisto(TestProcess p) throws Exception {
+        Output out = p.profile("-e alloc --alloc 1k --alloc-histo -d 3 -o flat=10");
+        assert out.contains("--- Allocated classes ---");
+        assert out.contains(" java\\.util\\.HashMap\\$Node\\[]");
+        assert !out.contains("--- \\d+ bytes");
+    }
+
     @Test(mainClass = Hello.class, agentArgs = "start,event=alloc,alloc=1,cstack=fp,flamegraph,file=%f", jvmArgs = "-XX:+UseG1GC -XX:-UseTLAB")
     public void startup(TestProcess p) throws Exception {
         Output out = p.waitForExit("%f");
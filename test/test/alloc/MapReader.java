@@ -52,10 +52,14 @@ public class MapReader {
         return map;
     }
 
+    public void read() throws IOException {
+        readMap(new ByteArrayInputStream(input));
+    }
+
     public void benchmark() throws IOException {
         while (true) {
             long start = System.nanoTime();
-            readMap(new ByteArrayInputStream(input));
+            read();
             long end = System.nanoTime();
             System.out.println((end - start) / 1e9);
         }
@@ -19,6 +19,14 @@ public class ApiTests {
         assert out.contains("BusyLoops.method3;");
     }
 
+    @Test(mainClass = DumpToStream.class, jvmArgs = "-Djava.library.path=build/lib", output = true)
+    public void stream(TestProcess p) throws Exception {
+        Output out = p.waitForExit(TestProcess.STDOUT);
+        assert out.contains("BusyLoops.method1;");
+        assert out.contains("BusyLoops.method2;");
+        assert out.contains("BusyLoops.method3;");
+    }
+
     @Test(mainClass = StopResume.class, jvmArgs = "-Djava.library.path=build/lib", output = true)
     public void stopResume(TestProcess p) throws Exception {
         Output out = p.waitForExit(TestProcess.STDOUT);
@@ -26,4 +34,14 @@ public class ApiTests {
         assert out.contains("BusyLoops.method2");
         assert !out.contains("BusyLoops.method3");
     }
+
+    @Test(mainClass = Metrics.class, jvmArgs = "-Djava.library.path=build/lib", output = true)
+    public void metrics(TestProcess p) throws Exception {
+        Output out = p.waitForExit(TestProcess.STDOUT);
+        assert out.samples("^Samples ") > 0;
+        assert out.samples("^CallTraceStorageBytes ") > 0;
+        assert out.samples("^UsedMemoryBytes ") >= out.samples("^CallTraceStorageBytes ");
+        assert out.samples("^JavaUnwindNanos ") > 0;
+        assert out.contains("^FailedSamples ");
+    }
 }
@@ -0,0 +1,29 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package test.api;
+
+import one.profiler.AsyncProfiler;
+import one.profiler.Counter;
+import one.profiler.Events;
+
+import java.io.ByteArrayOutputStream;
+
+public class DumpToStream extends BusyLoops {
+
+    public static void main(String[] args) throws Exception {
+        AsyncProfiler.getInstance().start(Events.CPU, 1_000_000);
+
+        for (int i = 0; i < 5; i++) {
+            method1();
+            method2();
+            method3();
+        }
+
+        ByteArrayOutputStream out = new ByteArrayOutputStream();
+        AsyncProfiler.getInstance().dumpCollapsed(Counter.SAMPLES, out);
+        System.out.println(out.toString("UTF-8"));
+    }
+}
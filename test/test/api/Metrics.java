@@ -0,0 +1,35 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package test.api;
+
+import one.profiler.AsyncProfiler;
+
+import javax.management.MBeanServer;
+import javax.management.ObjectName;
+import java.lang.management.ManagementFactory;
+
+public class Metrics extends BusyLoops {
+
+    public static void main(String[] args) throws Exception {
+        MBeanServer server = ManagementFactory.getPlatformMBeanServer();
+        ObjectName name = new ObjectName("one.profiler:type=AsyncProfiler");
+        server.registerMBean(AsyncProfiler.getInstance(), name);
+
+        AsyncProfiler.getInstance().execute("start,event=cpu,interval=1ms,features=stats");
+        for (int i = 0; i < 5; i++) {
+            method1();
+            method2();
+            method3();
+        }
+        AsyncProfiler.getInstance().stop();
+
+        String[] attributes = {"Samples", "SkippedTicks", "FailedSamples", "CallTraceStorageBytes",
+                "UsedMemoryBytes", "NativeUnwindNanos", "JavaUnwindNanos", "StorageNanos", "JfrNanos"};
+        for (String attribute : attributes) {
+            System.out.println(attribute + " " + server.getAttribute(name, attribute));
+        }
+    }
+}
@@ -10,7 +10,7 @@ import java.util.Random;
 public class CpuBurner {
     private static final Random random = new Random();
 
-    static void burn() {
+    public static void burn() {
         long n = random.nextLong();
         if (Long.toString(n).hashCode() == 0) {
             System.out.println(n);
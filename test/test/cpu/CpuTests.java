@@ -8,6 +8,9 @@ package test.cpu;
 import java.io.File;
 import java.io.IOException;
 import java.lang.ProcessBuilder.Redirect;
+import java.nio.file.Files;
+import java.nio.file.Paths;
+import java.util.List;
 
 import one.profiler.test.Assert;
 import one.profiler.test.Os;
@@ -85,4 +88,15 @@ public class CpuTests {
             throw new IllegalStateException("Profiling should have failed");
         } catch (IOException expectedException) {}
     }
+
+    @Test(mainClass = CpuBurner.class, os = Os.LINUX)
+    public void perfMap(TestProcess p) throws Exception {
+        p.profile("-d 2 -e itimer --perfmap -o collapsed");
+
+        List<String> lines = Files.readAllLines(Paths.get("/tmp/perf-" + p.pid() + ".map"));
+        Assert.isGreater(lines.size(), 0);
+        assert lines.stream().allMatch(s -> s.matches("[0-9a-f]+ [0-9a-f]+ .+"));
+        assert lines.stream().anyMatch(s -> s.contains(" test/cpu/CpuBurner."));
+        assert lines.stream().anyMatch(s -> s.endsWith(" Interpreter"));
+    }
 }
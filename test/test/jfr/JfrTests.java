@@ -8,6 +8,7 @@ package test.jfr;
 import jdk.jfr.consumer.RecordedEvent;
 import jdk.jfr.consumer.RecordingFile;
 import one.profiler.test.Assert;
+import one.profiler.test.Os;
 import one.profiler.test.Output;
 import one.profiler.test.Test;
 import one.profiler.test.TestProcess;
@@ -55,6 +56,44 @@ public class JfrTests {
         assert parsedOut.contains("test.jfr.JfrCpuProfiling.method1()");
     }
 
+    @Test(mainClass = JfrCpuProfiling.class, os = Os.LINUX)
+    public void cpuAndNode(TestProcess p) throws Exception {
+        p.profile("-d 3 -e cpu -f %f.jfr");
+        int samplesWithCpu = 0;
+        try (RecordingFile recordingFile = new RecordingFile(p.getFile("%f").toPath())) {
+            while (recordingFile.hasMoreEvents()) {
+                RecordedEvent event = recordingFile.readEvent();
+                if (event.getEventType().getName().equals("jdk.ExecutionSample") && event.getInt("cpu") >= 0) {
+                    Assert.isGreaterOrEqual(event.getInt("numaNode"), 0);
+                    samplesWithCpu++;
+                }
+            }
+        }
+        Assert.isGreater(samplesWithCpu, 0);
+
+        Output out = Output.convertJfrToCollapsed(p.getFilePath("%f"), "--cpus");
+        assert out.contains("^\\[CPU \\d+\\];.*test/jfr/JfrCpuProfiling.method1");
+        out = Output.convertJfrToCollapsed(p.getFilePath("%f"), "--nodes");
+        assert out.contains("^\\[node \\d+\\];");
+    }
+
+    @Test(mainClass = JfrCpuProfiling.class)
+    public void threadCpuLoad(TestProcess p) throws Exception {
+        p.profile("-d 3 -e cpu --jfropts threadcpu -f %f.jfr");
+        float mainLoad = 0;
+        try (RecordingFile recordingFile = new RecordingFile(p.getFile("%f").toPath())) {
+            while (recordingFile.hasMoreEvents()) {
+                RecordedEvent event = recordingFile.readEvent();
+                if (event.getEventType().getName().equals("jdk.ThreadCPULoad")
+                        && "main".equals(event.getThread("eventThread").getJavaName())) {
+                    mainLoad = Math.max(mainLoad, event.getFloat("user") + event.getFloat("system"));
+                }
+            }
+        }
+        // The main thread keeps one CPU busy
+        Assert.isGreater(mainLoad, 0.5f / Runtime.getRuntime().availableProcessors());
+    }
+
     /**
      * Test to validate JDK APIs to parse Multimode profiling JFR output
      *
@@ -5,6 +5,7 @@
 
 package test.nonjava;
 
+import one.profiler.test.Os;
 import one.profiler.test.Output;
 import one.profiler.test.Test;
 import one.profiler.test.TestProcess;
@@ -53,4 +54,25 @@ public class NonjavaTests {
         Output out = p.readFile("%s");
         assert out.contains(".cpuHeavyTask");
     }
+
+    // Symbols are loaded at the end, but frames sampled before are named all the same
+    @Test(sh = "LD_PRELOAD=%lib ASPROF_COMMAND=start,event=itimer,lazysyms,collapsed,file=%f %testbin/cpu_burner", os = Os.LINUX)
+    public void lazySymbols(TestProcess p) throws Exception {
+        p.waitForExit();
+        assert p.exitCode() == 0;
+
+        Output out = p.readFile("%f");
+        assert out.contains(";burnStatic ");
+        assert !out.contains(";0x");
+    }
+
+    @Test(sh = "LD_PRELOAD=%lib ASPROF_COMMAND=start,event=itimer,lazysyms,file=%f.jfr %testbin/cpu_burner", os = Os.LINUX)
+    public void lazySymbolsJfr(TestProcess p) throws Exception {
+        p.waitForExit();
+        assert p.exitCode() == 0;
+
+        Output out = Output.convertJfrToCollapsed(p.getFilePath("%f"));
+        assert out.contains(";burnStatic ");
+        assert !out.contains(";0x");
+    }
 }
@@ -0,0 +1,28 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+static volatile unsigned long sink;
+
+// Static functions are named only in .symtab, not in dynamic symbols
+static __attribute__((noinline)) void burnStatic(void) {
+    for (int i = 0; i < 100000; i++) {
+        sink = sink * 31 + i;
+    }
+}
+
+int main(void) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        burnStatic();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < 1000);
+
+    printf("%lu\n", sink);
+    return 0;
+}
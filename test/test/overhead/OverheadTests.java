@@ -0,0 +1,91 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package test.overhead;
+
+import java.util.logging.Level;
+import java.util.logging.Logger;
+
+import one.profiler.test.Assert;
+import one.profiler.test.Os;
+import one.profiler.test.Output;
+import one.profiler.test.Test;
+import one.profiler.test.TestProcess;
+
+// Overhead regression tests. They take a while and depend on machine load,
+// so the Runner includes them only on request: make test-overhead or TESTS=overhead.
+// Limits can be tuned with -DmaxOverhead=<percent> and -DmaxRssMb=<megabytes>.
+public class OverheadTests {
+    private static final Logger log = Logger.getLogger(OverheadTests.class.getName());
+
+    // Fixed pre-touched heap, so that RSS growth comes from the profiler only
+    private static final String JVM_ARGS = "-Djava.library.path=build/lib -Xms256m -Xmx256m -XX:+AlwaysPreTouch";
+
+    private static final double MAX_OVERHEAD = Double.parseDouble(System.getProperty("maxOverhead", "10"));
+    private static final double MAX_RSS_MB = Double.parseDouble(System.getProperty("maxRssMb", "64"));
+
+    private static double value(Output out, String key) {
+        String prefix = key + "=";
+        return out.stream()
+                .filter(s -> s.startsWith(prefix))
+                .mapToDouble(s -> Double.parseDouble(s.substring(prefix.length())))
+                .findFirst()
+                .orElseThrow(() -> new AssertionError("No " + key + " in workload output"));
+    }
+
+    private static void check(TestProcess p) throws Exception {
+        Output out = p.waitForExit(TestProcess.STDOUT);
+        Assert.isEqual(p.exitCode(), 0);
+
+        double baselineOps = value(out, "baseline_ops");
+        double profiledOps = value(out, "profiled_ops");
+        double degradation = (1 - profiledOps / baselineOps) * 100;
+        double agentCpu = (value(out, "profiled_cpu") - value(out, "baseline_cpu")) * 100;
+        double rssMb = value(out, "rss_kb") / 1024;
+
+        log.log(Level.INFO, String.format("%s: throughput %.0f -> %.0f ops/s (%+.2f%%), agent CPU %+.2f%%, RSS %+.1f MB",
+                p.test().args(), baselineOps, profiledOps, -degradation, agentCpu, rssMb));
+
+        Assert.isLessOrEqual(degradation, MAX_OVERHEAD, "Throughput degradation exceeds the limit");
+        Assert.isLessOrEqual(rssMb, MAX_RSS_MB, "Profiler memory footprint exceeds the limit");
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "cpu start,event=cpu")
+    public void cpu(TestProcess p) throws Exception {
+        check(p);
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "cpu start,event=itimer")
+    public void itimer(TestProcess p) throws Exception {
+        check(p);
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "cpu start,event=wall")
+    public void wall(TestProcess p) throws Exception {
+        check(p);
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "cpu start,event=cpu,cstack=fp", nameSuffix = "fp")
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "cpu start,event=cpu,cstack=vm", nameSuffix = "vm")
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "cpu start,event=cpu,cstack=dwarf", nameSuffix = "dwarf", os = Os.LINUX)
+    public void cstack(TestProcess p) throws Exception {
+        check(p);
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "alloc start,event=alloc")
+    public void alloc(TestProcess p) throws Exception {
+        check(p);
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "alloc start,event=lock")
+    public void lock(TestProcess p) throws Exception {
+        check(p);
+    }
+
+    @Test(mainClass = OverheadWorkload.class, jvmArgs = JVM_ARGS, output = true, args = "alloc start,nativemem", os = Os.LINUX)
+    public void nativemem(TestProcess p) throws Exception {
+        check(p);
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package test.overhead;
+
+import one.profiler.AsyncProfiler;
+import test.alloc.MapReader;
+import test.cpu.CpuBurner;
+
+import java.io.IOException;
+import java.lang.management.ManagementFactory;
+import java.nio.file.Files;
+import java.nio.file.Paths;
+import java.util.List;
+
+// Runs a workload in alternating phases with and without the profiler in the same JVM,
+// so that JIT state and machine load affect both sides equally.
+// Usage: OverheadWorkload <cpu|alloc> <profiler start command>
+public class OverheadWorkload {
+    private static final long PHASE_NANOS = 1_000_000_000L;
+    private static final int ROUNDS = 5;
+
+    private static final com.sun.management.OperatingSystemMXBean os =
+            (com.sun.management.OperatingSystemMXBean) ManagementFactory.getOperatingSystemMXBean();
+
+    private final MapReader mapReader;
+
+    private OverheadWorkload(String workload) throws IOException {
+        if (workload.equals("alloc")) {
+            mapReader = new MapReader(50000);
+        } else if (workload.equals("cpu")) {
+            mapReader = null;
+        } else {
+            throw new IllegalArgumentException("Unknown workload: " + workload);
+        }
+    }
+
+    private void work() throws IOException {
+        if (mapReader != null) {
+            mapReader.read();
+        } else {
+            for (int i = 0; i < 1000; i++) {
+                CpuBurner.burn();
+            }
+        }
+    }
+
+    private void phase(Stats stats) throws IOException {
+        long cpuStart = os.getProcessCpuTime();
+        long start = System.nanoTime();
+        long end = start + PHASE_NANOS;
+        long count = 0;
+
+        long now;
+        do {
+            work();
+            count++;
+        } while ((now = System.nanoTime()) < end);
+
+        if (stats != null) {
+            stats.ops += count;
+            stats.nanos += now - start;
+            stats.cpuNanos += os.getProcessCpuTime() - cpuStart;
+        }
+    }
+
+    static class Stats {
+        long ops;
+        long nanos;
+        long cpuNanos;
+
+        double opsPerSecond() {
+            return ops * 1e9 / nanos;
+        }
+
+        double cpuLoad() {
+            return (double) cpuNanos / nanos;
+        }
+    }
+
+    // Resident set size in KB, 0 if not available on this OS
+    private static long rss() throws IOException {
+        if (!Files.exists(Paths.get("/proc/self/status"))) {
+            return 0;
+        }
+        List<String> lines = Files.readAllLines(Paths.get("/proc/self/status"));
+        for (String line : lines) {
+            if (line.startsWith("VmRSS:")) {
+                return Long.parseLong(line.substring(6).trim().split("\\s+")[0]);
+            }
+        }
+        return 0;
+    }
+
+    public static void main(String[] args) throws Exception {
+        OverheadWorkload workload = new OverheadWorkload(args[0]);
+        AsyncProfiler profiler = AsyncProfiler.getInstance();
+        Stats baseline = new Stats();
+        Stats profiled = new Stats();
+
+        // Warm up both the workload and the profiler: the first start parses all libraries
+        workload.phase(null);
+        profiler.execute(args[1]);
+        workload.phase(null);
+        profiler.execute("stop");
+        long rssBefore = rss();
+
+        for (int i = 0; i < ROUNDS; i++) {
+            workload.phase(baseline);
+            profiler.execute(args[1]);
+            workload.phase(profiled);
+            profiler.execute("stop");
+        }
+        long rssAfter = rss();
+
+        System.out.println("baseline_ops=" + baseline.opsPerSecond());
+        System.out.println("profiled_ops=" + profiled.opsPerSecond());
+        System.out.println("baseline_cpu=" + baseline.cpuLoad());
+        System.out.println("profiled_cpu=" + profiled.cpuLoad());
+        System.out.println("rss_kb=" + (rssAfter - rssBefore));
+    }
+}
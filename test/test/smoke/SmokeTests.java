@@ -33,6 +33,14 @@ public class SmokeTests {
         assert out.contains("\\[RenamedThread tid=[0-9]+];.*Threads.methodForRenamedThread;.*");
     }
 
+    @Test(mainClass = Cpu.class)
+    public void multipleOutputs(TestProcess p) throws Exception {
+        p.profile("-d 3 -e cpu -f %f.collapsed+%html.html+%txt.txt");
+        assert p.readFile("%f").contains("test/smoke/Cpu.main;test/smoke/Cpu.method1");
+        assert p.readFile("%html").contains("<!DOCTYPE html>");
+        assert p.readFile("%txt").contains("--- Execution profile ---");
+    }
+
     @Test(mainClass = LoadLibrary.class)
     public void loadLibrary(TestProcess p) throws Exception {
         p.profile("-f %f -o collapsed -d 4 -i 1ms");
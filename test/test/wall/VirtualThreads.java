@@ -0,0 +1,40 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package test.wall;
+
+import java.lang.reflect.Method;
+import java.util.concurrent.locks.LockSupport;
+
+// Many parked virtual threads and a few busy ones.
+// Virtual threads are started through reflection, since tests are compiled for Java 8.
+public class VirtualThreads {
+    private static volatile long sink;
+
+    static void park() {
+        while (true) {
+            LockSupport.park();
+        }
+    }
+
+    static void burn() {
+        while (true) {
+            sink += System.nanoTime() % 7;
+        }
+    }
+
+    public static void main(String[] args) throws Exception {
+        Method startVirtualThread = Thread.class.getMethod("startVirtualThread", Runnable.class);
+
+        for (int i = 0; i < 1000; i++) {
+            startVirtualThread.invoke(null, (Runnable) VirtualThreads::park);
+        }
+        for (int i = 0; i < 2; i++) {
+            startVirtualThread.invoke(null, (Runnable) VirtualThreads::burn);
+        }
+
+        Thread.sleep(Long.MAX_VALUE);
+    }
+}
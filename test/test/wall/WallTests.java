@@ -26,4 +26,11 @@ public class WallTests {
         assert s1 > 10 && s2 > 10 && s3 > 10;
         assert Math.abs(s1 - s2) < 5 && Math.abs(s2 - s3) < 5 && Math.abs(s3 - s1) < 5;
     }
+
+    @Test(mainClass = VirtualThreads.class, jvmVer = {21, Integer.MAX_VALUE})
+    public void virtualThreads(TestProcess p) throws Exception {
+        Output out = p.profile("-e wall -t --vthreads 100ms -d 3 -o collapsed");
+        Assert.isGreater(out.samples("\\[vthread #\\d+\\];.*test/wall/VirtualThreads.burn"), 0);
+        Assert.isGreater(out.samples("\\[vthread #\\d+\\];.*test/wall/VirtualThreads.park"), 0);
+    }
 }